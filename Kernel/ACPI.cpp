@@ -0,0 +1,115 @@
+/**
+ * @file ACPI.cpp
+ * @author Siddharth Mishra (brightprogrammer)
+ * @date 10/18/26
+ * @brief Finding ACPI tables through root pointer given by bootloader.
+ * @copyright MIT License 2022 Siddharth Mishra
+ * */
+
+#include "ACPI.hpp"
+#include "MemoryManager.hpp"
+#include "Printf.hpp"
+#include "String.hpp"
+
+struct ACPIRootPointer {
+    char signature[8];
+    u8 checksum;
+    char oem_id[6];
+    u8 revision;
+    u32 rsdt_address;
+    // rest is only valid from revision 2
+    u32 length;
+    u64 xsdt_address;
+    u8 extended_checksum;
+    u8 reserved[3];
+} __attribute__((packed));
+
+// first 20 bytes are covered by checksum of ACPI 1.0
+#define ACPI_RSDP_V1_SIZE 20
+
+// root table, nullptr if there's no ACPI
+static ACPITableHeader* root_table = nullptr;
+// entries of root table are 8 bytes in XSDT and 4 in RSDT
+static u64 root_entry_size = 0;
+
+static bool ValidChecksum(const void* data, u64 size){
+    const u8* p = reinterpret_cast<const u8*>(data);
+    u8 sum = 0;
+    for(u64 i = 0; i < size; i++) sum += p[i];
+    return sum == 0;
+}
+
+// tables may live in memory that isn't in memory map at all,
+// so make sure every page they touch is in direct map
+static u64 MapACPIMemory(u64 paddr, u64 size){
+    u64 start = paddr & ~(PAGE_SIZE - 1);
+    u64 end = (paddr + size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    for(u64 p = start; p < end; p += PAGE_SIZE){
+        MapMemory(PhysicalToVirtualAddress(p), p, MAP_PRESENT | MAP_READ_WRITE);
+    }
+    return PhysicalToVirtualAddress(paddr);
+}
+
+// map a table whose size is known only after reading it's header
+static ACPITableHeader* MapACPITable(u64 paddr){
+    ACPITableHeader* header = reinterpret_cast<ACPITableHeader*>(MapACPIMemory(paddr, sizeof(ACPITableHeader)));
+    MapACPIMemory(paddr, header->length);
+    return header;
+}
+
+void InitializeACPI(stivale2_struct* sysinfo_struct){
+    stivale2_struct_tag_rsdp* tag = (stivale2_struct_tag_rsdp*)stivale2_get_tag(sysinfo_struct, STIVALE2_STRUCT_TAG_RSDP_ID);
+    if(tag == nullptr) return;
+
+    u64 rsdp_addr = tag->rsdp;
+    if(rsdp_addr >= MEM_PHYS_OFFSET){
+        rsdp_addr = VirtualToPhysicalAddress(rsdp_addr);
+    }
+    ACPIRootPointer* rsdp = reinterpret_cast<ACPIRootPointer*>(MapACPIMemory(rsdp_addr, sizeof(ACPIRootPointer)));
+    if(memcmp(rsdp->signature, "RSD PTR ", 8) != 0 || !ValidChecksum(rsdp, ACPI_RSDP_V1_SIZE)){
+        ColorPrintf(COLOR_RED, COLOR_BLACK, "[-] Invalid ACPI root pointer\n");
+        return;
+    }
+
+    ACPITableHeader* root;
+    if(rsdp->revision >= 2 && rsdp->xsdt_address && ValidChecksum(rsdp, rsdp->length)){
+        root = MapACPITable(rsdp->xsdt_address);
+        root_entry_size = 8;
+    }else{
+        root = MapACPITable(rsdp->rsdt_address);
+        root_entry_size = 4;
+    }
+
+    if(!ValidChecksum(root, root->length)){
+        ColorPrintf(COLOR_RED, COLOR_BLACK, "[-] Invalid ACPI root table\n");
+        return;
+    }
+    root_table = root;
+
+    char signature[5];
+    memcpy(signature, root->signature, 4);
+    signature[4] = 0;
+    Printf("\tACPI : revision %u | %s with %lu tables\n", u32(rsdp->revision), signature,
+           (root->length - sizeof(ACPITableHeader)) / root_entry_size);
+}
+
+ACPITableHeader* FindACPITable(const char* signature, u64 index){
+    if(root_table == nullptr) return nullptr;
+
+    u8* entries = reinterpret_cast<u8*>(root_table) + sizeof(ACPITableHeader);
+    u64 count = (root_table->length - sizeof(ACPITableHeader)) / root_entry_size;
+    for(u64 i = 0; i < count; i++){
+        // entries are not naturally aligned in XSDT
+        u64 paddr = 0;
+        memcpy(&paddr, entries + i * root_entry_size, root_entry_size);
+        if(paddr == 0) continue;
+
+        ACPITableHeader* table = reinterpret_cast<ACPITableHeader*>(MapACPIMemory(paddr, sizeof(ACPITableHeader)));
+        if(memcmp(table->signature, signature, 4) != 0) continue;
+        if(index--) continue;
+
+        table = MapACPITable(paddr);
+        return ValidChecksum(table, table->length) ? table : nullptr;
+    }
+    return nullptr;
+}
@@ -0,0 +1,47 @@
+/**
+ * @file ACPI.hpp
+ * @author Siddharth Mishra (brightprogrammer)
+ * @date 10/18/26
+ * @brief Finding ACPI tables through root pointer given by bootloader.
+ * @copyright MIT License 2022 Siddharth Mishra
+ * */
+
+#ifndef ACPI_HPP
+#define ACPI_HPP
+
+#include "Common.hpp"
+#include "stivale2.hpp"
+
+/**
+ * @brief Header common to all ACPI system description tables.
+ * */
+struct ACPITableHeader {
+    char signature[4];
+    u32 length;
+    u8 revision;
+    u8 checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    u32 oem_revision;
+    u32 creator_id;
+    u32 creator_revision;
+} __attribute__((packed));
+
+/**
+ * @brief Find root table (XSDT, or RSDT on ACPI 1.0) through RSDP tag.
+ * Must be called after memory manager is initialized. Nothing is found
+ * if bootloader gave no RSDP.
+ * */
+void InitializeACPI(stivale2_struct* sysinfo_struct);
+
+/**
+ * @brief Find a table by it's signature.
+ *
+ * @param signature 4 character signature, eg: "MCFG".
+ * @param index Which one of tables with same signature to get.
+ * @return Direct map address of table, or nullptr if there is no
+ * such table or it's checksum is wrong.
+ * */
+ACPITableHeader* FindACPITable(const char* signature, u64 index = 0);
+
+#endif // ACPI_HPP
@@ -0,0 +1,115 @@
+/**
+ * @file APIC.cpp
+ * @author Siddharth Mishra (brightprogrammer)
+ * @date 10/18/26
+ * @brief Local APIC driver. Provides per-cpu timer interrupts,
+ * inter processor interrupts and end of interrupt signalling.
+ * @copyright MIT License 2022 Siddharth Mishra
+ * */
+
+#include "APIC.hpp"
+#include "CPU.hpp"
+#include "MemoryManager.hpp"
+#include "Printf.hpp"
+#include "Timer.hpp"
+
+// local apic register offsets
+#define LAPIC_ID 0x20
+#define LAPIC_TPR 0x80
+#define LAPIC_EOI 0xb0
+#define LAPIC_SVR 0xf0
+#define LAPIC_ICR_LOW 0x300
+#define LAPIC_ICR_HIGH 0x310
+#define LAPIC_LVT_TIMER 0x320
+#define LAPIC_TIMER_INITIAL_COUNT 0x380
+#define LAPIC_TIMER_CURRENT_COUNT 0x390
+#define LAPIC_TIMER_DIVIDE 0x3e0
+
+// bits in registers
+#define LAPIC_SVR_ENABLE (1 << 8)
+#define LAPIC_ICR_DELIVERY_PENDING (1 << 12)
+#define LAPIC_LVT_MASKED (1 << 16)
+#define LAPIC_TIMER_PERIODIC (1 << 17)
+// divide timer input clock by 16
+#define LAPIC_TIMER_DIVIDE_BY_16 0x3
+
+// virtual address of local apic registers
+// every cpu sees it's own local apic at same address
+static volatile u8* lapic = nullptr;
+// timer ticks per APIC_TIMER_FREQUENCY'th of a second
+static u32 lapic_timer_count = 0;
+
+static inline u32 ReadLAPIC(u32 reg){
+    return *reinterpret_cast<volatile u32*>(lapic + reg);
+}
+
+static inline void WriteLAPIC(u32 reg, u32 value){
+    *reinterpret_cast<volatile u32*>(lapic + reg) = value;
+}
+
+// measure local apic timer frequency against tsc
+static void CalibrateAPICTimer(){
+    WriteLAPIC(LAPIC_TIMER_DIVIDE, LAPIC_TIMER_DIVIDE_BY_16);
+    WriteLAPIC(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED);
+    WriteLAPIC(LAPIC_TIMER_INITIAL_COUNT, 0xffffffff);
+
+    // wait for 10 ms
+    SpinDelay(10000);
+
+    u32 elapsed = 0xffffffff - ReadLAPIC(LAPIC_TIMER_CURRENT_COUNT);
+    WriteLAPIC(LAPIC_TIMER_INITIAL_COUNT, 0);
+
+    // elapsed is ticks per 10ms
+    lapic_timer_count = (elapsed * 100) / APIC_TIMER_FREQUENCY;
+    Printf("\tAPIC Timer : %u ticks per interrupt\n", lapic_timer_count);
+}
+
+void InitializeAPIC(){
+    u64 lapic_paddr = ReadMSR(MSR_APIC_BASE) & ~u64(0xfff);
+    lapic = reinterpret_cast<volatile u8*>(MapMMIO(lapic_paddr, PAGE_SIZE));
+
+    EnableLocalAPIC();
+    CalibrateAPICTimer();
+}
+
+void EnableLocalAPIC(){
+    // make sure apic is globally enabled
+    WriteMSR(MSR_APIC_BASE, ReadMSR(MSR_APIC_BASE) | (1 << 11));
+    // accept all interrupts
+    WriteLAPIC(LAPIC_TPR, 0);
+    // software enable and set spurious vector
+    WriteLAPIC(LAPIC_SVR, LAPIC_SVR_ENABLE | APIC_SPURIOUS_VECTOR);
+}
+
+void StartAPICTimer(){
+    WriteLAPIC(LAPIC_TIMER_DIVIDE, LAPIC_TIMER_DIVIDE_BY_16);
+    WriteLAPIC(LAPIC_LVT_TIMER, LAPIC_TIMER_PERIODIC | APIC_TIMER_VECTOR);
+    WriteLAPIC(LAPIC_TIMER_INITIAL_COUNT, lapic_timer_count);
+}
+
+u32 GetLocalAPICID(){
+    return ReadLAPIC(LAPIC_ID) >> 24;
+}
+
+__attribute__((no_caller_saved_registers)) void SendEndOfInterrupt(){
+    WriteLAPIC(LAPIC_EOI, 0);
+}
+
+void SendIPI(u32 lapic_id, u8 vector){
+    u64 flags = SaveFlagsAndDisableInterrupts();
+
+    // wait for previous ipi to be delivered
+    while(ReadLAPIC(LAPIC_ICR_LOW) & LAPIC_ICR_DELIVERY_PENDING){
+        CPUPause();
+    }
+
+    // writing low dword sends the ipi (fixed delivery mode, physical destination)
+    WriteLAPIC(LAPIC_ICR_HIGH, lapic_id << 24);
+    WriteLAPIC(LAPIC_ICR_LOW, vector);
+
+    RestoreFlags(flags);
+}
+
+bool IsAPICInitialized(){
+    return lapic != nullptr;
+}
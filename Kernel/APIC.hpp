@@ -0,0 +1,64 @@
+/**
+ * @file APIC.hpp
+ * @author Siddharth Mishra (brightprogrammer)
+ * @date 10/18/26
+ * @brief Local APIC driver. Provides per-cpu timer interrupts,
+ * inter processor interrupts and end of interrupt signalling.
+ * @copyright MIT License 2022 Siddharth Mishra
+ * */
+
+#ifndef APIC_HPP
+#define APIC_HPP
+
+#include "Common.hpp"
+
+// interrupt vectors used by local apic
+#define APIC_TIMER_VECTOR 0x40
+#define APIC_RESCHEDULE_VECTOR 0x41
+#define APIC_TLB_SHOOTDOWN_VECTOR 0x42
+#define APIC_SPURIOUS_VECTOR 0xff
+
+// number of timer interrupts per second
+#define APIC_TIMER_FREQUENCY 1000
+
+/**
+ * @brief Map local apic registers, enable local apic of boot processor
+ * and calibrate it's timer. Must be called after memory manager and
+ * timer are initialized, and before application processors are started.
+ * */
+void InitializeAPIC();
+
+/**
+ * @brief Enable local apic of current cpu. Application processors call this.
+ * */
+void EnableLocalAPIC();
+
+/**
+ * @brief Start periodic timer of current cpu at APIC_TIMER_FREQUENCY.
+ * */
+void StartAPICTimer();
+
+/**
+ * @brief Get local apic id of current cpu.
+ * */
+u32 GetLocalAPICID();
+
+/**
+ * @brief Signal end of interrupt to local apic of current cpu.
+ * */
+__attribute__((no_caller_saved_registers)) void SendEndOfInterrupt();
+
+/**
+ * @brief Send an interrupt to another cpu.
+ *
+ * @param lapic_id Local apic id of target cpu.
+ * @param vector Interrupt vector to raise on target cpu.
+ * */
+void SendIPI(u32 lapic_id, u8 vector);
+
+/**
+ * @brief Check whether local apic has been initialized.
+ * */
+bool IsAPICInitialized();
+
+#endif // APIC_HPP
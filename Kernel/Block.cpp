@@ -0,0 +1,674 @@
+/**
+ * @file Block.cpp
+ * @author Siddharth Mishra (brightprogrammer)
+ * @date 10/18/26
+ * @brief Block devices and requests made to them.
+ * @copyright MIT License 2022 Siddharth Mishra
+ * */
+
+#include "Block.hpp"
+#include "Thread.hpp"
+#include "Scheduler.hpp"
+#include "MemoryManager.hpp"
+#include "Slab.hpp"
+#include "Spinlock.hpp"
+#include "SMP.hpp"
+#include "CPU.hpp"
+#include "Timer.hpp"
+#include "Printf.hpp"
+#include "String.hpp"
+
+#include <new>
+
+// put in waiter of a request once it's complete, no thread has this address
+#define BLOCK_WAITER_DONE reinterpret_cast<Thread*>(1)
+// how long a request waits in request queue before it's dispatched out of order
+#define BLOCK_READ_DEADLINE_NS (u64(100) * 1000000)
+#define BLOCK_WRITE_DEADLINE_NS (u64(1000) * 1000000)
+
+struct BlockRequestQueue {
+    TicketLock<> lock;
+    BlockDevice* device;
+    // waiting requests sorted by sector, linked through next
+    BlockRequest* sorted;
+    // sector after last dispatched command, sweep continues from here
+    u64 position;
+    // commands given to driver and not completed yet
+    u32 in_flight;
+    bool merging;
+    Thread* dispatcher;
+    bool dispatcher_sleeping;
+    BlockQueueStatistics stats;
+
+    BlockRequestQueue() : lock("block.queue") {}
+};
+
+static BlockDevice* block_devices[MAX_BLOCK_DEVICES];
+static u64 block_device_count = 0;
+static TicketLock<> block_device_lock("block.devices");
+static SlabCache block_queue_cache("block.queue", sizeof(BlockRequestQueue));
+
+static void BlockQueueThread(void* arg);
+
+bool RegisterBlockDevice(BlockDevice* device){
+    if(device->max_segments == 0) device->max_segments = 1;
+    BlockRequestQueue* queue = new (SlabAllocate(&block_queue_cache)) BlockRequestQueue();
+    queue->device = device;
+    queue->sorted = nullptr;
+    queue->position = 0;
+    queue->in_flight = 0;
+    queue->merging = true;
+    queue->dispatcher = nullptr;
+    queue->dispatcher_sleeping = false;
+    memset(&queue->stats, 0, sizeof(BlockQueueStatistics));
+    device->request_queue = queue;
+
+    {
+        LockGuard guard(block_device_lock);
+        if(block_device_count == MAX_BLOCK_DEVICES){
+            device->request_queue = nullptr;
+            SlabFree(&block_queue_cache, queue);
+            return false;
+        }
+
+        block_devices[block_device_count++] = device;
+        Printf("\tBlock : %s | %lu MB | %lu queues%s\n", device->name,
+               device->sector_count * BLOCK_SECTOR_SIZE / MB, u64(device->queue_count),
+               device->polling_only ? " | polled" : "");
+    }
+    SpawnThread(device->name, BlockQueueThread, queue);
+    return true;
+}
+
+u64 GetBlockDeviceCount(){
+    return block_device_count;
+}
+
+BlockDevice* GetBlockDevice(u64 index){
+    return index < block_device_count ? block_devices[index] : nullptr;
+}
+
+BlockDevice* FindBlockDevice(const char* name){
+    for(u64 i = 0; i < block_device_count; i++){
+        if(strcmp(block_devices[i]->name, name) == 0) return block_devices[i];
+    }
+    return nullptr;
+}
+
+void SetBlockDevicePolling(BlockDevice* device, bool polling){
+    if(device->polling_only) polling = true;
+    device->polling = polling;
+    if(device->ops.set_polling){
+        device->ops.set_polling(device, polling);
+    }
+}
+
+void InitializeBlockRequest(BlockRequest* request, u32 op, u64 sector, u64 buffer, u64 size){
+    request->op = op;
+    request->status = BLOCK_STATUS_PENDING;
+    request->sector = sector;
+    request->buffer = buffer;
+    request->size = size;
+    request->queue = 0;
+    request->driver_tag = 0;
+    request->waiter = nullptr;
+    request->complete = nullptr;
+    request->private_data = nullptr;
+    request->next = nullptr;
+    request->merged = nullptr;
+    request->total_size = size;
+    request->request_queue = nullptr;
+    request->deadline = 0;
+}
+
+// reject what device can never do before driver sees it
+static bool IsValidBlockRequest(BlockDevice* device, BlockRequest* request){
+    bool ok = request->size % BLOCK_SECTOR_SIZE == 0;
+    if(request->op != BLOCK_OP_FLUSH){
+        ok = ok && request->size && request->sector + request->size / BLOCK_SECTOR_SIZE <= device->sector_count;
+        ok = ok && request->size <= device->max_transfer;
+    }
+    if(request->op == BLOCK_OP_WRITE && device->read_only) ok = false;
+    return ok;
+}
+
+void SubmitBlockRequests(BlockDevice* device, BlockRequest* requests){
+    BlockRequest* valid = nullptr;
+    BlockRequest** tail = &valid;
+    while(requests){
+        BlockRequest* request = requests;
+        requests = requests->next;
+        request->next = nullptr;
+        request->merged = nullptr;
+        request->total_size = request->size;
+        request->request_queue = nullptr;
+
+        if(!IsValidBlockRequest(device, request)){
+            CompleteBlockRequest(request, BLOCK_STATUS_ERROR);
+            continue;
+        }
+        *tail = request;
+        tail = &request->next;
+    }
+
+    if(valid && !device->ops.submit(device, valid)){
+        while(valid){
+            BlockRequest* request = valid;
+            valid = valid->next;
+            CompleteBlockRequest(request, BLOCK_STATUS_ERROR);
+        }
+    }
+}
+
+/******************** Request Queue ********************/
+
+// pick request to dispatch next, returns link to it in sorted list, caller holds lock
+static BlockRequest** FindNextBlockRequest(BlockRequestQueue* queue, u64 now){
+    BlockRequest** expired = nullptr;
+    BlockRequest** above = nullptr;
+    for(BlockRequest** link = &queue->sorted; *link; link = &(*link)->next){
+        BlockRequest* request = *link;
+        if(request->deadline <= now && (expired == nullptr || request->deadline < (*expired)->deadline)){
+            expired = link;
+        }
+        if(above == nullptr && request->sector >= queue->position) above = link;
+    }
+
+    if(expired){
+        if(expired != above) queue->stats.expired++;
+        return expired;
+    }
+    // sweep starts over from lowest sector once it passes last request
+    return above ? above : &queue->sorted;
+}
+
+// merge requests that follow head on disk behind it, link points to what
+// came after head in sorted list, caller holds lock
+static void MergeBlockRequests(BlockRequestQueue* queue, BlockRequest* head, BlockRequest** link){
+    BlockDevice* device = queue->device;
+    BlockRequest* last = head;
+    u32 segments = 1;
+    while(*link && segments < device->max_segments){
+        BlockRequest* request = *link;
+        if(request->op != head->op) break;
+        if(request->sector != head->sector + head->total_size / BLOCK_SECTOR_SIZE) break;
+        if(head->total_size + request->size > device->max_transfer) break;
+        // drivers describe every buffer after first one from a page boundary
+        if((last->buffer + last->size) % PAGE_SIZE || request->buffer % PAGE_SIZE) break;
+
+        *link = request->next;
+        request->next = nullptr;
+        last->merged = request;
+        last = request;
+        head->total_size += request->size;
+        segments++;
+        queue->stats.merged++;
+    }
+}
+
+// take as many commands as there is room for, caller holds lock
+static BlockRequest* TakeBlockRequests(BlockRequestQueue* queue){
+    BlockRequest* batch = nullptr;
+    BlockRequest** tail = &batch;
+    u64 now = GetUptimeNanoseconds();
+    while(queue->sorted && queue->in_flight < BLOCK_QUEUE_DEPTH){
+        BlockRequest** link = FindNextBlockRequest(queue, now);
+        BlockRequest* request = *link;
+        *link = request->next;
+        request->next = nullptr;
+        if(queue->merging) MergeBlockRequests(queue, request, link);
+
+        queue->position = request->sector + request->total_size / BLOCK_SECTOR_SIZE;
+        queue->in_flight++;
+        queue->stats.dispatched++;
+        *tail = request;
+        tail = &request->next;
+    }
+    return batch;
+}
+
+// give waiting requests to driver, must not be called from interrupt context
+static void RunBlockQueue(BlockRequestQueue* queue){
+    BlockRequest* batch;
+    {
+        LockGuard guard(queue->lock);
+        batch = TakeBlockRequests(queue);
+    }
+
+    BlockDevice* device = queue->device;
+    if(batch && !device->ops.submit(device, batch)){
+        while(batch){
+            BlockRequest* request = batch;
+            batch = batch->next;
+            CompleteBlockRequest(request, BLOCK_STATUS_ERROR);
+        }
+    }
+}
+
+// a command of request queue completed, may run in interrupt context
+static void FinishBlockDispatch(BlockRequestQueue* queue){
+    Thread* wake = nullptr;
+    {
+        LockGuard guard(queue->lock);
+        queue->in_flight--;
+        if(queue->sorted && queue->dispatcher_sleeping){
+            queue->dispatcher_sleeping = false;
+            wake = queue->dispatcher;
+        }
+    }
+    if(wake) WakeThread(wake);
+}
+
+// fills slots freed by completions, which may happen in interrupt handlers
+static void BlockQueueThread(void* arg){
+    BlockRequestQueue* queue = reinterpret_cast<BlockRequestQueue*>(arg);
+    {
+        LockGuard guard(queue->lock);
+        queue->dispatcher = GetCurrentThread();
+    }
+
+    while(true){
+        u64 flags = SaveFlagsAndDisableInterrupts();
+        queue->lock.Lock();
+        bool sleep = queue->sorted == nullptr || queue->in_flight >= BLOCK_QUEUE_DEPTH;
+        if(sleep){
+            queue->dispatcher_sleeping = true;
+            __atomic_store_n(&GetCurrentThread()->state, ThreadState::Blocked, __ATOMIC_RELEASE);
+        }
+        queue->lock.Unlock();
+
+        // FinishBlockDispatch wakes us
+        if(sleep) Schedule();
+        RestoreFlags(flags);
+        if(!sleep) RunBlockQueue(queue);
+    }
+}
+
+void StartBlockPlug(BlockPlug* plug, BlockDevice* device){
+    plug->device = device;
+    plug->requests = nullptr;
+    plug->count = 0;
+}
+
+void QueueBlockRequest(BlockPlug* plug, BlockRequest* request){
+    BlockDevice* device = plug->device;
+    request->next = nullptr;
+    if(request->op == BLOCK_OP_FLUSH){
+        SubmitBlockRequests(device, request);
+        return;
+    }
+
+    request->merged = nullptr;
+    request->total_size = request->size;
+    request->request_queue = nullptr;
+    if(!IsValidBlockRequest(device, request)){
+        CompleteBlockRequest(request, BLOCK_STATUS_ERROR);
+        return;
+    }
+    request->queue = BLOCK_QUEUE_WAITING;
+    request->request_queue = device->request_queue;
+    request->deadline = GetUptimeNanoseconds() +
+                        (request->op == BLOCK_OP_READ ? BLOCK_READ_DEADLINE_NS : BLOCK_WRITE_DEADLINE_NS);
+
+    BlockRequest** link = &plug->requests;
+    while(*link && (*link)->sector <= request->sector) link = &(*link)->next;
+    request->next = *link;
+    *link = request;
+    if(++plug->count == BLOCK_PLUG_MAX_REQUESTS) FinishBlockPlug(plug);
+}
+
+void FinishBlockPlug(BlockPlug* plug){
+    if(plug->requests == nullptr) return;
+
+    BlockRequestQueue* queue = plug->device->request_queue;
+    {
+        LockGuard guard(queue->lock);
+        // both lists are sorted, so whole plug goes in with one pass
+        BlockRequest** link = &queue->sorted;
+        BlockRequest* request = plug->requests;
+        while(request){
+            BlockRequest* next = request->next;
+            while(*link && (*link)->sector <= request->sector) link = &(*link)->next;
+            request->next = *link;
+            *link = request;
+            link = &request->next;
+            request = next;
+        }
+        queue->stats.queued += plug->count;
+        queue->stats.unplugs++;
+    }
+    plug->requests = nullptr;
+    plug->count = 0;
+    RunBlockQueue(queue);
+}
+
+void QueueBlockRequests(BlockDevice* device, BlockRequest* requests){
+    BlockPlug plug;
+    StartBlockPlug(&plug, device);
+    while(requests){
+        BlockRequest* request = requests;
+        requests = requests->next;
+        QueueBlockRequest(&plug, request);
+    }
+    FinishBlockPlug(&plug);
+}
+
+void SetBlockQueueMerging(BlockDevice* device, bool merging){
+    LockGuard guard(device->request_queue->lock);
+    device->request_queue->merging = merging;
+}
+
+void GetBlockQueueStatistics(BlockDevice* device, BlockQueueStatistics* stats){
+    LockGuard guard(device->request_queue->lock);
+    memcpy(stats, &device->request_queue->stats, sizeof(BlockQueueStatistics));
+}
+
+/* ------------------ WAITING --------------------
+ *
+ * Completion and waiting race through waiter field of request. Completer
+ * writes status, then swaps BLOCK_WAITER_DONE into waiter and wakes
+ * whatever thread it found there. Waiter marks itself blocked, then tries
+ * to put itself in waiter. If that fails request is already done and it
+ * never sleeps, otherwise completer is guaranteed to see it and wake it.
+ * Interrupts stay disabled in between, so waiter can't be preempted
+ * while it's marked blocked but still running.
+ *
+ * */
+
+void CompleteBlockRequest(BlockRequest* request, u32 status){
+    BlockRequestQueue* queue = request->request_queue;
+    while(request){
+        BlockRequest* merged = request->merged;
+        __atomic_store_n(&request->status, status, __ATOMIC_RELEASE);
+        BlockCompleteFunction complete = request->complete;
+        Thread* waiter = __atomic_exchange_n(&request->waiter, BLOCK_WAITER_DONE, __ATOMIC_ACQ_REL);
+
+        // request may be freed by it's owner as soon as waiter runs, so nothing
+        // is read from it after this
+        if(complete) complete(request);
+        if(waiter && waiter != BLOCK_WAITER_DONE) WakeThread(waiter);
+        request = merged;
+    }
+    if(queue) FinishBlockDispatch(queue);
+}
+
+u64 PollBlockDevice(BlockDevice* device, u32 queue){
+    if(queue != BLOCK_QUEUE_WAITING) return device->ops.poll(device, queue);
+
+    // request went through request queue, it may be anywhere by now
+    u64 count = 0;
+    for(u32 i = 0; i < device->queue_count; i++){
+        count += device->ops.poll(device, i);
+    }
+    // fill slots freed here instead of waiting for dispatcher to be scheduled
+    if(device->request_queue) RunBlockQueue(device->request_queue);
+    return count;
+}
+
+u32 WaitForBlockRequest(BlockDevice* device, BlockRequest* request){
+    while(__atomic_load_n(&request->status, __ATOMIC_ACQUIRE) == BLOCK_STATUS_PENDING){
+        if(device->polling){
+            if(PollBlockDevice(device, request->queue) == 0) CPUPause();
+            continue;
+        }
+
+        Thread* self = GetCurrentThread();
+        u64 flags = SaveFlagsAndDisableInterrupts();
+        __atomic_store_n(&self->state, ThreadState::Blocked, __ATOMIC_RELEASE);
+        Thread* expected = nullptr;
+        if(__atomic_compare_exchange_n(&request->waiter, &expected, self, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)){
+            Schedule();
+        }else{
+            // already completed, nobody knows about us so nobody can wake us
+            __atomic_store_n(&self->state, ThreadState::Running, __ATOMIC_RELEASE);
+        }
+        RestoreFlags(flags);
+    }
+    return request->status;
+}
+
+static bool DoBlockRequest(BlockDevice* device, u32 op, u64 sector, u64 buffer, u64 size){
+    BlockRequest request;
+    InitializeBlockRequest(&request, op, sector, buffer, size);
+    SubmitBlockRequests(device, &request);
+    return WaitForBlockRequest(device, &request) == BLOCK_STATUS_OK;
+}
+
+bool ReadBlocks(BlockDevice* device, u64 sector, u64 buffer, u64 size){
+    return DoBlockRequest(device, BLOCK_OP_READ, sector, buffer, size);
+}
+
+bool WriteBlocks(BlockDevice* device, u64 sector, u64 buffer, u64 size){
+    return DoBlockRequest(device, BLOCK_OP_WRITE, sector, buffer, size);
+}
+
+/******************** Block Device Benchmark ********************/
+
+#define BENCH_BLOCK_SIZE 4096
+#define BENCH_BLOCK_SECTORS (BENCH_BLOCK_SIZE / BLOCK_SECTOR_SIZE)
+#define BENCH_BLOCK_REQUESTS 4096
+#define BENCH_BLOCK_MAX_DEPTH 32
+#define BENCH_BLOCK_THREAD_DEPTH 8
+
+struct BlockBenchmark {
+    BlockDevice* device;
+    bool random;
+    u32 depth;
+    u64 requests;
+    // seed of random offsets, also where sequential reads start
+    u64 seed;
+    u64 errors;
+    volatile bool done;
+};
+
+// read requests 4 KB blocks, depth of them at a time, returns nanoseconds taken
+static u64 RunBlockBenchmark(BlockBenchmark* bench){
+    BlockDevice* device = bench->device;
+    u64 blocks = device->sector_count / BENCH_BLOCK_SECTORS;
+    u64 buffer = AllocateKernelMemory(bench->depth * BENCH_BLOCK_SIZE / PAGE_SIZE);
+    BlockRequest requests[BENCH_BLOCK_MAX_DEPTH];
+
+    u64 next = bench->seed % blocks;
+    u64 random = bench->seed | 1;
+    u64 start = ReadTimestampCounter();
+    for(u64 done = 0; done < bench->requests; done += bench->depth){
+        BlockRequest* batch = nullptr;
+        for(u32 i = bench->depth; i-- > 0;){
+            u64 block;
+            if(bench->random){
+                random ^= random << 13;
+                random ^= random >> 7;
+                random ^= random << 17;
+                block = random % blocks;
+            }else{
+                block = next;
+                next = (next + 1) % blocks;
+            }
+            InitializeBlockRequest(&requests[i], BLOCK_OP_READ, block * BENCH_BLOCK_SECTORS,
+                                   buffer + i * BENCH_BLOCK_SIZE, BENCH_BLOCK_SIZE);
+            requests[i].next = batch;
+            batch = &requests[i];
+        }
+
+        SubmitBlockRequests(device, batch);
+        for(u32 i = 0; i < bench->depth; i++){
+            if(WaitForBlockRequest(device, &requests[i]) != BLOCK_STATUS_OK) bench->errors++;
+        }
+    }
+    u64 ns = CyclesToNanoseconds(ReadTimestampCounter() - start);
+
+    FreeKernelMemory(buffer, bench->depth * BENCH_BLOCK_SIZE / PAGE_SIZE);
+    return ns;
+}
+
+static void ShowBlockBenchmark(const char* mode, const char* pattern, u32 depth, u64 requests, u64 ns, u64 errors){
+    if(ns == 0) ns = 1;
+    Printf("\t%s | %s | depth %u : %lu IOPS | %lu MB/s%s\n", mode, pattern, depth,
+           requests * 1000000000 / ns, requests * BENCH_BLOCK_SIZE * 1000 / ns,
+           errors ? " | errors" : "");
+}
+
+static void BlockBenchmarkThread(void* arg){
+    BlockBenchmark* bench = reinterpret_cast<BlockBenchmark*>(arg);
+    RunBlockBenchmark(bench);
+    __atomic_store_n(&bench->done, true, __ATOMIC_RELEASE);
+}
+
+void BenchmarkBlockDevices(){
+    ColorPrintf(COLOR_YELLOW, COLOR_BLACK, "[+] Benchmark : Block Device 4 KB Reads\n");
+
+    BlockDevice* device = GetBlockDevice(0);
+    if(device == nullptr || device->sector_count < BENCH_BLOCK_SECTORS){
+        Printf("\tNo block devices\n");
+        return;
+    }
+    Printf("\tDevice : %s | %lu MB | %u queues\n", device->name,
+           device->sector_count * BLOCK_SECTOR_SIZE / MB, device->queue_count);
+
+    bool was_polling = device->polling;
+    static const u32 depths[] = {1, BENCH_BLOCK_MAX_DEPTH};
+    for(u32 mode = 0; mode < 2; mode++){
+        bool polling = mode == 1;
+        if(!polling && device->polling_only) continue;
+        SetBlockDevicePolling(device, polling);
+
+        for(u32 random = 0; random < 2; random++){
+            for(u32 d = 0; d < 2; d++){
+                BlockBenchmark bench;
+                bench.device = device;
+                bench.random = random;
+                bench.depth = depths[d];
+                bench.requests = BENCH_BLOCK_REQUESTS;
+                bench.seed = 0x2545f4914f6cdd1d;
+                bench.errors = 0;
+                bench.done = false;
+                u64 ns = RunBlockBenchmark(&bench);
+                ShowBlockBenchmark(polling ? "Polled" : "Interrupt", random ? "random" : "sequential",
+                                   bench.depth, bench.requests, ns, bench.errors);
+            }
+        }
+    }
+
+    // one thread per cpu, each landing on queue of cpu it runs on
+    SetBlockDevicePolling(device, false);
+    u32 threads = GetCPUCount();
+    if(threads > BENCH_BLOCK_MAX_DEPTH) threads = BENCH_BLOCK_MAX_DEPTH;
+    BlockBenchmark benches[BENCH_BLOCK_MAX_DEPTH];
+    u64 start = ReadTimestampCounter();
+    for(u32 i = 0; i < threads; i++){
+        benches[i].device = device;
+        benches[i].random = true;
+        benches[i].depth = BENCH_BLOCK_THREAD_DEPTH;
+        benches[i].requests = BENCH_BLOCK_REQUESTS / threads;
+        benches[i].seed = 0x9e3779b97f4a7c15 * (i + 1);
+        benches[i].errors = 0;
+        benches[i].done = false;
+        SpawnThread("block-bench", BlockBenchmarkThread, &benches[i]);
+    }
+    u64 errors = 0;
+    u64 total = 0;
+    for(u32 i = 0; i < threads; i++){
+        while(!__atomic_load_n(&benches[i].done, __ATOMIC_ACQUIRE)) Yield();
+        errors += benches[i].errors;
+        total += benches[i].requests;
+    }
+    u64 ns = CyclesToNanoseconds(ReadTimestampCounter() - start);
+    char mode[32];
+    sprintf(mode, "%s, %u threads", device->polling_only ? "Polled" : "Interrupt", threads);
+    ShowBlockBenchmark(mode, "random", BENCH_BLOCK_THREAD_DEPTH, total, ns, errors);
+
+    SetBlockDevicePolling(device, was_polling);
+}
+
+/******************** Request Queue Benchmark ********************/
+
+#define BENCH_QUEUE_WRITERS 4
+#define BENCH_QUEUE_WRITES 4096
+// writes of a writer in flight at once, also size of it's plugs
+#define BENCH_QUEUE_DEPTH 32
+// writers hit a small region, so waiting requests often end up next to each other
+#define BENCH_QUEUE_REGION_BLOCKS 256
+
+struct BlockQueueBenchmark {
+    BlockDevice* device;
+    u64 seed;
+    u64 errors;
+    volatile bool done;
+};
+
+static void BlockQueueWriterThread(void* arg){
+    BlockQueueBenchmark* bench = reinterpret_cast<BlockQueueBenchmark*>(arg);
+    u64 pages = BENCH_QUEUE_DEPTH * BENCH_BLOCK_SIZE / PAGE_SIZE;
+    u64 buffer = AllocateKernelMemory(pages);
+    memset(reinterpret_cast<void*>(buffer), 0x5a, BENCH_QUEUE_DEPTH * BENCH_BLOCK_SIZE);
+    BlockRequest requests[BENCH_QUEUE_DEPTH];
+
+    u64 random = bench->seed | 1;
+    for(u64 done = 0; done < BENCH_QUEUE_WRITES; done += BENCH_QUEUE_DEPTH){
+        BlockPlug plug;
+        StartBlockPlug(&plug, bench->device);
+        for(u32 i = 0; i < BENCH_QUEUE_DEPTH; i++){
+            random ^= random << 13;
+            random ^= random >> 7;
+            random ^= random << 17;
+            u64 block = random % BENCH_QUEUE_REGION_BLOCKS;
+            InitializeBlockRequest(&requests[i], BLOCK_OP_WRITE, block * BENCH_BLOCK_SECTORS,
+                                   buffer + i * BENCH_BLOCK_SIZE, BENCH_BLOCK_SIZE);
+            QueueBlockRequest(&plug, &requests[i]);
+        }
+        FinishBlockPlug(&plug);
+
+        for(u32 i = 0; i < BENCH_QUEUE_DEPTH; i++){
+            if(WaitForBlockRequest(bench->device, &requests[i]) != BLOCK_STATUS_OK) bench->errors++;
+        }
+    }
+
+    FreeKernelMemory(buffer, pages);
+    __atomic_store_n(&bench->done, true, __ATOMIC_RELEASE);
+}
+
+void BenchmarkBlockQueue(){
+    ColorPrintf(COLOR_YELLOW, COLOR_BLACK, "[+] Benchmark : Block Request Queue\n");
+
+    BlockDevice* device = FindBlockDevice("nvme0n1");
+    if(device == nullptr || device->read_only || device->sector_count < BENCH_QUEUE_REGION_BLOCKS * BENCH_BLOCK_SECTORS){
+        Printf("\tNo scratch disk\n");
+        return;
+    }
+
+    bool was_polling = device->polling;
+    SetBlockDevicePolling(device, false);
+    for(u32 merging = 0; merging < 2; merging++){
+        SetBlockQueueMerging(device, merging);
+        BlockQueueStatistics before, after;
+        GetBlockQueueStatistics(device, &before);
+
+        BlockQueueBenchmark benches[BENCH_QUEUE_WRITERS];
+        u64 start = ReadTimestampCounter();
+        for(u32 i = 0; i < BENCH_QUEUE_WRITERS; i++){
+            benches[i].device = device;
+            benches[i].seed = 0x9e3779b97f4a7c15 * (i + 1);
+            benches[i].errors = 0;
+            benches[i].done = false;
+            SpawnThread("queue-bench", BlockQueueWriterThread, &benches[i]);
+        }
+        u64 errors = 0;
+        for(u32 i = 0; i < BENCH_QUEUE_WRITERS; i++){
+            while(!__atomic_load_n(&benches[i].done, __ATOMIC_ACQUIRE)) Yield();
+            errors += benches[i].errors;
+        }
+        u64 ns = CyclesToNanoseconds(ReadTimestampCounter() - start);
+        GetBlockQueueStatistics(device, &after);
+
+        char mode[32];
+        sprintf(mode, "Merging %s, %u writers", merging ? "on" : "off", u32(BENCH_QUEUE_WRITERS));
+        u64 writes = u64(BENCH_QUEUE_WRITERS) * BENCH_QUEUE_WRITES;
+        ShowBlockBenchmark(mode, "random writes", BENCH_QUEUE_DEPTH, writes, ns, errors);
+        Printf("\t\t%lu commands for %lu writes | %lu merged | %lu past deadline\n",
+               after.dispatched - before.dispatched, writes,
+               after.merged - before.merged, after.expired - before.expired);
+    }
+
+    SetBlockQueueMerging(device, true);
+    SetBlockDevicePolling(device, was_polling);
+}
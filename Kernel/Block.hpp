@@ -0,0 +1,311 @@
+/**
+ * @file Block.hpp
+ * @author Siddharth Mishra (brightprogrammer)
+ * @date 10/18/26
+ * @brief Block devices and requests made to them.
+ * @copyright MIT License 2022 Siddharth Mishra
+ * */
+
+#ifndef BLOCK_HPP
+#define BLOCK_HPP
+
+#include "Common.hpp"
+
+struct Thread;
+
+/* ------------------ BLOCK DEVICES --------------------
+ *
+ * A block device is a driver that takes requests to read or write runs
+ * of 512 byte sectors to or from kernel buffers. Requests are submitted
+ * in batches, so driver can tell device about a whole batch at once, and
+ * complete asynchronously, from an interrupt handler or from whoever
+ * polls device.
+ *
+ * Drivers move data straight between device and caller's buffer, so
+ * buffer must stay mapped until request completes. It doesn't have to
+ * be physically contiguous.
+ *
+ * Whether a device interrupts or is polled can be switched at any time,
+ * waiters check it every time they wait.
+ *
+ * */
+
+/* ------------------ REQUEST QUEUE --------------------
+ *
+ * Requests submitted with SubmitBlockRequests go straight to driver, which
+ * is what a latency sensitive caller wants. Callers that issue many requests
+ * at once (writeback, read-ahead) queue them instead, through a plug : a
+ * plug collects requests of a caller sorted by sector, and unplugging it
+ * moves all of them into request queue of device at once.
+ *
+ * Request queue keeps waiting requests sorted by sector and gives them to
+ * driver as long as fewer than BLOCK_QUEUE_DEPTH are in flight. Next one
+ * dispatched is first one at or above where last dispatch ended, so disk
+ * is swept in one direction, unless a request has waited past it's deadline,
+ * which is then dispatched first. Requests that follow a dispatched one on
+ * disk and meet it's buffer at a page boundary are merged behind it (see
+ * merged in BlockRequest), so driver issues a single command for all of them.
+ *
+ * Completion is asynchronous, as with direct submission. Once a command
+ * completes every request merged in it completes, and a dispatcher thread
+ * of device fills freed slots from waiting requests.
+ *
+ * Flushes are never queued, caller must wait for writes it wants flushed.
+ *
+ * */
+
+// size of a sector, all sector numbers and counts are in these
+#define BLOCK_SECTOR_SIZE 512
+// max number of block devices
+#define MAX_BLOCK_DEVICES 16
+// longest device name, including null terminator
+#define BLOCK_DEVICE_NAME_SIZE 16
+
+// request operations
+#define BLOCK_OP_READ 0
+#define BLOCK_OP_WRITE 1
+// wait until everything written before reaches stable storage
+#define BLOCK_OP_FLUSH 2
+
+// request status
+#define BLOCK_STATUS_PENDING 0
+#define BLOCK_STATUS_OK 1
+#define BLOCK_STATUS_ERROR 2
+#define BLOCK_STATUS_UNSUPPORTED 3
+
+// queue of a request that is still in request queue, see BlockRequest
+#define BLOCK_QUEUE_WAITING 0xffffffff
+// max number of commands request queue keeps in flight
+#define BLOCK_QUEUE_DEPTH 32
+// a plug is unplugged once it has this many requests
+#define BLOCK_PLUG_MAX_REQUESTS 32
+
+struct BlockRequest;
+struct BlockRequestQueue;
+struct BlockDevice;
+
+/**
+ * @brief Called when a request completes, from interrupt context or
+ * from thread polling device.
+ * */
+typedef void (*BlockCompleteFunction)(BlockRequest* request);
+
+/**
+ * @brief A read, write or flush. Owned by whoever submits it.
+ * */
+struct BlockRequest {
+    // BLOCK_OP_*
+    u32 op;
+    // BLOCK_STATUS_*, written once when request completes
+    volatile u32 status;
+    // first sector
+    u64 sector;
+    // kernel virtual address of buffer
+    u64 buffer;
+    // size of buffer in bytes, a multiple of BLOCK_SECTOR_SIZE
+    u64 size;
+
+    // queue request was put in, set by driver,
+    // BLOCK_QUEUE_WAITING while it waits in request queue
+    u32 queue;
+    // owned by driver while request is in flight
+    u64 driver_tag;
+    // thread sleeping in WaitForBlockRequest, see Block.cpp
+    Thread* volatile waiter;
+    // may be nullptr
+    BlockCompleteFunction complete;
+    // owned by submitter, eg: for complete
+    void* private_data;
+
+    // next request in a batch
+    BlockRequest* next;
+
+    // requests merged behind this one by request queue, their sectors follow
+    // right after it's own and driver moves data of each to it's own buffer
+    BlockRequest* merged;
+    // bytes of this request and of every one merged behind it
+    u64 total_size;
+    // request queue request went through, nullptr if submitted directly
+    BlockRequestQueue* request_queue;
+    // uptime in nanoseconds by which request queue should dispatch it
+    u64 deadline;
+};
+
+/**
+ * @brief Requests a caller queues, held back until it unplugs.
+ * */
+struct BlockPlug {
+    BlockDevice* device;
+    // sorted by sector
+    BlockRequest* requests;
+    u32 count;
+};
+
+/**
+ * @brief Counters of a request queue.
+ * */
+struct BlockQueueStatistics {
+    // requests queued, flushes not included
+    u64 queued;
+    // commands given to driver, each may carry many requests
+    u64 dispatched;
+    // requests merged behind another one
+    u64 merged;
+    // commands dispatched out of order because their deadline passed
+    u64 expired;
+    u64 unplugs;
+};
+
+/**
+ * @brief Operations a block device driver provides.
+ * */
+struct BlockDeviceOps {
+    // submit a linked list of requests, returns false if none could be submitted
+    bool (*submit)(BlockDevice* device, BlockRequest* requests);
+    // complete whatever is done in given queue, returns number of requests completed
+    u64 (*poll)(BlockDevice* device, u32 queue);
+    // turn device interrupts on or off
+    void (*set_polling)(BlockDevice* device, bool polling);
+};
+
+struct BlockDevice {
+    char name[BLOCK_DEVICE_NAME_SIZE];
+    u64 sector_count;
+    // smallest unit device can write without read-modify-write
+    u64 block_size;
+    bool read_only;
+    // largest request in bytes device takes, for any buffer alignment
+    u64 max_transfer;
+    // most requests driver takes merged in one, 1 if driver can't take merged requests
+    u32 max_segments;
+    // number of hardware queues, usually one per cpu
+    u32 queue_count;
+    // true if waiters poll instead of sleeping until an interrupt
+    volatile bool polling;
+    // true if device can't interrupt at all
+    bool polling_only;
+    BlockDeviceOps ops;
+    void* driver_data;
+    // created by RegisterBlockDevice
+    BlockRequestQueue* request_queue;
+};
+
+/**
+ * @brief Make a device available to rest of kernel, and start it's
+ * request queue.
+ *
+ * @return false if there are too many devices.
+ * */
+bool RegisterBlockDevice(BlockDevice* device);
+
+/**
+ * @brief Get number of registered block devices.
+ * */
+u64 GetBlockDeviceCount();
+
+/**
+ * @brief Get device at given index, or nullptr if there is no such device.
+ * */
+BlockDevice* GetBlockDevice(u64 index);
+
+/**
+ * @brief Find device by it's name, eg: "vda".
+ * */
+BlockDevice* FindBlockDevice(const char* name);
+
+/**
+ * @brief Switch device between interrupt driven and polled completion.
+ * Devices that can't interrupt stay polled.
+ * */
+void SetBlockDevicePolling(BlockDevice* device, bool polling);
+
+/**
+ * @brief Fill in a request, ready to be submitted.
+ * */
+void InitializeBlockRequest(BlockRequest* request, u32 op, u64 sector, u64 buffer, u64 size);
+
+/**
+ * @brief Submit a linked list of requests, linked through next.
+ * Requests that can't be accepted complete with an error.
+ * */
+void SubmitBlockRequests(BlockDevice* device, BlockRequest* requests);
+
+/**
+ * @brief Start collecting requests to be queued on a device.
+ * */
+void StartBlockPlug(BlockPlug* plug, BlockDevice* device);
+
+/**
+ * @brief Add a request to a plug. Plug is unplugged on it's own if it's full.
+ * Requests that can't be accepted complete with an error, flushes are
+ * submitted right away.
+ * */
+void QueueBlockRequest(BlockPlug* plug, BlockRequest* request);
+
+/**
+ * @brief Move requests of a plug into request queue of it's device and
+ * dispatch as many as device has room for.
+ * */
+void FinishBlockPlug(BlockPlug* plug);
+
+/**
+ * @brief Queue a linked list of requests, linked through next, as a single plug.
+ * */
+void QueueBlockRequests(BlockDevice* device, BlockRequest* requests);
+
+/**
+ * @brief Turn merging of adjacent requests in request queue on or off.
+ * Requests are still sorted when merging is off.
+ * */
+void SetBlockQueueMerging(BlockDevice* device, bool merging);
+
+/**
+ * @brief Get counters of request queue of a device.
+ * */
+void GetBlockQueueStatistics(BlockDevice* device, BlockQueueStatistics* stats);
+
+/**
+ * @brief Complete whatever is done in given queue of a device, or in all
+ * of it's queues if queue is BLOCK_QUEUE_WAITING.
+ *
+ * @return Number of requests completed.
+ * */
+u64 PollBlockDevice(BlockDevice* device, u32 queue);
+
+/**
+ * @brief Wait until a submitted or queued request completes, polling or
+ * sleeping depending on device.
+ *
+ * @return Status of request.
+ * */
+u32 WaitForBlockRequest(BlockDevice* device, BlockRequest* request);
+
+/**
+ * @brief Called by drivers once a request is done, completes every
+ * request merged behind it too.
+ * */
+void CompleteBlockRequest(BlockRequest* request, u32 status);
+
+/**
+ * @brief Read sectors into a buffer and wait for them.
+ * */
+bool ReadBlocks(BlockDevice* device, u64 sector, u64 buffer, u64 size);
+
+/**
+ * @brief Write sectors from a buffer and wait for them.
+ * */
+bool WriteBlocks(BlockDevice* device, u64 sector, u64 buffer, u64 size);
+
+/**
+ * @brief Sequential and random 4 KB reads from first block device,
+ * interrupt driven and polled, reporting IOPS and bandwidth.
+ * */
+void BenchmarkBlockDevices();
+
+/**
+ * @brief Random 4 KB writers on scratch disk through request queue,
+ * with merging on and off.
+ * */
+void BenchmarkBlockQueue();
+
+#endif // BLOCK_HPP
@@ -0,0 +1,734 @@
+/**
+ * @file BufferCache.cpp
+ * @author Siddharth Mishra (brightprogrammer)
+ * @date 10/18/26
+ * @brief Cache of block device contents, with ARC replacement,
+ * read-ahead of sequential streams and background writeback.
+ * @copyright MIT License 2022 Siddharth Mishra
+ * */
+
+#include "BufferCache.hpp"
+#include "Writeback.hpp"
+#include "Slab.hpp"
+#include "Spinlock.hpp"
+#include "Thread.hpp"
+#include "Scheduler.hpp"
+#include "MemoryManager.hpp"
+#include "CPU.hpp"
+#include "Timer.hpp"
+#include "Printf.hpp"
+#include "String.hpp"
+
+#define BUFFER_HASH_BUCKETS 8192
+// number of sequential streams followed at once, over all devices
+#define BUFFER_READAHEAD_STREAMS 16
+// max number of buffers written back in one batch
+#define BUFFER_WRITEBACK_BATCH 64
+
+// ARC lists
+#define ARC_T1 0
+#define ARC_T2 1
+#define ARC_B1 2
+#define ARC_B2 3
+
+struct BufferList {
+    // most recently used end
+    Buffer* head;
+    // least recently used end
+    Buffer* tail;
+    u64 count;
+};
+
+struct ReadAheadStream {
+    BlockDevice* device;
+    // block stream is expected to read next
+    u64 next;
+    // first block not read ahead yet
+    u64 ahead;
+    u64 window;
+    // for picking a stream to replace
+    u64 last_used;
+};
+
+static SlabCache buffer_header_cache("buffer.header", sizeof(Buffer));
+static TicketLock<> buffer_lock("buffer.cache");
+
+// everything below is protected by buffer_lock
+static Buffer* buffer_hash[BUFFER_HASH_BUCKETS];
+static BufferList arc_lists[4];
+// ARC target size of T1
+static u64 arc_target = 0;
+static u64 buffer_capacity = 0;
+
+// dirty buffers, oldest first
+static Buffer* dirty_head = nullptr;
+static Buffer* dirty_tail = nullptr;
+static u64 dirty_count = 0;
+static volatile u64 writing_count = 0;
+
+static ReadAheadStream readahead_streams[BUFFER_READAHEAD_STREAMS];
+static u64 readahead_clock = 0;
+
+static BufferCacheStatistics buffer_stats;
+
+static inline u64 HashBuffer(BlockDevice* device, u64 block){
+    u64 hash = (reinterpret_cast<u64>(device) >> 4) * 0x9e3779b97f4a7c15 ^ block * 0xff51afd7ed558ccd;
+    return (hash ^ (hash >> 29)) & (BUFFER_HASH_BUCKETS - 1);
+}
+
+static inline u64 GetDeviceBufferCount(BlockDevice* device){
+    return (device->sector_count + BUFFER_SECTORS - 1) / BUFFER_SECTORS;
+}
+
+// valid bytes in a buffer, last one of a device may be short
+static inline u64 GetBufferBytes(BlockDevice* device, u64 block){
+    u64 sectors = device->sector_count - block * BUFFER_SECTORS;
+    return sectors < BUFFER_SECTORS ? sectors * BLOCK_SECTOR_SIZE : BUFFER_SIZE;
+}
+
+static Buffer* FindBuffer(BlockDevice* device, u64 block){
+    for(Buffer* buffer = buffer_hash[HashBuffer(device, block)]; buffer; buffer = buffer->hash_next){
+        if(buffer->device == device && buffer->block == block) return buffer;
+    }
+    return nullptr;
+}
+
+static void RemoveFromHash(Buffer* buffer){
+    Buffer** link = &buffer_hash[HashBuffer(buffer->device, buffer->block)];
+    while(*link != buffer) link = &(*link)->hash_next;
+    *link = buffer->hash_next;
+}
+
+static void PushToList(Buffer* buffer, u32 list){
+    BufferList* l = &arc_lists[list];
+    buffer->list = list;
+    buffer->prev = nullptr;
+    buffer->next = l->head;
+    if(l->head) l->head->prev = buffer;
+    else l->tail = buffer;
+    l->head = buffer;
+    l->count++;
+}
+
+static void RemoveFromList(Buffer* buffer){
+    BufferList* l = &arc_lists[buffer->list];
+    if(buffer->prev) buffer->prev->next = buffer->next;
+    else l->head = buffer->next;
+    if(buffer->next) buffer->next->prev = buffer->prev;
+    else l->tail = buffer->prev;
+    l->count--;
+}
+
+static void AddToDirtyList(Buffer* buffer){
+    buffer->dirty_since = GetUptimeNanoseconds();
+    buffer->dirty_next = nullptr;
+    buffer->dirty_prev = dirty_tail;
+    if(dirty_tail) dirty_tail->dirty_next = buffer;
+    else dirty_head = buffer;
+    dirty_tail = buffer;
+    dirty_count++;
+}
+
+static void RemoveFromDirtyList(Buffer* buffer){
+    if(buffer->dirty_prev) buffer->dirty_prev->dirty_next = buffer->dirty_next;
+    else dirty_head = buffer->dirty_next;
+    if(buffer->dirty_next) buffer->dirty_next->dirty_prev = buffer->dirty_prev;
+    else dirty_tail = buffer->dirty_prev;
+    dirty_count--;
+}
+
+/* ------------------ ARC --------------------
+ *
+ * Ghost buffers keep their header, and place in hash table, but give
+ * their page to whoever evicted them. Cache can't always evict what ARC
+ * asks for, since buffers in use are pinned. Then it tries other list,
+ * and if nothing can be evicted at all it takes a fresh page and stays
+ * over capacity until something can be evicted again.
+ *
+ * */
+
+// evict least recently used buffer of a resident list that can be evicted, returns it's page
+static u64 EvictFromList(u32 list){
+    for(Buffer* buffer = arc_lists[list].tail; buffer; buffer = buffer->prev){
+        if(buffer->references || (buffer->flags & (BUFFER_DIRTY | BUFFER_READING | BUFFER_WRITING))) continue;
+
+        if(buffer->flags & BUFFER_READAHEAD) buffer_stats.readahead_wasted++;
+        u64 page = buffer->data;
+        buffer->data = 0;
+        buffer->flags = 0;
+        RemoveFromList(buffer);
+        PushToList(buffer, list == ARC_T1 ? ARC_B1 : ARC_B2);
+        buffer_stats.evictions++;
+        return page;
+    }
+    return 0;
+}
+
+// REPLACE of ARC, hit_in_b2 is true if block being brought in was found in B2
+static u64 ReplaceBuffer(bool hit_in_b2){
+    u64 t1 = arc_lists[ARC_T1].count;
+    bool from_t1 = t1 && (t1 > arc_target || (hit_in_b2 && t1 == arc_target));
+    u64 page = EvictFromList(from_t1 ? ARC_T1 : ARC_T2);
+    if(page == 0) page = EvictFromList(from_t1 ? ARC_T2 : ARC_T1);
+    return page;
+}
+
+static void DeleteGhost(u32 list){
+    Buffer* buffer = arc_lists[list].tail;
+    if(buffer == nullptr) return;
+    RemoveFromList(buffer);
+    RemoveFromHash(buffer);
+    SlabFree(&buffer_header_cache, buffer);
+}
+
+// get a page for a block being brought into cache
+static u64 MakeRoom(bool hit_in_b2){
+    u64 page = 0;
+    if(arc_lists[ARC_T1].count + arc_lists[ARC_T2].count >= buffer_capacity){
+        page = ReplaceBuffer(hit_in_b2);
+    }
+    if(page == 0) page = AllocatePage();
+
+    // ghost lists together never remember more than capacity
+    while(arc_lists[ARC_T1].count + arc_lists[ARC_B1].count > buffer_capacity && arc_lists[ARC_B1].count){
+        DeleteGhost(ARC_B1);
+    }
+    while(arc_lists[ARC_B1].count + arc_lists[ARC_B2].count > buffer_capacity && arc_lists[ARC_B2].count){
+        DeleteGhost(ARC_B2);
+    }
+    return page;
+}
+
+// bring a block into cache, from a ghost list or from nowhere. Buffer is
+// left in T1 or T2 with flags given, caller reads or fills it
+static Buffer* InsertBuffer(BlockDevice* device, u64 block, Buffer* ghost, u32 flags, bool adapt){
+    Buffer* buffer = ghost;
+    u32 list = ARC_T1;
+    if(ghost){
+        u64 b1 = arc_lists[ARC_B1].count;
+        u64 b2 = arc_lists[ARC_B2].count;
+        bool in_b2 = ghost->list == ARC_B2;
+        // read ahead doesn't tell us anything about what is reused
+        if(adapt){
+            buffer_stats.ghost_hits++;
+            if(in_b2){
+                u64 delta = b2 && b1 / b2 > 1 ? b1 / b2 : 1;
+                arc_target = arc_target > delta ? arc_target - delta : 0;
+            }else{
+                u64 delta = b1 && b2 / b1 > 1 ? b2 / b1 : 1;
+                arc_target = arc_target + delta < buffer_capacity ? arc_target + delta : buffer_capacity;
+            }
+            list = ARC_T2;
+        }
+        RemoveFromList(ghost);
+        buffer->data = MakeRoom(in_b2);
+    }else{
+        u64 page = MakeRoom(false);
+        buffer = reinterpret_cast<Buffer*>(SlabAllocate(&buffer_header_cache));
+        buffer->device = device;
+        buffer->block = block;
+        buffer->data = page;
+        u64 bucket = HashBuffer(device, block);
+        buffer->hash_next = buffer_hash[bucket];
+        buffer_hash[bucket] = buffer;
+    }
+
+    buffer->size = GetBufferBytes(device, block);
+    buffer->flags = flags;
+    buffer->references = 0;
+    PushToList(buffer, list);
+    return buffer;
+}
+
+static inline bool IsResident(Buffer* buffer){
+    return buffer->list == ARC_T1 || buffer->list == ARC_T2;
+}
+
+/******************** Buffer IO ********************/
+
+static void BufferReadComplete(BlockRequest* request){
+    Buffer* buffer = reinterpret_cast<Buffer*>(request->private_data);
+    if(request->status == BLOCK_STATUS_OK){
+        __atomic_or_fetch(&buffer->flags, BUFFER_VALID, __ATOMIC_RELEASE);
+    }
+    __atomic_and_fetch(&buffer->flags, ~u32(BUFFER_READING), __ATOMIC_RELEASE);
+}
+
+static void PrepareBufferIO(Buffer* buffer, u32 op){
+    InitializeBlockRequest(&buffer->request, op, buffer->block * BUFFER_SECTORS, buffer->data, buffer->size);
+    if(op == BLOCK_OP_READ){
+        buffer->request.complete = BufferReadComplete;
+    }
+    buffer->request.private_data = buffer;
+}
+
+// wait for someone else's read of a buffer
+static void WaitForBuffer(Buffer* buffer){
+    BlockDevice* device = buffer->device;
+    while(__atomic_load_n(&buffer->flags, __ATOMIC_ACQUIRE) & BUFFER_READING){
+        if(device->polling){
+            if(PollBlockDevice(device, buffer->request.queue) == 0) CPUPause();
+        }else{
+            Yield();
+        }
+    }
+}
+
+// follow sequential streams and read ahead of them
+static void ReadAhead(BlockDevice* device, u64 block){
+    BlockRequest* batch = nullptr;
+    BlockRequest** tail = &batch;
+    {
+        LockGuard guard(buffer_lock);
+
+        ReadAheadStream* stream = nullptr;
+        ReadAheadStream* oldest = &readahead_streams[0];
+        for(u64 i = 0; i < BUFFER_READAHEAD_STREAMS; i++){
+            ReadAheadStream* s = &readahead_streams[i];
+            if(s->device == device && s->next == block){
+                stream = s;
+                break;
+            }
+            // same block again isn't a new stream
+            if(s->device == device && s->next == block + 1) return;
+            if(s->last_used < oldest->last_used) oldest = s;
+        }
+
+        if(stream == nullptr){
+            oldest->device = device;
+            oldest->next = block + 1;
+            oldest->ahead = block + 1;
+            oldest->window = BUFFER_READAHEAD_MIN_WINDOW;
+            oldest->last_used = ++readahead_clock;
+            return;
+        }
+
+        stream->next = block + 1;
+        stream->last_used = ++readahead_clock;
+        if(stream->ahead < stream->next) stream->ahead = stream->next;
+        // still far enough ahead of reader
+        if(stream->ahead - stream->next > stream->window / 2) return;
+
+        u64 start = stream->ahead;
+        u64 end = start + stream->window;
+        u64 blocks = GetDeviceBufferCount(device);
+        if(end > blocks) end = blocks;
+        stream->ahead = end;
+        if(stream->window < BUFFER_READAHEAD_MAX_WINDOW) stream->window *= 2;
+
+        for(u64 b = start; b < end; b++){
+            Buffer* buffer = FindBuffer(device, b);
+            if(buffer && IsResident(buffer)) continue;
+
+            buffer = InsertBuffer(device, b, buffer, BUFFER_READING | BUFFER_READAHEAD, false);
+            PrepareBufferIO(buffer, BLOCK_OP_READ);
+            *tail = &buffer->request;
+            tail = &buffer->request.next;
+            buffer_stats.readahead_issued++;
+        }
+    }
+
+    // a window is contiguous on disk, request queue turns it into few commands
+    if(batch) QueueBlockRequests(device, batch);
+}
+
+Buffer* GetBuffer(BlockDevice* device, u64 block, bool overwrite){
+    if(block >= GetDeviceBufferCount(device)) return nullptr;
+
+    Buffer* buffer;
+    bool read = false;
+    bool fill = false;
+    {
+        LockGuard guard(buffer_lock);
+        buffer_stats.lookups++;
+
+        buffer = FindBuffer(device, block);
+        if(buffer && IsResident(buffer)){
+            buffer_stats.hits++;
+            if(buffer->flags & BUFFER_READAHEAD){
+                buffer->flags &= ~u32(BUFFER_READAHEAD);
+                buffer_stats.readahead_used++;
+            }
+            RemoveFromList(buffer);
+            PushToList(buffer, ARC_T2);
+        }else{
+            buffer = InsertBuffer(device, block, buffer, BUFFER_READING, true);
+            read = !overwrite;
+            fill = overwrite;
+        }
+
+        // an earlier read failed, try again
+        if(!(buffer->flags & (BUFFER_VALID | BUFFER_READING))){
+            buffer->flags |= BUFFER_READING;
+            read = !overwrite;
+            fill = overwrite;
+        }
+        buffer->references++;
+    }
+
+    if(fill){
+        memset(reinterpret_cast<void*>(buffer->data), 0, BUFFER_SIZE);
+        __atomic_store_n(&buffer->flags, u32(BUFFER_VALID), __ATOMIC_RELEASE);
+    }else if(!overwrite){
+        ReadAhead(device, block);
+    }
+
+    if(read){
+        PrepareBufferIO(buffer, BLOCK_OP_READ);
+        SubmitBlockRequests(device, &buffer->request);
+        WaitForBlockRequest(device, &buffer->request);
+    }
+    WaitForBuffer(buffer);
+
+    if(!(buffer->flags & BUFFER_VALID)){
+        ReleaseBuffer(buffer);
+        return nullptr;
+    }
+    return buffer;
+}
+
+void ReleaseBuffer(Buffer* buffer){
+    __atomic_sub_fetch(&buffer->references, 1, __ATOMIC_RELEASE);
+}
+
+void MarkBufferDirty(Buffer* buffer){
+    {
+        LockGuard guard(buffer_lock);
+        if(buffer->flags & BUFFER_DIRTY) return;
+        buffer->flags |= BUFFER_DIRTY | BUFFER_VALID;
+        AddToDirtyList(buffer);
+    }
+    WakeWriteback(buffer->device);
+}
+
+bool ReadCached(BlockDevice* device, u64 offset, void* dst, u64 size){
+    if(offset + size > device->sector_count * BLOCK_SECTOR_SIZE) return false;
+
+    u8* out = reinterpret_cast<u8*>(dst);
+    while(size){
+        u64 within = offset % BUFFER_SIZE;
+        u64 chunk = BUFFER_SIZE - within < size ? BUFFER_SIZE - within : size;
+        Buffer* buffer = GetBuffer(device, offset / BUFFER_SIZE);
+        if(buffer == nullptr) return false;
+        memcpy(out, reinterpret_cast<void*>(buffer->data + within), chunk);
+        ReleaseBuffer(buffer);
+
+        out += chunk;
+        offset += chunk;
+        size -= chunk;
+    }
+    return true;
+}
+
+bool WriteCached(BlockDevice* device, u64 offset, const void* src, u64 size){
+    if(device->read_only || offset + size > device->sector_count * BLOCK_SECTOR_SIZE) return false;
+
+    const u8* in = reinterpret_cast<const u8*>(src);
+    while(size){
+        u64 within = offset % BUFFER_SIZE;
+        u64 chunk = BUFFER_SIZE - within < size ? BUFFER_SIZE - within : size;
+        // whole buffers are overwritten without reading them first
+        Buffer* buffer = GetBuffer(device, offset / BUFFER_SIZE, chunk == BUFFER_SIZE);
+        if(buffer == nullptr) return false;
+        memcpy(reinterpret_cast<void*>(buffer->data + within), in, chunk);
+        MarkBufferDirty(buffer);
+        ReleaseBuffer(buffer);
+
+        in += chunk;
+        offset += chunk;
+        size -= chunk;
+    }
+    return true;
+}
+
+/* ------------------ WRITEBACK --------------------
+ *
+ * A buffer being written is taken off dirty list and pinned. If it's
+ * dirtied again while it's written, it goes back on dirty list and is
+ * written again later. Failed writes go back on dirty list too.
+ *
+ * */
+
+// write back a batch of dirty buffers of a single device and wait for them,
+// returns number of buffers written
+static u64 WriteBackBuffers(BlockDevice* device, bool force, u64* errors){
+    Buffer* chosen[BUFFER_WRITEBACK_BATCH];
+    u64 count = 0;
+    {
+        LockGuard guard(buffer_lock);
+        u64 now = GetUptimeNanoseconds();
+        for(Buffer* buffer = dirty_head; buffer && count < BUFFER_WRITEBACK_BATCH; buffer = buffer->dirty_next){
+            if(device && buffer->device != device) continue;
+            // list is oldest first
+            if(!force && now - buffer->dirty_since < BUFFER_WRITEBACK_AGE_NS) break;
+            if(buffer->flags & (BUFFER_WRITING | BUFFER_READING)) continue;
+            if(device == nullptr) device = buffer->device;
+            if(buffer->device != device) continue;
+            chosen[count++] = buffer;
+        }
+
+        for(u64 i = 0; i < count; i++){
+            Buffer* buffer = chosen[i];
+            RemoveFromDirtyList(buffer);
+            buffer->flags = (buffer->flags & ~u32(BUFFER_DIRTY)) | BUFFER_WRITING;
+            buffer->references++;
+        }
+        writing_count += count;
+    }
+    if(count == 0) return 0;
+
+    BlockRequest* batch = nullptr;
+    for(u64 i = count; i-- > 0;){
+        PrepareBufferIO(chosen[i], BLOCK_OP_WRITE);
+        chosen[i]->request.next = batch;
+        batch = &chosen[i]->request;
+    }
+    // neighbouring dirty buffers are merged by request queue
+    QueueBlockRequests(device, batch);
+    for(u64 i = 0; i < count; i++){
+        WaitForBlockRequest(device, &chosen[i]->request);
+    }
+
+    LockGuard guard(buffer_lock);
+    for(u64 i = 0; i < count; i++){
+        Buffer* buffer = chosen[i];
+        buffer->flags &= ~u32(BUFFER_WRITING);
+        if(buffer->request.status == BLOCK_STATUS_OK){
+            buffer_stats.writebacks++;
+        }else{
+            buffer_stats.write_errors++;
+            (*errors)++;
+            if(!(buffer->flags & BUFFER_DIRTY)){
+                buffer->flags |= BUFFER_DIRTY;
+                AddToDirtyList(buffer);
+            }
+        }
+        buffer->references--;
+    }
+    writing_count -= count;
+    return count;
+}
+
+u64 WriteBackBufferCache(BlockDevice* device, bool force){
+    u64 errors = 0;
+    return WriteBackBuffers(device, force, &errors);
+}
+
+bool HasDirtyBuffers(BlockDevice* device){
+    LockGuard guard(buffer_lock);
+    for(Buffer* buffer = dirty_head; buffer; buffer = buffer->dirty_next){
+        if(device == nullptr || buffer->device == device) return true;
+    }
+    return false;
+}
+
+u64 GetOldestDirtyBuffer(BlockDevice* device){
+    // dirty list is in order buffers got dirty
+    LockGuard guard(buffer_lock);
+    for(Buffer* buffer = dirty_head; buffer; buffer = buffer->dirty_next){
+        if(buffer->device == device) return buffer->dirty_since;
+    }
+    return 0;
+}
+
+static u32 FlushBlockDevice(BlockDevice* device){
+    BlockRequest request;
+    InitializeBlockRequest(&request, BLOCK_OP_FLUSH, 0, 0, 0);
+    SubmitBlockRequests(device, &request);
+    return WaitForBlockRequest(device, &request);
+}
+
+bool SyncBufferCache(BlockDevice* device){
+    u64 errors = 0;
+    u64 attempts = 0;
+    do{
+        while(WriteBackBuffers(device, true, &errors)) {}
+        // writeback threads may still have some in flight
+        while(__atomic_load_n(&writing_count, __ATOMIC_ACQUIRE)) Yield();
+        // failed writes are dirty again, don't retry them forever
+    }while(HasDirtyBuffers(device) && ++attempts < 4);
+
+    for(u64 i = 0; i < GetBlockDeviceCount(); i++){
+        BlockDevice* d = GetBlockDevice(i);
+        if(device && d != device) continue;
+        if(d->read_only) continue;
+        u32 status = FlushBlockDevice(d);
+        if(status != BLOCK_STATUS_OK && status != BLOCK_STATUS_UNSUPPORTED) errors++;
+    }
+    return errors == 0;
+}
+
+/******************** Statistics ********************/
+
+void GetBufferCacheStatistics(BufferCacheStatistics* stats){
+    LockGuard guard(buffer_lock);
+    memcpy(stats, &buffer_stats, sizeof(BufferCacheStatistics));
+    stats->capacity = buffer_capacity;
+    stats->t1 = arc_lists[ARC_T1].count;
+    stats->t2 = arc_lists[ARC_T2].count;
+    stats->b1 = arc_lists[ARC_B1].count;
+    stats->b2 = arc_lists[ARC_B2].count;
+    stats->resident = stats->t1 + stats->t2;
+    stats->ghosts = stats->b1 + stats->b2;
+    stats->dirty = dirty_count;
+    stats->target_t1 = arc_target;
+    stats->memory = stats->resident * BUFFER_SIZE + (stats->resident + stats->ghosts) * sizeof(Buffer);
+}
+
+void ShowBufferCacheStatistics(){
+    BufferCacheStatistics stats;
+    GetBufferCacheStatistics(&stats);
+    u64 lookups = stats.lookups ? stats.lookups : 1;
+    u64 issued = stats.readahead_issued ? stats.readahead_issued : 1;
+
+    ColorPrintf(COLOR_YELLOW, COLOR_BLACK, "[+] Buffer Cache Stats : \n");
+    Printf("\tBuffers : %lu / %lu | dirty %lu | ghosts %lu | memory %lu KB\n",
+           stats.resident, stats.capacity, stats.dirty, stats.ghosts, stats.memory / KB);
+    Printf("\tARC : T1 %lu (target %lu) | T2 %lu | B1 %lu | B2 %lu\n",
+           stats.t1, stats.target_t1, stats.t2, stats.b1, stats.b2);
+    Printf("\tLookups : %lu | hits %lu%% | ghost hits %lu | evictions %lu\n",
+           stats.lookups, stats.hits * 100 / lookups, stats.ghost_hits, stats.evictions);
+    Printf("\tRead-ahead : %lu buffers | used %lu%% | wasted %lu%%\n",
+           stats.readahead_issued, stats.readahead_used * 100 / issued, stats.readahead_wasted * 100 / issued);
+    Printf("\tWriteback : %lu buffers | %lu errors\n", stats.writebacks, stats.write_errors);
+}
+
+void InitializeBufferCache(u64 capacity){
+    if(capacity == 0){
+        capacity = GetFreeMemory() / 16 / PAGE_SIZE;
+        if(capacity < 256) capacity = 256;
+        if(capacity > 65536) capacity = 65536;
+    }
+    buffer_capacity = capacity;
+}
+
+u64 GetDirtyBufferCount(){
+    return __atomic_load_n(&dirty_count, __ATOMIC_RELAXED);
+}
+
+u64 GetBufferCacheCapacity(){
+    return buffer_capacity;
+}
+
+/******************** Buffer Cache Benchmark ********************/
+
+#define BENCH_BUFFER_RANDOM_READS 4096
+#define BENCH_BUFFER_WRITE_SIZE (u64(8) * MB)
+#define BENCH_BUFFER_WRITE_CHUNK (u64(64) * KB)
+
+static bool IsBufferCached(BlockDevice* device, u64 block){
+    LockGuard guard(buffer_lock);
+    Buffer* buffer = FindBuffer(device, block);
+    return buffer && IsResident(buffer);
+}
+
+// read count buffers starting at first, returns nanoseconds taken
+static u64 ReadBufferRange(BlockDevice* device, u64 first, u64 count){
+    u64 start = ReadTimestampCounter();
+    for(u64 i = 0; i < count; i++){
+        Buffer* buffer = GetBuffer(device, first + i);
+        if(buffer) ReleaseBuffer(buffer);
+    }
+    return CyclesToNanoseconds(ReadTimestampCounter() - start);
+}
+
+static void ShowBufferPass(const char* name, u64 buffers, u64 ns, BufferCacheStatistics* before){
+    BufferCacheStatistics after;
+    GetBufferCacheStatistics(&after);
+    u64 lookups = after.lookups - before->lookups;
+    u64 issued = after.readahead_issued - before->readahead_issued;
+    if(lookups == 0) lookups = 1;
+    if(ns == 0) ns = 1;
+
+    Printf("\t%s : %lu MB/s | hits %lu%% | read-ahead %lu buffers\n", name,
+           buffers * BUFFER_SIZE * 1000 / ns, (after.hits - before->hits) * 100 / lookups, issued);
+    memcpy(before, &after, sizeof(BufferCacheStatistics));
+}
+
+void BenchmarkBufferCache(){
+    ColorPrintf(COLOR_YELLOW, COLOR_BLACK, "[+] Benchmark : Buffer Cache\n");
+
+    BlockDevice* device = GetBlockDevice(0);
+    if(device == nullptr){
+        Printf("\tNo block devices\n");
+        return;
+    }
+    u64 blocks = GetDeviceBufferCount(device);
+    Printf("\tDevice : %s | %lu buffers | capacity %lu buffers\n", device->name, blocks, buffer_capacity);
+
+    BufferCacheStatistics stats;
+    GetBufferCacheStatistics(&stats);
+
+    // sequential, first cold then hot
+    u64 range = buffer_capacity / 2 < blocks ? buffer_capacity / 2 : blocks;
+    u64 ns = ReadBufferRange(device, 0, range);
+    ShowBufferPass("Sequential cold", range, ns, &stats);
+    ns = ReadBufferRange(device, 0, range);
+    ShowBufferPass("Sequential hot", range, ns, &stats);
+
+    // hot set read twice, so it's in T2, then a long scan with hot set
+    // still being read in between
+    u64 hot = buffer_capacity / 4 < blocks / 4 ? buffer_capacity / 4 : blocks / 4;
+    u64 scan = blocks - hot < 2 * buffer_capacity ? blocks - hot : 2 * buffer_capacity;
+    ReadBufferRange(device, 0, hot);
+    ReadBufferRange(device, 0, hot);
+    u64 hot_reads = 0;
+    u64 hot_hits = 0;
+    u64 start = ReadTimestampCounter();
+    for(u64 i = 0; i < scan; i++){
+        Buffer* buffer = GetBuffer(device, hot + i);
+        if(buffer) ReleaseBuffer(buffer);
+        if(i % 4 == 0 && hot){
+            u64 block = (i / 4) % hot;
+            hot_reads++;
+            if(IsBufferCached(device, block)) hot_hits++;
+            buffer = GetBuffer(device, block);
+            if(buffer) ReleaseBuffer(buffer);
+        }
+    }
+    ns = CyclesToNanoseconds(ReadTimestampCounter() - start);
+    ShowBufferPass("Scan over hot set", scan + hot_reads, ns, &stats);
+    Printf("\t\thot set %lu buffers, scan %lu buffers : hot set hits %lu%%\n",
+           hot, scan, hot_reads ? hot_hits * 100 / hot_reads : 0);
+
+    // random reads over twice what cache holds
+    u64 working_set = 2 * buffer_capacity < blocks ? 2 * buffer_capacity : blocks;
+    u64 random = 0x2545f4914f6cdd1d;
+    start = ReadTimestampCounter();
+    for(u64 i = 0; i < BENCH_BUFFER_RANDOM_READS; i++){
+        random ^= random << 13;
+        random ^= random >> 7;
+        random ^= random << 17;
+        Buffer* buffer = GetBuffer(device, random % working_set);
+        if(buffer) ReleaseBuffer(buffer);
+    }
+    ns = CyclesToNanoseconds(ReadTimestampCounter() - start);
+    if(ns == 0) ns = 1;
+    Printf("\tRandom over %lu buffers : %lu reads/s\n", working_set, u64(BENCH_BUFFER_RANDOM_READS) * 1000000000 / ns);
+    ShowBufferPass("Random", BENCH_BUFFER_RANDOM_READS, ns, &stats);
+
+    // writes go to NVMe scratch disk, never to boot disk
+    BlockDevice* scratch = FindBlockDevice("nvme0n1");
+    if(scratch && scratch->sector_count * BLOCK_SECTOR_SIZE >= BENCH_BUFFER_WRITE_SIZE){
+        u64 chunk = AllocateKernelMemory(BENCH_BUFFER_WRITE_CHUNK / PAGE_SIZE);
+        memset(reinterpret_cast<void*>(chunk), 0xa5, BENCH_BUFFER_WRITE_CHUNK);
+
+        start = ReadTimestampCounter();
+        for(u64 offset = 0; offset < BENCH_BUFFER_WRITE_SIZE; offset += BENCH_BUFFER_WRITE_CHUNK){
+            WriteCached(scratch, offset, reinterpret_cast<void*>(chunk), BENCH_BUFFER_WRITE_CHUNK);
+        }
+        u64 write_ns = CyclesToNanoseconds(ReadTimestampCounter() - start);
+        start = ReadTimestampCounter();
+        bool synced = SyncBufferCache(scratch);
+        u64 sync_ns = CyclesToNanoseconds(ReadTimestampCounter() - start);
+        if(write_ns == 0) write_ns = 1;
+        if(sync_ns == 0) sync_ns = 1;
+        Printf("\tWrites to %s : absorbed %lu MB/s | sync %lu MB/s%s\n", scratch->name,
+               BENCH_BUFFER_WRITE_SIZE * 1000 / write_ns, BENCH_BUFFER_WRITE_SIZE * 1000 / sync_ns,
+               synced ? "" : " | errors");
+
+        FreeKernelMemory(chunk, BENCH_BUFFER_WRITE_CHUNK / PAGE_SIZE);
+    }
+
+    ShowBufferCacheStatistics();
+}
@@ -0,0 +1,209 @@
+/**
+ * @file BufferCache.hpp
+ * @author Siddharth Mishra (brightprogrammer)
+ * @date 10/18/26
+ * @brief Cache of block device contents, with ARC replacement,
+ * read-ahead of sequential streams and background writeback.
+ * @copyright MIT License 2022 Siddharth Mishra
+ * */
+
+#ifndef BUFFER_CACHE_HPP
+#define BUFFER_CACHE_HPP
+
+#include "Common.hpp"
+#include "Block.hpp"
+
+/* ------------------ BUFFER CACHE --------------------
+ *
+ * Devices are cached in BUFFER_SIZE blocks, each one a page, found
+ * through a hash table keyed by (device, block).
+ *
+ * Replacement is ARC (Megiddo and Modha). Resident buffers are in one
+ * of two lists : T1 holds blocks seen once recently, T2 blocks seen at
+ * least twice. Evicted blocks leave their header behind in ghost lists
+ * B1 and B2. A hit in B1 means T1 was too small and a hit in B2 means T2
+ * was too small, and target size of T1 moves accordingly. A scan only
+ * ever passes through T1, so it can't push out what is used repeatedly.
+ *
+ * Read-ahead follows sequential streams. Second block read right after
+ * another starts a stream, and every time reader gets within half a
+ * window of where read-ahead got to, next window is read and window
+ * doubles, up to BUFFER_READAHEAD_MAX_WINDOW. Random reads never start
+ * a stream, so they never read ahead.
+ *
+ * Dirty buffers are written back by writeback thread of their device,
+ * once they are older than BUFFER_WRITEBACK_AGE_NS or when too much
+ * memory is dirty (see Writeback.hpp).
+ * Buffers that are in use, dirty or under io are never evicted, cache
+ * grows past it's capacity instead.
+ *
+ * */
+
+#define BUFFER_SIZE 4096
+#define BUFFER_SECTORS (BUFFER_SIZE / BLOCK_SECTOR_SIZE)
+
+// buffer flags
+// data is what's on device, or newer
+#define BUFFER_VALID (1 << 0)
+// data is newer than what's on device
+#define BUFFER_DIRTY (1 << 1)
+#define BUFFER_READING (1 << 2)
+#define BUFFER_WRITING (1 << 3)
+// read ahead and not used since
+#define BUFFER_READAHEAD (1 << 4)
+
+// initial and largest read-ahead window, in buffers
+#define BUFFER_READAHEAD_MIN_WINDOW 4
+#define BUFFER_READAHEAD_MAX_WINDOW 64
+// dirty buffers older than this are written back
+#define BUFFER_WRITEBACK_AGE_NS 500000000
+
+struct Buffer {
+    BlockDevice* device;
+    u64 block;
+    // page holding data, 0 for ghost buffers
+    u64 data;
+    // number of valid bytes, smaller than BUFFER_SIZE only at end of device
+    u64 size;
+    // BUFFER_* flags
+    volatile u32 flags;
+    // ARC list buffer is in
+    u32 list;
+    volatile u32 references;
+    // when buffer became dirty
+    u64 dirty_since;
+
+    Buffer* hash_next;
+    // position in ARC list
+    Buffer* prev;
+    Buffer* next;
+    // position in dirty list
+    Buffer* dirty_prev;
+    Buffer* dirty_next;
+
+    // io of buffer, only one at a time
+    BlockRequest request;
+};
+
+struct BufferCacheStatistics {
+    // buffers cache tries to keep, and how many it has
+    u64 capacity;
+    u64 resident;
+    u64 ghosts;
+    u64 dirty;
+    // ARC target size of T1, and sizes of lists
+    u64 target_t1;
+    u64 t1, t2, b1, b2;
+    // bytes of data pages and buffer headers
+    u64 memory;
+
+    u64 lookups;
+    u64 hits;
+    u64 ghost_hits;
+    u64 evictions;
+
+    u64 readahead_issued;
+    // read ahead buffers that were used before they were evicted
+    u64 readahead_used;
+    // read ahead buffers that were evicted without being used
+    u64 readahead_wasted;
+
+    u64 writebacks;
+    u64 write_errors;
+};
+
+/**
+ * @brief Set up cache. Dirty buffers are written back only once
+ * writeback threads are started, see InitializeWriteback.
+ *
+ * @param capacity Number of buffers to keep, 0 to pick one from free memory.
+ * */
+void InitializeBufferCache(u64 capacity = 0);
+
+/**
+ * @brief Get buffer of a block, reading it if it's not cached.
+ * Buffer stays in cache until it's released.
+ *
+ * @param overwrite Caller is going to overwrite whole buffer,
+ * so it's not read from device if it's not cached.
+ * @return Referenced buffer, or nullptr if it couldn't be read.
+ * */
+Buffer* GetBuffer(BlockDevice* device, u64 block, bool overwrite = false);
+
+/**
+ * @brief Drop a reference taken by GetBuffer.
+ * */
+void ReleaseBuffer(Buffer* buffer);
+
+/**
+ * @brief Mark a referenced buffer as modified, it's written back later.
+ * */
+void MarkBufferDirty(Buffer* buffer);
+
+/**
+ * @brief Read bytes at any offset of a device through cache.
+ * */
+bool ReadCached(BlockDevice* device, u64 offset, void* dst, u64 size);
+
+/**
+ * @brief Write bytes at any offset of a device through cache.
+ * Data reaches device later, see SyncBufferCache.
+ * */
+bool WriteCached(BlockDevice* device, u64 offset, const void* src, u64 size);
+
+/**
+ * @brief Write back every dirty buffer of a device, or of every device
+ * if device is nullptr, and wait until they are on stable storage.
+ *
+ * @return false if anything failed to write.
+ * */
+bool SyncBufferCache(BlockDevice* device);
+
+/**
+ * @brief Write back a batch of dirty buffers of a device and wait for it.
+ * Called by writeback threads.
+ *
+ * @param force Write buffers that are not old enough yet too.
+ * @return Number of buffers written.
+ * */
+u64 WriteBackBufferCache(BlockDevice* device, bool force);
+
+/**
+ * @brief Check if a device, or any device if it's nullptr, has dirty buffers.
+ * */
+bool HasDirtyBuffers(BlockDevice* device);
+
+/**
+ * @brief Uptime in nanoseconds since when oldest dirty buffer of a device
+ * has been dirty, 0 if it has none.
+ * */
+u64 GetOldestDirtyBuffer(BlockDevice* device);
+
+/**
+ * @brief Number of dirty buffers over all devices, without taking cache lock.
+ * */
+u64 GetDirtyBufferCount();
+
+/**
+ * @brief Number of buffers cache keeps.
+ * */
+u64 GetBufferCacheCapacity();
+
+/**
+ * @brief Get a snapshot of cache statistics.
+ * */
+void GetBufferCacheStatistics(BufferCacheStatistics* stats);
+
+/**
+ * @brief Print cache statistics.
+ * */
+void ShowBufferCacheStatistics();
+
+/**
+ * @brief Cold and hot sequential reads, a scan over a hot working set,
+ * random reads and buffered writes. Reports bandwidth, hit rates and
+ * read-ahead efficiency.
+ * */
+void BenchmarkBufferCache();
+
+#endif // BUFFER_CACHE_HPP
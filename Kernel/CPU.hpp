@@ -0,0 +1,170 @@
+/**
+ * @file CPU.hpp
+ * @author Siddharth Mishra (brightprogrammer)
+ * @date 10/18/26
+ * @brief Small wrappers around x86_64 instructions that don't have
+ * a C equivalent (msr, tsc, cpuid, control registers, interrupt flag).
+ * @copyright MIT License 2022 Siddharth Mishra
+ * */
+
+#ifndef CPU_HPP
+#define CPU_HPP
+
+#include <cstdint>
+#include "Common.hpp"
+
+// model specific registers used by kernel
+#define MSR_APIC_BASE 0x1b
+#define MSR_EFER 0xc0000080
+#define MSR_FS_BASE 0xc0000100
+#define MSR_GS_BASE 0xc0000101
+#define MSR_KERNEL_GS_BASE 0xc0000102
+
+// rflags bits
+#define RFLAGS_INTERRUPT_ENABLE (u64(1) << 9)
+
+// control register bits
+#define CR0_MONITOR_COPROCESSOR (u64(1) << 1)
+#define CR0_EMULATION (u64(1) << 2)
+#define CR0_TASK_SWITCHED (u64(1) << 3)
+#define CR0_NUMERIC_ERROR (u64(1) << 5)
+#define CR4_OSFXSR (u64(1) << 9)
+#define CR4_OSXMMEXCPT (u64(1) << 10)
+#define CR4_OSXSAVE (u64(1) << 18)
+
+// these are all inline because they are mostly used in places
+// where a function call would cost more than the instruction itself
+// (eg: timing code, lock code and interrupt handlers)
+
+// read time stamp counter
+inline u64 ReadTimestampCounter(){
+    u32 low, high;
+    asm volatile("rdtsc" : "=a"(low), "=d"(high));
+    return (u64(high) << 32) | low;
+}
+
+// rdtsc is not serializing so timing code uses this to make sure
+// all previous instructions retired before reading the counter
+inline u64 ReadTimestampCounterSerialized(){
+    u32 low, high;
+    asm volatile("lfence\n"
+                 "rdtsc\n"
+                 : "=a"(low), "=d"(high)
+                 :
+                 : "memory");
+    return (u64(high) << 32) | low;
+}
+
+// read model specific register
+inline u64 ReadMSR(u32 msr){
+    u32 low, high;
+    asm volatile("rdmsr" : "=a"(low), "=d"(high) : "c"(msr));
+    return (u64(high) << 32) | low;
+}
+
+// write model specific register
+inline void WriteMSR(u32 msr, u64 value){
+    asm volatile("wrmsr"
+                 :
+                 : "c"(msr), "a"(u32(value)), "d"(u32(value >> 32))
+                 : "memory");
+}
+
+// execute cpuid with given leaf and subleaf
+inline void CPUID(u32 leaf, u32 subleaf, u32& eax, u32& ebx, u32& ecx, u32& edx){
+    asm volatile("cpuid"
+                 : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx)
+                 : "a"(leaf), "c"(subleaf));
+}
+
+// tell cpu that we are in a spin wait loop
+inline void CPUPause(){
+    asm volatile("pause" ::: "memory");
+}
+
+// read rflags register
+inline u64 ReadFlags(){
+    u64 flags;
+    asm volatile("pushfq\n"
+                 "pop %0\n"
+                 : "=r"(flags)
+                 :
+                 : "memory");
+    return flags;
+}
+
+inline void DisableInterrupts(){
+    asm volatile("cli" ::: "memory");
+}
+
+inline void EnableInterrupts(){
+    asm volatile("sti" ::: "memory");
+}
+
+// disable interrupts and return previous state of rflags
+inline u64 SaveFlagsAndDisableInterrupts(){
+    u64 flags = ReadFlags();
+    DisableInterrupts();
+    return flags;
+}
+
+// enable interrupts only if they were enabled in given flags
+inline void RestoreFlags(u64 flags){
+    if(flags & RFLAGS_INTERRUPT_ENABLE){
+        EnableInterrupts();
+    }
+}
+
+inline u64 ReadCR0(){
+    u64 value;
+    asm volatile("mov %%cr0, %0" : "=r"(value));
+    return value;
+}
+
+inline void WriteCR0(u64 value){
+    asm volatile("mov %0, %%cr0" : : "r"(value) : "memory");
+}
+
+// clear task switched flag in cr0, after this fpu instructions don't trap
+inline void ClearTaskSwitched(){
+    asm volatile("clts" ::: "memory");
+}
+
+// cr2 contains faulting address on a page fault
+inline u64 ReadCR2(){
+    u64 value;
+    asm volatile("mov %%cr2, %0" : "=r"(value));
+    return value;
+}
+
+inline u64 ReadCR3(){
+    u64 value;
+    asm volatile("mov %%cr3, %0" : "=r"(value));
+    return value;
+}
+
+inline void WriteCR3(u64 value){
+    asm volatile("mov %0, %%cr3" : : "r"(value) : "memory");
+}
+
+inline u64 ReadCR4(){
+    u64 value;
+    asm volatile("mov %%cr4, %0" : "=r"(value));
+    return value;
+}
+
+inline void WriteCR4(u64 value){
+    asm volatile("mov %0, %%cr4" : : "r"(value) : "memory");
+}
+
+// write an extended control register, xcr0 selects state saved by xsave
+inline void WriteXCR(u32 xcr, u64 value){
+    asm volatile("xsetbv" : : "c"(xcr), "a"(u32(value)), "d"(u32(value >> 32)) : "memory");
+}
+
+// invalidate tlb entry for given virtual address
+inline void InvalidatePage(u64 vaddr){
+    asm volatile("invlpg (%0)" : : "r"(vaddr) : "memory");
+}
+
+#endif // CPU_HPP
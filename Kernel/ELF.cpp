@@ -0,0 +1,332 @@
+/**
+ * @file ELF.cpp
+ * @author Siddharth Mishra (brightprogrammer)
+ * @date 10/18/26
+ * @brief Loader for static ELF64 executables.
+ * @copyright MIT License 2022 Siddharth Mishra
+ * */
+
+#include "ELF.hpp"
+#include "Module.hpp"
+#include "MemoryManager.hpp"
+#include "Syscall.hpp"
+#include "Thread.hpp"
+#include "CPU.hpp"
+#include "Printf.hpp"
+#include "String.hpp"
+#include "Timer.hpp"
+
+#define STRINGIFY_(x) #x
+#define STRINGIFY(x) STRINGIFY_(x)
+
+// "\x7f" "ELF" read as a little endian u32
+#define ELF_MAGIC 0x464c457f
+#define ELF_CLASS_64 2
+#define ELF_DATA_LITTLE_ENDIAN 1
+#define ELF_TYPE_EXECUTABLE 2
+#define ELF_MACHINE_X86_64 62
+
+// program header types
+#define PT_LOAD 1
+#define PT_PHDR 6
+
+// segment permissions
+#define PF_X (1 << 0)
+#define PF_W (1 << 1)
+#define PF_R (1 << 2)
+
+// auxiliary vector entries
+#define AT_NULL 0
+#define AT_PHDR 3
+#define AT_PHENT 4
+#define AT_PHNUM 5
+#define AT_PAGESZ 6
+#define AT_ENTRY 9
+#define AT_RANDOM 25
+// number of auxiliary vector entries we pass, including AT_NULL
+#define ELF_AUXV_COUNT 7
+
+struct ELFHeader {
+    u8 e_ident[16];
+    u16 e_type;
+    u16 e_machine;
+    u32 e_version;
+    u64 e_entry;
+    u64 e_phoff;
+    u64 e_shoff;
+    u32 e_flags;
+    u16 e_ehsize;
+    u16 e_phentsize;
+    u16 e_phnum;
+    u16 e_shentsize;
+    u16 e_shnum;
+    u16 e_shstrndx;
+};
+
+struct ELFProgramHeader {
+    u32 p_type;
+    u32 p_flags;
+    u64 p_offset;
+    u64 p_vaddr;
+    u64 p_paddr;
+    u64 p_filesz;
+    u64 p_memsz;
+    u64 p_align;
+};
+
+static_assert(sizeof(ELFHeader) == 64, "ELFHeader doesn't match ELF64 file header");
+static_assert(sizeof(ELFProgramHeader) == 56, "ELFProgramHeader doesn't match ELF64 program header");
+
+// check that image is an executable we can run
+static bool IsValidExecutable(const ELFHeader* header, u64 size){
+    if(size < sizeof(ELFHeader)) return false;
+    if(*reinterpret_cast<const u32*>(header->e_ident) != ELF_MAGIC) return false;
+    if(header->e_ident[4] != ELF_CLASS_64 || header->e_ident[5] != ELF_DATA_LITTLE_ENDIAN) return false;
+    if(header->e_type != ELF_TYPE_EXECUTABLE || header->e_machine != ELF_MACHINE_X86_64) return false;
+    if(header->e_phentsize != sizeof(ELFProgramHeader)) return false;
+    if(header->e_phoff > size || u64(header->e_phnum) * sizeof(ELFProgramHeader) > size - header->e_phoff) return false;
+    return header->e_entry < USER_SPACE_LIMIT;
+}
+
+// write arguments, random bytes and vectors in top page of stack
+// returns user stack pointer, or 0 if they don't fit in a page
+static u64 SetupStack(u64 page, u64 argc, const char* const* argv, const u64* auxv){
+    u64 user_page = USER_STACK_TOP - PAGE_SIZE;
+    u64 offset = PAGE_SIZE;
+
+    // strings first, at very top
+    u64 arg_addrs[ELF_MAX_ARGUMENTS];
+    for(u64 i = argc; i-- > 0;){
+        u64 len = strlen(argv[i]) + 1;
+        if(len > offset) return 0;
+        offset -= len;
+        memcpy(reinterpret_cast<void*>(page + offset), argv[i], len);
+        arg_addrs[i] = user_page + offset;
+    }
+
+    // there's no entropy source, timestamp is the best we can do for now
+    if(offset < 16) return 0;
+    offset = (offset - 16) & ~u64(15);
+    u64* random = reinterpret_cast<u64*>(page + offset);
+    random[0] = ReadTimestampCounter();
+    random[1] = random[0] * 0x9e3779b97f4a7c15;
+    u64 random_addr = user_page + offset;
+
+    // argc, argv, null, envp null, auxiliary vector
+    u64 words = 1 + argc + 1 + 1 + 2 * ELF_AUXV_COUNT;
+    if(words * 8 > offset) return 0;
+    offset = (offset - words * 8) & ~u64(15);
+
+    u64* sp = reinterpret_cast<u64*>(page + offset);
+    u64 n = 0;
+    sp[n++] = argc;
+    for(u64 i = 0; i < argc; i++){
+        sp[n++] = arg_addrs[i];
+    }
+    sp[n++] = 0;
+    sp[n++] = 0;
+    for(u64 i = 0; i < 2 * (ELF_AUXV_COUNT - 1); i += 2){
+        sp[n++] = auxv[i];
+        sp[n++] = auxv[i] == AT_RANDOM ? random_addr : auxv[i + 1];
+    }
+    sp[n++] = AT_NULL;
+    sp[n++] = 0;
+
+    return user_page + offset;
+}
+
+bool LoadELF(AddressSpace* space, u64 image, u64 size, u64 argc, const char* const* argv, ELFProgram* program){
+    const ELFHeader* header = reinterpret_cast<const ELFHeader*>(image);
+    if(argc > ELF_MAX_ARGUMENTS || !IsValidExecutable(header, size)) return false;
+
+    const ELFProgramHeader* phdrs = reinterpret_cast<const ELFProgramHeader*>(image + header->e_phoff);
+    u64 phdr_vaddr = 0;
+    for(u64 i = 0; i < header->e_phnum; i++){
+        const ELFProgramHeader* ph = &phdrs[i];
+        if(ph->p_type == PT_PHDR){
+            phdr_vaddr = ph->p_vaddr;
+        }
+        if(ph->p_type != PT_LOAD || ph->p_memsz == 0) continue;
+
+        if(ph->p_filesz > ph->p_memsz || ph->p_offset > size || ph->p_filesz > size - ph->p_offset) return false;
+        if(ph->p_vaddr >= USER_SPACE_LIMIT || ph->p_memsz > USER_SPACE_LIMIT - ph->p_vaddr) return false;
+
+        // segment is mapped page by page as it's touched, straight from image when possible
+        u64 start = ph->p_vaddr & ~(PAGE_SIZE - 1);
+        u64 end = (ph->p_vaddr + ph->p_memsz + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+        u64 flags = (ph->p_flags & PF_W) ? u64(MAP_READ_WRITE) : 0;
+        if(!AddUserRegion(space, start, end - start, flags, image + ph->p_offset, ph->p_vaddr, ph->p_filesz)){
+            return false;
+        }
+
+        // without PT_PHDR, program headers are found in segment that loads them
+        if(phdr_vaddr == 0 && header->e_phoff >= ph->p_offset && header->e_phoff - ph->p_offset < ph->p_filesz){
+            phdr_vaddr = ph->p_vaddr + (header->e_phoff - ph->p_offset);
+        }
+    }
+
+    // stack grows lazily too, only it's top page is needed now
+    if(!AddUserRegion(space, USER_STACK_TOP - ELF_STACK_SIZE, ELF_STACK_SIZE, MAP_READ_WRITE, 0, 0, 0)){
+        return false;
+    }
+    u64 stack_page = AllocateUserPage(space, USER_STACK_TOP - PAGE_SIZE, MAP_PRESENT | MAP_READ_WRITE);
+
+    // AT_RANDOM value is filled in by SetupStack
+    u64 auxv[2 * (ELF_AUXV_COUNT - 1)] = {
+        AT_PHDR, phdr_vaddr,
+        AT_PHENT, sizeof(ELFProgramHeader),
+        AT_PHNUM, header->e_phnum,
+        AT_PAGESZ, PAGE_SIZE,
+        AT_ENTRY, header->e_entry,
+        AT_RANDOM, 0
+    };
+
+    u64 rsp = SetupStack(stack_page, argc, argv, auxv);
+    if(rsp == 0) return false;
+
+    program->entry = header->e_entry;
+    program->stack_pointer = rsp;
+    return true;
+}
+
+Thread* ExecuteModule(const char* name, u64 argc, const char* const* argv){
+    BootModule* module = FindModule(name);
+    if(module == nullptr) return nullptr;
+
+    AddressSpace* space = CreateAddressSpace();
+    ELFProgram program;
+    if(!LoadELF(space, module->base, module->size, argc, argv, &program)){
+        DestroyAddressSpace(space);
+        return nullptr;
+    }
+
+    return CreateUserThread(module->name, space, program.entry, program.stack_pointer, 0);
+}
+
+/******************** ELF Loader Benchmark ********************/
+
+// layout of program built for benchmark
+#define BENCH_ELF_BASE 0x400000
+#define BENCH_ELF_TEXT_SIZE (u64(10) * MB)
+#define BENCH_ELF_DATA_SIZE 0x1000
+#define BENCH_ELF_BSS_SIZE (u64(1) * MB)
+#define BENCH_ELF_ENTRY_OFFSET 0x1000
+#define BENCH_ELF_IMAGE_SIZE (BENCH_ELF_TEXT_SIZE + BENCH_ELF_DATA_SIZE)
+// number of times every case is measured
+#define BENCH_ELF_ITERATIONS 16
+
+// first instruction of benchmark program reads timestamp and exits with it
+asm(R"(
+.text
+.global UserFirstInstruction
+.global UserFirstInstructionEnd
+UserFirstInstruction:
+    rdtsc
+    shl $32, %rdx
+    or %rax, %rdx
+    mov %rdx, %rdi
+    mov $)" STRINGIFY(SYSCALL_EXIT) R"(, %eax
+    syscall
+    ud2
+UserFirstInstructionEnd:
+)");
+
+extern "C" u8 UserFirstInstruction[];
+extern "C" u8 UserFirstInstructionEnd[];
+
+// fill a program header field by field
+static void SetProgramHeader(ELFProgramHeader* ph, u32 flags, u64 offset, u64 vaddr, u64 filesz, u64 memsz){
+    ph->p_type = PT_LOAD;
+    ph->p_flags = flags;
+    ph->p_offset = offset;
+    ph->p_vaddr = vaddr;
+    ph->p_paddr = vaddr;
+    ph->p_filesz = filesz;
+    ph->p_memsz = memsz;
+    ph->p_align = PAGE_SIZE;
+}
+
+// build a 10 MiB executable with a text segment, a data segment and a .bss
+static void BuildBenchmarkImage(u64 image){
+    memset(reinterpret_cast<void*>(image), 0, BENCH_ELF_IMAGE_SIZE);
+
+    ELFHeader* header = reinterpret_cast<ELFHeader*>(image);
+    *reinterpret_cast<u32*>(header->e_ident) = ELF_MAGIC;
+    header->e_ident[4] = ELF_CLASS_64;
+    header->e_ident[5] = ELF_DATA_LITTLE_ENDIAN;
+    header->e_ident[6] = 1;
+    header->e_type = ELF_TYPE_EXECUTABLE;
+    header->e_machine = ELF_MACHINE_X86_64;
+    header->e_version = 1;
+    header->e_entry = BENCH_ELF_BASE + BENCH_ELF_ENTRY_OFFSET;
+    header->e_phoff = sizeof(ELFHeader);
+    header->e_ehsize = sizeof(ELFHeader);
+    header->e_phentsize = sizeof(ELFProgramHeader);
+    header->e_phnum = 2;
+
+    ELFProgramHeader* phdrs = reinterpret_cast<ELFProgramHeader*>(image + sizeof(ELFHeader));
+    SetProgramHeader(&phdrs[0], PF_R | PF_X, 0, BENCH_ELF_BASE, BENCH_ELF_TEXT_SIZE, BENCH_ELF_TEXT_SIZE);
+    SetProgramHeader(&phdrs[1], PF_R | PF_W, BENCH_ELF_TEXT_SIZE, BENCH_ELF_BASE + BENCH_ELF_TEXT_SIZE,
+                     BENCH_ELF_DATA_SIZE, BENCH_ELF_DATA_SIZE + BENCH_ELF_BSS_SIZE);
+
+    memcpy(reinterpret_cast<void*>(image + BENCH_ELF_ENTRY_OFFSET), UserFirstInstruction,
+           UserFirstInstructionEnd - UserFirstInstruction);
+}
+
+// cycles from start of loading until first instruction, averaged over iterations
+// if eager is set, every page of program is mapped before it starts
+static void TimeToFirstInstruction(u64 image, bool eager, u64* load_ns, u64* first_ns){
+    static const char* const argv[] = {"elf-bench"};
+    u64 load_cycles = 0, first_cycles = 0;
+
+    for(u64 i = 0; i < BENCH_ELF_ITERATIONS; i++){
+        u64 start = ReadTimestampCounter();
+        AddressSpace* space = CreateAddressSpace();
+        ELFProgram program;
+        LoadELF(space, image, BENCH_ELF_IMAGE_SIZE, 1, argv, &program);
+        if(eager){
+            IsUserRangeMapped(space, BENCH_ELF_BASE, BENCH_ELF_TEXT_SIZE + BENCH_ELF_DATA_SIZE + BENCH_ELF_BSS_SIZE);
+        }
+        Thread* thread = CreateUserThread("elf-bench", space, program.entry, program.stack_pointer, 0);
+        u64 loaded = ReadTimestampCounter();
+
+        StartThread(thread);
+        u64 first = JoinThread(thread);
+        DestroyAddressSpace(space);
+
+        load_cycles += loaded - start;
+        first_cycles += first - start;
+    }
+
+    *load_ns = CyclesToNanoseconds(load_cycles) / BENCH_ELF_ITERATIONS;
+    *first_ns = CyclesToNanoseconds(first_cycles) / BENCH_ELF_ITERATIONS;
+}
+
+void BenchmarkELF(){
+    ColorPrintf(COLOR_YELLOW, COLOR_BLACK, "[+] Benchmark : ELF Time To First Instruction (10 MiB)\n");
+
+    // one extra page, so that image can also be placed off page boundary
+    u64 num_pages = BENCH_ELF_IMAGE_SIZE / PAGE_SIZE + 1;
+    u64 buffer = AllocateKernelMemory(num_pages);
+
+    static const struct {
+        const char* name;
+        u64 offset;
+        bool eager;
+    } cases[] = {
+        {"lazy, zero copy", 0, false},
+        {"lazy, copied (unaligned image)", 8, false},
+        {"everything mapped up front", 0, true}
+    };
+
+    for(u64 c = 0; c < sizeof(cases) / sizeof(cases[0]); c++){
+        u64 image = buffer + cases[c].offset;
+        BuildBenchmarkImage(image);
+
+        u64 load_ns, first_ns;
+        TimeToFirstInstruction(image, cases[c].eager, &load_ns, &first_ns);
+        Printf("\tLoad : %lu ns | First Instruction : %lu ns | %s\n", load_ns, first_ns, cases[c].name);
+    }
+
+    FreeKernelMemory(buffer, num_pages);
+}
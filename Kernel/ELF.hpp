@@ -0,0 +1,92 @@
+/**
+ * @file ELF.hpp
+ * @author Siddharth Mishra (brightprogrammer)
+ * @date 10/18/26
+ * @brief Loader for static ELF64 executables.
+ * @copyright MIT License 2022 Siddharth Mishra
+ * */
+
+#ifndef ELF_HPP
+#define ELF_HPP
+
+#include "Common.hpp"
+
+struct AddressSpace;
+struct Thread;
+
+/* ------------------ ELF LOADING --------------------
+ *
+ * Nothing is copied or mapped when a program is loaded, except for top
+ * page of it's stack. Every PT_LOAD segment becomes a lazily mapped region
+ * (see AddUserRegion) backed by the image itself, so a program only pays
+ * for pages it touches :
+ *
+ *  - pages entirely inside file data are mapped straight from pages of the
+ *    image when segment's file offset and virtual address agree modulo page
+ *    size and image is page aligned (true for boot modules). Writable
+ *    segments get these pages copy on write.
+ *  - page holding the end of file data and start of .bss gets a private
+ *    copy with it's tail zeroed
+ *  - pages that are entirely .bss are zero filled on first touch
+ *
+ * Image must stay in memory as long as program runs. Boot modules are
+ * never freed, so programs are loaded straight from them.
+ *
+ * Initial stack follows System V ABI :
+ *
+ *   USER_STACK_TOP  ;-------------------;
+ *                   ; argument strings  ;
+ *                   ; AT_RANDOM bytes   ;
+ *                   ; padding           ;
+ *                   ; auxiliary vector  ; ends with AT_NULL
+ *                   ; 0                 ; end of envp
+ *                   ; 0                 ; end of argv
+ *                   ; argv pointers     ;
+ *   rsp ->          ; argc              ; 16 byte aligned
+ *                   ;-------------------;
+ *
+ * */
+
+// max number of argument strings given to a program
+#define ELF_MAX_ARGUMENTS 32
+// size of stack region of a program, mapped lazily
+#define ELF_STACK_SIZE (u64(8) * MB)
+
+/**
+ * @brief Where a loaded program starts.
+ * */
+struct ELFProgram {
+    u64 entry;
+    u64 stack_pointer;
+};
+
+/**
+ * @brief Load a static ELF64 executable in given address space and set up it's stack.
+ *
+ * @param space Address space to load program in, must have an empty user half.
+ * @param image Kernel address of ELF image.
+ * @param size Size of image in bytes.
+ * @param argc Number of arguments, at most ELF_MAX_ARGUMENTS.
+ * @param argv Argument strings.
+ * @param program Filled with entry point and initial stack pointer.
+ * @return false if image is not a valid executable.
+ * */
+bool LoadELF(AddressSpace* space, u64 image, u64 size, u64 argc, const char* const* argv, ELFProgram* program);
+
+/**
+ * @brief Load a boot module as a program in a new address space and create
+ * a thread for it. Thread doesn't run until it's started, and whoever joins
+ * it must destroy it's address space.
+ *
+ * @return Thread of program, or nullptr if there is no such module or it's
+ * not a valid executable.
+ * */
+Thread* ExecuteModule(const char* name, u64 argc, const char* const* argv);
+
+/**
+ * @brief Measure time from start of loading a 10 MiB program until it
+ * executes it's first instruction.
+ * */
+void BenchmarkELF();
+
+#endif // ELF_HPP
@@ -0,0 +1,1894 @@
+/**
+ * @file FAT32.cpp
+ * @author Siddharth Mishra (brightprogrammer)
+ * @date 10/18/26
+ * @brief FAT32 filesystem, read and write, on top of buffer cache.
+ * @copyright MIT License 2022 Siddharth Mishra
+ * */
+
+#include <new>
+
+#include "FAT32.hpp"
+#include "Block.hpp"
+#include "BufferCache.hpp"
+#include "Mutex.hpp"
+#include "Slab.hpp"
+#include "MemoryManager.hpp"
+#include "Timer.hpp"
+#include "VFS.hpp"
+#include "Printf.hpp"
+#include "String.hpp"
+
+// number of pinned FAT blocks
+#define FAT32_FAT_CACHE_SLOTS 64
+#define FAT32_NODE_BUCKETS 256
+
+#define FAT32_ENTRY_SIZE 32
+#define FAT32_ENTRY_MASK 0x0fffffff
+// entries at or above this end a chain
+#define FAT32_END_OF_CHAIN 0x0ffffff8
+#define FAT32_BAD_CLUSTER 0x0ffffff7
+// free cluster count in FSInfo is not known
+#define FAT32_UNKNOWN 0xffffffff
+// max number of entries in a directory
+#define FAT32_MAX_DIRECTORY_ENTRIES 65536
+// characters of a name in one long name entry
+#define FAT32_LONG_NAME_CHARS 13
+// first byte of a removed entry
+#define FAT32_REMOVED 0xe5
+// case flags of short names
+#define FAT32_LOWER_BASE 0x08
+#define FAT32_LOWER_EXTENSION 0x10
+// every timestamp we write, 1st Jan 2022
+#define FAT32_DATE (((2022 - 1980) << 9) | (1 << 5) | 1)
+// empty slot in directory hash table
+#define FAT32_NO_ENTRY 0xffffffff
+
+struct FAT32Run {
+    // first cluster of run in file
+    u32 file_cluster;
+    // first cluster of run on disk
+    u32 disk_cluster;
+    u32 length;
+};
+
+struct FAT32CachedEntry {
+    u32 hash;
+    // name is in name pool of directory
+    u32 name_offset;
+    u16 name_length;
+    u8 attributes;
+    bool removed;
+    // slot of short entry, and of first long name entry before it
+    u32 slot;
+    u32 first_slot;
+    u32 cluster;
+    u32 size;
+    u8 short_name[11];
+};
+
+// consecutive removed slots of a directory
+struct FAT32SlotRun {
+    u32 first;
+    u32 count;
+};
+
+struct FAT32DirectoryCache {
+    bool built;
+    FAT32CachedEntry* entries;
+    u64 entry_count;
+    u64 entry_pages;
+    char* names;
+    u64 names_used;
+    u64 name_pages;
+    // open addressing, holds indices of entries
+    u32* table;
+    u64 table_size;
+    u64 table_pages;
+    // first slot after last used one, new entries are appended here
+    u32 end_slot;
+    // entries that are not removed
+    u64 live_count;
+    // runs of removed slots sorted by slot, new entries go in one first
+    FAT32SlotRun* free_runs;
+    u64 free_run_count;
+    u64 free_run_pages;
+};
+
+struct FAT32Node {
+    FAT32Volume* volume;
+    // nullptr for root
+    FAT32Node* parent;
+    // slot of short entry in parent
+    u32 slot;
+    // index of entry in parent's directory cache
+    u32 cache_index;
+    u32 first_cluster;
+    u32 size;
+    u8 attributes;
+    bool removed;
+    u32 references;
+
+    // cluster runs, valid once runs_built is set
+    bool runs_built;
+    FAT32Run* runs;
+    u64 run_count;
+    u64 run_pages;
+
+    FAT32DirectoryCache directory;
+    FAT32Node* hash_next;
+};
+
+struct FAT32FATSlot {
+    u64 block;
+    Buffer* buffer;
+};
+
+struct FAT32Volume {
+    BlockDevice* device;
+    // where partition starts, in bytes
+    u64 offset;
+    u32 cluster_size;
+    u32 cluster_shift;
+    // absolute byte offsets
+    u64 fat_offset;
+    u64 fat_size;
+    u32 fat_count;
+    u64 data_offset;
+    u32 cluster_count;
+    u32 root_cluster;
+
+    // 0 if there is no FSInfo sector
+    u64 fsinfo_offset;
+    u32 free_count;
+    u32 next_free;
+    bool fsinfo_dirty;
+
+    // pinned blocks of first FAT, indexed by block % FAT32_FAT_CACHE_SLOTS
+    FAT32FATSlot fat_cache[FAT32_FAT_CACHE_SLOTS];
+    u64 fat_hits;
+    u64 fat_misses;
+    // one bit per block of first FAT modified since other FATs were updated
+    u8* fat_dirty;
+    u64 fat_dirty_pages;
+    u64 fat_first_block;
+    u64 fat_block_count;
+
+    FAT32Node* nodes[FAT32_NODE_BUCKETS];
+    FAT32Node* root;
+
+    // a page of zeros
+    u64 zero_page;
+    // a page for copying between FATs
+    u64 scratch_page;
+
+    // protects everything in volume and it's nodes
+    Mutex lock;
+
+    FAT32Volume() : lock("fat32.volume") {}
+};
+
+static SlabCache fat32_volume_cache("fat32.volume", sizeof(FAT32Volume));
+static SlabCache fat32_node_cache("fat32.node", sizeof(FAT32Node));
+
+static u16 Read16(const u8* p){
+    return u16(p[0]) | (u16(p[1]) << 8);
+}
+
+static u32 Read32(const u8* p){
+    return u32(Read16(p)) | (u32(Read16(p + 2)) << 16);
+}
+
+static u64 Read64(const u8* p){
+    return u64(Read32(p)) | (u64(Read32(p + 4)) << 32);
+}
+
+static void Write16(u8* p, u16 value){
+    p[0] = value & 0xff;
+    p[1] = value >> 8;
+}
+
+static void Write32(u8* p, u32 value){
+    Write16(p, value & 0xffff);
+    Write16(p + 2, value >> 16);
+}
+
+// grow a page allocated array so that it holds at least size bytes
+static bool GrowArray(void** array, u64* pages, u64 size){
+    if(size <= *pages * PAGE_SIZE) return true;
+
+    u64 new_pages = *pages ? *pages * 2 : 1;
+    while(new_pages * PAGE_SIZE < size) new_pages *= 2;
+    u64 memory = AllocateKernelMemory(new_pages);
+    if(memory == 0) return false;
+
+    if(*array){
+        memcpy(reinterpret_cast<void*>(memory), *array, *pages * PAGE_SIZE);
+        FreeKernelMemory(reinterpret_cast<u64>(*array), *pages);
+    }
+    *array = reinterpret_cast<void*>(memory);
+    *pages = new_pages;
+    return true;
+}
+
+static void FreeArray(void* array, u64 pages){
+    if(array) FreeKernelMemory(reinterpret_cast<u64>(array), pages);
+}
+
+static bool IsValidCluster(FAT32Volume* volume, u32 cluster){
+    return cluster >= 2 && cluster < volume->cluster_count + 2;
+}
+
+static u64 ClusterOffset(FAT32Volume* volume, u32 cluster){
+    return volume->data_offset + (u64(cluster - 2) << volume->cluster_shift);
+}
+
+/******************** FAT ********************/
+
+// get pointer to entry of a cluster in first FAT, through FAT cache
+static u8* GetFATEntry(FAT32Volume* volume, u32 cluster, Buffer** buffer){
+    u64 offset = volume->fat_offset + u64(cluster) * 4;
+    u64 block = offset / BUFFER_SIZE;
+    FAT32FATSlot* slot = &volume->fat_cache[block % FAT32_FAT_CACHE_SLOTS];
+
+    if(slot->buffer && slot->block == block){
+        volume->fat_hits++;
+    }else{
+        volume->fat_misses++;
+        Buffer* new_buffer = GetBuffer(volume->device, block);
+        if(new_buffer == nullptr) return nullptr;
+        if(slot->buffer) ReleaseBuffer(slot->buffer);
+        slot->buffer = new_buffer;
+        slot->block = block;
+    }
+
+    *buffer = slot->buffer;
+    return reinterpret_cast<u8*>(slot->buffer->data) + offset % BUFFER_SIZE;
+}
+
+// returns FAT32_UNKNOWN if FAT couldn't be read
+static u32 ReadFAT(FAT32Volume* volume, u32 cluster){
+    Buffer* buffer;
+    u8* entry = GetFATEntry(volume, cluster, &buffer);
+    if(entry == nullptr) return FAT32_UNKNOWN;
+    return Read32(entry) & FAT32_ENTRY_MASK;
+}
+
+static bool WriteFAT(FAT32Volume* volume, u32 cluster, u32 value){
+    Buffer* buffer;
+    u8* entry = GetFATEntry(volume, cluster, &buffer);
+    if(entry == nullptr) return false;
+
+    // top 4 bits are reserved and must be preserved
+    Write32(entry, (Read32(entry) & ~FAT32_ENTRY_MASK) | (value & FAT32_ENTRY_MASK));
+    MarkBufferDirty(buffer);
+
+    u64 index = buffer->block - volume->fat_first_block;
+    volume->fat_dirty[index / 8] |= 1 << (index % 8);
+    return true;
+}
+
+// take a free cluster, searching from hint, and end a chain with it
+// returns 0 if volume is full
+static u32 AllocateCluster(FAT32Volume* volume, u32 hint){
+    if(volume->free_count == 0) return 0;
+    if(!IsValidCluster(volume, hint)) hint = volume->next_free;
+    if(!IsValidCluster(volume, hint)) hint = 2;
+
+    for(u32 i = 0; i < volume->cluster_count; i++){
+        u32 cluster = 2 + (hint - 2 + i) % volume->cluster_count;
+        u32 value = ReadFAT(volume, cluster);
+        if(value == FAT32_UNKNOWN) return 0;
+        if(value != 0) continue;
+
+        if(!WriteFAT(volume, cluster, FAT32_ENTRY_MASK)) return 0;
+        if(volume->free_count != FAT32_UNKNOWN) volume->free_count--;
+        volume->next_free = cluster + 1;
+        volume->fsinfo_dirty = true;
+        return cluster;
+    }
+
+    volume->free_count = 0;
+    return 0;
+}
+
+static void FreeChain(FAT32Volume* volume, u32 cluster){
+    // a chain can't be longer than number of clusters, anything longer is a loop
+    for(u32 count = 0; IsValidCluster(volume, cluster) && count < volume->cluster_count; count++){
+        u32 next = ReadFAT(volume, cluster);
+        if(next == FAT32_UNKNOWN || !WriteFAT(volume, cluster, 0)) return;
+        if(volume->free_count != FAT32_UNKNOWN) volume->free_count++;
+        volume->fsinfo_dirty = true;
+        cluster = next;
+    }
+}
+
+static bool WriteZeros(BlockDevice* device, u64 zero_page, u64 offset, u64 size){
+    while(size){
+        u64 chunk = size < PAGE_SIZE ? size : PAGE_SIZE;
+        if(!WriteCached(device, offset, reinterpret_cast<void*>(zero_page), chunk)) return false;
+        offset += chunk;
+        size -= chunk;
+    }
+    return true;
+}
+
+// copy modified blocks of first FAT to other FATs and update FSInfo
+static bool WriteBackMetadata(FAT32Volume* volume){
+    bool ok = true;
+    for(u64 index = 0; index < volume->fat_block_count; index++){
+        if((volume->fat_dirty[index / 8] & (1 << (index % 8))) == 0) continue;
+        volume->fat_dirty[index / 8] &= ~(1 << (index % 8));
+
+        // part of block that belongs to first FAT
+        u64 start = (volume->fat_first_block + index) * BUFFER_SIZE;
+        u64 end = start + BUFFER_SIZE;
+        if(start < volume->fat_offset) start = volume->fat_offset;
+        if(end > volume->fat_offset + volume->fat_size) end = volume->fat_offset + volume->fat_size;
+
+        void* scratch = reinterpret_cast<void*>(volume->scratch_page);
+        if(!ReadCached(volume->device, start, scratch, end - start)){
+            ok = false;
+            continue;
+        }
+        for(u32 fat = 1; fat < volume->fat_count; fat++){
+            ok &= WriteCached(volume->device, start + fat * volume->fat_size, scratch, end - start);
+        }
+    }
+
+    if(volume->fsinfo_offset && volume->fsinfo_dirty){
+        u8 fsinfo[8];
+        Write32(fsinfo, volume->free_count);
+        Write32(fsinfo + 4, volume->next_free);
+        ok &= WriteCached(volume->device, volume->fsinfo_offset + 488, fsinfo, sizeof(fsinfo));
+        volume->fsinfo_dirty = false;
+    }
+
+    return ok;
+}
+
+/******************** Cluster Runs ********************/
+
+static u32 GetClusterCount(FAT32Node* node){
+    if(node->run_count == 0) return 0;
+    FAT32Run* last = &node->runs[node->run_count - 1];
+    return last->file_cluster + last->length;
+}
+
+// add a cluster at end of file
+static bool AppendCluster(FAT32Node* node, u32 cluster){
+    if(node->run_count){
+        FAT32Run* last = &node->runs[node->run_count - 1];
+        if(last->disk_cluster + last->length == cluster){
+            last->length++;
+            return true;
+        }
+    }
+
+    u32 file_cluster = GetClusterCount(node);
+    if(!GrowArray(reinterpret_cast<void**>(&node->runs), &node->run_pages, (node->run_count + 1) * sizeof(FAT32Run))){
+        return false;
+    }
+    FAT32Run* run = &node->runs[node->run_count++];
+    run->file_cluster = file_cluster;
+    run->disk_cluster = cluster;
+    run->length = 1;
+    return true;
+}
+
+// walk chain of a node once and turn it into runs
+static bool BuildRuns(FAT32Node* node){
+    if(node->runs_built) return true;
+
+    FAT32Volume* volume = node->volume;
+    node->run_count = 0;
+    u32 cluster = node->first_cluster;
+    for(u32 count = 0; IsValidCluster(volume, cluster); count++){
+        // longer than volume, chain loops
+        if(count >= volume->cluster_count) return false;
+        if(!AppendCluster(node, cluster)) return false;
+
+        cluster = ReadFAT(volume, cluster);
+        if(cluster == FAT32_UNKNOWN) return false;
+    }
+
+    node->runs_built = true;
+    return true;
+}
+
+// find byte offset on device of a byte in file, and how many bytes
+// after it are contiguous on device
+static bool MapOffset(FAT32Node* node, u64 offset, u64* device_offset, u64* contiguous){
+    FAT32Volume* volume = node->volume;
+    u32 file_cluster = offset >> volume->cluster_shift;
+
+    // binary search for first run that ends after file_cluster
+    u64 low = 0, high = node->run_count;
+    while(low < high){
+        u64 middle = (low + high) / 2;
+        FAT32Run* run = &node->runs[middle];
+        if(run->file_cluster + run->length <= file_cluster) low = middle + 1;
+        else high = middle;
+    }
+    if(low == node->run_count) return false;
+
+    FAT32Run* run = &node->runs[low];
+    u32 cluster = run->disk_cluster + (file_cluster - run->file_cluster);
+    *device_offset = ClusterOffset(volume, cluster) + (offset & (volume->cluster_size - 1));
+    *contiguous = (u64(run->file_cluster + run->length) << volume->cluster_shift) - offset;
+    return true;
+}
+
+// read or write a range that is inside allocated clusters of a node
+// src is nullptr to write zeros
+static bool TransferNode(FAT32Node* node, u64 offset, void* dst, const void* src, u64 size){
+    FAT32Volume* volume = node->volume;
+    while(size){
+        u64 device_offset, contiguous;
+        if(!MapOffset(node, offset, &device_offset, &contiguous)) return false;
+        u64 chunk = size < contiguous ? size : contiguous;
+
+        bool ok;
+        if(dst){
+            ok = ReadCached(volume->device, device_offset, dst, chunk);
+            dst = reinterpret_cast<u8*>(dst) + chunk;
+        }else if(src){
+            ok = WriteCached(volume->device, device_offset, src, chunk);
+            src = reinterpret_cast<const u8*>(src) + chunk;
+        }else{
+            ok = WriteZeros(volume->device, volume->zero_page, device_offset, chunk);
+        }
+        if(!ok) return false;
+
+        offset += chunk;
+        size -= chunk;
+    }
+    return true;
+}
+
+static bool IsDirectoryNode(FAT32Node* node){
+    return node->attributes & FAT32_ATTR_DIRECTORY;
+}
+
+// write first cluster and size of node to it's entry in parent
+static bool WriteNodeEntry(FAT32Node* node){
+    FAT32Node* parent = node->parent;
+    if(parent == nullptr || node->removed) return true;
+
+    u8 fields[8];
+    Write16(fields, node->first_cluster >> 16);
+    Write16(fields + 6, node->first_cluster & 0xffff);
+    u8 size[4];
+    Write32(size, IsDirectoryNode(node) ? 0 : node->size);
+
+    // cluster high is at 20, cluster low at 26 and size at 28
+    u64 device_offset, contiguous;
+    if(!BuildRuns(parent) || !MapOffset(parent, u64(node->slot) * FAT32_ENTRY_SIZE, &device_offset, &contiguous)) return false;
+    if(!WriteCached(node->volume->device, device_offset + 20, fields, 2)) return false;
+    if(!WriteCached(node->volume->device, device_offset + 26, fields + 6, 2)) return false;
+    if(!WriteCached(node->volume->device, device_offset + 28, size, 4)) return false;
+
+    FAT32CachedEntry* entry = &parent->directory.entries[node->cache_index];
+    entry->cluster = node->first_cluster;
+    entry->size = node->size;
+    return true;
+}
+
+// grow a node to given number of clusters, directories get zeroed clusters
+// on failure node keeps whatever could be allocated
+static bool ExtendNode(FAT32Node* node, u32 cluster_count){
+    FAT32Volume* volume = node->volume;
+    if(!BuildRuns(node)) return false;
+
+    u32 have = GetClusterCount(node);
+    if(have >= cluster_count) return true;
+
+    u32 last = 0;
+    if(have){
+        FAT32Run* run = &node->runs[node->run_count - 1];
+        last = run->disk_cluster + run->length - 1;
+    }
+
+    bool ok = true;
+    bool first_changed = false;
+    for(; have < cluster_count; have++){
+        // prefer cluster right after last one, so that file stays one run
+        u32 cluster = AllocateCluster(volume, last + 1);
+        if(cluster == 0){
+            ok = false;
+            break;
+        }
+        if(IsDirectoryNode(node) && !WriteZeros(volume->device, volume->zero_page, ClusterOffset(volume, cluster), volume->cluster_size)){
+            FreeChain(volume, cluster);
+            ok = false;
+            break;
+        }
+
+        if(last){
+            WriteFAT(volume, last, cluster);
+        }else{
+            node->first_cluster = cluster;
+            first_changed = true;
+        }
+        if(!AppendCluster(node, cluster)){
+            ok = false;
+            break;
+        }
+        last = cluster;
+    }
+
+    if(first_changed) ok &= WriteNodeEntry(node);
+    return ok;
+}
+
+/******************** Nodes ********************/
+
+static u64 HashNode(FAT32Node* parent, u32 slot){
+    u64 key = reinterpret_cast<u64>(parent) ^ (u64(slot) * 0x9e3779b97f4a7c15);
+    return (key ^ (key >> 29)) % FAT32_NODE_BUCKETS;
+}
+
+static FAT32Node* FindNode(FAT32Volume* volume, FAT32Node* parent, u32 slot){
+    FAT32Node* node = volume->nodes[HashNode(parent, slot)];
+    while(node && !(node->parent == parent && node->slot == slot)) node = node->hash_next;
+    return node;
+}
+
+static void UnhashNode(FAT32Node* node){
+    FAT32Node** link = &node->volume->nodes[HashNode(node->parent, node->slot)];
+    while(*link != node) link = &(*link)->hash_next;
+    *link = node->hash_next;
+}
+
+static void FreeDirectoryCache(FAT32DirectoryCache* directory){
+    FreeArray(directory->entries, directory->entry_pages);
+    FreeArray(directory->names, directory->name_pages);
+    FreeArray(directory->table, directory->table_pages);
+    FreeArray(directory->free_runs, directory->free_run_pages);
+    memset(directory, 0, sizeof(FAT32DirectoryCache));
+}
+
+static void FreeNode(FAT32Node* node){
+    FreeArray(node->runs, node->run_pages);
+    FreeDirectoryCache(&node->directory);
+    SlabFree(&fat32_node_cache, node);
+}
+
+// drop references until one doesn't reach 0
+static void ReleaseNode(FAT32Node* node){
+    while(node && --node->references == 0 && node->parent){
+        FAT32Node* parent = node->parent;
+        if(!node->removed) UnhashNode(node);
+        FreeNode(node);
+        node = parent;
+    }
+}
+
+static FAT32Node* NewNode(FAT32Volume* volume){
+    FAT32Node* node = reinterpret_cast<FAT32Node*>(SlabAllocate(&fat32_node_cache));
+    if(node == nullptr) return nullptr;
+    memset(node, 0, sizeof(FAT32Node));
+    node->volume = volume;
+    node->references = 1;
+    return node;
+}
+
+// get node of an entry in directory cache of parent
+static FAT32Node* GetNode(FAT32Node* parent, u32 index){
+    FAT32Volume* volume = parent->volume;
+    FAT32CachedEntry* entry = &parent->directory.entries[index];
+
+    FAT32Node* node = FindNode(volume, parent, entry->slot);
+    if(node){
+        node->references++;
+        return node;
+    }
+
+    node = NewNode(volume);
+    if(node == nullptr) return nullptr;
+    node->parent = parent;
+    node->slot = entry->slot;
+    node->cache_index = index;
+    node->first_cluster = entry->cluster;
+    node->size = entry->size;
+    node->attributes = entry->attributes;
+    parent->references++;
+
+    u64 bucket = HashNode(parent, entry->slot);
+    node->hash_next = volume->nodes[bucket];
+    volume->nodes[bucket] = node;
+    return node;
+}
+
+/******************** Directories ********************/
+
+static u32 HashName(const char* name, u64 length){
+    u32 hash = 2166136261u;
+    for(u64 i = 0; i < length; i++){
+        hash ^= u8(tolower(name[i]));
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static bool NamesEqual(const char* a, const char* b, u64 length){
+    for(u64 i = 0; i < length; i++){
+        if(tolower(a[i]) != tolower(b[i])) return false;
+    }
+    return true;
+}
+
+// put index of an entry in hash table, table must have a free slot
+static void InsertHashed(FAT32DirectoryCache* directory, u32 index){
+    u64 mask = directory->table_size - 1;
+    u64 position = directory->entries[index].hash & mask;
+    while(directory->table[position] != FAT32_NO_ENTRY) position = (position + 1) & mask;
+    directory->table[position] = index;
+}
+
+// keep table at most half full, removed entries are dropped while rehashing
+static bool ReserveHashed(FAT32DirectoryCache* directory){
+    if((directory->entry_count + 1) * 2 <= directory->table_size) return true;
+
+    u64 size = directory->table_size ? directory->table_size * 2 : PAGE_SIZE / sizeof(u32);
+    u64 pages = (size * sizeof(u32) + PAGE_SIZE - 1) / PAGE_SIZE;
+    u64 memory = AllocateKernelMemory(pages);
+    if(memory == 0) return false;
+
+    FreeArray(directory->table, directory->table_pages);
+    directory->table = reinterpret_cast<u32*>(memory);
+    directory->table_size = size;
+    directory->table_pages = pages;
+    memset(directory->table, 0xff, size * sizeof(u32));
+    for(u64 i = 0; i < directory->entry_count; i++){
+        if(!directory->entries[i].removed) InsertHashed(directory, i);
+    }
+    return true;
+}
+
+// returns index of new entry, or FAT32_NO_ENTRY
+static u32 AddCachedEntry(FAT32DirectoryCache* directory, const char* name, u64 length, const u8* entry, u32 slot, u32 first_slot){
+    if(!ReserveHashed(directory)) return FAT32_NO_ENTRY;
+    if(!GrowArray(reinterpret_cast<void**>(&directory->entries), &directory->entry_pages,
+                  (directory->entry_count + 1) * sizeof(FAT32CachedEntry))){
+        return FAT32_NO_ENTRY;
+    }
+    if(!GrowArray(reinterpret_cast<void**>(&directory->names), &directory->name_pages, directory->names_used + length)){
+        return FAT32_NO_ENTRY;
+    }
+
+    u32 index = directory->entry_count++;
+    FAT32CachedEntry* cached = &directory->entries[index];
+    cached->hash = HashName(name, length);
+    cached->name_offset = directory->names_used;
+    cached->name_length = length;
+    cached->attributes = entry[11];
+    cached->removed = false;
+    cached->slot = slot;
+    cached->first_slot = first_slot;
+    cached->cluster = (u32(Read16(entry + 20)) << 16) | Read16(entry + 26);
+    cached->size = Read32(entry + 28);
+    memcpy(cached->short_name, entry, 11);
+
+    memcpy(directory->names + directory->names_used, name, length);
+    directory->names_used += length;
+    directory->live_count++;
+    InsertHashed(directory, index);
+    return index;
+}
+
+static u32 FindCachedEntry(FAT32DirectoryCache* directory, const char* name, u64 length){
+    if(directory->table_size == 0) return FAT32_NO_ENTRY;
+
+    u32 hash = HashName(name, length);
+    u64 mask = directory->table_size - 1;
+    for(u64 position = hash & mask; directory->table[position] != FAT32_NO_ENTRY; position = (position + 1) & mask){
+        FAT32CachedEntry* entry = &directory->entries[directory->table[position]];
+        if(!entry->removed && entry->hash == hash && entry->name_length == length &&
+           NamesEqual(directory->names + entry->name_offset, name, length)){
+            return directory->table[position];
+        }
+    }
+    return FAT32_NO_ENTRY;
+}
+
+// add removed slots to free runs, merging them with runs next to them
+static bool AddFreeSlots(FAT32DirectoryCache* directory, u32 first, u32 count){
+    FAT32SlotRun* runs = directory->free_runs;
+    u64 run_count = directory->free_run_count;
+    // slots are mostly added in order while building, so search from end
+    u64 index = run_count;
+    while(index > 0 && runs[index - 1].first > first) index--;
+
+    bool join_previous = index > 0 && runs[index - 1].first + runs[index - 1].count == first;
+    bool join_next = index < run_count && first + count == runs[index].first;
+    if(join_previous && join_next){
+        runs[index - 1].count += count + runs[index].count;
+        for(u64 i = index + 1; i < run_count; i++) runs[i - 1] = runs[i];
+        directory->free_run_count--;
+        return true;
+    }
+    if(join_previous){
+        runs[index - 1].count += count;
+        return true;
+    }
+    if(join_next){
+        runs[index].first = first;
+        runs[index].count += count;
+        return true;
+    }
+
+    if(!GrowArray(reinterpret_cast<void**>(&directory->free_runs), &directory->free_run_pages,
+                  (run_count + 1) * sizeof(FAT32SlotRun))){
+        return false;
+    }
+    runs = directory->free_runs;
+    for(u64 i = run_count; i > index; i--) runs[i] = runs[i - 1];
+    runs[index].first = first;
+    runs[index].count = count;
+    directory->free_run_count++;
+    return true;
+}
+
+// find first run of removed slots that has room for count entries,
+// returns index of run or FAT32_NO_ENTRY
+static u32 FindFreeSlots(FAT32DirectoryCache* directory, u32 count){
+    for(u64 i = 0; i < directory->free_run_count; i++){
+        if(directory->free_runs[i].count >= count) return i;
+    }
+    return FAT32_NO_ENTRY;
+}
+
+// take count slots from start of a run found by FindFreeSlots
+static void UseFreeSlots(FAT32DirectoryCache* directory, u32 index, u32 count){
+    FAT32SlotRun* runs = directory->free_runs;
+    runs[index].first += count;
+    runs[index].count -= count;
+    if(runs[index].count != 0) return;
+
+    for(u64 i = index + 1; i < directory->free_run_count; i++) runs[i - 1] = runs[i];
+    directory->free_run_count--;
+}
+
+static u8 ShortNameChecksum(const u8* short_name){
+    u8 sum = 0;
+    for(u32 i = 0; i < 11; i++) sum = ((sum & 1) << 7) + (sum >> 1) + short_name[i];
+    return sum;
+}
+
+// turn a short entry into a name, returns length
+static u64 FormatShortName(const u8* entry, char* name){
+    u8 case_flags = entry[12];
+    u64 length = 0;
+    for(u32 i = 0; i < 8 && entry[i] != ' '; i++){
+        char c = (i == 0 && entry[0] == 0x05) ? char(FAT32_REMOVED) : char(entry[i]);
+        name[length++] = (case_flags & FAT32_LOWER_BASE) ? tolower(c) : c;
+    }
+    if(entry[8] != ' '){
+        name[length++] = '.';
+        for(u32 i = 8; i < 11 && entry[i] != ' '; i++){
+            name[length++] = (case_flags & FAT32_LOWER_EXTENSION) ? tolower(entry[i]) : entry[i];
+        }
+    }
+    return length;
+}
+
+// read a directory whole into it's cache
+static bool BuildDirectoryCache(FAT32Node* node){
+    FAT32DirectoryCache* directory = &node->directory;
+    if(directory->built) return true;
+    if(!BuildRuns(node)) return false;
+
+    FAT32Volume* volume = node->volume;
+    u64 slot_count = u64(GetClusterCount(node)) << (volume->cluster_shift - 5);
+    u8* cluster = reinterpret_cast<u8*>(volume->scratch_page);
+    u64 slots_per_page = PAGE_SIZE / FAT32_ENTRY_SIZE;
+
+    // long name being collected
+    u16 long_name[20 * FAT32_LONG_NAME_CHARS];
+    bool long_valid = false;
+    u32 long_next = 0;
+    u8 long_checksum = 0;
+    u32 long_first = 0;
+    char name[FAT32_NAME_MAX + 1];
+
+    directory->end_slot = slot_count;
+    bool ok = true;
+    for(u64 slot = 0; slot < slot_count && ok; slot++){
+        if(slot % slots_per_page == 0){
+            u64 size = (slot_count - slot) < slots_per_page ? (slot_count - slot) * FAT32_ENTRY_SIZE : PAGE_SIZE;
+            if(!TransferNode(node, slot * FAT32_ENTRY_SIZE, cluster, nullptr, size)){
+                FreeDirectoryCache(directory);
+                return false;
+            }
+        }
+        const u8* entry = cluster + (slot % slots_per_page) * FAT32_ENTRY_SIZE;
+
+        if(entry[0] == 0){
+            directory->end_slot = slot;
+            break;
+        }
+        if(entry[0] == FAT32_REMOVED){
+            long_valid = false;
+            ok = AddFreeSlots(directory, slot, 1);
+            continue;
+        }
+
+        if((entry[11] & 0x3f) == FAT32_ATTR_LONG_NAME){
+            u32 order = entry[0] & 0x1f;
+            if(entry[0] & 0x40){
+                if(order == 0 || order > 20){
+                    long_valid = false;
+                    continue;
+                }
+                long_valid = true;
+                long_checksum = entry[13];
+                long_first = slot;
+                memset(long_name, 0, sizeof(long_name));
+            }else if(!long_valid || order != long_next || entry[13] != long_checksum){
+                long_valid = false;
+                continue;
+            }
+
+            u16* chars = long_name + (order - 1) * FAT32_LONG_NAME_CHARS;
+            for(u32 i = 0; i < 5; i++) chars[i] = Read16(entry + 1 + i * 2);
+            for(u32 i = 0; i < 6; i++) chars[5 + i] = Read16(entry + 14 + i * 2);
+            for(u32 i = 0; i < 2; i++) chars[11 + i] = Read16(entry + 28 + i * 2);
+            long_next = order - 1;
+            continue;
+        }
+
+        // long name belongs to this entry only if it's complete and checksum matches
+        bool has_long_name = long_valid && long_next == 0 && long_checksum == ShortNameChecksum(entry);
+        u32 first_slot = has_long_name ? long_first : slot;
+        long_valid = false;
+
+        // volume labels and dot entries are not files
+        if(entry[11] & FAT32_ATTR_VOLUME_ID) continue;
+        if(entry[0] == '.') continue;
+
+        u64 length = 0;
+        if(has_long_name){
+            while(length < FAT32_NAME_MAX && long_name[length] != 0 && long_name[length] != 0xffff){
+                // only ascii is supported
+                name[length] = long_name[length] < 0x80 ? char(long_name[length]) : '?';
+                length++;
+            }
+        }
+        if(length == 0){
+            length = FormatShortName(entry, name);
+            first_slot = slot;
+        }
+
+        ok = AddCachedEntry(directory, name, length, entry, slot, first_slot) != FAT32_NO_ENTRY;
+    }
+
+    if(!ok || !ReserveHashed(directory)){
+        FreeDirectoryCache(directory);
+        return false;
+    }
+    directory->built = true;
+    return true;
+}
+
+static bool IsOneOf(char c, const char* set){
+    for(; *set; set++){
+        if(*set == c) return true;
+    }
+    return false;
+}
+
+static bool IsShortNameChar(char c){
+    if((c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9')) return true;
+    return IsOneOf(c, "$%'-_@~`!(){}^#&");
+}
+
+static bool IsLongNameChar(char c){
+    return IsShortNameChar(c) || IsOneOf(c, " +,;=[].");
+}
+
+// try to fit a name in a short entry, case of each part must be uniform
+static bool MakeShortName(const char* name, u64 length, u8* short_name, u8* case_flags){
+    memset(short_name, ' ', 11);
+    *case_flags = 0;
+
+    u64 dot = length;
+    for(u64 i = 0; i < length; i++){
+        if(name[i] == '.'){
+            if(dot != length) return false;
+            dot = i;
+        }else if(!IsShortNameChar(name[i])){
+            return false;
+        }
+    }
+    if(dot == 0 || dot > 8 || (dot < length && (length - dot - 1 == 0 || length - dot - 1 > 3))) return false;
+
+    for(u32 part = 0; part < 2; part++){
+        u64 start = part ? dot + 1 : 0;
+        u64 end = part ? length : dot;
+        bool upper = false, lower = false;
+        for(u64 i = start; i < end; i++){
+            upper |= name[i] >= 'A' && name[i] <= 'Z';
+            lower |= name[i] >= 'a' && name[i] <= 'z';
+            char c = name[i];
+            if(c >= 'a' && c <= 'z') c -= 'a' - 'A';
+            short_name[(part ? 8 : 0) + i - start] = c;
+        }
+        if(upper && lower) return false;
+        if(lower) *case_flags |= part ? FAT32_LOWER_EXTENSION : FAT32_LOWER_BASE;
+    }
+    if(short_name[0] == FAT32_REMOVED) short_name[0] = 0x05;
+    return true;
+}
+
+static bool ShortNameExists(FAT32DirectoryCache* directory, const u8* short_name){
+    for(u64 i = 0; i < directory->entry_count; i++){
+        if(!directory->entries[i].removed && memcmp(directory->entries[i].short_name, short_name, 11) == 0) return true;
+    }
+    return false;
+}
+
+// make a unique short alias for a long name
+// first few tries are BASIS~N, then a hash of name is mixed in
+static bool MakeShortAlias(FAT32DirectoryCache* directory, const char* name, u64 length, u8* short_name){
+    u64 dot = length;
+    for(u64 i = length; i > 0; i--){
+        if(name[i - 1] == '.'){
+            dot = i - 1;
+            break;
+        }
+    }
+
+    char base[8];
+    u64 base_length = 0;
+    for(u64 i = 0; i < dot && base_length < 6; i++){
+        if(name[i] == ' ' || name[i] == '.') continue;
+        char c = name[i];
+        if(c >= 'a' && c <= 'z') c -= 'a' - 'A';
+        base[base_length++] = IsShortNameChar(c) ? c : '_';
+    }
+    if(base_length == 0) base[base_length++] = '_';
+
+    memset(short_name, ' ', 11);
+    for(u64 i = dot + 1, j = 8; i < length && j < 11; i++){
+        if(name[i] == ' ') continue;
+        char c = name[i];
+        if(c >= 'a' && c <= 'z') c -= 'a' - 'A';
+        short_name[j++] = IsShortNameChar(c) ? c : '_';
+    }
+
+    u32 hash = HashName(name, length);
+    static const char hex[] = "0123456789ABCDEF";
+    for(u32 attempt = 1; attempt < 256; attempt++){
+        char candidate[9];
+        u64 candidate_length = 0;
+        if(attempt < 5){
+            memcpy(candidate, base, base_length);
+            candidate_length = base_length;
+            candidate[candidate_length++] = '~';
+            candidate[candidate_length++] = '0' + attempt;
+        }else{
+            u32 mixed = hash + attempt * 0x9e3779b9;
+            candidate_length = base_length < 2 ? base_length : 2;
+            memcpy(candidate, base, candidate_length);
+            for(u32 i = 0; i < 4; i++) candidate[candidate_length++] = hex[(mixed >> (12 - i * 4)) & 0xf];
+            candidate[candidate_length++] = '~';
+            candidate[candidate_length++] = '1';
+        }
+
+        memset(short_name, ' ', 8);
+        memcpy(short_name, candidate, candidate_length);
+        if(!ShortNameExists(directory, short_name)) return true;
+    }
+    return false;
+}
+
+static bool IsValidName(const char* name, u64 length){
+    if(length == 0 || length > FAT32_NAME_MAX) return false;
+    if(length <= 2 && name[0] == '.' && (length == 1 || name[1] == '.')) return false;
+    for(u64 i = 0; i < length; i++){
+        if(!IsLongNameChar(name[i])) return false;
+    }
+    return true;
+}
+
+static void FillShortEntry(u8* entry, const u8* short_name, u8 attributes, u8 case_flags, u32 cluster){
+    memset(entry, 0, FAT32_ENTRY_SIZE);
+    memcpy(entry, short_name, 11);
+    entry[11] = attributes;
+    entry[12] = case_flags;
+    // creation, access and modification dates
+    Write16(entry + 16, FAT32_DATE);
+    Write16(entry + 18, FAT32_DATE);
+    Write16(entry + 24, FAT32_DATE);
+    Write16(entry + 20, cluster >> 16);
+    Write16(entry + 26, cluster & 0xffff);
+}
+
+// write entries to consecutive slots of a directory
+static bool WriteSlots(FAT32Node* directory, u32 slot, const u8* entries, u32 count){
+    for(u32 i = 0; i < count; i++){
+        if(!TransferNode(directory, u64(slot + i) * FAT32_ENTRY_SIZE, nullptr, entries + i * FAT32_ENTRY_SIZE, FAT32_ENTRY_SIZE)){
+            return false;
+        }
+    }
+    return true;
+}
+
+/******************** Mount ********************/
+
+static bool IsFAT32BootSector(const u8* sector){
+    if(sector[510] != 0x55 || sector[511] != 0xaa) return false;
+    u16 sector_size = Read16(sector + 11);
+    u8 sectors_per_cluster = sector[13];
+    if(sector_size != 512 && sector_size != 1024 && sector_size != 2048 && sector_size != 4096) return false;
+    if(sectors_per_cluster == 0 || (sectors_per_cluster & (sectors_per_cluster - 1))) return false;
+    // FAT12 and FAT16 have a fixed root directory and a 16 bit FAT size
+    return Read16(sector + 14) != 0 && sector[16] != 0 && Read16(sector + 17) == 0 &&
+           Read16(sector + 22) == 0 && Read32(sector + 36) != 0;
+}
+
+// check if a FAT32 volume starts at a byte offset
+static bool ProbeFAT32(BlockDevice* device, u64 offset, u8* sector){
+    return offset + BLOCK_SECTOR_SIZE <= device->sector_count * BLOCK_SECTOR_SIZE &&
+           ReadCached(device, offset, sector, BLOCK_SECTOR_SIZE) && IsFAT32BootSector(sector);
+}
+
+// find start of a FAT32 volume, leaves it's boot sector in sector
+static bool FindFAT32(BlockDevice* device, u64* offset, u8* sector){
+    // whole device
+    *offset = 0;
+    if(ProbeFAT32(device, 0, sector)) return true;
+    if(sector[510] != 0x55 || sector[511] != 0xaa) return false;
+
+    u8 mbr[64];
+    memcpy(mbr, sector + 446, sizeof(mbr));
+    bool gpt = false;
+    for(u32 i = 0; i < 4; i++){
+        const u8* partition = mbr + i * 16;
+        // protective MBR of GPT disks has one partition of type 0xee
+        if(partition[4] == 0xee) gpt = true;
+        if(partition[4] != 0x0b && partition[4] != 0x0c && partition[4] != 0xef) continue;
+        *offset = u64(Read32(partition + 8)) * BLOCK_SECTOR_SIZE;
+        if(*offset && ProbeFAT32(device, *offset, sector)) return true;
+    }
+    if(!gpt) return false;
+
+    static const u8 esp_type[16] = {
+        0x28, 0x73, 0x2a, 0xc1, 0x1f, 0xf8, 0xd2, 0x11, 0xba, 0x4b, 0x00, 0xa0, 0xc9, 0x3e, 0xc9, 0x3b
+    };
+    static const u8 data_type[16] = {
+        0xa2, 0xa0, 0xd0, 0xeb, 0xe5, 0xb9, 0x33, 0x44, 0x87, 0xc0, 0x68, 0xb6, 0xb7, 0x26, 0x99, 0xc7
+    };
+
+    u8 header[92];
+    if(!ReadCached(device, BLOCK_SECTOR_SIZE, header, sizeof(header)) || memcmp(header, "EFI PART", 8) != 0) return false;
+    u64 entries = Read64(header + 72);
+    u32 entry_count = Read32(header + 80);
+    u32 entry_size = Read32(header + 84);
+    if(entry_size < 128 || entry_count > 128) return false;
+
+    for(u32 i = 0; i < entry_count; i++){
+        u8 entry[40];
+        if(!ReadCached(device, entries * BLOCK_SECTOR_SIZE + u64(i) * entry_size, entry, sizeof(entry))) return false;
+        if(memcmp(entry, esp_type, 16) != 0 && memcmp(entry, data_type, 16) != 0) continue;
+        *offset = Read64(entry + 32) * BLOCK_SECTOR_SIZE;
+        if(ProbeFAT32(device, *offset, sector)) return true;
+    }
+    return false;
+}
+
+static void DestroyVolume(FAT32Volume* volume){
+    for(u32 i = 0; i < FAT32_FAT_CACHE_SLOTS; i++){
+        if(volume->fat_cache[i].buffer) ReleaseBuffer(volume->fat_cache[i].buffer);
+    }
+    FreeArray(volume->fat_dirty, volume->fat_dirty_pages);
+    if(volume->zero_page) FreePage(volume->zero_page);
+    if(volume->scratch_page) FreePage(volume->scratch_page);
+    if(volume->root) FreeNode(volume->root);
+    SlabFree(&fat32_volume_cache, volume);
+}
+
+FAT32Volume* MountFAT32(BlockDevice* device){
+    u8 sector[BLOCK_SECTOR_SIZE];
+    u64 offset;
+    if(!FindFAT32(device, &offset, sector)) return nullptr;
+
+    u32 sector_size = Read16(sector + 11);
+    u32 cluster_size = sector_size * sector[13];
+    u64 reserved = Read16(sector + 14);
+    u32 fat_count = sector[16];
+    u64 total_sectors = Read16(sector + 19) ? Read16(sector + 19) : Read32(sector + 32);
+    u64 fat_sectors = Read32(sector + 36);
+    u64 data_sector = reserved + fat_count * fat_sectors;
+    if(data_sector >= total_sectors) return nullptr;
+    // buffer cache pages hold FAT entries, so a cluster must fit in a page
+    // or a page must be made of whole clusters, both are true up to 32KB
+    u64 cluster_count = (total_sectors - data_sector) / sector[13];
+    if(cluster_count < 65525 || cluster_count > FAT32_BAD_CLUSTER - 2) return nullptr;
+    if(cluster_count + 2 > fat_sectors * sector_size / 4) cluster_count = fat_sectors * sector_size / 4 - 2;
+
+    FAT32Volume* volume = new (SlabAllocate(&fat32_volume_cache)) FAT32Volume();
+    memset(volume->fat_cache, 0, sizeof(volume->fat_cache));
+    memset(volume->nodes, 0, sizeof(volume->nodes));
+    volume->device = device;
+    volume->offset = offset;
+    volume->cluster_size = cluster_size;
+    volume->cluster_shift = __builtin_ctz(cluster_size);
+    volume->fat_offset = offset + reserved * sector_size;
+    volume->fat_size = fat_sectors * sector_size;
+    volume->fat_count = fat_count;
+    volume->data_offset = offset + data_sector * sector_size;
+    volume->cluster_count = cluster_count;
+    volume->root_cluster = Read32(sector + 44);
+    volume->fsinfo_offset = 0;
+    volume->free_count = FAT32_UNKNOWN;
+    volume->next_free = 2;
+    volume->fsinfo_dirty = false;
+    volume->fat_hits = 0;
+    volume->fat_misses = 0;
+    volume->fat_first_block = volume->fat_offset / BUFFER_SIZE;
+    volume->fat_block_count = (volume->fat_offset + volume->fat_size - 1) / BUFFER_SIZE - volume->fat_first_block + 1;
+    volume->fat_dirty = nullptr;
+    volume->fat_dirty_pages = 0;
+    volume->zero_page = AllocatePage();
+    volume->scratch_page = AllocatePage();
+    volume->root = nullptr;
+    memset(reinterpret_cast<void*>(volume->zero_page), 0, PAGE_SIZE);
+
+    if(!GrowArray(reinterpret_cast<void**>(&volume->fat_dirty), &volume->fat_dirty_pages, (volume->fat_block_count + 7) / 8)){
+        DestroyVolume(volume);
+        return nullptr;
+    }
+    memset(volume->fat_dirty, 0, volume->fat_dirty_pages * PAGE_SIZE);
+
+    u16 fsinfo_sector = Read16(sector + 48);
+    if(fsinfo_sector && fsinfo_sector < reserved){
+        u8 fsinfo[BLOCK_SECTOR_SIZE];
+        u64 fsinfo_offset = offset + u64(fsinfo_sector) * sector_size;
+        if(ReadCached(device, fsinfo_offset, fsinfo, sizeof(fsinfo)) && Read32(fsinfo) == 0x41615252 &&
+           Read32(fsinfo + 484) == 0x61417272 && Read32(fsinfo + 508) == 0xaa550000){
+            volume->fsinfo_offset = fsinfo_offset;
+            if(Read32(fsinfo + 488) <= cluster_count) volume->free_count = Read32(fsinfo + 488);
+            if(IsValidCluster(volume, Read32(fsinfo + 492))) volume->next_free = Read32(fsinfo + 492);
+        }
+    }
+
+    FAT32Node* root = NewNode(volume);
+    if(root == nullptr || !IsValidCluster(volume, volume->root_cluster)){
+        if(root) FreeNode(root);
+        DestroyVolume(volume);
+        return nullptr;
+    }
+    root->first_cluster = volume->root_cluster;
+    root->attributes = FAT32_ATTR_DIRECTORY;
+    volume->root = root;
+    return volume;
+}
+
+void UnmountFAT32(FAT32Volume* volume){
+    SyncFAT32(volume);
+    DestroyVolume(volume);
+}
+
+bool FormatFAT32(BlockDevice* device){
+    if(device->read_only) return false;
+
+    // pick largest cluster upto 4KB that still makes this FAT32,
+    // FAT size is from formula in Microsoft's FAT specification
+    u64 sectors = device->sector_count;
+    u64 reserved = 32;
+    u32 sectors_per_cluster = 0;
+    u64 fat_sectors = 0;
+    u64 cluster_count = 0;
+    for(u32 spc = 8; spc; spc /= 2){
+        u64 divisor = (256 * spc + 2) / 2;
+        if(sectors <= reserved) return false;
+        fat_sectors = (sectors - reserved + divisor - 1) / divisor;
+        cluster_count = (sectors - reserved - 2 * fat_sectors) / spc;
+        if(cluster_count >= 65525){
+            sectors_per_cluster = spc;
+            break;
+        }
+    }
+    if(sectors_per_cluster == 0 || cluster_count > FAT32_BAD_CLUSTER - 2) return false;
+
+    u8* page = reinterpret_cast<u8*>(AllocatePage());
+    memset(page, 0, PAGE_SIZE);
+
+    // boot sector
+    u8* boot = page;
+    boot[0] = 0xeb;
+    boot[1] = 0x58;
+    boot[2] = 0x90;
+    memcpy(boot + 3, "MOSS    ", 8);
+    Write16(boot + 11, BLOCK_SECTOR_SIZE);
+    boot[13] = sectors_per_cluster;
+    Write16(boot + 14, reserved);
+    boot[16] = 2;
+    boot[21] = 0xf8;
+    Write16(boot + 24, 32);
+    Write16(boot + 26, 64);
+    Write32(boot + 32, sectors);
+    Write32(boot + 36, fat_sectors);
+    Write32(boot + 44, 2);
+    Write16(boot + 48, 1);
+    Write16(boot + 50, 6);
+    boot[64] = 0x80;
+    boot[66] = 0x29;
+    Write32(boot + 67, u32(GetUptimeNanoseconds()));
+    memcpy(boot + 71, "NO NAME    FAT32   ", 19);
+    boot[510] = 0x55;
+    boot[511] = 0xaa;
+
+    // FSInfo, root directory takes cluster 2
+    u8* fsinfo = page + BLOCK_SECTOR_SIZE;
+    Write32(fsinfo, 0x41615252);
+    Write32(fsinfo + 484, 0x61417272);
+    Write32(fsinfo + 488, cluster_count - 1);
+    Write32(fsinfo + 492, 3);
+    Write32(fsinfo + 508, 0xaa550000);
+
+    u64 zero_page = AllocatePage();
+    memset(reinterpret_cast<void*>(zero_page), 0, PAGE_SIZE);
+
+    // reserved sectors with backup of boot sector and FSInfo at 6,
+    // then both FATs and root directory's cluster right after them
+    u64 fat_offset = reserved * BLOCK_SECTOR_SIZE;
+    u64 fat_size = fat_sectors * BLOCK_SECTOR_SIZE;
+    bool ok = WriteZeros(device, zero_page, 0, reserved * BLOCK_SECTOR_SIZE) &&
+              WriteCached(device, 0, page, 2 * BLOCK_SECTOR_SIZE) &&
+              WriteCached(device, 6 * BLOCK_SECTOR_SIZE, page, 2 * BLOCK_SECTOR_SIZE) &&
+              WriteZeros(device, zero_page, fat_offset, 2 * fat_size + BLOCK_SECTOR_SIZE * sectors_per_cluster);
+
+    // media descriptor, reserved entry and end of root directory's chain
+    u8 first_entries[12];
+    Write32(first_entries, 0x0ffffff8);
+    Write32(first_entries + 4, 0x0fffffff);
+    Write32(first_entries + 8, 0x0fffffff);
+    for(u32 fat = 0; fat < 2 && ok; fat++){
+        ok = WriteCached(device, fat_offset + fat * fat_size, first_entries, sizeof(first_entries));
+    }
+    ok = ok && SyncBufferCache(device);
+
+    FreePage(zero_page);
+    FreePage(reinterpret_cast<u64>(page));
+    return ok;
+}
+
+bool SyncFAT32(FAT32Volume* volume){
+    bool ok;
+    {
+        LockGuard guard(volume->lock);
+        ok = WriteBackMetadata(volume);
+    }
+    return SyncBufferCache(volume->device) && ok;
+}
+
+/******************** Nodes and Files ********************/
+
+FAT32Node* GetFAT32Root(FAT32Volume* volume){
+    LockGuard guard(volume->lock);
+    volume->root->references++;
+    return volume->root;
+}
+
+FAT32Volume* GetFAT32Volume(FAT32Node* node){
+    return node->volume;
+}
+
+void FAT32Reference(FAT32Node* node){
+    LockGuard guard(node->volume->lock);
+    node->references++;
+}
+
+void FAT32Release(FAT32Node* node){
+    LockGuard guard(node->volume->lock);
+    ReleaseNode(node);
+}
+
+bool FAT32IsDirectory(FAT32Node* node){
+    return IsDirectoryNode(node);
+}
+
+u64 FAT32GetSize(FAT32Node* node){
+    return node->size;
+}
+
+u64 FAT32GetNodeId(FAT32Node* node){
+    // parent's first cluster and slot never change while a file exists,
+    // parent's cluster is at least 2 so no other node gets root's id
+    if(node->parent == nullptr) return 1;
+    return (u64(node->parent->first_cluster) << 32) | node->slot;
+}
+
+FAT32Node* FAT32Lookup(FAT32Node* directory, const char* name, u64 length){
+    FAT32Volume* volume = directory->volume;
+    LockGuard guard(volume->lock);
+    if(!IsDirectoryNode(directory) || directory->removed) return nullptr;
+
+    if(length == 1 && name[0] == '.'){
+        directory->references++;
+        return directory;
+    }
+    if(length == 2 && name[0] == '.' && name[1] == '.'){
+        FAT32Node* parent = directory->parent ? directory->parent : directory;
+        parent->references++;
+        return parent;
+    }
+
+    if(!BuildDirectoryCache(directory)) return nullptr;
+    u32 index = FindCachedEntry(&directory->directory, name, length);
+    if(index == FAT32_NO_ENTRY) return nullptr;
+    return GetNode(directory, index);
+}
+
+FAT32Node* FAT32OpenPath(FAT32Volume* volume, const char* path){
+    FAT32Node* node = GetFAT32Root(volume);
+    while(node && *path){
+        if(*path == '/'){
+            path++;
+            continue;
+        }
+
+        u64 length = 0;
+        while(path[length] && path[length] != '/') length++;
+        FAT32Node* next = FAT32Lookup(node, path, length);
+        FAT32Release(node);
+        node = next;
+        path += length;
+    }
+    return node;
+}
+
+u64 FAT32Read(FAT32Node* node, u64 offset, void* buffer, u64 size){
+    LockGuard guard(node->volume->lock);
+    if(!BuildRuns(node)) return ~u64(0);
+
+    u64 end = IsDirectoryNode(node) ? u64(GetClusterCount(node)) << node->volume->cluster_shift : node->size;
+    if(offset >= end) return 0;
+    if(size > end - offset) size = end - offset;
+
+    if(!TransferNode(node, offset, buffer, nullptr, size)) return ~u64(0);
+    return size;
+}
+
+u64 FAT32Write(FAT32Node* node, u64 offset, const void* buffer, u64 size){
+    FAT32Volume* volume = node->volume;
+    LockGuard guard(volume->lock);
+    if(IsDirectoryNode(node) || node->removed || volume->device->read_only) return ~u64(0);
+
+    // files can't be 4GB or larger
+    u64 end = offset + size;
+    if(end > 0xffffffff) end = 0xffffffff;
+    if(offset >= end) return size ? ~u64(0) : 0;
+
+    // on a full volume write whatever fits in clusters we could get
+    u64 clusters = (end + volume->cluster_size - 1) >> volume->cluster_shift;
+    ExtendNode(node, clusters);
+    u64 allocated = u64(GetClusterCount(node)) << volume->cluster_shift;
+    if(end > allocated) end = allocated;
+    if(offset >= end) return 0;
+
+    // gap between old end of file and write reads as zeros
+    if(offset > node->size && !TransferNode(node, node->size, nullptr, nullptr, offset - node->size)) return ~u64(0);
+    if(!TransferNode(node, offset, nullptr, buffer, end - offset)) return ~u64(0);
+
+    if(end > node->size){
+        node->size = end;
+        if(!WriteNodeEntry(node)) return ~u64(0);
+    }
+    return end - offset;
+}
+
+bool FAT32Truncate(FAT32Node* node, u64 size){
+    FAT32Volume* volume = node->volume;
+    LockGuard guard(volume->lock);
+    if(IsDirectoryNode(node) || node->removed || volume->device->read_only || size > 0xffffffff) return false;
+    if(!BuildRuns(node)) return false;
+
+    u32 keep = (size + volume->cluster_size - 1) >> volume->cluster_shift;
+    if(size > node->size){
+        if(!ExtendNode(node, keep)) return false;
+        if(!TransferNode(node, node->size, nullptr, nullptr, size - node->size)) return false;
+    }else if(keep < GetClusterCount(node)){
+        // find run holding first cluster to free and cut runs there
+        u64 index = 0;
+        while(node->runs[index].file_cluster + node->runs[index].length <= keep) index++;
+        FAT32Run* run = &node->runs[index];
+        u32 first_free = run->disk_cluster + (keep - run->file_cluster);
+
+        if(keep == 0){
+            node->first_cluster = 0;
+        }else{
+            u32 last_kept = keep - 1 >= run->file_cluster ? first_free - 1 : node->runs[index - 1].disk_cluster + node->runs[index - 1].length - 1;
+            WriteFAT(volume, last_kept, FAT32_ENTRY_MASK);
+        }
+        FreeChain(volume, first_free);
+
+        if(run->file_cluster == keep){
+            node->run_count = index;
+        }else{
+            run->length = keep - run->file_cluster;
+            node->run_count = index + 1;
+        }
+    }
+
+    node->size = size;
+    return WriteNodeEntry(node);
+}
+
+FAT32Node* FAT32Create(FAT32Node* directory, const char* name, u64 length, bool is_directory){
+    FAT32Volume* volume = directory->volume;
+    LockGuard guard(volume->lock);
+    if(!IsDirectoryNode(directory) || directory->removed || volume->device->read_only) return nullptr;
+    if(!IsValidName(name, length) || !BuildDirectoryCache(directory)) return nullptr;
+
+    FAT32DirectoryCache* cache = &directory->directory;
+    if(FindCachedEntry(cache, name, length) != FAT32_NO_ENTRY) return nullptr;
+
+    // names that fit in 8.3 don't need long name entries
+    u8 short_name[11];
+    u8 case_flags;
+    u32 long_count = 0;
+    if(MakeShortName(name, length, short_name, &case_flags)){
+        if(ShortNameExists(cache, short_name)) return nullptr;
+    }else{
+        case_flags = 0;
+        long_count = (length + FAT32_LONG_NAME_CHARS - 1) / FAT32_LONG_NAME_CHARS;
+        if(!MakeShortAlias(cache, name, length, short_name)) return nullptr;
+    }
+
+    // slots of removed entries are reused, otherwise entries are appended
+    // and directory grows to make room for them
+    u32 slot_count = long_count + 1;
+    u32 free_run = FindFreeSlots(cache, slot_count);
+    u32 first_slot = free_run != FAT32_NO_ENTRY ? cache->free_runs[free_run].first : cache->end_slot;
+    if(free_run == FAT32_NO_ENTRY){
+        if(first_slot + slot_count > FAT32_MAX_DIRECTORY_ENTRIES) return nullptr;
+        u64 clusters = ((u64(first_slot) + slot_count) * FAT32_ENTRY_SIZE + volume->cluster_size - 1) >> volume->cluster_shift;
+        if(!ExtendNode(directory, clusters)) return nullptr;
+    }
+
+    u32 cluster = 0;
+    if(is_directory){
+        cluster = AllocateCluster(volume, 0);
+        if(cluster == 0) return nullptr;
+
+        // "." and "..", ".." of a child of root points to cluster 0
+        u8 dots[2 * FAT32_ENTRY_SIZE];
+        u8 dot_name[11];
+        memset(dot_name, ' ', 11);
+        dot_name[0] = '.';
+        FillShortEntry(dots, dot_name, FAT32_ATTR_DIRECTORY, 0, cluster);
+        dot_name[1] = '.';
+        FillShortEntry(dots + FAT32_ENTRY_SIZE, dot_name, FAT32_ATTR_DIRECTORY, 0,
+                       directory->parent ? directory->first_cluster : 0);
+
+        u64 offset = ClusterOffset(volume, cluster);
+        if(!WriteZeros(volume->device, volume->zero_page, offset, volume->cluster_size) || !WriteCached(volume->device, offset, dots, sizeof(dots))){
+            FreeChain(volume, cluster);
+            return nullptr;
+        }
+    }
+
+    // long name entries come before short entry, last part of name first
+    u8 entries[21 * FAT32_ENTRY_SIZE];
+    FillShortEntry(entries + long_count * FAT32_ENTRY_SIZE, short_name,
+                   is_directory ? FAT32_ATTR_DIRECTORY : FAT32_ATTR_ARCHIVE, case_flags, cluster);
+    u8 checksum = ShortNameChecksum(short_name);
+    for(u32 i = 0; i < long_count; i++){
+        u32 order = long_count - i;
+        u8* entry = entries + i * FAT32_ENTRY_SIZE;
+        memset(entry, 0, FAT32_ENTRY_SIZE);
+        entry[0] = order | (i == 0 ? 0x40 : 0);
+        entry[11] = FAT32_ATTR_LONG_NAME;
+        entry[13] = checksum;
+
+        // name ends with a 0 and rest of entry is padded with 0xffff
+        static const u8 char_offsets[FAT32_LONG_NAME_CHARS] = {1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30};
+        for(u32 j = 0; j < FAT32_LONG_NAME_CHARS; j++){
+            u64 position = (order - 1) * FAT32_LONG_NAME_CHARS + j;
+            u16 c = position < length ? u8(name[position]) : (position == length ? 0 : 0xffff);
+            Write16(entry + char_offsets[j], c);
+        }
+    }
+
+    if(!WriteSlots(directory, first_slot, entries, slot_count)){
+        if(cluster) FreeChain(volume, cluster);
+        return nullptr;
+    }
+    if(free_run != FAT32_NO_ENTRY){
+        UseFreeSlots(cache, free_run, slot_count);
+    }else{
+        cache->end_slot = first_slot + slot_count;
+    }
+
+    u32 index = AddCachedEntry(cache, name, length, entries + long_count * FAT32_ENTRY_SIZE, first_slot + long_count, first_slot);
+    if(index == FAT32_NO_ENTRY) return nullptr;
+    return GetNode(directory, index);
+}
+
+bool FAT32Remove(FAT32Node* directory, const char* name, u64 length){
+    FAT32Volume* volume = directory->volume;
+    LockGuard guard(volume->lock);
+    if(!IsDirectoryNode(directory) || directory->removed || volume->device->read_only) return false;
+    if(!BuildDirectoryCache(directory)) return false;
+
+    FAT32DirectoryCache* cache = &directory->directory;
+    u32 index = FindCachedEntry(cache, name, length);
+    if(index == FAT32_NO_ENTRY) return false;
+    FAT32CachedEntry* entry = &cache->entries[index];
+
+    FAT32Node* node = FindNode(volume, directory, entry->slot);
+    if(entry->attributes & FAT32_ATTR_DIRECTORY){
+        FAT32Node* child = GetNode(directory, index);
+        if(child == nullptr) return false;
+        bool empty = BuildDirectoryCache(child) && child->directory.live_count == 0;
+        ReleaseNode(child);
+        if(!empty) return false;
+        node = FindNode(volume, directory, entry->slot);
+    }
+
+    u8 removed = FAT32_REMOVED;
+    for(u32 slot = entry->first_slot; slot <= entry->slot; slot++){
+        if(!TransferNode(directory, u64(slot) * FAT32_ENTRY_SIZE, nullptr, &removed, 1)) return false;
+    }
+
+    // an open node of removed file keeps working on nothing,
+    // it's out of hash so that slot can be reused
+    if(node){
+        UnhashNode(node);
+        node->removed = true;
+        node->first_cluster = 0;
+        node->size = 0;
+        node->run_count = 0;
+        node->runs_built = true;
+    }
+    FreeChain(volume, entry->cluster);
+    entry->removed = true;
+    cache->live_count--;
+    // slots are only lost for reuse if this fails
+    AddFreeSlots(cache, entry->first_slot, entry->slot - entry->first_slot + 1);
+    return true;
+}
+
+bool FAT32ReadDirectory(FAT32Node* directory, u64* cookie, FAT32DirectoryEntry* entry){
+    LockGuard guard(directory->volume->lock);
+    if(!IsDirectoryNode(directory) || directory->removed || !BuildDirectoryCache(directory)) return false;
+
+    FAT32DirectoryCache* cache = &directory->directory;
+    while(*cookie < cache->entry_count){
+        FAT32CachedEntry* cached = &cache->entries[(*cookie)++];
+        if(cached->removed) continue;
+
+        memcpy(entry->name, cache->names + cached->name_offset, cached->name_length);
+        entry->name[cached->name_length] = 0;
+        entry->attributes = cached->attributes;
+        entry->size = cached->size;
+        return true;
+    }
+    return false;
+}
+
+/******************** VFS ********************/
+
+static void FillNodeInfo(FAT32Node* node, VFSNodeInfo* info){
+    info->node = node;
+    info->id = FAT32GetNodeId(node);
+    info->type = IsDirectoryNode(node) ? VFS_TYPE_DIRECTORY : VFS_TYPE_FILE;
+    info->size = node->size;
+    info->cache = nullptr;
+}
+
+static bool VFSLookup(Inode* directory, const char* name, u64 length, VFSNodeInfo* info){
+    FAT32Node* node = FAT32Lookup(reinterpret_cast<FAT32Node*>(directory->node), name, length);
+    if(node == nullptr) return false;
+    FillNodeInfo(node, info);
+    return true;
+}
+
+static bool VFSCreate(Inode* directory, const char* name, u64 length, u32 type, VFSNodeInfo* info){
+    FAT32Node* node = FAT32Create(reinterpret_cast<FAT32Node*>(directory->node), name, length, type == VFS_TYPE_DIRECTORY);
+    if(node == nullptr) return false;
+    FillNodeInfo(node, info);
+    return true;
+}
+
+static bool VFSRemoveName(Inode* directory, const char* name, u64 length){
+    return FAT32Remove(reinterpret_cast<FAT32Node*>(directory->node), name, length);
+}
+
+static u64 VFSReadNode(Inode* inode, u64 offset, void* buffer, u64 size){
+    return FAT32Read(reinterpret_cast<FAT32Node*>(inode->node), offset, buffer, size);
+}
+
+static u64 VFSWriteNode(Inode* inode, u64 offset, const void* buffer, u64 size){
+    return FAT32Write(reinterpret_cast<FAT32Node*>(inode->node), offset, buffer, size);
+}
+
+static bool VFSTruncateNode(Inode* inode, u64 size){
+    return FAT32Truncate(reinterpret_cast<FAT32Node*>(inode->node), size);
+}
+
+static bool VFSReadNodeDirectory(Inode* directory, u64* cookie, VFSDirectoryEntry* entry){
+    FAT32DirectoryEntry fat_entry;
+    if(!FAT32ReadDirectory(reinterpret_cast<FAT32Node*>(directory->node), cookie, &fat_entry)) return false;
+
+    memcpy(entry->name, fat_entry.name, sizeof(entry->name));
+    entry->type = (fat_entry.attributes & FAT32_ATTR_DIRECTORY) ? VFS_TYPE_DIRECTORY : VFS_TYPE_FILE;
+    entry->size = fat_entry.size;
+    return true;
+}
+
+static void VFSReleaseNode(Mount*, void* node){
+    FAT32Release(reinterpret_cast<FAT32Node*>(node));
+}
+
+static bool VFSSyncVolume(Mount* mount){
+    return SyncFAT32(reinterpret_cast<FAT32Volume*>(mount->data));
+}
+
+static void VFSUnmountVolume(Mount* mount){
+    UnmountFAT32(reinterpret_cast<FAT32Volume*>(mount->data));
+}
+
+static const VFSOperations fat32_operations = {
+    "fat32", true,
+    VFSLookup, VFSCreate, VFSRemoveName,
+    VFSReadNode, VFSWriteNode, VFSTruncateNode,
+    VFSReadNodeDirectory, VFSReleaseNode, VFSSyncVolume, VFSUnmountVolume
+};
+
+bool VFSMountFAT32(const char* path, FAT32Volume* volume){
+    VFSNodeInfo root;
+    FillNodeInfo(GetFAT32Root(volume), &root);
+    if(VFSMount(path, &fat32_operations, volume, &root, volume->device)) return true;
+
+    FAT32Release(reinterpret_cast<FAT32Node*>(root.node));
+    return false;
+}
+
+/******************** FAT32 Benchmark ********************/
+
+#define BENCH_FAT32_CHUNK (64 * 1024)
+#define BENCH_FAT32_LOOKUPS 100000
+#define BENCH_FAT32_FILES 1000
+#define BENCH_FAT32_LONG_FILES 200
+#define BENCH_FAT32_LARGE_FILE (u64(32) * MB)
+#define BENCH_FAT32_MAX_DEPTH 8
+
+struct FAT32WalkResult {
+    u64 directories;
+    u64 files;
+    u64 largest_size;
+    char largest_path[FAT32_NAME_MAX + 1];
+};
+
+// walk a tree and remember largest file in it
+static void WalkFAT32(FAT32Node* directory, char* path, u64 path_length, u32 depth, FAT32WalkResult* result){
+    result->directories++;
+    FAT32DirectoryEntry entry;
+    u64 cookie = 0;
+    while(FAT32ReadDirectory(directory, &cookie, &entry)){
+        u64 length = strlen(entry.name);
+        if(path_length + 1 + length >= FAT32_NAME_MAX) continue;
+        path[path_length] = '/';
+        memcpy(path + path_length + 1, entry.name, length + 1);
+
+        if(entry.attributes & FAT32_ATTR_DIRECTORY){
+            if(depth + 1 >= BENCH_FAT32_MAX_DEPTH) continue;
+            FAT32Node* child = FAT32Lookup(directory, entry.name, length);
+            if(child == nullptr) continue;
+            WalkFAT32(child, path, path_length + 1 + length, depth + 1, result);
+            FAT32Release(child);
+        }else{
+            result->files++;
+            if(entry.size > result->largest_size){
+                result->largest_size = entry.size;
+                memcpy(result->largest_path, path, path_length + 1 + length + 1);
+            }
+        }
+    }
+    path[path_length] = 0;
+}
+
+// read a file in chunks, returns MB/s
+static u64 ReadFAT32File(FAT32Node* file, u64 buffer){
+    u64 size = FAT32GetSize(file);
+    u64 start = GetUptimeNanoseconds();
+    for(u64 offset = 0; offset < size; offset += BENCH_FAT32_CHUNK){
+        if(FAT32Read(file, offset, reinterpret_cast<void*>(buffer), BENCH_FAT32_CHUNK) == ~u64(0)) return 0;
+    }
+    u64 ns = GetUptimeNanoseconds() - start;
+    return ns ? size * 1000 / ns : 0;
+}
+
+static u64 OperationsPerSecond(u64 count, u64 ns){
+    return ns ? count * 1000000000 / ns : 0;
+}
+
+static void BenchmarkBootVolume(u64 buffer){
+    BlockDevice* device = FindBlockDevice("vda");
+    if(device == nullptr && GetBlockDeviceCount()) device = GetBlockDevice(0);
+    FAT32Volume* volume = device ? MountFAT32(device) : nullptr;
+    if(volume == nullptr){
+        Printf("\tNo FAT32 boot volume\n");
+        return;
+    }
+    Printf("\tBoot volume : %s at %lu MB | %u clusters of %u bytes\n", device->name,
+           volume->offset / MB, volume->cluster_count, volume->cluster_size);
+
+    FAT32WalkResult* result = reinterpret_cast<FAT32WalkResult*>(buffer);
+    memset(result, 0, sizeof(FAT32WalkResult));
+    char path[FAT32_NAME_MAX + 1];
+    path[0] = 0;
+    FAT32Node* root = GetFAT32Root(volume);
+    u64 start = GetUptimeNanoseconds();
+    WalkFAT32(root, path, 0, 0, result);
+    u64 ns = GetUptimeNanoseconds() - start;
+    Printf("\tWalk : %lu directories, %lu files in %lu us\n", result->directories, result->files, ns / 1000);
+
+    if(result->largest_size == 0){
+        FAT32Release(root);
+        UnmountFAT32(volume);
+        return;
+    }
+    memcpy(path, result->largest_path, sizeof(path));
+
+    FAT32Node* file = FAT32OpenPath(volume, path);
+    if(file){
+        u64 size = FAT32GetSize(file);
+        u64 first = ReadFAT32File(file, buffer);
+        u64 second = ReadFAT32File(file, buffer);
+        Printf("\tSequential read of %s (%lu KB) : %lu MB/s first, %lu MB/s cached | %lu runs\n",
+               path, size / KB, first, second, file->run_count);
+
+        // name lookups in parent held open hit directory hash,
+        // full path opens rebuild caches that were dropped with last reference
+        FAT32Node* parent = file->parent;
+        FAT32Reference(parent);
+        const char* name = path + strlen(path);
+        while(name > path && name[-1] != '/') name--;
+        u64 length = strlen(name);
+
+        start = GetUptimeNanoseconds();
+        for(u64 i = 0; i < BENCH_FAT32_LOOKUPS; i++) FAT32Release(FAT32Lookup(parent, name, length));
+        ns = GetUptimeNanoseconds() - start;
+        Printf("\tLookups in cached directory : %lu/s\n", OperationsPerSecond(BENCH_FAT32_LOOKUPS, ns));
+        FAT32Release(parent);
+        FAT32Release(file);
+
+        start = GetUptimeNanoseconds();
+        for(u64 i = 0; i < BENCH_FAT32_LOOKUPS / 100; i++){
+            FAT32Node* node = FAT32OpenPath(volume, path);
+            if(node) FAT32Release(node);
+        }
+        ns = GetUptimeNanoseconds() - start;
+        Printf("\tPath opens without cached directories : %lu/s\n", OperationsPerSecond(BENCH_FAT32_LOOKUPS / 100, ns));
+    }
+
+    FAT32Release(root);
+    UnmountFAT32(volume);
+}
+
+static void BenchmarkScratchVolume(u64 buffer){
+    BlockDevice* device = FindBlockDevice("nvme0n1");
+    if(device == nullptr){
+        Printf("\tNo scratch disk for writes\n");
+        return;
+    }
+
+    u64 start = GetUptimeNanoseconds();
+    FAT32Volume* volume = FormatFAT32(device) ? MountFAT32(device) : nullptr;
+    if(volume == nullptr){
+        Printf("\tFailed to format %s\n", device->name);
+        return;
+    }
+    Printf("\tFormatted %s in %lu ms | %u clusters of %u bytes\n", device->name,
+           (GetUptimeNanoseconds() - start) / 1000000, volume->cluster_count, volume->cluster_size);
+
+    FAT32Node* root = GetFAT32Root(volume);
+    FAT32Node* directory = FAT32Create(root, "bench", 5, true);
+    if(directory == nullptr){
+        Printf("\tFailed to create directory\n");
+        FAT32Release(root);
+        UnmountFAT32(volume);
+        return;
+    }
+
+    // small files with 8.3 names, each with one cluster of data
+    char name[64];
+    start = GetUptimeNanoseconds();
+    for(u64 i = 0; i < BENCH_FAT32_FILES; i++){
+        sprintf(name, "file%i.dat", i32(i));
+        FAT32Node* file = FAT32Create(directory, name, strlen(name), false);
+        if(file == nullptr) break;
+        FAT32Write(file, 0, reinterpret_cast<void*>(buffer), volume->cluster_size);
+        FAT32Release(file);
+    }
+    u64 create_ns = GetUptimeNanoseconds() - start;
+
+    start = GetUptimeNanoseconds();
+    u64 found = 0;
+    for(u64 i = 0; i < BENCH_FAT32_FILES; i++){
+        sprintf(name, "FILE%i.DAT", i32(i));
+        FAT32Node* file = FAT32Lookup(directory, name, strlen(name));
+        if(file){
+            found++;
+            FAT32Release(file);
+        }
+    }
+    u64 lookup_ns = GetUptimeNanoseconds() - start;
+
+    FAT32DirectoryEntry* entry = reinterpret_cast<FAT32DirectoryEntry*>(buffer + BENCH_FAT32_CHUNK - PAGE_SIZE);
+    u64 cookie = 0, listed = 0;
+    start = GetUptimeNanoseconds();
+    while(FAT32ReadDirectory(directory, &cookie, entry)) listed++;
+    u64 list_ns = GetUptimeNanoseconds() - start;
+
+    start = GetUptimeNanoseconds();
+    u64 removed = 0;
+    for(u64 i = 0; i < BENCH_FAT32_FILES; i++){
+        sprintf(name, "file%i.dat", i32(i));
+        removed += FAT32Remove(directory, name, strlen(name));
+    }
+    u64 remove_ns = GetUptimeNanoseconds() - start;
+
+    Printf("\t%lu files : create+write %lu/s | lookup %lu/s (%lu found) | list %lu/s | remove %lu/s (%lu removed)\n",
+           u64(BENCH_FAT32_FILES), OperationsPerSecond(BENCH_FAT32_FILES, create_ns),
+           OperationsPerSecond(BENCH_FAT32_FILES, lookup_ns), found,
+           OperationsPerSecond(listed, list_ns), OperationsPerSecond(BENCH_FAT32_FILES, remove_ns), removed);
+
+    // long names need long name entries and a unique short alias
+    start = GetUptimeNanoseconds();
+    u64 created = 0;
+    for(u64 i = 0; i < BENCH_FAT32_LONG_FILES; i++){
+        sprintf(name, "A long file name number %i.text", i32(i));
+        FAT32Node* file = FAT32Create(directory, name, strlen(name), false);
+        if(file == nullptr) break;
+        created++;
+        FAT32Release(file);
+    }
+    u64 long_ns = GetUptimeNanoseconds() - start;
+    Printf("\t%lu long name creates : %lu/s\n", created, OperationsPerSecond(created, long_ns));
+
+    // one large file, written and synced, then read back
+    FAT32Node* file = FAT32Create(root, "large.bin", 9, false);
+    if(file){
+        memset(reinterpret_cast<void*>(buffer), 0x5a, BENCH_FAT32_CHUNK);
+        start = GetUptimeNanoseconds();
+        u64 written = 0;
+        for(u64 offset = 0; offset < BENCH_FAT32_LARGE_FILE; offset += BENCH_FAT32_CHUNK){
+            u64 count = FAT32Write(file, offset, reinterpret_cast<void*>(buffer), BENCH_FAT32_CHUNK);
+            if(count == ~u64(0) || count == 0) break;
+            written += count;
+        }
+        u64 write_ns = GetUptimeNanoseconds() - start;
+        SyncFAT32(volume);
+        u64 sync_ns = GetUptimeNanoseconds() - start;
+        u64 read = ReadFAT32File(file, buffer);
+
+        Printf("\tLarge file %lu MB : write %lu MB/s | with sync %lu MB/s | read %lu MB/s | %lu runs\n",
+               written / MB, write_ns ? written * 1000 / write_ns : 0, sync_ns ? written * 1000 / sync_ns : 0,
+               read, file->run_count);
+        FAT32Release(file);
+    }
+
+    u64 lookups = volume->fat_hits + volume->fat_misses;
+    Printf("\tFAT cache : %lu lookups | hits %lu%%\n", lookups, lookups ? volume->fat_hits * 100 / lookups : 0);
+
+    FAT32Release(directory);
+    FAT32Release(root);
+    UnmountFAT32(volume);
+}
+
+void BenchmarkFAT32(){
+    ColorPrintf(COLOR_YELLOW, COLOR_BLACK, "[+] Benchmark : FAT32\n");
+
+    u64 pages = BENCH_FAT32_CHUNK / PAGE_SIZE;
+    u64 buffer = AllocateKernelMemory(pages);
+    BenchmarkBootVolume(buffer);
+    BenchmarkScratchVolume(buffer);
+    FreeKernelMemory(buffer, pages);
+}
@@ -0,0 +1,178 @@
+/**
+ * @file FAT32.hpp
+ * @author Siddharth Mishra (brightprogrammer)
+ * @date 10/18/26
+ * @brief FAT32 filesystem, read and write, on top of buffer cache.
+ * @copyright MIT License 2022 Siddharth Mishra
+ * */
+
+#ifndef FAT32_HPP
+#define FAT32_HPP
+
+#include "Common.hpp"
+
+struct BlockDevice;
+struct FAT32Volume;
+struct FAT32Node;
+
+/* ------------------ FAT32 --------------------
+ *
+ * A volume is found on a whole device, in a GPT partition (ESP or basic
+ * data) or in an MBR partition. Everything goes through buffer cache.
+ *
+ * Three things keep metadata off the device as much as possible :
+ *
+ *  - FAT cache : blocks of first FAT are pinned in a small direct mapped
+ *    cache, so following a chain doesn't even touch buffer cache locks.
+ *    Other FAT copies are brought up to date when volume is synced.
+ *
+ *  - cluster runs : chain of a file is walked once, when it's first
+ *    needed, and turned into a sorted array of runs of consecutive
+ *    clusters. Seeking is a binary search over runs, and a read that
+ *    stays in a run is a single read from cache.
+ *
+ *  - directory hash : first lookup in a directory reads it whole into a
+ *    hash table of names (long names included), later lookups and
+ *    creates don't read directory again.
+ *
+ * Nodes are shared : looking up an open file again gives same node.
+ * Every node holds a reference to it's parent directory, so directory
+ * caches of an open file's ancestors stay around as long as it's open.
+ *
+ * */
+
+#define FAT32_ATTR_READ_ONLY 0x01
+#define FAT32_ATTR_HIDDEN 0x02
+#define FAT32_ATTR_SYSTEM 0x04
+#define FAT32_ATTR_VOLUME_ID 0x08
+#define FAT32_ATTR_DIRECTORY 0x10
+#define FAT32_ATTR_ARCHIVE 0x20
+#define FAT32_ATTR_LONG_NAME 0x0f
+
+// longest name, without null terminator
+#define FAT32_NAME_MAX 255
+
+struct FAT32DirectoryEntry {
+    char name[FAT32_NAME_MAX + 1];
+    u8 attributes;
+    u32 size;
+};
+
+/**
+ * @brief Find a FAT32 volume on device and mount it.
+ *
+ * @return nullptr if there is none.
+ * */
+FAT32Volume* MountFAT32(BlockDevice* device);
+
+/**
+ * @brief Write back and forget a volume. Every node except root must
+ * have been released.
+ * */
+void UnmountFAT32(FAT32Volume* volume);
+
+/**
+ * @brief Create an empty FAT32 volume spanning whole device,
+ * without a partition table.
+ * */
+bool FormatFAT32(BlockDevice* device);
+
+/**
+ * @brief Write back everything modified on volume, including other FATs
+ * and FSInfo, and wait until it's on device.
+ * */
+bool SyncFAT32(FAT32Volume* volume);
+
+/**
+ * @brief Get root directory, referenced.
+ * */
+FAT32Node* GetFAT32Root(FAT32Volume* volume);
+
+/**
+ * @brief Get volume a node belongs to.
+ * */
+FAT32Volume* GetFAT32Volume(FAT32Node* node);
+
+/**
+ * @brief Find a name in a directory, case insensitively.
+ *
+ * @return Referenced node, or nullptr if there is no such name.
+ * */
+FAT32Node* FAT32Lookup(FAT32Node* directory, const char* name, u64 length);
+
+/**
+ * @brief Look up a path relative to root, components separated by '/'.
+ * */
+FAT32Node* FAT32OpenPath(FAT32Volume* volume, const char* path);
+
+/**
+ * @brief Take another reference to a node.
+ * */
+void FAT32Reference(FAT32Node* node);
+
+/**
+ * @brief Drop a reference to a node.
+ * */
+void FAT32Release(FAT32Node* node);
+
+bool FAT32IsDirectory(FAT32Node* node);
+u64 FAT32GetSize(FAT32Node* node);
+
+/**
+ * @brief Number that stays same for a file as long as it exists.
+ * */
+u64 FAT32GetNodeId(FAT32Node* node);
+
+/**
+ * @brief Read from a file.
+ *
+ * @return Number of bytes read, smaller than size at end of file,
+ * or ~0 on error.
+ * */
+u64 FAT32Read(FAT32Node* node, u64 offset, void* buffer, u64 size);
+
+/**
+ * @brief Write to a file, growing it if needed. A gap between old end
+ * of file and offset reads back as zeros.
+ *
+ * @return Number of bytes written, smaller than size if volume is full,
+ * or ~0 on error.
+ * */
+u64 FAT32Write(FAT32Node* node, u64 offset, const void* buffer, u64 size);
+
+/**
+ * @brief Change size of a file, freeing clusters or zero filling.
+ * */
+bool FAT32Truncate(FAT32Node* node, u64 size);
+
+/**
+ * @brief Create a file or directory in a directory.
+ *
+ * @return Referenced node, or nullptr if name exists or volume is full.
+ * */
+FAT32Node* FAT32Create(FAT32Node* directory, const char* name, u64 length, bool is_directory);
+
+/**
+ * @brief Remove a file or an empty directory.
+ * */
+bool FAT32Remove(FAT32Node* directory, const char* name, u64 length);
+
+/**
+ * @brief Iterate a directory. Cookie starts at 0.
+ *
+ * @return false once there are no more entries.
+ * */
+bool FAT32ReadDirectory(FAT32Node* directory, u64* cookie, FAT32DirectoryEntry* entry);
+
+/**
+ * @brief Mount a volume in VFS. Volume is unmounted along with it.
+ * */
+bool VFSMountFAT32(const char* path, FAT32Volume* volume);
+
+/**
+ * @brief Sequential read of a large file on boot volume, and metadata
+ * operations and large writes on a freshly formatted NVMe scratch disk.
+ * */
+void BenchmarkFAT32();
+
+#endif // FAT32_HPP
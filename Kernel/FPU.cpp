@@ -0,0 +1,387 @@
+/**
+ * @file FPU.cpp
+ * @author Siddharth Mishra (brightprogrammer)
+ * @date 10/18/26
+ * @brief Lazy x87/SSE/AVX state management and kernel fpu sections.
+ * @copyright MIT License 2022 Siddharth Mishra
+ * */
+
+#include "FPU.hpp"
+#include "CPU.hpp"
+#include "SMP.hpp"
+#include "Thread.hpp"
+#include "Scheduler.hpp"
+#include "Slab.hpp"
+#include "String.hpp"
+#include "Printf.hpp"
+#include "PanicPrintf.hpp"
+#include "Timer.hpp"
+#include "MemoryManager.hpp"
+#include "VectorMemory.hpp"
+
+/* ------------------ HOW LAZY FPU WORKS --------------------
+ *
+ * Whenever a cpu switches threads, CR0.TS is set. The first fpu/sse/avx
+ * instruction after that raises #NM, whose handler clears TS and loads
+ * state of current thread. Threads that never touch fpu registers never
+ * pay for saving or restoring them.
+ *
+ * If a thread used fpu during it's time slice, it's state is saved when
+ * it's switched out. Cpu remembers whose state is still in it's registers
+ * (fpu_owner_id), so if same thread comes back and nobody else used fpu
+ * in between, #NM handler only has to clear TS.
+ *
+ * Kernel code is compiled without vector registers, except for files in
+ * KERNEL_SIMD_SRCS. Code from these files must run between KernelFpuBegin
+ * and KernelFpuEnd, which save state of owning thread, disable preemption
+ * and allow fpu use until the section ends.
+ *
+ * */
+
+// instruction used to save and restore state, best available is picked
+enum class FPUSaveMode : u8 {
+    FXSave,
+    XSave,
+    XSaveOpt,
+    XSaves
+};
+
+// ids never given to a thread, used when no thread owns registers
+#define FPU_NO_OWNER (~u64(0))
+
+// offsets in legacy region of save area
+#define FPU_FCW_OFFSET 0
+#define FPU_MXCSR_OFFSET 24
+// offset of XCOMP_BV in xsave header
+#define FPU_XCOMP_BV_OFFSET 520
+#define FPU_XCOMP_BV_COMPACTED (u64(1) << 63)
+
+// default control words after reset
+#define FPU_DEFAULT_FCW 0x37f
+#define FPU_DEFAULT_MXCSR 0x1f80
+
+// state components enabled in xcr0
+#define XCR0_X87 (u64(1) << 0)
+#define XCR0_SSE (u64(1) << 1)
+#define XCR0_AVX (u64(1) << 2)
+
+#define MSR_XSS 0xda0
+
+static FPUSaveMode save_mode = FPUSaveMode::FXSave;
+static u64 xcr0 = 0;
+static bool avx_enabled = false;
+
+// save areas must be 64 byte aligned for xsave, size is known only at runtime
+static SlabCache fpu_state_cache("fpu.state", 0, 64);
+
+// initial state every thread starts with, copied to new save areas
+static void* initial_fpu_state = nullptr;
+static u64 fpu_state_size = 512;
+
+static inline void SaveState(void* area){
+    u32 low = u32(xcr0), high = u32(xcr0 >> 32);
+    switch(save_mode){
+        case FPUSaveMode::FXSave :
+            asm volatile("fxsave64 (%0)" :: "r"(area) : "memory");
+            break;
+        case FPUSaveMode::XSave :
+            asm volatile("xsave64 (%0)" :: "r"(area), "a"(low), "d"(high) : "memory");
+            break;
+        case FPUSaveMode::XSaveOpt :
+            asm volatile("xsaveopt64 (%0)" :: "r"(area), "a"(low), "d"(high) : "memory");
+            break;
+        case FPUSaveMode::XSaves :
+            asm volatile("xsaves64 (%0)" :: "r"(area), "a"(low), "d"(high) : "memory");
+            break;
+    }
+}
+
+static inline void RestoreState(void* area){
+    u32 low = u32(xcr0), high = u32(xcr0 >> 32);
+    switch(save_mode){
+        case FPUSaveMode::FXSave :
+            asm volatile("fxrstor64 (%0)" :: "r"(area) : "memory");
+            break;
+        case FPUSaveMode::XSave :
+        case FPUSaveMode::XSaveOpt :
+            asm volatile("xrstor64 (%0)" :: "r"(area), "a"(low), "d"(high) : "memory");
+            break;
+        case FPUSaveMode::XSaves :
+            asm volatile("xrstors64 (%0)" :: "r"(area), "a"(low), "d"(high) : "memory");
+            break;
+    }
+}
+
+// make fpu instructions trap on current cpu
+static inline void DisableFPUAccess(CPU* cpu){
+    if(cpu->fpu_live){
+        WriteCR0(ReadCR0() | CR0_TASK_SWITCHED);
+        cpu->fpu_live = false;
+    }
+}
+
+static inline void EnableFPUAccess(CPU* cpu){
+    if(!cpu->fpu_live){
+        ClearTaskSwitched();
+        cpu->fpu_live = true;
+    }
+}
+
+void EnableFPU(){
+    u64 cr0 = ReadCR0();
+    cr0 &= ~CR0_EMULATION;
+    // fpu instructions trap when TS is set, errors are reported as exceptions
+    cr0 |= CR0_MONITOR_COPROCESSOR | CR0_NUMERIC_ERROR | CR0_TASK_SWITCHED;
+    WriteCR0(cr0);
+
+    u64 cr4 = ReadCR4() | CR4_OSFXSR | CR4_OSXMMEXCPT;
+    if(save_mode != FPUSaveMode::FXSave){
+        cr4 |= CR4_OSXSAVE;
+    }
+    WriteCR4(cr4);
+
+    if(save_mode != FPUSaveMode::FXSave){
+        WriteXCR(0, xcr0);
+    }
+    if(save_mode == FPUSaveMode::XSaves){
+        // no supervisor state components
+        WriteMSR(MSR_XSS, 0);
+    }
+
+    CPU* cpu = GetCurrentCPU();
+    cpu->fpu_live = false;
+    cpu->fpu_owner_id = FPU_NO_OWNER;
+}
+
+void InitializeFPU(){
+    u32 eax, ebx, ecx, edx;
+    CPUID(1, 0, eax, ebx, ecx, edx);
+    bool has_xsave = ecx & (1 << 26);
+    bool has_avx = ecx & (1 << 28);
+
+    xcr0 = XCR0_X87 | XCR0_SSE;
+    if(has_xsave){
+        save_mode = FPUSaveMode::XSave;
+        if(has_avx){
+            xcr0 |= XCR0_AVX;
+            avx_enabled = true;
+        }
+
+        CPUID(0xd, 1, eax, ebx, ecx, edx);
+        if(eax & (1 << 3)) save_mode = FPUSaveMode::XSaves;
+        else if(eax & (1 << 0)) save_mode = FPUSaveMode::XSaveOpt;
+    }
+
+    EnableFPU();
+
+    // sizes reported by cpuid depend on xcr0, so this is done after enabling
+    if(save_mode == FPUSaveMode::XSaves){
+        CPUID(0xd, 1, eax, ebx, ecx, edx);
+        fpu_state_size = ebx;
+    }else if(save_mode != FPUSaveMode::FXSave){
+        CPUID(0xd, 0, eax, ebx, ecx, edx);
+        fpu_state_size = ebx;
+    }
+    fpu_state_cache.object_size = fpu_state_size;
+
+    // zeroed header means every component starts in it's init state,
+    // except control words which are always loaded from legacy region
+    u8* initial = reinterpret_cast<u8*>(SlabAllocate(&fpu_state_cache));
+    memset(initial, 0, fpu_state_size);
+    *reinterpret_cast<u16*>(initial + FPU_FCW_OFFSET) = FPU_DEFAULT_FCW;
+    *reinterpret_cast<u32*>(initial + FPU_MXCSR_OFFSET) = FPU_DEFAULT_MXCSR;
+    if(save_mode == FPUSaveMode::XSaves){
+        *reinterpret_cast<u64*>(initial + FPU_XCOMP_BV_OFFSET) = FPU_XCOMP_BV_COMPACTED | xcr0;
+    }
+    initial_fpu_state = initial;
+
+    static const char* mode_names[] = {"fxsave", "xsave", "xsaveopt", "xsaves"};
+    Printf("\tFPU : %s | AVX : %s | State Size : %lu bytes\n",
+           mode_names[u8(save_mode)], avx_enabled ? "yes" : "no", fpu_state_size);
+}
+
+bool IsAVXEnabled(){
+    return avx_enabled;
+}
+
+void SaveFPUStateOnSwitch(Thread* prev){
+    CPU* cpu = GetCurrentCPU();
+    if(!cpu->fpu_live) return;
+
+    // thread touched fpu in this time slice, registers may be modified
+    if(cpu->fpu_owner_id == prev->id && prev->fpu_state){
+        SaveState(prev->fpu_state);
+    }
+    DisableFPUAccess(cpu);
+}
+
+void HandleFPUTrap(){
+    CPU* cpu = GetCurrentCPU();
+    Thread* thread = cpu->current_thread;
+
+    // fpu used outside a kernel fpu section before scheduler started,
+    // this is a bug, sse code must not run outside KernelFpuBegin/End
+    if(thread == nullptr || cpu->kernel_fpu_depth){
+        PanicPrintf("Caught #DEVICE_NOT_AVAILABLE outside a thread\n");
+        while(true) asm("hlt");
+    }
+
+    EnableFPUAccess(cpu);
+
+    // registers still hold this thread's state
+    if(cpu->fpu_owner_id == thread->id && thread->fpu_cpu == cpu->id){
+        return;
+    }
+
+    if(thread->fpu_state == nullptr){
+        thread->fpu_state = SlabAllocate(&fpu_state_cache);
+        memcpy(thread->fpu_state, initial_fpu_state, fpu_state_size);
+    }
+
+    RestoreState(thread->fpu_state);
+    cpu->fpu_owner_id = thread->id;
+    thread->fpu_cpu = cpu->id;
+}
+
+void CopyFPUState(Thread* child){
+    Thread* thread = GetCurrentThread();
+    if(thread->fpu_state == nullptr) return;
+
+    // registers may hold newer state than save area, an empty kernel
+    // section saves them
+    KernelFpuBegin();
+    KernelFpuEnd();
+
+    child->fpu_state = SlabAllocate(&fpu_state_cache);
+    memcpy(child->fpu_state, thread->fpu_state, fpu_state_size);
+}
+
+void FreeFPUState(Thread* thread){
+    if(thread->fpu_state){
+        SlabFree(&fpu_state_cache, thread->fpu_state);
+        thread->fpu_state = nullptr;
+    }
+}
+
+void KernelFpuBegin(){
+    DisablePreemption();
+    u64 flags = SaveFlagsAndDisableInterrupts();
+
+    CPU* cpu = GetCurrentCPU();
+    if(cpu->kernel_fpu_depth++ == 0){
+        // registers may hold live state of current thread, save it
+        Thread* thread = cpu->current_thread;
+        if(cpu->fpu_live && thread && cpu->fpu_owner_id == thread->id && thread->fpu_state){
+            SaveState(thread->fpu_state);
+        }
+
+        // we're going to clobber registers
+        cpu->fpu_owner_id = FPU_NO_OWNER;
+        EnableFPUAccess(cpu);
+    }
+
+    RestoreFlags(flags);
+}
+
+void KernelFpuEnd(){
+    u64 flags = SaveFlagsAndDisableInterrupts();
+
+    CPU* cpu = GetCurrentCPU();
+    if(--cpu->kernel_fpu_depth == 0){
+        // next user of fpu has to restore it's state
+        DisableFPUAccess(cpu);
+    }
+
+    RestoreFlags(flags);
+    EnablePreemption();
+}
+
+// copies smaller than this aren't worth the cost of an fpu section
+#define VECTOR_MEMCPY_THRESHOLD 512
+
+void* VectorMemcpy(void* dst, const void* src, u64 n){
+    if(n < VECTOR_MEMCPY_THRESHOLD){
+        return memcpy(dst, src, n);
+    }
+
+    KernelFpuBegin();
+    if(avx_enabled){
+        VectorCopyAVX(dst, src, n);
+    }else{
+        VectorCopySSE2(dst, src, n);
+    }
+    KernelFpuEnd();
+
+    return dst;
+}
+
+/******************** FPU Benchmark ********************/
+
+#define BENCH_FPU_SECTIONS 100000
+#define BENCH_COPY_PAGES 256
+#define BENCH_COPY_ITERATIONS 8
+
+static u64 bench_src_pages[BENCH_COPY_PAGES];
+static u64 bench_dst_pages[BENCH_COPY_PAGES];
+
+typedef void* (*CopyFunction)(void* dst, const void* src, u64 n);
+
+static void* PlainMemcpy(void* dst, const void* src, u64 n){
+    return memcpy(dst, src, n);
+}
+
+// copy all benchmark pages in chunks of given size, return best cycles
+static u64 TimeCopy(CopyFunction copy, u64 chunk){
+    u64 best = ~u64(0);
+    for(u32 iter = 0; iter < BENCH_COPY_ITERATIONS; iter++){
+        u64 start = ReadTimestampCounterSerialized();
+        for(u64 p = 0; p < BENCH_COPY_PAGES; p++){
+            for(u64 off = 0; off < PAGE_SIZE; off += chunk){
+                copy(reinterpret_cast<void*>(bench_dst_pages[p] + off),
+                     reinterpret_cast<void*>(bench_src_pages[p] + off), chunk);
+            }
+        }
+        u64 cycles = ReadTimestampCounterSerialized() - start;
+        if(cycles < best) best = cycles;
+    }
+    return best;
+}
+
+void BenchmarkFPU(){
+    ColorPrintf(COLOR_YELLOW, COLOR_BLACK, "[+] Benchmark : Kernel FPU Sections\n");
+
+    u64 start = ReadTimestampCounterSerialized();
+    for(u64 i = 0; i < BENCH_FPU_SECTIONS; i++){
+        KernelFpuBegin();
+        KernelFpuEnd();
+    }
+    u64 cycles = ReadTimestampCounterSerialized() - start;
+    Printf("\tKernelFpuBegin + KernelFpuEnd : %lu cycles\n", cycles / BENCH_FPU_SECTIONS);
+
+    for(u64 i = 0; i < BENCH_COPY_PAGES; i++){
+        bench_src_pages[i] = AllocatePage();
+        bench_dst_pages[i] = AllocatePage();
+        memset(reinterpret_cast<void*>(bench_src_pages[i]), u8(i), PAGE_SIZE);
+    }
+
+    u64 bytes = BENCH_COPY_PAGES * PAGE_SIZE;
+    static const u64 chunks[] = {512, 1024, 4096};
+    for(u64 c = 0; c < sizeof(chunks) / sizeof(chunks[0]); c++){
+        u64 plain = TimeCopy(PlainMemcpy, chunks[c]);
+        u64 vector = TimeCopy(VectorMemcpy, chunks[c]);
+
+        u64 plain_ns = CyclesToNanoseconds(plain);
+        u64 vector_ns = CyclesToNanoseconds(vector);
+        Printf("\tChunk : %lu B | memcpy : %lu MB/s | VectorMemcpy (%s) : %lu MB/s | Speedup : %lu.%lux\n",
+               chunks[c],
+               plain_ns ? (bytes * 1000) / plain_ns : 0,
+               avx_enabled ? "avx" : "sse2",
+               vector_ns ? (bytes * 1000) / vector_ns : 0,
+               vector ? plain / vector : 0, vector ? ((plain * 10) / vector) % 10 : 0);
+    }
+
+    for(u64 i = 0; i < BENCH_COPY_PAGES; i++){
+        FreePage(bench_src_pages[i]);
+        FreePage(bench_dst_pages[i]);
+    }
+}
@@ -0,0 +1,79 @@
+/**
+ * @file FPU.hpp
+ * @author Siddharth Mishra (brightprogrammer)
+ * @date 10/18/26
+ * @brief Lazy x87/SSE/AVX state management and kernel fpu sections.
+ * @copyright MIT License 2022 Siddharth Mishra
+ * */
+
+#ifndef FPU_HPP
+#define FPU_HPP
+
+#include "Common.hpp"
+
+struct Thread;
+
+/**
+ * @brief Detect fpu features, set up state save areas and enable
+ * fpu on boot processor. Must be called after memory manager is initialized.
+ * */
+void InitializeFPU();
+
+/**
+ * @brief Enable fpu on current cpu, application processors call this.
+ * */
+void EnableFPU();
+
+/**
+ * @brief Called by scheduler before switching away from a thread.
+ * Saves thread's fpu state if it used fpu and arms lazy restore trap.
+ * Interrupts must be disabled.
+ * */
+void SaveFPUStateOnSwitch(Thread* prev);
+
+/**
+ * @brief Handle device not available (#NM) exception, raised on first
+ * fpu instruction after a context switch. Restores state of current thread.
+ * */
+void HandleFPUTrap();
+
+/**
+ * @brief Give a new thread a copy of fpu state of current thread (eg: fork).
+ * */
+void CopyFPUState(Thread* child);
+
+/**
+ * @brief Free fpu save area of a dead thread.
+ * */
+void FreeFPUState(Thread* thread);
+
+/**
+ * @brief Start a section where kernel code may use SSE/AVX registers.
+ * Disables preemption until KernelFpuEnd. Sections can be nested.
+ * Must not be used from interrupt handlers.
+ * */
+void KernelFpuBegin();
+
+/**
+ * @brief End a section started by KernelFpuBegin.
+ * */
+void KernelFpuEnd();
+
+/**
+ * @brief Check whether cpu supports AVX and it's enabled.
+ * */
+bool IsAVXEnabled();
+
+/**
+ * @brief memcpy using widest vector registers available. Small copies
+ * fall back to memcpy, because fpu section costs more than the copy.
+ * */
+void* VectorMemcpy(void* dst, const void* src, u64 n);
+
+/**
+ * @brief Measure cost of KernelFpuBegin/KernelFpuEnd and speedup of
+ * VectorMemcpy over memcpy.
+ * */
+void BenchmarkFPU();
+
+#endif // FPU_HPP
@@ -0,0 +1,340 @@
+/**
+ * @file Fork.cpp
+ * @author Siddharth Mishra (brightprogrammer)
+ * @date 10/18/26
+ * @brief Fork with copy on write address spaces, and waiting for forked threads.
+ * @copyright MIT License 2022 Siddharth Mishra
+ * */
+
+#include "Fork.hpp"
+#include "Syscall.hpp"
+#include "Thread.hpp"
+#include "Scheduler.hpp"
+#include "MemoryManager.hpp"
+#include "FPU.hpp"
+#include "GDT.hpp"
+#include "CPU.hpp"
+#include "Slab.hpp"
+#include "Printf.hpp"
+#include "String.hpp"
+#include "Timer.hpp"
+#include "IoRing.hpp"
+#include "IPC.hpp"
+#include <cstddef>
+
+#define STRINGIFY_(x) #x
+#define STRINGIFY(x) STRINGIFY_(x)
+
+// user values of callee saved registers, in order SyscallFork pushes them
+struct ForkRegisters {
+    u64 r15;
+    u64 r14;
+    u64 r13;
+    u64 r12;
+    u64 rbp;
+    u64 rbx;
+};
+
+// where child continues in user mode
+struct ForkContext {
+    u64 rip;
+    u64 rsp;
+    u64 rflags;
+    u64 rbx;
+    u64 rbp;
+    u64 r12;
+    u64 r13;
+    u64 r14;
+    u64 r15;
+};
+
+// ResumeUserMode reads context with these offsets
+static_assert(offsetof(ForkContext, rflags) == 16, "ForkContext layout doesn't match ResumeUserMode");
+static_assert(offsetof(ForkContext, r15) == 64, "ForkContext layout doesn't match ResumeUserMode");
+
+static SlabCache fork_context_cache("fork.context", sizeof(ForkContext), 16);
+
+// SyscallEntry doesn't touch callee saved registers, so they still hold
+// user values here. Save them where ForkCurrentThread can see them.
+asm(R"(
+.text
+.global SyscallFork
+SyscallFork:
+    push %rbx
+    push %rbp
+    push %r12
+    push %r13
+    push %r14
+    push %r15
+    mov %rsp, %rdi
+    # keep stack 16 byte aligned at call
+    sub $8, %rsp
+    call ForkCurrentThread
+    add $56, %rsp
+    ret
+)");
+
+// drop to user mode in the middle of user code, as if a system call
+// returned 0 there
+[[noreturn]] static void ResumeUserMode(const ForkContext* context){
+    asm volatile("cli\n"
+                 "pushq %[ss]\n"
+                 "pushq 8(%%rdi)\n"
+                 "pushq 16(%%rdi)\n"
+                 "pushq %[cs]\n"
+                 "pushq 0(%%rdi)\n"
+                 "mov 24(%%rdi), %%rbx\n"
+                 "mov 32(%%rdi), %%rbp\n"
+                 "mov 40(%%rdi), %%r12\n"
+                 "mov 48(%%rdi), %%r13\n"
+                 "mov 56(%%rdi), %%r14\n"
+                 "mov 64(%%rdi), %%r15\n"
+                 "xor %%eax, %%eax\n"
+                 "xor %%ecx, %%ecx\n"
+                 "xor %%edx, %%edx\n"
+                 "xor %%esi, %%esi\n"
+                 "xor %%edi, %%edi\n"
+                 "xor %%r8d, %%r8d\n"
+                 "xor %%r9d, %%r9d\n"
+                 "xor %%r10d, %%r10d\n"
+                 "xor %%r11d, %%r11d\n"
+                 "swapgs\n"
+                 "iretq\n"
+                 :
+                 : [ss]"i"(GDT_USER_DATA_SELECTOR | 3),
+                   [cs]"i"(GDT_USER_CODE_SELECTOR | 3),
+                   "D"(context)
+                 : "memory");
+    __builtin_unreachable();
+}
+
+// first thing a forked thread runs, in kernel mode
+static void ForkChildStart(void* arg){
+    ForkContext* saved = reinterpret_cast<ForkContext*>(arg);
+
+    // context is copied on stack, so that it can be freed before we leave
+    ForkContext context;
+    context.rip = saved->rip;
+    context.rsp = saved->rsp;
+    context.rflags = saved->rflags;
+    context.rbx = saved->rbx;
+    context.rbp = saved->rbp;
+    context.r12 = saved->r12;
+    context.r13 = saved->r13;
+    context.r14 = saved->r14;
+    context.r15 = saved->r15;
+    SlabFree(&fork_context_cache, saved);
+
+    ResumeUserMode(&context);
+}
+
+extern "C" u64 ForkCurrentThread(const ForkRegisters* registers){
+    Thread* parent = GetCurrentThread();
+    SyscallFrame* frame = GetSyscallFrame();
+
+    ForkContext* context = reinterpret_cast<ForkContext*>(SlabAllocate(&fork_context_cache));
+    context->rip = frame->rip;
+    context->rsp = frame->rsp;
+    context->rflags = frame->rflags;
+    context->rbx = registers->rbx;
+    context->rbp = registers->rbp;
+    context->r12 = registers->r12;
+    context->r13 = registers->r13;
+    context->r14 = registers->r14;
+    context->r15 = registers->r15;
+
+    Thread* child = CreateThread(parent->name, ForkChildStart, context);
+    child->address_space = CloneAddressSpace(parent->address_space);
+    CopyFPUState(child);
+
+    // only parent touches it's list of children, no lock needed
+    child->sibling = parent->children;
+    parent->children = child;
+
+    // child is joinable, so it stays valid even if it exits right away
+    StartThread(child);
+    return child->id;
+}
+
+u64 SyscallWait(u64 id, u64, u64, u64, u64, u64){
+    Thread* parent = GetCurrentThread();
+
+    Thread** link = &parent->children;
+    while(*link != nullptr && (*link)->id != id){
+        link = &(*link)->sibling;
+    }
+    Thread* child = *link;
+    if(child == nullptr) return SYSCALL_ERROR;
+    *link = child->sibling;
+
+    AddressSpace* space = child->address_space;
+    u64 exit_code = JoinThread(child);
+
+    // child is dead, nothing runs in it's address space anymore
+    DestroyIoRings(space);
+    DestroyIPCEndpoints(space);
+    DestroyAddressSpace(space);
+    return exit_code;
+}
+
+/******************** Fork Benchmark ********************/
+
+// number of forks timed for every size
+#define BENCH_FORK_ITERATIONS 64
+// where benchmark code and resident memory are mapped in user space
+#define BENCH_FORK_USER_CODE 0x400000
+#define BENCH_FORK_USER_MEMORY 0x10000000
+
+// parameters of user code, at bottom of it's stack page
+struct ForkBenchParams {
+    u64 iterations;
+    u64 memory;
+    u64 pages;
+    // endpoint child of last fork waits on
+    u64 endpoint;
+    // results, written by user code
+    u64 fork_cycles;
+    u64 write_cycles;
+};
+
+// user code for benchmark, copied to a user page
+// forks and waits for a child that exits immediately, params->iterations times.
+// Then forks a child that sleeps on an endpoint, writes to every resident
+// page while child still shares them, and wakes child up.
+asm(R"(
+.text
+.global UserForkBench
+.global UserForkBenchEnd
+UserForkBench:
+    mov %rdi, %rbp
+    mov 0(%rbp), %r12
+    xor %r15d, %r15d
+
+1:
+    rdtsc
+    shl $32, %rdx
+    or %rax, %rdx
+    mov %rdx, %r14
+    mov $)" STRINGIFY(SYSCALL_FORK) R"(, %eax
+    syscall
+    test %rax, %rax
+    jz 7f
+    mov %rax, %rbx
+    rdtsc
+    shl $32, %rdx
+    or %rax, %rdx
+    sub %r14, %rdx
+    add %rdx, %r15
+
+    mov %rbx, %rdi
+    mov $)" STRINGIFY(SYSCALL_WAIT) R"(, %eax
+    syscall
+    dec %r12
+    jnz 1b
+
+    mov $)" STRINGIFY(SYSCALL_FORK) R"(, %eax
+    syscall
+    test %rax, %rax
+    jz 8f
+    mov %rax, %rbx
+
+    mov 8(%rbp), %r12
+    mov 16(%rbp), %r13
+    rdtsc
+    shl $32, %rdx
+    or %rax, %rdx
+    mov %rdx, %r14
+    test %r13, %r13
+    jz 3f
+2:
+    movb $1, (%r12)
+    add $0x1000, %r12
+    dec %r13
+    jnz 2b
+3:
+    rdtsc
+    shl $32, %rdx
+    or %rax, %rdx
+    sub %r14, %rdx
+    mov %rdx, %r14
+
+    mov 24(%rbp), %rdi
+    xor %esi, %esi
+    xor %edx, %edx
+    xor %r10d, %r10d
+    xor %r8d, %r8d
+    xor %r9d, %r9d
+    mov $)" STRINGIFY(SYSCALL_IPC_SEND) R"(, %eax
+    syscall
+    mov %rbx, %rdi
+    mov $)" STRINGIFY(SYSCALL_WAIT) R"(, %eax
+    syscall
+
+    # child is gone, so stack page is ours alone and this write doesn't copy it
+    mov %r15, 32(%rbp)
+    mov %r14, 40(%rbp)
+    xor %edi, %edi
+    mov $)" STRINGIFY(SYSCALL_EXIT) R"(, %eax
+    syscall
+    ud2
+
+7:
+    xor %edi, %edi
+    mov $)" STRINGIFY(SYSCALL_EXIT) R"(, %eax
+    syscall
+    ud2
+
+8:
+    mov 24(%rbp), %rdi
+    xor %esi, %esi
+    xor %edx, %edx
+    mov $)" STRINGIFY(SYSCALL_IPC_RECEIVE) R"(, %eax
+    syscall
+    xor %edi, %edi
+    mov $)" STRINGIFY(SYSCALL_EXIT) R"(, %eax
+    syscall
+    ud2
+UserForkBenchEnd:
+)");
+
+extern "C" u8 UserForkBench[];
+extern "C" u8 UserForkBenchEnd[];
+
+void BenchmarkFork(){
+    ColorPrintf(COLOR_YELLOW, COLOR_BLACK, "[+] Benchmark : Copy On Write Fork\n");
+
+    // resident pages besides code and stack
+    static const u64 sizes[] = {0, 256, 1024, 4096, 16384};
+    for(u64 s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++){
+        u64 pages = sizes[s];
+
+        AddressSpace* space = CreateAddressSpace();
+        u64 code = AllocateUserPage(space, BENCH_FORK_USER_CODE, MAP_PRESENT);
+        memcpy(reinterpret_cast<void*>(code), UserForkBench, UserForkBenchEnd - UserForkBench);
+        // parent writes results here only after it's last child is gone,
+        // so page is never copied and stays where kernel can see it
+        u64 stack = AllocateUserPage(space, USER_STACK_TOP - PAGE_SIZE, MAP_PRESENT | MAP_READ_WRITE);
+        for(u64 i = 0; i < pages; i++){
+            AllocateUserPage(space, BENCH_FORK_USER_MEMORY + i * PAGE_SIZE, MAP_PRESENT | MAP_READ_WRITE);
+        }
+
+        ForkBenchParams* params = reinterpret_cast<ForkBenchParams*>(stack);
+        params->iterations = BENCH_FORK_ITERATIONS;
+        params->memory = BENCH_FORK_USER_MEMORY;
+        params->pages = pages;
+        params->endpoint = CreateIPCEndpoint(space);
+
+        Thread* thread = CreateUserThread("fork-bench", space, BENCH_FORK_USER_CODE, USER_STACK_TOP, USER_STACK_TOP - PAGE_SIZE);
+        StartThread(thread);
+        JoinThread(thread);
+
+        u64 fork_ns = CyclesToNanoseconds(params->fork_cycles) / BENCH_FORK_ITERATIONS;
+        u64 write_ns = CyclesToNanoseconds(params->write_cycles);
+        DestroyIPCEndpoints(space);
+        DestroyAddressSpace(space);
+
+        // code and stack are resident too
+        Printf("\tRSS : %lu KB | Fork : %lu ns | First Writes : %lu ns (%lu ns per page)\n",
+               (pages + 2) * PAGE_SIZE / 1024, fork_ns, write_ns, pages ? write_ns / pages : 0);
+    }
+}
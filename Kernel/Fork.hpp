@@ -0,0 +1,60 @@
+/**
+ * @file Fork.hpp
+ * @author Siddharth Mishra (brightprogrammer)
+ * @date 10/18/26
+ * @brief Fork with copy on write address spaces, and waiting for forked threads.
+ * @copyright MIT License 2022 Siddharth Mishra
+ * */
+
+#ifndef FORK_HPP
+#define FORK_HPP
+
+#include "Common.hpp"
+
+/* ------------------ FORK --------------------
+ *
+ * Fork creates a new thread in a clone of address space of calling thread
+ * (see CloneAddressSpace). No user page is copied at fork time, only page
+ * tables are. Writable pages become read only and copy on write in both
+ * address spaces, and the first write to such a page from either side
+ * copies it (see HandlePageFault). Page frames count their references, so
+ * once one side has copied a page, the other side just gets write access
+ * back without another copy. Pages mapped with MAP_SHARED (eg: io rings)
+ * stay shared between both sides.
+ *
+ * Cost of fork grows with number of mapped pages, because every page table
+ * entry is copied, but not with amount of memory in them.
+ *
+ * Child starts at same user instruction as parent, with same stack pointer,
+ * flags, callee saved registers and fpu state. Argument registers are zero,
+ * like after every other system call.
+ *
+ * System calls :
+ *
+ *  SYSCALL_FORK() -> id of child thread in parent, 0 in child
+ *
+ *  SYSCALL_WAIT(id) -> exit code of child
+ *    waits until child with given id exits and frees it's address space.
+ *    Only thread that forked a child can wait for it. Children that are never
+ *    waited for are never freed.
+ *
+ * */
+
+/**
+ * @brief System call handler for SYSCALL_FORK. Written in assembly,
+ * because it needs user values of callee saved registers.
+ * */
+extern "C" u64 SyscallFork(u64, u64, u64, u64, u64, u64);
+
+/**
+ * @brief System call handler for SYSCALL_WAIT.
+ * */
+u64 SyscallWait(u64 id, u64, u64, u64, u64, u64);
+
+/**
+ * @brief Measure fork latency and cost of copy on write faults
+ * for different amounts of resident memory.
+ * */
+void BenchmarkFork();
+
+#endif // FORK_HPP
@@ -7,18 +7,19 @@
  */
 
 #include "GDT.hpp"
+#include "String.hpp"
 
 // create default gdt
 static GDT __attribute__((aligned(0x1000))) default_gdt;
-// pointer to global_descriptor table
-static GDTR gdtr;
+// task state segment used with default gdt
+static TSS default_tss;
 
 // load gdt address in gdtr register
-void ReloadGDTR(){
+void ReloadGDTR(GDTR* gdtr){
     // load gdtr
     asm volatile("lgdt %0"
                  :
-                 : "m"(gdtr));
+                 : "m"(*gdtr));
     // jump to code segment
     asm volatile("push $0x08\n" // offset to code segment
                  "lea 1f(%%rip), %%rax\n"
@@ -58,23 +59,58 @@ GDTEntry CreateGDTEntry(uint8_t access, uint8_t attributes){
     return gdtEntry;
 }
 
+// create a tss descriptor pointing to given tss
+TSSDescriptor CreateTSSDescriptor(TSS* tss){
+    TSSDescriptor tssDesc;
+    uint64_t base = reinterpret_cast<uint64_t>(tss);
+
+    tssDesc.segment_limit_low = sizeof(TSS) - 1;
+    tssDesc.base_address_low = uint16_t(base & 0xffff);
+    tssDesc.base_address_middle = uint8_t((base >> 16) & 0xff);
+    tssDesc.access_flags = 0x89; // present, 64 bit tss (available)
+    tssDesc.attributes = 0x00;
+    tssDesc.base_address_high = uint8_t((base >> 24) & 0xff);
+    tssDesc.base_address_upper = uint32_t(base >> 32);
+    tssDesc.reserved = 0;
+
+    return tssDesc;
+}
+
 
 // initializes global descriptor table
 void InstallGDT(){
+    InstallGDT(&default_gdt, &default_tss);
+}
+
+// initialize given gdt and tss and make them active on this cpu
+void InstallGDT(GDT* gdt, TSS* tss){
     // prepare pointer to gdt
     // minus 1 to get the last valid byte address in gdt
+    // gdtr value is copied by lgdt so this can live on stack
+    GDTR gdtr;
     gdtr.table_limit = sizeof(GDT) - 1;
-    gdtr.table_base_address = (uint64_t)&default_gdt;
+    gdtr.table_base_address = (uint64_t)gdt;
 
     // fill gdt:
     // createGDTEntry(access_flags, attributes/granularity)
     // null descriptor has all fields set to 0 (null)
-    default_gdt.null = CreateGDTEntry(0x00, 0x00);
-    default_gdt.kernelCode = CreateGDTEntry(0x9b, 0x20);
-    default_gdt.kernelData = CreateGDTEntry(0x92, 0x00);
-    default_gdt.userCode = CreateGDTEntry(0xfb, 0x20);
-    default_gdt.userData = CreateGDTEntry(0xf2, 0x00);
+    gdt->null = CreateGDTEntry(0x00, 0x00);
+    gdt->kernelCode = CreateGDTEntry(0x9b, 0x20);
+    gdt->kernelData = CreateGDTEntry(0x92, 0x00);
+    gdt->userData = CreateGDTEntry(0xf2, 0x00);
+    gdt->userCode = CreateGDTEntry(0xfb, 0x20);
+
+    // stacks in tss are filled by owner of tss
+    // no io permission bitmap
+    memset(tss, 0, sizeof(TSS));
+    tss->iomap_base = sizeof(TSS);
+    gdt->tss = CreateTSSDescriptor(tss);
 
     // reload gdt address in gdtr
-    ReloadGDTR();
+    ReloadGDTR(&gdtr);
+
+    // load task register
+    asm volatile("ltr %0"
+                 :
+                 : "r"(uint16_t(GDT_TSS_SELECTOR)));
 }
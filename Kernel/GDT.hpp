@@ -28,15 +28,55 @@ struct GDTEntry {
     uint8_t base_address_high;
 } __attribute__((packed));
 
+// in long mode a tss descriptor takes space of two normal descriptors
+struct TSSDescriptor {
+    uint16_t segment_limit_low;
+    uint16_t base_address_low;
+    uint8_t base_address_middle;
+    uint8_t access_flags;
+    uint8_t attributes;
+    uint8_t base_address_high;
+    uint32_t base_address_upper;
+    uint32_t reserved;
+} __attribute__((packed));
+
+// task state segment
+// in long mode this is only used to find stacks on privilege change (rsp0)
+// and to find interrupt stacks (ist1-ist7)
+struct TSS {
+    uint32_t reserved0;
+    uint64_t rsp0;
+    uint64_t rsp1;
+    uint64_t rsp2;
+    uint64_t reserved1;
+    uint64_t ist[7];
+    uint64_t reserved2;
+    uint16_t reserved3;
+    uint16_t iomap_base;
+} __attribute__((packed));
+
 struct GDT{
     GDTEntry null;
     GDTEntry kernelCode;
     GDTEntry kernelData;
-    GDTEntry userCode;
+    // sysret expects user data right before user code
     GDTEntry userData;
+    GDTEntry userCode;
+    TSSDescriptor tss;
 } __attribute__((packed)) __attribute__((aligned(0x1000)));
 
+// segment selectors (offsets in gdt)
+#define GDT_KERNEL_CODE_SELECTOR 0x08
+#define GDT_KERNEL_DATA_SELECTOR 0x10
+#define GDT_USER_DATA_SELECTOR 0x18
+#define GDT_USER_CODE_SELECTOR 0x20
+#define GDT_TSS_SELECTOR 0x28
+
 // install kernel's global descriptor table in gdtr
 void InstallGDT();
 
+// install given gdt in gdtr and load given tss in task register
+// every cpu has it's own gdt and tss
+void InstallGDT(GDT* gdt, TSS* tss);
+
 #endif // GDT_HPP
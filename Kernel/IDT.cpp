@@ -8,14 +8,155 @@
 #include "IDT.hpp"
 #include "MemoryManager.hpp"
 #include "Interrupts.hpp"
+#include "APIC.hpp"
+#include "Spinlock.hpp"
 #include "Printf.hpp"
+#include "String.hpp"
 
 #define IDT_ENTRY_OFFSET_LOW_MASK uint64_t(0xffff)
 #define IDT_ENTRY_OFFSET_MIDDLE_MASK uint64_t(0xffff0000)
 #define IDT_ENTRY_OFFSET_HIGH_MASK uint64_t(0xffffffff00000000)
 
+#define STRINGIFY_(x) #x
+#define STRINGIFY(x) STRINGIFY_(x)
+
+#define IDT_DYNAMIC_VECTOR_COUNT (IDT_DYNAMIC_VECTOR_END - IDT_DYNAMIC_VECTOR_BASE)
+// size of entry stub of each dynamic vector
+#define IDT_VECTOR_STUB_SIZE 16
+
 static IDTR idtr;
 
+/* ------------------ DYNAMIC VECTORS --------------------
+ *
+ * Every dynamic vector has a tiny stub that pushes it's vector number
+ * and jumps to common entry code, which saves caller saved registers
+ * and calls DispatchInterrupt. Kernel never touches vector registers
+ * (see CMakeLists.txt), so general purpose registers are all we save.
+ *
+ * Stack on entry to common code, cpu aligns rsp to 16 bytes before
+ * pushing interrupt frame :
+ *
+ *                 ;-------------------;
+ *                 ; interrupt frame   ; 5 words
+ *                 ; vector            ;
+ *                 ; rax ... r11       ; 9 words, pushed by common code
+ *                 ;-------------------;
+ *
+ * */
+asm(R"(
+.text
+.global InterruptVectorStubs
+.align 16
+InterruptVectorStubs:
+.set vector, )" STRINGIFY(IDT_DYNAMIC_VECTOR_BASE) R"(
+.rept )" STRINGIFY(IDT_DYNAMIC_VECTOR_COUNT) R"(
+    .align )" STRINGIFY(IDT_VECTOR_STUB_SIZE) R"(
+    pushq $vector
+    jmp InterruptVectorCommon
+    .set vector, vector + 1
+.endr
+
+InterruptVectorCommon:
+    # rpl of interrupted cs, user gs base is swapped out while in kernel
+    testb $3, 16(%rsp)
+    jz 1f
+    swapgs
+1:
+    push %rax
+    push %rcx
+    push %rdx
+    push %rsi
+    push %rdi
+    push %r8
+    push %r9
+    push %r10
+    push %r11
+    cld
+    mov 72(%rsp), %rdi
+    sub $8, %rsp
+    call DispatchInterrupt
+    add $8, %rsp
+    pop %r11
+    pop %r10
+    pop %r9
+    pop %r8
+    pop %rdi
+    pop %rsi
+    pop %rdx
+    pop %rcx
+    pop %rax
+    add $8, %rsp
+    testb $3, 8(%rsp)
+    jz 2f
+    swapgs
+2:
+    iretq
+)");
+
+extern "C" uint8_t InterruptVectorStubs[];
+
+struct InterruptVector {
+    InterruptHandler handler;
+    void* arg;
+};
+
+static InterruptVector dynamic_vectors[IDT_DYNAMIC_VECTOR_COUNT];
+// one bit per dynamic vector, set if allocated
+static uint64_t dynamic_vector_map[(IDT_DYNAMIC_VECTOR_COUNT + 63) / 64];
+static TicketLock<> dynamic_vector_lock("idt.vectors");
+
+extern "C" void DispatchInterrupt(uint64_t vector){
+    InterruptVector* v = &dynamic_vectors[vector - IDT_DYNAMIC_VECTOR_BASE];
+    InterruptHandler handler = __atomic_load_n(&v->handler, __ATOMIC_ACQUIRE);
+    if(handler){
+        handler(v->arg);
+    }
+    SendEndOfInterrupt();
+}
+
+static inline bool IsVectorAllocated(uint32_t index){
+    return dynamic_vector_map[index / 64] & (uint64_t(1) << (index % 64));
+}
+
+uint8_t AllocateInterruptVectors(uint32_t count){
+    if(count == 0 || (count & (count - 1)) || count > IDT_DYNAMIC_VECTOR_COUNT) return 0;
+
+    LockGuard guard(dynamic_vector_lock);
+    // alignment is of vector number, not of index in table
+    uint32_t first = (IDT_DYNAMIC_VECTOR_BASE + count - 1) & ~(count - 1);
+    for(; first + count <= IDT_DYNAMIC_VECTOR_END; first += count){
+        bool free = true;
+        for(uint32_t i = 0; i < count && free; i++){
+            free = !IsVectorAllocated(first + i - IDT_DYNAMIC_VECTOR_BASE);
+        }
+        if(!free) continue;
+
+        for(uint32_t i = 0; i < count; i++){
+            uint32_t index = first + i - IDT_DYNAMIC_VECTOR_BASE;
+            dynamic_vector_map[index / 64] |= uint64_t(1) << (index % 64);
+        }
+        return uint8_t(first);
+    }
+    return 0;
+}
+
+void FreeInterruptVectors(uint8_t first, uint32_t count){
+    LockGuard guard(dynamic_vector_lock);
+    for(uint32_t i = 0; i < count; i++){
+        uint32_t index = first + i - IDT_DYNAMIC_VECTOR_BASE;
+        __atomic_store_n(&dynamic_vectors[index].handler, nullptr, __ATOMIC_RELEASE);
+        dynamic_vector_map[index / 64] &= ~(uint64_t(1) << (index % 64));
+    }
+}
+
+void SetInterruptHandler(uint8_t vector, InterruptHandler handler, void* arg){
+    InterruptVector* v = &dynamic_vectors[vector - IDT_DYNAMIC_VECTOR_BASE];
+    // callers mask their source first, so at most a late interrupt sees no handler
+    __atomic_store_n(&v->handler, nullptr, __ATOMIC_RELEASE);
+    v->arg = arg;
+    __atomic_store_n(&v->handler, handler, __ATOMIC_RELEASE);
+}
+
 // set offset in this idt entry
 void IDTEntry::SetOffset(uint64_t offset){
     offsetLow = uint16_t(offset & IDT_ENTRY_OFFSET_LOW_MASK);
@@ -40,6 +181,21 @@ void SetInterruptDescriptor(uint8_t entry, uint64_t isr, uint8_t flags){
     gatedesc->SetOffset(isr);
     gatedesc->typeAttr = flags;
     gatedesc->selector = 0x08; // offset of kernelCode in GDT
+    gatedesc->ist = 0;
+    gatedesc->reserved = 0;
+}
+
+// set interrupt stack table index for given entry
+void SetInterruptStack(uint8_t entry, uint8_t ist){
+    IDTEntry* gatedesc = reinterpret_cast<IDTEntry*>(idtr.offset + entry * sizeof(IDTEntry));
+    gatedesc->ist = ist & 0x7;
+}
+
+// load idtr on current cpu
+void LoadIDT(){
+    asm volatile ("lidt %0"
+                  :
+                  : "m"(idtr));
 }
 
 void InstallIDT(){
@@ -47,35 +203,43 @@ void InstallIDT(){
     // allocate page always returns virtual address
     // and if paging is enabled then offset must be the virtual address
     idtr.offset = AllocatePage();
+    // pages aren't zeroed on allocation and an entry with garbage
+    // present bit is worse than no entry at all
+    memset(reinterpret_cast<void*>(idtr.offset), 0, PAGE_SIZE);
+
+    // every handler runs with interrupts off until it has swapped in
+    // per-cpu data (see SwapGSIfFromUser), so no trap gates
 
     // divide by zero
-    SetInterruptDescriptor(0x00, reinterpret_cast<uint64_t>(DefaultInterruptHandlerNoError), IDT_TYPE_ATTR_TRAP_GATE);
+    SetInterruptDescriptor(0x00, reinterpret_cast<uint64_t>(DefaultInterruptHandlerNoError), IDT_TYPE_ATTR_INTERRUPT_GATE);
     // debug
-    SetInterruptDescriptor(0x01, reinterpret_cast<uint64_t>(DefaultInterruptHandlerNoError), IDT_TYPE_ATTR_TRAP_GATE);
+    SetInterruptDescriptor(0x01, reinterpret_cast<uint64_t>(DefaultInterruptHandlerNoError), IDT_TYPE_ATTR_INTERRUPT_GATE);
     // NMI
-    SetInterruptDescriptor(0x02, reinterpret_cast<uint64_t>(DefaultInterruptHandlerNoError), IDT_TYPE_ATTR_TRAP_GATE);
+    SetInterruptDescriptor(0x02, reinterpret_cast<uint64_t>(DefaultInterruptHandlerNoError), IDT_TYPE_ATTR_INTERRUPT_GATE);
     // breakpoint
-    SetInterruptDescriptor(0x03, reinterpret_cast<uint64_t>(DefaultInterruptHandlerNoError), IDT_TYPE_ATTR_TRAP_GATE);
+    SetInterruptDescriptor(0x03, reinterpret_cast<uint64_t>(DefaultInterruptHandlerNoError), IDT_TYPE_ATTR_INTERRUPT_GATE);
     // overflow
-    SetInterruptDescriptor(0x04, reinterpret_cast<uint64_t>(DefaultInterruptHandlerNoError), IDT_TYPE_ATTR_TRAP_GATE);
+    SetInterruptDescriptor(0x04, reinterpret_cast<uint64_t>(DefaultInterruptHandlerNoError), IDT_TYPE_ATTR_INTERRUPT_GATE);
     // bound range exceeded
-    SetInterruptDescriptor(0x05, reinterpret_cast<uint64_t>(DefaultInterruptHandlerNoError), IDT_TYPE_ATTR_TRAP_GATE);
+    SetInterruptDescriptor(0x05, reinterpret_cast<uint64_t>(DefaultInterruptHandlerNoError), IDT_TYPE_ATTR_INTERRUPT_GATE);
     // invalid opcode
-    SetInterruptDescriptor(0x06, reinterpret_cast<uint64_t>(DefaultInterruptHandlerNoError), IDT_TYPE_ATTR_TRAP_GATE);
+    SetInterruptDescriptor(0x06, reinterpret_cast<uint64_t>(DefaultInterruptHandlerNoError), IDT_TYPE_ATTR_INTERRUPT_GATE);
     // device not avaiable
-    SetInterruptDescriptor(0x07, reinterpret_cast<uint64_t>(DefaultInterruptHandlerNoError), IDT_TYPE_ATTR_TRAP_GATE);
+    SetInterruptDescriptor(0x07, reinterpret_cast<uint64_t>(DeviceNotAvailableHandler), IDT_TYPE_ATTR_INTERRUPT_GATE);
 
     // create double fault handler
     SetInterruptDescriptor(0x08, reinterpret_cast<uint64_t>(DoubleFaultHandler), IDT_TYPE_ATTR_INTERRUPT_GATE);
+    // double fault may be caused by a stack overflow, so always use a known good stack
+    SetInterruptStack(0x08, 1);
 
     // co-processor segment overrun
-    SetInterruptDescriptor(0x09, reinterpret_cast<uint64_t>(DefaultInterruptHandlerWithError), IDT_TYPE_ATTR_TRAP_GATE);
+    SetInterruptDescriptor(0x09, reinterpret_cast<uint64_t>(DefaultInterruptHandlerWithError), IDT_TYPE_ATTR_INTERRUPT_GATE);
     // invalid tss
-    SetInterruptDescriptor(0x0a, reinterpret_cast<uint64_t>(DefaultInterruptHandlerWithError), IDT_TYPE_ATTR_TRAP_GATE);
+    SetInterruptDescriptor(0x0a, reinterpret_cast<uint64_t>(DefaultInterruptHandlerWithError), IDT_TYPE_ATTR_INTERRUPT_GATE);
     // segment not present
-    SetInterruptDescriptor(0x0b, reinterpret_cast<uint64_t>(DefaultInterruptHandlerWithError), IDT_TYPE_ATTR_TRAP_GATE);
+    SetInterruptDescriptor(0x0b, reinterpret_cast<uint64_t>(DefaultInterruptHandlerWithError), IDT_TYPE_ATTR_INTERRUPT_GATE);
     // stack segment fault
-    SetInterruptDescriptor(0x0c, reinterpret_cast<uint64_t>(DefaultInterruptHandlerWithError), IDT_TYPE_ATTR_TRAP_GATE);
+    SetInterruptDescriptor(0x0c, reinterpret_cast<uint64_t>(DefaultInterruptHandlerWithError), IDT_TYPE_ATTR_INTERRUPT_GATE);
 
     // create general protection fault handler
     SetInterruptDescriptor(0x0d, reinterpret_cast<uint64_t>(GeneralProtectionFaultHandler), IDT_TYPE_ATTR_INTERRUPT_GATE);
@@ -85,17 +249,17 @@ void InstallIDT(){
     // 0x0f is reserved
 
     // floating point error
-    SetInterruptDescriptor(0x10, reinterpret_cast<uint64_t>(DefaultInterruptHandlerNoError), IDT_TYPE_ATTR_TRAP_GATE);
+    SetInterruptDescriptor(0x10, reinterpret_cast<uint64_t>(DefaultInterruptHandlerNoError), IDT_TYPE_ATTR_INTERRUPT_GATE);
     // alignment cehck
-    SetInterruptDescriptor(0x11, reinterpret_cast<uint64_t>(DefaultInterruptHandlerWithError), IDT_TYPE_ATTR_TRAP_GATE);
+    SetInterruptDescriptor(0x11, reinterpret_cast<uint64_t>(DefaultInterruptHandlerWithError), IDT_TYPE_ATTR_INTERRUPT_GATE);
     // machine check
-    SetInterruptDescriptor(0x12, reinterpret_cast<uint64_t>(DefaultInterruptHandlerNoError), IDT_TYPE_ATTR_TRAP_GATE);
+    SetInterruptDescriptor(0x12, reinterpret_cast<uint64_t>(DefaultInterruptHandlerNoError), IDT_TYPE_ATTR_INTERRUPT_GATE);
     // simd floating point exception
-    SetInterruptDescriptor(0x13, reinterpret_cast<uint64_t>(DefaultInterruptHandlerNoError), IDT_TYPE_ATTR_TRAP_GATE);
+    SetInterruptDescriptor(0x13, reinterpret_cast<uint64_t>(DefaultInterruptHandlerNoError), IDT_TYPE_ATTR_INTERRUPT_GATE);
     // virtualization exception
-    SetInterruptDescriptor(0x14, reinterpret_cast<uint64_t>(DefaultInterruptHandlerNoError), IDT_TYPE_ATTR_TRAP_GATE);
+    SetInterruptDescriptor(0x14, reinterpret_cast<uint64_t>(DefaultInterruptHandlerNoError), IDT_TYPE_ATTR_INTERRUPT_GATE);
     // control protection exception
-    SetInterruptDescriptor(0x15, reinterpret_cast<uint64_t>(DefaultInterruptHandlerWithError), IDT_TYPE_ATTR_TRAP_GATE);
+    SetInterruptDescriptor(0x15, reinterpret_cast<uint64_t>(DefaultInterruptHandlerWithError), IDT_TYPE_ATTR_INTERRUPT_GATE);
     // rest up until 0x1f is reserved
 
     // first interrupt is mapped to 0x20
@@ -103,8 +267,18 @@ void InstallIDT(){
     // so offset = 0x21
     SetInterruptDescriptor(0x21, reinterpret_cast<uint64_t>(KeyboardInterruptHandler), IDT_TYPE_ATTR_INTERRUPT_GATE);
 
+    // local apic interrupts
+    SetInterruptDescriptor(APIC_TIMER_VECTOR, reinterpret_cast<uint64_t>(APICTimerInterruptHandler), IDT_TYPE_ATTR_INTERRUPT_GATE);
+    SetInterruptDescriptor(APIC_RESCHEDULE_VECTOR, reinterpret_cast<uint64_t>(RescheduleInterruptHandler), IDT_TYPE_ATTR_INTERRUPT_GATE);
+    SetInterruptDescriptor(APIC_TLB_SHOOTDOWN_VECTOR, reinterpret_cast<uint64_t>(TLBShootdownInterruptHandler), IDT_TYPE_ATTR_INTERRUPT_GATE);
+    SetInterruptDescriptor(APIC_SPURIOUS_VECTOR, reinterpret_cast<uint64_t>(SpuriousInterruptHandler), IDT_TYPE_ATTR_INTERRUPT_GATE);
+
+    // vectors handed out at runtime
+    for(uint32_t v = IDT_DYNAMIC_VECTOR_BASE; v < IDT_DYNAMIC_VECTOR_END; v++){
+        uint64_t stub = reinterpret_cast<uint64_t>(InterruptVectorStubs) + (v - IDT_DYNAMIC_VECTOR_BASE) * IDT_VECTOR_STUB_SIZE;
+        SetInterruptDescriptor(uint8_t(v), stub, IDT_TYPE_ATTR_INTERRUPT_GATE);
+    }
+
     // load the idtr strucg in idtr register
-    asm volatile ("lidt %0"
-                  :
-                  : "m"(idtr));
+    LoadIDT();
 }
@@ -60,9 +60,38 @@ struct IDTR{
 // entry must be the id of interrupt to be handled
 // isr must be pointer to function that will handle the interrupt
 // flags must be a valid flag to define the type of interrupt descriptor
-void SetInterruptDescriptor(uint8_t entry, void* isr, uint8_t flags);
+void SetInterruptDescriptor(uint8_t entry, uint64_t isr, uint8_t flags);
+
+// make cpu switch to given interrupt stack (1-7) from tss on given interrupt
+// 0 means no stack switch
+void SetInterruptStack(uint8_t entry, uint8_t ist);
+
+// vectors handed out at runtime, eg: to message signalled interrupts of devices
+// everything below is taken by exceptions, pic and local apic
+#define IDT_DYNAMIC_VECTOR_BASE 0x50
+#define IDT_DYNAMIC_VECTOR_END 0xf0
+
+// handler of a dynamically allocated vector
+// runs with interrupts disabled, end of interrupt is sent after it returns
+typedef void (*InterruptHandler)(void* arg);
+
+// allocate count consecutive vectors, first one aligned to count
+// count must be a power of 2, as needed by multi message MSI
+// returns first vector or 0 if there are not enough free vectors
+uint8_t AllocateInterruptVectors(uint32_t count);
+
+// free vectors allocated with AllocateInterruptVectors, removing their handlers
+void FreeInterruptVectors(uint8_t first, uint32_t count);
+
+// make handler run with arg whenever given dynamic vector is raised
+// nullptr handler just acknowledges the interrupt
+void SetInterruptHandler(uint8_t vector, InterruptHandler handler, void* arg);
 
 // you know what this does!
 void InstallIDT();
 
+// load already installed idt on this cpu
+// all cpus share the same idt
+void LoadIDT();
+
 #endif // IDT_HPP
@@ -51,6 +51,36 @@ __attribute__((no_caller_saved_registers)) uint8_t PortReadByte(uint16_t port){
     return ret;
 }
 
+__attribute__((no_caller_saved_registers)) void PortWriteWord(uint16_t port, uint16_t value){
+    asm volatile ("outw %0, %1"
+                  :
+                  : "a"(value), "Nd"(port));
+}
+
+__attribute__((no_caller_saved_registers)) uint16_t PortReadWord(uint16_t port){
+    uint16_t ret;
+    asm volatile ("inw %1, %0"
+                  : "=a"(ret)
+                  : "Nd"(port));
+
+    return ret;
+}
+
+__attribute__((no_caller_saved_registers)) void PortWriteDword(uint16_t port, uint32_t value){
+    asm volatile ("outl %0, %1"
+                  :
+                  : "a"(value), "Nd"(port));
+}
+
+__attribute__((no_caller_saved_registers)) uint32_t PortReadDword(uint16_t port){
+    uint32_t ret;
+    asm volatile ("inl %1, %0"
+                  : "=a"(ret)
+                  : "Nd"(port));
+
+    return ret;
+}
+
 __attribute__((no_caller_saved_registers)) void PortIOWait(){
     // write something into an unused port so that
     // other ports get time to catch up
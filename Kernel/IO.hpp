@@ -52,6 +52,12 @@ __attribute__((no_caller_saved_registers)) void PortWriteByte(uint16_t port, uin
 // get byte from port
 __attribute__((no_caller_saved_registers)) uint8_t PortReadByte(uint16_t port);
 
+// 16 and 32 bit versions of above
+__attribute__((no_caller_saved_registers)) void PortWriteWord(uint16_t port, uint16_t value);
+__attribute__((no_caller_saved_registers)) uint16_t PortReadWord(uint16_t port);
+__attribute__((no_caller_saved_registers)) void PortWriteDword(uint16_t port, uint32_t value);
+__attribute__((no_caller_saved_registers)) uint32_t PortReadDword(uint16_t port);
+
 // wait for small time
 // on older machines, i/o ports are slow
 __attribute__((no_caller_saved_registers)) void PortIOWait();
@@ -0,0 +1,488 @@
+/**
+ * @file IPC.cpp
+ * @author Siddharth Mishra (brightprogrammer)
+ * @date 10/18/26
+ * @brief Synchronous message passing between threads. Small messages
+ * travel in registers, large buffers move by remapping pages.
+ * @copyright MIT License 2022 Siddharth Mishra
+ * */
+
+#include "IPC.hpp"
+#include "Syscall.hpp"
+#include "Thread.hpp"
+#include "Scheduler.hpp"
+#include "MemoryManager.hpp"
+#include "Slab.hpp"
+#include "Spinlock.hpp"
+#include "CPU.hpp"
+#include "Printf.hpp"
+#include "String.hpp"
+#include "Timer.hpp"
+#include <new>
+
+struct IPCMessage {
+    u64 flags;
+    u64 words[IPC_MESSAGE_WORDS];
+};
+
+// a thread sleeping on an endpoint, lives on it's kernel stack
+struct IPCWaiter {
+    Thread* thread;
+    AddressSpace* space;
+
+    // message being sent, or message received
+    IPCMessage message;
+    // where receiver wants buffer
+    u64 buffer;
+    u64 capacity;
+    u64 sender_id;
+
+    // filled in by whoever wakes up waiter
+    u64 result;
+    IPCWaiter* next;
+};
+
+// fifo of waiters
+struct IPCWaitQueue {
+    IPCWaiter* head;
+    IPCWaiter* tail;
+};
+
+struct Endpoint {
+    u32 id;
+    AddressSpace* owner;
+    TicketLock<false> lock;
+    // at most one of these is non empty at any time
+    IPCWaitQueue senders;
+    IPCWaitQueue receivers;
+
+    Endpoint() : id(0), owner(nullptr), lock("ipc.endpoint"),
+                 senders{nullptr, nullptr}, receivers{nullptr, nullptr} {}
+};
+
+static SlabCache endpoint_cache("ipc.endpoint", sizeof(Endpoint), 64);
+
+// endpoints are looked up by id, id is index in this table
+static Endpoint* endpoints[IPC_MAX_ENDPOINTS] = {};
+static TicketLock<> endpoint_table_lock("ipc.table");
+
+static void PushWaiter(IPCWaitQueue* queue, IPCWaiter* waiter){
+    waiter->next = nullptr;
+    if(queue->tail){
+        queue->tail->next = waiter;
+    }else{
+        queue->head = waiter;
+    }
+    queue->tail = waiter;
+}
+
+static IPCWaiter* PopWaiter(IPCWaitQueue* queue){
+    IPCWaiter* waiter = queue->head;
+    if(waiter){
+        queue->head = waiter->next;
+        if(queue->head == nullptr) queue->tail = nullptr;
+    }
+    return waiter;
+}
+
+// wake up a waiter whose result is filled in
+// waiter lives on stack of it's thread, so it's not touched after this
+static void WakeWaiter(IPCWaiter* waiter){
+    Thread* thread = waiter->thread;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    WakeThread(thread);
+}
+
+// find endpoint and lock it, interrupts must be disabled
+static Endpoint* LockEndpoint(u64 id){
+    if(id >= IPC_MAX_ENDPOINTS) return nullptr;
+
+    // taking endpoint lock before dropping table lock
+    // keeps endpoint from being destroyed under us
+    LockGuard guard(endpoint_table_lock);
+    Endpoint* endpoint = endpoints[id];
+    if(endpoint){
+        endpoint->lock.Lock();
+    }
+    return endpoint;
+}
+
+// add current thread to queue and sleep until someone fills in it's result
+// called with endpoint locked and interrupts disabled, unlocks endpoint
+static void SleepOnEndpoint(Endpoint* endpoint, IPCWaitQueue* queue, IPCWaiter* waiter){
+    PushWaiter(queue, waiter);
+    __atomic_store_n(&waiter->thread->state, ThreadState::Blocked, __ATOMIC_RELEASE);
+    endpoint->lock.Unlock();
+    Schedule();
+}
+
+// move buffer from sender to receiver, returns number of bytes moved
+static u64 MoveBuffer(IPCWaiter* sender, IPCWaiter* receiver){
+    u64 src = sender->message.words[0];
+    u64 length = sender->message.words[1];
+    u64 dst = receiver->buffer;
+    if(length > receiver->capacity) length = receiver->capacity;
+
+    // whole pages are remapped, tail of last page is copied so that
+    // receiver doesn't see what's after the message in sender's page
+    u64 remapped = 0;
+    if(length >= IPC_REMAP_THRESHOLD && !((src | dst) & (PAGE_SIZE - 1))){
+        remapped = length & ~(PAGE_SIZE - 1);
+        if(!ShareUserPages(receiver->space, dst, sender->space, src, remapped / PAGE_SIZE)){
+            return SYSCALL_ERROR;
+        }
+        receiver->message.flags |= IPC_REMAPPED;
+    }
+
+    if(length > remapped &&
+       !CopyUserMemory(receiver->space, dst + remapped, sender->space, src + remapped, length - remapped)){
+        return SYSCALL_ERROR;
+    }
+
+    receiver->message.words[0] = dst;
+    receiver->message.words[1] = length;
+    return length;
+}
+
+// deliver message of sender to receiver, returns result for sender
+// runs with interrupts enabled and no locks held, both sides are
+// off their endpoint queues so no one else touches them
+static u64 Transfer(IPCWaiter* sender, IPCWaiter* receiver){
+    receiver->message.flags = sender->message.flags;
+    for(u32 i = 0; i < IPC_MESSAGE_WORDS; i++){
+        receiver->message.words[i] = sender->message.words[i];
+    }
+    receiver->sender_id = sender->thread->id;
+
+    u64 result = 0;
+    if(sender->message.flags & IPC_BUFFER){
+        result = MoveBuffer(sender, receiver);
+    }
+
+    receiver->result = result;
+    return result;
+}
+
+u64 CreateIPCEndpoint(AddressSpace* owner){
+    Endpoint* endpoint = new (SlabAllocate(&endpoint_cache)) Endpoint();
+    endpoint->owner = owner;
+
+    LockGuard guard(endpoint_table_lock);
+    for(u32 id = 0; id < IPC_MAX_ENDPOINTS; id++){
+        if(endpoints[id] == nullptr){
+            endpoint->id = id;
+            endpoints[id] = endpoint;
+            return id;
+        }
+    }
+
+    SlabFree(&endpoint_cache, endpoint);
+    return SYSCALL_ERROR;
+}
+
+// fail every waiter in queue
+static void FailWaiters(IPCWaitQueue* queue){
+    while(IPCWaiter* waiter = PopWaiter(queue)){
+        waiter->result = SYSCALL_ERROR;
+        WakeWaiter(waiter);
+    }
+}
+
+void DestroyIPCEndpoints(AddressSpace* owner){
+    for(u32 id = 0; id < IPC_MAX_ENDPOINTS; id++){
+        Endpoint* endpoint;
+        {
+            LockGuard guard(endpoint_table_lock);
+            endpoint = endpoints[id];
+            if(endpoint == nullptr || endpoint->owner != owner) continue;
+            endpoints[id] = nullptr;
+        }
+
+        // no one can find endpoint anymore, wait for current holder and fail waiters
+        endpoint->lock.Lock();
+        FailWaiters(&endpoint->senders);
+        FailWaiters(&endpoint->receivers);
+        endpoint->lock.Unlock();
+
+        SlabFree(&endpoint_cache, endpoint);
+    }
+}
+
+u64 SyscallIPCCreate(u64, u64, u64, u64, u64, u64){
+    return CreateIPCEndpoint(GetCurrentThread()->address_space);
+}
+
+u64 SyscallIPCSend(u64 id, u64 flags, u64 word0, u64 word1, u64 word2, u64 word3){
+    Thread* self = GetCurrentThread();
+    IPCWaiter me;
+    me.thread = self;
+    me.space = self->address_space;
+    me.message.flags = flags & IPC_BUFFER;
+    me.message.words[0] = word0;
+    me.message.words[1] = word1;
+    me.message.words[2] = word2;
+    me.message.words[3] = word3;
+    me.result = SYSCALL_ERROR;
+
+    // interrupts stay disabled from taking endpoint lock until we're
+    // asleep, so a tick can't deschedule us while we're marked blocked
+    u64 irq_flags = SaveFlagsAndDisableInterrupts();
+    Endpoint* endpoint = LockEndpoint(id);
+    if(endpoint == nullptr){
+        RestoreFlags(irq_flags);
+        return SYSCALL_ERROR;
+    }
+
+    IPCWaiter* receiver = PopWaiter(&endpoint->receivers);
+    if(receiver == nullptr){
+        // receiver moves message when it arrives
+        SleepOnEndpoint(endpoint, &endpoint->senders, &me);
+        RestoreFlags(irq_flags);
+        return me.result;
+    }
+
+    endpoint->lock.Unlock();
+    RestoreFlags(irq_flags);
+
+    u64 result = Transfer(&me, receiver);
+    WakeWaiter(receiver);
+    return result;
+}
+
+u64 SyscallIPCReceive(u64 id, u64 buffer, u64 capacity, u64, u64, u64){
+    Thread* self = GetCurrentThread();
+    IPCWaiter me;
+    me.thread = self;
+    me.space = self->address_space;
+    me.buffer = buffer;
+    me.capacity = capacity;
+    me.result = SYSCALL_ERROR;
+
+    u64 irq_flags = SaveFlagsAndDisableInterrupts();
+    Endpoint* endpoint = LockEndpoint(id);
+    if(endpoint == nullptr){
+        RestoreFlags(irq_flags);
+        return SYSCALL_ERROR;
+    }
+
+    IPCWaiter* sender = PopWaiter(&endpoint->senders);
+    if(sender == nullptr){
+        // sender moves message when it arrives
+        SleepOnEndpoint(endpoint, &endpoint->receivers, &me);
+        RestoreFlags(irq_flags);
+    }else{
+        endpoint->lock.Unlock();
+        RestoreFlags(irq_flags);
+
+        sender->result = Transfer(sender, &me);
+        WakeWaiter(sender);
+    }
+
+    if(me.result == SYSCALL_ERROR) return SYSCALL_ERROR;
+
+    // message goes back to user in registers
+    SyscallFrame* frame = GetSyscallFrame();
+    for(u32 i = 0; i < IPC_MESSAGE_WORDS; i++){
+        frame->registers[i] = me.message.words[i];
+    }
+    frame->registers[4] = me.message.flags;
+    frame->registers[5] = me.sender_id;
+    return me.result;
+}
+
+/******************** IPC Benchmark ********************/
+
+#define STRINGIFY_(x) #x
+#define STRINGIFY(x) STRINGIFY_(x)
+
+// max round trips for one message size
+#define BENCH_IPC_MAX_ITERATIONS 10000
+// bytes sent one way for every message size, limits round trips of large messages
+#define BENCH_IPC_BYTES (u64(64) * MB)
+// where things are mapped in user space of client and server
+#define BENCH_IPC_USER_CODE 0x400000
+#define BENCH_IPC_USER_BUFFER 0x10000000
+#define BENCH_IPC_USER_WINDOW 0x20000000
+
+// passed to user code in rdi, at bottom of it's stack page
+struct IPCBenchParams {
+    u64 iterations;
+    u64 ping;
+    u64 pong;
+    u64 buffer;
+    u64 size;
+    u64 window;
+};
+
+// client sends a message on ping endpoint and waits for it to come back on
+// pong endpoint, exits with cycles taken by all round trips
+// server echoes every message it receives on ping back on pong
+asm(R"(
+.text
+.global UserIPCClient
+.global UserIPCServer
+.global UserIPCServerEnd
+UserIPCClient:
+    mov 0(%rdi), %r12
+    mov 8(%rdi), %r13
+    mov 16(%rdi), %r14
+    mov 24(%rdi), %r15
+    mov 32(%rdi), %rbx
+    mov 40(%rdi), %rbp
+
+    rdtsc
+    shl $32, %rdx
+    or %rax, %rdx
+    push %rdx
+
+1:
+    # empty messages travel in registers only
+    mov %r13, %rdi
+    xor %esi, %esi
+    test %rbx, %rbx
+    jz 2f
+    mov $)" STRINGIFY(IPC_BUFFER) R"(, %esi
+2:
+    mov %r15, %rdx
+    mov %rbx, %r10
+    xor %r8d, %r8d
+    xor %r9d, %r9d
+    mov $)" STRINGIFY(SYSCALL_IPC_SEND) R"(, %eax
+    syscall
+
+    mov %r14, %rdi
+    mov %rbp, %rsi
+    mov %rbx, %rdx
+    mov $)" STRINGIFY(SYSCALL_IPC_RECEIVE) R"(, %eax
+    syscall
+
+    dec %r12
+    jnz 1b
+
+    rdtsc
+    shl $32, %rdx
+    or %rax, %rdx
+    pop %rcx
+    sub %rcx, %rdx
+    mov %rdx, %rdi
+    mov $)" STRINGIFY(SYSCALL_EXIT) R"(, %eax
+    syscall
+    ud2
+
+UserIPCServer:
+    mov 0(%rdi), %r12
+    mov 8(%rdi), %r13
+    mov 16(%rdi), %r14
+    mov 32(%rdi), %rbx
+    mov 40(%rdi), %rbp
+
+1:
+    mov %r13, %rdi
+    mov %rbp, %rsi
+    mov %rbx, %rdx
+    mov $)" STRINGIFY(SYSCALL_IPC_RECEIVE) R"(, %eax
+    syscall
+
+    # send back what we got, buffer words now point into our window
+    mov %rsi, %r10
+    mov %rdi, %rdx
+    mov %r8, %rsi
+    and $)" STRINGIFY(IPC_BUFFER) R"(, %esi
+    mov %r14, %rdi
+    xor %r8d, %r8d
+    xor %r9d, %r9d
+    mov $)" STRINGIFY(SYSCALL_IPC_SEND) R"(, %eax
+    syscall
+
+    dec %r12
+    jnz 1b
+
+    xor %edi, %edi
+    mov $)" STRINGIFY(SYSCALL_EXIT) R"(, %eax
+    syscall
+    ud2
+UserIPCServerEnd:
+)");
+
+extern "C" u8 UserIPCClient[];
+extern "C" u8 UserIPCServer[];
+extern "C" u8 UserIPCServerEnd[];
+
+// create address space with given code, a stack and a buffer at every given address
+// returns address space, params point to bottom of stack page
+static AddressSpace* CreateIPCBenchSpace(u8* code, u64 code_size, u64 buffer_pages,
+                                         u64* buffers, u64 buffer_count, IPCBenchParams** params){
+    AddressSpace* space = CreateAddressSpace();
+    u64 code_page = AllocateUserPage(space, BENCH_IPC_USER_CODE, MAP_PRESENT);
+    memcpy(reinterpret_cast<void*>(code_page), code, code_size);
+
+    u64 stack = AllocateUserPage(space, USER_STACK_TOP - PAGE_SIZE, MAP_PRESENT | MAP_READ_WRITE);
+    *params = reinterpret_cast<IPCBenchParams*>(stack);
+
+    for(u64 b = 0; b < buffer_count; b++){
+        for(u64 i = 0; i < buffer_pages; i++){
+            AllocateUserPage(space, buffers[b] + i * PAGE_SIZE, MAP_PRESENT | MAP_READ_WRITE);
+        }
+    }
+    return space;
+}
+
+// run one ping-pong and return cycles taken by client
+static u64 RunIPCBenchmark(u64 size, u64 iterations){
+    u64 buffer_pages = size ? (size + PAGE_SIZE - 1) / PAGE_SIZE : 1;
+
+    IPCBenchParams* client_params;
+    IPCBenchParams* server_params;
+    u64 client_buffers[] = {BENCH_IPC_USER_BUFFER, BENCH_IPC_USER_WINDOW};
+    u64 server_buffers[] = {BENCH_IPC_USER_WINDOW};
+    AddressSpace* client_space = CreateIPCBenchSpace(UserIPCClient, UserIPCServer - UserIPCClient,
+                                                     buffer_pages, client_buffers, 2, &client_params);
+    AddressSpace* server_space = CreateIPCBenchSpace(UserIPCServer, UserIPCServerEnd - UserIPCServer,
+                                                     buffer_pages, server_buffers, 1, &server_params);
+
+    u64 ping = CreateIPCEndpoint(client_space);
+    u64 pong = CreateIPCEndpoint(client_space);
+
+    client_params->iterations = iterations;
+    client_params->ping = ping;
+    client_params->pong = pong;
+    client_params->buffer = BENCH_IPC_USER_BUFFER;
+    client_params->size = size;
+    client_params->window = BENCH_IPC_USER_WINDOW;
+    server_params->iterations = iterations;
+    server_params->ping = ping;
+    server_params->pong = pong;
+    server_params->size = size;
+    server_params->window = BENCH_IPC_USER_WINDOW;
+
+    u64 params_vaddr = USER_STACK_TOP - PAGE_SIZE;
+    Thread* server = CreateUserThread("ipc-server", server_space, BENCH_IPC_USER_CODE, USER_STACK_TOP, params_vaddr);
+    Thread* client = CreateUserThread("ipc-client", client_space, BENCH_IPC_USER_CODE, USER_STACK_TOP, params_vaddr);
+    StartThread(server);
+    StartThread(client);
+    u64 cycles = JoinThread(client);
+    JoinThread(server);
+
+    DestroyIPCEndpoints(client_space);
+    DestroyAddressSpace(client_space);
+    DestroyAddressSpace(server_space);
+    return cycles;
+}
+
+void BenchmarkIPC(){
+    ColorPrintf(COLOR_YELLOW, COLOR_BLACK, "[+] Benchmark : IPC Ping-Pong\n");
+
+    static const u64 sizes[] = {0, 64, 1024, 4096, 16384, 65536, 262144, 1048576};
+    for(u64 s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++){
+        u64 size = sizes[s];
+        u64 iterations = BENCH_IPC_MAX_ITERATIONS;
+        if(size && BENCH_IPC_BYTES / size < iterations) iterations = BENCH_IPC_BYTES / size;
+
+        u64 ns = CyclesToNanoseconds(RunIPCBenchmark(size, iterations));
+        // message goes both ways in a round trip
+        u64 bytes = 2 * size * iterations;
+        Printf("\tSize : %lu B | Round Trip : %lu ns | Bandwidth : %lu MB/s | %s\n",
+               size, ns / iterations, ns ? (bytes * 1000) / ns : 0,
+               size == 0 ? "registers" : (size >= IPC_REMAP_THRESHOLD ? "remapped" : "copied"));
+    }
+}
@@ -0,0 +1,93 @@
+/**
+ * @file IPC.hpp
+ * @author Siddharth Mishra (brightprogrammer)
+ * @date 10/18/26
+ * @brief Synchronous message passing between threads. Small messages
+ * travel in registers, large buffers move by remapping pages.
+ * @copyright MIT License 2022 Siddharth Mishra
+ * */
+
+#ifndef IPC_HPP
+#define IPC_HPP
+
+#include "Common.hpp"
+
+struct AddressSpace;
+
+/* ------------------ IPC --------------------
+ *
+ * Messages are sent to endpoints. Sender and receiver meet at an endpoint,
+ * whoever comes first sleeps until other side arrives, and whoever comes
+ * second moves the message. Nothing is buffered in kernel.
+ *
+ * Every message carries 4 words, which go from registers of sender to
+ * registers of receiver. If IPC_BUFFER is set, first two words are address
+ * and length of a buffer that is moved too :
+ *
+ *  - smaller than IPC_REMAP_THRESHOLD, or not page aligned on both sides :
+ *    copied once, straight from sender's pages into receiver's pages
+ *  - otherwise whole pages are remapped into receiver's buffer, read only and
+ *    copy on write on both sides, and only the tail of last page is copied
+ *
+ * System calls :
+ *
+ *  SYSCALL_IPC_CREATE() -> endpoint id
+ *
+ *  SYSCALL_IPC_SEND(endpoint, flags, word0, word1, word2, word3)
+ *    -> number of buffer bytes delivered
+ *
+ *  SYSCALL_IPC_RECEIVE(endpoint, buffer, capacity) -> number of buffer bytes received
+ *    rdi, rsi, rdx, r10 : message words (buffer address and length are
+ *                         rewritten to where buffer landed in receiver)
+ *    r8 : message flags, IPC_REMAPPED is added if pages were remapped
+ *    r9 : id of sender thread
+ *
+ * */
+
+// message carries a buffer, word0 is it's address and word1 it's length
+#define IPC_BUFFER (1 << 0)
+// set in received flags when buffer pages were remapped instead of copied
+#define IPC_REMAPPED (1 << 1)
+
+// buffers this large are remapped instead of copied
+#define IPC_REMAP_THRESHOLD (16 * 1024)
+// number of words in a message
+#define IPC_MESSAGE_WORDS 4
+// max number of endpoints in system
+#define IPC_MAX_ENDPOINTS 64
+
+/**
+ * @brief Create an endpoint owned by given address space.
+ *
+ * @return Id of endpoint or SYSCALL_ERROR.
+ * */
+u64 CreateIPCEndpoint(AddressSpace* owner);
+
+/**
+ * @brief Destroy all endpoints owned by given address space.
+ * Threads waiting on them fail with SYSCALL_ERROR.
+ * */
+void DestroyIPCEndpoints(AddressSpace* owner);
+
+/**
+ * @brief System call handler for SYSCALL_IPC_CREATE.
+ * */
+u64 SyscallIPCCreate(u64, u64, u64, u64, u64, u64);
+
+/**
+ * @brief System call handler for SYSCALL_IPC_SEND.
+ * */
+u64 SyscallIPCSend(u64 endpoint, u64 flags, u64 word0, u64 word1, u64 word2, u64 word3);
+
+/**
+ * @brief System call handler for SYSCALL_IPC_RECEIVE.
+ * */
+u64 SyscallIPCReceive(u64 endpoint, u64 buffer, u64 capacity, u64, u64, u64);
+
+/**
+ * @brief Ping-pong messages of different sizes between two address
+ * spaces and report round trip latency and bandwidth.
+ * */
+void BenchmarkIPC();
+
+#endif // IPC_HPP
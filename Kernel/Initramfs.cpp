@@ -0,0 +1,561 @@
+/**
+ * @file Initramfs.cpp
+ * @author Siddharth Mishra (brightprogrammer)
+ * @date 10/18/26
+ * @brief Read only file archive (cpio newc or ustar) loaded as a boot module.
+ * @copyright MIT License 2022 Siddharth Mishra
+ * */
+
+#include "Initramfs.hpp"
+#include "Module.hpp"
+#include "MemoryManager.hpp"
+#include "Slab.hpp"
+#include "CPU.hpp"
+#include "Printf.hpp"
+#include "String.hpp"
+#include "Timer.hpp"
+#include "VFS.hpp"
+
+// cpio newc header is 110 ascii characters, fields are 8 hex digits
+#define CPIO_HEADER_SIZE 110
+#define CPIO_MODE_OFFSET 14
+#define CPIO_FILESIZE_OFFSET 54
+#define CPIO_NAMESIZE_OFFSET 94
+#define CPIO_TRAILER "TRAILER!!!"
+
+// ustar headers and data are in 512 byte blocks
+#define USTAR_BLOCK_SIZE 512
+#define USTAR_NAME_SIZE 100
+#define USTAR_SIZE_OFFSET 124
+#define USTAR_CHECKSUM_OFFSET 148
+#define USTAR_TYPE_OFFSET 156
+#define USTAR_LINKNAME_OFFSET 157
+#define USTAR_MAGIC_OFFSET 257
+#define USTAR_PREFIX_OFFSET 345
+#define USTAR_PREFIX_SIZE 155
+
+// initial number of hash buckets, table doubles whenever it gets full
+#define INITRAMFS_INITIAL_BUCKETS 1024
+// longest path built from ustar prefix and name
+#define INITRAMFS_PATH_SIZE 256
+
+static SlabCache initramfs_file_cache("initramfs.file", sizeof(InitramfsFile), 16);
+static SlabCache initramfs_path_cache("initramfs.path", INITRAMFS_PATH_SIZE, 16);
+
+static Initramfs boot_initramfs;
+static bool has_boot_initramfs = false;
+
+// FNV-1a
+static u64 HashPath(const char* path, u64 length){
+    u64 hash = 0xcbf29ce484222325;
+    for(u64 i = 0; i < length; i++){
+        hash ^= u8(path[i]);
+        hash *= 0x100000001b3;
+    }
+    return hash;
+}
+
+// drop leading "/" and "./" and trailing "/"
+static void NormalizePath(const char** path, u64* length){
+    const char* p = *path;
+    u64 n = *length;
+    while(n){
+        if(p[0] == '/'){
+            p++;
+            n--;
+        }else if(n >= 2 && p[0] == '.' && p[1] == '/'){
+            p += 2;
+            n -= 2;
+        }else{
+            break;
+        }
+    }
+    // "." is root of archive
+    if(n == 1 && p[0] == '.') n = 0;
+    while(n && p[n - 1] == '/') n--;
+
+    *path = p;
+    *length = n;
+}
+
+// length of a string in a fixed size field that may not be null terminated
+static u64 FieldLength(const char* field, u64 size){
+    u64 n = 0;
+    while(n < size && field[n]) n++;
+    return n;
+}
+
+static u64 ParseHex(const char* str, u64 n, bool* ok){
+    u64 value = 0;
+    for(u64 i = 0; i < n; i++){
+        char c = str[i];
+        u64 digit;
+        if(c >= '0' && c <= '9') digit = c - '0';
+        else if(c >= 'a' && c <= 'f') digit = c - 'a' + 10;
+        else if(c >= 'A' && c <= 'F') digit = c - 'A' + 10;
+        else{
+            *ok = false;
+            return 0;
+        }
+        value = (value << 4) | digit;
+    }
+    return value;
+}
+
+// octal fields are padded with leading zeros or spaces and end with a null or space
+static u64 ParseOctal(const char* str, u64 n){
+    u64 i = 0;
+    while(i < n && str[i] == ' ') i++;
+
+    u64 value = 0;
+    for(; i < n && str[i] >= '0' && str[i] <= '7'; i++){
+        value = (value << 3) | u64(str[i] - '0');
+    }
+    return value;
+}
+
+// double number of buckets and rehash every entry
+static void GrowBuckets(Initramfs* fs){
+    u64 count = fs->bucket_count ? fs->bucket_count * 2 : INITRAMFS_INITIAL_BUCKETS;
+    u64 pages = (count * sizeof(InitramfsFile*) + PAGE_SIZE - 1) / PAGE_SIZE;
+    InitramfsFile** buckets = reinterpret_cast<InitramfsFile**>(AllocateKernelMemory(pages));
+    memset(buckets, 0, pages * PAGE_SIZE);
+
+    // walk buckets back to front, so that order within a bucket is kept
+    // and newer entries stay in front of older ones with same path
+    for(u64 b = 0; b < fs->bucket_count; b++){
+        InitramfsFile* file = fs->buckets[b];
+        InitramfsFile* reversed = nullptr;
+        while(file){
+            InitramfsFile* next = file->next;
+            file->next = reversed;
+            reversed = file;
+            file = next;
+        }
+        while(reversed){
+            InitramfsFile* next = reversed->next;
+            u64 index = reversed->hash & (count - 1);
+            reversed->next = buckets[index];
+            buckets[index] = reversed;
+            reversed = next;
+        }
+    }
+
+    if(fs->buckets){
+        FreeKernelMemory(reinterpret_cast<u64>(fs->buckets), (fs->bucket_count * sizeof(InitramfsFile*) + PAGE_SIZE - 1) / PAGE_SIZE);
+    }
+    fs->buckets = buckets;
+    fs->bucket_count = count;
+}
+
+static void AddFile(Initramfs* fs, const char* path, u64 length, u64 data, u64 size, u32 mode){
+    NormalizePath(&path, &length);
+    if(length == 0) return;
+
+    if(fs->file_count >= fs->bucket_count){
+        GrowBuckets(fs);
+    }
+
+    InitramfsFile* file = reinterpret_cast<InitramfsFile*>(SlabAllocate(&initramfs_file_cache));
+    file->path = path;
+    file->path_length = length;
+    file->data = data;
+    file->size = size;
+    file->mode = mode;
+    file->hash = HashPath(path, length);
+
+    u64 index = file->hash & (fs->bucket_count - 1);
+    file->next = fs->buckets[index];
+    fs->buckets[index] = file;
+    fs->file_count++;
+}
+
+static bool LoadCpio(Initramfs* fs){
+    u64 offset = 0;
+    while(true){
+        if(fs->size - offset < CPIO_HEADER_SIZE) return false;
+        const char* header = reinterpret_cast<const char*>(fs->base + offset);
+        if(memcmp(header, "07070", 5) != 0 || (header[5] != '1' && header[5] != '2')) return false;
+
+        bool ok = true;
+        u32 mode = ParseHex(header + CPIO_MODE_OFFSET, 8, &ok);
+        u64 size = ParseHex(header + CPIO_FILESIZE_OFFSET, 8, &ok);
+        u64 namesize = ParseHex(header + CPIO_NAMESIZE_OFFSET, 8, &ok);
+        if(!ok || namesize == 0 || namesize > fs->size - offset - CPIO_HEADER_SIZE) return false;
+
+        // name size counts null terminator
+        const char* name = header + CPIO_HEADER_SIZE;
+        u64 length = namesize - 1;
+        if(length == sizeof(CPIO_TRAILER) - 1 && memcmp(name, CPIO_TRAILER, length) == 0) return true;
+
+        // name and data are both padded to 4 bytes
+        u64 data = (offset + CPIO_HEADER_SIZE + namesize + 3) & ~u64(3);
+        if(data > fs->size || size > fs->size - data) return false;
+
+        AddFile(fs, name, length, fs->base + data, size, mode);
+        offset = (data + size + 3) & ~u64(3);
+        // padding of last entry may be cut off, but trailer can't be
+        if(offset >= fs->size) return false;
+    }
+}
+
+static bool LoadUstar(Initramfs* fs){
+    u64 offset = 0;
+    while(fs->size - offset >= USTAR_BLOCK_SIZE){
+        const char* header = reinterpret_cast<const char*>(fs->base + offset);
+        // archive ends with zero blocks
+        if(header[0] == 0) return true;
+        if(memcmp(header + USTAR_MAGIC_OFFSET, "ustar", 5) != 0) return false;
+
+        u64 size = ParseOctal(header + USTAR_SIZE_OFFSET, 12);
+        u64 data = offset + USTAR_BLOCK_SIZE;
+        char type = header[USTAR_TYPE_OFFSET];
+        // links and directories have no data blocks, whatever size says
+        if(type != '0' && type != '\0' && type != '7') size = 0;
+        if(size > fs->size - data) return false;
+
+        u32 mode = 0;
+        u64 contents = fs->base + data;
+        u64 contents_size = size;
+        if(type == '0' || type == '\0' || type == '7'){
+            mode = INITRAMFS_MODE_FILE;
+        }else if(type == '5'){
+            mode = INITRAMFS_MODE_DIRECTORY;
+        }else if(type == '2'){
+            // target of a symlink is in it's header
+            mode = INITRAMFS_MODE_SYMLINK;
+            contents = fs->base + offset + USTAR_LINKNAME_OFFSET;
+            contents_size = FieldLength(header + USTAR_LINKNAME_OFFSET, USTAR_NAME_SIZE);
+        }
+        mode |= ParseOctal(header + 100, 8) & 07777;
+
+        // other types (hard links, devices, extended headers) are skipped
+        if(mode & INITRAMFS_MODE_TYPE){
+            const char* name = header;
+            u64 length = FieldLength(name, USTAR_NAME_SIZE);
+            const char* prefix = header + USTAR_PREFIX_OFFSET;
+            u64 prefix_length = FieldLength(prefix, USTAR_PREFIX_SIZE);
+
+            if(prefix_length == 0){
+                AddFile(fs, name, length, contents, contents_size, mode);
+            }else{
+                // only path that can't be a slice of archive
+                NormalizePath(&prefix, &prefix_length);
+                char* path = reinterpret_cast<char*>(SlabAllocate(&initramfs_path_cache));
+                memcpy(path, prefix, prefix_length);
+                path[prefix_length] = '/';
+                memcpy(path + prefix_length + 1, name, length);
+                AddFile(fs, path, prefix_length + 1 + length, contents, contents_size, mode);
+            }
+        }
+
+        offset = data + ((size + USTAR_BLOCK_SIZE - 1) & ~u64(USTAR_BLOCK_SIZE - 1));
+        // last data block may be cut short, archive ends with it
+        if(offset >= fs->size) break;
+    }
+    return true;
+}
+
+bool LoadInitramfs(Initramfs* fs, u64 base, u64 size){
+    fs->base = base;
+    fs->size = size;
+    fs->buckets = nullptr;
+    fs->bucket_count = 0;
+    fs->file_count = 0;
+    GrowBuckets(fs);
+
+    if(size >= 6 && memcmp(reinterpret_cast<const void*>(base), "07070", 5) == 0){
+        return LoadCpio(fs);
+    }
+    if(size >= USTAR_BLOCK_SIZE && memcmp(reinterpret_cast<const void*>(base + USTAR_MAGIC_OFFSET), "ustar", 5) == 0){
+        return LoadUstar(fs);
+    }
+    return false;
+}
+
+void DestroyInitramfs(Initramfs* fs){
+    for(u64 b = 0; b < fs->bucket_count; b++){
+        InitramfsFile* file = fs->buckets[b];
+        while(file){
+            InitramfsFile* next = file->next;
+            u64 path = reinterpret_cast<u64>(file->path);
+            if(path < fs->base || path >= fs->base + fs->size){
+                SlabFree(&initramfs_path_cache, const_cast<char*>(file->path));
+            }
+            SlabFree(&initramfs_file_cache, file);
+            file = next;
+        }
+    }
+
+    if(fs->buckets){
+        FreeKernelMemory(reinterpret_cast<u64>(fs->buckets), (fs->bucket_count * sizeof(InitramfsFile*) + PAGE_SIZE - 1) / PAGE_SIZE);
+    }
+    fs->buckets = nullptr;
+    fs->bucket_count = 0;
+    fs->file_count = 0;
+}
+
+InitramfsFile* FindInitramfsFile(Initramfs* fs, const char* path, u64 length){
+    NormalizePath(&path, &length);
+    u64 hash = HashPath(path, length);
+    for(InitramfsFile* file = fs->buckets[hash & (fs->bucket_count - 1)]; file; file = file->next){
+        if(file->hash == hash && file->path_length == length && memcmp(file->path, path, length) == 0){
+            return file;
+        }
+    }
+    return nullptr;
+}
+
+void InitializeInitramfs(){
+    BootModule* module = FindModule("initramfs");
+    if(module == nullptr) return;
+
+    if(!LoadInitramfs(&boot_initramfs, module->base, module->size)){
+        ColorPrintf(COLOR_RED, COLOR_BLACK, "[-] Initramfs is malformed, ignoring it\n");
+        DestroyInitramfs(&boot_initramfs);
+        return;
+    }
+
+    has_boot_initramfs = true;
+    Printf("\tInitramfs : %lu files\n", boot_initramfs.file_count);
+}
+
+Initramfs* GetInitramfs(){
+    return has_boot_initramfs ? &boot_initramfs : nullptr;
+}
+
+/******************** VFS ********************/
+
+// root of archive has no entry, it's node is nullptr
+static void FillNodeInfo(InitramfsFile* file, VFSNodeInfo* info){
+    info->node = file;
+    info->id = file ? reinterpret_cast<u64>(file) : 1;
+    info->type = (file == nullptr || (file->mode & INITRAMFS_MODE_TYPE) == INITRAMFS_MODE_DIRECTORY) ?
+        VFS_TYPE_DIRECTORY : VFS_TYPE_FILE;
+    info->size = file ? file->size : 0;
+    info->cache = nullptr;
+}
+
+static bool VFSLookupFile(Inode* directory, const char* name, u64 length, VFSNodeInfo* info){
+    Initramfs* fs = reinterpret_cast<Initramfs*>(directory->mount->data);
+    InitramfsFile* parent = reinterpret_cast<InitramfsFile*>(directory->node);
+
+    // archive is indexed by whole paths
+    char path[2 * INITRAMFS_PATH_SIZE];
+    u64 parent_length = parent ? parent->path_length : 0;
+    if(parent_length + 1 + length > sizeof(path)) return false;
+    if(parent) memcpy(path, parent->path, parent_length);
+    path[parent_length] = '/';
+    memcpy(path + parent_length + 1, name, length);
+
+    InitramfsFile* file = FindInitramfsFile(fs, path, parent_length + 1 + length);
+    if(file == nullptr) return false;
+    FillNodeInfo(file, info);
+    return true;
+}
+
+static u64 VFSReadFile(Inode* inode, u64 offset, void* buffer, u64 size){
+    InitramfsFile* file = reinterpret_cast<InitramfsFile*>(inode->node);
+    if(offset >= file->size) return 0;
+    if(size > file->size - offset) size = file->size - offset;
+    memcpy(buffer, reinterpret_cast<const void*>(file->data + offset), size);
+    return size;
+}
+
+// cookie is bucket in upper half and position in bucket in lower half
+static bool VFSReadArchiveDirectory(Inode* directory, u64* cookie, VFSDirectoryEntry* entry){
+    Initramfs* fs = reinterpret_cast<Initramfs*>(directory->mount->data);
+    InitramfsFile* parent = reinterpret_cast<InitramfsFile*>(directory->node);
+    u64 parent_length = parent ? parent->path_length : 0;
+
+    for(u64 bucket = *cookie >> 32, position = *cookie & 0xffffffff; bucket < fs->bucket_count; bucket++, position = 0){
+        InitramfsFile* file = fs->buckets[bucket];
+        for(u64 i = 0; file && i < position; i++) file = file->next;
+
+        for(; file; file = file->next){
+            position++;
+            // direct children only, and only winning entry of a path
+            u64 start = parent ? parent_length + 1 : 0;
+            if(file->path_length <= start) continue;
+            if(parent && (memcmp(file->path, parent->path, parent_length) != 0 || file->path[parent_length] != '/')) continue;
+            u64 slash = start;
+            while(slash < file->path_length && file->path[slash] != '/') slash++;
+            if(slash != file->path_length) continue;
+            if(FindInitramfsFile(fs, file->path, file->path_length) != file) continue;
+
+            u64 length = file->path_length - start;
+            if(length > VFS_NAME_MAX) continue;
+            memcpy(entry->name, file->path + start, length);
+            entry->name[length] = 0;
+            VFSNodeInfo info;
+            FillNodeInfo(file, &info);
+            entry->type = info.type;
+            entry->size = info.size;
+            *cookie = (bucket << 32) | position;
+            return true;
+        }
+    }
+    *cookie = fs->bucket_count << 32;
+    return false;
+}
+
+// entries live as long as archive
+static void VFSReleaseFile(Mount*, void*){}
+
+static const VFSOperations initramfs_operations = {
+    "initramfs", false,
+    VFSLookupFile, nullptr, nullptr,
+    VFSReadFile, nullptr, nullptr,
+    VFSReadArchiveDirectory, VFSReleaseFile, nullptr, nullptr
+};
+
+bool VFSMountInitramfs(const char* path, Initramfs* fs){
+    VFSNodeInfo root;
+    FillNodeInfo(nullptr, &root);
+    return VFSMount(path, &initramfs_operations, fs, &root);
+}
+
+/******************** Initramfs Benchmark ********************/
+
+#define BENCH_INITRAMFS_DIRS 100
+#define BENCH_INITRAMFS_FILES_PER_DIR 100
+#define BENCH_INITRAMFS_FILES (BENCH_INITRAMFS_DIRS * BENCH_INITRAMFS_FILES_PER_DIR)
+#define BENCH_INITRAMFS_FILE_SIZE 64
+// room for one path in table of paths looked up
+#define BENCH_INITRAMFS_PATH_STRIDE 32
+
+static void WriteHex(char* dst, u64 value){
+    static const char digits[] = "0123456789abcdef";
+    for(int i = 7; i >= 0; i--){
+        dst[i] = digits[value & 0xf];
+        value >>= 4;
+    }
+}
+
+static void WriteOctal(char* dst, u64 width, u64 value){
+    dst[width - 1] = 0;
+    for(int i = int(width) - 2; i >= 0; i--){
+        dst[i] = char('0' + (value & 7));
+        value >>= 3;
+    }
+}
+
+// append a cpio entry, returns offset after it
+static u64 WriteCpioEntry(u64 archive, u64 offset, const char* name, u32 mode, u64 size){
+    char* header = reinterpret_cast<char*>(archive + offset);
+    u64 namesize = strlen(name) + 1;
+    memcpy(header, "070701", 6);
+    for(u64 field = 0; field < 13; field++){
+        WriteHex(header + 6 + field * 8, 0);
+    }
+    WriteHex(header + CPIO_MODE_OFFSET, mode);
+    WriteHex(header + CPIO_FILESIZE_OFFSET, size);
+    WriteHex(header + CPIO_NAMESIZE_OFFSET, namesize);
+    memcpy(header + CPIO_HEADER_SIZE, name, namesize);
+
+    u64 data = (offset + CPIO_HEADER_SIZE + namesize + 3) & ~u64(3);
+    memset(reinterpret_cast<void*>(archive + data), 'x', size);
+    return (data + size + 3) & ~u64(3);
+}
+
+// append a ustar entry, returns offset after it
+static u64 WriteUstarEntry(u64 archive, u64 offset, const char* name, char type, u64 size){
+    char* header = reinterpret_cast<char*>(archive + offset);
+    memset(header, 0, USTAR_BLOCK_SIZE);
+    memcpy(header, name, strlen(name));
+    WriteOctal(header + 100, 8, 0644);
+    WriteOctal(header + USTAR_SIZE_OFFSET, 12, size);
+    header[USTAR_TYPE_OFFSET] = type;
+    memcpy(header + USTAR_MAGIC_OFFSET, "ustar", 6);
+    memcpy(header + USTAR_MAGIC_OFFSET + 6, "00", 2);
+
+    // checksum is computed with checksum field filled with spaces
+    memset(header + USTAR_CHECKSUM_OFFSET, ' ', 8);
+    u64 checksum = 0;
+    for(u64 i = 0; i < USTAR_BLOCK_SIZE; i++) checksum += u8(header[i]);
+    WriteOctal(header + USTAR_CHECKSUM_OFFSET, 7, checksum);
+
+    u64 data = offset + USTAR_BLOCK_SIZE;
+    u64 blocks = (size + USTAR_BLOCK_SIZE - 1) & ~u64(USTAR_BLOCK_SIZE - 1);
+    memset(reinterpret_cast<void*>(archive + data), 'x', blocks);
+    return data + blocks;
+}
+
+// build an archive with a directory entry for every directory and
+// files dirN/fileM, returns size of archive
+static u64 BuildBenchmarkArchive(u64 archive, bool cpio){
+    u64 offset = 0;
+    char name[BENCH_INITRAMFS_PATH_STRIDE];
+    for(u64 d = 0; d < BENCH_INITRAMFS_DIRS; d++){
+        sprintf(name, "dir%lu", d);
+        offset = cpio ? WriteCpioEntry(archive, offset, name, INITRAMFS_MODE_DIRECTORY | 0755, 0)
+                      : WriteUstarEntry(archive, offset, name, '5', 0);
+
+        for(u64 f = 0; f < BENCH_INITRAMFS_FILES_PER_DIR; f++){
+            sprintf(name, "dir%lu/file%lu", d, f);
+            offset = cpio ? WriteCpioEntry(archive, offset, name, INITRAMFS_MODE_FILE | 0644, BENCH_INITRAMFS_FILE_SIZE)
+                          : WriteUstarEntry(archive, offset, name, '0', BENCH_INITRAMFS_FILE_SIZE);
+        }
+    }
+
+    if(cpio){
+        return WriteCpioEntry(archive, offset, CPIO_TRAILER, 0, 0);
+    }
+    memset(reinterpret_cast<void*>(archive + offset), 0, 2 * USTAR_BLOCK_SIZE);
+    return offset + 2 * USTAR_BLOCK_SIZE;
+}
+
+// look up every path in table, returns average cycles per lookup
+static u64 TimeLookups(Initramfs* fs, u64 paths, u64* found){
+    *found = 0;
+    u64 start = ReadTimestampCounter();
+    for(u64 i = 0; i < BENCH_INITRAMFS_FILES; i++){
+        const char* path = reinterpret_cast<const char*>(paths + i * BENCH_INITRAMFS_PATH_STRIDE);
+        if(FindInitramfsFile(fs, path, strlen(path))) (*found)++;
+    }
+    return (ReadTimestampCounter() - start) / BENCH_INITRAMFS_FILES;
+}
+
+void BenchmarkInitramfs(){
+    ColorPrintf(COLOR_YELLOW, COLOR_BLACK, "[+] Benchmark : Initramfs Index (10k files)\n");
+
+    // ustar needs two blocks per file, cpio much less
+    u64 archive_pages = ((BENCH_INITRAMFS_FILES + BENCH_INITRAMFS_DIRS + 2) * 2 * USTAR_BLOCK_SIZE) / PAGE_SIZE + 1;
+    u64 archive = AllocateKernelMemory(archive_pages);
+
+    // paths that exist and paths that don't, with leading "/" like callers would pass
+    u64 path_pages = (BENCH_INITRAMFS_FILES * BENCH_INITRAMFS_PATH_STRIDE) / PAGE_SIZE;
+    u64 hits = AllocateKernelMemory(path_pages);
+    u64 misses = AllocateKernelMemory(path_pages);
+    for(u64 i = 0; i < BENCH_INITRAMFS_FILES; i++){
+        u64 d = i / BENCH_INITRAMFS_FILES_PER_DIR;
+        u64 f = i % BENCH_INITRAMFS_FILES_PER_DIR;
+        sprintf(reinterpret_cast<char*>(hits + i * BENCH_INITRAMFS_PATH_STRIDE), "/dir%lu/file%lu", d, f);
+        sprintf(reinterpret_cast<char*>(misses + i * BENCH_INITRAMFS_PATH_STRIDE), "/dir%lu/nofile%lu", d, f);
+    }
+
+    for(int cpio = 1; cpio >= 0; cpio--){
+        u64 size = BuildBenchmarkArchive(archive, cpio);
+
+        Initramfs fs;
+        u64 start = ReadTimestampCounter();
+        bool ok = LoadInitramfs(&fs, archive, size);
+        u64 build_ns = CyclesToNanoseconds(ReadTimestampCounter() - start);
+
+        u64 found_hits, found_misses;
+        u64 hit_ns = CyclesToNanoseconds(TimeLookups(&fs, hits, &found_hits));
+        u64 miss_ns = CyclesToNanoseconds(TimeLookups(&fs, misses, &found_misses));
+
+        Printf("\tFormat : %s | Size : %lu KB | Files : %lu | Build : %lu us (%lu ns per file) | %s\n",
+               cpio ? "cpio" : "ustar", size / KB, fs.file_count, build_ns / 1000,
+               fs.file_count ? build_ns / fs.file_count : 0, ok ? "ok" : "malformed");
+        Printf("\tLookup Hit : %lu ns (%lu found) | Lookup Miss : %lu ns (%lu found)\n",
+               hit_ns, found_hits, miss_ns, found_misses);
+
+        DestroyInitramfs(&fs);
+    }
+
+    FreeKernelMemory(archive, archive_pages);
+    FreeKernelMemory(hits, path_pages);
+    FreeKernelMemory(misses, path_pages);
+}
@@ -0,0 +1,113 @@
+/**
+ * @file Initramfs.hpp
+ * @author Siddharth Mishra (brightprogrammer)
+ * @date 10/18/26
+ * @brief Read only file archive (cpio newc or ustar) loaded as a boot module.
+ * @copyright MIT License 2022 Siddharth Mishra
+ * */
+
+#ifndef INITRAMFS_HPP
+#define INITRAMFS_HPP
+
+#include "Common.hpp"
+
+/* ------------------ INITRAMFS --------------------
+ *
+ * Archive is parsed once, front to back, and every entry is put in a hash
+ * table keyed by it's path. Nothing is copied : paths and contents of files
+ * are slices of archive memory, so archive must stay in memory as long as
+ * index is used (boot modules always do).
+ *
+ * Paths are stored without leading "/" or "./" and without trailing "/",
+ * so "/etc/motd", "./etc/motd" and "etc/motd" name the same file. Root of
+ * archive itself is not indexed. If an archive contains same path twice,
+ * later entry wins.
+ *
+ * Both cpio newc (magic 070701 or 070702) and ustar are accepted, format is
+ * detected from first header.
+ *
+ * */
+
+// file type bits of mode, same as unix
+#define INITRAMFS_MODE_TYPE 0170000
+#define INITRAMFS_MODE_DIRECTORY 0040000
+#define INITRAMFS_MODE_FILE 0100000
+#define INITRAMFS_MODE_SYMLINK 0120000
+
+/**
+ * @brief An entry of archive.
+ * */
+struct InitramfsFile {
+    // normalized path, not null terminated
+    const char* path;
+    u64 path_length;
+    // kernel address of contents, inside archive
+    u64 data;
+    u64 size;
+    u32 mode;
+    u64 hash;
+    // next entry in same hash bucket
+    InitramfsFile* next;
+};
+
+/**
+ * @brief Index of an archive.
+ * */
+struct Initramfs {
+    u64 base;
+    u64 size;
+    // hash table, number of buckets is a power of 2
+    InitramfsFile** buckets;
+    u64 bucket_count;
+    u64 file_count;
+};
+
+/**
+ * @brief Index archive in boot module named "initramfs", if there is one.
+ * Must be called after boot modules are initialized.
+ * */
+void InitializeInitramfs();
+
+/**
+ * @brief Get index of boot archive, or nullptr if there is none.
+ * */
+Initramfs* GetInitramfs();
+
+/**
+ * @brief Build index of an archive.
+ *
+ * @param fs Index to fill.
+ * @param base Kernel address of archive.
+ * @param size Size of archive in bytes.
+ * @return false if archive is malformed, index must still be destroyed.
+ * */
+bool LoadInitramfs(Initramfs* fs, u64 base, u64 size);
+
+/**
+ * @brief Free index of an archive. Archive itself is not touched.
+ * */
+void DestroyInitramfs(Initramfs* fs);
+
+/**
+ * @brief Find an entry by it's path.
+ *
+ * @param fs Index of archive.
+ * @param path Path of entry, leading "/" or "./" is ignored.
+ * @param length Length of path.
+ * @return Entry or nullptr if there is no such path.
+ * */
+InitramfsFile* FindInitramfsFile(Initramfs* fs, const char* path, u64 length);
+
+/**
+ * @brief Mount an archive in VFS, read only. Directories are only those
+ * that have an entry of their own in archive.
+ * */
+bool VFSMountInitramfs(const char* path, Initramfs* fs);
+
+/**
+ * @brief Measure index build time and lookup latency for
+ * archives with 10k files in both formats.
+ * */
+void BenchmarkInitramfs();
+
+#endif // INITRAMFS_HPP
@@ -40,42 +40,71 @@
 #include "PanicPrintf.hpp"
 #include "Keyboard.hpp"
 #include "IO.hpp"
-
+#include "APIC.hpp"
+#include "Scheduler.hpp"
+#include "FPU.hpp"
+#include "MemoryManager.hpp"
+#include "CPU.hpp"
+#include "Thread.hpp"
+
+// exit code of a user thread killed by a fault, what waiting parent sees
+#define FAULT_EXIT_CODE (~u64(0))
+
+// a fault caused by user code only takes down the thread that caused it,
+// it's report is already printed by caller
+static void __attribute__((noreturn)) KillFaultingThread(){
+    Thread* thread = GetCurrentThread();
+    PanicPrintf("\tKilled user thread %s\n", thread->name);
+    thread->exit_code = FAULT_EXIT_CODE;
+    ExitThread();
+}
 
 // without errcode
 __attribute__((interrupt)) void DefaultInterruptHandlerNoError(InterruptFrame* frame){
+    SwapGSIfFromUser(frame);
     PanicPrintf("REACHED DEFAULT INTERRUPT HANDLER!\n");
 
     // print information
     PanicPrintf("\tINSTRUCTION POINTER (RIP) : 0x%lx\n"
           "\tFLAGS REGISTER (RFLAGS) : 0x%lx\n"
-          "\tCODE SEGMENT (CS) : 0x%x\n",
+          "\tCODE SEGMENT (CS) : 0x%lx\n",
           frame->rip, frame->rflags, frame->cs);
+    if(frame->cs & 3) KillFaultingThread();
 }
 
 // with an errcode
 __attribute__((interrupt)) void DefaultInterruptHandlerWithError(InterruptFrame* frame, uint64_t errcode){
+    SwapGSIfFromUser(frame);
     PanicPrintf("REACHED DEFAULT INTERRUPT HANDLER!\n");
 
     // print information
     PanicPrintf("\tINSTRUCTION POINTER (RIP) : 0x%lx\n"
-          "\tCODE SEGMENT (CS) : 0x%x\n"
+          "\tCODE SEGMENT (CS) : 0x%lx\n"
           "\tFLAGS REGISTER (RFLAGS) : 0x%lx\n"
           "\tSTACK POINTER (RSP) : 0x%lx\n"
-          "\tSTACK SEGMENT (SS) : 0x%x\n"
+          "\tSTACK SEGMENT (SS) : 0x%lx\n"
           "\tERROR CODE : %lu\n",
           frame->rip, frame->cs, frame->rflags, frame->rsp, frame->ss, errcode);
+    if(frame->cs & 3) KillFaultingThread();
+}
+
+// 0x07
+__attribute__((interrupt)) void DeviceNotAvailableHandler(InterruptFrame* frame){
+    SwapGSIfFromUser(frame);
+    HandleFPUTrap();
+    SwapGSIfFromUser(frame);
 }
 
 // 0x08
 __attribute__((interrupt)) void DoubleFaultHandler(InterruptFrame* frame, uint64_t errorcode){
+    SwapGSIfFromUser(frame);
     PanicPrintf("Caught #DOUBLE_FAULT\n");
 
     PanicPrintf("\tINSTRUCTION POINTER (RIP) : 0x%lx\n"
-          "\tCODE SEGMENT (CS) : 0x%x\n"
+          "\tCODE SEGMENT (CS) : 0x%lx\n"
           "\tFLAGS REGISTER (RFLAGS) : 0x%lx\n"
           "\tSTACK POINTER (RSP) : 0x%lx\n"
-          "\tSTACK SEGMENT (SS) : 0x%x\n"
+          "\tSTACK SEGMENT (SS) : 0x%lx\n"
           "\tERROR CODE : %lu\n",
           frame->rip, frame->cs, frame->rflags, frame->rsp, frame->ss, errorcode);
 
@@ -85,31 +114,41 @@ __attribute__((interrupt)) void DoubleFaultHandler(InterruptFrame* frame, uint64
 
 // 0x0d
 __attribute__((interrupt)) void GeneralProtectionFaultHandler(InterruptFrame* frame, uint64_t errorcode){
+    SwapGSIfFromUser(frame);
     PanicPrintf("Caught #GENERAL_PROTECTION_FAULT\n");
 
     PanicPrintf("\tINSTRUCTION POINTER (RIP) : 0x%lx\n"
-          "\tCODE SEGMENT (CS) : 0x%x\n"
+          "\tCODE SEGMENT (CS) : 0x%lx\n"
           "\tFLAGS REGISTER (RFLAGS) : 0x%lx\n"
           "\tSTACK POINTER (RSP) : 0x%lx\n"
-          "\tSTACK SEGMENT (SS) : 0x%x\n"
+          "\tSTACK SEGMENT (SS) : 0x%lx\n"
           "\tERROR CODE : %lu\n",
           frame->rip, frame->cs, frame->rflags, frame->rsp, frame->ss, errorcode);
 
+    if(frame->cs & 3) KillFaultingThread();
     while(true) asm("hlt");
 }
 
 // 0x0e
 __attribute__((interrupt)) void PageFaultHandler(InterruptFrame* frame, uint64_t errorcode){
+    SwapGSIfFromUser(frame);
+    // faults memory manager can fix (eg: copy on write)
+    if(HandlePageFault(ReadCR2(), errorcode, frame->rflags & RFLAGS_INTERRUPT_ENABLE)){
+        SwapGSIfFromUser(frame);
+        return;
+    }
+
     PanicPrintf("Caught #PAGE_FAULT\n");
 
     PanicPrintf("\tINSTRUCTION POINTER (RIP) : 0x%lx\n"
-          "\tCODE SEGMENT (CS) : 0x%x\n"
+          "\tCODE SEGMENT (CS) : 0x%lx\n"
           "\tFLAGS REGISTER (RFLAGS) : 0x%lx\n"
           "\tSTACK POINTER (RSP) : 0x%lx\n"
-          "\tSTACK SEGMENT (SS) : 0x%x\n"
+          "\tSTACK SEGMENT (SS) : 0x%lx\n"
           "\tERROR CODE : %lu\n",
           frame->rip, frame->cs, frame->rflags, frame->rsp, frame->ss, errorcode);
 
+    if(frame->cs & 3) KillFaultingThread();
     while(true) asm("hlt");
 }
 
@@ -123,10 +162,37 @@ __attribute__((no_caller_saved_registers)) void EndSlavePIC(){
 }
 
 __attribute__((interrupt)) void KeyboardInterruptHandler(InterruptFrame* frame){
+    SwapGSIfFromUser(frame);
     // 0x60 is the port at which ps2 keyboard is located
     uint8_t scancode = PortReadByte(0x60);
     HandleKeyboardEvent(scancode);
     EndMasterPIC();
+    SwapGSIfFromUser(frame);
+}
+
+// acknowledge before scheduling, we may not return here for a while
+__attribute__((interrupt)) void APICTimerInterruptHandler(InterruptFrame* frame){
+    SwapGSIfFromUser(frame);
+    SendEndOfInterrupt();
+    SchedulerTick();
+    SwapGSIfFromUser(frame);
+}
+
+// idle loop will pick up the work once we return
+__attribute__((interrupt)) void RescheduleInterruptHandler(InterruptFrame* frame){
+    SwapGSIfFromUser(frame);
+    SendEndOfInterrupt();
+    SwapGSIfFromUser(frame);
+}
+
+__attribute__((interrupt)) void TLBShootdownInterruptHandler(InterruptFrame* frame){
+    SwapGSIfFromUser(frame);
+    HandleTLBShootdown();
+    SendEndOfInterrupt();
+    SwapGSIfFromUser(frame);
+}
+
+__attribute__((interrupt)) void SpuriousInterruptHandler(InterruptFrame*){
 }
 
 // remap pic
@@ -59,14 +59,24 @@
 // Reference : https://wiki.osdev.org/Exceptions
 
 // this is made as defined in intel architecture manual
+// cs and ss are pushed as full 8 byte slots in long mode
 struct InterruptFrame {
     uint64_t rip;
-    uint16_t cs;
+    uint64_t cs;
     uint64_t rflags;
     uint64_t rsp;
-    uint16_t ss;
+    uint64_t ss;
 } __attribute__((packed));
 
+/**
+ * @brief First and last thing every handler does. User code can load gs
+ * with anything, so per-cpu data is swapped in on entry from user mode and
+ * user gs base is swapped back before returning to it (see SyscallEntry).
+ * */
+inline void SwapGSIfFromUser(InterruptFrame* frame){
+    if(frame->cs & 3) asm volatile("swapgs" ::: "memory");
+}
+
 // default exception handlers
 __attribute__((interrupt)) void DefaultInterruptHandlerNoError(InterruptFrame* frame);
 __attribute__((interrupt)) void DefaultInterruptHandlerWithError(InterruptFrame* frame, uint64_t errcode);
@@ -78,8 +88,18 @@ __attribute__((interrupt)) void DoubleFaultHandler(InterruptFrame* frame, uint64
 __attribute__((interrupt)) void GeneralProtectionFaultHandler(InterruptFrame* frame, uint64_t errorcode);
 // page fault handler = 0x0e
 __attribute__((interrupt)) void PageFaultHandler(InterruptFrame* frame, uint64_t errocode);
+// device not available = 0x07, raised on first fpu use after a context switch
+__attribute__((interrupt)) void DeviceNotAvailableHandler(InterruptFrame* frame);
 // keyboard interrupt handler
 __attribute__((interrupt)) void KeyboardInterruptHandler(InterruptFrame* frame);
+// local apic timer interrupt handler, drives preemption
+__attribute__((interrupt)) void APICTimerInterruptHandler(InterruptFrame* frame);
+// sent by other cpus when there's work for this cpu
+__attribute__((interrupt)) void RescheduleInterruptHandler(InterruptFrame* frame);
+// sent by other cpus when they change mappings of our address space
+__attribute__((interrupt)) void TLBShootdownInterruptHandler(InterruptFrame* frame);
+// local apic spurious interrupt, must not be acknowledged
+__attribute__((interrupt)) void SpuriousInterruptHandler(InterruptFrame* frame);
 
 // remap pic chip so that our interrupts don't collide with
 // pic chip's interrupts
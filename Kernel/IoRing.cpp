@@ -0,0 +1,623 @@
+/**
+ * @file IoRing.cpp
+ * @author Siddharth Mishra (brightprogrammer)
+ * @date 10/18/26
+ * @brief Submission and completion rings shared between user and kernel,
+ * so that many requests can be made with a single system call.
+ * @copyright MIT License 2022 Siddharth Mishra
+ * */
+
+#include "IoRing.hpp"
+#include "Syscall.hpp"
+#include "Thread.hpp"
+#include "Scheduler.hpp"
+#include "MemoryManager.hpp"
+#include "Slab.hpp"
+#include "Spinlock.hpp"
+#include "CPU.hpp"
+#include "Printf.hpp"
+#include "String.hpp"
+#include "Timer.hpp"
+#include <new>
+
+// PAGE_SIZE is not a compile time constant, ring page arrays need one
+#define IO_RING_PAGE_SIZE 0x1000
+#define SUBMISSIONS_PER_PAGE (IO_RING_PAGE_SIZE / sizeof(IoRingSubmission))
+#define COMPLETIONS_PER_PAGE (IO_RING_PAGE_SIZE / sizeof(IoRingCompletion))
+#define IO_RING_MAX_SQ_PAGES (IO_RING_MAX_ENTRIES / SUBMISSIONS_PER_PAGE)
+#define IO_RING_MAX_CQ_PAGES (2 * IO_RING_MAX_ENTRIES / COMPLETIONS_PER_PAGE)
+
+// max number of timeouts pending in a ring at once
+#define IO_RING_MAX_TIMEOUTS 32
+// completions are collected on stack and published this many at once
+#define IO_RING_COMPLETION_BATCH 32
+// poll thread goes to sleep after submission ring stays empty for this long
+#define IO_RING_POLL_IDLE_NS 1000000
+
+struct IoRingTimeout {
+    u64 deadline;
+    u64 user_data;
+};
+
+struct IoRing {
+    u32 id;
+    AddressSpace* space;
+
+    // kernel addresses of ring pages
+    IoRingHeader* header;
+    u64 sq_pages[IO_RING_MAX_SQ_PAGES];
+    u64 cq_pages[IO_RING_MAX_CQ_PAGES];
+    u32 sq_mask;
+    u32 cq_entries;
+    u32 cq_mask;
+
+    // private copies of counters written by kernel,
+    // user can scribble over the ones in header
+    u32 sq_head;
+    volatile u32 cq_tail;
+
+    // whoever sets this consumes submission ring and expires timeouts,
+    // it's not a spinlock so that interrupts stay enabled while requests run
+    volatile bool submitting;
+    IoRingTimeout timeouts[IO_RING_MAX_TIMEOUTS];
+    volatile u32 timeout_count;
+
+    // serializes completions, they can also come from other rings
+    TicketLock<false> complete_lock;
+    // thread sleeping in SyscallIoRingEnter, protected by complete_lock
+    Thread* waiter;
+
+    // kernel thread polling submission ring if ring has IO_RING_SETUP_SQPOLL
+    Thread* poller;
+    volatile bool stopping;
+
+    IoRing() : id(0), space(nullptr), header(nullptr), sq_mask(0), cq_entries(0), cq_mask(0),
+               sq_head(0), cq_tail(0), submitting(false), timeout_count(0),
+               complete_lock("io_ring.complete"), waiter(nullptr), poller(nullptr), stopping(false) {}
+};
+
+static SlabCache io_ring_cache("io_ring", sizeof(IoRing), 64);
+
+// rings are looked up by id, id is index in this table
+static IoRing* io_rings[IO_RING_MAX_RINGS] = {};
+static TicketLock<> io_ring_table_lock("io_ring.table");
+
+static inline IoRingSubmission* GetSubmission(IoRing* ring, u32 counter){
+    u32 index = counter & ring->sq_mask;
+    return reinterpret_cast<IoRingSubmission*>(ring->sq_pages[index / SUBMISSIONS_PER_PAGE]) + index % SUBMISSIONS_PER_PAGE;
+}
+
+static inline IoRingCompletion* GetCompletion(IoRing* ring, u32 counter){
+    u32 index = counter & ring->cq_mask;
+    return reinterpret_cast<IoRingCompletion*>(ring->cq_pages[index / COMPLETIONS_PER_PAGE]) + index % COMPLETIONS_PER_PAGE;
+}
+
+// number of completions user hasn't consumed yet
+static inline u32 CompletionsReady(IoRing* ring){
+    return __atomic_load_n(&ring->cq_tail, __ATOMIC_ACQUIRE) - __atomic_load_n(&ring->header->cq_head, __ATOMIC_ACQUIRE);
+}
+
+// publish completions and wake up thread waiting for them
+static void PostCompletions(IoRing* ring, IoRingCompletion* completions, u32 count){
+    LockGuard guard(ring->complete_lock);
+
+    u32 head = __atomic_load_n(&ring->header->cq_head, __ATOMIC_ACQUIRE);
+    u32 tail = ring->cq_tail;
+    for(u32 i = 0; i < count; i++){
+        if(tail - head >= ring->cq_entries){
+            ring->header->cq_overflow = ring->header->cq_overflow + 1;
+            continue;
+        }
+
+        IoRingCompletion* completion = GetCompletion(ring, tail);
+        completion->user_data = completions[i].user_data;
+        completion->result = completions[i].result;
+        tail++;
+    }
+
+    // entries must be visible before user sees new tail
+    __atomic_store_n(&ring->cq_tail, tail, __ATOMIC_RELEASE);
+    __atomic_store_n(&ring->header->cq_tail, tail, __ATOMIC_RELEASE);
+
+    if(ring->waiter){
+        WakeThread(ring->waiter);
+    }
+}
+
+// send a completion to another ring
+static u64 SendRingMessage(u64 id, u64 value, u64 user_data){
+    if(id >= IO_RING_MAX_RINGS) return SYSCALL_ERROR;
+
+    // holding table lock keeps target alive
+    LockGuard guard(io_ring_table_lock);
+    IoRing* target = io_rings[id];
+    if(target == nullptr) return SYSCALL_ERROR;
+
+    IoRingCompletion completion;
+    completion.user_data = user_data;
+    completion.result = value;
+    PostCompletions(target, &completion, 1);
+    return 0;
+}
+
+// execute a request, returns false if request completes later
+static bool ExecuteSubmission(IoRing* ring, IoRingSubmission* sqe, u64* result){
+    switch(sqe->opcode){
+        case IO_RING_OP_NOP :
+            *result = 0;
+            return true;
+
+        case IO_RING_OP_CONSOLE_WRITE :
+            *result = WriteUserConsole(sqe->args[0], sqe->args[1]);
+            return true;
+
+        case IO_RING_OP_TIMEOUT : {
+            u32 count = ring->timeout_count;
+            if(count == IO_RING_MAX_TIMEOUTS){
+                *result = SYSCALL_ERROR;
+                return true;
+            }
+            ring->timeouts[count].deadline = GetUptimeNanoseconds() + sqe->args[0];
+            ring->timeouts[count].user_data = sqe->user_data;
+            __atomic_store_n(&ring->timeout_count, count + 1, __ATOMIC_RELEASE);
+            return false;
+        }
+
+        case IO_RING_OP_MSG_RING :
+            *result = SendRingMessage(sqe->args[0], sqe->args[1], sqe->args[2]);
+            return true;
+
+        default :
+            *result = SYSCALL_ERROR;
+            return true;
+    }
+}
+
+// consume up to max_count submissions, caller owns ring->submitting
+static u32 ConsumeSubmissions(IoRing* ring, u32 max_count){
+    IoRingHeader* header = ring->header;
+
+    u32 count = __atomic_load_n(&header->sq_tail, __ATOMIC_ACQUIRE) - ring->sq_head;
+    // tail is written by user, it can be anything
+    if(count > ring->sq_mask + 1) count = ring->sq_mask + 1;
+    if(count > max_count) count = max_count;
+
+    // don't take more requests than there is space for their completions
+    u32 used = CompletionsReady(ring) + ring->timeout_count;
+    u32 space = used < ring->cq_entries ? ring->cq_entries - used : 0;
+    if(count > space) count = space;
+
+    IoRingCompletion done[IO_RING_COMPLETION_BATCH];
+    u32 done_count = 0;
+    for(u32 i = 0; i < count; i++){
+        // copy entry first, user may change it while we're looking at it
+        IoRingSubmission* shared = GetSubmission(ring, ring->sq_head++);
+        IoRingSubmission sqe;
+        sqe.opcode = shared->opcode;
+        sqe.flags = shared->flags;
+        sqe.user_data = shared->user_data;
+        for(u32 arg = 0; arg < 4; arg++){
+            sqe.args[arg] = shared->args[arg];
+        }
+
+        u64 result;
+        if(ExecuteSubmission(ring, &sqe, &result)){
+            done[done_count].user_data = sqe.user_data;
+            done[done_count].result = result;
+            if(++done_count == IO_RING_COMPLETION_BATCH){
+                PostCompletions(ring, done, done_count);
+                done_count = 0;
+            }
+        }
+    }
+
+    __atomic_store_n(&header->sq_head, ring->sq_head, __ATOMIC_RELEASE);
+    if(done_count){
+        PostCompletions(ring, done, done_count);
+    }
+    return count;
+}
+
+// complete timeouts whose deadline has passed, caller owns ring->submitting
+static void ExpireTimeouts(IoRing* ring){
+    if(ring->timeout_count == 0) return;
+
+    u64 now = GetUptimeNanoseconds();
+    IoRingCompletion done[IO_RING_MAX_TIMEOUTS];
+    u32 done_count = 0;
+    u32 count = ring->timeout_count;
+    for(u32 i = 0; i < count;){
+        if(ring->timeouts[i].deadline <= now){
+            done[done_count].user_data = ring->timeouts[i].user_data;
+            done[done_count].result = 0;
+            done_count++;
+            ring->timeouts[i] = ring->timeouts[--count];
+        }else{
+            i++;
+        }
+    }
+    __atomic_store_n(&ring->timeout_count, count, __ATOMIC_RELEASE);
+
+    if(done_count){
+        PostCompletions(ring, done, done_count);
+    }
+}
+
+// consume submissions and expire timeouts, returns number of submissions consumed
+// does nothing if someone else is already doing it
+static u32 ProcessRing(IoRing* ring, u32 max_count){
+    if(__atomic_exchange_n(&ring->submitting, true, __ATOMIC_ACQUIRE)) return 0;
+
+    u32 count = max_count ? ConsumeSubmissions(ring, max_count) : 0;
+    ExpireTimeouts(ring);
+
+    __atomic_store_n(&ring->submitting, false, __ATOMIC_RELEASE);
+    return count;
+}
+
+// put poll thread to sleep until user enters kernel with IO_RING_ENTER_SQ_WAKEUP
+static void PollThreadSleep(IoRing* ring){
+    Thread* self = GetCurrentThread();
+    IoRingHeader* header = ring->header;
+
+    // interrupts stay disabled until we're switched away, so a tick
+    // can't deschedule us while we're marked blocked but not asleep yet
+    u64 flags = SaveFlagsAndDisableInterrupts();
+    __atomic_store_n(&self->state, ThreadState::Blocked, __ATOMIC_SEQ_CST);
+    __atomic_or_fetch(&header->sq_flags, IO_RING_SQ_NEED_WAKEUP, __ATOMIC_SEQ_CST);
+
+    // user checks flag after writing tail, so either we see new entries
+    // here or user sees flag and wakes us up
+    bool has_work = __atomic_load_n(&header->sq_tail, __ATOMIC_SEQ_CST) != ring->sq_head ||
+                    __atomic_load_n(&ring->stopping, __ATOMIC_SEQ_CST);
+
+    ThreadState expected = ThreadState::Blocked;
+    if(!has_work || !__atomic_compare_exchange_n(&self->state, &expected, ThreadState::Running, false,
+                                                 __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)){
+        // either nothing to do, or someone already woke us up and queued us
+        Schedule();
+    }
+
+    __atomic_and_fetch(&header->sq_flags, ~u32(IO_RING_SQ_NEED_WAKEUP), __ATOMIC_SEQ_CST);
+    RestoreFlags(flags);
+}
+
+static void IoRingPollThread(void* arg){
+    IoRing* ring = reinterpret_cast<IoRing*>(arg);
+    u64 idle_since = GetUptimeNanoseconds();
+
+    while(!__atomic_load_n(&ring->stopping, __ATOMIC_ACQUIRE)){
+        if(ProcessRing(ring, ring->sq_mask + 1)){
+            idle_since = GetUptimeNanoseconds();
+            continue;
+        }
+
+        // pending timeouts need someone to watch the clock
+        if(ring->timeout_count || GetUptimeNanoseconds() - idle_since < IO_RING_POLL_IDLE_NS){
+            CPUPause();
+            continue;
+        }
+
+        PollThreadSleep(ring);
+        idle_since = GetUptimeNanoseconds();
+    }
+}
+
+// wait until at least min_complete completions are ready
+static void WaitForCompletions(IoRing* ring, u32 min_complete){
+    Thread* self = GetCurrentThread();
+
+    while(true){
+        if(ring->poller == nullptr){
+            ProcessRing(ring, 0);
+        }
+        if(CompletionsReady(ring) >= min_complete) return;
+
+        // timeouts don't have an interrupt behind them, keep checking
+        if(ring->timeout_count){
+            Yield();
+            continue;
+        }
+
+        // posters wake waiter while holding complete_lock, so checking for
+        // completions and going to sleep under it means no wakeup is lost
+        u64 flags = SaveFlagsAndDisableInterrupts();
+        ring->complete_lock.Lock();
+        bool sleep = ring->waiter == nullptr && CompletionsReady(ring) < min_complete;
+        if(sleep){
+            ring->waiter = self;
+            __atomic_store_n(&self->state, ThreadState::Blocked, __ATOMIC_RELEASE);
+        }
+        ring->complete_lock.Unlock();
+
+        if(sleep){
+            Schedule();
+            ring->complete_lock.Lock();
+            ring->waiter = nullptr;
+            ring->complete_lock.Unlock();
+        }
+        RestoreFlags(flags);
+
+        // another thread is already waiting on this ring
+        if(!sleep) Yield();
+    }
+}
+
+// find ring with given id in given address space
+static IoRing* LookupIoRing(u64 id, AddressSpace* space){
+    if(id >= IO_RING_MAX_RINGS) return nullptr;
+
+    LockGuard guard(io_ring_table_lock);
+    IoRing* ring = io_rings[id];
+    if(ring == nullptr || ring->space != space) return nullptr;
+    return ring;
+}
+
+u64 CreateIoRing(AddressSpace* space, u64 user_addr, u64 entries, u64 flags){
+    if(entries == 0 || entries > IO_RING_MAX_ENTRIES || (user_addr & (PAGE_SIZE - 1))){
+        return SYSCALL_ERROR;
+    }
+
+    u32 sq_entries = 1;
+    while(sq_entries < entries) sq_entries <<= 1;
+    u32 cq_entries = 2 * sq_entries;
+    u64 sq_pages = (sq_entries + SUBMISSIONS_PER_PAGE - 1) / SUBMISSIONS_PER_PAGE;
+    u64 cq_pages = (cq_entries + COMPLETIONS_PER_PAGE - 1) / COMPLETIONS_PER_PAGE;
+
+    u64 size = (1 + sq_pages + cq_pages) * PAGE_SIZE;
+    if(user_addr >= USER_SPACE_LIMIT || size > USER_SPACE_LIMIT - user_addr) return SYSCALL_ERROR;
+    for(u64 offset = 0; offset < size; offset += PAGE_SIZE){
+        if(IsUserRangeMapped(space, user_addr + offset, PAGE_SIZE)) return SYSCALL_ERROR;
+    }
+
+    IoRing* ring = new (SlabAllocate(&io_ring_cache)) IoRing();
+    ring->space = space;
+    ring->sq_mask = sq_entries - 1;
+    ring->cq_entries = cq_entries;
+    ring->cq_mask = cq_entries - 1;
+
+    // kernel uses pages through direct map, so they don't need to be contiguous,
+    // and they're shared so that fork never replaces them with private copies
+    ring->header = reinterpret_cast<IoRingHeader*>(AllocateUserPage(space, user_addr, MAP_PRESENT | MAP_READ_WRITE | MAP_SHARED));
+    u64 vaddr = user_addr + PAGE_SIZE;
+    for(u64 i = 0; i < sq_pages; i++, vaddr += PAGE_SIZE){
+        ring->sq_pages[i] = AllocateUserPage(space, vaddr, MAP_PRESENT | MAP_READ_WRITE | MAP_SHARED);
+    }
+    // user only reads completions
+    for(u64 i = 0; i < cq_pages; i++, vaddr += PAGE_SIZE){
+        ring->cq_pages[i] = AllocateUserPage(space, vaddr, MAP_PRESENT | MAP_SHARED);
+    }
+
+    IoRingHeader* header = ring->header;
+    header->sq_entries = sq_entries;
+    header->sq_mask = sq_entries - 1;
+    header->cq_entries = cq_entries;
+    header->cq_mask = cq_entries - 1;
+    header->sq_offset = PAGE_SIZE;
+    header->cq_offset = (1 + sq_pages) * PAGE_SIZE;
+
+    // ring becomes visible only after it's completely set up
+    // if table is full, ring pages stay mapped until address space is destroyed
+    {
+        LockGuard guard(io_ring_table_lock);
+        u32 id = 0;
+        while(id < IO_RING_MAX_RINGS && io_rings[id]) id++;
+        if(id == IO_RING_MAX_RINGS){
+            SlabFree(&io_ring_cache, ring);
+            return SYSCALL_ERROR;
+        }
+        ring->id = id;
+        io_rings[id] = ring;
+    }
+
+    if(flags & IO_RING_SETUP_SQPOLL){
+        // poll thread runs in ring's address space so that requests can read user memory
+        ring->poller = CreateThread("io_ring.poll", IoRingPollThread, ring);
+        ring->poller->address_space = space;
+        StartThread(ring->poller);
+    }
+
+    return ring->id;
+}
+
+void DestroyIoRings(AddressSpace* space){
+    for(u32 id = 0; id < IO_RING_MAX_RINGS; id++){
+        IoRing* ring;
+        {
+            LockGuard guard(io_ring_table_lock);
+            ring = io_rings[id];
+            if(ring == nullptr || ring->space != space) continue;
+            io_rings[id] = nullptr;
+        }
+
+        if(ring->poller){
+            __atomic_store_n(&ring->stopping, true, __ATOMIC_SEQ_CST);
+            WakeThread(ring->poller);
+            JoinThread(ring->poller);
+        }
+
+        SlabFree(&io_ring_cache, ring);
+    }
+}
+
+u64 SyscallIoRingSetup(u64 user_addr, u64 entries, u64 flags, u64, u64, u64){
+    return CreateIoRing(GetCurrentThread()->address_space, user_addr, entries, flags);
+}
+
+u64 SyscallIoRingEnter(u64 id, u64 to_submit, u64 min_complete, u64 flags, u64, u64){
+    // ring can't go away under us, rings are destroyed only
+    // after all threads of address space are gone
+    IoRing* ring = LookupIoRing(id, GetCurrentThread()->address_space);
+    if(ring == nullptr) return SYSCALL_ERROR;
+
+    u64 submitted;
+    if(ring->poller){
+        // poll thread submits for us
+        if(flags & IO_RING_ENTER_SQ_WAKEUP){
+            WakeThread(ring->poller);
+        }
+        submitted = to_submit;
+    }else{
+        if(to_submit > ring->sq_mask + 1) to_submit = ring->sq_mask + 1;
+        submitted = ProcessRing(ring, to_submit);
+    }
+
+    if(min_complete){
+        if(min_complete > ring->cq_entries) min_complete = ring->cq_entries;
+        WaitForCompletions(ring, min_complete);
+    }
+
+    return submitted;
+}
+
+/******************** IO Ring Benchmark ********************/
+
+#define STRINGIFY_(x) #x
+#define STRINGIFY(x) STRINGIFY_(x)
+
+// number of requests made for every batch size
+#define BENCH_RING_REQUESTS 65536
+#define BENCH_RING_ENTRIES 256
+#define BENCH_RING_MAX_BATCH 256
+// where benchmark code and ring are mapped in user space
+#define BENCH_RING_USER_CODE 0x400000
+#define BENCH_RING_USER_RING 0x600000
+
+// passed to user code in rdi, at bottom of it's stack page
+struct RingBenchParams {
+    u64 batch;
+    u64 requests;
+    u64 ring;
+    u64 ring_id;
+    u64 polled;
+};
+
+// user code for benchmark, copied to a user page
+// submits requests in batches of NOPs, waits for whole batch to
+// complete and exits with number of cycles all requests took
+asm(R"(
+.text
+.global UserIoRingLoop
+.global UserIoRingLoopEnd
+UserIoRingLoop:
+    mov 0(%rdi), %r12
+    mov 8(%rdi), %r13
+    mov 16(%rdi), %r14
+    mov 24(%rdi), %r15
+    mov 32(%rdi), %rbp
+    mov )" STRINGIFY(IO_RING_SQ_OFFSET) R"((%r14), %ebx
+    add %r14, %rbx
+
+    rdtsc
+    shl $32, %rdx
+    or %rax, %rdx
+    push %rdx
+
+1:
+    # fill batch, we are only writer of sq_tail
+    mov )" STRINGIFY(IO_RING_SQ_TAIL) R"((%r14), %eax
+    mov )" STRINGIFY(IO_RING_SQ_MASK) R"((%r14), %r8d
+    xor %ecx, %ecx
+2:
+    lea (%rax, %rcx), %edx
+    and %r8d, %edx
+    shl $)" STRINGIFY(IO_RING_SUBMISSION_SHIFT) R"(, %rdx
+    movl $)" STRINGIFY(IO_RING_OP_NOP) R"(, (%rbx, %rdx)
+    mov %rcx, 8(%rbx, %rdx)
+    inc %ecx
+    cmp %r12d, %ecx
+    jb 2b
+    add %r12d, %eax
+    mov %eax, )" STRINGIFY(IO_RING_SQ_TAIL) R"((%r14)
+
+    test %rbp, %rbp
+    jnz 3f
+
+    # submit batch and wait for it in one system call
+    mov %r15, %rdi
+    mov %r12, %rsi
+    mov %r12, %rdx
+    xor %r10d, %r10d
+    mov $)" STRINGIFY(SYSCALL_IO_RING_ENTER) R"(, %eax
+    syscall
+    jmp 5f
+
+3:
+    # polled, enter kernel only if poll thread went to sleep
+    mfence
+    testl $)" STRINGIFY(IO_RING_SQ_NEED_WAKEUP) R"(, )" STRINGIFY(IO_RING_SQ_FLAGS) R"((%r14)
+    jz 4f
+    mov %r15, %rdi
+    xor %esi, %esi
+    xor %edx, %edx
+    mov $)" STRINGIFY(IO_RING_ENTER_SQ_WAKEUP) R"(, %r10d
+    mov $)" STRINGIFY(SYSCALL_IO_RING_ENTER) R"(, %eax
+    syscall
+4:
+    mov )" STRINGIFY(IO_RING_CQ_TAIL) R"((%r14), %eax
+    sub )" STRINGIFY(IO_RING_CQ_HEAD) R"((%r14), %eax
+    cmp %r12d, %eax
+    jae 5f
+    pause
+    jmp 4b
+
+5:
+    # consume whole batch, NOPs can't fail
+    add %r12d, )" STRINGIFY(IO_RING_CQ_HEAD) R"((%r14)
+    sub %r12, %r13
+    ja 1b
+
+    rdtsc
+    shl $32, %rdx
+    or %rax, %rdx
+    pop %rcx
+    sub %rcx, %rdx
+    mov %rdx, %rdi
+    mov $)" STRINGIFY(SYSCALL_EXIT) R"(, %eax
+    syscall
+    ud2
+UserIoRingLoopEnd:
+)");
+
+extern "C" u8 UserIoRingLoop[];
+extern "C" u8 UserIoRingLoopEnd[];
+
+// run benchmark program in a fresh address space, returns cycles taken
+static u64 RunIoRingBenchmark(u64 batch, bool polled){
+    AddressSpace* space = CreateAddressSpace();
+    u64 code = AllocateUserPage(space, BENCH_RING_USER_CODE, MAP_PRESENT);
+    memcpy(reinterpret_cast<void*>(code), UserIoRingLoop, UserIoRingLoopEnd - UserIoRingLoop);
+    u64 stack = AllocateUserPage(space, USER_STACK_TOP - PAGE_SIZE, MAP_PRESENT | MAP_READ_WRITE);
+
+    RingBenchParams* params = reinterpret_cast<RingBenchParams*>(stack);
+    params->batch = batch;
+    params->requests = BENCH_RING_REQUESTS;
+    params->ring = BENCH_RING_USER_RING;
+    params->ring_id = CreateIoRing(space, BENCH_RING_USER_RING, BENCH_RING_ENTRIES, polled ? IO_RING_SETUP_SQPOLL : 0);
+    params->polled = polled;
+
+    Thread* thread = CreateUserThread("io-ring-bench", space, BENCH_RING_USER_CODE, USER_STACK_TOP, USER_STACK_TOP - PAGE_SIZE);
+    StartThread(thread);
+    u64 cycles = JoinThread(thread);
+
+    DestroyIoRings(space);
+    DestroyAddressSpace(space);
+    return cycles;
+}
+
+// requests per second given cycles taken by all requests
+static u64 RequestsPerSecond(u64 cycles){
+    u64 ns = CyclesToNanoseconds(cycles);
+    return ns ? u64(BENCH_RING_REQUESTS) * 1000000000 / ns : 0;
+}
+
+void BenchmarkIoRing(){
+    ColorPrintf(COLOR_YELLOW, COLOR_BLACK, "[+] Benchmark : IO Ring\n");
+
+    for(u64 batch = 1; batch <= BENCH_RING_MAX_BATCH; batch <<= 1){
+        u64 enter = RunIoRingBenchmark(batch, false);
+        u64 polled = RunIoRingBenchmark(batch, true);
+        Printf("\tBatch : %lu | Enter : %lu requests/s | Polled : %lu requests/s\n",
+               batch, RequestsPerSecond(enter), RequestsPerSecond(polled));
+    }
+}
@@ -0,0 +1,170 @@
+/**
+ * @file IoRing.hpp
+ * @author Siddharth Mishra (brightprogrammer)
+ * @date 10/18/26
+ * @brief Submission and completion rings shared between user and kernel,
+ * so that many requests can be made with a single system call.
+ * @copyright MIT License 2022 Siddharth Mishra
+ * */
+
+#ifndef IO_RING_HPP
+#define IO_RING_HPP
+
+#include <cstddef>
+
+#include "Common.hpp"
+
+struct AddressSpace;
+
+/* ------------------ IO RING LAYOUT --------------------
+ *
+ * A ring is mapped in user space at an address chosen by user :
+ *
+ *   base                     ;-------------------------;
+ *                            ; IoRingHeader (1 page)   ;
+ *   base + sq_offset         ;-------------------------;
+ *                            ; submission entries      ; read write
+ *   base + cq_offset         ;-------------------------;
+ *                            ; completion entries      ; read only
+ *                            ;-------------------------;
+ *
+ * User writes submission entries at sq_tail and then moves sq_tail
+ * forward. Kernel consumes entries from sq_head, executes them and
+ * writes a completion entry at cq_tail for each of them. User reads
+ * completions at cq_head and then moves cq_head forward. Heads and tails
+ * are free running counters, index of an entry is counter & mask.
+ *
+ * Every counter is written by only one side, so no locks are shared
+ * with user. Counters written by different sides are on different cache
+ * lines so that they don't bounce between cpus.
+ *
+ * */
+
+// opcodes of submission entries
+// does nothing, completes with 0
+#define IO_RING_OP_NOP 0
+// write string at args[0] of length args[1] on console
+#define IO_RING_OP_CONSOLE_WRITE 1
+// complete after args[0] nanoseconds
+#define IO_RING_OP_TIMEOUT 2
+// post a completion with user_data=args[2] and result=args[1]
+// in ring with id args[0]
+#define IO_RING_OP_MSG_RING 3
+#define IO_RING_OP_COUNT 4
+
+// flags for SYSCALL_IO_RING_SETUP
+// kernel thread polls submission ring, so no system call is needed to submit
+#define IO_RING_SETUP_SQPOLL (1 << 0)
+
+// flags for SYSCALL_IO_RING_ENTER
+// wake up sleeping poll thread
+#define IO_RING_ENTER_SQ_WAKEUP (1 << 0)
+
+// set in sq_flags when poll thread went to sleep,
+// user must enter kernel with IO_RING_ENTER_SQ_WAKEUP to wake it up
+#define IO_RING_SQ_NEED_WAKEUP (1 << 0)
+
+// max number of submission entries, completion ring is twice as large
+#define IO_RING_MAX_ENTRIES 4096
+// max number of rings in system
+#define IO_RING_MAX_RINGS 64
+
+struct IoRingSubmission {
+    u32 opcode;
+    u32 flags;
+    // returned as it is in completion entry
+    u64 user_data;
+    u64 args[4];
+    u64 reserved[2];
+};
+
+struct IoRingCompletion {
+    u64 user_data;
+    // SYSCALL_ERROR on failure
+    u64 result;
+};
+
+struct IoRingHeader {
+    // written by user
+    alignas(64) volatile u32 sq_tail;
+
+    // written by kernel
+    alignas(64) volatile u32 sq_head;
+    volatile u32 sq_flags;
+
+    // written by kernel
+    alignas(64) volatile u32 cq_tail;
+    // number of completions dropped because completion ring was full
+    volatile u32 cq_overflow;
+
+    // written by user
+    alignas(64) volatile u32 cq_head;
+
+    // set up once by kernel
+    alignas(64) u32 sq_entries;
+    u32 sq_mask;
+    u32 cq_entries;
+    u32 cq_mask;
+    // offsets of entry arrays from start of header
+    u32 sq_offset;
+    u32 cq_offset;
+};
+
+// offsets used by user code written in assembly
+#define IO_RING_SQ_TAIL 0
+#define IO_RING_SQ_FLAGS 68
+#define IO_RING_CQ_TAIL 128
+#define IO_RING_CQ_HEAD 192
+#define IO_RING_SQ_MASK 260
+#define IO_RING_SQ_OFFSET 272
+#define IO_RING_SUBMISSION_SHIFT 6
+
+static_assert(sizeof(IoRingSubmission) == (1 << IO_RING_SUBMISSION_SHIFT), "IO_RING_SUBMISSION_SHIFT doesn't match IoRingSubmission");
+static_assert(sizeof(IoRingCompletion) == 16, "completion entries must divide a page");
+static_assert(offsetof(IoRingHeader, sq_tail) == IO_RING_SQ_TAIL, "IO_RING_SQ_TAIL doesn't match IoRingHeader layout");
+static_assert(offsetof(IoRingHeader, sq_flags) == IO_RING_SQ_FLAGS, "IO_RING_SQ_FLAGS doesn't match IoRingHeader layout");
+static_assert(offsetof(IoRingHeader, cq_tail) == IO_RING_CQ_TAIL, "IO_RING_CQ_TAIL doesn't match IoRingHeader layout");
+static_assert(offsetof(IoRingHeader, cq_head) == IO_RING_CQ_HEAD, "IO_RING_CQ_HEAD doesn't match IoRingHeader layout");
+static_assert(offsetof(IoRingHeader, sq_mask) == IO_RING_SQ_MASK, "IO_RING_SQ_MASK doesn't match IoRingHeader layout");
+static_assert(offsetof(IoRingHeader, sq_offset) == IO_RING_SQ_OFFSET, "IO_RING_SQ_OFFSET doesn't match IoRingHeader layout");
+
+/**
+ * @brief Create a ring and map it in given address space.
+ *
+ * @param space Address space ring is mapped in.
+ * @param user_addr Page aligned user address, range must not be mapped already.
+ * @param entries Number of submission entries, rounded up to a power of 2.
+ * @param flags IO_RING_SETUP_* flags.
+ * @return Id of ring or SYSCALL_ERROR.
+ * */
+u64 CreateIoRing(AddressSpace* space, u64 user_addr, u64 entries, u64 flags);
+
+/**
+ * @brief Destroy all rings of given address space and stop their poll threads.
+ * Must be called before address space is destroyed, ring pages themselves
+ * are user pages and are freed with address space.
+ * */
+void DestroyIoRings(AddressSpace* space);
+
+/**
+ * @brief System call handler for SYSCALL_IO_RING_SETUP.
+ * Arguments are same as CreateIoRing, in address space of calling thread.
+ * */
+u64 SyscallIoRingSetup(u64 user_addr, u64 entries, u64 flags, u64, u64, u64);
+
+/**
+ * @brief System call handler for SYSCALL_IO_RING_ENTER.
+ * Submit up to to_submit entries and wait until at least min_complete
+ * completions are ready.
+ *
+ * @return Number of entries submitted, or SYSCALL_ERROR.
+ * */
+u64 SyscallIoRingEnter(u64 id, u64 to_submit, u64 min_complete, u64 flags, u64, u64);
+
+/**
+ * @brief Measure requests per second through a ring for batch
+ * sizes 1 to 256, with and without a poll thread.
+ * */
+void BenchmarkIoRing();
+
+#endif // IO_RING_HPP
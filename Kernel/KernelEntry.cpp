@@ -20,6 +20,35 @@
 #include "GDT.hpp"
 #include "IDT.hpp"
 #include "MemoryManager.hpp"
+#include "SMP.hpp"
+#include "Timer.hpp"
+#include "Spinlock.hpp"
+#include "Interrupts.hpp"
+#include "APIC.hpp"
+#include "Thread.hpp"
+#include "Scheduler.hpp"
+#include "FPU.hpp"
+#include "Syscall.hpp"
+#include "IoRing.hpp"
+#include "IPC.hpp"
+#include "Fork.hpp"
+#include "Module.hpp"
+#include "ELF.hpp"
+#include "Initramfs.hpp"
+#include "LZ4.hpp"
+#include "ACPI.hpp"
+#include "PCI.hpp"
+#include "MSI.hpp"
+#include "Block.hpp"
+#include "VirtioBlock.hpp"
+#include "VirtioNet.hpp"
+#include "NVMe.hpp"
+#include "BufferCache.hpp"
+#include "FAT32.hpp"
+#include "VFS.hpp"
+#include "PageCache.hpp"
+#include "Tmpfs.hpp"
+#include "Writeback.hpp"
 
 // placeholder for NULL value in uintptr_t instead of using 0 again and again
 #define NULLADDR 0
@@ -29,6 +58,18 @@
 // where our stack is
 static uint8_t stack[8192]; // 8KB stack
 
+// ask bootloader to start all application processors and park them
+// until we give them an address to jump to.
+// flags = 0 means we want xAPIC mode, not x2APIC mode.
+static struct stivale2_header_tag_smp smp_hdr_tag = {
+    .tag = {
+        .identifier = STIVALE2_HEADER_TAG_SMP_ID,
+        // this is the last tag in the list
+        .next = NULLADDR
+    },
+    .flags = 0
+};
+
 // we need a framebuffer from stivale on bootup so we
 // need to tell stivale that we need a framebuffer instead of
 // CGA-compatible text mode.
@@ -36,8 +77,8 @@ static struct stivale2_header_tag_framebuffer framebuffer_hdr_tag = {
     .tag = {
         // which type of tag is this
         .identifier = STIVALE2_HEADER_TAG_FRAMEBUFFER_ID,
-        // this must be a pointer address, NULL in this case
-        .next = NULLADDR
+        // pointer to next tag in the list
+        .next = (uintptr_t)&smp_hdr_tag
     },
     // set all framebuffer specifics to 0 and let bootloader decide
     .framebuffer_width = 0,
@@ -86,6 +127,13 @@ extern "C" { // stop compiler from mangling function name
         InstallGDT();
         ColorPuts(COLOR_GREEN, COLOR_BLACK, "[+] Global Descriptor Table\n");
 
+        // per-cpu gdt, tss and gs base for boot processor
+        InitializeBootCPU();
+        ColorPuts(COLOR_GREEN, COLOR_BLACK, "[+] Boot CPU\n");
+
+        InitializeTimer();
+        ColorPuts(COLOR_GREEN, COLOR_BLACK, "[+] Timer\n");
+
         stivale2_struct_tag_memmap* mmap = nullptr;
         mmap = (stivale2_struct_tag_memmap*)stivale2_get_tag(sysinfo_struct, STIVALE2_STRUCT_TAG_MEMMAP_ID);
 
@@ -98,9 +146,96 @@ extern "C" { // stop compiler from mangling function name
         InitializeMemoryManager(mmap);
         ColorPuts(COLOR_GREEN, COLOR_BLACK, "[+] Memory Manager\n");
 
+        InitializeACPI(sysinfo_struct);
+        ColorPuts(COLOR_GREEN, COLOR_BLACK, "[+] ACPI\n");
+
+        InitializeModules(sysinfo_struct);
+        ColorPuts(COLOR_GREEN, COLOR_BLACK, "[+] Boot Modules\n");
+
+        InitializeFPU();
+        ColorPuts(COLOR_GREEN, COLOR_BLACK, "[+] FPU\n");
+
+        InitializeSyscalls();
+        ColorPuts(COLOR_GREEN, COLOR_BLACK, "[+] System Calls\n");
+
         InstallIDT();
         ColorPuts(COLOR_GREEN, COLOR_BLACK, "[+] Interrupt Descriptor Table\n");
 
+        // legacy pic only delivers keyboard interrupts now
+        RemapPIC();
+
+        InitializeAPIC();
+        ColorPuts(COLOR_GREEN, COLOR_BLACK, "[+] Local APIC\n");
+
+        InitializeSMP(sysinfo_struct);
+        ColorPuts(COLOR_GREEN, COLOR_BLACK, "[+] Application Processors\n");
+
+        InitializeScheduler();
+        ColorPuts(COLOR_GREEN, COLOR_BLACK, "[+] Scheduler\n");
+
+        // compressed modules decompress in background from here on
+        StartModuleDecompression();
+
+        InitializeInitramfs();
+        ColorPuts(COLOR_GREEN, COLOR_BLACK, "[+] Initramfs\n");
+
+        InitializePCI();
+        ColorPuts(COLOR_GREEN, COLOR_BLACK, "[+] PCI\n");
+
+        InitializeVirtioBlock();
+        ColorPuts(COLOR_GREEN, COLOR_BLACK, "[+] Virtio Block\n");
+
+        InitializeVirtioNet();
+        ColorPuts(COLOR_GREEN, COLOR_BLACK, "[+] Virtio Net\n");
+
+        InitializeNVMe();
+        ColorPuts(COLOR_GREEN, COLOR_BLACK, "[+] NVMe\n");
+
+        InitializeBufferCache();
+        ColorPuts(COLOR_GREEN, COLOR_BLACK, "[+] Buffer Cache\n");
+
+        InitializeVFS();
+        ColorPuts(COLOR_GREEN, COLOR_BLACK, "[+] VFS\n");
+
+        InitializeWriteback();
+        ColorPuts(COLOR_GREEN, COLOR_BLACK, "[+] Writeback\n");
+
+#ifdef MOSS_BENCHMARKS
+        BenchmarkParallelPageZeroing();
+        BenchmarkPageAllocator();
+        BenchmarkContextSwitch();
+        BenchmarkScheduler();
+        BenchmarkFPU();
+        BenchmarkSyscall();
+        BenchmarkIoRing();
+        BenchmarkIPC();
+        BenchmarkFork();
+        BenchmarkELF();
+        BenchmarkInitramfs();
+        BenchmarkLZ4();
+        BenchmarkPCI();
+        BenchmarkMSI();
+        BenchmarkBlockDevices();
+        BenchmarkNVMe();
+        BenchmarkBlockQueue();
+        BenchmarkBufferCache();
+        BenchmarkFAT32();
+        BenchmarkVFS();
+        BenchmarkPageCache();
+        BenchmarkTmpfs();
+        BenchmarkWriteback();
+        BenchmarkVirtioNet();
+        ShowLockStatistics();
+#endif
+
+        // first user program, if bootloader gave us one
+        static const char* const init_argv[] = {"init"};
+        Thread* init = ExecuteModule("init", 1, init_argv);
+        if(init){
+            StartThread(init);
+            ColorPuts(COLOR_GREEN, COLOR_BLACK, "[+] Started init\n");
+        }
+
         ColorPuts(COLOR_YELLOW, COLOR_BLACK, "[!] Generating intentional #PAGE_FAULT\n");
         int* ptr = 0;
         *ptr = 4;
@@ -38,6 +38,7 @@
 #include "Printf.hpp"
 #include "KeyCodes.hpp"
 #include "String.hpp"
+#include "Spinlock.hpp"
 
 enum class KeyState : uint8_t{
     Pressed, Released
@@ -180,5 +181,12 @@ char KeyboardToASCII(uint8_t key){
 
 void __attribute__((no_caller_saved_registers)) HandleKeyboardEvent(uint8_t scancode){
     if(scancode == 0) return;
+
+    // F1 dumps statistics of hottest locks
+    if(scancode == F1_PRESSED){
+        ShowLockStatistics();
+        return;
+    }
+
     PutChar(KeyboardToASCII(scancode));
 }
@@ -0,0 +1,495 @@
+/**
+ * @file LZ4.cpp
+ * @author Siddharth Mishra (brightprogrammer)
+ * @date 10/18/26
+ * @brief Streaming decoder for LZ4 frames.
+ * @copyright MIT License 2022 Siddharth Mishra
+ * */
+
+#include "LZ4.hpp"
+#include "MemoryManager.hpp"
+#include "CPU.hpp"
+#include "Printf.hpp"
+#include "String.hpp"
+#include "Timer.hpp"
+
+#define LZ4_SKIPPABLE_MAGIC 0x184d2a50
+#define LZ4_SKIPPABLE_MASK 0xfffffff0
+
+// frame descriptor flags
+#define LZ4_FLAG_VERSION_MASK 0xc0
+#define LZ4_FLAG_VERSION 0x40
+#define LZ4_FLAG_BLOCK_INDEPENDENT (1 << 5)
+#define LZ4_FLAG_BLOCK_CHECKSUM (1 << 4)
+#define LZ4_FLAG_CONTENT_SIZE (1 << 3)
+#define LZ4_FLAG_CONTENT_CHECKSUM (1 << 2)
+#define LZ4_FLAG_DICTIONARY_ID (1 << 0)
+
+// block size field, top bit set for blocks stored without compression
+#define LZ4_BLOCK_UNCOMPRESSED 0x80000000
+#define LZ4_BLOCK_SIZE_MASK 0x7fffffff
+
+#define LZ4_MIN_MATCH 4
+#define LZ4_MAX_OFFSET 65535
+
+#define LZ4_ERROR (~u64(0))
+
+#define XXH_PRIME32_1 0x9e3779b1U
+#define XXH_PRIME32_2 0x85ebca77U
+#define XXH_PRIME32_3 0xc2b2ae3dU
+#define XXH_PRIME32_4 0x27d4eb2fU
+#define XXH_PRIME32_5 0x165667b1U
+
+static inline u32 Read32(const u8* p){
+    return u32(p[0]) | (u32(p[1]) << 8) | (u32(p[2]) << 16) | (u32(p[3]) << 24);
+}
+
+static inline u64 Read64(const u8* p){
+    return u64(Read32(p)) | (u64(Read32(p + 4)) << 32);
+}
+
+static inline u32 RotateLeft32(u32 x, int r){
+    return (x << r) | (x >> (32 - r));
+}
+
+static inline u32 XXH32Round(u32 acc, u32 input){
+    acc += input * XXH_PRIME32_2;
+    acc = RotateLeft32(acc, 13);
+    return acc * XXH_PRIME32_1;
+}
+
+// checksum used by lz4 frames
+static u32 XXH32(const u8* p, u64 len, u32 seed){
+    const u8* end = p + len;
+    u32 h;
+
+    if(len >= 16){
+        u32 v1 = seed + XXH_PRIME32_1 + XXH_PRIME32_2;
+        u32 v2 = seed + XXH_PRIME32_2;
+        u32 v3 = seed;
+        u32 v4 = seed - XXH_PRIME32_1;
+        const u8* limit = end - 16;
+        do{
+            v1 = XXH32Round(v1, Read32(p));
+            v2 = XXH32Round(v2, Read32(p + 4));
+            v3 = XXH32Round(v3, Read32(p + 8));
+            v4 = XXH32Round(v4, Read32(p + 12));
+            p += 16;
+        }while(p <= limit);
+        h = RotateLeft32(v1, 1) + RotateLeft32(v2, 7) + RotateLeft32(v3, 12) + RotateLeft32(v4, 18);
+    }else{
+        h = seed + XXH_PRIME32_5;
+    }
+
+    h += u32(len);
+    while(p + 4 <= end){
+        h += Read32(p) * XXH_PRIME32_3;
+        h = RotateLeft32(h, 17) * XXH_PRIME32_4;
+        p += 4;
+    }
+    while(p < end){
+        h += (*p) * XXH_PRIME32_5;
+        h = RotateLeft32(h, 11) * XXH_PRIME32_1;
+        p++;
+    }
+
+    h ^= h >> 15;
+    h *= XXH_PRIME32_2;
+    h ^= h >> 13;
+    h *= XXH_PRIME32_3;
+    h ^= h >> 16;
+    return h;
+}
+
+// parsed frame descriptor
+struct LZ4Frame {
+    u8 flags;
+    u64 block_max_size;
+    u64 content_size;
+    // size of magic and descriptor
+    u64 header_size;
+};
+
+// parse header of frame at p, returns false if it's malformed
+static bool ParseFrameHeader(const u8* p, u64 size, LZ4Frame* frame){
+    if(size < 7 || Read32(p) != LZ4_FRAME_MAGIC) return false;
+
+    u8 flags = p[4];
+    u8 bd = p[5];
+    if((flags & LZ4_FLAG_VERSION_MASK) != LZ4_FLAG_VERSION) return false;
+
+    // block max size is 64K, 256K, 1M or 4M
+    u64 size_id = (bd >> 4) & 7;
+    if(size_id < 4) return false;
+    frame->block_max_size = u64(1) << (8 + 2 * size_id);
+
+    u64 descriptor_size = 2;
+    if(flags & LZ4_FLAG_CONTENT_SIZE) descriptor_size += 8;
+    if(flags & LZ4_FLAG_DICTIONARY_ID) descriptor_size += 4;
+    if(size < 4 + descriptor_size + 1) return false;
+
+    // second byte of hash of descriptor
+    u8 checksum = (XXH32(p + 4, descriptor_size, 0) >> 8) & 0xff;
+    if(checksum != p[4 + descriptor_size]) return false;
+
+    // we have no dictionaries to give
+    if(flags & LZ4_FLAG_DICTIONARY_ID) return false;
+
+    frame->flags = flags;
+    frame->content_size = (flags & LZ4_FLAG_CONTENT_SIZE) ? Read64(p + 6) : 0;
+    frame->header_size = 4 + descriptor_size + 1;
+    return true;
+}
+
+bool IsLZ4Frame(u64 data, u64 size){
+    return size >= 4 && Read32(reinterpret_cast<const u8*>(data)) == LZ4_FRAME_MAGIC;
+}
+
+// walk blocks of every frame without decoding them
+bool GetLZ4DecompressedBound(u64 src, u64 size, u64* bound){
+    const u8* p = reinterpret_cast<const u8*>(src);
+    u64 offset = 0;
+    u64 total = 0;
+
+    while(offset < size){
+        if(size - offset < 8) return false;
+        u32 magic = Read32(p + offset);
+        if((magic & LZ4_SKIPPABLE_MASK) == LZ4_SKIPPABLE_MAGIC){
+            u64 skip = Read32(p + offset + 4);
+            if(skip > size - offset - 8) return false;
+            offset += 8 + skip;
+            continue;
+        }
+
+        LZ4Frame frame;
+        if(!ParseFrameHeader(p + offset, size - offset, &frame)) return false;
+        offset += frame.header_size;
+
+        u64 frame_total = 0;
+        while(true){
+            if(size - offset < 4) return false;
+            u32 block = Read32(p + offset);
+            offset += 4;
+            if(block == 0) break;
+
+            u64 block_size = block & LZ4_BLOCK_SIZE_MASK;
+            if(block_size > frame.block_max_size || block_size > size - offset) return false;
+            offset += block_size;
+            if(frame.flags & LZ4_FLAG_BLOCK_CHECKSUM) offset += 4;
+
+            // stored blocks are exact, compressed ones may expand up to block max size
+            frame_total += (block & LZ4_BLOCK_UNCOMPRESSED) ? block_size : frame.block_max_size;
+        }
+        if(frame.flags & LZ4_FLAG_CONTENT_CHECKSUM) offset += 4;
+        if(offset > size) return false;
+
+        total += (frame.flags & LZ4_FLAG_CONTENT_SIZE) ? frame.content_size : frame_total;
+    }
+
+    *bound = total;
+    return true;
+}
+
+// decode sequences of one block into out[pos..end)
+// matches may reach back into earlier blocks, down to start of output
+// returns new position in output, or LZ4_ERROR
+static u64 DecodeBlock(const u8* in, u64 in_size, u8* out, u64 pos, u64 end){
+    const u8* in_end = in + in_size;
+    while(in < in_end){
+        u8 token = *in++;
+
+        // literals
+        u64 literals = token >> 4;
+        if(literals == 15){
+            u8 b;
+            do{
+                if(in >= in_end) return LZ4_ERROR;
+                b = *in++;
+                literals += b;
+            }while(b == 255);
+        }
+        if(literals > u64(in_end - in) || literals > end - pos) return LZ4_ERROR;
+        memcpy(out + pos, in, literals);
+        in += literals;
+        pos += literals;
+
+        // last sequence has no match
+        if(in == in_end) break;
+
+        if(in_end - in < 2) return LZ4_ERROR;
+        u64 offset = u64(in[0]) | (u64(in[1]) << 8);
+        in += 2;
+        if(offset == 0 || offset > pos) return LZ4_ERROR;
+
+        u64 length = token & 15;
+        if(length == 15){
+            u8 b;
+            do{
+                if(in >= in_end) return LZ4_ERROR;
+                b = *in++;
+                length += b;
+            }while(b == 255);
+        }
+        length += LZ4_MIN_MATCH;
+        if(length > end - pos) return LZ4_ERROR;
+
+        // overlapping matches repeat a pattern, so they're copied byte by byte
+        u8* from = out + pos - offset;
+        if(offset >= length){
+            memcpy(out + pos, from, length);
+        }else{
+            for(u64 i = 0; i < length; i++){
+                out[pos + i] = from[i];
+            }
+        }
+        pos += length;
+    }
+    return pos;
+}
+
+u64 DecompressLZ4(u64 src, u64 size, u64 dst, u64 capacity, volatile u64* progress){
+    const u8* p = reinterpret_cast<const u8*>(src);
+    u8* out = reinterpret_cast<u8*>(dst);
+    u64 offset = 0;
+    u64 pos = 0;
+
+    while(offset < size){
+        if(size - offset < 8) return LZ4_ERROR;
+        u32 magic = Read32(p + offset);
+        if((magic & LZ4_SKIPPABLE_MASK) == LZ4_SKIPPABLE_MAGIC){
+            u64 skip = Read32(p + offset + 4);
+            if(skip > size - offset - 8) return LZ4_ERROR;
+            offset += 8 + skip;
+            continue;
+        }
+
+        LZ4Frame frame;
+        if(!ParseFrameHeader(p + offset, size - offset, &frame)) return LZ4_ERROR;
+        offset += frame.header_size;
+        u64 frame_start = pos;
+
+        while(true){
+            if(size - offset < 4) return LZ4_ERROR;
+            u32 block = Read32(p + offset);
+            offset += 4;
+            if(block == 0) break;
+
+            u64 block_size = block & LZ4_BLOCK_SIZE_MASK;
+            u64 checksum_size = (frame.flags & LZ4_FLAG_BLOCK_CHECKSUM) ? 4 : 0;
+            if(block_size > frame.block_max_size || block_size + checksum_size > size - offset) return LZ4_ERROR;
+
+            const u8* data = p + offset;
+            if(checksum_size && XXH32(data, block_size, 0) != Read32(data + block_size)) return LZ4_ERROR;
+
+            if(block & LZ4_BLOCK_UNCOMPRESSED){
+                if(block_size > capacity - pos) return LZ4_ERROR;
+                memcpy(out + pos, data, block_size);
+                pos += block_size;
+            }else{
+                // a block never decodes past block max size
+                u64 end = pos + frame.block_max_size;
+                if(end > capacity) end = capacity;
+                pos = DecodeBlock(data, block_size, out, pos, end);
+                if(pos == LZ4_ERROR) return LZ4_ERROR;
+            }
+            offset += block_size + checksum_size;
+
+            if(progress){
+                __atomic_store_n(progress, pos, __ATOMIC_RELEASE);
+            }
+        }
+
+        if(frame.flags & LZ4_FLAG_CONTENT_CHECKSUM){
+            if(size - offset < 4) return LZ4_ERROR;
+            if(XXH32(out + frame_start, pos - frame_start, 0) != Read32(p + offset)) return LZ4_ERROR;
+            offset += 4;
+        }
+        if((frame.flags & LZ4_FLAG_CONTENT_SIZE) && pos - frame_start != frame.content_size) return LZ4_ERROR;
+    }
+
+    return pos;
+}
+
+/******************** LZ4 Benchmark ********************/
+
+// size of image compressed in benchmark
+#define BENCH_LZ4_SIZE (u64(8) * MB)
+// compressor uses 4M independent blocks
+#define BENCH_LZ4_BLOCK_SIZE (u64(4) * MB)
+#define BENCH_LZ4_HASH_BITS 12
+#define BENCH_LZ4_ITERATIONS 4
+
+// positions + 1 of last 4 byte sequence with every hash, 0 if none
+// static because boot stack is too small for it
+static u32 bench_lz4_table[1 << BENCH_LZ4_HASH_BITS];
+
+// write length extension bytes of a token field
+static u8* WriteLength(u8* out, u64 length){
+    while(length >= 255){
+        *out++ = 255;
+        length -= 255;
+    }
+    *out++ = u8(length);
+    return out;
+}
+
+static u8* WriteSequence(u8* out, const u8* literals, u64 literal_count, u64 offset, u64 match_length){
+    u8* token = out++;
+    u8 lit_field = literal_count >= 15 ? 15 : u8(literal_count);
+    *token = lit_field << 4;
+    if(literal_count >= 15) out = WriteLength(out, literal_count - 15);
+    memcpy(out, literals, literal_count);
+    out += literal_count;
+
+    // last sequence is only literals
+    if(match_length == 0) return out;
+
+    *out++ = u8(offset);
+    *out++ = u8(offset >> 8);
+    u64 length = match_length - LZ4_MIN_MATCH;
+    *token |= length >= 15 ? 15 : u8(length);
+    if(length >= 15) out = WriteLength(out, length - 15);
+    return out;
+}
+
+// greedy compressor for one block, this only exists to produce benchmark input
+static u64 CompressBlock(const u8* src, u64 size, u8* dst){
+    memset(bench_lz4_table, 0, sizeof(bench_lz4_table));
+    u8* out = dst;
+    u64 anchor = 0;
+    u64 i = 0;
+
+    // last match must start 12 bytes before end and last 5 bytes are literals
+    u64 limit = size > 12 ? size - 12 : 0;
+    while(i < limit){
+        u32 sequence = Read32(src + i);
+        u32 hash = (sequence * 2654435761U) >> (32 - BENCH_LZ4_HASH_BITS);
+        u64 candidate = bench_lz4_table[hash];
+        bench_lz4_table[hash] = u32(i + 1);
+
+        if(candidate && i - (candidate - 1) <= LZ4_MAX_OFFSET && Read32(src + candidate - 1) == sequence){
+            u64 ref = candidate - 1;
+            u64 length = LZ4_MIN_MATCH;
+            while(i + length < size - 5 && src[ref + length] == src[i + length]) length++;
+
+            out = WriteSequence(out, src + anchor, i - anchor, i - ref, length);
+            i += length;
+            anchor = i;
+        }else{
+            i++;
+        }
+    }
+
+    out = WriteSequence(out, src + anchor, size - anchor, 0, 0);
+    return out - dst;
+}
+
+// compress into a single frame with content size and content checksum
+static u64 CompressLZ4Frame(const u8* src, u64 size, u8* dst){
+    u8* out = dst;
+    out[0] = u8(LZ4_FRAME_MAGIC);
+    out[1] = u8(LZ4_FRAME_MAGIC >> 8);
+    out[2] = u8(LZ4_FRAME_MAGIC >> 16);
+    out[3] = u8(LZ4_FRAME_MAGIC >> 24);
+    out[4] = LZ4_FLAG_VERSION | LZ4_FLAG_BLOCK_INDEPENDENT | LZ4_FLAG_CONTENT_SIZE | LZ4_FLAG_CONTENT_CHECKSUM;
+    out[5] = 7 << 4;
+    for(u64 i = 0; i < 8; i++) out[6 + i] = u8(size >> (8 * i));
+    out[14] = (XXH32(out + 4, 10, 0) >> 8) & 0xff;
+    out += 15;
+
+    for(u64 offset = 0; offset < size; offset += BENCH_LZ4_BLOCK_SIZE){
+        u64 block = size - offset < BENCH_LZ4_BLOCK_SIZE ? size - offset : BENCH_LZ4_BLOCK_SIZE;
+        u64 compressed = CompressBlock(src + offset, block, out + 4);
+
+        // incompressible blocks are stored as they are
+        u32 header = u32(compressed);
+        if(compressed >= block){
+            memcpy(out + 4, src + offset, block);
+            header = u32(block) | LZ4_BLOCK_UNCOMPRESSED;
+        }
+        out[0] = u8(header);
+        out[1] = u8(header >> 8);
+        out[2] = u8(header >> 16);
+        out[3] = u8(header >> 24);
+        out += 4 + (header & LZ4_BLOCK_SIZE_MASK);
+    }
+
+    // end mark and checksum of content
+    u32 checksum = XXH32(src, size, 0);
+    for(u64 i = 0; i < 4; i++) out[i] = 0;
+    for(u64 i = 0; i < 4; i++) out[4 + i] = u8(checksum >> (8 * i));
+    out += 8;
+    return out - dst;
+}
+
+// something that looks like a boot image : mostly text and tables,
+// with one incompressible chunk in every four
+static void BuildBenchmarkImage(u8* image){
+    u64 random = 0x2545f4914f6cdd1d;
+    u64 offset = 0;
+    u64 line = 0;
+    while(offset < BENCH_LZ4_SIZE){
+        u64 chunk = BENCH_LZ4_SIZE - offset < 64 * KB ? BENCH_LZ4_SIZE - offset : 64 * KB;
+        if((offset / (64 * KB)) % 4 == 3){
+            for(u64 i = 0; i < chunk; i++){
+                random ^= random << 13;
+                random ^= random >> 7;
+                random ^= random << 17;
+                image[offset + i] = u8(random);
+            }
+        }else{
+            char text[96];
+            u64 done = 0;
+            while(done < chunk){
+                u32 len = sprintf(text, "/usr/share/moss/file%lu : size %lu, mode 0644, owner root\n", line, (line * 37) % 4096);
+                line++;
+                if(len > chunk - done) len = u32(chunk - done);
+                memcpy(image + offset + done, text, len);
+                done += len;
+            }
+        }
+        offset += chunk;
+    }
+}
+
+void BenchmarkLZ4(){
+    ColorPrintf(COLOR_YELLOW, COLOR_BLACK, "[+] Benchmark : LZ4 Compressed Boot Image\n");
+
+    u64 raw_pages = BENCH_LZ4_SIZE / PAGE_SIZE;
+    // worst case expansion of lz4 plus frame overhead
+    u64 compressed_pages = (BENCH_LZ4_SIZE + BENCH_LZ4_SIZE / 255 + PAGE_SIZE) / PAGE_SIZE + 1;
+    u8* raw = reinterpret_cast<u8*>(AllocateKernelMemory(raw_pages));
+    u8* compressed = reinterpret_cast<u8*>(AllocateKernelMemory(compressed_pages));
+    u8* output = reinterpret_cast<u8*>(AllocateKernelMemory(raw_pages));
+
+    BuildBenchmarkImage(raw);
+    u64 compressed_size = CompressLZ4Frame(raw, BENCH_LZ4_SIZE, compressed);
+
+    u64 bound = 0;
+    GetLZ4DecompressedBound(reinterpret_cast<u64>(compressed), compressed_size, &bound);
+
+    u64 cycles = 0;
+    u64 written = 0;
+    for(u64 i = 0; i < BENCH_LZ4_ITERATIONS; i++){
+        u64 start = ReadTimestampCounter();
+        written = DecompressLZ4(reinterpret_cast<u64>(compressed), compressed_size,
+                                reinterpret_cast<u64>(output), raw_pages * PAGE_SIZE, nullptr);
+        cycles += ReadTimestampCounter() - start;
+    }
+    u64 ns = CyclesToNanoseconds(cycles) / BENCH_LZ4_ITERATIONS;
+    bool ok = written == BENCH_LZ4_SIZE && memcmp(raw, output, BENCH_LZ4_SIZE) == 0;
+
+    Printf("\tRaw : %lu KB | Compressed : %lu KB (%lu%%) | Bound : %lu KB | %s\n",
+           BENCH_LZ4_SIZE / KB, compressed_size / KB, compressed_size * 100 / BENCH_LZ4_SIZE,
+           bound / KB, ok ? "ok" : "corrupt");
+    Printf("\tDecompress : %lu us | %lu MB/s\n", ns / 1000, ns ? (BENCH_LZ4_SIZE * 1000) / ns : 0);
+
+    // loader reads fewer bytes but kernel has to decompress them, compressed image
+    // boots faster whenever loader reads slower than this
+    Printf("\tCompressed image boots faster below %lu MB/s of loader read bandwidth\n",
+           ns ? ((BENCH_LZ4_SIZE - compressed_size) * 1000) / ns : 0);
+
+    FreeKernelMemory(reinterpret_cast<u64>(raw), raw_pages);
+    FreeKernelMemory(reinterpret_cast<u64>(compressed), compressed_pages);
+    FreeKernelMemory(reinterpret_cast<u64>(output), raw_pages);
+}
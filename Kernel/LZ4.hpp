@@ -0,0 +1,69 @@
+/**
+ * @file LZ4.hpp
+ * @author Siddharth Mishra (brightprogrammer)
+ * @date 10/18/26
+ * @brief Streaming decoder for LZ4 frames.
+ * @copyright MIT License 2022 Siddharth Mishra
+ * */
+
+#ifndef LZ4_HPP
+#define LZ4_HPP
+
+#include "Common.hpp"
+
+/* ------------------ LZ4 FRAMES --------------------
+ *
+ * A frame is a header, a list of blocks and an end mark. Every block is
+ * either stored as it is or is a list of sequences, each sequence being
+ * some literal bytes followed by a match : a copy of earlier output at
+ * most 64K back. Input can hold more than one frame, skippable frames are
+ * ignored.
+ *
+ * Whole output is decoded into one buffer, so blocks that depend on
+ * previous blocks need no separate window. Decoder works block by block
+ * and publishes how much output is ready after every block, so that a
+ * consumer can start on beginning of output while rest is still decoded.
+ *
+ * Header checksum, block checksums and content checksum are verified.
+ *
+ * */
+
+#define LZ4_FRAME_MAGIC 0x184d2204
+
+/**
+ * @brief Check whether data starts with an LZ4 frame.
+ * */
+bool IsLZ4Frame(u64 data, u64 size);
+
+/**
+ * @brief Find size of buffer needed to decompress given frames. This is
+ * exact size of output if frames record it, otherwise an upper bound
+ * computed from block headers, without decoding anything.
+ *
+ * @param src Kernel address of compressed data.
+ * @param size Size of compressed data.
+ * @param bound Filled with size of buffer needed.
+ * @return false if data is malformed.
+ * */
+bool GetLZ4DecompressedBound(u64 src, u64 size, u64* bound);
+
+/**
+ * @brief Decompress LZ4 frames into a single buffer.
+ *
+ * @param src Kernel address of compressed data.
+ * @param size Size of compressed data.
+ * @param dst Kernel address of output buffer.
+ * @param capacity Size of output buffer.
+ * @param progress If not nullptr, number of bytes of output that are
+ * ready is stored here after every block.
+ * @return Size of output, or ~0 if data is malformed or doesn't fit.
+ * */
+u64 DecompressLZ4(u64 src, u64 size, u64 dst, u64 capacity, volatile u64* progress);
+
+/**
+ * @brief Compare cost of decompressing a boot image with cost
+ * of loading it uncompressed.
+ * */
+void BenchmarkLZ4();
+
+#endif // LZ4_HPP
@@ -0,0 +1,366 @@
+/**
+ * @file MSI.cpp
+ * @author Siddharth Mishra (brightprogrammer)
+ * @date 10/18/26
+ * @brief Message signalled interrupts (MSI and MSI-X) of PCI devices.
+ * @copyright MIT License 2022 Siddharth Mishra
+ * */
+
+#include "MSI.hpp"
+#include "PCI.hpp"
+#include "SMP.hpp"
+#include "APIC.hpp"
+#include "CPU.hpp"
+#include "IO.hpp"
+#include "Interrupts.hpp"
+#include "Scheduler.hpp"
+#include "Timer.hpp"
+#include "Printf.hpp"
+
+// registers of MSI capability, relative to capability
+#define MSI_CONTROL 0x02
+#define MSI_ADDRESS_LOW 0x04
+#define MSI_ADDRESS_HIGH 0x08
+// data and mask registers move by 4 bytes if address is 64 bit
+#define MSI_DATA_32 0x08
+#define MSI_DATA_64 0x0c
+#define MSI_MASK_32 0x0c
+#define MSI_MASK_64 0x10
+
+#define MSI_CONTROL_ENABLE (1 << 0)
+#define MSI_CONTROL_MULTIPLE_CAPABLE(control) (((control) >> 1) & 7)
+#define MSI_CONTROL_MULTIPLE_ENABLE_SHIFT 4
+#define MSI_CONTROL_MULTIPLE_ENABLE_MASK (7 << 4)
+#define MSI_CONTROL_64BIT (1 << 7)
+#define MSI_CONTROL_PER_VECTOR_MASK (1 << 8)
+
+// registers of MSI-X capability, relative to capability
+#define MSIX_CONTROL 0x02
+#define MSIX_TABLE 0x04
+
+#define MSIX_CONTROL_TABLE_SIZE(control) u32(((control) & 0x7ff) + 1)
+#define MSIX_CONTROL_FUNCTION_MASK (1 << 14)
+#define MSIX_CONTROL_ENABLE (1 << 15)
+// table register holds BAR index in low 3 bits and offset in rest
+#define MSIX_TABLE_BIR(reg) ((reg) & 7)
+#define MSIX_TABLE_OFFSET(reg) ((reg) & ~u32(7))
+
+// MSI-X table entry
+#define MSIX_ENTRY_SIZE 16
+#define MSIX_ENTRY_ADDRESS_LOW 0x0
+#define MSIX_ENTRY_ADDRESS_HIGH 0x4
+#define MSIX_ENTRY_DATA 0x8
+#define MSIX_ENTRY_VECTOR_CONTROL 0xc
+#define MSIX_ENTRY_MASKED (1 << 0)
+
+// message address : fixed delivery to a physical local apic id
+#define MSI_ADDRESS_BASE 0xfee00000
+#define MSI_ADDRESS_DESTINATION_SHIFT 12
+
+static inline u32 MessageAddress(u32 cpu){
+    CPU* target = GetCPU(cpu);
+    u32 lapic_id = target ? target->lapic_id : GetLocalAPICID();
+    return MSI_ADDRESS_BASE | (lapic_id << MSI_ADDRESS_DESTINATION_SHIFT);
+}
+
+static inline volatile u32* MSIXEntry(PCIInterrupts* irq, u32 index, u32 reg){
+    return reinterpret_cast<volatile u32*>(irq->msix_table + index * MSIX_ENTRY_SIZE + reg);
+}
+
+static u32 EnableMSIX(PCIInterrupts* irq, PCIDevice* device, u32 count){
+    u8 cap = device->msix_capability;
+    u16 control = PCIRead16(device, cap + MSIX_CONTROL);
+    u32 table_reg = PCIRead32(device, cap + MSIX_TABLE);
+
+    u64 bar = MapPCIBar(device, MSIX_TABLE_BIR(table_reg));
+    if(bar == 0) return 0;
+    irq->msix_table = bar + MSIX_TABLE_OFFSET(table_reg);
+
+    if(count > MSIX_CONTROL_TABLE_SIZE(control)) count = MSIX_CONTROL_TABLE_SIZE(control);
+
+    // no vector must fire while table is being filled
+    PCIWrite16(device, cap + MSIX_CONTROL, control | MSIX_CONTROL_FUNCTION_MASK);
+
+    u32 allocated = 0;
+    for(; allocated < count; allocated++){
+        u8 vector = AllocateInterruptVectors(1);
+        if(vector == 0) break;
+
+        irq->vectors[allocated] = vector;
+        irq->cpus[allocated] = 0;
+        *MSIXEntry(irq, allocated, MSIX_ENTRY_VECTOR_CONTROL) = MSIX_ENTRY_MASKED;
+        *MSIXEntry(irq, allocated, MSIX_ENTRY_ADDRESS_LOW) = MessageAddress(0);
+        *MSIXEntry(irq, allocated, MSIX_ENTRY_ADDRESS_HIGH) = 0;
+        *MSIXEntry(irq, allocated, MSIX_ENTRY_DATA) = vector;
+    }
+    if(allocated == 0){
+        PCIWrite16(device, cap + MSIX_CONTROL, control);
+        return 0;
+    }
+
+    irq->type = PCI_INTERRUPT_MSIX;
+    irq->count = allocated;
+    PCIWrite16(device, cap + MSIX_CONTROL, (control | MSIX_CONTROL_ENABLE) & ~MSIX_CONTROL_FUNCTION_MASK);
+    return allocated;
+}
+
+static u32 EnableMSI(PCIInterrupts* irq, PCIDevice* device, u32 count){
+    u8 cap = device->msi_capability;
+    u16 control = PCIRead16(device, cap + MSI_CONTROL);
+
+    // multiple vectors come in powers of 2
+    u32 log2 = 0;
+    while(log2 < MSI_CONTROL_MULTIPLE_CAPABLE(control) && (u32(2) << log2) <= count) log2++;
+
+    u8 first = 0;
+    for(; ; log2--){
+        first = AllocateInterruptVectors(1 << log2);
+        if(first || log2 == 0) break;
+    }
+    if(first == 0) return 0;
+
+    u32 allocated = 1 << log2;
+    for(u32 i = 0; i < allocated; i++){
+        irq->vectors[i] = first + i;
+        irq->cpus[i] = 0;
+    }
+
+    PCIWrite32(device, cap + MSI_ADDRESS_LOW, MessageAddress(0));
+    if(control & MSI_CONTROL_64BIT){
+        PCIWrite32(device, cap + MSI_ADDRESS_HIGH, 0);
+        PCIWrite16(device, cap + MSI_DATA_64, first);
+    }else{
+        PCIWrite16(device, cap + MSI_DATA_32, first);
+    }
+
+    // vectors stay masked until they get handlers, if device can mask them
+    if(control & MSI_CONTROL_PER_VECTOR_MASK){
+        u8 mask = cap + ((control & MSI_CONTROL_64BIT) ? MSI_MASK_64 : MSI_MASK_32);
+        PCIWrite32(device, mask, 0xffffffff);
+    }
+
+    control &= ~MSI_CONTROL_MULTIPLE_ENABLE_MASK;
+    control |= (log2 << MSI_CONTROL_MULTIPLE_ENABLE_SHIFT) | MSI_CONTROL_ENABLE;
+    PCIWrite16(device, cap + MSI_CONTROL, control);
+
+    irq->type = PCI_INTERRUPT_MSI;
+    irq->count = allocated;
+    return allocated;
+}
+
+u32 EnablePCIInterrupts(PCIInterrupts* irq, PCIDevice* device, u32 count){
+    irq->device = device;
+    irq->type = PCI_INTERRUPT_NONE;
+    irq->count = 0;
+    irq->msix_table = 0;
+    if(count > PCI_MAX_INTERRUPT_VECTORS) count = PCI_MAX_INTERRUPT_VECTORS;
+    if(count == 0) return 0;
+
+    u32 allocated = 0;
+    if(device->msix_capability){
+        allocated = EnableMSIX(irq, device, count);
+    }
+    if(allocated == 0 && device->msi_capability){
+        allocated = EnableMSI(irq, device, count);
+    }
+
+    if(allocated){
+        PCIWrite16(device, PCI_COMMAND, PCIRead16(device, PCI_COMMAND) | PCI_COMMAND_INTX_DISABLE);
+    }
+    return allocated;
+}
+
+static void SetMSIMask(PCIInterrupts* irq, u32 index, bool masked){
+    PCIDevice* device = irq->device;
+    if(irq->type == PCI_INTERRUPT_MSIX){
+        *MSIXEntry(irq, index, MSIX_ENTRY_VECTOR_CONTROL) = masked ? MSIX_ENTRY_MASKED : 0;
+        return;
+    }
+
+    // devices without per vector masking can't mask at all
+    u16 control = PCIRead16(device, device->msi_capability + MSI_CONTROL);
+    if(!(control & MSI_CONTROL_PER_VECTOR_MASK)) return;
+
+    u8 reg = device->msi_capability + ((control & MSI_CONTROL_64BIT) ? MSI_MASK_64 : MSI_MASK_32);
+    u32 mask = PCIRead32(device, reg);
+    mask = masked ? (mask | (u32(1) << index)) : (mask & ~(u32(1) << index));
+    PCIWrite32(device, reg, mask);
+}
+
+void MaskPCIInterrupt(PCIInterrupts* irq, u32 index){
+    if(index >= irq->count) return;
+    SetMSIMask(irq, index, true);
+}
+
+void UnmaskPCIInterrupt(PCIInterrupts* irq, u32 index){
+    if(index >= irq->count) return;
+    SetMSIMask(irq, index, false);
+}
+
+bool SetPCIInterruptHandler(PCIInterrupts* irq, u32 index, InterruptHandler handler, void* arg, u32 cpu){
+    if(index >= irq->count) return false;
+    if(cpu >= GetCPUCount()) cpu = 0;
+
+    MaskPCIInterrupt(irq, index);
+    SetInterruptHandler(irq->vectors[index], handler, arg);
+
+    if(irq->type == PCI_INTERRUPT_MSIX){
+        *MSIXEntry(irq, index, MSIX_ENTRY_ADDRESS_LOW) = MessageAddress(cpu);
+        irq->cpus[index] = cpu;
+    }else if(index == 0){
+        // single address register, every vector follows vector 0
+        PCIWrite32(irq->device, irq->device->msi_capability + MSI_ADDRESS_LOW, MessageAddress(cpu));
+        for(u32 i = 0; i < irq->count; i++) irq->cpus[i] = cpu;
+    }
+
+    UnmaskPCIInterrupt(irq, index);
+    return true;
+}
+
+void DisablePCIInterrupts(PCIInterrupts* irq){
+    PCIDevice* device = irq->device;
+    if(irq->type == PCI_INTERRUPT_NONE) return;
+
+    for(u32 i = 0; i < irq->count; i++){
+        MaskPCIInterrupt(irq, i);
+    }
+
+    if(irq->type == PCI_INTERRUPT_MSIX){
+        u8 cap = device->msix_capability;
+        PCIWrite16(device, cap + MSIX_CONTROL, PCIRead16(device, cap + MSIX_CONTROL) & ~MSIX_CONTROL_ENABLE);
+        for(u32 i = 0; i < irq->count; i++){
+            FreeInterruptVectors(irq->vectors[i], 1);
+        }
+    }else{
+        u8 cap = device->msi_capability;
+        PCIWrite16(device, cap + MSI_CONTROL, PCIRead16(device, cap + MSI_CONTROL) & ~MSI_CONTROL_ENABLE);
+        FreeInterruptVectors(irq->vectors[0], irq->count);
+    }
+
+    irq->type = PCI_INTERRUPT_NONE;
+    irq->count = 0;
+}
+
+/******************** MSI Benchmark ********************/
+
+#define BENCH_MSI_ITERATIONS 10000
+#define BENCH_MSI_MAX_SHARERS 32
+
+// written by handler on whichever cpu it runs
+static volatile u64 bench_msi_tsc = 0;
+static volatile u64 bench_msi_count = 0;
+
+// devices sharing busiest legacy interrupt line
+static PCIDevice* bench_intx_sharers[BENCH_MSI_MAX_SHARERS];
+static u64 bench_intx_sharer_count = 0;
+
+static void BenchmarkMSIHandler(void*){
+    bench_msi_tsc = ReadTimestampCounter();
+    __atomic_add_fetch(&bench_msi_count, 1, __ATOMIC_RELEASE);
+}
+
+// what a shared level triggered line costs : every driver on line reads it's
+// device to find out whether it was the one interrupting, then line is
+// acknowledged at interrupt controller too
+static void BenchmarkINTxHandler(void*){
+    u64 pending = 0;
+    for(u64 i = 0; i < bench_intx_sharer_count; i++){
+        if(PCIRead16(bench_intx_sharers[i], PCI_STATUS) & PCI_STATUS_INTERRUPT) pending++;
+    }
+    PortWriteByte(PICMASTER_COMMAND, PIC_EOI);
+
+    bench_msi_tsc = ReadTimestampCounter();
+    __atomic_add_fetch(&bench_msi_count, pending + 1, __ATOMIC_RELEASE);
+}
+
+// raise vector on cpu with given local apic id and wait for handler to run
+static void MeasureVector(u8 vector, u32 lapic_id, u64* delivery_ns, u64* round_trip_ns){
+    u64 delivery = 0;
+    u64 round_trip = 0;
+    for(u64 i = 0; i < BENCH_MSI_ITERATIONS; i++){
+        u64 before = __atomic_load_n(&bench_msi_count, __ATOMIC_ACQUIRE);
+        u64 start = ReadTimestampCounter();
+        SendIPI(lapic_id, vector);
+        while(__atomic_load_n(&bench_msi_count, __ATOMIC_ACQUIRE) == before){
+            CPUPause();
+        }
+        u64 end = ReadTimestampCounter();
+        delivery += bench_msi_tsc - start;
+        round_trip += end - start;
+    }
+    *delivery_ns = CyclesToNanoseconds(delivery) / BENCH_MSI_ITERATIONS;
+    *round_trip_ns = CyclesToNanoseconds(round_trip) / BENCH_MSI_ITERATIONS;
+}
+
+// find legacy line shared by most devices
+static void FindSharedINTxLine(){
+    u64 best = 0;
+    u8 best_line = 0;
+    for(u64 i = 0; i < GetPCIDeviceCount(); i++){
+        PCIDevice* device = GetPCIDevice(i);
+        if(device->interrupt_pin == 0) continue;
+
+        u64 sharers = 0;
+        for(u64 j = 0; j < GetPCIDeviceCount(); j++){
+            PCIDevice* other = GetPCIDevice(j);
+            if(other->interrupt_pin && other->interrupt_line == device->interrupt_line) sharers++;
+        }
+        if(sharers > best){
+            best = sharers;
+            best_line = device->interrupt_line;
+        }
+    }
+
+    bench_intx_sharer_count = 0;
+    for(u64 i = 0; i < GetPCIDeviceCount() && bench_intx_sharer_count < BENCH_MSI_MAX_SHARERS; i++){
+        PCIDevice* device = GetPCIDevice(i);
+        if(device->interrupt_pin && device->interrupt_line == best_line){
+            bench_intx_sharers[bench_intx_sharer_count++] = device;
+        }
+    }
+}
+
+void BenchmarkMSI(){
+    ColorPrintf(COLOR_YELLOW, COLOR_BLACK, "[+] Benchmark : Message Signalled Interrupts\n");
+
+    u64 msix = 0, msi = 0, intx = 0;
+    for(u64 i = 0; i < GetPCIDeviceCount(); i++){
+        PCIDevice* device = GetPCIDevice(i);
+        if(device->msix_capability) msix++;
+        else if(device->msi_capability) msi++;
+        else if(device->interrupt_pin) intx++;
+    }
+    Printf("\tDevices : %lu with MSI-X | %lu with MSI only | %lu with INTx only\n", msix, msi, intx);
+
+    // a device writing it's message and a cpu sending a fixed ipi end up
+    // in same place : a vector latched in target's local apic
+    u8 vector = AllocateInterruptVectors(1);
+    if(vector == 0){
+        Printf("\tNo free vectors\n");
+        return;
+    }
+
+    DisablePreemption();
+    CPU* cpu = GetCurrentCPU();
+    u64 delivery, round_trip;
+
+    SetInterruptHandler(vector, BenchmarkMSIHandler, nullptr);
+    MeasureVector(vector, cpu->lapic_id, &delivery, &round_trip);
+    u64 local_round_trip = round_trip;
+    Printf("\tMSI, same cpu : %lu ns delivery | %lu ns round trip\n", delivery, round_trip);
+
+    if(GetCPUCount() > 1){
+        CPU* remote = GetCPU((cpu->id + 1) % GetCPUCount());
+        MeasureVector(vector, remote->lapic_id, &delivery, &round_trip);
+        Printf("\tMSI, cpu %u : %lu ns delivery | %lu ns round trip\n", remote->id, delivery, round_trip);
+    }
+
+    FindSharedINTxLine();
+    SetInterruptHandler(vector, BenchmarkINTxHandler, nullptr);
+    MeasureVector(vector, cpu->lapic_id, &delivery, &round_trip);
+    Printf("\tINTx, %lu devices sharing line : %lu ns round trip | %lu ns more than MSI\n",
+           bench_intx_sharer_count, round_trip, round_trip > local_round_trip ? round_trip - local_round_trip : 0);
+    EnablePreemption();
+
+    FreeInterruptVectors(vector, 1);
+}
@@ -0,0 +1,101 @@
+/**
+ * @file MSI.hpp
+ * @author Siddharth Mishra (brightprogrammer)
+ * @date 10/18/26
+ * @brief Message signalled interrupts (MSI and MSI-X) of PCI devices.
+ * @copyright MIT License 2022 Siddharth Mishra
+ * */
+
+#ifndef MSI_HPP
+#define MSI_HPP
+
+#include "Common.hpp"
+#include "IDT.hpp"
+
+struct PCIDevice;
+
+/* ------------------ MESSAGE SIGNALLED INTERRUPTS --------------------
+ *
+ * Device raises an interrupt by writing a message to an address in
+ * local apic range, so interrupts are edge triggered, never shared,
+ * need only an end of interrupt to local apic and go straight to cpu
+ * named in address.
+ *
+ * MSI-X has a table in one of device BARs with it's own address, data
+ * and mask for each vector, so every queue of a device gets it's own
+ * vector on cpu that owns queue. MSI has a single address, so all of
+ * it's vectors go to one cpu and must be a block of consecutive vectors
+ * aligned to their count.
+ *
+ * Devices without either of them are not supported, there's no
+ * io apic driver to route legacy INTx lines, so their drivers poll.
+ *
+ * */
+
+// how device interrupts
+#define PCI_INTERRUPT_NONE 0
+#define PCI_INTERRUPT_MSI 1
+#define PCI_INTERRUPT_MSIX 2
+
+// max number of vectors a single device can have
+#define PCI_MAX_INTERRUPT_VECTORS 32
+
+/**
+ * @brief Interrupt vectors of a device, owned by it's driver.
+ * */
+struct PCIInterrupts {
+    PCIDevice* device;
+    // PCI_INTERRUPT_*
+    u32 type;
+    // number of vectors
+    u32 count;
+    // direct map address of MSI-X table
+    u64 msix_table;
+    u8 vectors[PCI_MAX_INTERRUPT_VECTORS];
+    // index of cpu each vector is sent to
+    u32 cpus[PCI_MAX_INTERRUPT_VECTORS];
+};
+
+/**
+ * @brief Allocate vectors and enable MSI-X, or MSI if device has no MSI-X.
+ * Legacy INTx is disabled. Vectors are masked until a handler is set.
+ *
+ * @param irq Filled with vectors of device.
+ * @param count Number of vectors wanted, usually one per queue.
+ * @return Number of vectors device got, may be less than count, 0 if
+ * device has no message signalled interrupts or there are no free vectors.
+ * */
+u32 EnablePCIInterrupts(PCIInterrupts* irq, PCIDevice* device, u32 count);
+
+/**
+ * @brief Set handler of a vector, send it to given cpu and unmask it.
+ * With MSI every vector goes to cpu of vector 0.
+ *
+ * @param index Index of vector, same as index of MSI-X table entry.
+ * @param cpu Index of cpu handling this vector, usually cpu owning the queue.
+ * */
+bool SetPCIInterruptHandler(PCIInterrupts* irq, u32 index, InterruptHandler handler, void* arg, u32 cpu);
+
+/**
+ * @brief Stop device from raising given vector. Messages raised
+ * while masked are held by device until vector is unmasked.
+ * */
+void MaskPCIInterrupt(PCIInterrupts* irq, u32 index);
+
+/**
+ * @brief Undo MaskPCIInterrupt.
+ * */
+void UnmaskPCIInterrupt(PCIInterrupts* irq, u32 index);
+
+/**
+ * @brief Disable message signalled interrupts of device and free it's vectors.
+ * */
+void DisablePCIInterrupts(PCIInterrupts* irq);
+
+/**
+ * @brief Measure delivery latency of a dynamically allocated vector
+ * to same and another cpu, against handling of a shared INTx line.
+ * */
+void BenchmarkMSI();
+
+#endif // MSI_HPP
@@ -9,6 +9,18 @@
 #include "MemoryManager.hpp"
 #include "Printf.hpp"
 #include "String.hpp"
+#include "CPU.hpp"
+#include "SMP.hpp"
+#include "Timer.hpp"
+#include "Spinlock.hpp"
+#include "Slab.hpp"
+#include "APIC.hpp"
+#include "Scheduler.hpp"
+#include "FPU.hpp"
+#include "VFS.hpp"
+#include "PageCache.hpp"
+
+#include <new>
 
 // virtual address where all address are mapped
 constexpr u64 MEM_PHYS_OFFSET = 0xffff800000000000;
@@ -22,6 +34,28 @@ constexpr u64 PAGE_PHYSICAL_ADDRESS_MASK = 0x000ffffffffff000;
 // virtual address where kernel is mapped
 constexpr u64 KERNEL_VIRT_BASE = 0xffffffff80000000;
 
+// virtual address region where kernel stacks and other virtually
+// contiguous kernel memory is mapped
+// this is 512 GB of virtual memory, so we never reuse addresses
+constexpr u64 KERNEL_STACK_REGION_BASE = 0xfffffe0000000000;
+constexpr u64 KERNEL_STACK_REGION_SIZE = u64(512)*GB;
+
+// max number of pages cached by a single cpu
+#define PAGE_MAGAZINE_SIZE 64
+// number of pages moved between a magazine and page stack at once
+#define PAGE_MAGAZINE_BATCH 32
+
+// per-cpu cache of free pages
+// only owner cpu touches this, with interrupts disabled
+struct PageMagazine {
+    u64 count;
+    u64 pages[PAGE_MAGAZINE_SIZE];
+
+    // statistics counters, summed over all cpus only when read
+    u64 allocated_pages;
+    u64 freed_pages;
+} __attribute__((aligned(64)));
+
 // stores memory manager information
 struct MemoryManager{
     bool is_initialized = false;
@@ -34,6 +68,17 @@ struct MemoryManager{
     // array to store addresses of free pages
     u64* page_stack = nullptr;
     u64 page_stack_top = 0;
+    // protects page_stack and page_stack_top
+    // this is the lock all cpus fight for when magazines run dry
+    MCSLock<> page_stack_lock = MCSLock<>("mm.page_stack");
+
+    // one bit per physical page frame, set if page is allocated
+    u64* frame_bitmap = nullptr;
+    u64 frame_count = 0;
+
+    // one counter per physical page frame, number of references
+    // to an allocated page beyond the first one (see ReferencePage)
+    u32* frame_refcounts = nullptr;
 
     // total number of pages in memory
     u64 total_page_count = 0;
@@ -49,46 +94,69 @@ struct MemoryManager{
     // More levels of paging means more addresses can be mapped.
     PageTable* pml4 = nullptr;
     u64 pml4_paddr = 0;
+    // protects kernel page table
+    TicketLock<> page_table_lock = TicketLock<>("mm.page_table");
+
+    // next free virtual address in kernel stack region
+    u64 kernel_stack_next = KERNEL_STACK_REGION_BASE;
 };
 
 // single static instance of memory manager
 static MemoryManager mm;
 
+// per-cpu page caches
+static PageMagazine magazines[MAX_CPUS];
+
+// kernel's own page table as an address space
+static AddressSpace kernel_address_space;
+static SlabCache address_space_cache("mm.address_space", sizeof(AddressSpace), 64);
+static SlabCache memory_region_cache("mm.memory_region", sizeof(MemoryRegion), 16);
+
 /* ------------------ ALGORITHM EXPLANATION --------------------
  *                STACK BASED MEMORY ALLOCATOR
  *
  * mm.page_stack here is an array that stores addresses of all pages
- * that can be allocated.
- * mm.used_page_stack here is an array that stores addresses of all pages
- * that are allocated.
+ * that can be allocated. mm.page_stack_top is the number of free pages
+ * in the stack.
  *
  * mm.total_page_count is the maximum number of pages that
  * can be allocated.
  *
  * mm.num_pages_used_by_stack is the number of pages used by
- * used_page_stack and page_stack array.
+ * page_stack, frame_bitmap and frame_refcounts arrays.
  *
- * When a new page is to be allocated, first we check whether
- * page_stack_top is non zero. The address is then searched
- * in used pages stack to make sure no double allocation happens.
- * If we can allocate pages then we return the page address from
- * the top of stack and then mm.page_stack_top is then decreased
- * and mm.used_page_stack_top is increased. Address of used page is
- * pushed to top of used pages stack.
+ * mm.frame_bitmap has one bit for every physical page frame. The bit
+ * is set when page is given out by AllocatePage and cleared when it's
+ * given back with FreePage. This makes sure that there is no double free
+ * or freeing of pages that were never allocated, in O(1) time.
  *
- * When a page is to be freed, the given page is first searched
- * in the used pages stack. If it is present in stack then the address
- * is pushed to top of free pages stack and the entry in which
- * the given page address was stored is set to 0 in used pages
- * stack.
+ * mm.frame_refcounts counts extra references to a page, so that a page
+ * can be mapped in more than one address space. A freshly allocated page
+ * has one reference and a count of zero, this way AllocatePage never has
+ * to touch the counter.
  *
- * This makes sure that there is no double free or double allocation.
+ * Page stack is shared by all cpus, so every cpu keeps a small
+ * magazine (cache) of free pages in front of it. Allocation and freeing
+ * only touches the magazine of current cpu. When magazine is empty,
+ * PAGE_MAGAZINE_BATCH pages are moved from page stack to magazine
+ * while holding page stack lock, and when it's full, PAGE_MAGAZINE_BATCH
+ * pages are moved back. This way lock is taken once in PAGE_MAGAZINE_BATCH
+ * allocations instead of every time.
  *
- * <----------- mm.page_stack_top ---------->
- * ;----------------------------------------;--------------------;
- * ; free pages ||||||||||||||||||||||||||||;|||||||| used pages ;
- * ;----------------------------------------;--------------------;
+ *        cpu0          cpu1                cpuN
+ *   ;-----------; ;-----------;       ;-----------;
+ *   ; magazine  ; ; magazine  ;  ...  ; magazine  ;
+ *   ;-----------; ;-----------;       ;-----------;
+ *         \            |                   /
+ *          \           |  batch refill/   /
+ *           \          |  drain (locked) /
+ *   ;----------------------------------------;
+ *   ; free pages |||||||||||||||||||||||||||||;<- mm.page_stack_top
+ *   ;----------------------------------------;
  *
+ * Free and used memory counters are also kept per cpu and are only
+ * summed when someone asks for them. This keeps cpus from bouncing
+ * cache line of a shared counter on every allocation.
  *
  * A system with 1GiB total memory will have 0.5MiB sized page_stack
  * This means 1TiB memory will need only 512M stack size
@@ -96,7 +164,7 @@ static MemoryManager mm;
  * Time complexity : O(1)
  *
  * One of the cons of this algo is that this can cause fragmentation.
- * To solve this we can sort the used and free stacks after a certain
+ * To solve this we can sort the free stack after a certain
  * number of alloc and free.
  *
  * */
@@ -119,19 +187,34 @@ void InitializePhysicalMemoryManager(stivale2_struct_tag_memmap* mmap){
 
     // First step is to find the largest claimable block
     // we'll keep our pages array at the beginning of the largest block
-    // We also have to find the total available memory
+    // We also have to find the total available memory and
+    // highest usable address (for size of frame bitmap)
     u64 largest_mem_block_base = 0, largest_mem_block_size = 0;
+    u64 highest_usable_address = 0;
     for(size_t i = 0; i < mm.mmap_entries_count; i++){
-        if(mm.mmap_entries[i].length > largest_mem_block_size){
-            largest_mem_block_base = mm.mmap_entries[i].base;
-            largest_mem_block_size = mm.mmap_entries[i].length;
-        }
-
         // if memory is usable, then it's free
         if(mm.mmap_entries[i].type == STIVALE2_MMAP_USABLE){
             mm.free_memory += mm.mmap_entries[i].length;
+
+            // only usable memory can be claimed
+            if(mm.mmap_entries[i].length > largest_mem_block_size){
+                largest_mem_block_base = mm.mmap_entries[i].base;
+                largest_mem_block_size = mm.mmap_entries[i].length;
+            }
+
+            u64 end = mm.mmap_entries[i].base + mm.mmap_entries[i].length;
+            if(end > highest_usable_address){
+                highest_usable_address = end;
+            }
         }else{
             mm.reserved_memory += mm.mmap_entries[i].length;
+
+            // boot modules are mapped in user space without copying,
+            // so their frames need reference counts too
+            u64 end = mm.mmap_entries[i].base + mm.mmap_entries[i].length;
+            if(mm.mmap_entries[i].type == STIVALE2_MMAP_KERNEL_AND_MODULES && end > highest_usable_address){
+                highest_usable_address = end;
+            }
         }
     }
 
@@ -139,8 +222,12 @@ void InitializePhysicalMemoryManager(stivale2_struct_tag_memmap* mmap){
     // calculate the size of page stack
     // page stack size is the number of pages that can be allocated
     mm.total_page_count = mm.free_memory / PAGE_SIZE;
-    // calculate required numer of pages to allocate for stack
-    mm.num_pages_used_by_stack = ((mm.total_page_count * 8) / PAGE_SIZE) + 1;
+    // one bit per frame, rounded up to u64s
+    mm.frame_count = highest_usable_address / PAGE_SIZE;
+    u64 frame_bitmap_size = ((mm.frame_count + 63) / 64) * 8;
+    u64 frame_refcounts_size = mm.frame_count * sizeof(u32);
+    // calculate required numer of pages to allocate for stack, bitmap and reference counts
+    mm.num_pages_used_by_stack = ((mm.total_page_count * 8 + frame_bitmap_size + frame_refcounts_size) / PAGE_SIZE) + 1;
     mm.page_stack_size = mm.num_pages_used_by_stack * PAGE_SIZE;
     // check if largest block can provide this much space or not
     if(largest_mem_block_size <= mm.page_stack_size){
@@ -151,8 +238,12 @@ void InitializePhysicalMemoryManager(stivale2_struct_tag_memmap* mmap){
     }
 
     // set page stacks at the start of this memory region
-    // create page_stack
+    // create page_stack and frame bitmap right after it
     mm.page_stack = reinterpret_cast<u64*>(PhysicalToVirtualAddress(largest_mem_block_base));
+    mm.frame_bitmap = mm.page_stack + mm.total_page_count;
+    memset(mm.frame_bitmap, 0, frame_bitmap_size);
+    mm.frame_refcounts = reinterpret_cast<u32*>(mm.frame_bitmap + frame_bitmap_size / 8);
+    memset(mm.frame_refcounts, 0, frame_refcounts_size);
 
     // mark this memory as used
     mm.free_memory -= mm.page_stack_size;
@@ -195,26 +286,85 @@ void InitializePhysicalMemoryManager(stivale2_struct_tag_memmap* mmap){
     }
 }
 
-u64 GetFreeMemory(){ return mm.free_memory; }
-u64 GetUsedMemory(){ return mm.used_memory; }
+// sum of per-cpu counters, this is approximate while other cpus
+// are allocating but that's fine for statistics
+static u64 GetAllocatedPageCount(){
+    u64 allocated = 0, freed = 0;
+    for(u32 i = 0; i < MAX_CPUS; i++){
+        allocated += __atomic_load_n(&magazines[i].allocated_pages, __ATOMIC_RELAXED);
+        freed += __atomic_load_n(&magazines[i].freed_pages, __ATOMIC_RELAXED);
+    }
+    return allocated - freed;
+}
+
+u64 GetFreeMemory(){ return mm.free_memory - GetAllocatedPageCount() * PAGE_SIZE; }
+u64 GetUsedMemory(){ return mm.used_memory + GetAllocatedPageCount() * PAGE_SIZE; }
 u64 GetReservedMemory(){ return mm.reserved_memory; }
 u64 GetTotalMemory(){ return mm.free_memory + mm.used_memory + mm.reserved_memory; }
 
+// mark given page as allocated in frame bitmap
+// returns false if page was already allocated
+static bool MarkFrameAllocated(u64 page_vaddr){
+    u64 frame = VirtualToPhysicalAddress(page_vaddr) / PAGE_SIZE;
+    u64 bit = u64(1) << (frame % 64);
+    u64 old = __atomic_fetch_or(&mm.frame_bitmap[frame / 64], bit, __ATOMIC_RELAXED);
+    return (old & bit) == 0;
+}
+
+// mark given page as free in frame bitmap
+// returns false if page wasn't allocated
+static bool MarkFrameFree(u64 page_vaddr){
+    u64 frame = VirtualToPhysicalAddress(page_vaddr) / PAGE_SIZE;
+    if(page_vaddr < MEM_PHYS_OFFSET || frame >= mm.frame_count){
+        return false;
+    }
+
+    u64 bit = u64(1) << (frame % 64);
+    u64 old = __atomic_fetch_and(&mm.frame_bitmap[frame / 64], ~bit, __ATOMIC_RELAXED);
+    return (old & bit) != 0;
+}
+
+// move a batch of pages from page stack to magazine
+// returns number of pages moved
+static u64 RefillMagazine(PageMagazine* magazine){
+    MCSLockGuard guard(mm.page_stack_lock);
+    u64 n = 0;
+    while(n < PAGE_MAGAZINE_BATCH && mm.page_stack_top > 0){
+        mm.page_stack_top--;
+        magazine->pages[magazine->count++] = mm.page_stack[mm.page_stack_top];
+        n++;
+    }
+    return n;
+}
+
+// move a batch of pages from magazine back to page stack
+static void DrainMagazine(PageMagazine* magazine, u64 n){
+    MCSLockGuard guard(mm.page_stack_lock);
+    while(n > 0 && magazine->count > 0){
+        mm.page_stack[mm.page_stack_top] = magazine->pages[--magazine->count];
+        mm.page_stack_top++;
+        n--;
+    }
+}
+
 // allocate's a single page
-// this pops out the top element from stack and returns the value
+// this pops out the top element from magazine of this cpu
+// and refills magazine from page stack when it is empty
 u64 AllocatePage(){
-    if(mm.page_stack_top == 0){
+    u64 flags = SaveFlagsAndDisableInterrupts();
+    PageMagazine* magazine = &magazines[GetCurrentCPU()->id];
+
+    if(magazine->count == 0 && RefillMagazine(magazine) == 0){
         Printf("Out Of Memory!");
         while(true)asm("hlt");
     }
 
-    mm.free_memory -= PAGE_SIZE;
-    mm.used_memory += PAGE_SIZE;
-
     // get page addr
-    mm.page_stack_top--;
-    u64 page_vaddr = mm.page_stack[mm.page_stack_top];
+    u64 page_vaddr = magazine->pages[--magazine->count];
+    magazine->allocated_pages++;
+    MarkFrameAllocated(page_vaddr);
 
+    RestoreFlags(flags);
     return page_vaddr;
 }
 
@@ -238,68 +388,26 @@ u64* AllocatePages(size_t n){
 }
 
 // free a single page
+// page is pushed into magazine of this cpu, and half of
+// magazine is given back to page stack if it is full
 void FreePage(u64 page_vaddr){
-    // check that such memory actually exists
-    bool freeable = false;
-
-    // first search whether this page was already allocated or not
-    u64 posn = 0;
-    for(size_t i = mm.page_stack_top; i < mm.page_stack_size; i++){
-        if(mm.page_stack[i] == page_vaddr){
-            posn = i;
-            freeable = true;
-        }
+    // check that such memory actually exists and was allocated
+    if(!MarkFrameFree(page_vaddr)){
+        Printf("Attemt to free a reserved page! : Address = %lx\n", page_vaddr);
+        return;
     }
 
-    // free memory
-    if(freeable){
-        /*
-         *  %%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%% BEFORE FREEING %%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
-         *
-         *                  unfreed memory
-         *                        |
-         *                        | /----------------> page stack top
-         *                        |/
-         *                        v
-         * ;---------------------;-------;
-         * ; | | | | | | | | | | |%|%|%|%|
-         * ;---------------------;-------;
-         *                            ^
-         *                            |
-         *                            |
-         *                   memory to be freed
-         *
-         *  %%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%% AFTER FREEING %%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
-         *
-         *                   freed memory
-         *                        |
-         *                        | ;----------------> new stack top
-         *                        | |
-         *                        v v
-         * ;-----------------------;-----;
-         * ; | | | | | | | | | | | |%|%|%|
-         * ;-----------------------;-----;
-         *                            ^
-         *                            |
-         *                            |
-         *                    swapped memory
-         *
-         *
-         *
-         * */
-
-        // swap freed memory with non freed memory
-        u64 temp = mm.page_stack[posn];
-        mm.page_stack[posn] = mm.page_stack[mm.page_stack_top];
-        mm.page_stack[mm.page_stack_top] = temp;
-
-        // mm.page_stack[mm.page_stack_top] = page_vaddr;
-        mm.page_stack_top++;
-        mm.used_memory -= PAGE_SIZE;
-        mm.free_memory += PAGE_SIZE;
-    }else{
-        Printf("Attemt to free a reserved page! : Address = %lx\n", PhysicalToVirtualAddress(page_vaddr));
+    u64 flags = SaveFlagsAndDisableInterrupts();
+    PageMagazine* magazine = &magazines[GetCurrentCPU()->id];
+
+    if(magazine->count == PAGE_MAGAZINE_SIZE){
+        DrainMagazine(magazine, PAGE_MAGAZINE_BATCH);
     }
+
+    magazine->pages[magazine->count++] = page_vaddr;
+    magazine->freed_pages++;
+
+    RestoreFlags(flags);
 }
 
 // free pages at addresses stored at the value provided in the element of
@@ -314,14 +422,38 @@ void FreePages(u64 *pages, size_t n){
     }
 }
 
+// take one more reference to an allocated page
+void ReferencePage(u64 page_vaddr){
+    u64 frame = VirtualToPhysicalAddress(page_vaddr) / PAGE_SIZE;
+    __atomic_fetch_add(&mm.frame_refcounts[frame], 1, __ATOMIC_RELAXED);
+}
+
+// drop a reference to page, and free it if it was the last one
+void ReleasePage(u64 page_vaddr){
+    u64 frame = VirtualToPhysicalAddress(page_vaddr) / PAGE_SIZE;
+
+    // counter only holds extra references, so finding
+    // zero means we're dropping the last reference
+    u32 old = __atomic_fetch_sub(&mm.frame_refcounts[frame], 1, __ATOMIC_ACQ_REL);
+    if(old == 0){
+        mm.frame_refcounts[frame] = 0;
+        FreePage(page_vaddr);
+    }
+}
+
+u64 GetPageReferenceCount(u64 page_vaddr){
+    u64 frame = VirtualToPhysicalAddress(page_vaddr) / PAGE_SIZE;
+    return u64(__atomic_load_n(&mm.frame_refcounts[frame], __ATOMIC_ACQUIRE)) + 1;
+}
+
 // print memmoy statistics
 void ShowMemoryStatistics(){
     ColorPrintf(COLOR_YELLOW, COLOR_BLACK, "[+] Memory Stats : \n");
-    Printf("\tFree Memory : %lu KB\n", (mm.free_memory/KB));
-    Printf("\tUsed Memory : %lu KB\n", (mm.used_memory/KB));
+    Printf("\tFree Memory : %lu KB\n", (GetFreeMemory()/KB));
+    Printf("\tUsed Memory : %lu KB\n", (GetUsedMemory()/KB));
     Printf("\tReserved Memory : %lu KB\n", (mm.reserved_memory/KB));
-    Printf("\tFree Pages : %lu pages\n", (mm.page_stack_top));
-    Printf("\tTotal Pages : %lu pages\n", (mm.total_memory));
+    Printf("\tFree Pages : %lu pages\n", (GetFreeMemory()/PAGE_SIZE));
+    Printf("\tTotal Pages : %lu pages\n", (mm.total_page_count));
 }
 
 // turn on given flags
@@ -354,7 +486,8 @@ void Page::SetAddress(u64 address){
 }
 
 // get next level of paging
-PageTable* GetNextLevel(PageTable* ptable, u64 entry_index, bool allocate){
+// table_flags are added to entry pointing to next level (eg: MAP_USER)
+PageTable* GetNextLevel(PageTable* ptable, u64 entry_index, bool allocate, u64 table_flags = 0){
     Page* pte = &ptable->entries[entry_index];
     PageTable* pt = nullptr;
 
@@ -373,7 +506,7 @@ PageTable* GetNextLevel(PageTable* ptable, u64 entry_index, bool allocate){
 
         // shift by 12 biits to align it to 0x1000 boundary
         pte->SetAddress(paddr >> 12);
-        pte->SetFlags(MAP_PRESENT | MAP_READ_WRITE);
+        pte->SetFlags(MAP_PRESENT | MAP_READ_WRITE | table_flags);
     }else{
         u64 paddr = pte->GetAddress() << 12;
         u64 vaddr = PhysicalToVirtualAddress(paddr);
@@ -439,6 +572,8 @@ Page* GetPage(u64 vaddr, bool allocate){
 
 // map given physical memory to virtual memory wiht given flags
 void MapMemory(u64 vaddr, u64 paddr, u64 flags){
+    LockGuard guard(mm.page_table_lock);
+
     // get page table entry
     Page* pte = GetPage(vaddr, true);
     if(pte == nullptr) return;
@@ -448,6 +583,92 @@ void MapMemory(u64 vaddr, u64 paddr, u64 flags){
     pte->SetFlags(flags);
 }
 
+// unmap page mapped at given virtual address
+void UnmapMemory(u64 vaddr){
+    LockGuard guard(mm.page_table_lock);
+
+    // don't allocate page tables just to unmap a page
+    Page* pte = GetPage(vaddr, false);
+    if(pte == nullptr) return;
+
+    pte->value = 0;
+    InvalidatePage(vaddr);
+}
+
+// map device memory to it's direct map address with caching disabled
+u64 MapMMIO(u64 paddr, u64 size){
+    u64 start = paddr & ~(PAGE_SIZE - 1);
+    u64 end = (paddr + size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    for(u64 p = start; p < end; p += PAGE_SIZE){
+        // memory map may have already mapped it as normal memory
+        MapMemory(PhysicalToVirtualAddress(p), p, MAP_PRESENT | MAP_READ_WRITE | MAP_CACHE_DISABLED | MAP_WRITE_THROUGH);
+        InvalidatePage(PhysicalToVirtualAddress(p));
+    }
+    return PhysicalToVirtualAddress(paddr);
+}
+
+// allocate and map a kernel stack with a guard page below it
+u64 AllocateKernelStack(u64 num_pages){
+    // +1 for guard page, guard page is never mapped
+    u64 region_size = (num_pages + 1) * PAGE_SIZE;
+    u64 base = __atomic_fetch_add(&mm.kernel_stack_next, region_size, __ATOMIC_RELAXED);
+    if(base + region_size > KERNEL_STACK_REGION_BASE + KERNEL_STACK_REGION_SIZE){
+        Printf("[-] Kernel stack region exhausted\n");
+        while(true)asm("hlt");
+    }
+
+    // skip guard page
+    u64 stack_bottom = base + PAGE_SIZE;
+    for(u64 i = 0; i < num_pages; i++){
+        u64 page_vaddr = AllocatePage();
+        MapMemory(stack_bottom + i * PAGE_SIZE, VirtualToPhysicalAddress(page_vaddr), MAP_PRESENT | MAP_READ_WRITE);
+    }
+
+    return stack_bottom + num_pages * PAGE_SIZE;
+}
+
+// unmap and free pages of a kernel stack
+// virtual address range is not reused
+void FreeKernelStack(u64 stack_top, u64 num_pages){
+    u64 stack_bottom = stack_top - num_pages * PAGE_SIZE;
+    for(u64 i = 0; i < num_pages; i++){
+        u64 vaddr = stack_bottom + i * PAGE_SIZE;
+        u64 paddr = 0;
+        {
+            LockGuard guard(mm.page_table_lock);
+            Page* pte = GetPage(vaddr, false);
+            if(pte == nullptr || !pte->GetFlags(MAP_PRESENT)) continue;
+
+            paddr = pte->GetAddress() << 12;
+            pte->value = 0;
+            InvalidatePage(vaddr);
+        }
+        // page may also be mapped in user space (see AddUserRegion)
+        ReleasePage(PhysicalToVirtualAddress(paddr));
+    }
+}
+
+// kernel memory is a kernel stack without a guard page at it's top
+u64 AllocateKernelMemory(u64 num_pages){
+    return AllocateKernelStack(num_pages) - num_pages * PAGE_SIZE;
+}
+
+void FreeKernelMemory(u64 vaddr, u64 num_pages){
+    FreeKernelStack(vaddr + num_pages * PAGE_SIZE, num_pages);
+}
+
+// physical address a kernel virtual address is mapped to
+u64 KernelVirtualToPhysical(u64 vaddr){
+    // direct map needs no walk
+    if(vaddr >= MEM_PHYS_OFFSET && vaddr < KERNEL_STACK_REGION_BASE){
+        return VirtualToPhysicalAddress(vaddr);
+    }
+
+    LockGuard guard(mm.page_table_lock);
+    Page* pte = GetPage(vaddr, false);
+    return (pte->GetAddress() << 12) | (vaddr & (PAGE_SIZE - 1));
+}
+
 // create page map table by allocating a new array for it.
 void CreatePageMap(){
     if(mm.pml4 == nullptr){
@@ -494,10 +715,21 @@ void InitializeVirtualMemoryManager(stivale2_struct_tag_memmap* mmap){
                 u64 paddr = mmap_entry[i].base + p;
                 u64 vaddr = KERNEL_VIRT_BASE + p;
                 MapMemory(vaddr, paddr, MAP_PRESENT | MAP_READ_WRITE);
+                // boot modules are accessed through direct map
+                MapMemory(PhysicalToVirtualAddress(paddr), paddr, MAP_PRESENT | MAP_READ_WRITE);
             }
         }
     }
 
+    // every address space shares kernel half of page table by copying
+    // it's pml4 entries, so these entries must never change after this
+    for(u64 i = 256; i < 512; i++){
+        GetNextLevel(mm.pml4, i, true);
+    }
+
+    kernel_address_space.pml4 = mm.pml4;
+    kernel_address_space.pml4_paddr = mm.pml4_paddr;
+
     // u64 krnlPhysBase = BootInfo::GetKernelPhysicalBase();
     // for (uintptr_t p = 0; p < 2*GB; p += PAGE_SIZE){
     //     u64 paddr = krnlPhysBase + p;
@@ -509,8 +741,814 @@ void InitializeVirtualMemoryManager(stivale2_struct_tag_memmap* mmap){
     LoadPageTable();
 }
 
+/******************** Address Spaces ********************/
+
+AddressSpace* GetKernelAddressSpace(){
+    return &kernel_address_space;
+}
+
+AddressSpace* CreateAddressSpace(){
+    AddressSpace* space = new (SlabAllocate(&address_space_cache)) AddressSpace();
+
+    u64 pml4_vaddr = AllocatePage();
+    space->pml4 = reinterpret_cast<PageTable*>(pml4_vaddr);
+    space->pml4_paddr = VirtualToPhysicalAddress(pml4_vaddr);
+
+    // user half is empty, kernel half is shared
+    memset(space->pml4, 0, PAGE_SIZE / 2);
+    memcpy(&space->pml4->entries[256], &mm.pml4->entries[256], PAGE_SIZE / 2);
+
+    return space;
+}
+
+// copy a level of user page tables, pages mapped by it get one more reference
+// level is 4 for pml4, 1 for a table of pages
+// caller holds lock of src address space
+static void CloneTableLevel(PageTable* dst, PageTable* src, u64 level, u64 num_entries, u64 base, TLBBatch* batch){
+    for(u64 i = 0; i < num_entries; i++){
+        Page* pte = &src->entries[i];
+        if(!pte->GetFlags(MAP_PRESENT)) continue;
+
+        u64 vaddr = base + (i << (12 + 9 * (level - 1)));
+        u64 page = PhysicalToVirtualAddress(pte->GetAddress() << 12);
+        if(level > 1){
+            u64 table = AllocatePage();
+            memset(reinterpret_cast<void*>(table), 0, PAGE_SIZE);
+            CloneTableLevel(reinterpret_cast<PageTable*>(table), reinterpret_cast<PageTable*>(page), level - 1, 512, vaddr, batch);
+
+            // same flags, different table
+            dst->entries[i].value = pte->value;
+            dst->entries[i].SetAddress(VirtualToPhysicalAddress(table) >> 12);
+            continue;
+        }
+
+        // parent must not write to a page child can see, so writable
+        // pages become copy on write on both sides
+        if(pte->GetFlags(MAP_READ_WRITE) && !pte->GetFlags(MAP_SHARED)){
+            pte->UnsetFlags(MAP_READ_WRITE);
+            pte->SetFlags(MAP_COPY_ON_WRITE);
+            QueueTLBFlush(batch, vaddr);
+        }
+
+        ReferencePage(page);
+        dst->entries[i].value = pte->value;
+    }
+}
+
+AddressSpace* CloneAddressSpace(AddressSpace* src){
+    AddressSpace* dst = CreateAddressSpace();
+    TLBBatch batch(src);
+
+    {
+        LockGuard guard(src->lock);
+        CloneTableLevel(dst->pml4, src->pml4, 4, 256, 0, &batch);
+
+        // pages of regions that were never touched are faulted in separately on both sides
+        MemoryRegion** tail = &dst->regions;
+        for(MemoryRegion* region = src->regions; region; region = region->next){
+            MemoryRegion* copy = reinterpret_cast<MemoryRegion*>(SlabAllocate(&memory_region_cache));
+            copy->start = region->start;
+            copy->end = region->end;
+            copy->flags = region->flags;
+            copy->data = region->data;
+            copy->data_start = region->data_start;
+            copy->data_end = region->data_end;
+            copy->file = region->file ? VFSDuplicate(region->file) : nullptr;
+            copy->file_offset = region->file_offset;
+            copy->space = dst;
+            copy->mapping_next = nullptr;
+            copy->next = nullptr;
+            *tail = copy;
+            tail = &copy->next;
+        }
+    }
+
+    // file mappings are registered without holding a spinlock
+    for(MemoryRegion* region = dst->regions; region; region = region->next){
+        if(region->file) AddFileMapping(region);
+    }
+
+    // threads of parent may still have writable translations cached
+    FlushTLBBatch(&batch);
+    return dst;
+}
+
+// free a page table and everything mapped by it
+// level is 4 for pml4, 1 for a table of pages
+static void FreePageTableLevel(PageTable* table, u64 level, u64 num_entries){
+    for(u64 i = 0; i < num_entries; i++){
+        Page* pte = &table->entries[i];
+        if(!pte->GetFlags(MAP_PRESENT)) continue;
+
+        u64 vaddr = PhysicalToVirtualAddress(pte->GetAddress() << 12);
+        if(level > 1){
+            FreePageTableLevel(reinterpret_cast<PageTable*>(vaddr), level - 1, 512);
+        }else{
+            // page may still be mapped in other address spaces
+            ReleasePage(vaddr);
+        }
+    }
+
+    FreePage(reinterpret_cast<u64>(table));
+}
+
+void DestroyAddressSpace(AddressSpace* space){
+    // writes through shared file mappings must reach page cache before page tables go
+    for(MemoryRegion* region = space->regions; region; region = region->next){
+        if(region->file) RemoveFileMapping(region);
+    }
+
+    // only user half belongs to this address space
+    FreePageTableLevel(space->pml4, 4, 256);
+
+    MemoryRegion* region = space->regions;
+    while(region){
+        MemoryRegion* next = region->next;
+        if(region->file) VFSClose(region->file);
+        SlabFree(&memory_region_cache, region);
+        region = next;
+    }
+
+    SlabFree(&address_space_cache, space);
+}
+
+void SwitchAddressSpace(AddressSpace* space){
+    CPU* cpu = GetCurrentCPU();
+    if(cpu->address_space != space){
+        WriteCR3(space->pml4_paddr);
+        cpu->address_space = space;
+    }
+}
+
+// walk user half of page table of an address space
+static Page* GetUserPage(AddressSpace* space, u64 vaddr, bool allocate){
+    PageTable* table = space->pml4;
+    for(u64 shift = 39; shift > 12; shift -= 9){
+        table = GetNextLevel(table, (vaddr >> shift) & 0x1ff, allocate, MAP_USER);
+        if(table == nullptr) return nullptr;
+    }
+    return &table->entries[(vaddr >> 12) & 0x1ff];
+}
+
+bool MapUserMemory(AddressSpace* space, u64 vaddr, u64 paddr, u64 flags){
+    if(vaddr >= USER_SPACE_LIMIT) return false;
+
+    LockGuard guard(space->lock);
+    Page* pte = GetUserPage(space, vaddr, true);
+    pte->value = 0;
+    pte->SetAddress(paddr >> 12);
+    pte->SetFlags(flags | MAP_USER);
+
+    // address space may be active on this cpu
+    InvalidatePage(vaddr);
+    return true;
+}
+
+u64 AllocateUserPage(AddressSpace* space, u64 vaddr, u64 flags){
+    if(vaddr >= USER_SPACE_LIMIT) return 0;
+
+    u64 page = AllocatePage();
+    memset(reinterpret_cast<void*>(page), 0, PAGE_SIZE);
+    MapUserMemory(space, vaddr & ~(PAGE_SIZE - 1), VirtualToPhysicalAddress(page), flags);
+    return page;
+}
+
+/******************** Lazily Mapped Regions ********************/
+
+// add region to list of address space, fails if it overlaps another region
+static bool InsertUserRegion(AddressSpace* space, MemoryRegion* region){
+    // list is sorted by address and regions never overlap
+    LockGuard guard(space->lock);
+    MemoryRegion** link = &space->regions;
+    while(*link && (*link)->end <= region->start){
+        link = &(*link)->next;
+    }
+    if(*link && (*link)->start < region->end) return false;
+
+    region->next = *link;
+    *link = region;
+    return true;
+}
+
+bool AddUserRegion(AddressSpace* space, u64 vaddr, u64 size, u64 flags, u64 data, u64 data_vaddr, u64 data_size){
+    if((vaddr | size) & (PAGE_SIZE - 1)) return false;
+    if(size == 0 || vaddr >= USER_SPACE_LIMIT || size > USER_SPACE_LIMIT - vaddr) return false;
+    if(data_size && (data_vaddr < vaddr || data_size > vaddr + size - data_vaddr)) return false;
+
+    MemoryRegion* region = reinterpret_cast<MemoryRegion*>(SlabAllocate(&memory_region_cache));
+    region->start = vaddr;
+    region->end = vaddr + size;
+    region->flags = flags | MAP_PRESENT | MAP_USER;
+    region->data = data;
+    region->data_start = data_vaddr;
+    region->data_end = data_vaddr + data_size;
+    region->file = nullptr;
+    region->file_offset = 0;
+    region->space = space;
+    region->mapping_next = nullptr;
+
+    if(!InsertUserRegion(space, region)){
+        SlabFree(&memory_region_cache, region);
+        return false;
+    }
+    return true;
+}
+
+bool AddFileRegion(AddressSpace* space, u64 vaddr, u64 size, u64 flags, File* file, u64 offset){
+    if((vaddr | size | offset) & (PAGE_SIZE - 1)) return false;
+    if(size == 0 || vaddr >= USER_SPACE_LIMIT || size > USER_SPACE_LIMIT - vaddr) return false;
+    if(file->inode->type != VFS_TYPE_FILE || file->inode->cache == nullptr) return false;
+    if((flags & MAP_SHARED) && (flags & MAP_READ_WRITE) &&
+       (!(file->flags & VFS_OPEN_WRITE) || file->inode->ops->write == nullptr)) return false;
+
+    MemoryRegion* region = reinterpret_cast<MemoryRegion*>(SlabAllocate(&memory_region_cache));
+    region->start = vaddr;
+    region->end = vaddr + size;
+    region->flags = flags | MAP_PRESENT | MAP_USER;
+    region->data = 0;
+    region->data_start = 0;
+    region->data_end = 0;
+    region->file = VFSDuplicate(file);
+    region->file_offset = offset;
+    region->space = space;
+    region->mapping_next = nullptr;
+
+    if(!InsertUserRegion(space, region)){
+        VFSClose(region->file);
+        SlabFree(&memory_region_cache, region);
+        return false;
+    }
+    AddFileMapping(region);
+    return true;
+}
+
+// find region containing a user address, caller holds lock of address space
+static MemoryRegion* FindUserRegion(AddressSpace* space, u64 vaddr){
+    MemoryRegion* region = space->regions;
+    while(region && region->end <= vaddr){
+        region = region->next;
+    }
+    if(region == nullptr || region->start > vaddr) return nullptr;
+    return region;
+}
+
+// map page of a mapped file from page cache
+// caller holds lock of address space, returns nullptr if page is not cached
+static Page* FaultInFilePage(AddressSpace* space, MemoryRegion* region, u64 vaddr, bool write){
+    u64 page = FindCachedPage(region->file->inode, (region->file_offset + vaddr - region->start) / PAGE_SIZE);
+    if(page == 0) return nullptr;
+
+    // private writable mapping shares page until it's written
+    u64 flags = region->flags;
+    if(!(flags & MAP_SHARED) && (flags & MAP_READ_WRITE)){
+        if(write){
+            u64 copy = AllocatePage();
+            memcpy(reinterpret_cast<void*>(copy), reinterpret_cast<void*>(page), PAGE_SIZE);
+            ReleasePage(page);
+            page = copy;
+        }else{
+            flags = (flags & ~u64(MAP_READ_WRITE)) | MAP_COPY_ON_WRITE;
+        }
+    }
+
+    Page* pte = GetUserPage(space, vaddr, true);
+    pte->value = 0;
+    pte->SetAddress(VirtualToPhysicalAddress(page) >> 12);
+    pte->SetFlags(flags);
+    return pte;
+}
+
+// map page of a region on first access
+// caller holds lock of address space and page must not be present
+// returns nullptr if address is not in any region, or it's a page of mapped file that is not cached
+static Page* FaultInUserPage(AddressSpace* space, u64 vaddr, bool write){
+    vaddr &= ~(PAGE_SIZE - 1);
+    MemoryRegion* region = FindUserRegion(space, vaddr);
+    if(region == nullptr) return nullptr;
+    if(region->file) return FaultInFilePage(space, region, vaddr, write);
+
+    u64 flags = region->flags;
+    u64 end = vaddr + PAGE_SIZE;
+    Page* pte = GetUserPage(space, vaddr, true);
+    pte->value = 0;
+
+    // whole page comes from a page of backing memory, so it's shared instead of copied,
+    // unless it's going to be written right away
+    bool whole = vaddr >= region->data_start && end <= region->data_end;
+    if(whole && !((region->data + (vaddr - region->data_start)) & (PAGE_SIZE - 1)) &&
+       !(write && (flags & MAP_READ_WRITE))){
+        u64 paddr = KernelVirtualToPhysical(region->data + (vaddr - region->data_start));
+        ReferencePage(PhysicalToVirtualAddress(paddr));
+        if(flags & MAP_READ_WRITE){
+            flags = (flags & ~u64(MAP_READ_WRITE)) | MAP_COPY_ON_WRITE;
+        }
+        pte->SetAddress(paddr >> 12);
+        pte->SetFlags(flags);
+        return pte;
+    }
+
+    // otherwise page is private, with whatever part of data falls in it
+    u64 page = AllocatePage();
+    memset(reinterpret_cast<void*>(page), 0, PAGE_SIZE);
+    u64 from = vaddr > region->data_start ? vaddr : region->data_start;
+    u64 to = end < region->data_end ? end : region->data_end;
+    if(from < to){
+        memcpy(reinterpret_cast<void*>(page + (from - vaddr)),
+               reinterpret_cast<void*>(region->data + (from - region->data_start)), to - from);
+    }
+    pte->SetAddress(VirtualToPhysicalAddress(page) >> 12);
+    pte->SetFlags(flags);
+    return pte;
+}
+
+// get page table entry of a mapped user page, mapping it first if it's in a region
+// caller holds lock of address space, returns nullptr if address is not mapped
+static Page* GetMappedUserPage(AddressSpace* space, u64 vaddr, bool write){
+    Page* pte = GetUserPage(space, vaddr, false);
+    if(pte != nullptr && pte->GetFlags(MAP_PRESENT)){
+        return pte->GetFlags(MAP_USER) ? pte : nullptr;
+    }
+    return FaultInUserPage(space, vaddr, write);
+}
+
+// read page of a mapped file into page cache, so that it can be mapped
+// must be called without lock of address space and with interrupts enabled
+// returns false if address is not in a mapped file or page can't be read
+static bool ReadInFilePage(AddressSpace* space, u64 vaddr){
+    Inode* inode = nullptr;
+    u64 index = 0;
+    {
+        LockGuard guard(space->lock);
+        MemoryRegion* region = FindUserRegion(space, vaddr);
+        if(region && region->file){
+            inode = region->file->inode;
+            index = (region->file_offset + vaddr - region->start) / PAGE_SIZE;
+        }
+    }
+
+    // region, and file with it, lives as long as address space
+    if(inode == nullptr) return false;
+    u64 page = GetCachedPage(inode, index);
+    if(page == 0) return false;
+    ReleasePage(page);
+    return true;
+}
+
+bool IsUserRangeMapped(AddressSpace* space, u64 vaddr, u64 size){
+    if(vaddr >= USER_SPACE_LIMIT || size > USER_SPACE_LIMIT - vaddr) return false;
+
+    u64 end = vaddr + size;
+    u64 page = vaddr & ~(PAGE_SIZE - 1);
+    while(page < end){
+        {
+            LockGuard guard(space->lock);
+            while(page < end && GetMappedUserPage(space, page, false) != nullptr){
+                page += PAGE_SIZE;
+            }
+        }
+        // rest of range may be a mapped file whose next page is not cached yet
+        if(page < end && !ReadInFilePage(space, page)) return false;
+    }
+    return true;
+}
+
+u64 CleanUserPages(AddressSpace* space, u64 vaddr, u64 num_pages, TLBBatch* batch){
+    u64 dirty = 0;
+    LockGuard guard(space->lock);
+    for(u64 i = 0; i < num_pages; i++){
+        u64 page = vaddr + i * PAGE_SIZE;
+        Page* pte = GetUserPage(space, page, false);
+        if(pte == nullptr || !pte->GetFlags(MAP_PRESENT) || !pte->GetFlags(MAP_DIRTY)) continue;
+
+        // cpu sets accessed and dirty bits without taking our lock
+        __atomic_fetch_and(&pte->value, ~u64(MAP_DIRTY), __ATOMIC_RELAXED);
+        QueueTLBFlush(batch, page);
+        dirty |= u64(1) << i;
+    }
+    return dirty;
+}
+
+void UnmapUserPages(AddressSpace* space, u64 vaddr, u64 num_pages){
+    // pages are released only after no cpu can reach them through it's tlb
+    u64 pages[TLB_BATCH_PAGES];
+    TLBBatch batch(space);
+    for(u64 first = 0; first < num_pages; first += TLB_BATCH_PAGES){
+        u64 count = num_pages - first < TLB_BATCH_PAGES ? num_pages - first : TLB_BATCH_PAGES;
+        u64 unmapped = 0;
+        {
+            LockGuard guard(space->lock);
+            for(u64 i = 0; i < count; i++){
+                u64 page = vaddr + (first + i) * PAGE_SIZE;
+                Page* pte = GetUserPage(space, page, false);
+                if(pte == nullptr || !pte->GetFlags(MAP_PRESENT)) continue;
+
+                pages[unmapped++] = PhysicalToVirtualAddress(pte->GetAddress() << 12);
+                pte->value = 0;
+                QueueTLBFlush(&batch, page);
+            }
+        }
+
+        FlushTLBBatch(&batch);
+        for(u64 i = 0; i < unmapped; i++) ReleasePage(pages[i]);
+    }
+}
+
+/******************** TLB Shootdown ********************/
+
+/* ------------------ TLB SHOOTDOWN --------------------
+ *
+ * When a user mapping is downgraded or replaced, every cpu that has the
+ * address space loaded may still have old translation in it's tlb. Cpus
+ * that have some other address space loaded don't, because loading cr3
+ * flushes all non global entries.
+ *
+ * Changed pages are collected in a TLBBatch and flushed together once page
+ * tables are updated. Every remote cpu that has address space loaded (see
+ * cpu->address_space) gets a pointer to batch in it's mailbox and a single
+ * IPI, and initiator waits until all of them have flushed. A cpu serves
+ * only one request at a time, so initiator waits for mailbox to become
+ * empty before posting. It waits with interrupts enabled, so that two cpus
+ * shooting down each other at the same time don't deadlock.
+ *
+ * */
+
+void QueueTLBFlush(TLBBatch* batch, u64 vaddr){
+    if(batch->count < TLB_BATCH_PAGES){
+        batch->pages[batch->count++] = vaddr & ~(PAGE_SIZE - 1);
+    }else{
+        batch->flush_all = true;
+    }
+}
+
+// invalidate batch on current cpu
+static void FlushLocalTLB(TLBBatch* batch){
+    if(batch->flush_all){
+        WriteCR3(ReadCR3());
+        return;
+    }
+
+    for(u32 i = 0; i < batch->count; i++){
+        InvalidatePage(batch->pages[i]);
+    }
+}
+
+void FlushTLBBatch(TLBBatch* batch){
+    if(batch->count == 0 && !batch->flush_all) return;
+
+    // set of remote cpus must be computed on the cpu that flushes locally
+    DisablePreemption();
+    CPU* self = GetCurrentCPU();
+    if(self->address_space == batch->space){
+        FlushLocalTLB(batch);
+    }
+
+    // page table updates must be visible before we check who uses address space
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    batch->pending = 0;
+    u32 count = GetCPUCount();
+    for(u32 id = 0; id < count; id++){
+        CPU* cpu = GetCPU(id);
+        if(cpu == self || !cpu->is_online) continue;
+        if(__atomic_load_n(&cpu->address_space, __ATOMIC_ACQUIRE) != batch->space) continue;
+
+        __atomic_fetch_add(&batch->pending, 1, __ATOMIC_RELAXED);
+        TLBBatch* expected = nullptr;
+        while(!__atomic_compare_exchange_n(&cpu->tlb_flush_request, &expected, batch, false,
+                                           __ATOMIC_RELEASE, __ATOMIC_RELAXED)){
+            expected = nullptr;
+            CPUPause();
+        }
+        SendIPI(cpu->lapic_id, APIC_TLB_SHOOTDOWN_VECTOR);
+    }
+
+    while(__atomic_load_n(&batch->pending, __ATOMIC_ACQUIRE)){
+        CPUPause();
+    }
+    EnablePreemption();
+
+    batch->count = 0;
+    batch->flush_all = false;
+}
+
+void HandleTLBShootdown(){
+    CPU* cpu = GetCurrentCPU();
+    TLBBatch* batch = __atomic_exchange_n(&cpu->tlb_flush_request, nullptr, __ATOMIC_ACQUIRE);
+    if(batch == nullptr) return;
+
+    if(cpu->address_space == batch->space){
+        FlushLocalTLB(batch);
+    }
+    __atomic_fetch_sub(&batch->pending, 1, __ATOMIC_RELEASE);
+}
+
+/******************** Copy On Write ********************/
+
+// page fault error code bits
+#define PAGE_FAULT_PRESENT (1 << 0)
+#define PAGE_FAULT_WRITE (1 << 1)
+
+// make a copy on write page private to the address space it's mapped in
+// caller holds lock of address space, returns true if page was replaced
+// by a copy (old translation must be flushed everywhere)
+static bool BreakCopyOnWrite(Page* pte){
+    u64 page = PhysicalToVirtualAddress(pte->GetAddress() << 12);
+    bool copied = false;
+
+    // someone else still references page, give this mapping it's own copy
+    // otherwise page is ours alone and just becomes writable again
+    if(GetPageReferenceCount(page) > 1){
+        u64 copy = AllocatePage();
+        memcpy(reinterpret_cast<void*>(copy), reinterpret_cast<void*>(page), PAGE_SIZE);
+        pte->SetAddress(VirtualToPhysicalAddress(copy) >> 12);
+        ReleasePage(page);
+        copied = true;
+    }
+
+    pte->UnsetFlags(MAP_COPY_ON_WRITE);
+    pte->SetFlags(MAP_READ_WRITE);
+    return copied;
+}
+
+// first touch of a lazily mapped page, or another cpu just mapped it
+// cpus don't cache non present entries, so there's nothing to invalidate
+static bool MapFaultedUserPage(AddressSpace* space, u64 vaddr, bool write){
+    LockGuard guard(space->lock);
+    Page* pte = GetUserPage(space, vaddr, false);
+    if(pte != nullptr && pte->GetFlags(MAP_PRESENT)) return true;
+    return FaultInUserPage(space, vaddr, write) != nullptr;
+}
+
+bool HandlePageFault(u64 vaddr, u64 errorcode, bool interrupts_enabled){
+    if(vaddr >= USER_SPACE_LIMIT) return false;
+
+    // fault is always against the address space loaded on this cpu
+    AddressSpace* space = GetCurrentCPU()->address_space;
+    if(space == nullptr || space == &kernel_address_space) return false;
+
+    bool write = errorcode & PAGE_FAULT_WRITE;
+    if(!(errorcode & PAGE_FAULT_PRESENT)){
+        if(MapFaultedUserPage(space, vaddr, write)) return true;
+
+        // page of a mapped file that is not cached, read it in without holding any lock
+        if(!interrupts_enabled) return false;
+        EnableInterrupts();
+        bool cached = ReadInFilePage(space, vaddr);
+        DisableInterrupts();
+        return cached && MapFaultedUserPage(space, vaddr, write);
+    }
+
+    bool copied;
+    {
+        LockGuard guard(space->lock);
+        Page* pte = GetUserPage(space, vaddr, false);
+
+        if(!write) return false;
+        if(pte == nullptr || !pte->GetFlags(MAP_PRESENT) || !pte->GetFlags(MAP_USER)) return false;
+
+        // another cpu already resolved it, our tlb is just stale
+        if(pte->GetFlags(MAP_READ_WRITE)){
+            InvalidatePage(vaddr);
+            return true;
+        }
+        if(!pte->GetFlags(MAP_COPY_ON_WRITE)) return false;
+
+        copied = BreakCopyOnWrite(pte);
+        InvalidatePage(vaddr);
+    }
+
+    // other threads of this address space may still read old page
+    if(copied && interrupts_enabled){
+        TLBBatch batch(space);
+        QueueTLBFlush(&batch, vaddr);
+        EnableInterrupts();
+        FlushTLBBatch(&batch);
+        DisableInterrupts();
+    }
+    return true;
+}
+
+/******************** Sharing Between Address Spaces ********************/
+
+bool ShareUserPages(AddressSpace* dst, u64 dst_vaddr, AddressSpace* src, u64 src_vaddr, u64 num_pages){
+    u64 size = num_pages * PAGE_SIZE;
+    if((dst_vaddr | src_vaddr) & (PAGE_SIZE - 1)) return false;
+    if(dst_vaddr >= USER_SPACE_LIMIT || size > USER_SPACE_LIMIT - dst_vaddr) return false;
+    if(src_vaddr >= USER_SPACE_LIMIT || size > USER_SPACE_LIMIT - src_vaddr) return false;
+
+    TLBBatch src_batch(src);
+    TLBBatch dst_batch(dst);
+    // pages replaced at destination, freed only after their translations are flushed
+    u64 replaced[TLB_BATCH_PAGES];
+
+    // work in chunks, so every chunk costs one flush on every cpu
+    for(u64 done = 0; done < num_pages;){
+        u64 chunk = num_pages - done;
+        if(chunk > TLB_BATCH_PAGES) chunk = TLB_BATCH_PAGES;
+
+        u64 pages[TLB_BATCH_PAGES];
+        u64 flags[TLB_BATCH_PAGES];
+        bool ok = true;
+        {
+            LockGuard guard(src->lock);
+            for(u64 i = 0; i < chunk; i++){
+                u64 vaddr = src_vaddr + (done + i) * PAGE_SIZE;
+                Page* pte = GetMappedUserPage(src, vaddr, false);
+                if(pte == nullptr){
+                    chunk = i;
+                    ok = false;
+                    break;
+                }
+
+                // writable pages are downgraded, pages that were read only stay that way
+                // shared pages are seen by kernel through their frame, they can't move
+                flags[i] = MAP_PRESENT;
+                if(pte->GetFlags(MAP_READ_WRITE) && !pte->GetFlags(MAP_SHARED)){
+                    pte->UnsetFlags(MAP_READ_WRITE);
+                    pte->SetFlags(MAP_COPY_ON_WRITE);
+                    QueueTLBFlush(&src_batch, vaddr);
+                }
+                if(pte->GetFlags(MAP_COPY_ON_WRITE)){
+                    flags[i] |= MAP_COPY_ON_WRITE;
+                }
+
+                pages[i] = PhysicalToVirtualAddress(pte->GetAddress() << 12);
+                ReferencePage(pages[i]);
+            }
+        }
+
+        u64 replaced_count = 0;
+        {
+            LockGuard guard(dst->lock);
+            for(u64 i = 0; i < chunk; i++){
+                u64 vaddr = dst_vaddr + (done + i) * PAGE_SIZE;
+                Page* pte = GetUserPage(dst, vaddr, true);
+                if(pte->GetFlags(MAP_PRESENT)){
+                    replaced[replaced_count++] = PhysicalToVirtualAddress(pte->GetAddress() << 12);
+                    QueueTLBFlush(&dst_batch, vaddr);
+                }
+
+                pte->value = 0;
+                pte->SetAddress(VirtualToPhysicalAddress(pages[i]) >> 12);
+                pte->SetFlags(flags[i] | MAP_USER);
+            }
+        }
+
+        FlushTLBBatch(&src_batch);
+        FlushTLBBatch(&dst_batch);
+        for(u64 i = 0; i < replaced_count; i++){
+            ReleasePage(replaced[i]);
+        }
+
+        if(!ok) return false;
+        done += chunk;
+    }
+
+    return true;
+}
+
+// get page mapped at given user address with a reference taken on it
+// if write is true, page is made private to address space first
+// returns 0 if page is not mapped
+static u64 GrabUserPage(AddressSpace* space, u64 vaddr, bool write, TLBBatch* batch){
+    LockGuard guard(space->lock);
+    Page* pte = GetMappedUserPage(space, vaddr, write);
+    if(pte == nullptr) return 0;
+
+    if(write && !pte->GetFlags(MAP_READ_WRITE)){
+        if(!pte->GetFlags(MAP_COPY_ON_WRITE)) return 0;
+        BreakCopyOnWrite(pte);
+        QueueTLBFlush(batch, vaddr);
+    }
+
+    u64 page = PhysicalToVirtualAddress(pte->GetAddress() << 12);
+    ReferencePage(page);
+    return page;
+}
+
+bool CopyUserMemory(AddressSpace* dst, u64 dst_vaddr, AddressSpace* src, u64 src_vaddr, u64 size){
+    if(dst_vaddr >= USER_SPACE_LIMIT || size > USER_SPACE_LIMIT - dst_vaddr) return false;
+    if(src_vaddr >= USER_SPACE_LIMIT || size > USER_SPACE_LIMIT - src_vaddr) return false;
+
+    TLBBatch dst_batch(dst);
+    bool ok = true;
+    while(size){
+        // copy up to end of whichever page ends first
+        u64 src_offset = src_vaddr & (PAGE_SIZE - 1);
+        u64 dst_offset = dst_vaddr & (PAGE_SIZE - 1);
+        u64 chunk = PAGE_SIZE - (src_offset > dst_offset ? src_offset : dst_offset);
+        if(chunk > size) chunk = size;
+
+        // references keep pages alive while no lock is held,
+        // holding both locks at once could deadlock with a copy the other way
+        u64 src_page = GrabUserPage(src, src_vaddr, false, nullptr);
+        if(src_page == 0){
+            ok = false;
+            break;
+        }
+        u64 dst_page = GrabUserPage(dst, dst_vaddr, true, &dst_batch);
+        if(dst_page == 0){
+            ReleasePage(src_page);
+            ok = false;
+            break;
+        }
+
+        VectorMemcpy(reinterpret_cast<void*>(dst_page + dst_offset), reinterpret_cast<void*>(src_page + src_offset), chunk);
+        ReleasePage(src_page);
+        ReleasePage(dst_page);
+
+        src_vaddr += chunk;
+        dst_vaddr += chunk;
+        size -= chunk;
+    }
+
+    FlushTLBBatch(&dst_batch);
+    return ok;
+}
+
 // initialize memory manager
 void InitializeMemoryManager(stivale2_struct_tag_memmap* mmap){
     InitializePhysicalMemoryManager(mmap);
     InitializeVirtualMemoryManager(mmap);
 }
+
+/******************** Page Allocator Benchmark ********************/
+
+// number of pages every cpu holds at once in benchmark
+#define BENCH_ALLOC_BATCH 256
+// number of times every cpu allocates and frees a batch
+#define BENCH_ALLOC_ROUNDS 64
+
+struct AllocatorBenchWork {
+    bool use_magazines;
+    u64 pages[BENCH_ALLOC_BATCH];
+};
+
+static AllocatorBenchWork alloc_bench_work[MAX_CPUS];
+
+// allocate a page directly from page stack, taking lock every time
+// this is what every allocation looked like before magazines
+static u64 AllocatePageFromStack(){
+    MCSLockGuard guard(mm.page_stack_lock);
+    u64 page_vaddr = mm.page_stack[--mm.page_stack_top];
+    mm.free_memory -= PAGE_SIZE;
+    mm.used_memory += PAGE_SIZE;
+    return page_vaddr;
+}
+
+static void FreePageToStack(u64 page_vaddr){
+    MCSLockGuard guard(mm.page_stack_lock);
+    mm.page_stack[mm.page_stack_top++] = page_vaddr;
+    mm.free_memory += PAGE_SIZE;
+    mm.used_memory -= PAGE_SIZE;
+}
+
+static void AllocatorStress(void* arg){
+    AllocatorBenchWork* work = reinterpret_cast<AllocatorBenchWork*>(arg);
+    for(u64 round = 0; round < BENCH_ALLOC_ROUNDS; round++){
+        for(u64 i = 0; i < BENCH_ALLOC_BATCH; i++){
+            work->pages[i] = work->use_magazines ? AllocatePage() : AllocatePageFromStack();
+        }
+        for(u64 i = 0; i < BENCH_ALLOC_BATCH; i++){
+            if(work->use_magazines) FreePage(work->pages[i]);
+            else FreePageToStack(work->pages[i]);
+        }
+    }
+}
+
+// run allocator stress test on first n cpus and return cycles taken
+static u64 RunAllocatorStress(u32 n, bool use_magazines){
+    for(u32 c = 0; c < n; c++){
+        alloc_bench_work[c].use_magazines = use_magazines;
+    }
+
+    u64 start = ReadTimestampCounterSerialized();
+    for(u32 c = 1; c < n; c++){
+        RunOnCPU(c, AllocatorStress, &alloc_bench_work[c]);
+    }
+    AllocatorStress(&alloc_bench_work[0]);
+    for(u32 c = 1; c < n; c++){
+        WaitForCPU(c);
+    }
+    return ReadTimestampCounterSerialized() - start;
+}
+
+void BenchmarkPageAllocator(){
+    ColorPrintf(COLOR_YELLOW, COLOR_BLACK, "[+] Benchmark : Page Allocator Stress\n");
+
+    u32 cpu_count = GetCPUCount();
+    for(u32 n = 1; n <= cpu_count; n++){
+        // powers of two and total cpu count are enough to show scaling
+        if((n & (n - 1)) != 0 && n != cpu_count) continue;
+
+        // every operation is one allocation or one free
+        u64 ops = u64(n) * BENCH_ALLOC_ROUNDS * BENCH_ALLOC_BATCH * 2;
+        u64 global_ns = CyclesToNanoseconds(RunAllocatorStress(n, false));
+        u64 magazine_ns = CyclesToNanoseconds(RunAllocatorStress(n, true));
+
+        // operations per millisecond
+        Printf("\tCPUs : %u | Global Stack : %lu ops/ms | Per-CPU Magazines : %lu ops/ms\n", n,
+               global_ns ? (ops * 1000000) / global_ns : 0,
+               magazine_ns ? (ops * 1000000) / magazine_ns : 0);
+    }
+}
@@ -14,6 +14,7 @@
 
 #include "stivale2.hpp"
 #include "Common.hpp"
+#include "Spinlock.hpp"
 
 extern const u64 MEM_PHYS_OFFSET;
 extern const u64 PAGE_SIZE;
@@ -60,6 +61,30 @@ void FreePage(u64 vaddr);
  * */
 void FreePages(u64* pages);
 
+/******************** Page References ********************/
+
+/**
+ * @brief Take one more reference to an allocated page, so that it
+ * can be mapped at more than one place. AllocatePage returns a page
+ * with a single reference.
+ *
+ * @param vaddr Virtual address of page.
+ * */
+void ReferencePage(u64 vaddr);
+
+/**
+ * @brief Drop a reference to a page. Page is freed when
+ * last reference is dropped.
+ *
+ * @param vaddr Virtual address of page.
+ * */
+void ReleasePage(u64 vaddr);
+
+/**
+ * @brief Get number of references to an allocated page.
+ * */
+u64 GetPageReferenceCount(u64 vaddr);
+
 /******************** Conversion Functions ********************/
 
 /**
@@ -111,6 +136,12 @@ u64 GetTotalMemory();
  * */
 void ShowMemoryStatistics();
 
+/**
+ * @brief Allocate and free pages on 1..n cpus at once and report
+ * throughput with and without per-cpu page magazines.
+ * */
+void BenchmarkPageAllocator();
+
 /**
  * @brief Different page flags that can be used while mapping
  * a physical address to new virtual address.
@@ -119,13 +150,23 @@ enum PageFlags {
     MAP_PRESENT = 1 << 0,
     MAP_READ_WRITE = 1 << 1,
     MAP_SUPERVISOR_ONLY = 1 << 2,
+    // despite the name above, setting bit 2 is what allows user mode access
+    MAP_USER = 1 << 2,
     MAP_WRITE_THROUGH = 1 << 3,
     MAP_CACHE_DISABLED = 1 << 4,
     MAP_ACCESSED = 1 << 5,
+    // set by cpu on first write through mapping
+    MAP_DIRTY = 1 << 6,
     MAP_LARGER_PAGES =  1 << 7,
     MAP_CUSTOM0 = 1 << 9,
     MAP_CUSTOM1 = 1 << 10,
     MAP_CUSTOM2 = 1 << 11,
+    // page is mapped read only in more than one place,
+    // first write gives writer it's own copy
+    MAP_COPY_ON_WRITE = MAP_CUSTOM0,
+    // page is shared with kernel (eg: io ring pages), it stays the same
+    // physical page when address space is cloned and is never copied on write
+    MAP_SHARED = MAP_CUSTOM1,
     MAP_NO_EXECUTE = uint64_t(1) << 63 // only if supported
 };
 
@@ -169,4 +210,289 @@ void MapMemory(u64 vaddr, u64 paddr, u64 flags);
  * */
 void UnmapMemory(u64 vaddr);
 
+/**
+ * @brief Map device memory (memory mapped io) with caching disabled.
+ * Memory is mapped at it's higher half direct map address.
+ *
+ * @param paddr Physical address of device memory.
+ * @param size Size of device memory in bytes.
+ * @return Virtual address of mapped memory.
+ * */
+u64 MapMMIO(u64 paddr, u64 size);
+
+/**
+ * @brief Load kernel's page table in cr3 of current cpu.
+ * Application processors call this to switch from bootloader's page table.
+ * */
+void LoadPageTable();
+
+/**
+ * @brief Allocate a kernel stack. Pages are mapped in a separate virtual
+ * memory region and an unmapped guard page is left below every stack
+ * so that a stack overflow causes a page fault instead of silent corruption.
+ *
+ * @param num_pages Number of pages in stack.
+ * @return Virtual address of top of stack (stack grows downwards).
+ * */
+[[nodiscard]] u64 AllocateKernelStack(u64 num_pages);
+
+/**
+ * @brief Free a kernel stack allocated using AllocateKernelStack.
+ *
+ * @param stack_top Value returned by AllocateKernelStack.
+ * @param num_pages Number of pages passed to AllocateKernelStack.
+ * */
+void FreeKernelStack(u64 stack_top, u64 num_pages);
+
+/**
+ * @brief Allocate pages that are virtually contiguous in kernel space,
+ * but not necessarily physically contiguous.
+ *
+ * @param num_pages Number of pages to allocate.
+ * @return Virtual address of first page.
+ * */
+[[nodiscard]] u64 AllocateKernelMemory(u64 num_pages);
+
+/**
+ * @brief Free memory allocated using AllocateKernelMemory.
+ *
+ * @param vaddr Value returned by AllocateKernelMemory.
+ * @param num_pages Number of pages passed to AllocateKernelMemory.
+ * */
+void FreeKernelMemory(u64 vaddr, u64 num_pages);
+
+/**
+ * @brief Get physical address of a mapped kernel address, in direct map
+ * or in memory from AllocateKernelMemory. Used to hand buffers to devices.
+ * */
+u64 KernelVirtualToPhysical(u64 vaddr);
+
+// user programs live in lower half of virtual address space
+#define USER_SPACE_END 0x0000800000000000
+// last user page is never mapped, so that an instruction at end of user
+// space can't make syscall return to a non canonical address
+#define USER_SPACE_LIMIT (USER_SPACE_END - 0x1000)
+// initial user stack grows down from here
+#define USER_STACK_TOP (USER_SPACE_LIMIT - 0x1000)
+
+struct File;
+struct AddressSpace;
+
+/**
+ * @brief A range of user address space whose pages are mapped on first access
+ * instead of up front (see AddUserRegion). Part of range may be backed by
+ * kernel memory, rest of it is zero filled. Or whole range maps a file
+ * through page cache (see AddFileRegion).
+ * */
+struct MemoryRegion {
+    // page aligned user range
+    u64 start;
+    u64 end;
+    // flags of pages mapped in this range
+    u64 flags;
+    // user range [data_start, data_end) is filled from kernel address data
+    u64 data;
+    u64 data_start;
+    u64 data_end;
+    // mapped file, whole range maps file starting at file_offset (see AddFileRegion)
+    File* file;
+    u64 file_offset;
+    // address space region belongs to, and next region mapping same file
+    AddressSpace* space;
+    MemoryRegion* mapping_next;
+    // next region at a higher address
+    MemoryRegion* next;
+};
+
+/**
+ * @brief A set of page tables. Lower half of every address space is private
+ * user memory, upper half is shared with kernel's page table.
+ * */
+struct AddressSpace {
+    PageTable* pml4;
+    u64 pml4_paddr;
+    // lazily mapped ranges, sorted by address
+    MemoryRegion* regions;
+    // protects user half of page tables and regions
+    // address spaces come and go, so lock statistics are not collected
+    TicketLock<false> lock;
+
+    constexpr AddressSpace() : pml4(nullptr), pml4_paddr(0), regions(nullptr), lock("mm.address_space") {}
+};
+
+/**
+ * @brief Get address space containing only kernel mappings.
+ * */
+AddressSpace* GetKernelAddressSpace();
+
+/**
+ * @brief Create a new address space with empty user half.
+ * */
+AddressSpace* CreateAddressSpace();
+
+/**
+ * @brief Create a copy of an address space for fork. Page tables are copied,
+ * pages are not. Writable pages become read only and copy on write in both
+ * address spaces, so they're copied only when one side writes to them.
+ * Must be called with interrupts enabled and no spinlocks held.
+ *
+ * @param src Address space to clone.
+ * @return New address space.
+ * */
+AddressSpace* CloneAddressSpace(AddressSpace* src);
+
+/**
+ * @brief Free user half of page tables, all user pages and address space itself.
+ * Address space must not be loaded on any cpu.
+ * */
+void DestroyAddressSpace(AddressSpace* space);
+
+/**
+ * @brief Load given address space in cr3 of current cpu, if it isn't already.
+ * */
+void SwitchAddressSpace(AddressSpace* space);
+
+/**
+ * @brief Map a physical page in user half of given address space.
+ * MAP_USER is added to flags.
+ *
+ * @return false if vaddr is not a user address.
+ * */
+bool MapUserMemory(AddressSpace* space, u64 vaddr, u64 paddr, u64 flags);
+
+/**
+ * @brief Allocate a zeroed page and map it at given user address.
+ *
+ * @return Kernel virtual address of page, or 0 if vaddr is not a user address.
+ * */
+u64 AllocateUserPage(AddressSpace* space, u64 vaddr, u64 flags);
+
+/**
+ * @brief Make a user range map it's pages on first access. Pages that lie
+ * entirely in data and are backed by a page aligned part of it are mapped
+ * without copying, read only, and copy on write if flags has MAP_READ_WRITE.
+ * Other pages get a zeroed private page with their part of data copied in.
+ * Backing memory must outlive address space, it's pages are referenced
+ * while they're mapped.
+ *
+ * @param space Address space to add range to.
+ * @param vaddr Page aligned start of range.
+ * @param size Page aligned size of range.
+ * @param flags Flags of pages, MAP_PRESENT and MAP_USER are added.
+ * @param data Kernel address of backing memory.
+ * @param data_vaddr User address where backing memory starts, inside range.
+ * @param data_size Size of backing memory, 0 for a zero filled range.
+ * @return false if range is invalid or overlaps another region.
+ * */
+bool AddUserRegion(AddressSpace* space, u64 vaddr, u64 size, u64 flags, u64 data, u64 data_vaddr, u64 data_size);
+
+/**
+ * @brief Map a file in a user range. Pages are page cache pages of file (see
+ * PageCache.hpp) and are mapped on first access, reading them in if needed.
+ * With MAP_SHARED writes go to page cache and reach file on next sync, found
+ * through dirty bit of page table entries. Without it a writable mapping is
+ * copy on write and file never sees writes. Pages past end of file can't be
+ * accessed. Region keeps it's own reference to file.
+ *
+ * @param flags Flags of pages, MAP_PRESENT and MAP_USER are added.
+ * @param file Open regular file, opened for writing if mapping is writable and shared.
+ * @param offset Page aligned offset in file where range starts.
+ * @return false if range or file can't be mapped.
+ * */
+bool AddFileRegion(AddressSpace* space, u64 vaddr, u64 size, u64 flags, File* file, u64 offset);
+
+/**
+ * @brief Check whether given user range is mapped and accessible from user mode.
+ * Pages of lazily mapped regions in range are mapped.
+ * */
+bool IsUserRangeMapped(AddressSpace* space, u64 vaddr, u64 size);
+
+// max number of pages invalidated one by one, more than this flushes whole tlb
+#define TLB_BATCH_PAGES 32
+
+/**
+ * @brief User pages whose mappings changed in an address space. Instead of
+ * invalidating every page on every cpu as soon as it's mapping changes, pages
+ * are collected here and all cpus using address space are flushed at once.
+ * */
+struct TLBBatch {
+    AddressSpace* space;
+    u64 pages[TLB_BATCH_PAGES];
+    u32 count;
+    // batch overflowed, whole tlb is flushed
+    bool flush_all;
+    // number of cpus that haven't flushed yet
+    volatile u32 pending;
+
+    TLBBatch(AddressSpace* s) : space(s), count(0), flush_all(false), pending(0) {}
+};
+
+/**
+ * @brief Add a page to batch of pages to be invalidated.
+ * */
+void QueueTLBFlush(TLBBatch* batch, u64 vaddr);
+
+/**
+ * @brief Invalidate all pages in batch on every cpu that has batch's address space
+ * loaded, and empty the batch. Remote cpus are sent a single IPI each.
+ * Must be called with interrupts enabled and no spinlocks held.
+ * */
+void FlushTLBBatch(TLBBatch* batch);
+
+/**
+ * @brief Serve a tlb flush request posted by another cpu.
+ * Called by tlb shootdown interrupt handler.
+ * */
+void HandleTLBShootdown();
+
+/**
+ * @brief Clear dirty bit of mapped user pages. Translations of pages that were
+ * dirty are queued in batch, which must be flushed before contents of those
+ * pages are used.
+ *
+ * @param num_pages At most 64.
+ * @return Bitmap of pages that were dirty, bit 0 is page at vaddr.
+ * */
+u64 CleanUserPages(AddressSpace* space, u64 vaddr, u64 num_pages, TLBBatch* batch);
+
+/**
+ * @brief Unmap user pages and drop their references, pages that are
+ * not mapped are skipped. Must be called with interrupts enabled and
+ * no spinlocks held.
+ * */
+void UnmapUserPages(AddressSpace* space, u64 vaddr, u64 num_pages);
+
+/**
+ * @brief Try to resolve a page fault on a user address (eg: write to a
+ * copy on write page, or first access to a lazily mapped page). Pages
+ * of mapped files that are not cached are read in only if interrupts
+ * were enabled.
+ *
+ * @param vaddr Faulting address (cr2).
+ * @param errorcode Error code pushed by cpu.
+ * @param interrupts_enabled Whether interrupts were enabled when fault happened.
+ * @return true if fault is resolved and faulting instruction can be retried.
+ * */
+bool HandlePageFault(u64 vaddr, u64 errorcode, bool interrupts_enabled);
+
+/**
+ * @brief Map pages of one address space into another without copying them.
+ * Both mappings become read only, and pages that were writable become
+ * copy on write on both sides. Pages already mapped at destination are replaced.
+ * MAP_SHARED pages stay writable at source and are mapped read only at destination.
+ * Must be called with interrupts enabled and no spinlocks held.
+ *
+ * @return false if a source page is not mapped or range is not in user space.
+ * */
+bool ShareUserPages(AddressSpace* dst, u64 dst_vaddr, AddressSpace* src, u64 src_vaddr, u64 num_pages);
+
+/**
+ * @brief Copy memory between user ranges of two address spaces.
+ * Destination pages that are copy on write are made private first.
+ * Must be called with interrupts enabled and no spinlocks held.
+ *
+ * @return false if any page in either range is not mapped.
+ * */
+bool CopyUserMemory(AddressSpace* dst, u64 dst_vaddr, AddressSpace* src, u64 src_vaddr, u64 size);
+
 #endif // MEMORYMANAGER_H_
@@ -0,0 +1,140 @@
+/**
+ * @file Module.cpp
+ * @author Siddharth Mishra (brightprogrammer)
+ * @date 10/18/26
+ * @brief Files loaded by bootloader along with kernel.
+ * @copyright MIT License 2022 Siddharth Mishra
+ * */
+
+#include "Module.hpp"
+#include "MemoryManager.hpp"
+#include "Thread.hpp"
+#include "Scheduler.hpp"
+#include "CPU.hpp"
+#include "Timer.hpp"
+#include "LZ4.hpp"
+#include "Printf.hpp"
+#include "String.hpp"
+
+static BootModule modules[MAX_BOOT_MODULES];
+static u64 module_count = 0;
+
+void InitializeModules(stivale2_struct* sysinfo_struct){
+    stivale2_struct_tag_modules* tag = (stivale2_struct_tag_modules*)stivale2_get_tag(sysinfo_struct, STIVALE2_STRUCT_TAG_MODULES_ID);
+    if(tag == nullptr) return;
+
+    for(u64 i = 0; i < tag->module_count; i++){
+        if(module_count == MAX_BOOT_MODULES){
+            ColorPrintf(COLOR_YELLOW, COLOR_BLACK, "[!] Only %u boot modules are supported\n", MAX_BOOT_MODULES);
+            break;
+        }
+
+        // bootloader gives higher half addresses, but be tolerant of physical ones
+        u64 begin = tag->modules[i].begin;
+        if(begin < MEM_PHYS_OFFSET){
+            begin = PhysicalToVirtualAddress(begin);
+        }
+
+        BootModule* module = &modules[module_count++];
+        module->loaded_base = begin;
+        module->loaded_size = tag->modules[i].end - tag->modules[i].begin;
+        u64 len = strlen(tag->modules[i].string);
+        if(len >= BOOT_MODULE_NAME_SIZE) len = BOOT_MODULE_NAME_SIZE - 1;
+        memcpy(module->name, tag->modules[i].string, len);
+        module->name[len] = 0;
+
+        if(IsLZ4Frame(module->loaded_base, module->loaded_size)){
+            module->state = BOOT_MODULE_COMPRESSED;
+            Printf("\tModule : %s | %lu KB (LZ4)\n", module->name, module->loaded_size / KB);
+        }else{
+            module->base = module->loaded_base;
+            module->size = module->loaded_size;
+            module->available = module->size;
+            module->state = BOOT_MODULE_READY;
+            Printf("\tModule : %s | %lu KB\n", module->name, module->size / KB);
+        }
+    }
+}
+
+// decompress module into a single allocation, module must be claimed by caller
+static void DecompressModule(BootModule* module){
+    u64 start = ReadTimestampCounter();
+    u64 base = 0;
+    u64 size = 0;
+
+    u64 bound = 0;
+    if(GetLZ4DecompressedBound(module->loaded_base, module->loaded_size, &bound) && bound){
+        u64 num_pages = (bound + PAGE_SIZE - 1) / PAGE_SIZE;
+        u64 buffer = AllocateKernelMemory(num_pages);
+        if(buffer){
+            size = DecompressLZ4(module->loaded_base, module->loaded_size, buffer, num_pages * PAGE_SIZE, &module->available);
+            if(size == ~u64(0)){
+                FreeKernelMemory(buffer, num_pages);
+                size = 0;
+            }else{
+                base = buffer;
+            }
+        }
+    }
+
+    module->decompress_ns = CyclesToNanoseconds(ReadTimestampCounter() - start);
+    module->base = base;
+    module->size = size;
+    __atomic_store_n(&module->state, BOOT_MODULE_READY, __ATOMIC_RELEASE);
+
+    if(base){
+        Printf("\tModule : %s | %lu KB -> %lu KB in %lu us\n", module->name,
+               module->loaded_size / KB, size / KB, module->decompress_ns / 1000);
+    }else{
+        ColorPrintf(COLOR_RED, COLOR_BLACK, "[-] Module %s : corrupt LZ4 image\n", module->name);
+    }
+}
+
+// take module from compressed to decompressing, false if someone else did it
+static bool ClaimModule(BootModule* module){
+    u32 expected = BOOT_MODULE_COMPRESSED;
+    return __atomic_compare_exchange_n(&module->state, &expected, BOOT_MODULE_DECOMPRESSING,
+                                       false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+static void DecompressModuleThread(void* arg){
+    BootModule* module = reinterpret_cast<BootModule*>(arg);
+    if(ClaimModule(module)){
+        DecompressModule(module);
+    }
+}
+
+void StartModuleDecompression(){
+    for(u64 i = 0; i < module_count; i++){
+        if(modules[i].state == BOOT_MODULE_COMPRESSED){
+            SpawnThread("lz4-module", DecompressModuleThread, &modules[i]);
+        }
+    }
+}
+
+bool WaitForModule(BootModule* module){
+    if(ClaimModule(module)){
+        DecompressModule(module);
+    }
+    while(__atomic_load_n(&module->state, __ATOMIC_ACQUIRE) != BOOT_MODULE_READY){
+        Yield();
+    }
+    return module->base != 0;
+}
+
+u64 GetModuleCount(){
+    return module_count;
+}
+
+BootModule* GetModule(u64 index){
+    return index < module_count ? &modules[index] : nullptr;
+}
+
+BootModule* FindModule(const char* name){
+    for(u64 i = 0; i < module_count; i++){
+        if(strcmp(modules[i].name, name) == 0){
+            return WaitForModule(&modules[i]) ? &modules[i] : nullptr;
+        }
+    }
+    return nullptr;
+}
@@ -0,0 +1,105 @@
+/**
+ * @file Module.hpp
+ * @author Siddharth Mishra (brightprogrammer)
+ * @date 10/18/26
+ * @brief Files loaded by bootloader along with kernel.
+ * @copyright MIT License 2022 Siddharth Mishra
+ * */
+
+#ifndef MODULE_HPP
+#define MODULE_HPP
+
+#include "Common.hpp"
+#include "stivale2.hpp"
+
+// max number of modules remembered
+#define MAX_BOOT_MODULES 32
+// longest module name, including null terminator
+#define BOOT_MODULE_NAME_SIZE 64
+
+// states of a module
+// contents can be used
+#define BOOT_MODULE_READY 0
+// LZ4 compressed, nobody started decompressing it yet
+#define BOOT_MODULE_COMPRESSED 1
+// being decompressed by some thread
+#define BOOT_MODULE_DECOMPRESSING 2
+
+/* ------------------ COMPRESSED MODULES --------------------
+ *
+ * Modules that start with LZ4 frame magic are decompressed by kernel.
+ * Bootloader reads fewer bytes from disk, and kernel pays for it with
+ * decompression, which runs in one thread per module as soon as scheduler
+ * is up, while rest of boot goes on.
+ *
+ * Output of a module goes to one contiguous allocation sized from frame
+ * headers, so decoder never reallocates and matches can point anywhere
+ * back in output. Compressed bytes are left where bootloader put them.
+ *
+ * Anyone looking up a module waits until it's ready. If nobody started
+ * decompressing it yet (eg: before scheduler runs), caller decompresses
+ * it itself.
+ *
+ * */
+
+/**
+ * @brief A module, as loaded by bootloader. Module memory is never freed,
+ * so it can be mapped anywhere without copying.
+ * */
+struct BootModule {
+    // direct map address of module, page aligned, 0 if decompression failed
+    // valid only after module is ready
+    u64 base;
+    u64 size;
+    // module as loaded by bootloader, same as base and size for raw modules
+    u64 loaded_base;
+    u64 loaded_size;
+    // BOOT_MODULE_*
+    volatile u32 state;
+    // bytes of output decompressed so far
+    volatile u64 available;
+    // time taken to decompress module
+    u64 decompress_ns;
+    // module string from bootloader config
+    char name[BOOT_MODULE_NAME_SIZE];
+};
+
+/**
+ * @brief Remember modules given by bootloader. Must be called after
+ * memory manager is initialized.
+ * */
+void InitializeModules(stivale2_struct* sysinfo_struct);
+
+/**
+ * @brief Start decompressing compressed modules in background threads.
+ * Must be called after scheduler is initialized.
+ * */
+void StartModuleDecompression();
+
+/**
+ * @brief Wait until given module is ready, decompressing it in
+ * current thread if nobody started doing it yet.
+ *
+ * @return true if module can be used, false if decompression failed.
+ * */
+bool WaitForModule(BootModule* module);
+
+/**
+ * @brief Get number of boot modules.
+ * */
+u64 GetModuleCount();
+
+/**
+ * @brief Get module at given index, or nullptr if there is no such module.
+ * Module may not be ready yet, see WaitForModule.
+ * */
+BootModule* GetModule(u64 index);
+
+/**
+ * @brief Find a module by it's name and wait until it's ready.
+ *
+ * @return Module or nullptr if there is no usable module with given name.
+ * */
+BootModule* FindModule(const char* name);
+
+#endif // MODULE_HPP
@@ -0,0 +1,53 @@
+/**
+ * @file Mutex.cpp
+ * @author Siddharth Mishra (brightprogrammer)
+ * @date 10/18/26
+ * @brief Sleeping lock, for code that waits for io while holding it.
+ * @copyright MIT License 2022 Siddharth Mishra
+ * */
+
+#include "Mutex.hpp"
+#include "Thread.hpp"
+#include "Scheduler.hpp"
+#include "CPU.hpp"
+
+void Mutex::Lock(){
+    if(TryLock()) return;
+
+    Thread* self = GetCurrentThread();
+    // interrupts stay disabled from queueing until we are switched away,
+    // so we can't be preempted while marked blocked
+    u64 flags = SaveFlagsAndDisableInterrupts();
+    wait_lock.Lock();
+    if(TryLock()){
+        wait_lock.Unlock();
+        RestoreFlags(flags);
+        return;
+    }
+
+    self->wait_next = nullptr;
+    if(waiters_tail) waiters_tail->wait_next = self;
+    else waiters_head = self;
+    waiters_tail = self;
+    __atomic_store_n(&self->state, ThreadState::Blocked, __ATOMIC_RELEASE);
+    wait_lock.Unlock();
+
+    // Unlock hands lock over to us before waking us
+    Schedule();
+    RestoreFlags(flags);
+}
+
+void Mutex::Unlock(){
+    wait_lock.Lock();
+    Thread* next = waiters_head;
+    if(next){
+        waiters_head = next->wait_next;
+        if(waiters_head == nullptr) waiters_tail = nullptr;
+    }else{
+        __atomic_store_n(&locked, 0, __ATOMIC_RELEASE);
+    }
+    wait_lock.Unlock();
+
+    // lock stays taken, it now belongs to next
+    if(next) WakeThread(next);
+}
@@ -0,0 +1,44 @@
+/**
+ * @file Mutex.hpp
+ * @author Siddharth Mishra (brightprogrammer)
+ * @date 10/18/26
+ * @brief Sleeping lock, for code that waits for io while holding it.
+ * @copyright MIT License 2022 Siddharth Mishra
+ * */
+
+#ifndef MUTEX_HPP
+#define MUTEX_HPP
+
+#include "Common.hpp"
+#include "Spinlock.hpp"
+
+struct Thread;
+
+/**
+ * @brief A lock whose waiters sleep instead of spinning. Unlike spinlocks
+ * it doesn't disable interrupts, so holder may block, eg: for io.
+ * Ownership is handed straight to first waiter on unlock, so waiters
+ * get it in FIFO order. Can be used with LockGuard.
+ * */
+struct Mutex {
+    volatile u32 locked;
+    // threads waiting for lock, linked through wait_next
+    Thread* waiters_head;
+    Thread* waiters_tail;
+    TicketLock<false> wait_lock;
+
+    constexpr Mutex(const char* name)
+        : locked(0), waiters_head(nullptr), waiters_tail(nullptr), wait_lock(name) {}
+
+    void Lock();
+    void Unlock();
+
+    // try to take lock without waiting
+    // returns true if lock is acquired
+    bool TryLock(){
+        u32 expected = 0;
+        return __atomic_compare_exchange_n(&locked, &expected, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+    }
+};
+
+#endif // MUTEX_HPP
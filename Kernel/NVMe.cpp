@@ -0,0 +1,899 @@
+/**
+ * @file NVMe.cpp
+ * @author Siddharth Mishra (brightprogrammer)
+ * @date 10/18/26
+ * @brief NVMe driver with one submission/completion queue pair per cpu.
+ * @copyright MIT License 2022 Siddharth Mishra
+ * */
+
+#include "NVMe.hpp"
+#include "Block.hpp"
+#include "PCI.hpp"
+#include "MSI.hpp"
+#include "SMP.hpp"
+#include "CPU.hpp"
+#include "Slab.hpp"
+#include "Thread.hpp"
+#include "Scheduler.hpp"
+#include "MemoryManager.hpp"
+#include "Timer.hpp"
+#include "Printf.hpp"
+#include "String.hpp"
+
+#include <new>
+
+// mass storage, non volatile memory, NVM express
+#define NVME_PCI_CLASS 0x010802
+
+// controller registers
+#define NVME_REG_CAP 0x00
+#define NVME_REG_VS 0x08
+#define NVME_REG_CC 0x14
+#define NVME_REG_CSTS 0x1c
+#define NVME_REG_AQA 0x24
+#define NVME_REG_ASQ 0x28
+#define NVME_REG_ACQ 0x30
+#define NVME_REG_DOORBELLS 0x1000
+
+// fields of CAP
+#define NVME_CAP_MQES(cap) ((cap) & 0xffff)
+#define NVME_CAP_TIMEOUT(cap) (((cap) >> 24) & 0xff)
+#define NVME_CAP_DSTRD(cap) (((cap) >> 32) & 0xf)
+#define NVME_CAP_CSS_NVM (u64(1) << 37)
+#define NVME_CAP_MPSMIN(cap) (((cap) >> 48) & 0xf)
+
+// fields of CC
+#define NVME_CC_ENABLE (1 << 0)
+#define NVME_CC_IOSQES (6 << 16)
+#define NVME_CC_IOCQES (4 << 20)
+
+// fields of CSTS
+#define NVME_CSTS_READY (1 << 0)
+#define NVME_CSTS_FATAL (1 << 1)
+
+// admin commands
+#define NVME_ADMIN_CREATE_SQ 0x01
+#define NVME_ADMIN_CREATE_CQ 0x05
+#define NVME_ADMIN_IDENTIFY 0x06
+#define NVME_ADMIN_SET_FEATURES 0x09
+
+#define NVME_IDENTIFY_NAMESPACE 0
+#define NVME_IDENTIFY_CONTROLLER 1
+#define NVME_FEATURE_NUMBER_OF_QUEUES 0x07
+
+// queue creation flags
+#define NVME_QUEUE_CONTIGUOUS (1 << 0)
+#define NVME_CQ_INTERRUPTS (1 << 1)
+
+// io commands
+#define NVME_CMD_FLUSH 0x00
+#define NVME_CMD_WRITE 0x01
+#define NVME_CMD_READ 0x02
+
+// completion status, after phase bit is shifted out
+#define NVME_STATUS_INVALID_OPCODE 0x01
+
+#define NVME_ADMIN_QUEUE_DEPTH 32
+// how long an admin command may take
+#define NVME_ADMIN_TIMEOUT_NS 2000000000
+// entries in a single PRP list page
+#define NVME_PRP_LIST_ENTRIES (4096 / 8)
+
+struct NVMeCommand {
+    u8 opcode;
+    u8 flags;
+    u16 command_id;
+    u32 nsid;
+    u64 reserved;
+    u64 metadata;
+    u64 prp1;
+    u64 prp2;
+    u32 cdw10;
+    u32 cdw11;
+    u32 cdw12;
+    u32 cdw13;
+    u32 cdw14;
+    u32 cdw15;
+};
+
+struct NVMeCompletion {
+    u32 result;
+    u32 reserved;
+    u16 sq_head;
+    u16 sq_id;
+    u16 command_id;
+    // bit 0 is phase, flips every time controller wraps around queue
+    u16 status;
+};
+
+static_assert(sizeof(NVMeCommand) == 64, "NVMe commands are 64 bytes");
+static_assert(sizeof(NVMeCompletion) == 16, "NVMe completions are 16 bytes");
+
+struct NVMeController;
+
+struct NVMeQueue {
+    u16 id;
+    // number of entries in submission queue
+    u16 depth;
+    NVMeCommand* sq;
+    volatile NVMeCompletion* cq;
+    volatile u32* sq_doorbell;
+    volatile u32* cq_doorbell;
+    u16 sq_tail;
+    u16 cq_head;
+    u16 phase;
+    NVMeController* controller;
+
+    // free command ids, one less than depth so queue never overflows
+    u16 free_ids[NVME_MAX_QUEUE_DEPTH];
+    u16 free_count;
+    BlockRequest* requests[NVME_MAX_QUEUE_DEPTH];
+    // one PRP list page per command id
+    u64* prp_lists[NVME_MAX_QUEUE_DEPTH];
+
+    TicketLock<false> lock;
+
+    NVMeQueue() : lock("nvme.queue") {}
+};
+
+struct NVMeController {
+    PCIDevice* pci;
+    u64 registers;
+    u64 cap;
+    u32 doorbell_stride;
+    u32 index;
+    // largest transfer in bytes, from MDTS and size of a PRP list
+    u64 max_transfer;
+    NVMeQueue* admin;
+    NVMeQueue* queues[NVME_MAX_QUEUES];
+    u32 queue_count;
+    bool polling_only;
+    PCIInterrupts irq;
+};
+
+struct NVMeNamespace {
+    BlockDevice block;
+    NVMeController* controller;
+    u32 nsid;
+    // log2 of size of a logical block
+    u32 lba_shift;
+};
+
+static SlabCache nvme_controller_cache("nvme.controller", sizeof(NVMeController));
+static SlabCache nvme_queue_cache("nvme.queue", sizeof(NVMeQueue));
+static SlabCache nvme_namespace_cache("nvme.namespace", sizeof(NVMeNamespace));
+
+static u32 nvme_queue_depth = NVME_DEFAULT_QUEUE_DEPTH;
+static u32 nvme_controller_count = 0;
+// namespaces registered so far, first one is benchmarked
+static NVMeNamespace* nvme_namespaces[NVME_MAX_NAMESPACES];
+static u32 nvme_namespace_count = 0;
+
+static inline u32 ReadNVMe32(NVMeController* controller, u32 reg){
+    return *reinterpret_cast<volatile u32*>(controller->registers + reg);
+}
+
+static inline void WriteNVMe32(NVMeController* controller, u32 reg, u32 value){
+    *reinterpret_cast<volatile u32*>(controller->registers + reg) = value;
+}
+
+static inline u64 ReadNVMe64(NVMeController* controller, u32 reg){
+    return ReadNVMe32(controller, reg) | (u64(ReadNVMe32(controller, reg + 4)) << 32);
+}
+
+static inline void WriteNVMe64(NVMeController* controller, u32 reg, u64 value){
+    WriteNVMe32(controller, reg, u32(value));
+    WriteNVMe32(controller, reg + 4, u32(value >> 32));
+}
+
+// wait until ready bit of CSTS is what we want, or controller times out
+static bool WaitForNVMeReady(NVMeController* controller, bool ready){
+    // CAP.TO is in 500 ms units
+    u64 timeout = (NVME_CAP_TIMEOUT(controller->cap) + 1) * u64(500000000);
+    u64 start = ReadTimestampCounter();
+    while(true){
+        u32 status = ReadNVMe32(controller, NVME_REG_CSTS);
+        if(status & NVME_CSTS_FATAL) return false;
+        if(bool(status & NVME_CSTS_READY) == ready) return true;
+        if(CyclesToNanoseconds(ReadTimestampCounter() - start) > timeout) return false;
+        CPUPause();
+    }
+}
+
+static NVMeQueue* CreateNVMeQueue(NVMeController* controller, u16 id, u16 depth){
+    NVMeQueue* queue = new (SlabAllocate(&nvme_queue_cache)) NVMeQueue();
+    u64 sq = AllocatePage();
+    u64 cq = AllocatePage();
+    memset(reinterpret_cast<void*>(sq), 0, PAGE_SIZE);
+    memset(reinterpret_cast<void*>(cq), 0, PAGE_SIZE);
+
+    u64 stride = u64(4) << controller->doorbell_stride;
+    queue->id = id;
+    queue->depth = depth;
+    queue->sq = reinterpret_cast<NVMeCommand*>(sq);
+    queue->cq = reinterpret_cast<volatile NVMeCompletion*>(cq);
+    queue->sq_doorbell = reinterpret_cast<volatile u32*>(controller->registers + NVME_REG_DOORBELLS + (2 * id) * stride);
+    queue->cq_doorbell = reinterpret_cast<volatile u32*>(controller->registers + NVME_REG_DOORBELLS + (2 * id + 1) * stride);
+    queue->sq_tail = 0;
+    queue->cq_head = 0;
+    queue->phase = 1;
+    queue->controller = controller;
+
+    // admin queue runs one command at a time and needs no PRP lists
+    queue->free_count = 0;
+    for(u16 i = 0; i < depth - 1; i++){
+        queue->free_ids[queue->free_count++] = depth - 2 - i;
+        queue->requests[i] = nullptr;
+        queue->prp_lists[i] = id ? reinterpret_cast<u64*>(AllocatePage()) : nullptr;
+    }
+    return queue;
+}
+
+// take next new completion off a queue, returns false if there is none
+static bool NextNVMeCompletion(NVMeQueue* queue, u16* id, u16* status, u32* result){
+    volatile NVMeCompletion* completion = &queue->cq[queue->cq_head];
+    u16 entry_status = completion->status;
+    if((entry_status & 1) != queue->phase) return false;
+    // rest of entry is only valid once phase says so
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    *id = completion->command_id;
+    *status = entry_status >> 1;
+    *result = completion->result;
+    if(++queue->cq_head == queue->depth){
+        queue->cq_head = 0;
+        queue->phase ^= 1;
+    }
+    return true;
+}
+
+// run an admin command and wait for it, returns status and result through result
+static u16 RunNVMeAdminCommand(NVMeController* controller, NVMeCommand* command, u32* result = nullptr){
+    NVMeQueue* queue = controller->admin;
+    LockGuard guard(queue->lock);
+
+    NVMeCommand* slot = &queue->sq[queue->sq_tail];
+    memcpy(slot, command, sizeof(NVMeCommand));
+    slot->command_id = queue->sq_tail;
+    queue->sq_tail = (queue->sq_tail + 1) % queue->depth;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    *queue->sq_doorbell = queue->sq_tail;
+
+    u64 start = ReadTimestampCounter();
+    u16 id, status;
+    u32 command_result;
+    while(!NextNVMeCompletion(queue, &id, &status, &command_result)){
+        if(CyclesToNanoseconds(ReadTimestampCounter() - start) > NVME_ADMIN_TIMEOUT_NS) return 0xffff;
+        CPUPause();
+    }
+    *queue->cq_doorbell = queue->cq_head;
+
+    if(result) *result = command_result;
+    return status;
+}
+
+static void InitializeNVMeCommand(NVMeCommand* command, u8 opcode){
+    memset(command, 0, sizeof(NVMeCommand));
+    command->opcode = opcode;
+}
+
+static bool IdentifyNVMe(NVMeController* controller, u32 cns, u32 nsid, u64 page){
+    NVMeCommand command;
+    InitializeNVMeCommand(&command, NVME_ADMIN_IDENTIFY);
+    command.nsid = nsid;
+    command.prp1 = VirtualToPhysicalAddress(page);
+    command.cdw10 = cns;
+    return RunNVMeAdminCommand(controller, &command) == 0;
+}
+
+static bool CreateNVMeIOQueue(NVMeController* controller, NVMeQueue* queue, u16 vector){
+    NVMeCommand command;
+    InitializeNVMeCommand(&command, NVME_ADMIN_CREATE_CQ);
+    command.prp1 = VirtualToPhysicalAddress(reinterpret_cast<u64>(queue->cq));
+    command.cdw10 = (u32(queue->depth - 1) << 16) | queue->id;
+    command.cdw11 = (u32(vector) << 16) | NVME_QUEUE_CONTIGUOUS | (controller->polling_only ? 0 : NVME_CQ_INTERRUPTS);
+    if(RunNVMeAdminCommand(controller, &command) != 0) return false;
+
+    InitializeNVMeCommand(&command, NVME_ADMIN_CREATE_SQ);
+    command.prp1 = VirtualToPhysicalAddress(reinterpret_cast<u64>(queue->sq));
+    command.cdw10 = (u32(queue->depth - 1) << 16) | queue->id;
+    command.cdw11 = (u32(queue->id) << 16) | NVME_QUEUE_CONTIGUOUS;
+    return RunNVMeAdminCommand(controller, &command) == 0;
+}
+
+/******************** IO Queues ********************/
+
+static inline NVMeNamespace* GetNVMeNamespace(BlockDevice* device){
+    return reinterpret_cast<NVMeNamespace*>(device->driver_data);
+}
+
+// collect completed requests of a queue and ring head doorbell once, caller holds queue lock
+static BlockRequest* ReapNVMeRequests(NVMeQueue* queue, u64* count){
+    BlockRequest* done = nullptr;
+    u16 id, status;
+    u32 result;
+    u64 reaped = 0;
+    while(NextNVMeCompletion(queue, &id, &status, &result)){
+        reaped++;
+        if(id >= queue->depth - 1 || queue->requests[id] == nullptr) continue;
+        BlockRequest* request = queue->requests[id];
+        queue->requests[id] = nullptr;
+        queue->free_ids[queue->free_count++] = id;
+
+        // request status is only written by CompleteBlockRequest
+        if(status == 0){
+            request->driver_tag = BLOCK_STATUS_OK;
+        }else if(status == NVME_STATUS_INVALID_OPCODE){
+            request->driver_tag = BLOCK_STATUS_UNSUPPORTED;
+        }else{
+            request->driver_tag = BLOCK_STATUS_ERROR;
+        }
+        request->next = done;
+        done = request;
+    }
+    if(reaped){
+        *queue->cq_doorbell = queue->cq_head;
+    }
+    *count += reaped;
+    return done;
+}
+
+// complete requests outside queue lock, completion may wake threads
+static void CompleteNVMeRequests(BlockRequest* done){
+    while(done){
+        BlockRequest* request = done;
+        done = done->next;
+        CompleteBlockRequest(request, u32(request->driver_tag));
+    }
+}
+
+static u64 PollNVMeQueue(NVMeQueue* queue){
+    u64 count = 0;
+    BlockRequest* done;
+    {
+        LockGuard guard(queue->lock);
+        done = ReapNVMeRequests(queue, &count);
+    }
+    CompleteNVMeRequests(done);
+    return count;
+}
+
+static u64 NVMePoll(BlockDevice* device, u32 index){
+    return PollNVMeQueue(GetNVMeNamespace(device)->controller->queues[index]);
+}
+
+static void NVMeInterrupt(void* arg){
+    PollNVMeQueue(reinterpret_cast<NVMeQueue*>(arg));
+}
+
+static void NVMeSetPolling(BlockDevice* device, bool polling){
+    NVMeController* controller = GetNVMeNamespace(device)->controller;
+    if(controller->polling_only) return;
+    for(u32 i = 0; i < controller->queue_count; i++){
+        if(polling){
+            MaskPCIInterrupt(&controller->irq, i);
+        }else{
+            UnmaskPCIInterrupt(&controller->irq, i);
+            // nothing interrupts for what completed while vector was masked
+            PollNVMeQueue(controller->queues[i]);
+        }
+    }
+}
+
+// describe buffers of a request and of requests merged behind it with PRPs,
+// returns false if they can't be described
+static bool BuildNVMePRPs(NVMeQueue* queue, u16 id, BlockRequest* request, NVMeCommand* command){
+    // PRP entries other than first must be page aligned, first one dword aligned,
+    // request queue only merges buffers that meet at page boundaries
+    if(request->buffer & 3) return false;
+
+    command->prp1 = KernelVirtualToPhysical(request->buffer);
+    command->prp2 = 0;
+    u64 first = PAGE_SIZE - (request->buffer & (PAGE_SIZE - 1));
+    if(request->total_size <= first) return true;
+
+    // every page after first one goes in list, PRP2 points at list unless
+    // there is a single such page
+    u64* list = queue->prp_lists[id];
+    u64 count = 0;
+    for(BlockRequest* segment = request; segment; segment = segment->merged){
+        u64 buffer = segment->buffer;
+        u64 size = segment->size;
+        if(segment == request){
+            buffer += first;
+            size = size > first ? size - first : 0;
+        }
+        while(size){
+            if(count == NVME_PRP_LIST_ENTRIES) return false;
+            list[count++] = KernelVirtualToPhysical(buffer);
+            buffer += PAGE_SIZE;
+            size = size > PAGE_SIZE ? size - PAGE_SIZE : 0;
+        }
+    }
+    command->prp2 = count == 1 ? list[0] : VirtualToPhysicalAddress(reinterpret_cast<u64>(list));
+    return true;
+}
+
+static bool NVMeSubmit(BlockDevice* device, BlockRequest* requests){
+    NVMeNamespace* ns = GetNVMeNamespace(device);
+    NVMeController* controller = ns->controller;
+    u32 index = GetCurrentCPU()->id % controller->queue_count;
+    NVMeQueue* queue = controller->queues[index];
+    u64 lba_sectors = u64(1) << (ns->lba_shift - 9);
+
+    while(requests){
+        BlockRequest* failed = nullptr;
+        bool queue_full = false;
+        {
+            LockGuard guard(queue->lock);
+            u16 tail = queue->sq_tail;
+            // whole batch goes in with a single doorbell write
+            while(requests){
+                BlockRequest* request = requests;
+                if(queue->free_count == 0){
+                    queue_full = true;
+                    break;
+                }
+                requests = requests->next;
+                request->queue = index;
+
+                u16 id = queue->free_ids[queue->free_count - 1];
+                NVMeCommand* command = &queue->sq[tail];
+                memset(command, 0, sizeof(NVMeCommand));
+                command->command_id = id;
+                command->nsid = ns->nsid;
+
+                bool ok = true;
+                if(request->op == BLOCK_OP_FLUSH){
+                    command->opcode = NVME_CMD_FLUSH;
+                }else{
+                    u64 lba = request->sector / lba_sectors;
+                    u64 blocks = request->total_size >> ns->lba_shift;
+                    command->opcode = request->op == BLOCK_OP_READ ? NVME_CMD_READ : NVME_CMD_WRITE;
+                    command->cdw10 = u32(lba);
+                    command->cdw11 = u32(lba >> 32);
+                    command->cdw12 = u32(blocks - 1);
+                    // block layer works in sectors, namespace in logical blocks
+                    ok = request->sector % lba_sectors == 0 && (request->total_size & ((u64(1) << ns->lba_shift) - 1)) == 0;
+                    ok = ok && BuildNVMePRPs(queue, id, request, command);
+                }
+                if(!ok){
+                    request->driver_tag = BLOCK_STATUS_ERROR;
+                    request->next = failed;
+                    failed = request;
+                    continue;
+                }
+
+                queue->free_count--;
+                queue->requests[id] = request;
+                tail = (tail + 1) % queue->depth;
+            }
+
+            if(tail != queue->sq_tail){
+                queue->sq_tail = tail;
+                __atomic_thread_fence(__ATOMIC_RELEASE);
+                *queue->sq_doorbell = tail;
+            }
+        }
+
+        CompleteNVMeRequests(failed);
+        if(queue_full){
+            // make room by completing whatever controller is done with
+            if(PollNVMeQueue(queue) == 0) CPUPause();
+        }
+    }
+    return true;
+}
+
+/******************** Probe ********************/
+
+static void RegisterNVMeNamespace(NVMeController* controller, u32 nsid, u64 identify){
+    u8* data = reinterpret_cast<u8*>(identify);
+    u64 size = *reinterpret_cast<u64*>(data);
+    if(size == 0) return;
+
+    // formatted LBA size picks one of the LBA formats at byte 128
+    u32 format = data[26] & 0xf;
+    u32 lba_shift = (*reinterpret_cast<u32*>(data + 128 + 4 * format) >> 16) & 0xff;
+    if(lba_shift < 9 || lba_shift > 12) return;
+
+    if(nvme_namespace_count == NVME_MAX_NAMESPACES) return;
+    NVMeNamespace* ns = new (SlabAllocate(&nvme_namespace_cache)) NVMeNamespace();
+    ns->controller = controller;
+    ns->nsid = nsid;
+    ns->lba_shift = lba_shift;
+
+    BlockDevice* block = &ns->block;
+    sprintf(block->name, "nvme%un%u", controller->index, nsid);
+    block->sector_count = size << (lba_shift - 9);
+    block->block_size = u64(1) << lba_shift;
+    block->read_only = false;
+    block->max_transfer = controller->max_transfer;
+    // a merged request is limited by size of PRP list alone
+    block->max_segments = u32(controller->max_transfer / PAGE_SIZE);
+    block->queue_count = controller->queue_count;
+    block->polling = controller->polling_only;
+    block->polling_only = controller->polling_only;
+    block->ops.submit = NVMeSubmit;
+    block->ops.poll = NVMePoll;
+    block->ops.set_polling = NVMeSetPolling;
+    block->driver_data = ns;
+
+    if(RegisterBlockDevice(block)){
+        nvme_namespaces[nvme_namespace_count++] = ns;
+    }
+}
+
+static bool ProbeNVMe(PCIDevice* pci, const PCIDeviceID*){
+    NVMeController* controller = new (SlabAllocate(&nvme_controller_cache)) NVMeController();
+    controller->pci = pci;
+    controller->index = nvme_controller_count;
+    controller->irq.type = PCI_INTERRUPT_NONE;
+
+    EnablePCIDevice(pci);
+    controller->registers = MapPCIBar(pci, 0);
+    if(controller->registers == 0) return false;
+
+    controller->cap = ReadNVMe64(controller, NVME_REG_CAP);
+    controller->doorbell_stride = NVME_CAP_DSTRD(controller->cap);
+    // we only speak NVM command set, with 4 KB pages
+    if(!(controller->cap & NVME_CAP_CSS_NVM) || NVME_CAP_MPSMIN(controller->cap) != 0) return false;
+
+    // reset
+    WriteNVMe32(controller, NVME_REG_CC, 0);
+    if(!WaitForNVMeReady(controller, false)) return false;
+
+    u32 max_depth = NVME_CAP_MQES(controller->cap) + 1;
+    u16 admin_depth = max_depth < NVME_ADMIN_QUEUE_DEPTH ? max_depth : NVME_ADMIN_QUEUE_DEPTH;
+    controller->admin = CreateNVMeQueue(controller, 0, admin_depth);
+    WriteNVMe32(controller, NVME_REG_AQA, (u32(admin_depth - 1) << 16) | (admin_depth - 1));
+    WriteNVMe64(controller, NVME_REG_ASQ, VirtualToPhysicalAddress(reinterpret_cast<u64>(controller->admin->sq)));
+    WriteNVMe64(controller, NVME_REG_ACQ, VirtualToPhysicalAddress(reinterpret_cast<u64>(controller->admin->cq)));
+    WriteNVMe32(controller, NVME_REG_CC, NVME_CC_ENABLE | NVME_CC_IOSQES | NVME_CC_IOCQES);
+    if(!WaitForNVMeReady(controller, true)) return false;
+
+    u64 identify = AllocatePage();
+    memset(reinterpret_cast<void*>(identify), 0, PAGE_SIZE);
+    if(!IdentifyNVMe(controller, NVME_IDENTIFY_CONTROLLER, 0, identify)){
+        FreePage(identify);
+        return false;
+    }
+    u8 mdts = reinterpret_cast<u8*>(identify)[77];
+    u32 namespaces = *reinterpret_cast<u32*>(identify + 516);
+
+    // a PRP list page covers this many pages, plus first one in PRP1
+    controller->max_transfer = u64(NVME_PRP_LIST_ENTRIES) * PAGE_SIZE;
+    if(mdts && (u64(PAGE_SIZE) << mdts) < controller->max_transfer){
+        controller->max_transfer = u64(PAGE_SIZE) << mdts;
+    }
+    // an unaligned buffer needs one page more than an aligned one
+    controller->max_transfer -= PAGE_SIZE;
+
+    u32 queues = GetCPUCount();
+    if(queues > NVME_MAX_QUEUES) queues = NVME_MAX_QUEUES;
+
+    // ask for one queue pair per cpu, controller says how many it can give
+    NVMeCommand command;
+    InitializeNVMeCommand(&command, NVME_ADMIN_SET_FEATURES);
+    command.cdw10 = NVME_FEATURE_NUMBER_OF_QUEUES;
+    command.cdw11 = ((queues - 1) << 16) | (queues - 1);
+    u32 result = 0;
+    if(RunNVMeAdminCommand(controller, &command, &result) != 0){
+        FreePage(identify);
+        return false;
+    }
+    u32 sq_count = (result & 0xffff) + 1;
+    u32 cq_count = (result >> 16) + 1;
+    if(queues > sq_count) queues = sq_count;
+    if(queues > cq_count) queues = cq_count;
+
+    u32 vectors = EnablePCIInterrupts(&controller->irq, pci, queues);
+    controller->polling_only = vectors == 0;
+    if(controller->polling_only){
+        DisablePCIInterrupts(&controller->irq);
+    }else if(vectors < queues){
+        queues = vectors;
+    }
+
+    u32 depth = nvme_queue_depth;
+    if(depth > max_depth) depth = max_depth;
+    for(u32 i = 0; i < queues; i++){
+        NVMeQueue* queue = CreateNVMeQueue(controller, i + 1, depth);
+        if(!CreateNVMeIOQueue(controller, queue, controller->polling_only ? 0 : i)){
+            FreePage(identify);
+            return false;
+        }
+        controller->queues[i] = queue;
+    }
+    controller->queue_count = queues;
+
+    if(!controller->polling_only){
+        for(u32 i = 0; i < queues; i++){
+            SetPCIInterruptHandler(&controller->irq, i, NVMeInterrupt, controller->queues[i], i);
+        }
+    }
+
+    if(namespaces > NVME_MAX_NAMESPACES) namespaces = NVME_MAX_NAMESPACES;
+    for(u32 nsid = 1; nsid <= namespaces; nsid++){
+        memset(reinterpret_cast<void*>(identify), 0, PAGE_SIZE);
+        if(IdentifyNVMe(controller, NVME_IDENTIFY_NAMESPACE, nsid, identify)){
+            RegisterNVMeNamespace(controller, nsid, identify);
+        }
+    }
+    FreePage(identify);
+
+    pci->driver_data = controller;
+    nvme_controller_count++;
+    return true;
+}
+
+static const PCIDeviceID nvme_ids[] = {
+    {PCI_ANY_ID, PCI_ANY_ID, NVME_PCI_CLASS, 0xffffff}
+};
+
+static PCIDriver nvme_driver = {
+    "nvme",
+    nvme_ids,
+    sizeof(nvme_ids) / sizeof(nvme_ids[0]),
+    ProbeNVMe,
+    nullptr
+};
+
+void InitializeNVMe(u32 queue_depth){
+    if(queue_depth < NVME_MIN_QUEUE_DEPTH) queue_depth = NVME_MIN_QUEUE_DEPTH;
+    if(queue_depth > NVME_MAX_QUEUE_DEPTH) queue_depth = NVME_MAX_QUEUE_DEPTH;
+    nvme_queue_depth = queue_depth;
+    RegisterPCIDriver(&nvme_driver);
+}
+
+/******************** NVMe Benchmark ********************/
+
+#define BENCH_NVME_REQUESTS 8192
+#define BENCH_NVME_THREAD_DEPTH 16
+#define BENCH_NVME_MAX_THREADS NVME_MAX_QUEUES
+
+struct NVMeJobSlot {
+    BlockRequest request;
+    u64 submitted;
+    u64 completed;
+    volatile bool finished;
+    bool in_flight;
+};
+
+struct NVMeJob {
+    BlockDevice* device;
+    u32 op;
+    bool random;
+    u64 block_size;
+    u32 depth;
+    u64 requests;
+    u64 seed;
+    // completion latency of every request, in cycles
+    u64* latencies;
+    u64 errors;
+    volatile bool done;
+};
+
+// stamp completion time, waiter only looks at it once finished is set
+static void NVMeJobComplete(BlockRequest* request){
+    NVMeJobSlot* slot = reinterpret_cast<NVMeJobSlot*>(request->private_data);
+    slot->completed = ReadTimestampCounter();
+    __atomic_store_n(&slot->finished, true, __ATOMIC_RELEASE);
+}
+
+static void PrepareNVMeJobSlot(NVMeJob* job, NVMeJobSlot* slot, u64 buffer, u64* next, u64* random){
+    u64 blocks = job->device->sector_count * BLOCK_SECTOR_SIZE / job->block_size;
+    u64 block;
+    if(job->random){
+        *random ^= *random << 13;
+        *random ^= *random >> 7;
+        *random ^= *random << 17;
+        block = *random % blocks;
+    }else{
+        block = *next;
+        *next = (*next + 1) % blocks;
+    }
+    InitializeBlockRequest(&slot->request, job->op, block * (job->block_size / BLOCK_SECTOR_SIZE), buffer, job->block_size);
+    slot->request.complete = NVMeJobComplete;
+    slot->request.private_data = slot;
+    slot->finished = false;
+    slot->in_flight = true;
+    slot->submitted = ReadTimestampCounter();
+}
+
+// keep depth requests in flight until job->requests complete,
+// refilling every slot that completed with a single submission
+static void RunNVMeJob(NVMeJob* job){
+    u64 slot_pages = (job->depth * sizeof(NVMeJobSlot) + PAGE_SIZE - 1) / PAGE_SIZE;
+    u64 buffer_pages = job->depth * job->block_size / PAGE_SIZE;
+    NVMeJobSlot* slots = reinterpret_cast<NVMeJobSlot*>(AllocateKernelMemory(slot_pages));
+    u64 buffer = AllocateKernelMemory(buffer_pages);
+    memset(reinterpret_cast<void*>(buffer), 0x5a, buffer_pages * PAGE_SIZE);
+
+    u64 next = job->seed % (job->device->sector_count * BLOCK_SECTOR_SIZE / job->block_size);
+    u64 random = job->seed | 1;
+    u64 submitted = 0;
+    u64 completed = 0;
+    u32 head = 0;
+
+    BlockRequest* batch = nullptr;
+    for(u32 i = job->depth; i-- > 0;){
+        slots[i].in_flight = false;
+        if(i >= job->requests) continue;
+        PrepareNVMeJobSlot(job, &slots[i], buffer + i * job->block_size, &next, &random);
+        slots[i].request.next = batch;
+        batch = &slots[i].request;
+        submitted++;
+    }
+    SubmitBlockRequests(job->device, batch);
+
+    while(completed < job->requests){
+        BlockRequest** tail = &batch;
+        batch = nullptr;
+
+        // oldest request is waited for, everything after it that is already done is taken too
+        for(u32 taken = 0; taken < job->depth && slots[head].in_flight; taken++){
+            NVMeJobSlot* slot = &slots[head];
+            if(taken == 0){
+                WaitForBlockRequest(job->device, &slot->request);
+                while(!__atomic_load_n(&slot->finished, __ATOMIC_ACQUIRE)) CPUPause();
+            }else if(!__atomic_load_n(&slot->finished, __ATOMIC_ACQUIRE)){
+                break;
+            }
+
+            if(slot->request.status != BLOCK_STATUS_OK) job->errors++;
+            job->latencies[completed++] = slot->completed - slot->submitted;
+            slot->in_flight = false;
+
+            if(submitted < job->requests){
+                PrepareNVMeJobSlot(job, slot, buffer + head * job->block_size, &next, &random);
+                *tail = &slot->request;
+                tail = &slot->request.next;
+                submitted++;
+            }
+            head = (head + 1) % job->depth;
+        }
+
+        if(batch){
+            SubmitBlockRequests(job->device, batch);
+        }
+    }
+
+    FreeKernelMemory(buffer, buffer_pages);
+    FreeKernelMemory(reinterpret_cast<u64>(slots), slot_pages);
+}
+
+static void NVMeJobThread(void* arg){
+    NVMeJob* job = reinterpret_cast<NVMeJob*>(arg);
+    RunNVMeJob(job);
+    __atomic_store_n(&job->done, true, __ATOMIC_RELEASE);
+}
+
+static void SortLatencies(u64* values, u64 count){
+    // shell sort, gaps from Ciura's sequence extended by 2.25
+    static const u64 gaps[] = {7983, 3548, 1577, 701, 301, 132, 57, 23, 10, 4, 1};
+    for(u64 g = 0; g < sizeof(gaps) / sizeof(gaps[0]); g++){
+        u64 gap = gaps[g];
+        for(u64 i = gap; i < count; i++){
+            u64 value = values[i];
+            u64 j = i;
+            while(j >= gap && values[j - gap] > value){
+                values[j] = values[j - gap];
+                j -= gap;
+            }
+            values[j] = value;
+        }
+    }
+}
+
+static void ShowNVMeJob(const char* name, u64 block_size, u32 depth, u64 requests, u64 ns, u64* latencies, u64 errors){
+    if(ns == 0) ns = 1;
+    SortLatencies(latencies, requests);
+    u64 total = 0;
+    for(u64 i = 0; i < requests; i++) total += latencies[i];
+
+    Printf("\t%s | %lu KB | depth %u : %lu IOPS | %lu MB/s%s\n", name, block_size / KB, depth,
+           requests * 1000000000 / ns, requests * block_size * 1000 / ns, errors ? " | errors" : "");
+    Printf("\t\tclat ns : min %lu | avg %lu | p50 %lu | p99 %lu | max %lu\n",
+           CyclesToNanoseconds(latencies[0]), CyclesToNanoseconds(total / requests),
+           CyclesToNanoseconds(latencies[requests / 2]), CyclesToNanoseconds(latencies[requests * 99 / 100]),
+           CyclesToNanoseconds(latencies[requests - 1]));
+}
+
+struct NVMeJobDescription {
+    const char* name;
+    u32 op;
+    bool random;
+    u64 block_size;
+    u32 depth;
+    bool polled;
+};
+
+void BenchmarkNVMe(){
+    ColorPrintf(COLOR_YELLOW, COLOR_BLACK, "[+] Benchmark : NVMe\n");
+
+    if(nvme_namespace_count == 0){
+        Printf("\tNo NVMe namespaces\n");
+        return;
+    }
+    NVMeNamespace* ns = nvme_namespaces[0];
+    BlockDevice* device = &ns->block;
+    Printf("\tNamespace : %s | %lu MB | %u queues | queue depth %u\n", device->name,
+           device->sector_count * BLOCK_SECTOR_SIZE / MB, device->queue_count,
+           ns->controller->queues[0]->depth);
+
+    static const NVMeJobDescription jobs[] = {
+        {"randread", BLOCK_OP_READ, true, 4096, 1, false},
+        {"randread (polled)", BLOCK_OP_READ, true, 4096, 1, true},
+        {"randread", BLOCK_OP_READ, true, 4096, 16, false},
+        {"randread", BLOCK_OP_READ, true, 4096, NVME_MAX_QUEUE_DEPTH, false},
+        {"randwrite", BLOCK_OP_WRITE, true, 4096, 16, false},
+        {"read", BLOCK_OP_READ, false, 128 * 1024, 8, false},
+        {"write", BLOCK_OP_WRITE, false, 128 * 1024, 8, false}
+    };
+
+    // whole benchmark goes through one latency array
+    u64 latency_pages = BENCH_NVME_REQUESTS * sizeof(u64) / PAGE_SIZE;
+    u64* latencies = reinterpret_cast<u64*>(AllocateKernelMemory(latency_pages));
+    u32 max_depth = ns->controller->queues[0]->depth - 1;
+    bool was_polling = device->polling;
+
+    for(u64 i = 0; i < sizeof(jobs) / sizeof(jobs[0]); i++){
+        const NVMeJobDescription* description = &jobs[i];
+        if(!description->polled && device->polling_only) continue;
+
+        NVMeJob job;
+        job.device = device;
+        job.op = description->op;
+        job.random = description->random;
+        job.block_size = description->block_size;
+        while(job.block_size > device->max_transfer) job.block_size /= 2;
+        job.depth = description->depth < max_depth ? description->depth : max_depth;
+        job.requests = BENCH_NVME_REQUESTS;
+        job.seed = 0x2545f4914f6cdd1d;
+        job.latencies = latencies;
+        job.errors = 0;
+        job.done = false;
+        if(job.block_size < PAGE_SIZE || job.device->sector_count * BLOCK_SECTOR_SIZE < job.block_size) continue;
+
+        SetBlockDevicePolling(device, description->polled);
+        u64 start = ReadTimestampCounter();
+        RunNVMeJob(&job);
+        u64 ns_taken = CyclesToNanoseconds(ReadTimestampCounter() - start);
+        ShowNVMeJob(description->name, job.block_size, job.depth, job.requests, ns_taken, latencies, job.errors);
+    }
+
+    // one random reader per cpu, each on queue of cpu it runs on
+    SetBlockDevicePolling(device, false);
+    u32 threads = GetCPUCount();
+    if(threads > BENCH_NVME_MAX_THREADS) threads = BENCH_NVME_MAX_THREADS;
+    NVMeJob thread_jobs[BENCH_NVME_MAX_THREADS];
+    u64 per_thread = BENCH_NVME_REQUESTS / threads;
+    u32 depth = BENCH_NVME_THREAD_DEPTH < max_depth ? BENCH_NVME_THREAD_DEPTH : max_depth;
+    u64 start = ReadTimestampCounter();
+    for(u32 i = 0; i < threads; i++){
+        thread_jobs[i].device = device;
+        thread_jobs[i].op = BLOCK_OP_READ;
+        thread_jobs[i].random = true;
+        thread_jobs[i].block_size = 4096;
+        thread_jobs[i].depth = depth;
+        thread_jobs[i].requests = per_thread;
+        thread_jobs[i].seed = 0x9e3779b97f4a7c15 * (i + 1);
+        thread_jobs[i].latencies = latencies + i * per_thread;
+        thread_jobs[i].errors = 0;
+        thread_jobs[i].done = false;
+        SpawnThread("nvme-bench", NVMeJobThread, &thread_jobs[i]);
+    }
+    u64 errors = 0;
+    for(u32 i = 0; i < threads; i++){
+        while(!__atomic_load_n(&thread_jobs[i].done, __ATOMIC_ACQUIRE)) Yield();
+        errors += thread_jobs[i].errors;
+    }
+    u64 ns_taken = CyclesToNanoseconds(ReadTimestampCounter() - start);
+    char name[32];
+    sprintf(name, "randread, %u threads", threads);
+    ShowNVMeJob(name, 4096, depth, per_thread * threads, ns_taken, latencies, errors);
+
+    SetBlockDevicePolling(device, was_polling);
+    FreeKernelMemory(reinterpret_cast<u64>(latencies), latency_pages);
+}
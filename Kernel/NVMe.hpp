@@ -0,0 +1,62 @@
+/**
+ * @file NVMe.hpp
+ * @author Siddharth Mishra (brightprogrammer)
+ * @date 10/18/26
+ * @brief NVMe driver with one submission/completion queue pair per cpu.
+ * @copyright MIT License 2022 Siddharth Mishra
+ * */
+
+#ifndef NVME_HPP
+#define NVME_HPP
+
+#include "Common.hpp"
+
+/* ------------------ NVME --------------------
+ *
+ * Controller is set up through it's admin queue pair, which is only
+ * used during probe and is polled. After that every cpu gets an io
+ * queue pair of it's own, with it's own interrupt vector sent to that
+ * cpu, so submission and completion never leave the cpu that made a
+ * request.
+ *
+ * Every namespace of a controller is a block device, "nvme0n1" and so
+ * on, sharing queues of controller.
+ *
+ * Submission writes one command per request and rings the tail doorbell
+ * once per batch. Reaping goes through every new completion and rings
+ * the head doorbell once. Data is described by PRPs : first page in
+ * PRP1, second in PRP2, and anything longer through a PRP list, one page
+ * of which is allocated for every command slot when queue is created.
+ *
+ * Queues must be physically contiguous and memory manager only hands
+ * out single pages, so a submission queue holds at most
+ * NVME_MAX_QUEUE_DEPTH commands.
+ *
+ * */
+
+// max number of io queue pairs of a controller
+#define NVME_MAX_QUEUES 16
+// max number of namespaces registered per controller
+#define NVME_MAX_NAMESPACES 8
+// number of entries of an io submission queue, one less can be in flight
+#define NVME_DEFAULT_QUEUE_DEPTH 64
+#define NVME_MIN_QUEUE_DEPTH 2
+#define NVME_MAX_QUEUE_DEPTH 64
+
+/**
+ * @brief Register NVMe driver and probe every NVMe controller on PCI bus.
+ *
+ * @param queue_depth Number of entries in every io queue, clamped to
+ * NVME_MIN_QUEUE_DEPTH..NVME_MAX_QUEUE_DEPTH and to what controller allows.
+ * */
+void InitializeNVMe(u32 queue_depth = NVME_DEFAULT_QUEUE_DEPTH);
+
+/**
+ * @brief fio style jobs on first NVMe namespace : random and sequential
+ * reads and random writes at different depths, and one random reader
+ * per cpu. Reports IOPS, bandwidth and completion latency.
+ * Namespace is written to, so it must be a scratch disk.
+ * */
+void BenchmarkNVMe();
+
+#endif // NVME_HPP
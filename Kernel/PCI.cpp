@@ -0,0 +1,551 @@
+/**
+ * @file PCI.cpp
+ * @author Siddharth Mishra (brightprogrammer)
+ * @date 10/18/26
+ * @brief PCI bus enumeration, configuration space access and driver matching.
+ * @copyright MIT License 2022 Siddharth Mishra
+ * */
+
+#include "PCI.hpp"
+#include "ACPI.hpp"
+#include "MemoryManager.hpp"
+#include "Spinlock.hpp"
+#include "CPU.hpp"
+#include "IO.hpp"
+#include "Timer.hpp"
+#include "Printf.hpp"
+#include "String.hpp"
+
+#define PCI_CONFIG_ADDRESS 0xcf8
+#define PCI_CONFIG_DATA 0xcfc
+#define PCI_CONFIG_ENABLE 0x80000000
+// size of configuration space of a function through ports and ECAM
+#define PCI_PORT_CONFIG_SIZE 256
+#define PCI_ECAM_CONFIG_SIZE 4096
+// ECAM size of one bus
+#define PCI_ECAM_BUS_SIZE (1 << 20)
+
+#define PCI_MAX_BUSES 256
+#define PCI_MAX_SLOTS 32
+#define PCI_MAX_FUNCTIONS 8
+
+// capability lists can't be longer than this, anything longer is a loop
+#define PCI_MAX_CAPABILITIES 48
+
+// class of PCI to PCI bridges
+#define PCI_CLASS_BRIDGE 0x06
+#define PCI_SUBCLASS_PCI_BRIDGE 0x04
+
+struct MCFGEntry {
+    u64 base;
+    u16 segment;
+    u8 start_bus;
+    u8 end_bus;
+    u32 reserved;
+} __attribute__((packed));
+
+struct MCFGTable {
+    ACPITableHeader header;
+    u64 reserved;
+    MCFGEntry entries[];
+} __attribute__((packed));
+
+struct ECAMRegion {
+    u64 base;
+    u16 segment;
+    u8 start_bus;
+    u8 end_bus;
+    // buses already mapped, a bus is mapped when it's first walked
+    u64 mapped[PCI_MAX_BUSES / 64];
+};
+
+// how buses are being walked, enumeration at boot and benchmark use their own
+struct PCIScan {
+    // nullptr when walking through ports
+    ECAMRegion* region;
+    PCIDevice* table;
+    u64 count;
+    u64 capacity;
+    // size BARs and parse capabilities of functions found, only done at boot
+    bool first_walk;
+    u64 buses;
+    u64 config_reads;
+};
+
+static ECAMRegion ecam_regions[PCI_MAX_ECAM_REGIONS];
+static u64 ecam_region_count = 0;
+
+static PCIDevice pci_devices[PCI_MAX_DEVICES];
+static u64 pci_device_count = 0;
+static u64 pci_bus_count = 0;
+// time taken by enumeration at boot
+static u64 pci_enumeration_ns = 0;
+
+static PCIDriver* pci_drivers = nullptr;
+static TicketLock<> pci_driver_lock("pci.drivers");
+
+// address and data ports are one shared register pair
+static TicketLock<> pci_port_lock("pci.ports");
+
+/******************** Configuration Space Access ********************/
+
+static inline u32 PortConfigAddress(u8 bus, u8 device, u8 function, u16 offset){
+    return PCI_CONFIG_ENABLE | (u32(bus) << 16) | (u32(device) << 11) | (u32(function) << 8) | (offset & 0xfc);
+}
+
+static u32 PortRead(u8 bus, u8 device, u8 function, u16 offset, u32 size){
+    if(offset >= PCI_PORT_CONFIG_SIZE) return 0xffffffff;
+
+    LockGuard guard(pci_port_lock);
+    PortWriteDword(PCI_CONFIG_ADDRESS, PortConfigAddress(bus, device, function, offset));
+    u16 port = PCI_CONFIG_DATA + (offset & 3);
+    if(size == 1) return PortReadByte(port);
+    if(size == 2) return PortReadWord(port);
+    return PortReadDword(port);
+}
+
+static void PortWrite(u8 bus, u8 device, u8 function, u16 offset, u32 size, u32 value){
+    if(offset >= PCI_PORT_CONFIG_SIZE) return;
+
+    LockGuard guard(pci_port_lock);
+    PortWriteDword(PCI_CONFIG_ADDRESS, PortConfigAddress(bus, device, function, offset));
+    u16 port = PCI_CONFIG_DATA + (offset & 3);
+    if(size == 1) PortWriteByte(port, u8(value));
+    else if(size == 2) PortWriteWord(port, u16(value));
+    else PortWriteDword(port, value);
+}
+
+static u32 ConfigRead(PCIDevice* device, u16 offset, u32 size){
+    if(device->config == 0){
+        return PortRead(device->bus, device->device, device->function, offset, size);
+    }
+
+    u64 addr = device->config + offset;
+    if(size == 1) return *reinterpret_cast<volatile u8*>(addr);
+    if(size == 2) return *reinterpret_cast<volatile u16*>(addr);
+    return *reinterpret_cast<volatile u32*>(addr);
+}
+
+static void ConfigWrite(PCIDevice* device, u16 offset, u32 size, u32 value){
+    if(device->config == 0){
+        PortWrite(device->bus, device->device, device->function, offset, size, value);
+        return;
+    }
+
+    u64 addr = device->config + offset;
+    if(size == 1) *reinterpret_cast<volatile u8*>(addr) = u8(value);
+    else if(size == 2) *reinterpret_cast<volatile u16*>(addr) = u16(value);
+    else *reinterpret_cast<volatile u32*>(addr) = value;
+}
+
+u8 PCIRead8(PCIDevice* device, u16 offset){
+    return u8(ConfigRead(device, offset, 1));
+}
+
+u16 PCIRead16(PCIDevice* device, u16 offset){
+    return u16(ConfigRead(device, offset, 2));
+}
+
+u32 PCIRead32(PCIDevice* device, u16 offset){
+    return ConfigRead(device, offset, 4);
+}
+
+void PCIWrite8(PCIDevice* device, u16 offset, u8 value){
+    ConfigWrite(device, offset, 1, value);
+}
+
+void PCIWrite16(PCIDevice* device, u16 offset, u16 value){
+    ConfigWrite(device, offset, 2, value);
+}
+
+void PCIWrite32(PCIDevice* device, u16 offset, u32 value){
+    ConfigWrite(device, offset, 4, value);
+}
+
+/******************** Enumeration ********************/
+
+// configuration space of a function in ECAM, mapping it's bus if needed
+static u64 GetECAMConfig(ECAMRegion* region, u8 bus, u8 device, u8 function){
+    u64 bus_base = region->base + u64(bus - region->start_bus) * PCI_ECAM_BUS_SIZE;
+    u64 bit = u64(1) << (bus % 64);
+    if(!(region->mapped[bus / 64] & bit)){
+        MapMMIO(bus_base, PCI_ECAM_BUS_SIZE);
+        region->mapped[bus / 64] |= bit;
+    }
+    return PhysicalToVirtualAddress(bus_base + (u64(device) << 15) + (u64(function) << 12));
+}
+
+// fill location of a function, enough for config space access
+static void SetDeviceLocation(PCIScan* scan, PCIDevice* device, u8 bus, u8 slot, u8 function){
+    device->segment = scan->region ? scan->region->segment : 0;
+    device->bus = bus;
+    device->device = slot;
+    device->function = function;
+    device->config = scan->region ? GetECAMConfig(scan->region, bus, slot, function) : 0;
+}
+
+static u32 ScanRead32(PCIScan* scan, PCIDevice* device, u16 offset){
+    scan->config_reads++;
+    return PCIRead32(device, offset);
+}
+
+// write all ones to BARs to find their sizes
+static void SizeBars(PCIScan* scan, PCIDevice* device){
+    u32 bar_count = 0;
+    if((device->header_type & PCI_HEADER_TYPE_MASK) == PCI_HEADER_TYPE_DEVICE) bar_count = 6;
+    else if((device->header_type & PCI_HEADER_TYPE_MASK) == PCI_HEADER_TYPE_BRIDGE) bar_count = 2;
+
+    // device must not decode addresses while BARs hold all ones
+    u16 command = PCIRead16(device, PCI_COMMAND);
+    PCIWrite16(device, PCI_COMMAND, command & ~(PCI_COMMAND_IO | PCI_COMMAND_MEMORY));
+
+    for(u32 i = 0; i < bar_count; i++){
+        u16 offset = PCI_BAR0 + i * 4;
+        u32 original = ScanRead32(scan, device, offset);
+        PCIWrite32(device, offset, 0xffffffff);
+        u32 mask = ScanRead32(scan, device, offset);
+        PCIWrite32(device, offset, original);
+
+        PCIBar* bar = &device->bars[i];
+        if(mask == 0) continue;
+
+        if(original & 1){
+            // io BARs may leave upper 16 bits zero
+            u32 m = mask & ~u32(3);
+            if((m & 0xffff0000) == 0) m |= 0xffff0000;
+            bar->address = original & ~u32(3);
+            bar->size = u32(~m + 1);
+            bar->flags = PCI_BAR_IO;
+            continue;
+        }
+
+        u64 address = original & ~u32(0xf);
+        u64 size_mask = mask & ~u32(0xf);
+        u32 flags = (original & (1 << 3)) ? PCI_BAR_PREFETCHABLE : 0;
+
+        // 64 bit BARs take next BAR for upper half
+        if(((original >> 1) & 3) == 2 && i + 1 < bar_count){
+            u32 original_high = ScanRead32(scan, device, offset + 4);
+            PCIWrite32(device, offset + 4, 0xffffffff);
+            u32 mask_high = ScanRead32(scan, device, offset + 4);
+            PCIWrite32(device, offset + 4, original_high);
+
+            address |= u64(original_high) << 32;
+            size_mask |= u64(mask_high) << 32;
+            flags |= PCI_BAR_64BIT;
+        }else{
+            size_mask |= 0xffffffff00000000;
+        }
+
+        bar->address = address;
+        bar->size = ~size_mask + 1;
+        bar->flags = flags;
+        if(flags & PCI_BAR_64BIT) i++;
+    }
+
+    PCIWrite16(device, PCI_COMMAND, command);
+}
+
+static void ScanBus(PCIScan* scan, u8 bus);
+
+static void ScanFunction(PCIScan* scan, u8 bus, u8 slot, u8 function){
+    if(scan->count == scan->capacity) return;
+
+    PCIDevice* device = &scan->table[scan->count];
+    SetDeviceLocation(scan, device, bus, slot, function);
+    u32 id = ScanRead32(scan, device, PCI_VENDOR_ID);
+    if((id & 0xffff) == 0xffff) return;
+    scan->count++;
+
+    u32 class_reg = ScanRead32(scan, device, PCI_REVISION_ID);
+    u32 header_reg = ScanRead32(scan, device, PCI_HEADER_TYPE & ~3);
+    device->vendor_id = id & 0xffff;
+    device->device_id = id >> 16;
+    device->revision = class_reg & 0xff;
+    device->prog_if = (class_reg >> 8) & 0xff;
+    device->subclass = (class_reg >> 16) & 0xff;
+    device->class_code = class_reg >> 24;
+    device->header_type = (header_reg >> 16) & 0xff;
+    device->driver = nullptr;
+    device->driver_data = nullptr;
+
+    u8 type = device->header_type & PCI_HEADER_TYPE_MASK;
+    if(type == PCI_HEADER_TYPE_DEVICE){
+        u32 subsystem = ScanRead32(scan, device, PCI_SUBSYSTEM_VENDOR_ID);
+        device->subsystem_vendor_id = subsystem & 0xffff;
+        device->subsystem_id = subsystem >> 16;
+    }else{
+        device->subsystem_vendor_id = 0;
+        device->subsystem_id = 0;
+    }
+    u32 interrupt = ScanRead32(scan, device, PCI_INTERRUPT_LINE);
+    device->interrupt_line = interrupt & 0xff;
+    device->interrupt_pin = (interrupt >> 8) & 0xff;
+
+    for(u32 i = 0; i < PCI_MAX_BARS; i++){
+        device->bars[i].address = 0;
+        device->bars[i].size = 0;
+        device->bars[i].flags = 0;
+    }
+    device->msi_capability = 0;
+    device->msix_capability = 0;
+    if(scan->first_walk){
+        SizeBars(scan, device);
+        device->msi_capability = FindPCICapability(device, PCI_CAPABILITY_MSI);
+        device->msix_capability = FindPCICapability(device, PCI_CAPABILITY_MSIX);
+    }
+
+    // follow bridges to buses behind them, firmware already numbered them
+    if(type == PCI_HEADER_TYPE_BRIDGE && device->class_code == PCI_CLASS_BRIDGE &&
+       device->subclass == PCI_SUBCLASS_PCI_BRIDGE){
+        u8 secondary = (ScanRead32(scan, device, PCI_SECONDARY_BUS & ~3) >> 8) & 0xff;
+        // bus numbers only grow going down, anything else would loop
+        if(secondary > bus && (!scan->region || secondary <= scan->region->end_bus)){
+            ScanBus(scan, secondary);
+        }
+    }
+}
+
+static void ScanSlot(PCIScan* scan, u8 bus, u8 slot){
+    u64 first = scan->count;
+    ScanFunction(scan, bus, slot, 0);
+    if(scan->count == first) return;
+
+    if(scan->table[first].header_type & PCI_HEADER_MULTIFUNCTION){
+        for(u8 function = 1; function < PCI_MAX_FUNCTIONS; function++){
+            ScanFunction(scan, bus, slot, function);
+        }
+    }
+}
+
+static void ScanBus(PCIScan* scan, u8 bus){
+    scan->buses++;
+    for(u8 slot = 0; slot < PCI_MAX_SLOTS; slot++){
+        ScanSlot(scan, bus, slot);
+    }
+}
+
+// walk everything under host bridges of a segment
+static void ScanSegment(PCIScan* scan, u8 start_bus){
+    PCIDevice host;
+    SetDeviceLocation(scan, &host, start_bus, 0, 0);
+    u32 header_reg = ScanRead32(scan, &host, PCI_HEADER_TYPE & ~3);
+    if(((header_reg >> 16) & PCI_HEADER_MULTIFUNCTION) == 0){
+        ScanBus(scan, start_bus);
+        return;
+    }
+
+    // every function of a multifunction host bridge is host bridge of a bus
+    for(u8 function = 0; function < PCI_MAX_FUNCTIONS; function++){
+        SetDeviceLocation(scan, &host, start_bus, 0, function);
+        if((ScanRead32(scan, &host, PCI_VENDOR_ID) & 0xffff) == 0xffff) break;
+        ScanBus(scan, start_bus + function);
+    }
+}
+
+// walk all buses, through ECAM if use_ecam is set and there is ECAM
+static void Enumerate(PCIScan* scan, bool use_ecam){
+    if(!use_ecam || ecam_region_count == 0){
+        scan->region = nullptr;
+        ScanSegment(scan, 0);
+        return;
+    }
+
+    for(u64 i = 0; i < ecam_region_count; i++){
+        scan->region = &ecam_regions[i];
+        ScanSegment(scan, ecam_regions[i].start_bus);
+    }
+}
+
+static void FindECAMRegions(){
+    MCFGTable* mcfg = reinterpret_cast<MCFGTable*>(FindACPITable("MCFG"));
+    if(mcfg == nullptr) return;
+
+    u64 count = (mcfg->header.length - sizeof(MCFGTable)) / sizeof(MCFGEntry);
+    for(u64 i = 0; i < count && ecam_region_count < PCI_MAX_ECAM_REGIONS; i++){
+        ECAMRegion* region = &ecam_regions[ecam_region_count++];
+        region->base = mcfg->entries[i].base;
+        region->segment = mcfg->entries[i].segment;
+        region->start_bus = mcfg->entries[i].start_bus;
+        region->end_bus = mcfg->entries[i].end_bus;
+    }
+}
+
+void InitializePCI(){
+    FindECAMRegions();
+
+    PCIScan scan;
+    scan.region = nullptr;
+    scan.table = pci_devices;
+    scan.count = 0;
+    scan.capacity = PCI_MAX_DEVICES;
+    scan.first_walk = true;
+    scan.buses = 0;
+    scan.config_reads = 0;
+
+    u64 start = ReadTimestampCounter();
+    Enumerate(&scan, true);
+    pci_enumeration_ns = CyclesToNanoseconds(ReadTimestampCounter() - start);
+    pci_device_count = scan.count;
+    pci_bus_count = scan.buses;
+
+    for(u64 i = 0; i < pci_device_count; i++){
+        PCIDevice* device = &pci_devices[i];
+        Printf("\tPCI %u:%u.%u | %x:%x | class %x.%x.%x\n", u32(device->bus), u32(device->device),
+               u32(device->function), u32(device->vendor_id), u32(device->device_id),
+               u32(device->class_code), u32(device->subclass), u32(device->prog_if));
+    }
+    Printf("\tPCI : %lu devices on %lu buses in %lu us (%s)\n", pci_device_count, pci_bus_count,
+           pci_enumeration_ns / 1000, ecam_region_count ? "ECAM" : "io ports");
+}
+
+/******************** Devices and Drivers ********************/
+
+u8 FindPCICapability(PCIDevice* device, u8 id, u8 start){
+    u8 offset;
+    if(start){
+        offset = PCIRead8(device, start + 1);
+    }else{
+        if(!(PCIRead16(device, PCI_STATUS) & PCI_STATUS_CAPABILITIES)) return 0;
+        offset = PCIRead8(device, PCI_CAPABILITY_POINTER);
+    }
+
+    for(u32 i = 0; i < PCI_MAX_CAPABILITIES && offset >= 0x40; i++){
+        // bottom two bits are reserved
+        offset &= 0xfc;
+        u16 header = PCIRead16(device, offset);
+        if((header & 0xff) == id) return offset;
+        offset = header >> 8;
+    }
+    return 0;
+}
+
+void EnablePCIDevice(PCIDevice* device){
+    u16 command = PCIRead16(device, PCI_COMMAND);
+    for(u32 i = 0; i < PCI_MAX_BARS; i++){
+        if(device->bars[i].size == 0) continue;
+        command |= (device->bars[i].flags & PCI_BAR_IO) ? PCI_COMMAND_IO : PCI_COMMAND_MEMORY;
+    }
+    PCIWrite16(device, PCI_COMMAND, command | PCI_COMMAND_BUS_MASTER);
+}
+
+u64 MapPCIBar(PCIDevice* device, u32 bar){
+    if(bar >= PCI_MAX_BARS) return 0;
+    PCIBar* b = &device->bars[bar];
+    if(b->size == 0 || (b->flags & PCI_BAR_IO)) return 0;
+    return MapMMIO(b->address, b->size);
+}
+
+u64 GetPCIDeviceCount(){
+    return pci_device_count;
+}
+
+PCIDevice* GetPCIDevice(u64 index){
+    return index < pci_device_count ? &pci_devices[index] : nullptr;
+}
+
+PCIDevice* FindPCIDevice(u16 vendor_id, u16 device_id, u64 index){
+    for(u64 i = 0; i < pci_device_count; i++){
+        PCIDevice* device = &pci_devices[i];
+        if(device->vendor_id == vendor_id && device->device_id == device_id){
+            if(index-- == 0) return device;
+        }
+    }
+    return nullptr;
+}
+
+static const PCIDeviceID* MatchDriver(PCIDriver* driver, PCIDevice* device){
+    u32 class_code = (u32(device->class_code) << 16) | (u32(device->subclass) << 8) | device->prog_if;
+    for(u64 i = 0; i < driver->id_count; i++){
+        const PCIDeviceID* id = &driver->ids[i];
+        if(id->vendor_id != PCI_ANY_ID && id->vendor_id != device->vendor_id) continue;
+        if(id->device_id != PCI_ANY_ID && id->device_id != device->device_id) continue;
+        if((class_code & id->class_mask) != id->class_code) continue;
+        return id;
+    }
+    return nullptr;
+}
+
+u64 RegisterPCIDriver(PCIDriver* driver){
+    pci_driver_lock.Lock();
+    driver->next = pci_drivers;
+    pci_drivers = driver;
+    pci_driver_lock.Unlock();
+
+    u64 taken = 0;
+    for(u64 i = 0; i < pci_device_count; i++){
+        PCIDevice* device = &pci_devices[i];
+        const PCIDeviceID* id = MatchDriver(driver, device);
+        if(id == nullptr) continue;
+
+        // claim device first, so that two drivers never probe it at once
+        PCIDriver* expected = nullptr;
+        if(!__atomic_compare_exchange_n(&device->driver, &expected, driver, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)){
+            continue;
+        }
+
+        if(driver->probe(device, id)){
+            Printf("\tPCI %u:%u.%u | driver %s\n", u32(device->bus), u32(device->device),
+                   u32(device->function), driver->name);
+            taken++;
+        }else{
+            __atomic_store_n(&device->driver, nullptr, __ATOMIC_RELEASE);
+        }
+    }
+    return taken;
+}
+
+/******************** PCI Benchmark ********************/
+
+#define BENCH_PCI_ITERATIONS 16
+#define BENCH_PCI_LOOKUPS 100000
+
+void BenchmarkPCI(){
+    ColorPrintf(COLOR_YELLOW, COLOR_BLACK, "[+] Benchmark : PCI Enumeration\n");
+    Printf("\tBoot : %lu devices on %lu buses in %lu us, BARs sized once\n",
+           pci_device_count, pci_bus_count, pci_enumeration_ns / 1000);
+
+    u64 table_pages = (PCI_MAX_DEVICES * sizeof(PCIDevice) + PAGE_SIZE - 1) / PAGE_SIZE;
+    PCIDevice* table = reinterpret_cast<PCIDevice*>(AllocateKernelMemory(table_pages));
+
+    // walk again without touching BARs, devices may be in use now
+    for(u32 mechanism = 0; mechanism < 2; mechanism++){
+        bool use_ecam = mechanism == 1;
+        if(use_ecam && ecam_region_count == 0) continue;
+
+        PCIScan scan;
+        u64 cycles = 0;
+        for(u64 i = 0; i < BENCH_PCI_ITERATIONS; i++){
+            scan.region = nullptr;
+            scan.table = table;
+            scan.count = 0;
+            scan.capacity = PCI_MAX_DEVICES;
+            scan.first_walk = false;
+            scan.buses = 0;
+            scan.config_reads = 0;
+
+            u64 start = ReadTimestampCounter();
+            Enumerate(&scan, use_ecam);
+            cycles += ReadTimestampCounter() - start;
+        }
+
+        u64 ns = CyclesToNanoseconds(cycles) / BENCH_PCI_ITERATIONS;
+        Printf("\t%s : %lu devices | %lu config reads | %lu us per walk | %lu ns per read\n",
+               use_ecam ? "ECAM" : "Ports", scan.count, scan.config_reads, ns / 1000,
+               scan.config_reads ? ns / scan.config_reads : 0);
+    }
+
+    FreeKernelMemory(reinterpret_cast<u64>(table), table_pages);
+
+    // drivers match against device table, never against bus
+    if(pci_device_count){
+        PCIDevice* last = &pci_devices[pci_device_count - 1];
+        u64 found = 0;
+        u64 start = ReadTimestampCounter();
+        for(u64 i = 0; i < BENCH_PCI_LOOKUPS; i++){
+            if(FindPCIDevice(last->vendor_id, last->device_id)) found++;
+        }
+        u64 ns = CyclesToNanoseconds(ReadTimestampCounter() - start);
+        Printf("\tDevice table lookup : %lu ns (%lu found)\n", ns / BENCH_PCI_LOOKUPS, found);
+    }
+}
@@ -0,0 +1,247 @@
+/**
+ * @file PCI.hpp
+ * @author Siddharth Mishra (brightprogrammer)
+ * @date 10/18/26
+ * @brief PCI bus enumeration, configuration space access and driver matching.
+ * @copyright MIT License 2022 Siddharth Mishra
+ * */
+
+#ifndef PCI_HPP
+#define PCI_HPP
+
+#include "Common.hpp"
+
+/* ------------------ PCI --------------------
+ *
+ * Configuration space is reached through ECAM when ACPI has an MCFG
+ * table, which maps 4 KB of configuration space of every function to
+ * memory, at
+ *
+ *   base + ((bus - start_bus) << 20) + (device << 15) + (function << 12)
+ *
+ * Otherwise it's reached through address and data ports 0xcf8 and 0xcfc,
+ * which only give first 256 bytes of segment 0 and need a lock, since
+ * every access is two port writes.
+ *
+ * Buses are walked once at boot, starting from host bridges and following
+ * every PCI to PCI bridge to it's secondary bus. Every function found is
+ * remembered in a device table along with size of it's BARs. BARs are sized
+ * by writing all ones to them, with decoding disabled, so this happens
+ * only once, before any driver starts using device.
+ *
+ * Drivers register a table of ids, and are matched against device
+ * table, never against bus itself.
+ *
+ * */
+
+// max number of functions remembered
+#define PCI_MAX_DEVICES 256
+// max number of ECAM regions taken from MCFG
+#define PCI_MAX_ECAM_REGIONS 8
+// number of BARs in a type 0 header
+#define PCI_MAX_BARS 6
+
+// matches any vendor or device id
+#define PCI_ANY_ID 0xffff
+
+// configuration space registers
+#define PCI_VENDOR_ID 0x00
+#define PCI_DEVICE_ID 0x02
+#define PCI_COMMAND 0x04
+#define PCI_STATUS 0x06
+#define PCI_REVISION_ID 0x08
+#define PCI_PROG_IF 0x09
+#define PCI_SUBCLASS 0x0a
+#define PCI_CLASS 0x0b
+#define PCI_HEADER_TYPE 0x0e
+#define PCI_BAR0 0x10
+#define PCI_SECONDARY_BUS 0x19
+#define PCI_SUBSYSTEM_VENDOR_ID 0x2c
+#define PCI_SUBSYSTEM_ID 0x2e
+#define PCI_CAPABILITY_POINTER 0x34
+#define PCI_INTERRUPT_LINE 0x3c
+#define PCI_INTERRUPT_PIN 0x3d
+
+// bits of command register
+#define PCI_COMMAND_IO (1 << 0)
+#define PCI_COMMAND_MEMORY (1 << 1)
+#define PCI_COMMAND_BUS_MASTER (1 << 2)
+#define PCI_COMMAND_INTX_DISABLE (1 << 10)
+
+// bits of status register
+#define PCI_STATUS_INTERRUPT (1 << 3)
+#define PCI_STATUS_CAPABILITIES (1 << 4)
+
+// capability ids
+#define PCI_CAPABILITY_MSI 0x05
+#define PCI_CAPABILITY_VENDOR 0x09
+#define PCI_CAPABILITY_PCIE 0x10
+#define PCI_CAPABILITY_MSIX 0x11
+
+// header types
+#define PCI_HEADER_TYPE_MASK 0x7f
+#define PCI_HEADER_MULTIFUNCTION 0x80
+#define PCI_HEADER_TYPE_DEVICE 0
+#define PCI_HEADER_TYPE_BRIDGE 1
+
+// flags of a BAR
+#define PCI_BAR_IO (1 << 0)
+#define PCI_BAR_64BIT (1 << 1)
+#define PCI_BAR_PREFETCHABLE (1 << 2)
+
+/**
+ * @brief Base address register, as found during enumeration.
+ * */
+struct PCIBar {
+    // physical address, or port number for io BARs
+    u64 address;
+    // 0 if BAR is not implemented
+    u64 size;
+    // PCI_BAR_*
+    u32 flags;
+};
+
+struct PCIDriver;
+
+/**
+ * @brief A function on PCI bus.
+ * */
+struct PCIDevice {
+    u16 segment;
+    u8 bus;
+    u8 device;
+    u8 function;
+    u8 header_type;
+
+    u16 vendor_id;
+    u16 device_id;
+    u16 subsystem_vendor_id;
+    u16 subsystem_id;
+    u8 class_code;
+    u8 subclass;
+    u8 prog_if;
+    u8 revision;
+    u8 interrupt_line;
+    u8 interrupt_pin;
+
+    PCIBar bars[PCI_MAX_BARS];
+
+    // offsets of interrupt capabilities, 0 if device doesn't have them
+    u8 msi_capability;
+    u8 msix_capability;
+
+    // direct map address of configuration space, 0 if accessed through ports
+    u64 config;
+
+    // driver bound to device, nullptr if none
+    PCIDriver* driver;
+    // whatever driver wants to remember for device
+    void* driver_data;
+};
+
+/**
+ * @brief An id a driver handles. Class is matched as
+ * (class << 16 | subclass << 8 | prog_if) & class_mask == class_code.
+ * */
+struct PCIDeviceID {
+    u16 vendor_id;
+    u16 device_id;
+    u32 class_code;
+    u32 class_mask;
+};
+
+/**
+ * @brief Called for every device matching one of driver's ids.
+ *
+ * @return true if driver takes device.
+ * */
+typedef bool (*PCIProbeFunction)(PCIDevice* device, const PCIDeviceID* id);
+
+struct PCIDriver {
+    const char* name;
+    const PCIDeviceID* ids;
+    u64 id_count;
+    PCIProbeFunction probe;
+    // next registered driver
+    PCIDriver* next;
+};
+
+/**
+ * @brief Find configuration mechanism and enumerate all buses.
+ * Must be called after ACPI is initialized.
+ * */
+void InitializePCI();
+
+/**
+ * @brief Read configuration space of a device.
+ *
+ * @param offset Offset of register, naturally aligned for it's size.
+ * */
+u8 PCIRead8(PCIDevice* device, u16 offset);
+u16 PCIRead16(PCIDevice* device, u16 offset);
+u32 PCIRead32(PCIDevice* device, u16 offset);
+
+/**
+ * @brief Write configuration space of a device.
+ *
+ * @param offset Offset of register, naturally aligned for it's size.
+ * */
+void PCIWrite8(PCIDevice* device, u16 offset, u8 value);
+void PCIWrite16(PCIDevice* device, u16 offset, u16 value);
+void PCIWrite32(PCIDevice* device, u16 offset, u32 value);
+
+/**
+ * @brief Find a capability in device's capability list.
+ *
+ * @param id PCI_CAPABILITY_* id.
+ * @param start Offset of capability to continue search after, 0 to search from start.
+ * @return Offset of capability in configuration space, or 0 if not found.
+ * */
+u8 FindPCICapability(PCIDevice* device, u8 id, u8 start = 0);
+
+/**
+ * @brief Turn on decoding of device's BARs and let it master the bus.
+ * */
+void EnablePCIDevice(PCIDevice* device);
+
+/**
+ * @brief Map a memory BAR of device with caching disabled.
+ *
+ * @return Virtual address of BAR, or 0 if BAR is not a memory BAR.
+ * */
+u64 MapPCIBar(PCIDevice* device, u32 bar);
+
+/**
+ * @brief Get number of devices found during enumeration.
+ * */
+u64 GetPCIDeviceCount();
+
+/**
+ * @brief Get device at given index of device table, or nullptr if there
+ * is no such device.
+ * */
+PCIDevice* GetPCIDevice(u64 index);
+
+/**
+ * @brief Find a device by it's vendor and device id in device table.
+ *
+ * @param index Which one of matching devices to get.
+ * @return Device or nullptr if there is no such device.
+ * */
+PCIDevice* FindPCIDevice(u16 vendor_id, u16 device_id, u64 index = 0);
+
+/**
+ * @brief Register a driver and probe it on every unclaimed device
+ * in device table matching one of it's ids.
+ *
+ * @return Number of devices driver took.
+ * */
+u64 RegisterPCIDriver(PCIDriver* driver);
+
+/**
+ * @brief Compare enumeration through ECAM and io ports, and cost of
+ * finding a device through device table.
+ * */
+void BenchmarkPCI();
+
+#endif // PCI_HPP
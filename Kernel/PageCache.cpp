@@ -0,0 +1,920 @@
+/**
+ * @file PageCache.cpp
+ * @author Siddharth Mishra (brightprogrammer)
+ * @date 10/18/26
+ * @brief Cache of file pages, shared by reads, writes and mapped files.
+ * @copyright MIT License 2022 Siddharth Mishra
+ * */
+
+#include "PageCache.hpp"
+#include "VFS.hpp"
+#include "Writeback.hpp"
+#include "FAT32.hpp"
+#include "Block.hpp"
+#include "MemoryManager.hpp"
+#include "Mutex.hpp"
+#include "Slab.hpp"
+#include "Syscall.hpp"
+#include "Thread.hpp"
+#include "Timer.hpp"
+#include "Printf.hpp"
+#include "String.hpp"
+
+#include <new>
+
+#define STRINGIFY_(x) #x
+#define STRINGIFY(x) STRINGIFY_(x)
+
+#define PAGE_CACHE_SHIFT 6
+#define PAGE_CACHE_SLOTS (1 << PAGE_CACHE_SHIFT)
+#define PAGE_CACHE_MASK (PAGE_CACHE_SLOTS - 1)
+// enough levels for page number of any 64 bit offset
+#define PAGE_CACHE_MAX_HEIGHT 9
+
+struct PageCacheNode {
+    // child nodes, or kernel addresses of pages in bottom level
+    void* slots[PAGE_CACHE_SLOTS];
+    // slots that are in use
+    u64 present;
+    // dirty pages, or children that have dirty pages below them
+    u64 dirty;
+};
+
+struct PageCache {
+    // nullptr while height is 0
+    PageCacheNode* root;
+    u32 height;
+    u64 pages;
+    // protects tree
+    TicketLock<false> lock;
+    // serializes io on file and protects mappings,
+    // pages are dropped from tree only while it's held
+    Mutex mutex;
+    // regions mapping this file, linked through mapping_next
+    MemoryRegion* mappings;
+    // set if cache is only storage of file, which then keeps it's size here
+    PageCacheLimit* limit;
+    u64 size;
+    // uptime since when pages may be dirty, 0 if none are tagged and
+    // nothing maps file shared and writable, protected by lock
+    u64 dirty_since;
+
+    constexpr PageCache(PageCacheLimit* memory_limit)
+        : root(nullptr), height(0), pages(0), lock("page_cache"), mutex("page_cache.io"),
+          mappings(nullptr), limit(memory_limit), size(0), dirty_since(0) {}
+};
+
+static SlabCache page_cache_cache("page_cache", sizeof(PageCache));
+static SlabCache page_cache_node_cache("page_cache.node", sizeof(PageCacheNode));
+
+// pages read from filesystems, found dirty in page tables, and written back
+static u64 pages_read_in;
+static u64 dirty_pages_found;
+static u64 pages_written_back;
+// pages tagged dirty, and caches that may have dirty pages, over all caches
+static volatile u64 dirty_pages;
+static volatile u64 dirty_caches;
+
+/******************** Radix Tree ********************/
+
+// largest page number a tree of given height can hold
+static u64 MaxIndex(u32 height){
+    return height >= PAGE_CACHE_MAX_HEIGHT ? ~u64(0) : (u64(1) << (PAGE_CACHE_SHIFT * height)) - 1;
+}
+
+// slot of page number in a node of given level, 1 is bottom level
+static u64 SlotOf(u64 index, u32 level){
+    return (index >> (PAGE_CACHE_SHIFT * (level - 1))) & PAGE_CACHE_MASK;
+}
+
+// first page number under a slot of a node that covers index
+static u64 StartOfSlot(u64 index, u32 level, u64 slot){
+    u32 shift = PAGE_CACHE_SHIFT * (level - 1);
+    return (index & ~((u64(1) << (shift + PAGE_CACHE_SHIFT)) - 1)) | (slot << shift);
+}
+
+static PageCacheNode* NewNode(){
+    PageCacheNode* node = reinterpret_cast<PageCacheNode*>(SlabAllocate(&page_cache_node_cache));
+    if(node) memset(node, 0, sizeof(PageCacheNode));
+    return node;
+}
+
+// slot of a page in bottom level, nullptr if there's no node for it
+// lock of cache is held
+static void** FindSlot(PageCache* cache, u64 index){
+    if(cache->height == 0 || index > MaxIndex(cache->height)) return nullptr;
+
+    PageCacheNode* node = cache->root;
+    for(u32 level = cache->height; level > 1; level--){
+        node = reinterpret_cast<PageCacheNode*>(node->slots[SlotOf(index, level)]);
+        if(node == nullptr) return nullptr;
+    }
+    return &node->slots[SlotOf(index, 1)];
+}
+
+// returns 0 if page is not cached, lock of cache is held
+static u64 LookupPage(PageCache* cache, u64 index){
+    void** slot = FindSlot(cache, index);
+    return slot ? reinterpret_cast<u64>(*slot) : 0;
+}
+
+// take a page from limit of a memory cache
+static bool ChargePage(PageCache* cache){
+    PageCacheLimit* limit = cache->limit;
+    if(limit == nullptr) return true;
+    if(__atomic_add_fetch(&limit->pages, 1, __ATOMIC_RELAXED) > limit->max_pages){
+        __atomic_sub_fetch(&limit->pages, 1, __ATOMIC_RELAXED);
+        return false;
+    }
+    return true;
+}
+
+static void UnchargePage(PageCache* cache){
+    if(cache->limit) __atomic_sub_fetch(&cache->limit->pages, 1, __ATOMIC_RELAXED);
+}
+
+// add a page that is not cached, cache takes over a reference to it
+// lock of cache is held
+static bool InsertPage(PageCache* cache, u64 index, u64 page){
+    // old root becomes first child of a new one until index fits
+    while(cache->height == 0 || index > MaxIndex(cache->height)){
+        PageCacheNode* node = NewNode();
+        if(node == nullptr) return false;
+        if(cache->root){
+            node->slots[0] = cache->root;
+            node->present = 1;
+            node->dirty = cache->root->dirty ? 1 : 0;
+        }
+        cache->root = node;
+        cache->height++;
+    }
+
+    PageCacheNode* node = cache->root;
+    for(u32 level = cache->height; level > 1; level--){
+        u64 slot = SlotOf(index, level);
+        if(node->slots[slot] == nullptr){
+            PageCacheNode* child = NewNode();
+            if(child == nullptr) return false;
+            node->slots[slot] = child;
+            node->present |= u64(1) << slot;
+        }
+        node = reinterpret_cast<PageCacheNode*>(node->slots[slot]);
+    }
+
+    u64 slot = SlotOf(index, 1);
+    node->slots[slot] = reinterpret_cast<void*>(page);
+    node->present |= u64(1) << slot;
+    cache->pages++;
+    return true;
+}
+
+// lock of cache is held
+static void SetDirtySince(PageCache* cache, u64 since){
+    if(cache->dirty_since == 0 && since) __atomic_fetch_add(&dirty_caches, 1, __ATOMIC_RELAXED);
+    if(cache->dirty_since && since == 0) __atomic_fetch_sub(&dirty_caches, 1, __ATOMIC_RELAXED);
+    cache->dirty_since = since;
+}
+
+// tag a cached page dirty, and every node above it
+static void TagDirty(PageCache* cache, u64 index){
+    PageCacheNode* node = cache->root;
+    for(u32 level = cache->height; level > 1; level--){
+        u64 slot = SlotOf(index, level);
+        node->dirty |= u64(1) << slot;
+        node = reinterpret_cast<PageCacheNode*>(node->slots[slot]);
+    }
+    u64 bit = u64(1) << SlotOf(index, 1);
+    if(node->dirty & bit) return;
+    node->dirty |= bit;
+    __atomic_fetch_add(&dirty_pages, 1, __ATOMIC_RELAXED);
+    if(cache->dirty_since == 0) SetDirtySince(cache, GetUptimeNanoseconds());
+}
+
+// untag a cached page, nodes above lose their tag once nothing below is dirty
+static void ClearDirty(PageCache* cache, u64 index){
+    PageCacheNode* path[PAGE_CACHE_MAX_HEIGHT];
+    PageCacheNode* node = cache->root;
+    for(u32 level = cache->height; level > 0; level--){
+        path[level - 1] = node;
+        if(level > 1) node = reinterpret_cast<PageCacheNode*>(node->slots[SlotOf(index, level)]);
+    }
+
+    if(path[0]->dirty & (u64(1) << SlotOf(index, 1))) __atomic_fetch_sub(&dirty_pages, 1, __ATOMIC_RELAXED);
+    for(u32 level = 1; level <= cache->height; level++){
+        path[level - 1]->dirty &= ~(u64(1) << SlotOf(index, level));
+        if(path[level - 1]->dirty) break;
+    }
+}
+
+// find first dirty page at or after index in subtree of node
+static bool NextDirty(PageCacheNode* node, u32 level, u64* index){
+    u64 slot = SlotOf(*index, level);
+    while(slot < PAGE_CACHE_SLOTS){
+        u64 dirty = node->dirty & (~u64(0) << slot);
+        if(dirty == 0) return false;
+
+        // skipping ahead starts at beginning of that slot
+        u64 next = __builtin_ctzll(dirty);
+        if(next != slot){
+            slot = next;
+            *index = StartOfSlot(*index, level, slot);
+        }
+        if(level == 1) return true;
+        if(NextDirty(reinterpret_cast<PageCacheNode*>(node->slots[slot]), level - 1, index)) return true;
+
+        slot++;
+        if(slot < PAGE_CACHE_SLOTS) *index = StartOfSlot(*index, level, slot);
+    }
+    return false;
+}
+
+static bool FindDirtyPage(PageCache* cache, u64* index){
+    if(cache->height == 0 || *index > MaxIndex(cache->height)) return false;
+    return NextDirty(cache->root, cache->height, index);
+}
+
+// drop pages from first onwards in subtree of node, only clean pages that
+// nobody else references if unused is set
+// returns true if node is empty afterwards
+static bool DropPages(PageCache* cache, PageCacheNode* node, u32 level, u64 base, u64 first, bool unused){
+    u64 span = u64(1) << (PAGE_CACHE_SHIFT * (level - 1));
+    for(u64 present = node->present; present; present &= present - 1){
+        u64 slot = __builtin_ctzll(present);
+        u64 start = base + slot * span;
+        if(start + span <= first) continue;
+
+        u64 bit = u64(1) << slot;
+        if(level > 1){
+            PageCacheNode* child = reinterpret_cast<PageCacheNode*>(node->slots[slot]);
+            bool empty = DropPages(cache, child, level - 1, start, first, unused);
+            if(empty || child->dirty == 0) node->dirty &= ~bit;
+            if(empty){
+                SlabFree(&page_cache_node_cache, child);
+                node->slots[slot] = nullptr;
+                node->present &= ~bit;
+            }
+            continue;
+        }
+
+        u64 page = reinterpret_cast<u64>(node->slots[slot]);
+        if(unused && ((node->dirty & bit) || GetPageReferenceCount(page) > 1)) continue;
+        // readers and mappings keep their own references
+        ReleasePage(page);
+        UnchargePage(cache);
+        if(node->dirty & bit) __atomic_fetch_sub(&dirty_pages, 1, __ATOMIC_RELAXED);
+        node->slots[slot] = nullptr;
+        node->present &= ~bit;
+        node->dirty &= ~bit;
+        cache->pages--;
+    }
+    return node->present == 0;
+}
+
+static void DropCachedPages(PageCache* cache, u64 first, bool unused){
+    if(cache->height == 0) return;
+    if(DropPages(cache, cache->root, cache->height, 0, first, unused)){
+        SlabFree(&page_cache_node_cache, cache->root);
+        cache->root = nullptr;
+        cache->height = 0;
+    }
+}
+
+/******************** Filling And Writeback ********************/
+
+static void SetFileSize(Inode* inode, u64 size){
+    inode->size = size;
+    if(inode->cache->limit) inode->cache->size = size;
+}
+
+// allocate a zeroed page for a hole of memory cache, mutex of cache is held
+// returns 0 if filesystem is full
+static u64 AllocateMemoryPage(PageCache* cache, u64 index){
+    if(!ChargePage(cache)) return 0;
+    u64 page = AllocatePage();
+    memset(reinterpret_cast<void*>(page), 0, PAGE_SIZE);
+
+    LockGuard guard(cache->lock);
+    if(!InsertPage(cache, index, page)){
+        ReleasePage(page);
+        UnchargePage(cache);
+        return 0;
+    }
+    return page;
+}
+
+// unmap cached pages [first, first + count) from every mapping of file
+// mutex of cache is held
+static void UnmapCachedPages(PageCache* cache, u64 first, u64 count){
+    for(MemoryRegion* region = cache->mappings; region; region = region->mapping_next){
+        u64 region_first = region->file_offset / PAGE_SIZE;
+        u64 region_last = region_first + (region->end - region->start) / PAGE_SIZE;
+        u64 from = first > region_first ? first : region_first;
+        u64 to = count < region_last - first ? first + count : region_last;
+        if(first >= region_last || from >= to) continue;
+        UnmapUserPages(region->space, region->start + (from - region_first) * PAGE_SIZE, to - from);
+    }
+}
+
+// read a page from filesystem, mutex of cache is held
+// returns page with a reference for caller
+static u64 ReadInPage(Inode* inode, u64 index){
+    PageCache* cache = inode->cache;
+    {
+        // somebody may have read it while we waited for mutex
+        LockGuard guard(cache->lock);
+        u64 page = LookupPage(cache, index);
+        if(page){
+            ReferencePage(page);
+            return page;
+        }
+    }
+
+    u64 offset = index * PAGE_SIZE;
+    if(offset >= inode->size) return 0;
+
+    // a hole of memory cache is being mapped, it needs a page of it's own from now on
+    if(cache->limit){
+        u64 page = AllocateMemoryPage(cache, index);
+        if(page) ReferencePage(page);
+        return page;
+    }
+
+    u64 length = inode->size - offset < PAGE_SIZE ? inode->size - offset : PAGE_SIZE;
+    u64 page = AllocatePage();
+    u64 count = inode->ops->read(inode, offset, reinterpret_cast<void*>(page), length);
+    if(count == VFS_ERROR){
+        ReleasePage(page);
+        return 0;
+    }
+    // anything past what filesystem had reads as zero
+    memset(reinterpret_cast<void*>(page + count), 0, PAGE_SIZE - count);
+    __atomic_fetch_add(&pages_read_in, 1, __ATOMIC_RELAXED);
+
+    // one reference for cache, other for caller, who keeps page even if it can't be cached
+    ReferencePage(page);
+    LockGuard guard(cache->lock);
+    if(!InsertPage(cache, index, page)) ReleasePage(page);
+    return page;
+}
+
+// tag pages written through a shared writable mapping, mutex of cache is held
+// returns number of pages found written
+static u64 CollectDirtyPages(PageCache* cache, MemoryRegion* region){
+    if(cache->limit) return 0;
+    if((region->flags & (MAP_SHARED | MAP_READ_WRITE)) != (MAP_SHARED | MAP_READ_WRITE)) return 0;
+
+    u64 num_pages = (region->end - region->start) / PAGE_SIZE;
+    u64 first_index = region->file_offset / PAGE_SIZE;
+    u64 found = 0;
+    TLBBatch batch(region->space);
+    for(u64 first = 0; first < num_pages; first += 64){
+        u64 count = num_pages - first < 64 ? num_pages - first : 64;
+        u64 dirty = CleanUserPages(region->space, region->start + first * PAGE_SIZE, count, &batch);
+        if(dirty == 0) continue;
+
+        // a cpu with dirty bit cached in tlb wouldn't set it again on next write
+        FlushTLBBatch(&batch);
+        LockGuard guard(cache->lock);
+        for(; dirty; dirty &= dirty - 1){
+            u64 index = first_index + first + __builtin_ctzll(dirty);
+            if(LookupPage(cache, index) == 0) continue;
+            TagDirty(cache, index);
+            __atomic_fetch_add(&dirty_pages_found, 1, __ATOMIC_RELAXED);
+            found++;
+        }
+    }
+    return found;
+}
+
+// collect from every mapping of cache, mutex of cache is held
+static u64 CollectMappedDirtyPages(PageCache* cache){
+    u64 found = 0;
+    for(MemoryRegion* region = cache->mappings; region; region = region->mapping_next){
+        found += CollectDirtyPages(cache, region);
+    }
+    return found;
+}
+
+static bool HasWritableMappings(PageCache* cache){
+    for(MemoryRegion* region = cache->mappings; region; region = region->mapping_next){
+        if((region->flags & (MAP_SHARED | MAP_READ_WRITE)) == (MAP_SHARED | MAP_READ_WRITE)) return true;
+    }
+    return false;
+}
+
+// wake writeback thread of device file is on, cache may have become dirty
+static void WakePageCacheWriteback(Inode* inode){
+    if(inode->mount->device) WakeWriteback(inode->mount->device);
+}
+
+// write pages tagged dirty to filesystem, mutex of cache is held
+// returns false if any page failed to write, and adds pages written to written
+// a cache whose mappings were just found written is likely written through
+// them again, so writeback keeps looking at it until a look finds nothing
+static bool WriteDirtyPages(Inode* inode, bool mapped_dirty, u64* written = nullptr){
+    PageCache* cache = inode->cache;
+    bool ok = true;
+    {
+        // anything dirtied from here on is found by next writeback
+        LockGuard guard(cache->lock);
+        SetDirtySince(cache, mapped_dirty && HasWritableMappings(cache) ? GetUptimeNanoseconds() : 0);
+    }
+    for(u64 index = 0;; index++){
+        u64 page;
+        {
+            LockGuard guard(cache->lock);
+            if(!FindDirtyPage(cache, &index)) break;
+            page = LookupPage(cache, index);
+            ClearDirty(cache, index);
+        }
+
+        // part of page past end of file is not written
+        u64 offset = index * PAGE_SIZE;
+        if(offset >= inode->size) continue;
+        u64 length = inode->size - offset < PAGE_SIZE ? inode->size - offset : PAGE_SIZE;
+        if(inode->ops->write(inode, offset, reinterpret_cast<void*>(page), length) != length){
+            // try again on next writeback
+            LockGuard guard(cache->lock);
+            if(LookupPage(cache, index) == page) TagDirty(cache, index);
+            ok = false;
+            continue;
+        }
+        __atomic_fetch_add(&pages_written_back, 1, __ATOMIC_RELAXED);
+        if(written) (*written)++;
+    }
+    return ok;
+}
+
+/******************** Page Cache ********************/
+
+PageCache* CreatePageCache(){
+    void* memory = SlabAllocate(&page_cache_cache);
+    return memory ? new (memory) PageCache(nullptr) : nullptr;
+}
+
+PageCache* CreateMemoryPageCache(PageCacheLimit* limit){
+    void* memory = SlabAllocate(&page_cache_cache);
+    return memory ? new (memory) PageCache(limit) : nullptr;
+}
+
+void FreeMemoryPageCache(PageCache* cache){
+    {
+        LockGuard guard(cache->lock);
+        DropCachedPages(cache, 0, false);
+    }
+    SlabFree(&page_cache_cache, cache);
+}
+
+u64 GetMemoryPageCacheSize(PageCache* cache){
+    return cache->size;
+}
+
+void DestroyPageCache(Inode* inode){
+    PageCache* cache = inode->cache;
+    // file still exists in filesystem that owns it
+    if(cache->limit) return;
+    {
+        // there are no mappings left, so every dirty page is tagged
+        LockGuard guard(cache->mutex);
+        WriteDirtyPages(inode, false);
+        LockGuard tree_guard(cache->lock);
+        DropCachedPages(cache, 0, false);
+        // pages that failed to write are lost with it
+        SetDirtySince(cache, 0);
+    }
+    SlabFree(&page_cache_cache, cache);
+    inode->cache = nullptr;
+}
+
+u64 FindCachedPage(Inode* inode, u64 index){
+    PageCache* cache = inode->cache;
+    // page past end of file may still be cached while file is truncated
+    if(index >= (inode->size + PAGE_SIZE - 1) / PAGE_SIZE) return 0;
+
+    LockGuard guard(cache->lock);
+    u64 page = LookupPage(cache, index);
+    if(page) ReferencePage(page);
+    return page;
+}
+
+u64 GetCachedPage(Inode* inode, u64 index){
+    u64 page = FindCachedPage(inode, index);
+    if(page) return page;
+
+    LockGuard guard(inode->cache->mutex);
+    return ReadInPage(inode, index);
+}
+
+u64 PageCacheRead(Inode* inode, u64 offset, void* buffer, u64 size){
+    u64 file_size = inode->size;
+    if(offset >= file_size) return 0;
+    if(size > file_size - offset) size = file_size - offset;
+
+    bool memory = inode->cache->limit != nullptr;
+    u8* out = reinterpret_cast<u8*>(buffer);
+    u64 done = 0;
+    while(done < size){
+        u64 position = offset + done;
+        u64 skip = position % PAGE_SIZE;
+        u64 count = PAGE_SIZE - skip < size - done ? PAGE_SIZE - skip : size - done;
+
+        // holes of a memory cache are never allocated by reads
+        u64 page = memory ? FindCachedPage(inode, position / PAGE_SIZE) : GetCachedPage(inode, position / PAGE_SIZE);
+        if(page){
+            memcpy(out + done, reinterpret_cast<void*>(page + skip), count);
+            ReleasePage(page);
+        }else if(memory){
+            memset(out + done, 0, count);
+        }else{
+            return done ? done : VFS_ERROR;
+        }
+        done += count;
+    }
+    return done;
+}
+
+// copy to cached pages, mutex of cache is held
+// holes of a memory cache get a page, others are read from filesystem when needed
+// returns number of bytes copied, less than size only if memory cache is full
+static u64 CopyToPages(PageCache* cache, u64 offset, const void* buffer, u64 size){
+    const u8* in = reinterpret_cast<const u8*>(buffer);
+    u64 done = 0;
+    while(done < size){
+        u64 position = offset + done;
+        u64 skip = position % PAGE_SIZE;
+        u64 length = PAGE_SIZE - skip < size - done ? PAGE_SIZE - skip : size - done;
+
+        // page can't be dropped while we hold mutex
+        u64 page;
+        {
+            LockGuard guard(cache->lock);
+            page = LookupPage(cache, position / PAGE_SIZE);
+        }
+        if(page == 0 && cache->limit){
+            page = AllocateMemoryPage(cache, position / PAGE_SIZE);
+            if(page == 0) break;
+        }
+        if(page) memcpy(reinterpret_cast<void*>(page + skip), in + done, length);
+        done += length;
+    }
+    return done;
+}
+
+u64 PageCacheWrite(Inode* inode, u64 offset, const void* buffer, u64 size){
+    PageCache* cache = inode->cache;
+    LockGuard guard(cache->mutex);
+
+    u64 count;
+    if(cache->limit){
+        count = CopyToPages(cache, offset, buffer, size);
+        if(count == 0 && size) return VFS_ERROR;
+    }else{
+        count = inode->ops->write(inode, offset, buffer, size);
+        if(count == VFS_ERROR) return VFS_ERROR;
+        CopyToPages(cache, offset, buffer, count);
+    }
+
+    if(offset + count > inode->size) SetFileSize(inode, offset + count);
+    return count;
+}
+
+u64 PageCacheSplice(Inode* inode, u64 offset, u64* pages, u64 count){
+    PageCache* cache = inode->cache;
+    if(offset % PAGE_SIZE) return 0;
+
+    LockGuard guard(cache->mutex);
+    u64 first = offset / PAGE_SIZE;
+    UnmapCachedPages(cache, first, count);
+
+    u64 moved = 0;
+    for(; moved < count; moved++){
+        u64 index = first + moved;
+        LockGuard tree_guard(cache->lock);
+        void** slot = FindSlot(cache, index);
+        if(slot && *slot){
+            // replaced page stays with whoever still references it
+            ReleasePage(reinterpret_cast<u64>(*slot));
+            *slot = reinterpret_cast<void*>(pages[moved]);
+        }else if(!ChargePage(cache)){
+            break;
+        }else if(!InsertPage(cache, index, pages[moved])){
+            UnchargePage(cache);
+            break;
+        }
+        // file on disk gets page on next sync
+        if(cache->limit == nullptr) TagDirty(cache, index);
+    }
+
+    u64 end = offset + moved * PAGE_SIZE;
+    if(end > inode->size) SetFileSize(inode, end);
+    if(moved && cache->limit == nullptr) WakePageCacheWriteback(inode);
+    return moved;
+}
+
+bool PageCacheTruncate(Inode* inode, u64 size){
+    PageCache* cache = inode->cache;
+    LockGuard guard(cache->mutex);
+    // a memory cache grows without pages, file just gets a hole at end
+    if(cache->limit == nullptr && !inode->ops->truncate(inode, size)) return false;
+
+    u64 old_size = inode->size;
+    SetFileSize(inode, size);
+    if(size >= old_size) return true;
+
+    // new faults already fail past end of file, take away pages that are mapped
+    u64 first = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+    UnmapCachedPages(cache, first, ~u64(0) - first);
+
+    LockGuard tree_guard(cache->lock);
+    DropCachedPages(cache, first, false);
+
+    // rest of last page reads as zero, in case file grows again
+    u64 tail = size % PAGE_SIZE;
+    u64 page = tail ? LookupPage(cache, size / PAGE_SIZE) : 0;
+    if(page) memset(reinterpret_cast<void*>(page + tail), 0, PAGE_SIZE - tail);
+    return true;
+}
+
+bool SyncPageCache(Inode* inode){
+    PageCache* cache = inode->cache;
+    if(cache->limit) return true;
+
+    LockGuard guard(cache->mutex);
+    return WriteDirtyPages(inode, CollectMappedDirtyPages(cache) != 0);
+}
+
+u64 WriteBackPageCache(Inode* inode, u64 dirty_before){
+    u64 since = GetPageCacheDirtyTime(inode);
+    if(since == 0 || since > dirty_before) return 0;
+
+    PageCache* cache = inode->cache;
+    LockGuard guard(cache->mutex);
+    u64 written = 0;
+    WriteDirtyPages(inode, CollectMappedDirtyPages(cache) != 0, &written);
+    return written;
+}
+
+u64 GetPageCacheDirtyTime(Inode* inode){
+    PageCache* cache = inode->cache;
+    if(cache->limit) return 0;
+    LockGuard guard(cache->lock);
+    return cache->dirty_since;
+}
+
+u64 GetPageCacheDirtyPages(){
+    return __atomic_load_n(&dirty_pages, __ATOMIC_RELAXED);
+}
+
+bool HasDirtyPageCaches(){
+    return __atomic_load_n(&dirty_caches, __ATOMIC_RELAXED) != 0;
+}
+
+void InvalidatePageCache(Inode* inode){
+    PageCache* cache = inode->cache;
+    // pages of a memory cache are file itself
+    if(cache == nullptr || cache->limit) return;
+
+    LockGuard guard(cache->mutex);
+    WriteDirtyPages(inode, CollectMappedDirtyPages(cache) != 0);
+
+    LockGuard tree_guard(cache->lock);
+    DropCachedPages(cache, 0, true);
+}
+
+void AddFileMapping(MemoryRegion* region){
+    Inode* inode = region->file->inode;
+    PageCache* cache = inode->cache;
+    {
+        LockGuard guard(cache->mutex);
+        region->mapping_next = cache->mappings;
+        cache->mappings = region;
+        if(cache->limit || !HasWritableMappings(cache)) return;
+
+        // pages written through mapping are found by writeback
+        LockGuard tree_guard(cache->lock);
+        if(cache->dirty_since == 0) SetDirtySince(cache, GetUptimeNanoseconds());
+    }
+    WakePageCacheWriteback(inode);
+}
+
+void RemoveFileMapping(MemoryRegion* region){
+    PageCache* cache = region->file->inode->cache;
+    LockGuard guard(cache->mutex);
+    CollectDirtyPages(cache, region);
+
+    MemoryRegion** link = &cache->mappings;
+    while(*link != region) link = &(*link)->mapping_next;
+    *link = region->mapping_next;
+}
+
+/******************** Page Cache Benchmark ********************/
+
+#define BENCH_PAGE_CACHE_FILE_SIZE (u64(16) * MB)
+// size of every read call
+#define BENCH_PAGE_CACHE_READ_SIZE (u64(64) * KB)
+// where benchmark code and mapped file are in user space
+#define BENCH_PAGE_CACHE_USER_CODE 0x400000
+#define BENCH_PAGE_CACHE_USER_MAP 0x10000000
+// shared mapping writes to every this many'th page
+#define BENCH_PAGE_CACHE_WRITE_STRIDE 8
+
+// parameters of user code, at bottom of it's stack page
+struct PageCacheBenchParams {
+    u64 memory;
+    // qwords to read
+    u64 qwords;
+    // pages to write to
+    u64 writes;
+    // results, written by user code
+    u64 read_cycles;
+    u64 sum;
+};
+
+// user code for benchmark, copied to a user page
+// sums params->qwords qwords of mapped file, then writes to params->writes
+// pages of it, and exits
+asm(R"(
+.text
+.global UserPageCacheBench
+.global UserPageCacheBenchEnd
+UserPageCacheBench:
+    mov %rdi, %rbp
+    mov 0(%rbp), %rsi
+    mov 8(%rbp), %rcx
+    rdtsc
+    shl $32, %rdx
+    or %rax, %rdx
+    mov %rdx, %r12
+    xor %ebx, %ebx
+    test %rcx, %rcx
+    jz 2f
+1:
+    add (%rsi), %rbx
+    add $8, %rsi
+    dec %rcx
+    jnz 1b
+2:
+    rdtsc
+    shl $32, %rdx
+    or %rax, %rdx
+    sub %r12, %rdx
+    mov %rdx, 24(%rbp)
+    mov %rbx, 32(%rbp)
+
+    mov 0(%rbp), %rsi
+    mov 16(%rbp), %rcx
+    test %rcx, %rcx
+    jz 4f
+3:
+    mov %rcx, (%rsi)
+    add $()" STRINGIFY(BENCH_PAGE_CACHE_WRITE_STRIDE) R"( * 0x1000), %rsi
+    dec %rcx
+    jnz 3b
+4:
+    xor %edi, %edi
+    mov $)" STRINGIFY(SYSCALL_EXIT) R"(, %eax
+    syscall
+    ud2
+UserPageCacheBenchEnd:
+)");
+
+extern "C" u8 UserPageCacheBench[];
+extern "C" u8 UserPageCacheBenchEnd[];
+
+// run user code with whole file mapped, file is synced before mapping goes away
+// if sync_ns is not nullptr
+static bool RunMappedBench(File* file, u64 flags, u64 qwords, u64 writes, u64* read_cycles, u64* sum, u64* sync_ns){
+    AddressSpace* space = CreateAddressSpace();
+    u64 code = AllocateUserPage(space, BENCH_PAGE_CACHE_USER_CODE, MAP_PRESENT);
+    memcpy(reinterpret_cast<void*>(code), UserPageCacheBench, UserPageCacheBenchEnd - UserPageCacheBench);
+    u64 stack = AllocateUserPage(space, USER_STACK_TOP - PAGE_SIZE, MAP_PRESENT | MAP_READ_WRITE);
+    if(!AddFileRegion(space, BENCH_PAGE_CACHE_USER_MAP, BENCH_PAGE_CACHE_FILE_SIZE, flags, file, 0)){
+        DestroyAddressSpace(space);
+        return false;
+    }
+
+    PageCacheBenchParams* params = reinterpret_cast<PageCacheBenchParams*>(stack);
+    params->memory = BENCH_PAGE_CACHE_USER_MAP;
+    params->qwords = qwords;
+    params->writes = writes;
+
+    Thread* thread = CreateUserThread("page-cache-bench", space, BENCH_PAGE_CACHE_USER_CODE, USER_STACK_TOP, USER_STACK_TOP - PAGE_SIZE);
+    StartThread(thread);
+    JoinThread(thread);
+    *read_cycles = params->read_cycles;
+    *sum = params->sum;
+
+    if(sync_ns){
+        u64 start = GetUptimeNanoseconds();
+        SyncPageCache(file->inode);
+        *sync_ns = GetUptimeNanoseconds() - start;
+    }
+    DestroyAddressSpace(space);
+    return true;
+}
+
+// read whole file with read calls, returns ns taken and sum of it's qwords
+static u64 TimeReads(File* file, u64* buffer, u64* sum){
+    VFSSeek(file, 0);
+    u64 total = 0;
+    u64 start = GetUptimeNanoseconds();
+    while(true){
+        u64 count = VFSRead(file, buffer, BENCH_PAGE_CACHE_READ_SIZE);
+        if(count == 0 || count == VFS_ERROR) break;
+        for(u64 i = 0; i < count / sizeof(u64); i++) total += buffer[i];
+    }
+    *sum = total;
+    return GetUptimeNanoseconds() - start;
+}
+
+void BenchmarkPageCache(){
+    ColorPrintf(COLOR_YELLOW, COLOR_BLACK, "[+] Benchmark : Page Cache\n");
+
+    BlockDevice* device = FindBlockDevice("nvme0n1");
+    FAT32Volume* volume = device && FormatFAT32(device) ? MountFAT32(device) : nullptr;
+    if(volume == nullptr){
+        Printf("\tNo scratch disk\n");
+        return;
+    }
+    VFSMakeDirectory("/scratch");
+    if(!VFSMountFAT32("/scratch", volume)){
+        Printf("\tFailed to mount scratch disk\n");
+        UnmountFAT32(volume);
+        return;
+    }
+
+    File* file = VFSOpen("/scratch/large", VFS_OPEN_READ | VFS_OPEN_WRITE | VFS_OPEN_CREATE);
+    u64 buffer_pages = BENCH_PAGE_CACHE_READ_SIZE / PAGE_SIZE;
+    u64* buffer = reinterpret_cast<u64*>(AllocateKernelMemory(buffer_pages));
+    u64 qwords = BENCH_PAGE_CACHE_FILE_SIZE / sizeof(u64);
+    bool ok = file != nullptr && file->inode->cache != nullptr;
+
+    // every qword holds it's own index
+    for(u64 offset = 0; ok && offset < BENCH_PAGE_CACHE_FILE_SIZE; offset += BENCH_PAGE_CACHE_READ_SIZE){
+        for(u64 i = 0; i < BENCH_PAGE_CACHE_READ_SIZE / sizeof(u64); i++) buffer[i] = offset / sizeof(u64) + i;
+        ok = VFSWrite(file, buffer, BENCH_PAGE_CACHE_READ_SIZE) == BENCH_PAGE_CACHE_READ_SIZE;
+    }
+    SyncVFS();
+    if(!ok){
+        Printf("\tFailed to create file\n");
+        if(file) VFSClose(file);
+        FreeKernelMemory(reinterpret_cast<u64>(buffer), buffer_pages);
+        VFSUnmount("/scratch");
+        return;
+    }
+    u64 expected = qwords * (qwords - 1) / 2;
+    Printf("\tFile : %lu MB, page cache cold means filesystem blocks are still in buffer cache\n",
+           BENCH_PAGE_CACHE_FILE_SIZE / MB);
+
+    u64 sum;
+    InvalidatePageCache(file->inode);
+    u64 read_in = pages_read_in;
+    u64 cold = TimeReads(file, buffer, &sum);
+    bool match = sum == expected;
+    read_in = pages_read_in - read_in;
+    u64 hot = TimeReads(file, buffer, &sum);
+    match &= sum == expected;
+    Printf("\tread : cold %lu MB/s | cached %lu MB/s | %lu pages read in | %s\n",
+           cold ? BENCH_PAGE_CACHE_FILE_SIZE * 1000 / cold : 0,
+           hot ? BENCH_PAGE_CACHE_FILE_SIZE * 1000 / hot : 0, read_in, match ? "data ok" : "data differs");
+
+    // every page faults once in a new address space, cold ones read their page in first
+    u64 cold_cycles = 0, hot_cycles = 0;
+    InvalidatePageCache(file->inode);
+    read_in = pages_read_in;
+    ok = RunMappedBench(file, MAP_PRESENT, qwords, 0, &cold_cycles, &sum, nullptr);
+    match = sum == expected;
+    read_in = pages_read_in - read_in;
+    ok &= RunMappedBench(file, MAP_PRESENT, qwords, 0, &hot_cycles, &sum, nullptr);
+    match &= sum == expected;
+    cold = CyclesToNanoseconds(cold_cycles);
+    hot = CyclesToNanoseconds(hot_cycles);
+    if(ok){
+        Printf("\tmmap : cold %lu MB/s | cached %lu MB/s | %lu pages read in | %s\n",
+               cold ? BENCH_PAGE_CACHE_FILE_SIZE * 1000 / cold : 0,
+               hot ? BENCH_PAGE_CACHE_FILE_SIZE * 1000 / hot : 0, read_in, match ? "data ok" : "data differs");
+    }else{
+        Printf("\tFailed to map file\n");
+    }
+
+    // writes through a shared mapping are found only through dirty bits of page table entries
+    u64 writes = BENCH_PAGE_CACHE_FILE_SIZE / PAGE_SIZE / BENCH_PAGE_CACHE_WRITE_STRIDE;
+    u64 found = dirty_pages_found;
+    u64 written = pages_written_back;
+    u64 sync_ns = 0;
+    u64 cycles;
+    if(RunMappedBench(file, MAP_PRESENT | MAP_READ_WRITE | MAP_SHARED, 0, writes, &cycles, &sum, &sync_ns)){
+        // read first page back from filesystem, first write put number of writes there
+        u64 first = 0;
+        InvalidatePageCache(file->inode);
+        VFSSeek(file, 0);
+        VFSRead(file, &first, sizeof(first));
+        Printf("\tShared mapping : %lu pages written | %lu found dirty | %lu written back in %lu us | %s\n",
+               writes, dirty_pages_found - found, pages_written_back - written, sync_ns / 1000,
+               first == writes ? "data ok" : "data differs");
+    }
+
+    VFSClose(file);
+    FreeKernelMemory(reinterpret_cast<u64>(buffer), buffer_pages);
+    if(!VFSUnmount("/scratch")) Printf("\tFailed to unmount scratch disk\n");
+}
@@ -0,0 +1,207 @@
+/**
+ * @file PageCache.hpp
+ * @author Siddharth Mishra (brightprogrammer)
+ * @date 10/18/26
+ * @brief Cache of file pages, shared by reads, writes and mapped files.
+ * @copyright MIT License 2022 Siddharth Mishra
+ * */
+
+#ifndef PAGECACHE_HPP
+#define PAGECACHE_HPP
+
+#include "Common.hpp"
+
+struct Inode;
+struct MemoryRegion;
+struct PageCache;
+
+/* ------------------ PAGE CACHE --------------------
+ *
+ * Every regular file inode has a cache of it's pages, indexed by page
+ * number (offset / PAGE_SIZE) in a radix tree with 64 slots per node.
+ * Tree grows in height as larger offsets are cached, so a small file
+ * needs a single node.
+ *
+ * VFS reads are copied out of cached pages, pages missing are read from
+ * filesystem once. Writes go to filesystem right away and update pages
+ * that are cached, so cache never holds data filesystem doesn't have,
+ * except for what was written through a shared mapping.
+ *
+ * Mapped files (see AddFileRegion) map cached pages themselves, a fault
+ * takes a reference to page and installs it in page table. Nothing is
+ * marked when a mapped page is written, cpu sets dirty bit in page table
+ * entry. Sync walks every shared writable mapping of file, clears dirty
+ * bits, flushes tlbs and only then writes pages that were dirty, so a
+ * write that happens during writeback sets dirty bit again and isn't lost.
+ * Pages found this way are tagged dirty in tree, tags are kept up to root,
+ * so writeback finds dirty pages without looking at clean ones.
+ *
+ * Writeback threads (see Writeback.hpp) write back caches that have been
+ * dirty for too long. A cache counts as dirty from when a page is tagged
+ * or a shared writable mapping is added. After writeback it stays dirty
+ * only if it's mappings were found written, since they are likely written
+ * again. Once a look at it's mappings finds nothing, pages written through
+ * them are found only by sync, invalidation or unmapping.
+ *
+ * A memory backed filesystem (see Tmpfs.hpp) has no storage besides
+ * cache. It's caches are created with a limit of pages shared by all of
+ * it's files, pages that are not cached are holes that read as zero and
+ * are allocated only when written, and nothing is ever written back. Such
+ * a cache belongs to filesystem and outlives inodes of it's file.
+ *
+ * Whole pages can also be spliced into a file, cache takes them over
+ * without copying and they are written back like pages of a mapping.
+ *
+ * Tree is protected by a spinlock, because faults look it up with lock of
+ * address space held. Filling pages, writes, truncation and writeback are
+ * serialized by a mutex of cache, since they wait for io.
+ * Lock order is : vfs lock -> cache mutex -> filesystem,
+ * and address space lock -> cache spinlock.
+ *
+ * */
+
+/**
+ * @brief Pages a memory backed filesystem may hold, shared by all it's files.
+ * */
+struct PageCacheLimit {
+    volatile u64 pages;
+    u64 max_pages;
+};
+
+/**
+ * @brief Create an empty cache for a regular file.
+ *
+ * @return nullptr if out of memory, file is then read without a cache.
+ * */
+PageCache* CreatePageCache();
+
+/**
+ * @brief Create a cache that is only storage of a file, it is freed by
+ * filesystem with FreeMemoryPageCache once file is gone.
+ *
+ * @param limit Pages of whole filesystem, each written page takes one.
+ * */
+PageCache* CreateMemoryPageCache(PageCacheLimit* limit);
+
+/**
+ * @brief Free a memory cache and give it's pages back to limit.
+ * File must not be open or mapped anywhere.
+ * */
+void FreeMemoryPageCache(PageCache* cache);
+
+/**
+ * @brief Size of file whose only storage is given memory cache.
+ * */
+u64 GetMemoryPageCacheSize(PageCache* cache);
+
+/**
+ * @brief Write back and free cache of an inode that is going away.
+ * File must not be mapped anywhere. Memory caches are left alone.
+ * */
+void DestroyPageCache(Inode* inode);
+
+/**
+ * @brief Read from file through it's cache.
+ *
+ * @return Number of bytes read, or VFS_ERROR.
+ * */
+u64 PageCacheRead(Inode* inode, u64 offset, void* buffer, u64 size);
+
+/**
+ * @brief Write to file and update cached pages. Size of inode grows if
+ * write goes past end of file.
+ *
+ * @return Number of bytes written, or VFS_ERROR.
+ * */
+u64 PageCacheWrite(Inode* inode, u64 offset, const void* buffer, u64 size);
+
+/**
+ * @brief Move whole pages into file without copying them. Cache takes over
+ * caller's reference to each page. Pages cached at same offsets before
+ * are dropped and unmapped. File grows if pages go past end of it.
+ *
+ * @param offset Page aligned offset of first page in file.
+ * @return Number of pages moved, caller still owns the rest.
+ * */
+u64 PageCacheSplice(Inode* inode, u64 offset, u64* pages, u64 count);
+
+/**
+ * @brief Change size of file. Cached pages past new end of file are dropped,
+ * and unmapped from every mapping of file.
+ * */
+bool PageCacheTruncate(Inode* inode, u64 size);
+
+/**
+ * @brief Write pages dirtied through shared mappings to filesystem.
+ * */
+bool SyncPageCache(Inode* inode);
+
+/**
+ * @brief Write back pages of a file if cache has been dirty since before
+ * given time. Called by writeback threads.
+ *
+ * @param dirty_before Uptime in nanoseconds.
+ * @return Number of pages written.
+ * */
+u64 WriteBackPageCache(Inode* inode, u64 dirty_before);
+
+/**
+ * @brief Uptime in nanoseconds since when cache of a file may have dirty
+ * pages, 0 if it has none.
+ * */
+u64 GetPageCacheDirtyTime(Inode* inode);
+
+/**
+ * @brief Number of pages tagged dirty over all caches. Pages written through
+ * a mapping count only once writeback has found them.
+ * */
+u64 GetPageCacheDirtyPages();
+
+/**
+ * @brief Check if any cache may have dirty pages, without taking any lock.
+ * */
+bool HasDirtyPageCaches();
+
+/**
+ * @brief Write back and drop every cached page that is not mapped,
+ * so that next reads go to filesystem.
+ * */
+void InvalidatePageCache(Inode* inode);
+
+/**
+ * @brief Get a cached page without reading it. Doesn't block, so it can be
+ * called with spinlocks held.
+ *
+ * @param index Page number in file.
+ * @return Kernel address of page with a reference taken for caller,
+ * or 0 if page is not cached or is past end of file.
+ * */
+u64 FindCachedPage(Inode* inode, u64 index);
+
+/**
+ * @brief Get a page of file, reading it in if it's not cached.
+ * Part of page past end of file is zero.
+ *
+ * @return Kernel address of page with a reference taken for caller,
+ * or 0 if page is past end of file or can't be read.
+ * */
+u64 GetCachedPage(Inode* inode, u64 index);
+
+/**
+ * @brief Register a region that maps a file, so that sync finds pages
+ * written through it. Region's file and address space must be set.
+ * */
+void AddFileMapping(MemoryRegion* region);
+
+/**
+ * @brief Unregister a file mapping, collecting it's dirty pages first.
+ * */
+void RemoveFileMapping(MemoryRegion* region);
+
+/**
+ * @brief Read a large file with read and by mapping it, cold and cached,
+ * and write back pages dirtied through a shared mapping.
+ * */
+void BenchmarkPageCache();
+
+#endif // PAGECACHE_HPP
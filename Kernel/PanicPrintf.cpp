@@ -7,6 +7,15 @@
 #include "Renderer.hpp"
 #include "String.hpp"
 
+// cursor position is owned by Printf.cpp
+extern u32 xpos;
+extern u32 ypos;
+
+// panic output doesn't take printf lock, because we may have panicked
+// while holding it (eg: a fault inside Printf) and waiting for it would
+// hang this cpu silently. This means panic output may get mixed with
+// normal output of other cpus, which is fine when system is going down.
+static char panic_buff[2048];
 
 void __attribute__((format(printf, 1, 2)))
 __attribute__((no_caller_saved_registers))
@@ -14,13 +23,15 @@ PanicPrintf(const char* fmtstr, ...){
     // print
     va_list vl;
     va_start(vl, fmtstr);
-    ColorPrintf(COLOR_RED, COLOR_BLACK, fmtstr, vl);
+    vsprintf(panic_buff, fmtstr, vl);
     va_end(vl);
+
+    DrawString(panic_buff, xpos, ypos, COLOR_RED, COLOR_BLACK);
 }
 
 // normal print without formatting
 void  __attribute__((no_caller_saved_registers))
 PanicPuts(const char* str){
     // draw string
-    ColorPuts(COLOR_RED, COLOR_BLACK, str);
+    DrawString(str, xpos, ypos, COLOR_RED, COLOR_BLACK);
 }
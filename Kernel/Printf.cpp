@@ -10,13 +10,19 @@
 #include <cstdarg>
 #include <cstdint>
 
+#include "Printf.hpp"
 #include "String.hpp"
 #include "Renderer.hpp"
 #include "FontData.hpp"
+#include "Spinlock.hpp"
 
 // 2KB printf buffer
 static char kprintf_buff[2048];
 
+// protects printf buffer and cursor position
+// this is taken in interrupt handlers too (keyboard)
+static TicketLock<> print_lock("printf");
+
 // cursor position information
 u32 xpos = 0; // x position for next character
 u32 ypos = 0; // y position for next character
@@ -25,9 +31,11 @@ u32 lastLineXPos = 0; // x position of cursor in last line
 
 // printf for kernel code
 u32 __attribute__((format(printf, 1, 2))) Printf(const char* fmtstr, ...){
+    LockGuard guard(print_lock);
+
     va_list vl;
     va_start(vl, fmtstr);
-    u32 finalstrsz = sprintf(kprintf_buff, fmtstr, vl);
+    u32 finalstrsz = vsprintf(kprintf_buff, fmtstr, vl);
     va_end(vl);
 
     // draw string automatically adjusts xpos and ypos
@@ -40,9 +48,17 @@ u32 __attribute__((format(printf, 1, 2))) Printf(const char* fmtstr, ...){
 u32 __attribute__((format(printf, 3, 4))) ColorPrintf(u32 fgColor, u32 bgColor, const char* fmtstr, ...){
     va_list vl;
     va_start(vl, fmtstr);
-    u32 finalstrsz = sprintf(kprintf_buff, fmtstr, vl);
+    u32 finalstrsz = ColorVPrintf(fgColor, bgColor, fmtstr, vl);
     va_end(vl);
 
+    return finalstrsz;
+}
+
+u32 ColorVPrintf(u32 fgColor, u32 bgColor, const char* fmtstr, va_list vl){
+    LockGuard guard(print_lock);
+
+    u32 finalstrsz = vsprintf(kprintf_buff, fmtstr, vl);
+
     // draw string automatically adjusts xpos and ypos
     DrawString(kprintf_buff, xpos, ypos, fgColor, bgColor);
 
@@ -52,12 +68,14 @@ u32 __attribute__((format(printf, 3, 4))) ColorPrintf(u32 fgColor, u32 bgColor,
 
 // draw a string without any formatting
 void Puts(const char* str){
+    LockGuard guard(print_lock);
     DrawString(str, xpos, ypos);
 }
 
 // puts but with a color
 void ColorPuts(uint32_t fgcolor, uint32_t bgcolor, const char* str){
     // draw with new colors
+    LockGuard guard(print_lock);
     DrawString(str, xpos, ypos, fgcolor, bgcolor);
 }
 
@@ -67,6 +85,7 @@ void PutChar(char c){
         return;
     }
 
+    LockGuard guard(print_lock);
     DrawCharacter(c, xpos, ypos);
 }
 
@@ -76,5 +95,6 @@ void ColorPutChar(uint32_t fgcolor, uint32_t bgcolor, char c){
         return;
     }
     // draw with new colors
+    LockGuard guard(print_lock);
     DrawCharacter(c, xpos, ypos, fgcolor, bgcolor);
 }
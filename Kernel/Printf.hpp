@@ -10,6 +10,8 @@
 #ifndef PRINTF_H_
 #define PRINTF_H_
 
+#include <cstdarg>
+
 #include "Common.hpp"
 #include "Colors.hpp"
 
@@ -34,6 +36,16 @@ u32 __attribute__((format(printf, 1, 2))) Printf(const char* fmtstr, ...);
  * @return Number of bytes printed */
 u32 __attribute__((format(printf, 3, 4))) ColorPrintf(u32 fg, u32 bg, const char* fmtstr, ...);
 
+/**
+ * @brief Same as ColorPrintf but takes a va_list instead of variable arguments.
+ *
+ * @param fg Foreground color.
+ * @param bg Background color.
+ * @param fmtstr Format string.
+ * @param vl Arguments as specified in fmtstr.
+ * @return Number of bytes printed */
+u32 ColorVPrintf(u32 fg, u32 bg, const char* fmtstr, va_list vl);
+
 
 // puts doesn't add a new line here
 void Puts(const char* str);
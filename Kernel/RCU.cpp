@@ -0,0 +1,47 @@
+/**
+ * @file RCU.cpp
+ * @author Siddharth Mishra (brightprogrammer)
+ * @date 10/18/26
+ * @brief Read side sections without locks, and waiting for them to end.
+ * @copyright MIT License 2022 Siddharth Mishra
+ * */
+
+#include "RCU.hpp"
+#include "SMP.hpp"
+#include "Scheduler.hpp"
+#include "CPU.hpp"
+
+void RCUReadLock(){
+    DisablePreemption();
+    CPU* cpu = GetCurrentCPU();
+    if(cpu->rcu_nesting++ == 0){
+        // full barrier, sequence must be visible before we read anything
+        // that a writer may unlink
+        __atomic_fetch_add(&cpu->rcu_sequence, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+void RCUReadUnlock(){
+    CPU* cpu = GetCurrentCPU();
+    if(--cpu->rcu_nesting == 0){
+        // only this cpu writes it's sequence
+        __atomic_store_n(&cpu->rcu_sequence, cpu->rcu_sequence + 1, __ATOMIC_RELEASE);
+    }
+    EnablePreemption();
+}
+
+void SynchronizeRCU(){
+    // unlinking stores must be visible before we look at sequences
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    for(u32 id = 0; id < GetCPUCount(); id++){
+        CPU* cpu = GetCPU(id);
+        u64 sequence = __atomic_load_n(&cpu->rcu_sequence, __ATOMIC_ACQUIRE);
+        if((sequence & 1) == 0) continue;
+
+        // any change means that section ended, even if another has started
+        while(__atomic_load_n(&cpu->rcu_sequence, __ATOMIC_ACQUIRE) == sequence){
+            CPUPause();
+        }
+    }
+}
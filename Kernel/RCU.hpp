@@ -0,0 +1,47 @@
+/**
+ * @file RCU.hpp
+ * @author Siddharth Mishra (brightprogrammer)
+ * @date 10/18/26
+ * @brief Read side sections without locks, and waiting for them to end.
+ * @copyright MIT License 2022 Siddharth Mishra
+ * */
+
+#ifndef RCU_HPP
+#define RCU_HPP
+
+#include "Common.hpp"
+
+/* ------------------ RCU --------------------
+ *
+ * Readers follow pointers without taking any lock and without writing
+ * shared memory. A read section only disables preemption and makes a
+ * per-cpu sequence number odd, it's made even again when section ends.
+ *
+ * Writers unlink an object (under whatever lock protects updates), and
+ * must not free it until every reader that could have seen it is gone.
+ * SynchronizeRCU waits for that : it snapshots sequence of every cpu and
+ * waits until each cpu that was inside a section has moved on. Readers
+ * can't sleep or be preempted, so this never waits long.
+ *
+ * Writers are expected to batch frees, so that one wait covers many
+ * objects.
+ *
+ * */
+
+/**
+ * @brief Start a read section. Sections can be nested, and must not sleep.
+ * */
+void RCUReadLock();
+
+/**
+ * @brief End a read section.
+ * */
+void RCUReadUnlock();
+
+/**
+ * @brief Wait until every read section that was running when this was
+ * called has ended. Must not be called inside a read section.
+ * */
+void SynchronizeRCU();
+
+#endif // RCU_HPP
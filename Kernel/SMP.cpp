@@ -0,0 +1,302 @@
+/**
+ * @file SMP.cpp
+ * @author Siddharth Mishra (brightprogrammer)
+ * @date 10/18/26
+ * @brief Symmetric multiprocessing support. Starts application processors
+ * and provides per-cpu data.
+ * @copyright MIT License 2022 Siddharth Mishra
+ * */
+
+#include "SMP.hpp"
+#include "CPU.hpp"
+#include "IDT.hpp"
+#include "MemoryManager.hpp"
+#include "Printf.hpp"
+#include "String.hpp"
+#include "Timer.hpp"
+#include "APIC.hpp"
+#include "Scheduler.hpp"
+#include "FPU.hpp"
+#include "Syscall.hpp"
+
+// per cpu data for all cpus, index 0 is always boot processor
+static CPU cpus[MAX_CPUS];
+// slots of cpus taken so far, retired ones included
+static u32 cpu_slot_count = 1;
+// online cpus by id, slot of a retired cpu is never given to another one
+static CPU* online_cpus[MAX_CPUS];
+static u32 cpu_count = 1;
+
+// boot processor's double fault stack
+// this is static because bsp needs it before memory manager is initialized
+static u8 bsp_fault_stack[CPU_FAULT_STACK_PAGES * 4096] __attribute__((aligned(16)));
+
+/* ------------------ HOW APPLICATION PROCESSORS BOOT --------------------
+ *
+ * Bootloader starts all application processors (APs) for us and parks them
+ * in a loop that keeps reading goto_address field of their stivale2_smp_info.
+ * As soon as we write a non zero address there, AP jumps to that address
+ * with rsp = target_stack and rdi = pointer to it's stivale2_smp_info.
+ *
+ * At this point AP is still using bootloader's page table, so the target
+ * stack must be mapped in bootloader's page table too. Only higher half
+ * direct map is same in both page tables, so AP first boots on a single
+ * page from direct map, loads kernel's page table and then switches to it's
+ * real stack (that has a guard page) allocated by boot processor.
+ *
+ * An AP that doesn't come online in time is retired : it keeps it's slot
+ * and stacks, which are never given to another cpu, since it may still
+ * start later. Whichever of AP and boot processor first moves boot_state
+ * out of CPU_BOOT_PENDING decides, and a retired AP that starts anyway
+ * parks itself without touching anything shared.
+ *
+ * */
+
+// make this cpu's gs base point to given per-cpu data block
+// must be done after loading segment registers, because loading
+// gs selector in long mode clears gs base
+// user code can load gs itself, so gs base is only trusted in kernel :
+// user gs base waits in kernel gs base and every entry from and return
+// to user mode does swapgs (see SyscallEntry and SwapGSIfFromUser)
+static void LoadPerCPUData(CPU* cpu){
+    WriteMSR(MSR_GS_BASE, reinterpret_cast<u64>(cpu));
+    WriteMSR(MSR_KERNEL_GS_BASE, 0);
+}
+
+// execute work posted by other cpus
+void RunPendingCPUWork(){
+    CPU* cpu = GetCurrentCPU();
+    u64 seq = __atomic_load_n(&cpu->work_sequence, __ATOMIC_ACQUIRE);
+    if(seq != cpu->work_done_sequence){
+        cpu->work_function(cpu->work_argument);
+        __atomic_store_n(&cpu->work_done_sequence, seq, __ATOMIC_RELEASE);
+    }
+}
+
+// runs on real stack of application processor
+extern "C" void __attribute__((noreturn)) APMain(CPU* cpu){
+    InstallGDT(&cpu->gdt, &cpu->tss);
+    cpu->tss.ist[0] = cpu->fault_stack_top;
+    LoadPerCPUData(cpu);
+    LoadIDT();
+    EnableLocalAPIC();
+    EnableFPU();
+    EnableSyscalls();
+
+    // boot processor gave up on us and our id may belong to another cpu now
+    u8 pending = CPU_BOOT_PENDING;
+    if(!__atomic_compare_exchange_n(&cpu->boot_state, &pending, CPU_BOOT_ONLINE, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)){
+        asm volatile("cli");
+        while(true) asm("hlt");
+    }
+
+    __atomic_store_n(&cpu->is_online, true, __ATOMIC_RELEASE);
+
+    // this flow becomes idle thread of this cpu
+    EnterIdleLoop();
+}
+
+// entry point of application processor, jumped to by bootloader
+extern "C" void __attribute__((noreturn)) APEntry(stivale2_smp_info* info){
+    CPU* cpu = reinterpret_cast<CPU*>(info->extra_argument);
+
+    // switch to kernel's page table, after this we can use kernel stacks
+    LoadPageTable();
+
+    // switch to real stack and never come back
+    asm volatile("mov %0, %%rsp\n"
+                 "xor %%rbp, %%rbp\n"
+                 "call APMain\n"
+                 :
+                 : "r"(cpu->stack_top), "D"(cpu)
+                 : "memory");
+    __builtin_unreachable();
+}
+
+void InitializeBootCPU(){
+    CPU* cpu = &cpus[0];
+    cpu->self = cpu;
+    cpu->id = 0;
+    cpu->is_bsp = true;
+    cpu->boot_state = CPU_BOOT_ONLINE;
+    online_cpus[0] = cpu;
+
+    InstallGDT(&cpu->gdt, &cpu->tss);
+    cpu->fault_stack_top = reinterpret_cast<u64>(bsp_fault_stack) + sizeof(bsp_fault_stack);
+    cpu->tss.ist[0] = cpu->fault_stack_top;
+    LoadPerCPUData(cpu);
+
+    cpu->is_online = true;
+}
+
+void InitializeSMP(stivale2_struct* sysinfo_struct){
+    stivale2_struct_tag_smp* smp_tag = nullptr;
+    smp_tag = (stivale2_struct_tag_smp*)stivale2_get_tag(sysinfo_struct, STIVALE2_STRUCT_TAG_SMP_ID);
+
+    // bootloader didn't start any other cpu
+    if(smp_tag == nullptr){
+        ColorPrintf(COLOR_YELLOW, COLOR_BLACK, "[!] No SMP information from bootloader, running on BSP only\n");
+        return;
+    }
+
+    cpus[0].lapic_id = smp_tag->bsp_lapic_id;
+
+    for(u64 i = 0; i < smp_tag->cpu_count; i++){
+        stivale2_smp_info* info = &smp_tag->smp_info[i];
+
+        // boot processor is already running
+        if(info->lapic_id == smp_tag->bsp_lapic_id){
+            continue;
+        }
+
+        if(cpu_slot_count >= MAX_CPUS){
+            ColorPrintf(COLOR_YELLOW, COLOR_BLACK, "[!] Only %u CPUs are supported\n", MAX_CPUS);
+            break;
+        }
+
+        CPU* cpu = &cpus[cpu_slot_count++];
+        cpu->self = cpu;
+        cpu->id = cpu_count;
+        cpu->lapic_id = info->lapic_id;
+        cpu->is_bsp = false;
+        cpu->stack_top = AllocateKernelStack(CPU_STACK_PAGES);
+        cpu->fault_stack_top = AllocateKernelStack(CPU_FAULT_STACK_PAGES);
+
+        // a single page from higher half direct map is mapped in bootloader's
+        // page table too, see explanation above
+        u64 boot_stack = AllocatePage();
+        info->target_stack = boot_stack + PAGE_SIZE;
+        info->extra_argument = reinterpret_cast<u64>(cpu);
+
+        // writing goto address makes ap jump to it
+        __atomic_store_n(&info->goto_address, reinterpret_cast<u64>(APEntry), __ATOMIC_SEQ_CST);
+
+        // wait for ap to come online, but don't wait forever
+        u64 timeout = ReadTimestampCounter() + GetTimestampFrequency();
+        while(!__atomic_load_n(&cpu->is_online, __ATOMIC_ACQUIRE)){
+            if(ReadTimestampCounter() > timeout) break;
+            CPUPause();
+        }
+
+        // retire a cpu that didn't make it, unless it just did
+        if(!cpu->is_online){
+            u8 pending = CPU_BOOT_PENDING;
+            if(__atomic_compare_exchange_n(&cpu->boot_state, &pending, CPU_BOOT_RETIRED, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)){
+                ColorPrintf(COLOR_RED, COLOR_BLACK, "[-] CPU with LAPIC ID %u failed to start\n", info->lapic_id);
+                continue;
+            }
+            while(!__atomic_load_n(&cpu->is_online, __ATOMIC_ACQUIRE)) CPUPause();
+        }
+
+        // boot stack is not needed once ap is on it's real stack
+        FreePage(boot_stack);
+        online_cpus[cpu_count++] = cpu;
+    }
+
+    Printf("\tOnline CPUs : %u\n", cpu_count);
+}
+
+u32 GetCPUCount(){
+    return cpu_count;
+}
+
+CPU* GetCPU(u32 id){
+    if(id >= cpu_count) return nullptr;
+    return online_cpus[id];
+}
+
+void RunOnCPU(u32 id, CPUWorkFunction function, void* arg){
+    CPU* cpu = GetCPU(id);
+    if(cpu == nullptr || cpu->is_bsp) return;
+
+    cpu->work_function = function;
+    cpu->work_argument = arg;
+    // publishing sequence number makes function and argument visible
+    __atomic_store_n(&cpu->work_sequence, cpu->work_sequence + 1, __ATOMIC_RELEASE);
+
+    // cpu may be sleeping in it's idle loop
+    SendIPI(cpu->lapic_id, APIC_RESCHEDULE_VECTOR);
+}
+
+void WaitForCPU(u32 id){
+    CPU* cpu = GetCPU(id);
+    if(cpu == nullptr || cpu->is_bsp) return;
+
+    while(__atomic_load_n(&cpu->work_done_sequence, __ATOMIC_ACQUIRE) != cpu->work_sequence){
+        CPUPause();
+    }
+}
+
+/******************** Parallel Page Zeroing Benchmark ********************/
+
+#define BENCH_ZERO_PAGES 4096
+#define BENCH_ZERO_ITERATIONS 4
+
+struct PageZeroWork {
+    u64* pages;
+    u64 begin;
+    u64 end;
+};
+
+static u64 bench_pages[BENCH_ZERO_PAGES];
+static PageZeroWork bench_work[MAX_CPUS];
+
+static void ZeroPages(void* arg){
+    PageZeroWork* work = reinterpret_cast<PageZeroWork*>(arg);
+    for(u64 i = work->begin; i < work->end; i++){
+        memset(reinterpret_cast<void*>(work->pages[i]), 0, PAGE_SIZE);
+    }
+}
+
+// zero all benchmark pages using first n cpus and return cycles taken
+static u64 ZeroPagesOnCPUs(u32 n){
+    u64 per_cpu = BENCH_ZERO_PAGES / n;
+    for(u32 c = 0; c < n; c++){
+        bench_work[c].pages = bench_pages;
+        bench_work[c].begin = c * per_cpu;
+        // last cpu takes the remainder
+        bench_work[c].end = (c == n - 1) ? BENCH_ZERO_PAGES : (c + 1) * per_cpu;
+    }
+
+    u64 start = ReadTimestampCounterSerialized();
+    for(u32 c = 1; c < n; c++){
+        RunOnCPU(c, ZeroPages, &bench_work[c]);
+    }
+    // boot processor does it's share too
+    ZeroPages(&bench_work[0]);
+    for(u32 c = 1; c < n; c++){
+        WaitForCPU(c);
+    }
+    return ReadTimestampCounterSerialized() - start;
+}
+
+void BenchmarkParallelPageZeroing(){
+    ColorPrintf(COLOR_YELLOW, COLOR_BLACK, "[+] Benchmark : Parallel Page Zeroing (%u KB)\n", u32(BENCH_ZERO_PAGES * (PAGE_SIZE / KB)));
+
+    for(u64 i = 0; i < BENCH_ZERO_PAGES; i++){
+        bench_pages[i] = AllocatePage();
+    }
+
+    // warm up tlb and caches once
+    ZeroPagesOnCPUs(1);
+
+    u64 bytes = BENCH_ZERO_PAGES * PAGE_SIZE;
+    for(u32 n = 1; n <= cpu_count; n++){
+        // powers of two and total cpu count are enough to show scaling
+        if((n & (n - 1)) != 0 && n != cpu_count) continue;
+
+        u64 best = ~u64(0);
+        for(u32 iter = 0; iter < BENCH_ZERO_ITERATIONS; iter++){
+            u64 cycles = ZeroPagesOnCPUs(n);
+            if(cycles < best) best = cycles;
+        }
+
+        u64 ns = CyclesToNanoseconds(best);
+        u64 mbps = ns ? (bytes * 1000) / ns : 0;
+        Printf("\tCPUs : %u | Cycles : %lu | Throughput : %lu MB/s\n", n, best, mbps);
+    }
+
+    for(u64 i = 0; i < BENCH_ZERO_PAGES; i++){
+        FreePage(bench_pages[i]);
+    }
+}
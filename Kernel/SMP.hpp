@@ -0,0 +1,183 @@
+/**
+ * @file SMP.hpp
+ * @author Siddharth Mishra (brightprogrammer)
+ * @date 10/18/26
+ * @brief Symmetric multiprocessing support. Starts application processors
+ * and provides per-cpu data.
+ * @copyright MIT License 2022 Siddharth Mishra
+ * */
+
+#ifndef SMP_HPP
+#define SMP_HPP
+
+#include <cstddef>
+
+#include "Common.hpp"
+#include "GDT.hpp"
+#include "stivale2.hpp"
+
+// maximum number of cpus kernel can handle
+#define MAX_CPUS 64
+
+// number of pages in per cpu boot stack
+#define CPU_STACK_PAGES 4
+// number of pages in per cpu double fault stack
+#define CPU_FAULT_STACK_PAGES 2
+
+// boot states of a cpu, see InitializeSMP
+#define CPU_BOOT_PENDING 0
+#define CPU_BOOT_ONLINE 1
+#define CPU_BOOT_RETIRED 2
+
+// function executed on a remote cpu
+typedef void (*CPUWorkFunction)(void* arg);
+
+struct Thread;
+struct AddressSpace;
+struct TLBBatch;
+
+// offsets of members of CPU used by system call entry code
+#define CPU_SYSCALL_KERNEL_RSP 8
+#define CPU_SYSCALL_USER_RSP 16
+
+/**
+ * @brief Per-cpu data block. Every cpu's gs base points to it's own block.
+ * */
+struct CPU {
+    // address of this structure, read through gs:0 because we can't read
+    // gs base without a msr read or fsgsbase extension
+    CPU* self;
+
+    // kernel stack of current thread, loaded on system call entry
+    u64 syscall_kernel_rsp;
+    // user stack pointer saved on system call entry
+    u64 syscall_user_rsp;
+
+    // index of this cpu among online cpus, see GetCPU
+    u32 id;
+    // local apic id
+    u32 lapic_id;
+
+    bool is_bsp;
+    volatile bool is_online;
+    // decided once, by ap coming online or by boot processor giving up on it
+    volatile u8 boot_state;
+
+    // top of stack this cpu booted with
+    u64 stack_top;
+    // top of stack used for double faults (ist1)
+    u64 fault_stack_top;
+
+    // work posted for this cpu by other cpus
+    // work_sequence is incremented after posting work and
+    // work_done_sequence is made equal to it once work is done
+    CPUWorkFunction volatile work_function;
+    void* volatile work_argument;
+    volatile u64 work_sequence;
+    volatile u64 work_done_sequence;
+
+    // scheduler state
+    Thread* current_thread;
+    Thread* idle_thread;
+    // thread we just switched away from, see FinishSwitch
+    Thread* previous_thread;
+    // number of timer interrupts on this cpu
+    volatile u64 ticks;
+    // tick at which current thread will be preempted
+    u64 slice_end_tick;
+    // preemption is disabled while this is non zero
+    u32 preempt_count;
+    // a preemption was skipped because preemption was disabled
+    bool need_resched;
+
+    // depth of nested rcu read sections, see RCU.hpp
+    u32 rcu_nesting;
+    // odd while cpu is in a read section
+    volatile u64 rcu_sequence;
+
+    // fpu state, see FPU.cpp
+    // true when CR0.TS is clear and fpu can be used without trapping
+    bool fpu_live;
+    // depth of nested kernel fpu sections
+    u32 kernel_fpu_depth;
+    // id of thread whose state is in fpu registers
+    u64 fpu_owner_id;
+
+    // address space loaded in cr3
+    AddressSpace* address_space;
+    // tlb flush posted by another cpu, see FlushTLBBatch
+    TLBBatch* tlb_flush_request;
+
+    TSS tss;
+    GDT gdt;
+} __attribute__((aligned(0x1000)));
+
+static_assert(offsetof(CPU, self) == 0, "CPU::self must be first member");
+static_assert(offsetof(CPU, syscall_kernel_rsp) == CPU_SYSCALL_KERNEL_RSP, "CPU_SYSCALL_KERNEL_RSP doesn't match CPU layout");
+static_assert(offsetof(CPU, syscall_user_rsp) == CPU_SYSCALL_USER_RSP, "CPU_SYSCALL_USER_RSP doesn't match CPU layout");
+
+/**
+ * @brief Get per-cpu data of cpu executing this code.
+ * */
+inline CPU* GetCurrentCPU(){
+    CPU* cpu;
+    asm volatile("mov %%gs:0, %0" : "=r"(cpu));
+    return cpu;
+}
+
+/**
+ * @brief Setup per-cpu data, gdt and tss for boot processor.
+ * Must be called after InstallGDT and before anything that uses
+ * per-cpu data. This doesn't allocate memory.
+ * */
+void InitializeBootCPU();
+
+/**
+ * @brief Start all application processors reported by bootloader.
+ * Returns after all processors are online (or have timed out).
+ *
+ * @param sysinfo_struct Structure provided by stivale2 bootloader.
+ * */
+void InitializeSMP(stivale2_struct* sysinfo_struct);
+
+/**
+ * @brief Get number of cpus that are online.
+ * */
+u32 GetCPUCount();
+
+/**
+ * @brief Get per-cpu data of cpu with given index.
+ *
+ * @return nullptr if no such cpu.
+ * */
+CPU* GetCPU(u32 id);
+
+/**
+ * @brief Make given cpu execute given function asynchronously.
+ * Caller must wait for previous work to complete before posting new work.
+ *
+ * @param id Index of cpu.
+ * @param function Function to execute.
+ * @param arg Argument passed to function.
+ * */
+void RunOnCPU(u32 id, CPUWorkFunction function, void* arg);
+
+/**
+ * @brief Execute work posted for current cpu by RunOnCPU, if any.
+ * Idle loop of every application processor calls this.
+ * */
+void RunPendingCPUWork();
+
+/**
+ * @brief Wait until cpu completes the work posted by RunOnCPU.
+ *
+ * @param id Index of cpu.
+ * */
+void WaitForCPU(u32 id);
+
+/**
+ * @brief Zero the same set of pages with 1..n cpus and report throughput.
+ * */
+void BenchmarkParallelPageZeroing();
+
+#endif // SMP_HPP
@@ -0,0 +1,625 @@
+/**
+ * @file Scheduler.cpp
+ * @author Siddharth Mishra (brightprogrammer)
+ * @date 10/18/26
+ * @brief Preemptive work stealing scheduler for kernel threads.
+ * @copyright MIT License 2022 Siddharth Mishra
+ * */
+
+#include "Scheduler.hpp"
+#include "SMP.hpp"
+#include "CPU.hpp"
+#include "APIC.hpp"
+#include "Printf.hpp"
+#include "Timer.hpp"
+#include "FPU.hpp"
+#include "MemoryManager.hpp"
+#include "Spinlock.hpp"
+
+/* ------------------ HOW SWITCHING WORKS --------------------
+ *
+ * Schedule always runs with interrupts disabled. It picks next thread,
+ * remembers current thread in cpu->previous_thread and switches stacks.
+ * Whatever runs next (returning from it's own call to Schedule, or
+ * ThreadStart for a new thread) calls FinishSwitch, which decides what
+ * to do with previous thread now that no one is using it's stack :
+ *
+ *  - Running : it was preempted or yielded, put it back in run queue
+ *  - Blocked : someone else will wake it up, do nothing
+ *  - Dead : free it's stack (and thread itself if it's detached)
+ *
+ * on_cpu of previous thread is cleared only after this, so another cpu
+ * never switches to a thread whose registers haven't been saved yet.
+ *
+ * */
+
+/* ------------------ RUN QUEUES --------------------
+ *
+ * Every cpu has it's own run queue. A run queue is a Chase-Lev deque,
+ * only the owning cpu pushes threads at bottom and anyone (including
+ * owner) takes threads from top with a single CAS. Owner taking from top
+ * too keeps order of threads on a cpu round robin instead of LIFO.
+ *
+ * Other cpus can't push into the deque, so wakeups of threads that last
+ * ran on another cpu go to a lock free inbox (a singly linked stack) of
+ * that cpu, which owner moves into it's deque when it schedules.
+ *
+ * When a cpu runs out of work it finds the peer with longest queue and
+ * steals half of it's threads.
+ *
+ * */
+
+// must be a power of two
+#define RUN_QUEUE_CAPACITY 1024
+
+struct RunQueue {
+    // next slot to take from, modified by anyone
+    volatile i64 top __attribute__((aligned(64)));
+    // next slot to push to, modified only by owner
+    volatile i64 bottom __attribute__((aligned(64)));
+    Thread* slots[RUN_QUEUE_CAPACITY];
+
+    // threads woken up by other cpus
+    Thread* inbox __attribute__((aligned(64)));
+    // changed by other cpus to wake this cpu from mwait
+    volatile u64 wake_generation;
+
+    // number of steal operations and threads stolen by this cpu
+    u64 steals;
+    u64 stolen_threads;
+} __attribute__((aligned(64)));
+
+static RunQueue run_queues[MAX_CPUS];
+
+// bit n is set while cpu n is waiting for work in it's idle loop
+static volatile u64 idle_cpu_mask = 0;
+
+// only cpus in this mask run threads, used by benchmark to measure scaling
+static volatile u64 scheduler_cpu_mask = ~u64(0);
+
+// set if cpu supports monitor/mwait
+static bool has_mwait = false;
+
+static inline bool IsSchedulingOn(u32 id){
+    return id < GetCPUCount() && (scheduler_cpu_mask & (u64(1) << id));
+}
+
+static inline i64 GetQueueLength(RunQueue* rq){
+    i64 length = __atomic_load_n(&rq->bottom, __ATOMIC_RELAXED) - __atomic_load_n(&rq->top, __ATOMIC_RELAXED);
+    return length > 0 ? length : 0;
+}
+
+// push at bottom, only owner may call this
+// returns false if queue is full
+static bool PushThread(RunQueue* rq, Thread* thread){
+    i64 b = __atomic_load_n(&rq->bottom, __ATOMIC_RELAXED);
+    i64 t = __atomic_load_n(&rq->top, __ATOMIC_ACQUIRE);
+    if(b - t >= RUN_QUEUE_CAPACITY) return false;
+
+    __atomic_store_n(&rq->slots[b & (RUN_QUEUE_CAPACITY - 1)], thread, __ATOMIC_RELAXED);
+    // slot must be visible before new bottom
+    __atomic_store_n(&rq->bottom, b + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+// take a thread from top, anyone may call this
+// returns nullptr if queue is empty or we lost a race
+static Thread* StealThread(RunQueue* rq){
+    i64 t = __atomic_load_n(&rq->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    i64 b = __atomic_load_n(&rq->bottom, __ATOMIC_ACQUIRE);
+    if(t >= b) return nullptr;
+
+    Thread* thread = __atomic_load_n(&rq->slots[t & (RUN_QUEUE_CAPACITY - 1)], __ATOMIC_RELAXED);
+    if(!__atomic_compare_exchange_n(&rq->top, &t, t + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)){
+        return nullptr;
+    }
+    return thread;
+}
+
+// push on inbox of a run queue, anyone may call this
+static void PushInbox(RunQueue* rq, Thread* thread){
+    Thread* head = __atomic_load_n(&rq->inbox, __ATOMIC_RELAXED);
+    do{
+        thread->next = head;
+    }while(!__atomic_compare_exchange_n(&rq->inbox, &head, thread, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+// move remote wakeups to deque, only owner may call this
+static void DrainInbox(RunQueue* rq){
+    if(__atomic_load_n(&rq->inbox, __ATOMIC_RELAXED) == nullptr) return;
+    Thread* list = __atomic_exchange_n(&rq->inbox, nullptr, __ATOMIC_ACQUIRE);
+
+    // inbox is lifo, reverse it so threads are run in order they were woken up
+    Thread* reversed = nullptr;
+    while(list){
+        Thread* next = list->next;
+        list->next = reversed;
+        reversed = list;
+        list = next;
+    }
+
+    while(reversed){
+        Thread* next = reversed->next;
+        reversed->next = nullptr;
+        // deque is full, keep rest for later
+        if(!PushThread(rq, reversed)){
+            PushInbox(rq, reversed);
+        }
+        reversed = next;
+    }
+}
+
+// wake a cpu waiting in it's idle loop
+static void KickCPU(u32 id){
+    if(!(__atomic_load_n(&idle_cpu_mask, __ATOMIC_SEQ_CST) & (u64(1) << id))) return;
+
+    if(has_mwait){
+        __atomic_fetch_add(&run_queues[id].wake_generation, 1, __ATOMIC_RELEASE);
+    }else{
+        SendIPI(GetCPU(id)->lapic_id, APIC_RESCHEDULE_VECTOR);
+    }
+}
+
+// wake one idle cpu, other than given one, so it can steal work
+static void KickIdleCPU(u32 self){
+    u64 mask = __atomic_load_n(&idle_cpu_mask, __ATOMIC_SEQ_CST) & ~(u64(1) << self) & scheduler_cpu_mask;
+    if(mask){
+        KickCPU(__builtin_ctzll(mask));
+    }
+}
+
+// put thread in run queue of current cpu
+static void EnqueueLocal(u32 self, Thread* thread){
+    RunQueue* rq = &run_queues[self];
+    if(!PushThread(rq, thread)){
+        PushInbox(rq, thread);
+    }
+    // there's more work than this cpu can do right now
+    KickIdleCPU(self);
+}
+
+// steal half of threads from longest run queue of other cpus
+// first stolen thread is returned, rest are put in our own queue
+static Thread* StealFromBusiestCPU(u32 self){
+    u32 count = GetCPUCount();
+    u32 victim = self;
+    i64 longest = 0;
+    for(u32 id = 0; id < count; id++){
+        if(id == self || !IsSchedulingOn(id)) continue;
+        i64 length = GetQueueLength(&run_queues[id]);
+        if(length > longest){
+            longest = length;
+            victim = id;
+        }
+    }
+    if(victim == self) return nullptr;
+
+    RunQueue* rq = &run_queues[self];
+    RunQueue* victim_rq = &run_queues[victim];
+    Thread* first = nullptr;
+    i64 to_steal = (longest + 1) / 2;
+    i64 stolen = 0;
+    for(; stolen < to_steal; stolen++){
+        Thread* thread = StealThread(victim_rq);
+        if(thread == nullptr) break;
+
+        if(first == nullptr){
+            first = thread;
+        }else if(!PushThread(rq, thread)){
+            PushInbox(rq, thread);
+        }
+    }
+
+    if(stolen){
+        rq->steals++;
+        rq->stolen_threads += stolen;
+    }
+    return first;
+}
+
+static Thread* PickNextThread(u32 self){
+    if(!IsSchedulingOn(self)) return nullptr;
+
+    RunQueue* rq = &run_queues[self];
+    DrainInbox(rq);
+
+    Thread* thread = StealThread(rq);
+    if(thread == nullptr){
+        thread = StealFromBusiestCPU(self);
+    }
+    return thread;
+}
+
+// check if there's anything this cpu can run
+static bool HasRunnableThreads(u32 self){
+    if(!IsSchedulingOn(self)) return false;
+
+    RunQueue* rq = &run_queues[self];
+    if(GetQueueLength(rq) || __atomic_load_n(&rq->inbox, __ATOMIC_RELAXED)) return true;
+
+    u32 count = GetCPUCount();
+    for(u32 id = 0; id < count; id++){
+        if(id != self && IsSchedulingOn(id) && GetQueueLength(&run_queues[id])) return true;
+    }
+    return false;
+}
+
+void MakeThreadReady(Thread* thread){
+    u64 flags = SaveFlagsAndDisableInterrupts();
+    u32 self = GetCurrentCPU()->id;
+    u32 target = thread->last_cpu;
+
+    if(target == self || !IsSchedulingOn(target)){
+        EnqueueLocal(self, thread);
+    }else{
+        // prefer cpu thread last ran on, it's cache is still warm
+        PushInbox(&run_queues[target], thread);
+        KickCPU(target);
+    }
+
+    RestoreFlags(flags);
+}
+
+void Schedule(){
+    CPU* cpu = GetCurrentCPU();
+    Thread* prev = cpu->current_thread;
+    Thread* next = PickNextThread(cpu->id);
+
+    if(next == nullptr){
+        // nothing else to run, keep running current thread if it can
+        if(prev->state == ThreadState::Running){
+            cpu->slice_end_tick = cpu->ticks + SCHEDULER_TIME_SLICE_TICKS;
+            return;
+        }
+        next = cpu->idle_thread;
+    }
+
+    // thread was woken up before it could switch away
+    if(next == prev){
+        prev->state = ThreadState::Running;
+        cpu->slice_end_tick = cpu->ticks + SCHEDULER_TIME_SLICE_TICKS;
+        return;
+    }
+
+    // another cpu may still be saving registers of next thread
+    while(__atomic_load_n(&next->on_cpu, __ATOMIC_ACQUIRE)){
+        CPUPause();
+    }
+
+    next->on_cpu = true;
+    next->state = ThreadState::Running;
+    next->last_cpu = cpu->id;
+    cpu->previous_thread = prev;
+    cpu->current_thread = next;
+    cpu->slice_end_tick = cpu->ticks + SCHEDULER_TIME_SLICE_TICKS;
+    cpu->need_resched = false;
+
+    // next thread restores it's fpu state lazily
+    SaveFPUStateOnSwitch(prev);
+
+    // user threads enter kernel on their own kernel stack
+    if(next->address_space){
+        cpu->tss.rsp0 = next->stack_top;
+        cpu->syscall_kernel_rsp = next->stack_top;
+        SwitchAddressSpace(next->address_space);
+    }else{
+        SwitchAddressSpace(GetKernelAddressSpace());
+    }
+
+    SwitchContext(&prev->rsp, next->rsp);
+
+    // we may be on a different cpu now
+    FinishSwitch();
+}
+
+void FinishSwitch(){
+    CPU* cpu = GetCurrentCPU();
+    Thread* prev = cpu->previous_thread;
+    cpu->previous_thread = nullptr;
+    if(prev == nullptr) return;
+
+    if(prev->state == ThreadState::Dead){
+        // thread may be freed, so don't touch it after this
+        __atomic_store_n(&prev->on_cpu, false, __ATOMIC_RELEASE);
+        DestroyThread(prev);
+        return;
+    }
+
+    // idle threads never go in run queue
+    bool requeue = prev->state == ThreadState::Running && prev != cpu->idle_thread;
+    if(requeue){
+        prev->state = ThreadState::Ready;
+    }
+    __atomic_store_n(&prev->on_cpu, false, __ATOMIC_RELEASE);
+    if(requeue){
+        EnqueueLocal(cpu->id, prev);
+    }
+}
+
+void Yield(){
+    u64 flags = SaveFlagsAndDisableInterrupts();
+    Schedule();
+    RestoreFlags(flags);
+}
+
+/******************** Sleep Timers ********************/
+
+// a thread blocked until a deadline, lives on it's stack
+struct SleepTimer {
+    Thread* thread;
+    u64 deadline;
+    SleepTimer* next;
+};
+
+// sorted by deadline, so ticks only ever look at first one
+static TicketLock<> sleep_timer_lock("scheduler.timers");
+static SleepTimer* sleep_timers = nullptr;
+static volatile u64 next_sleep_deadline = ~u64(0);
+
+// wake threads whose deadline has passed, called on every tick
+static void ExpireSleepTimers(){
+    u64 now = GetUptimeNanoseconds();
+    if(__atomic_load_n(&next_sleep_deadline, __ATOMIC_RELAXED) > now) return;
+
+    // waking under lock, so once sleeper has taken lock after waking up
+    // no stale wakeup of this timer can reach it
+    LockGuard guard(sleep_timer_lock);
+    while(sleep_timers && sleep_timers->deadline <= now){
+        SleepTimer* timer = sleep_timers;
+        sleep_timers = timer->next;
+        WakeThread(timer->thread);
+    }
+    __atomic_store_n(&next_sleep_deadline, sleep_timers ? sleep_timers->deadline : ~u64(0), __ATOMIC_RELAXED);
+}
+
+void BlockCurrentThreadUntil(u64 deadline){
+    SleepTimer timer = {GetCurrentThread(), deadline, nullptr};
+    {
+        LockGuard guard(sleep_timer_lock);
+        SleepTimer** link = &sleep_timers;
+        while(*link && (*link)->deadline <= deadline) link = &(*link)->next;
+        timer.next = *link;
+        *link = &timer;
+        __atomic_store_n(&next_sleep_deadline, sleep_timers->deadline, __ATOMIC_RELAXED);
+    }
+
+    BlockCurrentThread();
+
+    // woken by someone else, timer is still queued
+    LockGuard guard(sleep_timer_lock);
+    for(SleepTimer** link = &sleep_timers; *link; link = &(*link)->next){
+        if(*link == &timer){
+            *link = timer.next;
+            break;
+        }
+    }
+    __atomic_store_n(&next_sleep_deadline, sleep_timers ? sleep_timers->deadline : ~u64(0), __ATOMIC_RELAXED);
+}
+
+void SchedulerTick(){
+    CPU* cpu = GetCurrentCPU();
+    cpu->ticks++;
+
+    Thread* current = cpu->current_thread;
+    if(current == nullptr) return;
+
+    ExpireSleepTimers();
+    if(cpu->preempt_count){
+        cpu->need_resched = true;
+        return;
+    }
+
+    // idle cpu also looks for something to steal on every tick
+    if(current == cpu->idle_thread){
+        if(HasRunnableThreads(cpu->id)) Schedule();
+    }else if(cpu->ticks >= cpu->slice_end_tick){
+        Schedule();
+    }
+}
+
+void DisablePreemption(){
+    // we can't be moved to another cpu between reading cpu and incrementing,
+    // because that needs a preemption, which increment itself prevents
+    GetCurrentCPU()->preempt_count++;
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+}
+
+void EnablePreemption(){
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    CPU* cpu = GetCurrentCPU();
+    if(--cpu->preempt_count == 0 && cpu->need_resched &&
+       (ReadFlags() & RFLAGS_INTERRUPT_ENABLE) && cpu->current_thread){
+        Yield();
+    }
+}
+
+bool IsSchedulerRunning(){
+    return GetCurrentCPU()->current_thread != nullptr;
+}
+
+// check if another cpu posted work using RunOnCPU
+static inline bool HasPendingCPUWork(CPU* cpu){
+    return __atomic_load_n(&cpu->work_sequence, __ATOMIC_ACQUIRE) != cpu->work_done_sequence;
+}
+
+// wait for an interrupt or for someone to kick us
+// interrupts must be disabled, they're enabled on return
+static void WaitForWork(CPU* cpu){
+    RunQueue* rq = &run_queues[cpu->id];
+    u64 bit = u64(1) << cpu->id;
+
+    if(has_mwait){
+        asm volatile("monitor" :: "a"(&rq->wake_generation), "c"(0), "d"(0));
+    }
+
+    // cpus that make work for us check idle mask after publishing work,
+    // so checking for work after setting our bit means no wakeup is lost
+    __atomic_fetch_or(&idle_cpu_mask, bit, __ATOMIC_SEQ_CST);
+    if(!HasRunnableThreads(cpu->id) && !HasPendingCPUWork(cpu)){
+        // sti delays interrupts by one instruction, so there's no
+        // window for an interrupt to be missed before mwait or hlt
+        if(has_mwait){
+            asm volatile("sti; mwait" :: "a"(0), "c"(0));
+        }else{
+            asm volatile("sti; hlt");
+        }
+    }
+    __atomic_fetch_and(&idle_cpu_mask, ~bit, __ATOMIC_SEQ_CST);
+    EnableInterrupts();
+}
+
+[[noreturn]] static void IdleLoop(){
+    CPU* cpu = GetCurrentCPU();
+    while(true){
+        RunPendingCPUWork();
+
+        DisableInterrupts();
+        if(HasPendingCPUWork(cpu)){
+            EnableInterrupts();
+        }else if(HasRunnableThreads(cpu->id)){
+            Schedule();
+            EnableInterrupts();
+        }else{
+            WaitForWork(cpu);
+        }
+    }
+}
+
+// entry of idle thread of boot processor
+static void IdleThreadEntry(void*){
+    IdleLoop();
+}
+
+void InitializeScheduler(){
+    u32 eax, ebx, ecx, edx;
+    CPUID(1, 0, eax, ebx, ecx, edx);
+    // CPUID.01H:ECX.MONITOR[bit 3]
+    has_mwait = ecx & (1 << 3);
+
+    CPU* cpu = GetCurrentCPU();
+    DisableInterrupts();
+
+    // boot processor's idle thread is a new thread, because the boot
+    // flow continues as a normal thread
+    cpu->idle_thread = CreateThread("idle", IdleThreadEntry, nullptr);
+    cpu->idle_thread->state = ThreadState::Running;
+    cpu->current_thread = AdoptCurrentContext("main");
+    cpu->slice_end_tick = SCHEDULER_TIME_SLICE_TICKS;
+
+    StartAPICTimer();
+    EnableInterrupts();
+
+    Printf("\tIdle : %s\n", has_mwait ? "mwait" : "hlt");
+}
+
+void EnterIdleLoop(){
+    CPU* cpu = GetCurrentCPU();
+    cpu->idle_thread = AdoptCurrentContext("idle");
+    cpu->current_thread = cpu->idle_thread;
+
+    StartAPICTimer();
+    EnableInterrupts();
+    IdleLoop();
+}
+
+/******************** Work Stealing Benchmark ********************/
+
+#define BENCH_TASKS 4096
+// cycles of work every task does
+#define BENCH_TASK_WORK_CYCLES 20000
+
+// tsc when task was spawned and when it started running
+static u64 bench_spawn_tsc[BENCH_TASKS];
+static u64 bench_latency[BENCH_TASKS];
+static volatile u64 bench_tasks_done = 0;
+
+static void ShortTask(void* arg){
+    u64 index = reinterpret_cast<u64>(arg);
+    u64 start = ReadTimestampCounter();
+    bench_latency[index] = start - bench_spawn_tsc[index];
+
+    while(ReadTimestampCounter() - start < BENCH_TASK_WORK_CYCLES){
+        CPUPause();
+    }
+
+    __atomic_fetch_add(&bench_tasks_done, 1, __ATOMIC_RELEASE);
+}
+
+// sort latencies, heap sort because there's no allocator for merge sort
+// and insertion sort is too slow for this many elements
+static void SiftDown(u64* array, u64 root, u64 size){
+    while(2 * root + 1 < size){
+        u64 child = 2 * root + 1;
+        if(child + 1 < size && array[child + 1] > array[child]) child++;
+        if(array[root] >= array[child]) return;
+
+        u64 tmp = array[root];
+        array[root] = array[child];
+        array[child] = tmp;
+        root = child;
+    }
+}
+
+static void SortLatencies(u64* array, u64 size){
+    for(u64 i = size / 2; i > 0; i--){
+        SiftDown(array, i - 1, size);
+    }
+    for(u64 end = size - 1; end > 0; end--){
+        u64 tmp = array[0];
+        array[0] = array[end];
+        array[end] = tmp;
+        SiftDown(array, 0, end);
+    }
+}
+
+void BenchmarkScheduler(){
+    ColorPrintf(COLOR_YELLOW, COLOR_BLACK, "[+] Benchmark : Work Stealing Scheduler (%u tasks)\n", BENCH_TASKS);
+
+    u32 cpu_count = GetCPUCount();
+    for(u32 n = 1; n <= cpu_count; n++){
+        // powers of two and total cpu count are enough to show scaling
+        if((n & (n - 1)) != 0 && n != cpu_count) continue;
+
+        // current cpu and n - 1 others, main thread may migrate to any of them
+        u32 self = GetCurrentCPU()->id;
+        u64 mask = u64(1) << self;
+        for(u32 c = 0, added = 1; c < cpu_count && added < n; c++){
+            if(c == self) continue;
+            mask |= u64(1) << c;
+            added++;
+        }
+        scheduler_cpu_mask = mask;
+        bench_tasks_done = 0;
+        u64 steals_before = 0;
+        for(u32 c = 0; c < cpu_count; c++) steals_before += run_queues[c].stolen_threads;
+
+        // all tasks land on this cpu, others have to steal them
+        u64 start = ReadTimestampCounterSerialized();
+        for(u64 i = 0; i < BENCH_TASKS; i++){
+            bench_spawn_tsc[i] = ReadTimestampCounter();
+            SpawnThread("task", ShortTask, reinterpret_cast<void*>(i));
+        }
+        while(__atomic_load_n(&bench_tasks_done, __ATOMIC_ACQUIRE) != BENCH_TASKS){
+            Yield();
+        }
+        u64 cycles = ReadTimestampCounterSerialized() - start;
+
+        u64 stolen = 0;
+        for(u32 c = 0; c < cpu_count; c++) stolen += run_queues[c].stolen_threads;
+        stolen -= steals_before;
+
+        SortLatencies(bench_latency, BENCH_TASKS);
+        u64 ns = CyclesToNanoseconds(cycles);
+        u64 tasks_per_sec = ns ? (u64(BENCH_TASKS) * 1000000000) / ns : 0;
+        Printf("\tCPUs : %u | Tasks/s : %lu | Latency p50 : %lu ns | p99 : %lu ns | p99.9 : %lu ns | Stolen : %lu\n",
+               n, tasks_per_sec,
+               CyclesToNanoseconds(bench_latency[BENCH_TASKS / 2]),
+               CyclesToNanoseconds(bench_latency[(BENCH_TASKS * 99) / 100]),
+               CyclesToNanoseconds(bench_latency[(BENCH_TASKS * 999) / 1000]),
+               stolen);
+    }
+
+    scheduler_cpu_mask = ~u64(0);
+}
@@ -0,0 +1,90 @@
+/**
+ * @file Scheduler.hpp
+ * @author Siddharth Mishra (brightprogrammer)
+ * @date 10/18/26
+ * @brief Preemptive work stealing scheduler for kernel threads.
+ * @copyright MIT License 2022 Siddharth Mishra
+ * */
+
+#ifndef SCHEDULER_HPP
+#define SCHEDULER_HPP
+
+#include "Common.hpp"
+#include "Thread.hpp"
+
+// number of timer ticks a thread runs before it's preempted
+#define SCHEDULER_TIME_SLICE_TICKS 10
+
+/**
+ * @brief Turn current flow of boot processor into a thread, create
+ * it's idle thread and start preemption. Must be called after APIC
+ * and SMP are initialized.
+ * */
+void InitializeScheduler();
+
+/**
+ * @brief Turn current flow of an application processor into it's idle
+ * thread and start scheduling threads on it. Never returns.
+ * */
+[[noreturn]] void EnterIdleLoop();
+
+/**
+ * @brief Pick next thread and switch to it. If current thread is still
+ * running, it's put back in run queue. Interrupts must be disabled.
+ * */
+void Schedule();
+
+/**
+ * @brief Give up cpu to another ready thread, if there's any.
+ * */
+void Yield();
+
+/**
+ * @brief Like BlockCurrentThread, but thread is also woken once uptime
+ * reaches deadline, at resolution of timer tick. Returns once woken by
+ * either. Thread state must be set to ThreadState::Blocked before calling.
+ * */
+void BlockCurrentThreadUntil(u64 deadline);
+
+/**
+ * @brief Put a thread in run queue. Thread goes to run queue of cpu it last
+ * ran on, so it finds it's data still in that cpu's cache.
+ * */
+void MakeThreadReady(Thread* thread);
+
+/**
+ * @brief Finish switching from previous thread. Every thread calls this
+ * right after it's switched to (including first time it runs).
+ * */
+void FinishSwitch();
+
+/**
+ * @brief Called on every timer interrupt, preempts current thread
+ * when it's time slice is over.
+ * */
+void SchedulerTick();
+
+/**
+ * @brief Stop current thread from being preempted until a matching
+ * EnablePreemption. Calls can be nested.
+ * */
+void DisablePreemption();
+
+/**
+ * @brief Allow preemption again, and reschedule if a preemption
+ * was skipped in the meantime.
+ * */
+void EnablePreemption();
+
+/**
+ * @brief Check whether scheduler is running on current cpu.
+ * */
+bool IsSchedulerRunning();
+
+/**
+ * @brief Spawn many short tasks from one cpu and measure throughput and
+ * scheduling latency as number of cpus that can steal them grows.
+ * */
+void BenchmarkScheduler();
+
+#endif // SCHEDULER_HPP
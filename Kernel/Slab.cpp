@@ -0,0 +1,125 @@
+/**
+ * @file Slab.cpp
+ * @author Siddharth Mishra (brightprogrammer)
+ * @date 10/18/26
+ * @brief Slab allocator for fixed size kernel objects.
+ * @copyright MIT License 2022 Siddharth Mishra
+ * */
+
+#include "Slab.hpp"
+#include "MemoryManager.hpp"
+#include "Printf.hpp"
+
+// header at start of every slab page
+struct Slab {
+    SlabCache* cache;
+    // links in partial list of cache
+    Slab* next;
+    Slab* prev;
+    // free objects are linked through their first 8 bytes
+    void* free_list;
+    u64 in_use;
+};
+
+static inline u64 AlignUp(u64 value, u64 align){
+    return (value + align - 1) & ~(align - 1);
+}
+
+// compute slab layout once, when first object is allocated
+static void ComputeLayout(SlabCache* cache){
+    u64 size = AlignUp(cache->object_size < 8 ? 8 : cache->object_size, cache->align);
+    cache->object_size = size;
+    cache->first_object_offset = AlignUp(sizeof(Slab), cache->align);
+    cache->objects_per_slab = (PAGE_SIZE - cache->first_object_offset) / size;
+
+    if(cache->objects_per_slab == 0){
+        Printf("[-] Slab cache %s : object of %lu bytes doesn't fit in a page\n", cache->name, size);
+        while(true) asm("hlt");
+    }
+}
+
+static void RemoveFromPartial(SlabCache* cache, Slab* slab){
+    if(slab->prev) slab->prev->next = slab->next;
+    else cache->partial = slab->next;
+    if(slab->next) slab->next->prev = slab->prev;
+    slab->next = slab->prev = nullptr;
+}
+
+static void AddToPartial(SlabCache* cache, Slab* slab){
+    slab->prev = nullptr;
+    slab->next = cache->partial;
+    if(cache->partial) cache->partial->prev = slab;
+    cache->partial = slab;
+}
+
+// create a new slab and thread all it's objects in free list
+static Slab* CreateSlab(SlabCache* cache){
+    Slab* slab = reinterpret_cast<Slab*>(AllocatePage());
+    slab->cache = cache;
+    slab->next = slab->prev = nullptr;
+    slab->in_use = 0;
+    slab->free_list = nullptr;
+
+    u8* objects = reinterpret_cast<u8*>(slab) + cache->first_object_offset;
+    for(u64 i = cache->objects_per_slab; i > 0; i--){
+        void** object = reinterpret_cast<void**>(objects + (i - 1) * cache->object_size);
+        *object = slab->free_list;
+        slab->free_list = object;
+    }
+
+    cache->slab_count++;
+    return slab;
+}
+
+void* SlabAllocate(SlabCache* cache){
+    LockGuard guard(cache->lock);
+
+    if(cache->objects_per_slab == 0){
+        ComputeLayout(cache);
+    }
+
+    Slab* slab = cache->partial;
+    if(slab == nullptr){
+        slab = CreateSlab(cache);
+        AddToPartial(cache, slab);
+    }
+
+    void** object = reinterpret_cast<void**>(slab->free_list);
+    slab->free_list = *object;
+    slab->in_use++;
+    cache->allocated_objects++;
+
+    // slab is full, no need to look at it until something is freed
+    if(slab->in_use == cache->objects_per_slab){
+        RemoveFromPartial(cache, slab);
+    }
+
+    return object;
+}
+
+void SlabFree(SlabCache* cache, void* object){
+    if(object == nullptr) return;
+
+    LockGuard guard(cache->lock);
+
+    // slabs are page aligned, so header is at start of object's page
+    Slab* slab = reinterpret_cast<Slab*>(reinterpret_cast<u64>(object) & ~u64(PAGE_SIZE - 1));
+    bool was_full = slab->in_use == cache->objects_per_slab;
+
+    *reinterpret_cast<void**>(object) = slab->free_list;
+    slab->free_list = object;
+    slab->in_use--;
+    cache->allocated_objects--;
+
+    if(was_full){
+        AddToPartial(cache, slab);
+    }
+
+    // give empty slab back, but keep one around so that
+    // alternating alloc and free don't hit page allocator every time
+    if(slab->in_use == 0 && (slab->next || slab->prev)){
+        RemoveFromPartial(cache, slab);
+        cache->slab_count--;
+        FreePage(reinterpret_cast<u64>(slab));
+    }
+}
@@ -0,0 +1,59 @@
+/**
+ * @file Slab.hpp
+ * @author Siddharth Mishra (brightprogrammer)
+ * @date 10/18/26
+ * @brief Slab allocator for fixed size kernel objects.
+ * @copyright MIT License 2022 Siddharth Mishra
+ * */
+
+#ifndef SLAB_HPP
+#define SLAB_HPP
+
+#include "Common.hpp"
+#include "Spinlock.hpp"
+
+struct Slab;
+
+/**
+ * @brief A cache of objects of same size. Every slab is a single page
+ * with a small header at it's start, followed by objects.
+ *
+ * Object size may be set at runtime (eg: when it depends on cpu features),
+ * but only before first allocation from the cache.
+ * */
+struct SlabCache {
+    const char* name;
+    u64 object_size;
+    u64 align;
+
+    // computed on first allocation
+    u64 objects_per_slab;
+    u64 first_object_offset;
+
+    // slabs that have at least one free object
+    Slab* partial;
+    TicketLock<> lock;
+
+    // statistics
+    u64 allocated_objects;
+    u64 slab_count;
+
+    constexpr SlabCache(const char* cache_name, u64 size, u64 alignment = 16)
+        : name(cache_name), object_size(size), align(alignment),
+          objects_per_slab(0), first_object_offset(0), partial(nullptr),
+          lock(cache_name), allocated_objects(0), slab_count(0) {}
+};
+
+/**
+ * @brief Allocate an object from given cache.
+ *
+ * @return Address of object, contents are not initialized.
+ * */
+void* SlabAllocate(SlabCache* cache);
+
+/**
+ * @brief Return an object to the cache it was allocated from.
+ * */
+void SlabFree(SlabCache* cache, void* object);
+
+#endif // SLAB_HPP
@@ -0,0 +1,52 @@
+/**
+ * @file Spinlock.cpp
+ * @author Siddharth Mishra (brightprogrammer)
+ * @date 10/18/26
+ * @brief Registry of lock statistics.
+ * @copyright MIT License 2022 Siddharth Mishra
+ * */
+
+#include "Spinlock.hpp"
+#include "Printf.hpp"
+
+// max number of locks that can be sorted for display
+#define MAX_SHOWN_LOCKS 128
+
+// head of list of all registered lock statistics
+static LockStatistics* registered_locks = nullptr;
+
+// this is called with the lock itself held, so a lock is never
+// registered twice, but two different locks may register at once
+void RegisterLockStatistics(LockStatistics* stats){
+    stats->registered = true;
+    LockStatistics* head = __atomic_load_n(&registered_locks, __ATOMIC_RELAXED);
+    do{
+        stats->next = head;
+    }while(!__atomic_compare_exchange_n(&registered_locks, &head, stats, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+// show locks with most contended acquisitions first
+void ShowLockStatistics(u32 count){
+    static LockStatistics* sorted[MAX_SHOWN_LOCKS];
+    u32 num_locks = 0;
+
+    // insertion sort, number of locks is small
+    LockStatistics* stats = __atomic_load_n(&registered_locks, __ATOMIC_ACQUIRE);
+    while(stats != nullptr && num_locks < MAX_SHOWN_LOCKS){
+        u32 i = num_locks++;
+        while(i > 0 && sorted[i - 1]->contended_acquisitions < stats->contended_acquisitions){
+            sorted[i] = sorted[i - 1];
+            i--;
+        }
+        sorted[i] = stats;
+        stats = stats->next;
+    }
+
+    ColorPrintf(COLOR_YELLOW, COLOR_BLACK, "[+] Lock Stats (hottest %u of %u) : \n", count < num_locks ? count : num_locks, num_locks);
+    for(u32 i = 0; i < num_locks && i < count; i++){
+        Printf("\t%s : acquired %lu | contended %lu | max hold %lu cycles\n",
+               sorted[i]->name, sorted[i]->acquisitions,
+               sorted[i]->contended_acquisitions, sorted[i]->max_hold_cycles);
+    }
+}
@@ -0,0 +1,253 @@
+/**
+ * @file Spinlock.hpp
+ * @author Siddharth Mishra (brightprogrammer)
+ * @date 10/18/26
+ * @brief Ticket and MCS queue spinlocks with optional contention statistics.
+ * @copyright MIT License 2022 Siddharth Mishra
+ * */
+
+#ifndef SPINLOCK_HPP
+#define SPINLOCK_HPP
+
+#include "Common.hpp"
+#include "CPU.hpp"
+
+// statistics can be compiled out for all locks by turning off
+// MOSS_LOCK_STATISTICS option, or for a single lock by passing false
+// as template parameter
+#ifdef MOSS_LOCK_STATISTICS
+#define LOCK_STATISTICS_DEFAULT true
+#else
+#define LOCK_STATISTICS_DEFAULT false
+#endif
+
+/* ------------------ WHICH LOCK TO USE --------------------
+ *
+ * Both locks disable interrupts while held, so they can be shared
+ * between interrupt handlers and normal code.
+ *
+ * TicketLock : Small (8 bytes) and fair. All waiters spin on the same
+ * cache line, so every unlock invalidates that line in all waiting cpus.
+ * Use it for short critical sections that are rarely contended.
+ *
+ * MCSLock : Every waiter spins on it's own node (usually on it's stack),
+ * so unlock only touches next waiter's cache line. Use it for locks
+ * that many cpus fight for.
+ *
+ * */
+
+/**
+ * @brief Statistics of a single lock. Every lock registers itself in a
+ * global list the first time it is acquired.
+ * */
+struct LockStatistics {
+    const char* name;
+    u64 acquisitions;
+    u64 contended_acquisitions;
+    u64 max_hold_cycles;
+
+    // next lock in list of registered locks
+    LockStatistics* next;
+    bool registered;
+};
+
+// add lock statistics to global list, done only once per lock
+void RegisterLockStatistics(LockStatistics* stats);
+
+/**
+ * @brief Print statistics of most contended locks.
+ *
+ * @param count Maximum number of locks to show.
+ * */
+void ShowLockStatistics(u32 count = 10);
+
+// statistics collector, specialized below for disabled case
+template<bool Enabled>
+struct LockStatisticsCollector {
+    LockStatistics stats;
+    u64 acquire_tsc;
+
+    constexpr LockStatisticsCollector(const char* name)
+        : stats{name, 0, 0, 0, nullptr, false}, acquire_tsc(0) {}
+
+    // called with lock held
+    inline void OnAcquire(bool contended){
+        if(!stats.registered){
+            RegisterLockStatistics(&stats);
+        }
+
+        stats.acquisitions++;
+        if(contended) stats.contended_acquisitions++;
+        acquire_tsc = ReadTimestampCounter();
+    }
+
+    // called with lock held, just before releasing it
+    inline void OnRelease(){
+        u64 held = ReadTimestampCounter() - acquire_tsc;
+        if(held > stats.max_hold_cycles) stats.max_hold_cycles = held;
+    }
+};
+
+template<>
+struct LockStatisticsCollector<false> {
+    constexpr LockStatisticsCollector(const char*) {}
+    inline void OnAcquire(bool){}
+    inline void OnRelease(){}
+};
+
+/**
+ * @brief Fair FIFO spinlock. A cpu takes a ticket and waits until
+ * it's ticket number is being served.
+ * */
+template<bool CollectStatistics = LOCK_STATISTICS_DEFAULT>
+struct TicketLock {
+    u32 next_ticket;
+    u32 now_serving;
+    // interrupt state of cpu holding the lock
+    u64 saved_flags;
+    LockStatisticsCollector<CollectStatistics> collector;
+
+    constexpr TicketLock(const char* name)
+        : next_ticket(0), now_serving(0), saved_flags(0), collector(name) {}
+
+    void Lock(){
+        u64 flags = SaveFlagsAndDisableInterrupts();
+        u32 ticket = __atomic_fetch_add(&next_ticket, 1, __ATOMIC_RELAXED);
+
+        bool contended = false;
+        while(__atomic_load_n(&now_serving, __ATOMIC_ACQUIRE) != ticket){
+            contended = true;
+            CPUPause();
+        }
+
+        saved_flags = flags;
+        collector.OnAcquire(contended);
+    }
+
+    // try to take lock without waiting
+    // returns true if lock is acquired
+    bool TryLock(){
+        u64 flags = SaveFlagsAndDisableInterrupts();
+        u32 serving = __atomic_load_n(&now_serving, __ATOMIC_RELAXED);
+        u32 expected = serving;
+        // lock is free only if no one has a ticket after now_serving
+        if(!__atomic_compare_exchange_n(&next_ticket, &expected, serving + 1, false,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)){
+            RestoreFlags(flags);
+            return false;
+        }
+
+        saved_flags = flags;
+        collector.OnAcquire(false);
+        return true;
+    }
+
+    void Unlock(){
+        collector.OnRelease();
+        u64 flags = saved_flags;
+        __atomic_store_n(&now_serving, now_serving + 1, __ATOMIC_RELEASE);
+        RestoreFlags(flags);
+    }
+
+    bool IsLocked(){
+        return __atomic_load_n(&now_serving, __ATOMIC_RELAXED) != __atomic_load_n(&next_ticket, __ATOMIC_RELAXED);
+    }
+};
+
+/**
+ * @brief Queue node for MCS lock. Every cpu waiting for or holding
+ * an MCS lock needs it's own node, usually on it's stack.
+ * */
+struct MCSNode {
+    MCSNode* next;
+    bool locked;
+    u64 saved_flags;
+} __attribute__((aligned(64)));
+
+/**
+ * @brief MCS queue spinlock. Waiters form a linked list and every
+ * waiter spins on a flag in it's own node.
+ * */
+template<bool CollectStatistics = LOCK_STATISTICS_DEFAULT>
+struct MCSLock {
+    MCSNode* tail;
+    LockStatisticsCollector<CollectStatistics> collector;
+
+    constexpr MCSLock(const char* name)
+        : tail(nullptr), collector(name) {}
+
+    void Lock(MCSNode* node){
+        u64 flags = SaveFlagsAndDisableInterrupts();
+        node->next = nullptr;
+        node->locked = true;
+        node->saved_flags = flags;
+
+        MCSNode* prev = __atomic_exchange_n(&tail, node, __ATOMIC_ACQ_REL);
+        bool contended = prev != nullptr;
+        if(contended){
+            // link ourselves behind previous waiter and wait for it to hand over
+            __atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+            while(__atomic_load_n(&node->locked, __ATOMIC_ACQUIRE)){
+                CPUPause();
+            }
+        }
+
+        collector.OnAcquire(contended);
+    }
+
+    void Unlock(MCSNode* node){
+        collector.OnRelease();
+        u64 flags = node->saved_flags;
+
+        MCSNode* next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
+        if(next == nullptr){
+            // no known successor, try to mark lock as free
+            MCSNode* expected = node;
+            if(__atomic_compare_exchange_n(&tail, &expected, nullptr, false,
+                                           __ATOMIC_RELEASE, __ATOMIC_RELAXED)){
+                RestoreFlags(flags);
+                return;
+            }
+
+            // someone is in middle of linking itself behind us
+            while((next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE)) == nullptr){
+                CPUPause();
+            }
+        }
+
+        __atomic_store_n(&next->locked, false, __ATOMIC_RELEASE);
+        RestoreFlags(flags);
+    }
+};
+
+/**
+ * @brief Lock given lock for lifetime of this object.
+ * */
+template<typename LockType>
+struct LockGuard {
+    LockType* lock;
+
+    LockGuard(LockType& l) : lock(&l) { lock->Lock(); }
+    ~LockGuard() { lock->Unlock(); }
+
+    LockGuard(const LockGuard&) = delete;
+    LockGuard& operator=(const LockGuard&) = delete;
+};
+
+/**
+ * @brief Lock given MCS lock for lifetime of this object,
+ * queue node lives inside guard.
+ * */
+template<typename LockType>
+struct MCSLockGuard {
+    LockType* lock;
+    MCSNode node;
+
+    MCSLockGuard(LockType& l) : lock(&l) { lock->Lock(&node); }
+    ~MCSLockGuard() { lock->Unlock(&node); }
+
+    MCSLockGuard(const MCSLockGuard&) = delete;
+    MCSLockGuard& operator=(const MCSLockGuard&) = delete;
+};
+
+#endif // SPINLOCK_HPP
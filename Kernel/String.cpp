@@ -299,8 +299,14 @@ bool isalphanum(char c){
 u32 __attribute__((format(printf, 2, 3)))
 sprintf(char* buff, const char* fmtstr, ...){
     va_list vl;
-    int i = 0, finalstrsz = 0;
     va_start(vl, fmtstr);
+    u32 finalstrsz = vsprintf(buff, fmtstr, vl);
+    va_end(vl);
+    return finalstrsz;
+}
+
+u32 vsprintf(char* buff, const char* fmtstr, va_list vl){
+    int i = 0, finalstrsz = 0;
 
     while(fmtstr && fmtstr[i]){
         // check if any format specifier is present
@@ -350,6 +356,7 @@ sprintf(char* buff, const char* fmtstr, ...){
 
                         default: break;
                     }
+                    break;
                 }
 
                 // print integer
@@ -379,9 +386,17 @@ sprintf(char* buff, const char* fmtstr, ...){
                 }
 
                 case 's':{
-                    char* tmp = va_arg(vl, char*);
-                    strcat(buff, tmp);
-                    finalstrsz += strlen(tmp);
+                    const char* tmp = va_arg(vl, const char*);
+                    size_t len = strlen(tmp);
+                    memcpy(&buff[finalstrsz], tmp, len);
+                    finalstrsz += len;
+                    break;
+                }
+
+                // literal percent sign
+                case '%':{
+                    buff[finalstrsz] = '%';
+                    finalstrsz++;
                     break;
                 }
             }
@@ -396,6 +411,5 @@ sprintf(char* buff, const char* fmtstr, ...){
     // null terminate final string
     buff[finalstrsz] = 0;
 
-    va_end(vl);
     return finalstrsz;
 }
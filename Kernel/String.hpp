@@ -12,6 +12,7 @@
 
 #include <cstdint>
 #include <cstddef>
+#include <cstdarg>
 #include "Common.hpp"
 
 /**
@@ -181,4 +182,15 @@ char tolower(char c);
  * */
 u32 __attribute__((format(printf, 2, 3)))
 sprintf(char* buff, const char* fmtstr, ...);
+
+/**
+ * @brief String printf for kernel taking a va_list.
+ * This is what printf like functions must call to forward their arguments.
+ *
+ * @param buff Buffer to print string into.
+ * @param fmtstr Format string.
+ * @param vl Arguments as specified in fmtstr.
+ * @return length of final string.
+ * */
+u32 vsprintf(char* buff, const char* fmtstr, va_list vl);
 #endif // STRING_H_
@@ -0,0 +1,292 @@
+/**
+ * @file Syscall.cpp
+ * @author Siddharth Mishra (brightprogrammer)
+ * @date 10/18/26
+ * @brief System calls through SYSCALL/SYSRET and user mode entry.
+ * @copyright MIT License 2022 Siddharth Mishra
+ * */
+
+#include "Syscall.hpp"
+#include "CPU.hpp"
+#include "GDT.hpp"
+#include "SMP.hpp"
+#include "Thread.hpp"
+#include "Scheduler.hpp"
+#include "MemoryManager.hpp"
+#include "Printf.hpp"
+#include "String.hpp"
+#include "Timer.hpp"
+#include "IoRing.hpp"
+#include "IPC.hpp"
+#include "Fork.hpp"
+
+#define MSR_STAR 0xc0000081
+#define MSR_LSTAR 0xc0000082
+#define MSR_SFMASK 0xc0000084
+#define EFER_SYSCALL_ENABLE (1 << 0)
+
+// flags cleared on syscall entry : trap, interrupt, direction and alignment check
+#define SYSCALL_FLAGS_MASK ((1 << 8) | (1 << 9) | (1 << 10) | (1 << 18))
+
+#define STRINGIFY_(x) #x
+#define STRINGIFY(x) STRINGIFY_(x)
+
+/* ------------------ SYSCALL ENTRY --------------------
+ *
+ * SYSCALL loads kernel cs/ss from STAR, saves user rip in rcx and rflags
+ * in r11 and jumps to LSTAR, without touching rsp or gs. User code can
+ * load gs with anything, so first thing entry code does is swapgs, which
+ * brings in per-cpu data (see LoadPerCPUData), and then it switches to
+ * kernel stack of current thread, which scheduler keeps in per-cpu data.
+ * Interrupts are off from then until user gs base is swapped back in
+ * right before sysretq.
+ *
+ * Kernel stack of thread looks like this when handler is called
+ * (see SyscallFrame) :
+ *
+ *   stack top ->  ;-------------------;
+ *                 ; user rsp          ;
+ *                 ; user rip (rcx)    ;
+ *                 ; user rflags (r11) ;
+ *                 ; syscall number    ;
+ *                 ; r9                ;
+ *                 ; r8                ;
+ *                 ; r10               ;
+ *                 ; rdx               ;
+ *                 ; rsi               ;
+ *                 ; rdi               ;
+ *                 ;-------------------;
+ *
+ * Argument registers are zero when we go back to user, so no kernel
+ * values leak through them, unless handler puts something in their
+ * slots. This is how system calls like IPC receive return more than one
+ * value without touching user memory.
+ *
+ * Handlers are normal C++ functions, so they preserve callee saved
+ * registers for us. Interrupts are enabled while handler runs, so
+ * system calls can be preempted like any other kernel code.
+ *
+ * */
+asm(R"(
+.text
+.global SyscallEntry
+SyscallEntry:
+    swapgs
+    mov %rsp, %gs:)" STRINGIFY(CPU_SYSCALL_USER_RSP) R"(
+    mov %gs:)" STRINGIFY(CPU_SYSCALL_KERNEL_RSP) R"(, %rsp
+    pushq %gs:)" STRINGIFY(CPU_SYSCALL_USER_RSP) R"(
+    push %rcx
+    push %r11
+    push %rax
+    pushq $0
+    pushq $0
+    pushq $0
+    pushq $0
+    pushq $0
+    pushq $0
+
+    cmp $)" STRINGIFY(SYSCALL_COUNT) R"(, %rax
+    jae 1f
+
+    sti
+    # fourth argument is in r10 because syscall clobbers rcx
+    mov %r10, %rcx
+    lea syscall_table(%rip), %r11
+    call *(%r11, %rax, 8)
+    cli
+    jmp 2f
+
+1:
+    mov $-1, %rax
+
+2:
+    pop %rdi
+    pop %rsi
+    pop %rdx
+    pop %r10
+    pop %r8
+    pop %r9
+    add $8, %rsp
+    pop %r11
+    pop %rcx
+    pop %rsp
+    swapgs
+    sysretq
+)");
+
+extern "C" void SyscallEntry();
+
+static u64 SyscallNull(u64, u64, u64, u64, u64, u64){
+    return 0;
+}
+
+static u64 SyscallExit(u64 code, u64, u64, u64, u64, u64){
+    GetCurrentThread()->exit_code = code;
+    ExitThread();
+}
+
+static u64 SyscallYield(u64, u64, u64, u64, u64, u64){
+    Yield();
+    return 0;
+}
+
+// longest string user can print at once
+#define DEBUG_PRINT_MAX 256
+
+SyscallFrame* GetSyscallFrame(){
+    return reinterpret_cast<SyscallFrame*>(GetCurrentThread()->stack_top) - 1;
+}
+
+u64 WriteUserConsole(u64 str, u64 len){
+    if(len > DEBUG_PRINT_MAX) len = DEBUG_PRINT_MAX;
+    if(!IsUserRangeMapped(GetCurrentThread()->address_space, str, len)){
+        return SYSCALL_ERROR;
+    }
+
+    char buff[DEBUG_PRINT_MAX + 1];
+    memcpy(buff, reinterpret_cast<void*>(str), len);
+    buff[len] = 0;
+    Printf("%s", buff);
+    return len;
+}
+
+static u64 SyscallDebugPrint(u64 str, u64 len, u64, u64, u64, u64){
+    return WriteUserConsole(str, len);
+}
+
+// entry code indexes this table with system call number
+extern "C" SyscallFunction syscall_table[SYSCALL_COUNT];
+SyscallFunction syscall_table[SYSCALL_COUNT] = {
+    SyscallNull,
+    SyscallExit,
+    SyscallYield,
+    SyscallDebugPrint,
+    SyscallIoRingSetup,
+    SyscallIoRingEnter,
+    SyscallIPCCreate,
+    SyscallIPCSend,
+    SyscallIPCReceive,
+    SyscallFork,
+    SyscallWait
+};
+
+void EnableSyscalls(){
+    WriteMSR(MSR_EFER, ReadMSR(MSR_EFER) | EFER_SYSCALL_ENABLE);
+
+    // syscall loads cs = STAR[47:32] and ss = cs + 8
+    // sysret loads cs = STAR[63:48] + 16 and ss = STAR[63:48] + 8
+    u64 star = (u64(GDT_KERNEL_CODE_SELECTOR) << 32) | (u64(GDT_USER_DATA_SELECTOR - 8) << 48);
+    WriteMSR(MSR_STAR, star);
+    WriteMSR(MSR_LSTAR, reinterpret_cast<u64>(SyscallEntry));
+    WriteMSR(MSR_SFMASK, SYSCALL_FLAGS_MASK);
+}
+
+void InitializeSyscalls(){
+    EnableSyscalls();
+}
+
+void JumpToUserMode(u64 rip, u64 rsp, u64 arg){
+    // build an interrupt frame and return to it
+    asm volatile("cli\n"
+                 "pushq %[ss]\n"
+                 "push %[rsp]\n"
+                 "pushq %[rflags]\n"
+                 "pushq %[cs]\n"
+                 "push %[rip]\n"
+                 "xor %%eax, %%eax\n"
+                 "xor %%ebx, %%ebx\n"
+                 "xor %%ecx, %%ecx\n"
+                 "xor %%edx, %%edx\n"
+                 "xor %%esi, %%esi\n"
+                 "xor %%ebp, %%ebp\n"
+                 "xor %%r8d, %%r8d\n"
+                 "xor %%r9d, %%r9d\n"
+                 "xor %%r10d, %%r10d\n"
+                 "xor %%r11d, %%r11d\n"
+                 "xor %%r12d, %%r12d\n"
+                 "xor %%r13d, %%r13d\n"
+                 "xor %%r14d, %%r14d\n"
+                 "xor %%r15d, %%r15d\n"
+                 "swapgs\n"
+                 "iretq\n"
+                 :
+                 : [ss]"i"(GDT_USER_DATA_SELECTOR | 3),
+                   [rsp]"r"(rsp),
+                   [rflags]"i"(RFLAGS_INTERRUPT_ENABLE | 0x2),
+                   [cs]"i"(GDT_USER_CODE_SELECTOR | 3),
+                   [rip]"r"(rip),
+                   "D"(arg)
+                 : "memory");
+    __builtin_unreachable();
+}
+
+// first thing a user thread runs, in kernel mode
+static void UserThreadStart(void* arg){
+    Thread* thread = reinterpret_cast<Thread*>(arg);
+    JumpToUserMode(thread->user_rip, thread->user_rsp, thread->user_arg);
+}
+
+Thread* CreateUserThread(const char* name, AddressSpace* space, u64 rip, u64 rsp, u64 arg){
+    Thread* thread = CreateThread(name, UserThreadStart, nullptr);
+    thread->arg = thread;
+    thread->address_space = space;
+    thread->user_rip = rip;
+    thread->user_rsp = rsp;
+    thread->user_arg = arg;
+    return thread;
+}
+
+/******************** Null Syscall Benchmark ********************/
+
+#define BENCH_SYSCALL_ITERATIONS 1000000
+// where benchmark code is mapped in user space
+#define BENCH_USER_CODE 0x400000
+
+// user code for benchmark, copied to a user page
+// makes rdi null system calls and exits with number of cycles they took
+asm(R"(
+.text
+.global UserNullSyscallLoop
+.global UserNullSyscallLoopEnd
+UserNullSyscallLoop:
+    mov %rdi, %r12
+    rdtsc
+    shl $32, %rdx
+    or %rax, %rdx
+    mov %rdx, %r13
+1:
+    mov $)" STRINGIFY(SYSCALL_NULL) R"(, %eax
+    syscall
+    dec %r12
+    jnz 1b
+    rdtsc
+    shl $32, %rdx
+    or %rax, %rdx
+    sub %r13, %rdx
+    mov %rdx, %rdi
+    mov $)" STRINGIFY(SYSCALL_EXIT) R"(, %eax
+    syscall
+    ud2
+UserNullSyscallLoopEnd:
+)");
+
+extern "C" u8 UserNullSyscallLoop[];
+extern "C" u8 UserNullSyscallLoopEnd[];
+
+void BenchmarkSyscall(){
+    ColorPrintf(COLOR_YELLOW, COLOR_BLACK, "[+] Benchmark : Null System Call\n");
+
+    AddressSpace* space = CreateAddressSpace();
+    u64 code = AllocateUserPage(space, BENCH_USER_CODE, MAP_PRESENT);
+    memcpy(reinterpret_cast<void*>(code), UserNullSyscallLoop, UserNullSyscallLoopEnd - UserNullSyscallLoop);
+    AllocateUserPage(space, USER_STACK_TOP - PAGE_SIZE, MAP_PRESENT | MAP_READ_WRITE);
+
+    Thread* thread = CreateUserThread("syscall-bench", space, BENCH_USER_CODE, USER_STACK_TOP, BENCH_SYSCALL_ITERATIONS);
+    StartThread(thread);
+    u64 cycles = JoinThread(thread);
+    DestroyAddressSpace(space);
+
+    Printf("\tSYSCALL + SYSRET : %lu cycles (%lu ns) per round trip\n",
+           cycles / BENCH_SYSCALL_ITERATIONS,
+           CyclesToNanoseconds(cycles) / BENCH_SYSCALL_ITERATIONS);
+}
@@ -0,0 +1,111 @@
+/**
+ * @file Syscall.hpp
+ * @author Siddharth Mishra (brightprogrammer)
+ * @date 10/18/26
+ * @brief System calls through SYSCALL/SYSRET and user mode entry.
+ * @copyright MIT License 2022 Siddharth Mishra
+ * */
+
+#ifndef SYSCALL_HPP
+#define SYSCALL_HPP
+
+#include "Common.hpp"
+
+struct Thread;
+struct AddressSpace;
+
+/* ------------------ SYSTEM CALL ABI --------------------
+ *
+ * rax : system call number, and return value
+ * rdi, rsi, rdx, r10, r8, r9 : arguments
+ * rcx and r11 are clobbered by cpu (user rip and rflags are kept there)
+ *
+ * */
+
+// system call numbers
+#define SYSCALL_NULL 0
+#define SYSCALL_EXIT 1
+#define SYSCALL_YIELD 2
+#define SYSCALL_DEBUG_PRINT 3
+#define SYSCALL_IO_RING_SETUP 4
+#define SYSCALL_IO_RING_ENTER 5
+#define SYSCALL_IPC_CREATE 6
+#define SYSCALL_IPC_SEND 7
+#define SYSCALL_IPC_RECEIVE 8
+#define SYSCALL_FORK 9
+#define SYSCALL_WAIT 10
+// number of entries in system call table
+#define SYSCALL_COUNT 11
+
+// returned for unknown system calls and invalid arguments
+#define SYSCALL_ERROR (~u64(0))
+
+/**
+ * @brief What SyscallEntry keeps at top of kernel stack of a thread during
+ * a system call. Values in registers array are loaded into rdi, rsi, rdx,
+ * r10, r8 and r9 when system call returns.
+ * */
+struct SyscallFrame {
+    u64 registers[6];
+    u64 number;
+    u64 rflags;
+    u64 rip;
+    u64 rsp;
+};
+
+static_assert(sizeof(SyscallFrame) % 16 == 0, "SyscallFrame must keep kernel stack 16 byte aligned");
+
+typedef u64 (*SyscallFunction)(u64 arg0, u64 arg1, u64 arg2, u64 arg3, u64 arg4, u64 arg5);
+
+/**
+ * @brief Program syscall msrs of boot processor. Must be called
+ * after per-cpu data is initialized.
+ * */
+void InitializeSyscalls();
+
+/**
+ * @brief Program syscall msrs of current cpu. Application processors call this.
+ * */
+void EnableSyscalls();
+
+/**
+ * @brief Get syscall frame of current thread. Only valid inside a system call.
+ * */
+SyscallFrame* GetSyscallFrame();
+
+/**
+ * @brief Print a string from address space of current thread on console.
+ *
+ * @param str User address of string.
+ * @param len Length of string, at most 256 bytes are printed.
+ * @return Number of bytes printed, or SYSCALL_ERROR if string is not mapped.
+ * */
+u64 WriteUserConsole(u64 str, u64 len);
+
+/**
+ * @brief Drop to user mode. Address space of current thread must already be loaded.
+ *
+ * @param rip Address of first user instruction.
+ * @param rsp User stack pointer.
+ * @param arg Value passed to user code in rdi.
+ * */
+[[noreturn]] void JumpToUserMode(u64 rip, u64 rsp, u64 arg);
+
+/**
+ * @brief Create a thread that starts executing in user mode.
+ * Thread doesn't run until it's started.
+ *
+ * @param name Name of thread.
+ * @param space Address space thread runs in.
+ * @param rip Address of first user instruction.
+ * @param rsp User stack pointer.
+ * @param arg Value passed to user code in rdi.
+ * */
+Thread* CreateUserThread(const char* name, AddressSpace* space, u64 rip, u64 rsp, u64 arg);
+
+/**
+ * @brief Measure round trip cost of a system call that does nothing.
+ * */
+void BenchmarkSyscall();
+
+#endif // SYSCALL_HPP
@@ -0,0 +1,257 @@
+/**
+ * @file Thread.cpp
+ * @author Siddharth Mishra (brightprogrammer)
+ * @date 10/18/26
+ * @brief Kernel threads and context switching.
+ * @copyright MIT License 2022 Siddharth Mishra
+ * */
+
+#include "Thread.hpp"
+#include "Scheduler.hpp"
+#include "SMP.hpp"
+#include "CPU.hpp"
+#include "MemoryManager.hpp"
+#include "Printf.hpp"
+#include "String.hpp"
+#include "Timer.hpp"
+#include "FPU.hpp"
+
+// id given to next created thread
+static u64 next_thread_id = 0;
+
+/* ------------------ CONTEXT SWITCH EXPLANATION --------------------
+ *
+ * SwitchContext is called like a normal function, so compiler has
+ * already saved all caller saved registers it cares about. We only push
+ * callee saved registers on current stack, save stack pointer and then
+ * pop callee saved registers of new context from it's stack. The ret
+ * at the end returns to wherever new context called SwitchContext from.
+ *
+ * Stack of a thread that was never run is prepared to look exactly like
+ * it called SwitchContext, except that return address points to
+ * ThreadTrampoline, which calls function in r13 with r12 as argument.
+ *
+ *   stack top ->  ;-------------------;
+ *                 ; ThreadTrampoline  ; <- ret pops this
+ *                 ; rbp = 0           ;
+ *                 ; rbx = 0           ;
+ *                 ; r12 = argument    ;
+ *                 ; r13 = function    ;
+ *                 ; r14 = 0           ;
+ *                 ; r15 = 0           ; <- saved rsp
+ *                 ;-------------------;
+ *
+ * When interrupt handler preempts a thread, all registers are saved by
+ * handler itself on thread's stack before it calls Schedule.
+ * */
+asm(R"(
+.text
+.global SwitchContext
+SwitchContext:
+    push %rbp
+    push %rbx
+    push %r12
+    push %r13
+    push %r14
+    push %r15
+    mov %rsp, (%rdi)
+    mov %rsi, %rsp
+    pop %r15
+    pop %r14
+    pop %r13
+    pop %r12
+    pop %rbx
+    pop %rbp
+    ret
+
+.global ThreadTrampoline
+ThreadTrampoline:
+    mov %r12, %rdi
+    call *%r13
+    ud2
+)");
+
+extern "C" void ThreadTrampoline();
+
+// prepare a stack so that switching to it calls function(arg)
+// returns saved stack pointer to switch to
+static u64 PrepareContext(u64 stack_top, void (*function)(void*), void* arg){
+    u64* sp = reinterpret_cast<u64*>(stack_top);
+    *--sp = reinterpret_cast<u64>(ThreadTrampoline);
+    *--sp = 0; // rbp
+    *--sp = 0; // rbx
+    *--sp = reinterpret_cast<u64>(arg); // r12
+    *--sp = reinterpret_cast<u64>(function); // r13
+    *--sp = 0; // r14
+    *--sp = 0; // r15
+    return reinterpret_cast<u64>(sp);
+}
+
+// first function every new thread executes
+static void ThreadStart(void* arg){
+    Thread* thread = reinterpret_cast<Thread*>(arg);
+
+    FinishSwitch();
+    EnableInterrupts();
+
+    thread->entry(thread->arg);
+    ExitThread();
+}
+
+// allocate and fill a thread structure
+static Thread* AllocateThread(const char* name){
+    Thread* thread = reinterpret_cast<Thread*>(AllocatePage());
+    memset(thread, 0, sizeof(Thread));
+    thread->id = __atomic_fetch_add(&next_thread_id, 1, __ATOMIC_RELAXED);
+    thread->name = name;
+    thread->state = ThreadState::Created;
+    thread->last_cpu = GetCurrentCPU()->id;
+    thread->fpu_cpu = ~u32(0);
+    return thread;
+}
+
+Thread* CreateThread(const char* name, ThreadFunction entry, void* arg){
+    Thread* thread = AllocateThread(name);
+    thread->entry = entry;
+    thread->arg = arg;
+    thread->stack_top = AllocateKernelStack(THREAD_STACK_PAGES);
+    thread->rsp = PrepareContext(thread->stack_top, ThreadStart, thread);
+    return thread;
+}
+
+void StartThread(Thread* thread){
+    thread->state = ThreadState::Ready;
+    MakeThreadReady(thread);
+}
+
+Thread* SpawnThread(const char* name, ThreadFunction entry, void* arg){
+    Thread* thread = CreateThread(name, entry, arg);
+    thread->detached = true;
+    StartThread(thread);
+    return thread;
+}
+
+Thread* AdoptCurrentContext(const char* name){
+    Thread* thread = AllocateThread(name);
+    thread->state = ThreadState::Running;
+    thread->on_cpu = true;
+    thread->borrowed_stack = true;
+    thread->detached = true;
+    return thread;
+}
+
+Thread* GetCurrentThread(){
+    return GetCurrentCPU()->current_thread;
+}
+
+// free resources of a dead thread
+// this is called by FinishSwitch once we're off the dead thread's stack
+void DestroyThread(Thread* thread){
+    if(!thread->borrowed_stack){
+        FreeKernelStack(thread->stack_top, THREAD_STACK_PAGES);
+    }
+    FreeFPUState(thread);
+
+    // joinable threads are freed by JoinThread, clearing stack top
+    // tells it that we're done touching the thread
+    if(thread->detached){
+        FreePage(reinterpret_cast<u64>(thread));
+    }else{
+        __atomic_store_n(&thread->stack_top, 0, __ATOMIC_RELEASE);
+    }
+}
+
+void ExitThread(){
+    DisableInterrupts();
+    // FinishSwitch on next thread will see we're dead and destroy us
+    GetCurrentThread()->state = ThreadState::Dead;
+    Schedule();
+    __builtin_unreachable();
+}
+
+u64 JoinThread(Thread* thread){
+    // stack top is cleared only after thread is dead and it's stack is freed
+    while(__atomic_load_n(&thread->stack_top, __ATOMIC_ACQUIRE) != 0){
+        Yield();
+    }
+    u64 exit_code = thread->exit_code;
+    FreePage(reinterpret_cast<u64>(thread));
+    return exit_code;
+}
+
+void BlockCurrentThread(){
+    u64 flags = SaveFlagsAndDisableInterrupts();
+    Schedule();
+    RestoreFlags(flags);
+}
+
+void WakeThread(Thread* thread){
+    ThreadState expected = ThreadState::Blocked;
+    if(__atomic_compare_exchange_n(&thread->state, &expected, ThreadState::Ready, false,
+                                   __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)){
+        MakeThreadReady(thread);
+    }
+}
+
+/******************** Context Switch Benchmark ********************/
+
+#define BENCH_SWITCH_ITERATIONS 100000
+
+// saved stack pointers of two contexts ping-ponging in raw switch benchmark
+static u64 bench_main_rsp = 0;
+static u64 bench_partner_rsp = 0;
+
+// partner context just switches back, forever
+static void RawSwitchPartner(void*){
+    while(true){
+        SwitchContext(&bench_partner_rsp, bench_main_rsp);
+    }
+}
+
+static volatile bool bench_yield_done = false;
+
+// yields until benchmark is over
+static void YieldPartner(void*){
+    while(!bench_yield_done){
+        Yield();
+    }
+}
+
+void BenchmarkContextSwitch(){
+    ColorPrintf(COLOR_YELLOW, COLOR_BLACK, "[+] Benchmark : Context Switch\n");
+
+    // raw switch between two stacks, no scheduler involved
+    u64 partner_stack = AllocateKernelStack(THREAD_STACK_PAGES);
+    bench_partner_rsp = PrepareContext(partner_stack, RawSwitchPartner, nullptr);
+
+    u64 flags = SaveFlagsAndDisableInterrupts();
+    u64 start = ReadTimestampCounterSerialized();
+    for(u64 i = 0; i < BENCH_SWITCH_ITERATIONS; i++){
+        SwitchContext(&bench_main_rsp, bench_partner_rsp);
+    }
+    u64 raw_cycles = ReadTimestampCounterSerialized() - start;
+    RestoreFlags(flags);
+    FreeKernelStack(partner_stack, THREAD_STACK_PAGES);
+
+    // every iteration is two switches
+    Printf("\tSwitchContext : %lu cycles per switch\n", raw_cycles / (2 * BENCH_SWITCH_ITERATIONS));
+
+    // yield between two threads through scheduler
+    // if other cpus are idle they may pick partner up, which is fine,
+    // then we measure yield to an empty queue on this cpu
+    bench_yield_done = false;
+    Thread* partner = CreateThread("yield-partner", YieldPartner, nullptr);
+    StartThread(partner);
+
+    start = ReadTimestampCounterSerialized();
+    for(u64 i = 0; i < BENCH_SWITCH_ITERATIONS; i++){
+        Yield();
+    }
+    u64 yield_cycles = ReadTimestampCounterSerialized() - start;
+
+    bench_yield_done = true;
+    JoinThread(partner);
+
+    Printf("\tYield : %lu cycles per yield (%lu ns)\n", yield_cycles / BENCH_SWITCH_ITERATIONS,
+           CyclesToNanoseconds(yield_cycles) / BENCH_SWITCH_ITERATIONS);
+}
@@ -0,0 +1,178 @@
+/**
+ * @file Thread.hpp
+ * @author Siddharth Mishra (brightprogrammer)
+ * @date 10/18/26
+ * @brief Kernel threads and context switching.
+ * @copyright MIT License 2022 Siddharth Mishra
+ * */
+
+#ifndef THREAD_HPP
+#define THREAD_HPP
+
+#include <cstddef>
+
+#include "Common.hpp"
+
+// number of pages in a kernel thread's stack
+#define THREAD_STACK_PAGES 4
+
+typedef void (*ThreadFunction)(void* arg);
+
+struct AddressSpace;
+
+enum class ThreadState : u8 {
+    // created but not started yet
+    Created,
+    // waiting in a run queue
+    Ready,
+    // executing on a cpu
+    Running,
+    // waiting for someone to wake it up
+    Blocked,
+    // finished executing, waiting to be joined
+    Dead
+};
+
+/**
+ * @brief A kernel thread. One page is allocated for every thread structure.
+ * */
+struct Thread {
+    // saved stack pointer when thread is not running
+    // must be first member, context switch code uses it's offset
+    u64 rsp;
+
+    u64 id;
+    const char* name;
+    volatile ThreadState state;
+
+    // true while a cpu is executing this thread or is in the middle
+    // of switching away from it. A thread can't be switched to by another
+    // cpu until this becomes false, because it's registers aren't saved yet.
+    volatile bool on_cpu;
+
+    // if detached, thread structure is freed as soon as it exits
+    // otherwise JoinThread frees it
+    bool detached;
+
+    // true for threads that were not created by CreateThread
+    // (boot flow of every cpu), their stack is not ours to free
+    bool borrowed_stack;
+
+    // top of allocated stack
+    u64 stack_top;
+
+    ThreadFunction entry;
+    void* arg;
+
+    // cpu this thread last ran on, wakeups prefer it for cache affinity
+    u32 last_cpu;
+
+    // user threads run in their own address space, kernel threads have nullptr
+    AddressSpace* address_space;
+    // where user thread starts executing in user mode
+    u64 user_rip;
+    u64 user_rsp;
+    u64 user_arg;
+
+    // value returned by thread, see JoinThread
+    u64 exit_code;
+
+    // threads forked by this thread that weren't waited for yet
+    Thread* children;
+    Thread* sibling;
+
+    // fpu save area, allocated on first fpu use
+    void* fpu_state;
+    // cpu where fpu state was last loaded
+    u32 fpu_cpu;
+
+    // link in list of remote wakeups of a run queue
+    Thread* next;
+    // link in list of threads waiting for a mutex
+    Thread* wait_next;
+};
+
+static_assert(offsetof(Thread, rsp) == 0, "Thread::rsp must be first member");
+
+/**
+ * @brief Switch stacks from current context to a new one. Only callee saved
+ * registers are saved (rbx, rbp, r12-r15), caller saved registers are already
+ * saved by compiler at the call site.
+ *
+ * @param old_rsp Where to save stack pointer of current context.
+ * @param new_rsp Stack pointer of context to switch to.
+ * */
+extern "C" void SwitchContext(u64* old_rsp, u64 new_rsp);
+
+/**
+ * @brief Create a new kernel thread. Thread doesn't run until it's started.
+ *
+ * @param name Name of thread, used for debugging.
+ * @param entry Function to execute in thread.
+ * @param arg Argument passed to entry.
+ * @return Newly created thread.
+ * */
+Thread* CreateThread(const char* name, ThreadFunction entry, void* arg);
+
+/**
+ * @brief Make thread runnable.
+ * */
+void StartThread(Thread* thread);
+
+/**
+ * @brief Create and start a detached thread. Detached threads are
+ * freed as soon as they exit and can't be joined.
+ * */
+Thread* SpawnThread(const char* name, ThreadFunction entry, void* arg);
+
+/**
+ * @brief Create a thread structure for flow of execution that is
+ * already running on current cpu (eg: KernelEntry or boot flow of an AP).
+ *
+ * @param name Name of thread.
+ * @return Thread representing current flow of execution.
+ * */
+Thread* AdoptCurrentContext(const char* name);
+
+/**
+ * @brief Terminate calling thread.
+ * */
+[[noreturn]] void ExitThread();
+
+/**
+ * @brief Free stack of a dead thread, and thread itself if it's detached.
+ * Called by scheduler once no cpu is running on thread's stack.
+ * */
+void DestroyThread(Thread* thread);
+
+/**
+ * @brief Wait for a non detached thread to exit and free it.
+ *
+ * @return Exit code of thread.
+ * */
+u64 JoinThread(Thread* thread);
+
+/**
+ * @brief Get thread running on current cpu.
+ * */
+Thread* GetCurrentThread();
+
+/**
+ * @brief Put calling thread to sleep until someone calls WakeThread on it.
+ * Thread state must be set to ThreadState::Blocked before calling this,
+ * so that a wakeup that happens before this call is not lost.
+ * */
+void BlockCurrentThread();
+
+/**
+ * @brief Make a blocked thread runnable again.
+ * Does nothing if thread is not blocked.
+ * */
+void WakeThread(Thread* thread);
+
+/**
+ * @brief Measure raw context switch latency and yield latency.
+ * */
+void BenchmarkContextSwitch();
+
+#endif // THREAD_HPP
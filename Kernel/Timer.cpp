@@ -0,0 +1,88 @@
+/**
+ * @file Timer.cpp
+ * @author Siddharth Mishra (brightprogrammer)
+ * @date 10/18/26
+ * @brief Time keeping using time stamp counter.
+ * @copyright MIT License 2022 Siddharth Mishra
+ * */
+
+#include "Timer.hpp"
+#include "CPU.hpp"
+#include "IO.hpp"
+#include "Printf.hpp"
+
+// pit input clock frequency in Hz
+#define PIT_FREQUENCY 1193182
+#define PIT_CHANNEL2_DATA 0x42
+#define PIT_COMMAND 0x43
+// controls gate of pit channel 2 and pc speaker
+#define PIT_CHANNEL2_GATE 0x61
+
+// calibration will wait for 1/CALIBRATION_DIVISOR seconds
+#define CALIBRATION_DIVISOR 20
+
+static u64 tsc_frequency = 0;
+static u64 tsc_at_boot = 0;
+
+// measure how many tsc ticks happen in 1/CALIBRATION_DIVISOR seconds
+static u64 MeasureTimestampTicks(){
+    // enable gate of channel 2 and disable speaker output
+    u8 gate = PortReadByte(PIT_CHANNEL2_GATE);
+    PortWriteByte(PIT_CHANNEL2_GATE, (gate & ~0x02) | 0x01);
+
+    // channel 2, low byte then high byte, mode 0 (interrupt on terminal count)
+    PortWriteByte(PIT_COMMAND, 0b10110000);
+    u16 count = PIT_FREQUENCY / CALIBRATION_DIVISOR;
+    PortWriteByte(PIT_CHANNEL2_DATA, count & 0xff);
+    PortWriteByte(PIT_CHANNEL2_DATA, count >> 8);
+
+    // restart counting by toggling the gate
+    gate = PortReadByte(PIT_CHANNEL2_GATE) & ~0x01;
+    PortWriteByte(PIT_CHANNEL2_GATE, gate);
+    PortWriteByte(PIT_CHANNEL2_GATE, gate | 0x01);
+
+    u64 start = ReadTimestampCounter();
+    // bit 5 becomes set when counter reaches 0
+    while(!(PortReadByte(PIT_CHANNEL2_GATE) & 0x20));
+    u64 end = ReadTimestampCounter();
+
+    return end - start;
+}
+
+void InitializeTimer(){
+    // take smallest of few measurements
+    // larger values are caused by emulator/hypervisor preempting us
+    u64 best = ~u64(0);
+    for(int i = 0; i < 3; i++){
+        u64 ticks = MeasureTimestampTicks();
+        if(ticks < best) best = ticks;
+    }
+
+    tsc_frequency = best * CALIBRATION_DIVISOR;
+    tsc_at_boot = ReadTimestampCounter();
+
+    Printf("\tTSC Frequency : %lu MHz\n", tsc_frequency / 1000000);
+}
+
+u64 GetTimestampFrequency(){
+    return tsc_frequency;
+}
+
+u64 CyclesToNanoseconds(u64 cycles){
+    if(tsc_frequency == 0) return 0;
+    // split to avoid overflow for large cycle counts
+    u64 seconds = cycles / tsc_frequency;
+    u64 remainder = cycles % tsc_frequency;
+    return seconds * 1000000000 + (remainder * 1000000000) / tsc_frequency;
+}
+
+u64 GetUptimeNanoseconds(){
+    return CyclesToNanoseconds(ReadTimestampCounter() - tsc_at_boot);
+}
+
+void SpinDelay(u64 microseconds){
+    u64 end = ReadTimestampCounter() + (tsc_frequency / 1000000) * microseconds;
+    while(ReadTimestampCounter() < end){
+        CPUPause();
+    }
+}
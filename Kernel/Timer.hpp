@@ -0,0 +1,46 @@
+/**
+ * @file Timer.hpp
+ * @author Siddharth Mishra (brightprogrammer)
+ * @date 10/18/26
+ * @brief Time keeping using time stamp counter.
+ * @copyright MIT License 2022 Siddharth Mishra
+ * */
+
+#ifndef TIMER_HPP
+#define TIMER_HPP
+
+#include "Common.hpp"
+
+/**
+ * @brief Calibrate time stamp counter frequency using PIT channel 2.
+ * Must be called once on boot processor before any other function
+ * from this file is used. Interrupts may stay disabled.
+ * */
+void InitializeTimer();
+
+/**
+ * @brief Get calibrated time stamp counter frequency.
+ *
+ * @return Number of tsc ticks per second.
+ * */
+u64 GetTimestampFrequency();
+
+/**
+ * @brief Convert given number of tsc cycles to nanoseconds.
+ *
+ * @param cycles Number of cycles.
+ * @return Equivalent number of nanoseconds.
+ * */
+u64 CyclesToNanoseconds(u64 cycles);
+
+/**
+ * @brief Get nanoseconds elapsed since timer was initialized.
+ * */
+u64 GetUptimeNanoseconds();
+
+/**
+ * @brief Busy wait for given number of microseconds.
+ * */
+void SpinDelay(u64 microseconds);
+
+#endif // TIMER_HPP
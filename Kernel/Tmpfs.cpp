@@ -0,0 +1,372 @@
+/**
+ * @file Tmpfs.cpp
+ * @author Siddharth Mishra (brightprogrammer)
+ * @date 10/18/26
+ * @brief Filesystem in memory, file data lives only in page cache.
+ * @copyright MIT License 2022 Siddharth Mishra
+ * */
+
+#include "Tmpfs.hpp"
+#include "VFS.hpp"
+#include "PageCache.hpp"
+#include "FAT32.hpp"
+#include "Block.hpp"
+#include "MemoryManager.hpp"
+#include "Slab.hpp"
+#include "Mutex.hpp"
+#include "Timer.hpp"
+#include "Printf.hpp"
+#include "String.hpp"
+
+#include <new>
+
+struct TmpfsNode {
+    u64 id;
+    u32 type;
+    // one for being in a directory, and one for every reference VFS holds
+    volatile u32 references;
+    // children of a directory, oldest first so in order of id
+    TmpfsNode* children;
+    // next field of last child, where new children are linked
+    TmpfsNode** children_end;
+    TmpfsNode* next;
+    // data of a file
+    PageCache* cache;
+    u32 name_length;
+    char name[VFS_NAME_MAX + 1];
+};
+
+struct Tmpfs {
+    // protects children of every directory, readers don't hold VFS lock
+    Mutex lock;
+    PageCacheLimit limit;
+    u64 next_id;
+    TmpfsNode* root;
+
+    Tmpfs() : lock("tmpfs") {}
+};
+
+static SlabCache tmpfs_cache("tmpfs", sizeof(Tmpfs));
+static SlabCache tmpfs_node_cache("tmpfs.node", sizeof(TmpfsNode));
+
+static TmpfsNode* NewNode(Tmpfs* fs, u32 type, const char* name, u64 length){
+    TmpfsNode* node = reinterpret_cast<TmpfsNode*>(SlabAllocate(&tmpfs_node_cache));
+    if(node == nullptr) return nullptr;
+
+    node->cache = nullptr;
+    if(type == VFS_TYPE_FILE){
+        node->cache = CreateMemoryPageCache(&fs->limit);
+        if(node->cache == nullptr){
+            SlabFree(&tmpfs_node_cache, node);
+            return nullptr;
+        }
+    }
+    node->id = ++fs->next_id;
+    node->type = type;
+    node->references = 1;
+    node->children = nullptr;
+    node->children_end = &node->children;
+    node->next = nullptr;
+    node->name_length = length;
+    memcpy(node->name, name, length);
+    node->name[length] = 0;
+    return node;
+}
+
+// node is freed with it's data once it's in no directory and VFS doesn't hold it
+static void PutNode(TmpfsNode* node){
+    if(__atomic_sub_fetch(&node->references, 1, __ATOMIC_ACQ_REL) != 0) return;
+    if(node->cache) FreeMemoryPageCache(node->cache);
+    SlabFree(&tmpfs_node_cache, node);
+}
+
+static void FillNodeInfo(TmpfsNode* node, VFSNodeInfo* info){
+    info->node = node;
+    info->id = node->id;
+    info->type = node->type;
+    info->size = node->cache ? GetMemoryPageCacheSize(node->cache) : 0;
+    info->cache = node->cache;
+}
+
+/******************** VFS ********************/
+
+static bool TmpfsLookup(Inode* directory, const char* name, u64 length, VFSNodeInfo* info){
+    Tmpfs* fs = reinterpret_cast<Tmpfs*>(directory->mount->data);
+    TmpfsNode* parent = reinterpret_cast<TmpfsNode*>(directory->node);
+    LockGuard guard(fs->lock);
+    for(TmpfsNode* child = parent->children; child; child = child->next){
+        if(child->name_length == length && memcmp(child->name, name, length) == 0){
+            __atomic_fetch_add(&child->references, 1, __ATOMIC_RELAXED);
+            FillNodeInfo(child, info);
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool TmpfsCreate(Inode* directory, const char* name, u64 length, u32 type, VFSNodeInfo* info){
+    Tmpfs* fs = reinterpret_cast<Tmpfs*>(directory->mount->data);
+    TmpfsNode* parent = reinterpret_cast<TmpfsNode*>(directory->node);
+    LockGuard guard(fs->lock);
+    TmpfsNode* node = NewNode(fs, type, name, length);
+    if(node == nullptr) return false;
+
+    // reference of directory, and one for caller
+    node->references = 2;
+    *parent->children_end = node;
+    parent->children_end = &node->next;
+    FillNodeInfo(node, info);
+    return true;
+}
+
+static bool TmpfsRemove(Inode* directory, const char* name, u64 length){
+    Tmpfs* fs = reinterpret_cast<Tmpfs*>(directory->mount->data);
+    TmpfsNode* parent = reinterpret_cast<TmpfsNode*>(directory->node);
+    TmpfsNode* node = nullptr;
+    {
+        LockGuard guard(fs->lock);
+        for(TmpfsNode** link = &parent->children; *link; link = &(*link)->next){
+            if((*link)->name_length != length || memcmp((*link)->name, name, length) != 0) continue;
+            if((*link)->children) return false;
+
+            node = *link;
+            *link = node->next;
+            if(parent->children_end == &node->next) parent->children_end = link;
+            break;
+        }
+    }
+    if(node == nullptr) return false;
+
+    // data of node may go with it, no need to hold lock for that
+    PutNode(node);
+    return true;
+}
+
+// data is in page cache, which never calls these for a memory cache,
+// they only tell VFS that files can be written and truncated
+static u64 TmpfsRead(Inode*, u64, void*, u64){
+    return VFS_ERROR;
+}
+
+static u64 TmpfsWrite(Inode*, u64, const void*, u64){
+    return VFS_ERROR;
+}
+
+static bool TmpfsTruncate(Inode*, u64){
+    return false;
+}
+
+// cookie is id of last child returned, children are in order of id, so
+// children created or removed meanwhile don't make others skipped or repeated
+static bool TmpfsReadDirectory(Inode* directory, u64* cookie, VFSDirectoryEntry* entry){
+    Tmpfs* fs = reinterpret_cast<Tmpfs*>(directory->mount->data);
+    LockGuard guard(fs->lock);
+    TmpfsNode* child = reinterpret_cast<TmpfsNode*>(directory->node)->children;
+    while(child && child->id <= *cookie) child = child->next;
+    if(child == nullptr) return false;
+
+    memcpy(entry->name, child->name, child->name_length + 1);
+    entry->type = child->type;
+    entry->size = child->cache ? GetMemoryPageCacheSize(child->cache) : 0;
+    *cookie = child->id;
+    return true;
+}
+
+static void TmpfsRelease(Mount*, void* node){
+    PutNode(reinterpret_cast<TmpfsNode*>(node));
+}
+
+// drop references of directories to their children, leaves first
+static void FreeChildren(TmpfsNode* directory){
+    while(directory->children){
+        TmpfsNode* child = directory->children;
+        directory->children = child->next;
+        FreeChildren(child);
+        PutNode(child);
+    }
+}
+
+static void TmpfsUnmount(Mount* mount){
+    Tmpfs* fs = reinterpret_cast<Tmpfs*>(mount->data);
+    FreeChildren(fs->root);
+    PutNode(fs->root);
+    SlabFree(&tmpfs_cache, fs);
+}
+
+static const VFSOperations tmpfs_operations = {
+    "tmpfs", false,
+    TmpfsLookup, TmpfsCreate, TmpfsRemove,
+    TmpfsRead, TmpfsWrite, TmpfsTruncate,
+    TmpfsReadDirectory, TmpfsRelease, nullptr, TmpfsUnmount
+};
+
+static Tmpfs* CreateTmpfs(u64 max_size){
+    void* memory = SlabAllocate(&tmpfs_cache);
+    if(memory == nullptr) return nullptr;
+    Tmpfs* fs = new (memory) Tmpfs();
+
+    fs->limit.pages = 0;
+    fs->limit.max_pages = max_size / PAGE_SIZE;
+    fs->next_id = 0;
+    fs->root = NewNode(fs, VFS_TYPE_DIRECTORY, "", 0);
+    if(fs->root == nullptr){
+        SlabFree(&tmpfs_cache, fs);
+        return nullptr;
+    }
+    return fs;
+}
+
+// tmpfs is freed if mount fails
+static bool MountTmpfsVolume(const char* path, Tmpfs* fs){
+    // root stays with tmpfs, VFS gets a reference of it's own
+    VFSNodeInfo root;
+    __atomic_fetch_add(&fs->root->references, 1, __ATOMIC_RELAXED);
+    FillNodeInfo(fs->root, &root);
+    if(VFSMount(path, &tmpfs_operations, fs, &root)) return true;
+
+    PutNode(fs->root);
+    PutNode(fs->root);
+    SlabFree(&tmpfs_cache, fs);
+    return false;
+}
+
+bool MountTmpfs(const char* path, u64 max_size){
+    Tmpfs* fs = CreateTmpfs(max_size);
+    return fs && MountTmpfsVolume(path, fs);
+}
+
+/******************** Tmpfs Benchmark ********************/
+
+#define BENCH_TMPFS_FILES 1000
+#define BENCH_TMPFS_FILE_SIZE (u64(4) * KB)
+#define BENCH_TMPFS_LARGE_FILE (u64(16) * MB)
+#define BENCH_TMPFS_CHUNK (u64(64) * KB)
+// benchmark mounts tmpfs of it's own, so that it's usage can be seen
+#define BENCH_TMPFS_SIZE (u64(64) * MB)
+#define BENCH_TMPFS_LIMITED_SIZE (u64(1) * MB)
+#define BENCH_TMPFS_SPARSE_OFFSET (u64(1) * GB)
+#define BENCH_TMPFS_PATH_SIZE 64
+
+// create small files and write a large one in a directory
+static void TimeCreateAndWrite(const char* directory, const void* chunk, u64* creates, u64* write_rate){
+    char path[BENCH_TMPFS_PATH_SIZE];
+    u32 created = 0;
+    u64 start = GetUptimeNanoseconds();
+    for(; created < BENCH_TMPFS_FILES; created++){
+        sprintf(path, "%s/file%i", directory, i32(created));
+        File* file = VFSOpen(path, VFS_OPEN_WRITE | VFS_OPEN_CREATE);
+        if(file == nullptr) break;
+        VFSWrite(file, chunk, BENCH_TMPFS_FILE_SIZE);
+        VFSClose(file);
+    }
+    u64 ns = GetUptimeNanoseconds() - start;
+    *creates = ns ? u64(created) * 1000000000 / ns : 0;
+
+    sprintf(path, "%s/large", directory);
+    File* file = VFSOpen(path, VFS_OPEN_WRITE | VFS_OPEN_CREATE);
+    u64 written = 0;
+    start = GetUptimeNanoseconds();
+    while(file && written < BENCH_TMPFS_LARGE_FILE){
+        u64 count = VFSWrite(file, chunk, BENCH_TMPFS_CHUNK);
+        if(count == 0 || count == VFS_ERROR) break;
+        written += count;
+    }
+    ns = GetUptimeNanoseconds() - start;
+    if(file) VFSClose(file);
+    *write_rate = ns ? written * 1000 / ns : 0;
+}
+
+void BenchmarkTmpfs(){
+    ColorPrintf(COLOR_YELLOW, COLOR_BLACK, "[+] Benchmark : Tmpfs\n");
+
+    Tmpfs* fs = CreateTmpfs(BENCH_TMPFS_SIZE);
+    if(fs == nullptr || !VFSMakeDirectory("/tmp/bench") || !MountTmpfsVolume("/tmp/bench", fs)){
+        Printf("\tFailed to mount tmpfs\n");
+        return;
+    }
+    u64 chunk_pages = BENCH_TMPFS_CHUNK / PAGE_SIZE;
+    u8* chunk = reinterpret_cast<u8*>(AllocateKernelMemory(chunk_pages));
+    memset(chunk, 0xab, BENCH_TMPFS_CHUNK);
+
+    u64 creates, write_rate;
+    TimeCreateAndWrite("/tmp/bench", chunk, &creates, &write_rate);
+    Printf("\ttmpfs : %lu creates/s (%lu KB each) | %lu MB/s writes | %lu KB used\n",
+           creates, BENCH_TMPFS_FILE_SIZE / KB, write_rate, fs->limit.pages * PAGE_SIZE / KB);
+
+    // same thing through buffer cache to scratch disk
+    BlockDevice* device = FindBlockDevice("nvme0n1");
+    FAT32Volume* volume = device && FormatFAT32(device) ? MountFAT32(device) : nullptr;
+    // earlier benchmarks may have made mountpoint already
+    VFSMakeDirectory("/scratch");
+    if(volume && VFSMountFAT32("/scratch", volume)){
+        TimeCreateAndWrite("/scratch", chunk, &creates, &write_rate);
+        u64 start = GetUptimeNanoseconds();
+        SyncVFS();
+        u64 sync_ns = GetUptimeNanoseconds() - start;
+        Printf("\tFAT32 : %lu creates/s (%lu KB each) | %lu MB/s writes | %lu ms to sync\n",
+               creates, BENCH_TMPFS_FILE_SIZE / KB, write_rate, sync_ns / 1000000);
+        if(!VFSUnmount("/scratch")) Printf("\tFailed to unmount scratch disk\n");
+    }else{
+        if(volume) UnmountFAT32(volume);
+        Printf("\tNo scratch disk\n");
+    }
+
+    // pages become file data without being copied
+    u64 count = BENCH_TMPFS_LARGE_FILE / PAGE_SIZE;
+    u64 list_pages = (count * sizeof(u64) + PAGE_SIZE - 1) / PAGE_SIZE;
+    u64* pages = reinterpret_cast<u64*>(AllocateKernelMemory(list_pages));
+    for(u64 i = 0; i < count; i++){
+        pages[i] = AllocatePage();
+        *reinterpret_cast<u64*>(pages[i]) = i;
+    }
+    File* file = VFSOpen("/tmp/bench/spliced", VFS_OPEN_READ | VFS_OPEN_WRITE | VFS_OPEN_CREATE);
+    u64 moved = 0;
+    u64 start = GetUptimeNanoseconds();
+    if(file) moved = VFSSplice(file, pages, count);
+    u64 ns = GetUptimeNanoseconds() - start;
+    for(u64 i = moved; i < count; i++) ReleasePage(pages[i]);
+    u64 last = 0;
+    if(file && moved){
+        VFSSeek(file, (moved - 1) * PAGE_SIZE);
+        VFSRead(file, &last, sizeof(last));
+    }
+    if(file) VFSClose(file);
+    FreeKernelMemory(reinterpret_cast<u64>(pages), list_pages);
+    Printf("\tSplice : %lu MB/s | %lu of %lu pages moved | %s\n",
+           ns ? moved * PAGE_SIZE * 1000 / ns : 0, moved, count, moved && last == moved - 1 ? "data ok" : "data differs");
+
+    // only written page takes memory, hole reads as zero
+    u64 used = fs->limit.pages;
+    u64 hole = ~u64(0);
+    file = VFSOpen("/tmp/bench/sparse", VFS_OPEN_READ | VFS_OPEN_WRITE | VFS_OPEN_CREATE);
+    if(file){
+        VFSSeek(file, BENCH_TMPFS_SPARSE_OFFSET);
+        VFSWrite(file, chunk, PAGE_SIZE);
+        VFSSeek(file, BENCH_TMPFS_SPARSE_OFFSET / 2);
+        VFSRead(file, &hole, sizeof(hole));
+        Printf("\tSparse file : %lu MB in size, %lu KB of memory | hole reads %s\n",
+               file->inode->size / MB, (fs->limit.pages - used) * PAGE_SIZE / KB, hole == 0 ? "zero" : "garbage");
+        VFSClose(file);
+    }
+
+    // writes stop once mount is full
+    Tmpfs* small = CreateTmpfs(BENCH_TMPFS_LIMITED_SIZE);
+    if(small && VFSMakeDirectory("/tmp/bench/limited") && MountTmpfsVolume("/tmp/bench/limited", small)){
+        file = VFSOpen("/tmp/bench/limited/fill", VFS_OPEN_WRITE | VFS_OPEN_CREATE);
+        u64 written = 0;
+        while(file){
+            u64 count = VFSWrite(file, chunk, BENCH_TMPFS_CHUNK);
+            if(count == VFS_ERROR) break;
+            written += count;
+            if(count < BENCH_TMPFS_CHUNK) break;
+        }
+        if(file) VFSClose(file);
+        Printf("\tSize limit : %lu KB written to a %lu KB tmpfs before it was full\n",
+               written / KB, BENCH_TMPFS_LIMITED_SIZE / KB);
+        VFSUnmount("/tmp/bench/limited");
+    }
+
+    FreeKernelMemory(reinterpret_cast<u64>(chunk), chunk_pages);
+    if(!VFSUnmount("/tmp/bench")) Printf("\tFailed to unmount tmpfs\n");
+    VFSRemove("/tmp/bench");
+}
@@ -0,0 +1,48 @@
+/**
+ * @file Tmpfs.hpp
+ * @author Siddharth Mishra (brightprogrammer)
+ * @date 10/18/26
+ * @brief Filesystem in memory, file data lives only in page cache.
+ * @copyright MIT License 2022 Siddharth Mishra
+ * */
+
+#ifndef TMPFS_HPP
+#define TMPFS_HPP
+
+#include "Common.hpp"
+
+/* ------------------ TMPFS --------------------
+ *
+ * Directories are lists of nodes in memory. Data of a file is in pages
+ * taken from page allocator and indexed by file's page cache, which is
+ * created with file and freed with it (see memory caches in PageCache.hpp),
+ * so reads, writes and mappings of a tmpfs file are page cache operations
+ * that never reach tmpfs.
+ *
+ * Files are sparse, only pages that were written (or mapped) take memory,
+ * and all files of a mount together can't take more than it's size.
+ * Pages can be spliced into a file (see VFSSplice), which makes them part
+ * of file without copying.
+ *
+ * Directories are changed by VFS with it's lock held, but lookups and
+ * reads of a directory come without it, so a lock of each mount protects
+ * all it's directories. Children are kept in order of creation and a
+ * directory is read by node id, so a reader never skips or repeats an
+ * entry while directory changes under it.
+ *
+ * */
+
+/**
+ * @brief Mount an empty tmpfs on an existing directory.
+ *
+ * @param max_size Most bytes of file data it can hold, rounded down to pages.
+ * */
+bool MountTmpfs(const char* path, u64 max_size);
+
+/**
+ * @brief Create files and write them on tmpfs and on FAT32, and measure
+ * splicing, sparse files and size limit of tmpfs.
+ * */
+void BenchmarkTmpfs();
+
+#endif // TMPFS_HPP
@@ -0,0 +1,1056 @@
+/**
+ * @file VFS.cpp
+ * @author Siddharth Mishra (brightprogrammer)
+ * @date 10/18/26
+ * @brief Virtual filesystem : one tree of mounts, inodes, open files
+ * and a cache of path lookups in front of them.
+ * @copyright MIT License 2022 Siddharth Mishra
+ * */
+
+#include "VFS.hpp"
+#include "PageCache.hpp"
+#include "Writeback.hpp"
+#include "RCU.hpp"
+#include "Mutex.hpp"
+#include "Slab.hpp"
+#include "Block.hpp"
+#include "FAT32.hpp"
+#include "Initramfs.hpp"
+#include "Tmpfs.hpp"
+#include "MemoryManager.hpp"
+#include "Thread.hpp"
+#include "SMP.hpp"
+#include "CPU.hpp"
+#include "Timer.hpp"
+#include "Printf.hpp"
+#include "String.hpp"
+
+#define VFS_DENTRY_BUCKETS 4096
+#define VFS_INODE_BUCKETS 1024
+// unused dentries are evicted once there are more than this many
+#define VFS_DENTRY_LIMIT 16384
+// evicted objects are freed in batches, one grace period for each batch
+#define VFS_RETIRE_BATCH 64
+// most file data /tmp can hold
+#define VFS_TMP_SIZE (u64(64) * MB)
+// set in reference count of an object that is being freed,
+// a lock free walk can't take a reference to it anymore
+#define VFS_DEAD 0x80000000
+
+struct Dentry {
+    // holds a reference to parent, nullptr for root of a mount
+    Dentry* parent;
+    Mount* mount;
+    // nullptr for a negative dentry
+    Inode* volatile inode;
+    // mount covering this dentry
+    Mount* volatile mounted;
+    u32 hash;
+    u32 name_length;
+    volatile u32 references;
+    // set by lookups, cleared by eviction clock
+    volatile bool referenced;
+    Dentry* volatile hash_next;
+    Dentry* lru_prev;
+    Dentry* lru_next;
+    Dentry* retire_next;
+    char name[VFS_NAME_MAX + 1];
+};
+
+static SlabCache dentry_cache("vfs.dentry", sizeof(Dentry));
+static SlabCache inode_cache("vfs.inode", sizeof(Inode));
+static SlabCache file_cache("vfs.file", sizeof(File));
+static SlabCache mount_cache("vfs.mount", sizeof(Mount));
+
+// serializes everything that changes dentries, inodes and mounts,
+// filesystems are called with it held
+static Mutex vfs_lock("vfs");
+
+static Dentry* volatile dentry_hash[VFS_DENTRY_BUCKETS];
+static Inode* inode_hash[VFS_INODE_BUCKETS];
+// every hashed dentry, most recently added at head
+static Dentry* lru_head;
+static Dentry* lru_tail;
+static u64 dentry_count;
+static Mount* mounts;
+static Mount* volatile root_mount;
+
+static Dentry* retired_dentries;
+static Inode* retired_inodes;
+static u64 retired_count;
+
+// lookups that needed the lock, and those that reached a filesystem
+static u64 locked_walks;
+static u64 filesystem_lookups;
+static u64 evictions;
+
+/******************** Reference Counts ********************/
+
+// take a reference unless object is being freed
+static bool TryGetDentry(Dentry* dentry){
+    u32 references = __atomic_load_n(&dentry->references, __ATOMIC_RELAXED);
+    while(!(references & VFS_DEAD)){
+        if(__atomic_compare_exchange_n(&dentry->references, &references, references + 1, true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)){
+            return true;
+        }
+    }
+    return false;
+}
+
+// unused dentries stay cached, eviction frees them
+static void PutDentry(Dentry* dentry){
+    __atomic_fetch_sub(&dentry->references, 1, __ATOMIC_RELEASE);
+}
+
+// inodes are freed as soon as they are unused, so a count
+// of 0 can't be brought back without the lock
+static bool TryGetInode(Inode* inode){
+    u32 references = __atomic_load_n(&inode->references, __ATOMIC_RELAXED);
+    while(references != 0 && !(references & VFS_DEAD)){
+        if(__atomic_compare_exchange_n(&inode->references, &references, references + 1, true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)){
+            return true;
+        }
+    }
+    return false;
+}
+
+// free objects retired so far, once no lock free walk can see them
+static void FlushRetired(){
+    if(retired_count == 0) return;
+    SynchronizeRCU();
+
+    while(retired_dentries){
+        Dentry* next = retired_dentries->retire_next;
+        SlabFree(&dentry_cache, retired_dentries);
+        retired_dentries = next;
+    }
+    while(retired_inodes){
+        Inode* next = retired_inodes->retire_next;
+        SlabFree(&inode_cache, retired_inodes);
+        retired_inodes = next;
+    }
+    retired_count = 0;
+}
+
+static void RetireDentry(Dentry* dentry){
+    dentry->retire_next = retired_dentries;
+    retired_dentries = dentry;
+    if(++retired_count >= VFS_RETIRE_BATCH) FlushRetired();
+}
+
+static void RetireInode(Inode* inode){
+    inode->retire_next = retired_inodes;
+    retired_inodes = inode;
+    if(++retired_count >= VFS_RETIRE_BATCH) FlushRetired();
+}
+
+static u64 InodeBucket(Mount* mount, u64 id){
+    u64 key = (reinterpret_cast<u64>(mount) >> 4) ^ (id * 0x9e3779b97f4a7c15);
+    return (key ^ (key >> 32)) % VFS_INODE_BUCKETS;
+}
+
+static void UnhashInode(Inode* inode){
+    Inode** link = &inode_hash[InodeBucket(inode->mount, inode->id)];
+    while(*link != inode) link = &(*link)->hash_next;
+    *link = inode->hash_next;
+    inode->hashed = false;
+}
+
+// drop a reference, vfs_lock must be held
+static void PutInodeLocked(Inode* inode){
+    if(__atomic_sub_fetch(&inode->references, 1, __ATOMIC_ACQ_REL) != 0) return;
+
+    // a lock free walk may still be racing for it, whoever wins decides
+    u32 expected = 0;
+    if(!__atomic_compare_exchange_n(&inode->references, &expected, VFS_DEAD, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)){
+        return;
+    }
+    if(inode->hashed) UnhashInode(inode);
+    if(inode->cache) DestroyPageCache(inode);
+    inode->ops->release(inode->mount, inode->node);
+    RetireInode(inode);
+}
+
+static void PutInode(Inode* inode){
+    // fast path, common case is that somebody else still holds it
+    u32 references = __atomic_load_n(&inode->references, __ATOMIC_RELAXED);
+    while(references > 1){
+        if(__atomic_compare_exchange_n(&inode->references, &references, references - 1, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED)){
+            return;
+        }
+    }
+
+    LockGuard guard(vfs_lock);
+    PutInodeLocked(inode);
+}
+
+// get inode of a node found by filesystem, takes over node's reference
+static Inode* GetInode(Mount* mount, VFSNodeInfo* info){
+    u64 bucket = InodeBucket(mount, info->id);
+    for(Inode* inode = inode_hash[bucket]; inode; inode = inode->hash_next){
+        if(inode->mount == mount && inode->id == info->id && !(inode->references & VFS_DEAD)){
+            __atomic_fetch_add(&inode->references, 1, __ATOMIC_ACQUIRE);
+            // filesystem gave us another reference to a node we already have
+            mount->ops->release(mount, info->node);
+            return inode;
+        }
+    }
+
+    Inode* inode = reinterpret_cast<Inode*>(SlabAllocate(&inode_cache));
+    if(inode == nullptr){
+        mount->ops->release(mount, info->node);
+        return nullptr;
+    }
+    inode->mount = mount;
+    inode->ops = mount->ops;
+    inode->node = info->node;
+    inode->id = info->id;
+    inode->type = info->type;
+    inode->size = info->size;
+    inode->references = 1;
+    // without a cache file is read straight from filesystem
+    inode->cache = info->cache;
+    if(inode->cache == nullptr && info->type == VFS_TYPE_FILE) inode->cache = CreatePageCache();
+    inode->hashed = true;
+    inode->hash_next = inode_hash[bucket];
+    inode_hash[bucket] = inode;
+    return inode;
+}
+
+/******************** Dentry Cache ********************/
+
+static u32 HashName(const char* name, u64 length, bool ignore_case){
+    u32 hash = 2166136261u;
+    for(u64 i = 0; i < length; i++){
+        hash ^= u8(ignore_case ? tolower(name[i]) : name[i]);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static u64 DentryBucket(Dentry* parent, u32 hash){
+    u64 key = (reinterpret_cast<u64>(parent) >> 4) ^ (u64(hash) * 0x9e3779b97f4a7c15);
+    return (key ^ (key >> 32)) % VFS_DENTRY_BUCKETS;
+}
+
+static bool NamesMatch(const char* a, const char* b, u64 length, bool ignore_case){
+    if(!ignore_case) return memcmp(a, b, length) == 0;
+    for(u64 i = 0; i < length; i++){
+        if(tolower(a[i]) != tolower(b[i])) return false;
+    }
+    return true;
+}
+
+// safe without lock inside an RCU read section
+static Dentry* FindChild(Dentry* parent, const char* name, u64 length){
+    bool ignore_case = parent->mount->ops->ignore_case;
+    u32 hash = HashName(name, length, ignore_case);
+    Dentry* dentry = __atomic_load_n(&dentry_hash[DentryBucket(parent, hash)], __ATOMIC_ACQUIRE);
+    for(; dentry; dentry = __atomic_load_n(&dentry->hash_next, __ATOMIC_ACQUIRE)){
+        if(dentry->parent == parent && dentry->hash == hash && dentry->name_length == length &&
+           NamesMatch(dentry->name, name, length, ignore_case) &&
+           !(__atomic_load_n(&dentry->references, __ATOMIC_RELAXED) & VFS_DEAD)){
+            return dentry;
+        }
+    }
+    return nullptr;
+}
+
+static void LinkLRU(Dentry* dentry){
+    dentry->lru_prev = nullptr;
+    dentry->lru_next = lru_head;
+    if(lru_head) lru_head->lru_prev = dentry;
+    else lru_tail = dentry;
+    lru_head = dentry;
+}
+
+static void UnlinkLRU(Dentry* dentry){
+    if(dentry->lru_prev) dentry->lru_prev->lru_next = dentry->lru_next;
+    else lru_head = dentry->lru_next;
+    if(dentry->lru_next) dentry->lru_next->lru_prev = dentry->lru_prev;
+    else lru_tail = dentry->lru_prev;
+}
+
+// free an unused dentry, returns false if it's in use
+static bool EvictDentry(Dentry* dentry){
+    if(dentry->mounted) return false;
+    u32 expected = 0;
+    if(!__atomic_compare_exchange_n(&dentry->references, &expected, VFS_DEAD, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)){
+        return false;
+    }
+
+    // walks already on this dentry can still follow hash_next
+    Dentry* volatile* link = &dentry_hash[DentryBucket(dentry->parent, dentry->hash)];
+    while(*link != dentry) link = &(*link)->hash_next;
+    __atomic_store_n(link, dentry->hash_next, __ATOMIC_RELEASE);
+
+    UnlinkLRU(dentry);
+    dentry_count--;
+    evictions++;
+    PutDentry(dentry->parent);
+    if(dentry->inode) PutInodeLocked(dentry->inode);
+    RetireDentry(dentry);
+    return true;
+}
+
+// clock over lru list, recently used and busy dentries get moved to head
+static void EvictDentries(u64 target){
+    u64 steps = dentry_count * 2;
+    while(dentry_count > target && steps-- && lru_tail){
+        Dentry* dentry = lru_tail;
+        if(dentry->referenced || dentry->references || !EvictDentry(dentry)){
+            dentry->referenced = false;
+            UnlinkLRU(dentry);
+            LinkLRU(dentry);
+        }
+    }
+}
+
+// add a dentry to cache, inode's reference belongs to dentry
+static Dentry* NewDentry(Dentry* parent, const char* name, u64 length, Inode* inode){
+    // make room first, so that new dentry can't be evicted before caller uses it
+    if(dentry_count >= VFS_DENTRY_LIMIT) EvictDentries(VFS_DENTRY_LIMIT * 7 / 8);
+
+    Dentry* dentry = reinterpret_cast<Dentry*>(SlabAllocate(&dentry_cache));
+    if(dentry == nullptr) return nullptr;
+
+    dentry->parent = parent;
+    dentry->mount = parent->mount;
+    dentry->inode = inode;
+    dentry->mounted = nullptr;
+    dentry->hash = HashName(name, length, parent->mount->ops->ignore_case);
+    dentry->name_length = length;
+    dentry->references = 0;
+    dentry->referenced = true;
+    memcpy(dentry->name, name, length);
+    dentry->name[length] = 0;
+    __atomic_fetch_add(&parent->references, 1, __ATOMIC_RELAXED);
+
+    LinkLRU(dentry);
+    dentry_count++;
+    // publish only once dentry is filled
+    Dentry* volatile* bucket = &dentry_hash[DentryBucket(parent, dentry->hash)];
+    dentry->hash_next = *bucket;
+    __atomic_store_n(bucket, dentry, __ATOMIC_RELEASE);
+    return dentry;
+}
+
+// root of a mount, never hashed or evicted, mount holds a reference
+static Dentry* NewRootDentry(Mount* mount, Inode* inode){
+    Dentry* dentry = reinterpret_cast<Dentry*>(SlabAllocate(&dentry_cache));
+    if(dentry == nullptr) return nullptr;
+    memset(dentry, 0, sizeof(Dentry));
+    dentry->mount = mount;
+    dentry->inode = inode;
+    dentry->references = 1;
+    return dentry;
+}
+
+void ShrinkDentryCache(){
+    LockGuard guard(vfs_lock);
+    // children hold their parents, so evicting leaves frees parents for next round
+    for(u64 evicted = 1; evicted;){
+        evicted = 0;
+        for(Dentry* dentry = lru_head; dentry;){
+            Dentry* next = dentry->lru_next;
+            evicted += EvictDentry(dentry);
+            dentry = next;
+        }
+    }
+    FlushRetired();
+}
+
+/******************** Path Walk ********************/
+
+// get next component of path, returns false at end
+static bool NextComponent(const char** path, const char** name, u64* length){
+    const char* p = *path;
+    while(*p == '/') p++;
+    if(*p == 0) return false;
+
+    *name = p;
+    while(*p && *p != '/') p++;
+    *length = p - *name;
+    *path = p;
+    return true;
+}
+
+// ".." of root of a mount is ".." of directory it covers
+static Dentry* ParentOf(Dentry* dentry){
+    while(dentry->parent == nullptr && dentry->mount->mountpoint) dentry = dentry->mount->mountpoint;
+    return dentry->parent ? dentry->parent : dentry;
+}
+
+static Dentry* FollowMounts(Dentry* dentry){
+    Mount* mount;
+    while((mount = __atomic_load_n(&dentry->mounted, __ATOMIC_ACQUIRE))) dentry = mount->root;
+    return dentry;
+}
+
+static bool IsDirectory(Dentry* dentry){
+    Inode* inode = __atomic_load_n(&dentry->inode, __ATOMIC_ACQUIRE);
+    return inode && inode->type == VFS_TYPE_DIRECTORY;
+}
+
+// walk without any lock, retry is set if something is not cached
+// returns referenced dentry, which can be negative, or nullptr if path doesn't exist
+static Dentry* WalkLockFree(const char* path, bool* retry){
+    *retry = false;
+    RCUReadLock();
+
+    Dentry* dentry = __atomic_load_n(&root_mount, __ATOMIC_ACQUIRE)->root;
+    const char* name;
+    u64 length;
+    while(dentry && NextComponent(&path, &name, &length)){
+        if(length == 1 && name[0] == '.') continue;
+        if(length == 2 && name[0] == '.' && name[1] == '.'){
+            dentry = ParentOf(dentry);
+            continue;
+        }
+        if(!IsDirectory(dentry) || length > VFS_NAME_MAX){
+            dentry = nullptr;
+            break;
+        }
+
+        Dentry* child = FindChild(dentry, name, length);
+        if(child == nullptr){
+            *retry = true;
+            dentry = nullptr;
+            break;
+        }
+        // avoid dirtying cache line of hot dentries
+        if(!child->referenced) child->referenced = true;
+        dentry = FollowMounts(child);
+    }
+
+    // dentry may have been evicted since we found it
+    if(dentry && !TryGetDentry(dentry)){
+        *retry = true;
+        dentry = nullptr;
+    }
+    RCUReadUnlock();
+    return dentry;
+}
+
+// move a walk's reference from one dentry to another
+static Dentry* MoveTo(Dentry* from, Dentry* to){
+    __atomic_fetch_add(&to->references, 1, __ATOMIC_RELAXED);
+    PutDentry(from);
+    return to;
+}
+
+// walk holding vfs_lock, asking filesystems for names that are not cached
+static Dentry* WalkLocked(const char* path){
+    locked_walks++;
+    Dentry* dentry = root_mount->root;
+    __atomic_fetch_add(&dentry->references, 1, __ATOMIC_RELAXED);
+
+    const char* name;
+    u64 length;
+    while(NextComponent(&path, &name, &length)){
+        if(length == 1 && name[0] == '.') continue;
+        if(length == 2 && name[0] == '.' && name[1] == '.'){
+            dentry = MoveTo(dentry, ParentOf(dentry));
+            continue;
+        }
+        if(!IsDirectory(dentry) || length > VFS_NAME_MAX){
+            PutDentry(dentry);
+            return nullptr;
+        }
+
+        Dentry* child = FindChild(dentry, name, length);
+        if(child == nullptr){
+            filesystem_lookups++;
+            Inode* directory = dentry->inode;
+            VFSNodeInfo info;
+            Inode* inode = nullptr;
+            if(directory->ops->lookup(directory, name, length, &info)){
+                inode = GetInode(dentry->mount, &info);
+                if(inode == nullptr){
+                    PutDentry(dentry);
+                    return nullptr;
+                }
+            }
+            child = NewDentry(dentry, name, length, inode);
+            if(child == nullptr){
+                if(inode) PutInodeLocked(inode);
+                PutDentry(dentry);
+                return nullptr;
+            }
+        }
+        child->referenced = true;
+        dentry = MoveTo(dentry, FollowMounts(child));
+    }
+    return dentry;
+}
+
+static Dentry* LookupPath(const char* path){
+    if(__atomic_load_n(&root_mount, __ATOMIC_ACQUIRE) == nullptr) return nullptr;
+
+    bool retry;
+    Dentry* dentry = WalkLockFree(path, &retry);
+    if(!retry) return dentry;
+
+    LockGuard guard(vfs_lock);
+    return WalkLocked(path);
+}
+
+// get a reference to inode of a dentry, nullptr if it's negative
+static Inode* GetDentryInode(Dentry* dentry){
+    RCUReadLock();
+    Inode* inode = __atomic_load_n(&dentry->inode, __ATOMIC_ACQUIRE);
+    if(inode && !TryGetInode(inode)) inode = nullptr;
+    RCUReadUnlock();
+    return inode;
+}
+
+// turn a negative dentry into a new file or directory, vfs_lock must be held
+// returns referenced inode
+static Inode* CreateLocked(Dentry* dentry, u32 type){
+    // somebody else may have created it since we looked
+    if(dentry->inode){
+        if(dentry->inode->type != type) return nullptr;
+        __atomic_fetch_add(&dentry->inode->references, 1, __ATOMIC_RELAXED);
+        return dentry->inode;
+    }
+
+    Dentry* parent = dentry->parent;
+    if(parent == nullptr) return nullptr;
+    Inode* directory = parent->inode;
+    if(directory == nullptr || directory->ops->create == nullptr) return nullptr;
+
+    VFSNodeInfo info;
+    if(!directory->ops->create(directory, dentry->name, dentry->name_length, type, &info)) return nullptr;
+    Inode* inode = GetInode(dentry->mount, &info);
+    if(inode == nullptr) return nullptr;
+
+    // one reference for dentry, one for caller
+    __atomic_fetch_add(&inode->references, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&dentry->inode, inode, __ATOMIC_RELEASE);
+    return inode;
+}
+
+/******************** Mounts ********************/
+
+bool VFSMount(const char* path, const VFSOperations* ops, void* data, VFSNodeInfo* root, BlockDevice* device){
+    if(root->type != VFS_TYPE_DIRECTORY) return false;
+    LockGuard guard(vfs_lock);
+
+    // find directory we are mounting on, it must not be root of a mount
+    Dentry* mountpoint = nullptr;
+    if(root_mount){
+        mountpoint = WalkLocked(path);
+        if(mountpoint == nullptr) return false;
+        if(!IsDirectory(mountpoint) || mountpoint->parent == nullptr){
+            PutDentry(mountpoint);
+            return false;
+        }
+    }else{
+        const char* name;
+        u64 length;
+        if(NextComponent(&path, &name, &length)) return false;
+    }
+
+    Mount* mount = reinterpret_cast<Mount*>(SlabAllocate(&mount_cache));
+    mount->ops = ops;
+    mount->data = data;
+    mount->mountpoint = mountpoint;
+    mount->device = device;
+    mount->root = nullptr;
+
+    // caller keeps root node if anything fails before GetInode
+    Inode* inode = GetInode(mount, root);
+    mount->root = inode ? NewRootDentry(mount, inode) : nullptr;
+    if(mount->root == nullptr){
+        if(inode) PutInodeLocked(inode);
+        if(mountpoint) PutDentry(mountpoint);
+        SlabFree(&mount_cache, mount);
+        return false;
+    }
+
+    mount->next = mounts;
+    mounts = mount;
+    // mount's reference to mountpoint is the one walk took
+    if(mountpoint) __atomic_store_n(&mountpoint->mounted, mount, __ATOMIC_RELEASE);
+    else __atomic_store_n(&root_mount, mount, __ATOMIC_RELEASE);
+    return true;
+}
+
+bool VFSUnmount(const char* path){
+    LockGuard guard(vfs_lock);
+    if(root_mount == nullptr) return false;
+
+    Dentry* root = WalkLocked(path);
+    if(root == nullptr) return false;
+    Mount* mount = root->mount;
+    PutDentry(root);
+    if(root != mount->root || mount == root_mount) return false;
+
+    // drop everything cached in this mount, leaves first
+    bool busy = false;
+    for(u64 evicted = 1; evicted;){
+        evicted = 0;
+        busy = false;
+        for(Dentry* dentry = lru_head; dentry;){
+            Dentry* next = dentry->lru_next;
+            if(dentry->mount == mount){
+                if(EvictDentry(dentry)) evicted++;
+                else busy = true;
+            }
+            dentry = next;
+        }
+    }
+    if(busy || root->references != 1 || root->mounted) return false;
+
+    __atomic_store_n(&mount->mountpoint->mounted, nullptr, __ATOMIC_RELEASE);
+    PutDentry(mount->mountpoint);
+    root->references = VFS_DEAD;
+    PutInodeLocked(root->inode);
+    RetireDentry(root);
+
+    Mount** link = &mounts;
+    while(*link != mount) link = &(*link)->next;
+    *link = mount->next;
+
+    // no walk can be inside mount after this
+    FlushRetired();
+    if(mount->ops->unmount) mount->ops->unmount(mount);
+    SlabFree(&mount_cache, mount);
+    return true;
+}
+
+bool SyncVFS(){
+    LockGuard guard(vfs_lock);
+    bool ok = true;
+    // pages written through mappings go to filesystems first
+    for(u64 bucket = 0; bucket < VFS_INODE_BUCKETS; bucket++){
+        for(Inode* inode = inode_hash[bucket]; inode; inode = inode->hash_next){
+            if(inode->cache) ok &= SyncPageCache(inode);
+        }
+    }
+    for(Mount* mount = mounts; mount; mount = mount->next){
+        if(mount->ops->sync) ok &= mount->ops->sync(mount);
+    }
+    return ok;
+}
+
+u64 WriteBackVFS(BlockDevice* device, u64 dirty_before, u64* oldest){
+    LockGuard guard(vfs_lock);
+    u64 written = 0;
+    *oldest = 0;
+    for(u64 bucket = 0; bucket < VFS_INODE_BUCKETS; bucket++){
+        for(Inode* inode = inode_hash[bucket]; inode; inode = inode->hash_next){
+            if(inode->cache == nullptr || inode->mount->device != device) continue;
+            u64 since = GetPageCacheDirtyTime(inode);
+            if(since == 0) continue;
+            if(since <= dirty_before){
+                written += WriteBackPageCache(inode, dirty_before);
+                // mapped ones that are still being written stay dirty
+                since = GetPageCacheDirtyTime(inode);
+                if(since == 0) continue;
+            }
+            if(*oldest == 0 || since < *oldest) *oldest = since;
+        }
+    }
+    return written;
+}
+
+/******************** Files ********************/
+
+static bool TruncateInode(Inode* inode, u64 size){
+    if(inode->ops->truncate == nullptr) return false;
+    if(inode->cache) return PageCacheTruncate(inode, size);
+    if(!inode->ops->truncate(inode, size)) return false;
+    inode->size = size;
+    return true;
+}
+
+File* VFSOpen(const char* path, u32 flags){
+    Dentry* dentry = LookupPath(path);
+    if(dentry == nullptr) return nullptr;
+
+    Inode* inode = GetDentryInode(dentry);
+    if(inode == nullptr && (flags & VFS_OPEN_CREATE)){
+        LockGuard guard(vfs_lock);
+        inode = CreateLocked(dentry, VFS_TYPE_FILE);
+    }
+
+    bool ok = inode != nullptr;
+    if(ok && inode->type == VFS_TYPE_DIRECTORY) ok = !(flags & VFS_OPEN_WRITE);
+    else if(ok) ok = !(flags & VFS_OPEN_DIRECTORY);
+    if(ok && (flags & VFS_OPEN_WRITE) && (flags & VFS_OPEN_TRUNCATE) && inode->size){
+        ok = TruncateInode(inode, 0);
+    }
+
+    File* file = ok ? reinterpret_cast<File*>(SlabAllocate(&file_cache)) : nullptr;
+    if(file == nullptr){
+        if(inode) PutInode(inode);
+        PutDentry(dentry);
+        return nullptr;
+    }
+    file->dentry = dentry;
+    file->inode = inode;
+    file->offset = 0;
+    file->flags = flags;
+    return file;
+}
+
+void VFSClose(File* file){
+    PutInode(file->inode);
+    PutDentry(file->dentry);
+    SlabFree(&file_cache, file);
+}
+
+File* VFSDuplicate(File* file){
+    File* copy = reinterpret_cast<File*>(SlabAllocate(&file_cache));
+    if(copy == nullptr) return nullptr;
+
+    // file holds both, so neither can be freed under us
+    __atomic_fetch_add(&file->dentry->references, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&file->inode->references, 1, __ATOMIC_RELAXED);
+    copy->dentry = file->dentry;
+    copy->inode = file->inode;
+    copy->offset = 0;
+    copy->flags = file->flags;
+    return copy;
+}
+
+u64 VFSRead(File* file, void* buffer, u64 size){
+    Inode* inode = file->inode;
+    if(inode->type != VFS_TYPE_FILE || inode->ops->read == nullptr) return VFS_ERROR;
+
+    u64 count = inode->cache ? PageCacheRead(inode, file->offset, buffer, size)
+                             : inode->ops->read(inode, file->offset, buffer, size);
+    if(count != VFS_ERROR) file->offset += count;
+    return count;
+}
+
+u64 VFSWrite(File* file, const void* buffer, u64 size){
+    Inode* inode = file->inode;
+    if(!(file->flags & VFS_OPEN_WRITE) || inode->ops->write == nullptr) return VFS_ERROR;
+
+    u64 count;
+    if(inode->cache){
+        // page cache keeps size of inode
+        count = PageCacheWrite(inode, file->offset, buffer, size);
+        if(count == VFS_ERROR) return VFS_ERROR;
+        file->offset += count;
+    }else{
+        count = inode->ops->write(inode, file->offset, buffer, size);
+        if(count == VFS_ERROR) return VFS_ERROR;
+        file->offset += count;
+        if(file->offset > inode->size) inode->size = file->offset;
+    }
+
+    // writer slows down here, holding no locks, if too much memory is dirty
+    if(inode->mount->device) BalanceDirtyMemory(inode->mount->device, count);
+    return count;
+}
+
+u64 VFSSplice(File* file, u64* pages, u64 count){
+    Inode* inode = file->inode;
+    if(!(file->flags & VFS_OPEN_WRITE) || inode->ops->write == nullptr || inode->cache == nullptr) return 0;
+
+    u64 moved = PageCacheSplice(inode, file->offset, pages, count);
+    file->offset += moved * PAGE_SIZE;
+    return moved;
+}
+
+void VFSSeek(File* file, u64 offset){
+    file->offset = offset;
+}
+
+bool VFSTruncate(File* file, u64 size){
+    if(!(file->flags & VFS_OPEN_WRITE)) return false;
+    return TruncateInode(file->inode, size);
+}
+
+bool VFSReadDirectory(File* file, VFSDirectoryEntry* entry){
+    Inode* inode = file->inode;
+    if(inode->type != VFS_TYPE_DIRECTORY || inode->ops->read_directory == nullptr) return false;
+    return inode->ops->read_directory(inode, &file->offset, entry);
+}
+
+bool VFSMakeDirectory(const char* path){
+    Dentry* dentry = LookupPath(path);
+    if(dentry == nullptr) return false;
+
+    bool ok = false;
+    {
+        LockGuard guard(vfs_lock);
+        if(dentry->inode == nullptr){
+            Inode* inode = CreateLocked(dentry, VFS_TYPE_DIRECTORY);
+            if(inode){
+                PutInodeLocked(inode);
+                ok = true;
+            }
+        }
+    }
+    PutDentry(dentry);
+    return ok;
+}
+
+bool VFSRemove(const char* path){
+    Dentry* dentry = LookupPath(path);
+    if(dentry == nullptr) return false;
+
+    LockGuard guard(vfs_lock);
+    Inode* inode = dentry->inode;
+    Dentry* parent = dentry->parent;
+    bool ok = inode && parent && !dentry->mounted && parent->inode->ops->remove &&
+              parent->inode->ops->remove(parent->inode, dentry->name, dentry->name_length);
+    if(ok){
+        // dentry stays cached as negative, open files keep inode,
+        // and id of inode may be given to a new file from now on
+        __atomic_store_n(&dentry->inode, nullptr, __ATOMIC_RELEASE);
+        if(inode->hashed) UnhashInode(inode);
+        PutInodeLocked(inode);
+    }
+    PutDentry(dentry);
+    return ok;
+}
+
+bool VFSStat(const char* path, VFSStatus* status){
+    Dentry* dentry = LookupPath(path);
+    if(dentry == nullptr) return false;
+
+    Inode* inode = GetDentryInode(dentry);
+    if(inode){
+        status->id = inode->id;
+        status->type = inode->type;
+        status->size = inode->size;
+        PutInode(inode);
+    }
+    PutDentry(dentry);
+    return inode != nullptr;
+}
+
+/******************** Root Filesystem ********************/
+
+// directories of root filesystem, they are never removed
+struct RootDirectory {
+    RootDirectory* children;
+    RootDirectory* next;
+    u32 name_length;
+    char name[VFS_NAME_MAX + 1];
+};
+
+static SlabCache root_directory_cache("vfs.rootfs", sizeof(RootDirectory));
+static RootDirectory root_directory;
+
+static void FillRootInfo(RootDirectory* directory, VFSNodeInfo* info){
+    info->node = directory;
+    info->id = reinterpret_cast<u64>(directory);
+    info->type = VFS_TYPE_DIRECTORY;
+    info->size = 0;
+    info->cache = nullptr;
+}
+
+static bool RootLookup(Inode* directory, const char* name, u64 length, VFSNodeInfo* info){
+    RootDirectory* parent = reinterpret_cast<RootDirectory*>(directory->node);
+    for(RootDirectory* child = parent->children; child; child = child->next){
+        if(child->name_length == length && memcmp(child->name, name, length) == 0){
+            FillRootInfo(child, info);
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool RootCreate(Inode* directory, const char* name, u64 length, u32 type, VFSNodeInfo* info){
+    if(type != VFS_TYPE_DIRECTORY) return false;
+
+    RootDirectory* parent = reinterpret_cast<RootDirectory*>(directory->node);
+    RootDirectory* child = reinterpret_cast<RootDirectory*>(SlabAllocate(&root_directory_cache));
+    if(child == nullptr) return false;
+    child->children = nullptr;
+    child->name_length = length;
+    memcpy(child->name, name, length);
+    child->name[length] = 0;
+    child->next = parent->children;
+    parent->children = child;
+    FillRootInfo(child, info);
+    return true;
+}
+
+static bool RootReadDirectory(Inode* directory, u64* cookie, VFSDirectoryEntry* entry){
+    RootDirectory* child = reinterpret_cast<RootDirectory*>(directory->node)->children;
+    for(u64 i = 0; child && i < *cookie; i++) child = child->next;
+    if(child == nullptr) return false;
+
+    memcpy(entry->name, child->name, child->name_length + 1);
+    entry->type = VFS_TYPE_DIRECTORY;
+    entry->size = 0;
+    (*cookie)++;
+    return true;
+}
+
+static void RootRelease(Mount*, void*){}
+
+static const VFSOperations root_operations = {
+    "rootfs", false,
+    RootLookup, RootCreate, nullptr,
+    nullptr, nullptr, nullptr,
+    RootReadDirectory, RootRelease, nullptr, nullptr
+};
+
+void InitializeVFS(){
+    VFSNodeInfo root;
+    FillRootInfo(&root_directory, &root);
+    VFSMount("/", &root_operations, nullptr, &root);
+
+    Initramfs* initramfs = GetInitramfs();
+    if(initramfs && VFSMakeDirectory("/initramfs") && VFSMountInitramfs("/initramfs", initramfs)){
+        Printf("\tMounted initramfs on /initramfs\n");
+    }
+
+    if(VFSMakeDirectory("/tmp") && MountTmpfs("/tmp", VFS_TMP_SIZE)){
+        Printf("\tMounted tmpfs on /tmp\n");
+    }
+
+    // ESP of boot disk
+    BlockDevice* device = FindBlockDevice("vda");
+    FAT32Volume* volume = device ? MountFAT32(device) : nullptr;
+    if(volume){
+        if(VFSMakeDirectory("/boot") && VFSMountFAT32("/boot", volume)){
+            Printf("\tMounted %s on /boot\n", device->name);
+        }else{
+            UnmountFAT32(volume);
+        }
+    }
+}
+
+/******************** VFS Benchmark ********************/
+
+#define BENCH_VFS_DEPTH 8
+#define BENCH_VFS_FILES 16
+#define BENCH_VFS_OPENS 200000
+#define BENCH_VFS_COLD_OPENS 100
+#define BENCH_VFS_MAX_THREADS 8
+#define BENCH_VFS_PATH_SIZE 256
+
+struct BenchVFSThread {
+    const char* path;
+    u64 opens;
+    u64 failures;
+    volatile bool* start;
+};
+
+static void BenchVFSOpens(void* arg){
+    BenchVFSThread* bench = reinterpret_cast<BenchVFSThread*>(arg);
+    while(!__atomic_load_n(bench->start, __ATOMIC_ACQUIRE)) CPUPause();
+
+    for(u64 i = 0; i < bench->opens; i++){
+        File* file = VFSOpen(bench->path, VFS_OPEN_READ);
+        if(file) VFSClose(file);
+        else bench->failures++;
+    }
+}
+
+// opens/s of a path from given number of threads at once
+static u64 TimeParallelOpens(const char* path, u32 thread_count, u64* failures){
+    static BenchVFSThread benches[BENCH_VFS_MAX_THREADS];
+    Thread* threads[BENCH_VFS_MAX_THREADS];
+    volatile bool start = false;
+
+    for(u32 i = 0; i < thread_count; i++){
+        benches[i].path = path;
+        benches[i].opens = BENCH_VFS_OPENS / thread_count;
+        benches[i].failures = 0;
+        benches[i].start = &start;
+        threads[i] = CreateThread("vfs-bench", BenchVFSOpens, &benches[i]);
+        StartThread(threads[i]);
+    }
+
+    u64 begin = GetUptimeNanoseconds();
+    __atomic_store_n(&start, true, __ATOMIC_RELEASE);
+    for(u32 i = 0; i < thread_count; i++) JoinThread(threads[i]);
+    u64 ns = GetUptimeNanoseconds() - begin;
+
+    *failures = 0;
+    for(u32 i = 0; i < thread_count; i++) *failures += benches[i].failures;
+    return ns ? (BENCH_VFS_OPENS / thread_count) * thread_count * 1000000000 / ns : 0;
+}
+
+static u64 TimeOpens(const char* path, u64 count, bool drop_cache){
+    u64 ns = 0;
+    for(u64 i = 0; i < count; i++){
+        if(drop_cache) ShrinkDentryCache();
+        u64 start = GetUptimeNanoseconds();
+        File* file = VFSOpen(path, VFS_OPEN_READ);
+        ns += GetUptimeNanoseconds() - start;
+        if(file) VFSClose(file);
+    }
+    return ns ? count * 1000000000 / ns : 0;
+}
+
+void BenchmarkVFS(){
+    ColorPrintf(COLOR_YELLOW, COLOR_BLACK, "[+] Benchmark : VFS\n");
+
+    // deep tree on a scratch FAT32 volume
+    BlockDevice* device = FindBlockDevice("nvme0n1");
+    FAT32Volume* volume = device && FormatFAT32(device) ? MountFAT32(device) : nullptr;
+    if(volume == nullptr){
+        Printf("\tNo scratch disk\n");
+        return;
+    }
+    VFSMakeDirectory("/scratch");
+    if(!VFSMountFAT32("/scratch", volume)){
+        Printf("\tFailed to mount scratch disk\n");
+        UnmountFAT32(volume);
+        return;
+    }
+
+    char path[BENCH_VFS_PATH_SIZE];
+    u64 length = sprintf(path, "/scratch");
+    for(u32 level = 0; level < BENCH_VFS_DEPTH; level++){
+        length += sprintf(path + length, "/directory%i", i32(level));
+        VFSMakeDirectory(path);
+    }
+    for(u32 i = 0; i < BENCH_VFS_FILES; i++){
+        sprintf(path + length, "/file%i", i32(i));
+        File* file = VFSOpen(path, VFS_OPEN_WRITE | VFS_OPEN_CREATE);
+        if(file){
+            VFSWrite(file, path, length);
+            VFSClose(file);
+        }
+    }
+    char missing[BENCH_VFS_PATH_SIZE];
+    memcpy(missing, path, length);
+    sprintf(missing + length, "/missing");
+    sprintf(path + length, "/file0");
+    SyncVFS();
+
+    Printf("\tPath : %s (depth %i)\n", path, i32(BENCH_VFS_DEPTH + 2));
+
+    u64 cold = TimeOpens(path, BENCH_VFS_COLD_OPENS, true);
+    u64 locked = locked_walks;
+    u64 lookups = filesystem_lookups;
+    u64 hot = TimeOpens(path, BENCH_VFS_OPENS, false);
+    u64 negative = TimeOpens(missing, BENCH_VFS_OPENS, false);
+    Printf("\tOpen + close : cold %lu/s | cached %lu/s | missing name %lu/s\n", cold, hot, negative);
+    Printf("\t\tlocked walks %lu | filesystem lookups %lu while cached\n",
+           locked_walks - locked, filesystem_lookups - lookups);
+
+    // same path straight from filesystem, directory hashes hot but no dentries
+    FAT32Node* root = GetFAT32Root(volume);
+    u64 start = GetUptimeNanoseconds();
+    for(u64 i = 0; i < BENCH_VFS_OPENS / 10; i++){
+        FAT32Node* node = FAT32OpenPath(volume, path + sizeof("/scratch") - 1);
+        if(node) FAT32Release(node);
+    }
+    u64 ns = GetUptimeNanoseconds() - start;
+    FAT32Release(root);
+    Printf("\tFAT32 path walk without dentry cache : %lu/s\n", ns ? u64(BENCH_VFS_OPENS / 10) * 1000000000 / ns : 0);
+
+    // lock free walks shouldn't slow each other down
+    u32 thread_count = GetCPUCount() < BENCH_VFS_MAX_THREADS ? GetCPUCount() : BENCH_VFS_MAX_THREADS;
+    for(u32 threads = 1; threads <= thread_count; threads *= 2){
+        u64 failures;
+        u64 rate = TimeParallelOpens(path, threads, &failures);
+        Printf("\t%i threads : %lu opens/s%s\n", i32(threads), rate, failures ? " (some failed)" : "");
+    }
+
+    Printf("\tDentries : %lu cached | %lu evicted\n", dentry_count, evictions);
+    if(!VFSUnmount("/scratch")) Printf("\tFailed to unmount scratch disk\n");
+}
@@ -0,0 +1,277 @@
+/**
+ * @file VFS.hpp
+ * @author Siddharth Mishra (brightprogrammer)
+ * @date 10/18/26
+ * @brief Virtual filesystem : one tree of mounts, inodes, open files
+ * and a cache of path lookups in front of them.
+ * @copyright MIT License 2022 Siddharth Mishra
+ * */
+
+#ifndef VFS_HPP
+#define VFS_HPP
+
+#include "Common.hpp"
+
+struct Mount;
+struct Inode;
+struct BlockDevice;
+struct Dentry;
+struct PageCache;
+
+/* ------------------ VFS --------------------
+ *
+ * Every path is resolved from root of mount tree. A filesystem is
+ * plugged in by mounting it on a directory, with a table of operations
+ * that is used for every inode of that mount.
+ *
+ * Dentry cache :
+ *
+ *  A dentry is a name in a directory. Results of every lookup are kept,
+ *  including names that don't exist (negative dentries), so opening a
+ *  path that was seen before, or checking for a missing file, never
+ *  reaches filesystem. Dentries are in one hash table keyed by parent
+ *  and name. Unused ones are evicted in clock order once there are too
+ *  many, a dentry is in use while it's open or has cached children.
+ *
+ * Lookup :
+ *
+ *  Path walk first runs without any lock, inside an RCU read section (see
+ *  RCU.hpp). It only reads hash chains and takes a single reference at
+ *  the end. If a name is not cached it starts over holding VFS lock, which
+ *  fills in missing dentries by asking filesystem. Evicted dentries and
+ *  inodes are freed only after a grace period, so a lock free walk never
+ *  touches freed memory.
+ *
+ * Inodes :
+ *
+ *  There is one inode for a file no matter how many names lead to it,
+ *  inodes are found by (mount, id). Open files hold their inode, so
+ *  removing a name doesn't break files that are open. Contents of regular
+ *  files are read through page cache of their inode (see PageCache.hpp),
+ *  which is also what mapped files map.
+ *
+ * */
+
+// longest name, without null terminator
+#define VFS_NAME_MAX 255
+
+#define VFS_TYPE_FILE 1
+#define VFS_TYPE_DIRECTORY 2
+
+// flags for VFSOpen
+#define VFS_OPEN_READ (1 << 0)
+#define VFS_OPEN_WRITE (1 << 1)
+// create file if it doesn't exist
+#define VFS_OPEN_CREATE (1 << 2)
+// make file empty when it's opened for writing
+#define VFS_OPEN_TRUNCATE (1 << 3)
+// fail unless path is a directory
+#define VFS_OPEN_DIRECTORY (1 << 4)
+
+// returned by read and write on failure
+#define VFS_ERROR (~u64(0))
+
+/**
+ * @brief What a filesystem tells about a node it found or created.
+ * */
+struct VFSNodeInfo {
+    // filesystem's own node, handed back through Inode::node
+    void* node;
+    // same for a file as long as it exists
+    u64 id;
+    u32 type;
+    u64 size;
+    // cache that is only storage of a file, owned by filesystem,
+    // nullptr to let VFS cache file (see PageCache.hpp)
+    PageCache* cache;
+};
+
+struct VFSDirectoryEntry {
+    char name[VFS_NAME_MAX + 1];
+    u32 type;
+    u64 size;
+};
+
+struct VFSStatus {
+    u64 id;
+    u32 type;
+    u64 size;
+};
+
+/**
+ * @brief Operations of a filesystem. Only lookup and release are required,
+ * others can be nullptr if filesystem doesn't support them.
+ * */
+struct VFSOperations {
+    const char* name;
+    // names differing only in case are same name
+    bool ignore_case;
+
+    // find a name, info.node holds a reference until release is called on it
+    bool (*lookup)(Inode* directory, const char* name, u64 length, VFSNodeInfo* info);
+    bool (*create)(Inode* directory, const char* name, u64 length, u32 type, VFSNodeInfo* info);
+    bool (*remove)(Inode* directory, const char* name, u64 length);
+    // return VFS_ERROR on failure
+    u64 (*read)(Inode* inode, u64 offset, void* buffer, u64 size);
+    u64 (*write)(Inode* inode, u64 offset, const void* buffer, u64 size);
+    bool (*truncate)(Inode* inode, u64 size);
+    // cookie starts at 0
+    bool (*read_directory)(Inode* directory, u64* cookie, VFSDirectoryEntry* entry);
+    // drop reference to a node returned by lookup or create
+    void (*release)(Mount* mount, void* node);
+    bool (*sync)(Mount* mount);
+    // called once mount is gone, after every node was released
+    void (*unmount)(Mount* mount);
+};
+
+struct Mount {
+    const VFSOperations* ops;
+    // filesystem's own data
+    void* data;
+    Dentry* root;
+    // dentry this mount covers, nullptr for root of tree
+    Dentry* mountpoint;
+    // device filesystem is on, nullptr if it has none
+    BlockDevice* device;
+    Mount* next;
+};
+
+struct Inode {
+    Mount* mount;
+    // ops of mount, kept here to save a load on every operation
+    const VFSOperations* ops;
+    void* node;
+    u64 id;
+    u32 type;
+    volatile u64 size;
+    volatile u32 references;
+    // cached pages of a regular file, nullptr for directories
+    PageCache* cache;
+    // in inode hash, inodes of removed files are not
+    bool hashed;
+    Inode* hash_next;
+    Inode* retire_next;
+};
+
+struct File {
+    Dentry* dentry;
+    Inode* inode;
+    // position for reads and writes, and cookie for directories
+    u64 offset;
+    u32 flags;
+};
+
+/**
+ * @brief Mount an in memory root directory, which only holds directories
+ * to mount other filesystems on, and mount boot archive on /initramfs and
+ * boot partition on /boot if they are present, and a tmpfs on /tmp.
+ * Buffer cache must be initialized.
+ * */
+void InitializeVFS();
+
+/**
+ * @brief Mount a filesystem on an existing directory, first mount must be on "/".
+ *
+ * @param root Root directory of filesystem, it's reference belongs to VFS
+ * if mount succeeds.
+ * @param device Device filesystem is on, it's writeback thread writes back
+ * page caches of mount and writers of mount are throttled by it.
+ * */
+bool VFSMount(const char* path, const VFSOperations* ops, void* data, VFSNodeInfo* root,
+              BlockDevice* device = nullptr);
+
+/**
+ * @brief Unmount filesystem mounted on path. Fails if anything in it is open.
+ * */
+bool VFSUnmount(const char* path);
+
+/**
+ * @brief Open a file or directory.
+ *
+ * @param flags VFS_OPEN_* flags.
+ * @return nullptr if path doesn't exist or can't be opened this way.
+ * */
+File* VFSOpen(const char* path, u32 flags);
+
+void VFSClose(File* file);
+
+/**
+ * @brief Open same file again, with same flags. Doesn't block, so it
+ * can be called with spinlocks held.
+ * */
+File* VFSDuplicate(File* file);
+
+/**
+ * @brief Read at file's position and move it forward.
+ *
+ * @return Number of bytes read or VFS_ERROR.
+ * */
+u64 VFSRead(File* file, void* buffer, u64 size);
+
+/**
+ * @brief Write at file's position and move it forward.
+ *
+ * @return Number of bytes written or VFS_ERROR.
+ * */
+u64 VFSWrite(File* file, const void* buffer, u64 size);
+
+/**
+ * @brief Move whole pages into file at it's position, which must be page
+ * aligned, without copying them, and move position forward. File takes
+ * over caller's reference to pages that were moved.
+ *
+ * @return Number of pages moved.
+ * */
+u64 VFSSplice(File* file, u64* pages, u64 count);
+
+/**
+ * @brief Move file's position.
+ * */
+void VFSSeek(File* file, u64 offset);
+
+bool VFSTruncate(File* file, u64 size);
+
+/**
+ * @brief Get next entry of an open directory.
+ *
+ * @return false once there are no more entries.
+ * */
+bool VFSReadDirectory(File* file, VFSDirectoryEntry* entry);
+
+bool VFSMakeDirectory(const char* path);
+
+/**
+ * @brief Remove a file or an empty directory.
+ * */
+bool VFSRemove(const char* path);
+
+bool VFSStat(const char* path, VFSStatus* status);
+
+/**
+ * @brief Write back pages of mapped files and every mounted filesystem.
+ * */
+bool SyncVFS();
+
+/**
+ * @brief Write back page caches of files on a device that have been dirty
+ * since before given time. Called by writeback threads.
+ *
+ * @param dirty_before Uptime in nanoseconds.
+ * @param oldest Set to earliest time since when a cache on device that is
+ * still dirty after this has been dirty, 0 if none is.
+ * @return Number of pages written.
+ * */
+u64 WriteBackVFS(BlockDevice* device, u64 dirty_before, u64* oldest);
+
+/**
+ * @brief Drop every dentry that is not in use, so next lookups go to filesystems.
+ * */
+void ShrinkDentryCache();
+
+/**
+ * @brief Measure open and close of deep paths, cold and cached,
+ * missing names, and lookups from all cpus at once.
+ * */
+void BenchmarkVFS();
+
+#endif // VFS_HPP
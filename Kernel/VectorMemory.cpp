@@ -0,0 +1,69 @@
+/**
+ * @file VectorMemory.cpp
+ * @author Siddharth Mishra (brightprogrammer)
+ * @date 10/18/26
+ * @brief Memory routines that use vector registers. This file is built
+ * with SSE enabled (see KERNEL_SIMD_SRCS), keep only code that runs
+ * inside kernel fpu sections here.
+ * @copyright MIT License 2022 Siddharth Mishra
+ * */
+
+#include "VectorMemory.hpp"
+
+// vector types with alignment of 1, so loads and stores are unaligned moves
+typedef long long Vector16 __attribute__((vector_size(16), aligned(1)));
+typedef long long Vector32 __attribute__((vector_size(32), aligned(1)));
+
+// copy remaining bytes one at a time
+static inline void CopyTail(u8* d, const u8* s, u64 n){
+    while(n--) *d++ = *s++;
+}
+
+void VectorCopySSE2(void* dst, const void* src, u64 n){
+    u8* d = reinterpret_cast<u8*>(dst);
+    const u8* s = reinterpret_cast<const u8*>(src);
+
+    // 4 registers in flight per iteration
+    while(n >= 64){
+        Vector16 a = *reinterpret_cast<const Vector16*>(s);
+        Vector16 b = *reinterpret_cast<const Vector16*>(s + 16);
+        Vector16 c = *reinterpret_cast<const Vector16*>(s + 32);
+        Vector16 e = *reinterpret_cast<const Vector16*>(s + 48);
+        *reinterpret_cast<Vector16*>(d) = a;
+        *reinterpret_cast<Vector16*>(d + 16) = b;
+        *reinterpret_cast<Vector16*>(d + 32) = c;
+        *reinterpret_cast<Vector16*>(d + 48) = e;
+        d += 64; s += 64; n -= 64;
+    }
+
+    while(n >= 16){
+        *reinterpret_cast<Vector16*>(d) = *reinterpret_cast<const Vector16*>(s);
+        d += 16; s += 16; n -= 16;
+    }
+
+    CopyTail(d, s, n);
+}
+
+__attribute__((target("avx"))) void VectorCopyAVX(void* dst, const void* src, u64 n){
+    u8* d = reinterpret_cast<u8*>(dst);
+    const u8* s = reinterpret_cast<const u8*>(src);
+
+    while(n >= 128){
+        Vector32 a = *reinterpret_cast<const Vector32*>(s);
+        Vector32 b = *reinterpret_cast<const Vector32*>(s + 32);
+        Vector32 c = *reinterpret_cast<const Vector32*>(s + 64);
+        Vector32 e = *reinterpret_cast<const Vector32*>(s + 96);
+        *reinterpret_cast<Vector32*>(d) = a;
+        *reinterpret_cast<Vector32*>(d + 32) = b;
+        *reinterpret_cast<Vector32*>(d + 64) = c;
+        *reinterpret_cast<Vector32*>(d + 96) = e;
+        d += 128; s += 128; n -= 128;
+    }
+
+    while(n >= 32){
+        *reinterpret_cast<Vector32*>(d) = *reinterpret_cast<const Vector32*>(s);
+        d += 32; s += 32; n -= 32;
+    }
+
+    CopyTail(d, s, n);
+}
@@ -0,0 +1,26 @@
+/**
+ * @file VectorMemory.hpp
+ * @author Siddharth Mishra (brightprogrammer)
+ * @date 10/18/26
+ * @brief Memory routines that use vector registers. These are compiled
+ * with SSE enabled and must only be called between KernelFpuBegin and
+ * KernelFpuEnd.
+ * @copyright MIT License 2022 Siddharth Mishra
+ * */
+
+#ifndef VECTOR_MEMORY_HPP
+#define VECTOR_MEMORY_HPP
+
+#include "Common.hpp"
+
+/**
+ * @brief Copy n bytes using 16 byte SSE2 moves.
+ * */
+void VectorCopySSE2(void* dst, const void* src, u64 n);
+
+/**
+ * @brief Copy n bytes using 32 byte AVX moves. Cpu must support AVX.
+ * */
+void VectorCopyAVX(void* dst, const void* src, u64 n);
+
+#endif // VECTOR_MEMORY_HPP
@@ -0,0 +1,351 @@
+/**
+ * @file Virtio.cpp
+ * @author Siddharth Mishra (brightprogrammer)
+ * @date 10/18/26
+ * @brief Modern (1.0) virtio over PCI transport and split virtqueues.
+ * @copyright MIT License 2022 Siddharth Mishra
+ * */
+
+#include "Virtio.hpp"
+#include "PCI.hpp"
+#include "MemoryManager.hpp"
+#include "CPU.hpp"
+#include "String.hpp"
+
+// types of virtio vendor capabilities
+#define VIRTIO_PCI_CAP_COMMON_CFG 1
+#define VIRTIO_PCI_CAP_NOTIFY_CFG 2
+#define VIRTIO_PCI_CAP_ISR_CFG 3
+#define VIRTIO_PCI_CAP_DEVICE_CFG 4
+
+// fields of virtio vendor capabilities, relative to capability
+#define VIRTIO_CAP_TYPE 3
+#define VIRTIO_CAP_BAR 4
+#define VIRTIO_CAP_OFFSET 8
+#define VIRTIO_CAP_LENGTH 12
+#define VIRTIO_CAP_NOTIFY_MULTIPLIER 16
+
+// common configuration structure
+#define VIRTIO_COMMON_DEVICE_FEATURE_SELECT 0
+#define VIRTIO_COMMON_DEVICE_FEATURE 4
+#define VIRTIO_COMMON_DRIVER_FEATURE_SELECT 8
+#define VIRTIO_COMMON_DRIVER_FEATURE 12
+#define VIRTIO_COMMON_MSIX_CONFIG 16
+#define VIRTIO_COMMON_NUM_QUEUES 18
+#define VIRTIO_COMMON_DEVICE_STATUS 20
+#define VIRTIO_COMMON_CONFIG_GENERATION 21
+#define VIRTIO_COMMON_QUEUE_SELECT 22
+#define VIRTIO_COMMON_QUEUE_SIZE 24
+#define VIRTIO_COMMON_QUEUE_MSIX_VECTOR 26
+#define VIRTIO_COMMON_QUEUE_ENABLE 28
+#define VIRTIO_COMMON_QUEUE_NOTIFY_OFF 30
+#define VIRTIO_COMMON_QUEUE_DESC 32
+#define VIRTIO_COMMON_QUEUE_DRIVER 40
+#define VIRTIO_COMMON_QUEUE_DEVICE 48
+
+// device status bits
+#define VIRTIO_STATUS_ACKNOWLEDGE 1
+#define VIRTIO_STATUS_DRIVER 2
+#define VIRTIO_STATUS_DRIVER_OK 4
+#define VIRTIO_STATUS_FEATURES_OK 8
+#define VIRTIO_STATUS_FAILED 128
+
+// ring flags
+#define VIRTQ_AVAIL_F_NO_INTERRUPT 1
+#define VIRTQ_USED_F_NO_NOTIFY 1
+
+static inline volatile u8* Common8(VirtioDevice* device, u32 offset){
+    return reinterpret_cast<volatile u8*>(device->common + offset);
+}
+
+static inline volatile u16* Common16(VirtioDevice* device, u32 offset){
+    return reinterpret_cast<volatile u16*>(device->common + offset);
+}
+
+static inline volatile u32* Common32(VirtioDevice* device, u32 offset){
+    return reinterpret_cast<volatile u32*>(device->common + offset);
+}
+
+// 64 bit fields are written as two halves, low first
+static inline void WriteCommon64(VirtioDevice* device, u32 offset, u64 value){
+    *Common32(device, offset) = u32(value);
+    *Common32(device, offset + 4) = u32(value >> 32);
+}
+
+bool InitializeVirtioDevice(VirtioDevice* device, PCIDevice* pci){
+    device->pci = pci;
+    device->common = 0;
+    device->device_config = 0;
+    device->notify_base = 0;
+    device->notify_multiplier = 0;
+    device->features = 0;
+    device->irq.type = PCI_INTERRUPT_NONE;
+    device->irq.count = 0;
+
+    EnablePCIDevice(pci);
+
+    for(u8 cap = FindPCICapability(pci, PCI_CAPABILITY_VENDOR); cap; cap = FindPCICapability(pci, PCI_CAPABILITY_VENDOR, cap)){
+        u8 type = PCIRead8(pci, cap + VIRTIO_CAP_TYPE);
+        u8 bar = PCIRead8(pci, cap + VIRTIO_CAP_BAR);
+        u32 offset = PCIRead32(pci, cap + VIRTIO_CAP_OFFSET);
+        if(bar >= PCI_MAX_BARS) continue;
+
+        u64 base = MapPCIBar(pci, bar);
+        if(base == 0) continue;
+
+        // first capability of each type is the preferred one
+        if(type == VIRTIO_PCI_CAP_COMMON_CFG && !device->common){
+            device->common = base + offset;
+        }else if(type == VIRTIO_PCI_CAP_NOTIFY_CFG && !device->notify_base){
+            device->notify_base = base + offset;
+            device->notify_multiplier = PCIRead32(pci, cap + VIRTIO_CAP_NOTIFY_MULTIPLIER);
+        }else if(type == VIRTIO_PCI_CAP_DEVICE_CFG && !device->device_config){
+            device->device_config = base + offset;
+        }
+    }
+    if(!device->common || !device->notify_base) return false;
+
+    // reset, device says it's done by reading back 0
+    *Common8(device, VIRTIO_COMMON_DEVICE_STATUS) = 0;
+    while(*Common8(device, VIRTIO_COMMON_DEVICE_STATUS) != 0){
+        CPUPause();
+    }
+
+    *Common8(device, VIRTIO_COMMON_DEVICE_STATUS) = VIRTIO_STATUS_ACKNOWLEDGE;
+    *Common8(device, VIRTIO_COMMON_DEVICE_STATUS) = VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER;
+    // no configuration change interrupts
+    *Common16(device, VIRTIO_COMMON_MSIX_CONFIG) = VIRTIO_NO_VECTOR;
+    return true;
+}
+
+bool NegotiateVirtioFeatures(VirtioDevice* device, u64 wanted){
+    *Common32(device, VIRTIO_COMMON_DEVICE_FEATURE_SELECT) = 0;
+    u64 offered = *Common32(device, VIRTIO_COMMON_DEVICE_FEATURE);
+    *Common32(device, VIRTIO_COMMON_DEVICE_FEATURE_SELECT) = 1;
+    offered |= u64(*Common32(device, VIRTIO_COMMON_DEVICE_FEATURE)) << 32;
+
+    wanted |= u64(1) << VIRTIO_F_VERSION_1;
+    u64 features = offered & wanted;
+    if(!(features & (u64(1) << VIRTIO_F_VERSION_1))) return false;
+
+    *Common32(device, VIRTIO_COMMON_DRIVER_FEATURE_SELECT) = 0;
+    *Common32(device, VIRTIO_COMMON_DRIVER_FEATURE) = u32(features);
+    *Common32(device, VIRTIO_COMMON_DRIVER_FEATURE_SELECT) = 1;
+    *Common32(device, VIRTIO_COMMON_DRIVER_FEATURE) = u32(features >> 32);
+
+    u8 status = *Common8(device, VIRTIO_COMMON_DEVICE_STATUS);
+    *Common8(device, VIRTIO_COMMON_DEVICE_STATUS) = status | VIRTIO_STATUS_FEATURES_OK;
+    if(!(*Common8(device, VIRTIO_COMMON_DEVICE_STATUS) & VIRTIO_STATUS_FEATURES_OK)) return false;
+
+    device->features = features;
+    return true;
+}
+
+u16 GetVirtioQueueCount(VirtioDevice* device){
+    return *Common16(device, VIRTIO_COMMON_NUM_QUEUES);
+}
+
+bool SetupVirtqueue(VirtioDevice* device, Virtqueue* queue, u16 index, u16 max_size, u16 vector){
+    *Common16(device, VIRTIO_COMMON_QUEUE_SELECT) = index;
+    u16 size = *Common16(device, VIRTIO_COMMON_QUEUE_SIZE);
+    if(size == 0) return false;
+
+    if(max_size > VIRTQUEUE_MAX_SIZE) max_size = VIRTQUEUE_MAX_SIZE;
+    if(size > max_size) size = max_size;
+    // split queues are always a power of 2
+    while(size & (size - 1)) size &= size - 1;
+
+    u64 descriptors = AllocatePage();
+    u64 available = AllocatePage();
+    u64 used = AllocatePage();
+    memset(reinterpret_cast<void*>(descriptors), 0, PAGE_SIZE);
+    memset(reinterpret_cast<void*>(available), 0, PAGE_SIZE);
+    memset(reinterpret_cast<void*>(used), 0, PAGE_SIZE);
+
+    queue->index = index;
+    queue->size = size;
+    queue->descriptors = reinterpret_cast<VirtqDescriptor*>(descriptors);
+    queue->available = reinterpret_cast<VirtqAvailable*>(available);
+    queue->used = reinterpret_cast<VirtqUsed*>(used);
+    queue->event_idx = HasVirtioFeature(device, VIRTIO_F_RING_EVENT_IDX);
+    queue->free_head = 0;
+    queue->free_count = size;
+    queue->available_index = 0;
+    queue->kicked_index = 0;
+    queue->used_index = 0;
+    for(u16 i = 0; i < size; i++){
+        queue->descriptors[i].next = i + 1;
+        queue->cookies[i] = nullptr;
+    }
+
+    *Common16(device, VIRTIO_COMMON_QUEUE_SIZE) = size;
+    *Common16(device, VIRTIO_COMMON_QUEUE_MSIX_VECTOR) = vector;
+    // device says no by reading back no vector
+    if(*Common16(device, VIRTIO_COMMON_QUEUE_MSIX_VECTOR) != vector){
+        *Common16(device, VIRTIO_COMMON_QUEUE_MSIX_VECTOR) = VIRTIO_NO_VECTOR;
+    }
+    WriteCommon64(device, VIRTIO_COMMON_QUEUE_DESC, VirtualToPhysicalAddress(descriptors));
+    WriteCommon64(device, VIRTIO_COMMON_QUEUE_DRIVER, VirtualToPhysicalAddress(available));
+    WriteCommon64(device, VIRTIO_COMMON_QUEUE_DEVICE, VirtualToPhysicalAddress(used));
+
+    u16 notify_off = *Common16(device, VIRTIO_COMMON_QUEUE_NOTIFY_OFF);
+    queue->notify = reinterpret_cast<volatile u16*>(device->notify_base + u64(notify_off) * device->notify_multiplier);
+
+    *Common16(device, VIRTIO_COMMON_QUEUE_ENABLE) = 1;
+    return true;
+}
+
+void FreeVirtqueue(Virtqueue* queue){
+    FreePage(reinterpret_cast<u64>(queue->descriptors));
+    FreePage(reinterpret_cast<u64>(queue->available));
+    FreePage(reinterpret_cast<u64>(queue->used));
+    queue->descriptors = nullptr;
+    queue->available = nullptr;
+    queue->used = nullptr;
+}
+
+void StartVirtioDevice(VirtioDevice* device){
+    u8 status = *Common8(device, VIRTIO_COMMON_DEVICE_STATUS);
+    *Common8(device, VIRTIO_COMMON_DEVICE_STATUS) = status | VIRTIO_STATUS_DRIVER_OK;
+}
+
+void FailVirtioDevice(VirtioDevice* device){
+    if(device->common == 0) return;
+    u8 status = *Common8(device, VIRTIO_COMMON_DEVICE_STATUS);
+    *Common8(device, VIRTIO_COMMON_DEVICE_STATUS) = status | VIRTIO_STATUS_FAILED;
+}
+
+u8 ReadVirtioConfig8(VirtioDevice* device, u32 offset){
+    return *reinterpret_cast<volatile u8*>(device->device_config + offset);
+}
+
+u16 ReadVirtioConfig16(VirtioDevice* device, u32 offset){
+    return *reinterpret_cast<volatile u16*>(device->device_config + offset);
+}
+
+u32 ReadVirtioConfig32(VirtioDevice* device, u32 offset){
+    return *reinterpret_cast<volatile u32*>(device->device_config + offset);
+}
+
+u64 ReadVirtioConfig64(VirtioDevice* device, u32 offset){
+    // device may change configuration between two halves
+    while(true){
+        u8 generation = *Common8(device, VIRTIO_COMMON_CONFIG_GENERATION);
+        u64 value = ReadVirtioConfig32(device, offset) | (u64(ReadVirtioConfig32(device, offset + 4)) << 32);
+        if(generation == *Common8(device, VIRTIO_COMMON_CONFIG_GENERATION)) return value;
+    }
+}
+
+/******************** Virtqueues ********************/
+
+// event index fields live right after rings
+static inline u16* UsedEvent(Virtqueue* queue){
+    return &queue->available->ring[queue->size];
+}
+
+static inline u16* AvailableEvent(Virtqueue* queue){
+    return reinterpret_cast<u16*>(&queue->used->ring[queue->size]);
+}
+
+// true if moving index from old to new crosses event
+static inline bool NeedEvent(u16 event, u16 new_index, u16 old_index){
+    return u16(new_index - event - 1) < u16(new_index - old_index);
+}
+
+bool AddVirtqueueBuffers(Virtqueue* queue, const VirtqueueBuffer* buffers, u32 count, void* cookie){
+    if(count == 0 || count > queue->free_count) return false;
+
+    // free descriptors are already chained, so chain is built in place
+    u16 head = queue->free_head;
+    u16 id = head;
+    for(u32 i = 0; i < count; i++){
+        VirtqDescriptor* descriptor = &queue->descriptors[id];
+        descriptor->address = buffers[i].address;
+        descriptor->length = buffers[i].length;
+        descriptor->flags = (buffers[i].device_writable ? VIRTQ_DESC_F_WRITE : 0) |
+                            (i + 1 < count ? VIRTQ_DESC_F_NEXT : 0);
+        id = descriptor->next;
+    }
+    queue->free_head = id;
+    queue->free_count -= count;
+    queue->cookies[head] = cookie;
+
+    queue->available->ring[queue->available_index & (queue->size - 1)] = head;
+    queue->available_index++;
+    return true;
+}
+
+bool KickVirtqueue(Virtqueue* queue){
+    u16 old_index = queue->kicked_index;
+    u16 new_index = queue->available_index;
+    if(old_index == new_index) return false;
+
+    // descriptors and ring entries must be visible before index
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&queue->available->index, new_index, __ATOMIC_RELAXED);
+    queue->kicked_index = new_index;
+
+    // index store must be visible before we look at what device wants
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    bool notify;
+    if(queue->event_idx){
+        notify = NeedEvent(__atomic_load_n(AvailableEvent(queue), __ATOMIC_RELAXED), new_index, old_index);
+    }else{
+        notify = !(__atomic_load_n(&queue->used->flags, __ATOMIC_RELAXED) & VIRTQ_USED_F_NO_NOTIFY);
+    }
+
+    if(notify){
+        *queue->notify = queue->index;
+    }
+    return notify;
+}
+
+void* GetVirtqueueUsed(Virtqueue* queue, u32* length){
+    if(queue->used_index == __atomic_load_n(&queue->used->index, __ATOMIC_ACQUIRE)) return nullptr;
+
+    VirtqUsedElement* element = &queue->used->ring[queue->used_index & (queue->size - 1)];
+    u16 head = u16(element->id);
+    if(length) *length = element->length;
+    queue->used_index++;
+
+    // put chain back at front of free list
+    u16 id = head;
+    u16 count = 1;
+    while(queue->descriptors[id].flags & VIRTQ_DESC_F_NEXT){
+        id = queue->descriptors[id].next;
+        count++;
+    }
+    queue->descriptors[id].next = queue->free_head;
+    queue->free_head = head;
+    queue->free_count += count;
+
+    void* cookie = queue->cookies[head];
+    queue->cookies[head] = nullptr;
+    return cookie;
+}
+
+void DisableVirtqueueInterrupts(Virtqueue* queue){
+    __atomic_store_n(&queue->available->flags, VIRTQ_AVAIL_F_NO_INTERRUPT, __ATOMIC_RELAXED);
+    if(queue->event_idx){
+        // an event already behind device never fires
+        __atomic_store_n(UsedEvent(queue), u16(queue->used_index - 1), __ATOMIC_RELAXED);
+    }
+}
+
+bool EnableVirtqueueInterrupts(Virtqueue* queue){
+    return DelayVirtqueueInterrupts(queue, 1);
+}
+
+bool DelayVirtqueueInterrupts(Virtqueue* queue, u16 count){
+    if(count == 0) count = 1;
+    __atomic_store_n(&queue->available->flags, 0, __ATOMIC_RELAXED);
+    if(queue->event_idx){
+        __atomic_store_n(UsedEvent(queue), u16(queue->used_index + count - 1), __ATOMIC_RELAXED);
+    }else{
+        count = 1;
+    }
+
+    // device may have used chains before it saw our event
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return u16(__atomic_load_n(&queue->used->index, __ATOMIC_ACQUIRE) - queue->used_index) >= count;
+}
@@ -0,0 +1,249 @@
+/**
+ * @file Virtio.hpp
+ * @author Siddharth Mishra (brightprogrammer)
+ * @date 10/18/26
+ * @brief Modern (1.0) virtio over PCI transport and split virtqueues.
+ * @copyright MIT License 2022 Siddharth Mishra
+ * */
+
+#ifndef VIRTIO_HPP
+#define VIRTIO_HPP
+
+#include "Common.hpp"
+#include "Spinlock.hpp"
+#include "MSI.hpp"
+
+struct PCIDevice;
+
+/* ------------------ VIRTQUEUES --------------------
+ *
+ * A split virtqueue is three arrays in memory shared with device :
+ *
+ *   descriptor table : address, length and flags of buffers, chained
+ *                      through next field
+ *   available ring   : heads of chains driver gives to device
+ *   used ring        : heads of chains device is done with, and how
+ *                      many bytes it wrote to them
+ *
+ * Each array gets it's own page, so a queue has at most 256 entries.
+ * Descriptors point straight at caller's memory, nothing is copied.
+ *
+ * Driver adds any number of chains and then kicks queue once, which
+ * publishes them all and notifies device only if device asked for it.
+ * With VIRTIO_F_RING_EVENT_IDX both sides say exactly which index they
+ * want to hear about, otherwise only on/off flags are used.
+ *
+ * Queue doesn't lock itself, driver holds lock around every call.
+ *
+ * */
+
+// vendor id of all virtio devices
+#define VIRTIO_PCI_VENDOR_ID 0x1af4
+// modern device ids are this + virtio device type
+#define VIRTIO_PCI_MODERN_DEVICE_BASE 0x1040
+
+// device types
+#define VIRTIO_TYPE_NET 1
+#define VIRTIO_TYPE_BLOCK 2
+
+// feature bits common to all devices
+#define VIRTIO_F_INDIRECT_DESC 28
+#define VIRTIO_F_RING_EVENT_IDX 29
+#define VIRTIO_F_VERSION_1 32
+
+// largest queue we create
+#define VIRTQUEUE_MAX_SIZE 256
+// queue has no interrupt vector
+#define VIRTIO_NO_VECTOR 0xffff
+
+// descriptor flags
+#define VIRTQ_DESC_F_NEXT 1
+#define VIRTQ_DESC_F_WRITE 2
+
+struct VirtqDescriptor {
+    u64 address;
+    u32 length;
+    u16 flags;
+    u16 next;
+};
+
+struct VirtqAvailable {
+    u16 flags;
+    u16 index;
+    u16 ring[];
+    // followed by used_event if VIRTIO_F_RING_EVENT_IDX
+};
+
+struct VirtqUsedElement {
+    u32 id;
+    u32 length;
+};
+
+struct VirtqUsed {
+    u16 flags;
+    u16 index;
+    VirtqUsedElement ring[];
+    // followed by avail_event if VIRTIO_F_RING_EVENT_IDX
+};
+
+/**
+ * @brief A buffer in a chain given to AddVirtqueueBuffers.
+ * */
+struct VirtqueueBuffer {
+    // physical address
+    u64 address;
+    u32 length;
+    // device writes to buffer instead of reading it
+    bool device_writable;
+};
+
+struct Virtqueue {
+    u16 index;
+    u16 size;
+    VirtqDescriptor* descriptors;
+    VirtqAvailable* available;
+    VirtqUsed* used;
+    // where index is written to notify device
+    volatile u16* notify;
+    bool event_idx;
+
+    // free descriptors are chained through next
+    u16 free_head;
+    u16 free_count;
+    // next available index, published to device by KickVirtqueue
+    u16 available_index;
+    // available index device was last told about
+    u16 kicked_index;
+    // next used entry driver hasn't looked at
+    u16 used_index;
+    // driver pointer given with every chain, indexed by head descriptor
+    void* cookies[VIRTQUEUE_MAX_SIZE];
+
+    // held by driver around every call
+    TicketLock<false> lock;
+
+    Virtqueue() : lock("virtio.queue") {}
+};
+
+/**
+ * @brief A virtio device found through it's PCI capabilities.
+ * */
+struct VirtioDevice {
+    PCIDevice* pci;
+    // direct map addresses of configuration structures
+    u64 common;
+    u64 device_config;
+    u64 notify_base;
+    u32 notify_multiplier;
+    // features both sides agreed on
+    u64 features;
+    PCIInterrupts irq;
+};
+
+/**
+ * @brief Map configuration structures of device, reset it and
+ * acknowledge it.
+ *
+ * @return false if device isn't a modern virtio device.
+ * */
+bool InitializeVirtioDevice(VirtioDevice* device, PCIDevice* pci);
+
+/**
+ * @brief Accept features both device and driver have. VIRTIO_F_VERSION_1
+ * is always required.
+ *
+ * @param wanted Bit mask of features driver can use.
+ * @return false if device doesn't accept them.
+ * */
+bool NegotiateVirtioFeatures(VirtioDevice* device, u64 wanted);
+
+/**
+ * @brief Check whether a feature was negotiated.
+ * */
+inline bool HasVirtioFeature(VirtioDevice* device, u32 bit){
+    return device->features & (u64(1) << bit);
+}
+
+/**
+ * @brief Get number of queues device has.
+ * */
+u16 GetVirtioQueueCount(VirtioDevice* device);
+
+/**
+ * @brief Allocate and enable a queue.
+ *
+ * @param max_size Largest size wanted, queue may be smaller if device says so.
+ * @param vector Index of MSI-X vector of queue, or VIRTIO_NO_VECTOR.
+ * */
+bool SetupVirtqueue(VirtioDevice* device, Virtqueue* queue, u16 index, u16 max_size, u16 vector);
+
+/**
+ * @brief Free rings of a queue set up by SetupVirtqueue, once device can't
+ * use it anymore (it was never started, or has been failed).
+ * */
+void FreeVirtqueue(Virtqueue* queue);
+
+/**
+ * @brief Tell device driver is ready. Queues can be used after this.
+ * */
+void StartVirtioDevice(VirtioDevice* device);
+
+/**
+ * @brief Tell device driver gave up on it.
+ * */
+void FailVirtioDevice(VirtioDevice* device);
+
+/**
+ * @brief Read device specific configuration. 64 bit fields are read
+ * until configuration generation stays same.
+ * */
+u8 ReadVirtioConfig8(VirtioDevice* device, u32 offset);
+u16 ReadVirtioConfig16(VirtioDevice* device, u32 offset);
+u32 ReadVirtioConfig32(VirtioDevice* device, u32 offset);
+u64 ReadVirtioConfig64(VirtioDevice* device, u32 offset);
+
+/**
+ * @brief Add a chain of buffers to queue, without telling device.
+ *
+ * @param cookie Returned by GetVirtqueueUsed when device is done with chain.
+ * @return false if there are not enough free descriptors.
+ * */
+bool AddVirtqueueBuffers(Virtqueue* queue, const VirtqueueBuffer* buffers, u32 count, void* cookie);
+
+/**
+ * @brief Publish all chains added since last kick and notify device
+ * if it wants to be notified.
+ *
+ * @return true if device was notified.
+ * */
+bool KickVirtqueue(Virtqueue* queue);
+
+/**
+ * @brief Take next chain device is done with and free it's descriptors.
+ *
+ * @param length Set to number of bytes device wrote to chain.
+ * @return Cookie of chain, or nullptr if device isn't done with anything.
+ * */
+void* GetVirtqueueUsed(Virtqueue* queue, u32* length);
+
+/**
+ * @brief Ask device not to interrupt for this queue.
+ * */
+void DisableVirtqueueInterrupts(Virtqueue* queue);
+
+/**
+ * @brief Ask device to interrupt when it uses next chain.
+ *
+ * @return true if there are used chains already, which caller must
+ * process since no interrupt will come for them.
+ * */
+bool EnableVirtqueueInterrupts(Virtqueue* queue);
+
+/**
+ * @brief Ask device to interrupt only once given number of chains
+ * more are used (with VIRTIO_F_RING_EVENT_IDX, otherwise same as
+ * EnableVirtqueueInterrupts).
+ * */
+bool DelayVirtqueueInterrupts(Virtqueue* queue, u16 count);
+
+#endif // VIRTIO_HPP
@@ -0,0 +1,405 @@
+/**
+ * @file VirtioBlock.cpp
+ * @author Siddharth Mishra (brightprogrammer)
+ * @date 10/18/26
+ * @brief virtio-blk driver, one virtqueue per cpu.
+ * @copyright MIT License 2022 Siddharth Mishra
+ * */
+
+#include "VirtioBlock.hpp"
+#include "Virtio.hpp"
+#include "Block.hpp"
+#include "PCI.hpp"
+#include "MSI.hpp"
+#include "SMP.hpp"
+#include "CPU.hpp"
+#include "Slab.hpp"
+#include "MemoryManager.hpp"
+#include "Printf.hpp"
+#include "String.hpp"
+
+#include <new>
+
+#define VIRTIO_BLOCK_LEGACY_DEVICE_ID 0x1001
+
+// device features
+#define VIRTIO_BLK_F_SEG_MAX 2
+#define VIRTIO_BLK_F_RO 5
+#define VIRTIO_BLK_F_BLK_SIZE 6
+#define VIRTIO_BLK_F_FLUSH 9
+#define VIRTIO_BLK_F_MQ 12
+
+// device configuration
+#define VIRTIO_BLK_CONFIG_CAPACITY 0
+#define VIRTIO_BLK_CONFIG_SEG_MAX 12
+#define VIRTIO_BLK_CONFIG_BLK_SIZE 20
+#define VIRTIO_BLK_CONFIG_NUM_QUEUES 34
+
+// request types
+#define VIRTIO_BLK_T_IN 0
+#define VIRTIO_BLK_T_OUT 1
+#define VIRTIO_BLK_T_FLUSH 4
+
+// request status
+#define VIRTIO_BLK_S_OK 0
+#define VIRTIO_BLK_S_IOERR 1
+#define VIRTIO_BLK_S_UNSUPP 2
+
+struct VirtioBlockHeader {
+    u32 type;
+    u32 reserved;
+    u64 sector;
+};
+
+static_assert(sizeof(VirtioBlockHeader) * VIRTQUEUE_MAX_SIZE <= 4096, "request headers must fit in a page");
+
+struct VirtioBlockDevice;
+
+struct VirtioBlockQueue {
+    Virtqueue vq;
+    VirtioBlockDevice* device;
+    // one header and one status byte per descriptor, indexed by chain head
+    VirtioBlockHeader* headers;
+    u64 headers_phys;
+    volatile u8* status;
+    u64 status_phys;
+};
+
+struct VirtioBlockDevice {
+    BlockDevice block;
+    VirtioDevice virtio;
+    // max number of data descriptors device takes in one request
+    u32 max_segments;
+    VirtioBlockQueue* queues[VIRTIO_BLOCK_MAX_QUEUES];
+};
+
+static SlabCache virtio_block_cache("virtio.block", sizeof(VirtioBlockDevice));
+static SlabCache virtio_block_queue_cache("virtio.block.queue", sizeof(VirtioBlockQueue));
+static u32 virtio_block_count = 0;
+
+static inline VirtioBlockDevice* GetVirtioBlock(BlockDevice* device){
+    return reinterpret_cast<VirtioBlockDevice*>(device->driver_data);
+}
+
+// collect completed chains of a queue, caller holds queue lock
+static BlockRequest* ReapVirtioBlockQueue(VirtioBlockQueue* queue, u64* count){
+    BlockRequest* done = nullptr;
+    void* cookie;
+    while((cookie = GetVirtqueueUsed(&queue->vq, nullptr)) != nullptr){
+        BlockRequest* request = reinterpret_cast<BlockRequest*>(cookie);
+        u8 status = queue->status[request->driver_tag];
+        // status of request itself is only written by CompleteBlockRequest,
+        // once it's set waiter may return and free request
+        u64 result = BLOCK_STATUS_ERROR;
+        if(status == VIRTIO_BLK_S_OK){
+            result = BLOCK_STATUS_OK;
+        }else if(status == VIRTIO_BLK_S_UNSUPP){
+            result = BLOCK_STATUS_UNSUPPORTED;
+        }
+        request->driver_tag = result;
+        request->next = done;
+        done = request;
+        (*count)++;
+    }
+    return done;
+}
+
+// complete requests outside queue lock, completion may wake threads
+static void CompleteVirtioBlockRequests(BlockRequest* done){
+    while(done){
+        BlockRequest* request = done;
+        done = done->next;
+        CompleteBlockRequest(request, u32(request->driver_tag));
+    }
+}
+
+static u64 VirtioBlockPoll(BlockDevice* device, u32 index){
+    VirtioBlockQueue* queue = GetVirtioBlock(device)->queues[index];
+    u64 count = 0;
+    BlockRequest* done;
+    {
+        LockGuard guard(queue->vq.lock);
+        done = ReapVirtioBlockQueue(queue, &count);
+    }
+    CompleteVirtioBlockRequests(done);
+    return count;
+}
+
+static void VirtioBlockInterrupt(void* arg){
+    VirtioBlockQueue* queue = reinterpret_cast<VirtioBlockQueue*>(arg);
+    u64 count = 0;
+    BlockRequest* done = nullptr;
+    {
+        LockGuard guard(queue->vq.lock);
+        while(true){
+            BlockRequest* reaped = ReapVirtioBlockQueue(queue, &count);
+            while(reaped){
+                BlockRequest* request = reaped;
+                reaped = reaped->next;
+                request->next = done;
+                done = request;
+            }
+            // waiters poll themselves if device is switched to polling
+            if(queue->device->block.polling) break;
+            // ask for next interrupt, and go again if device was faster than us
+            if(!EnableVirtqueueInterrupts(&queue->vq)) break;
+        }
+    }
+    CompleteVirtioBlockRequests(done);
+}
+
+static void VirtioBlockSetPolling(BlockDevice* device, bool polling){
+    VirtioBlockDevice* blk = GetVirtioBlock(device);
+    for(u32 i = 0; i < device->queue_count; i++){
+        LockGuard guard(blk->queues[i]->vq.lock);
+        if(polling){
+            DisableVirtqueueInterrupts(&blk->queues[i]->vq);
+        }else{
+            EnableVirtqueueInterrupts(&blk->queues[i]->vq);
+        }
+    }
+    // anything that completed while interrupts were off has no interrupt coming
+    if(!polling){
+        for(u32 i = 0; i < device->queue_count; i++){
+            VirtioBlockPoll(device, i);
+        }
+    }
+}
+
+// split buffers of a request and of requests merged behind it into physically
+// contiguous runs, returns number of runs or 0 if too many
+static u32 MapVirtioBlockBuffer(BlockRequest* request, bool device_writable, VirtqueueBuffer* runs, u32 max_runs){
+    u32 count = 0;
+    for(BlockRequest* segment = request; segment; segment = segment->merged){
+        u64 buffer = segment->buffer;
+        u64 size = segment->size;
+        while(size){
+            u64 chunk = PAGE_SIZE - (buffer & (PAGE_SIZE - 1));
+            if(chunk > size) chunk = size;
+            u64 phys = KernelVirtualToPhysical(buffer);
+
+            if(count && runs[count - 1].address + runs[count - 1].length == phys){
+                runs[count - 1].length += chunk;
+            }else{
+                if(count == max_runs) return 0;
+                runs[count].address = phys;
+                runs[count].length = chunk;
+                runs[count].device_writable = device_writable;
+                count++;
+            }
+            buffer += chunk;
+            size -= chunk;
+        }
+    }
+    return count;
+}
+
+static bool VirtioBlockSubmit(BlockDevice* device, BlockRequest* requests){
+    VirtioBlockDevice* blk = GetVirtioBlock(device);
+    u32 index = GetCurrentCPU()->id % device->queue_count;
+    VirtioBlockQueue* queue = blk->queues[index];
+    VirtqueueBuffer buffers[VIRTIO_BLOCK_MAX_SEGMENTS + 2];
+
+    while(requests){
+        BlockRequest* request = requests;
+        BlockRequest* failed = nullptr;
+        bool queue_full = false;
+        {
+            LockGuard guard(queue->vq.lock);
+            // whole batch goes in under one lock and one notification
+            while(requests){
+                request = requests;
+                request->queue = index;
+
+                if(request->op == BLOCK_OP_FLUSH && !HasVirtioFeature(&blk->virtio, VIRTIO_BLK_F_FLUSH)){
+                    // device without flush writes everything through
+                    requests = requests->next;
+                    request->next = failed;
+                    request->driver_tag = BLOCK_STATUS_OK;
+                    failed = request;
+                    continue;
+                }
+
+                u32 segments = 0;
+                if(request->op != BLOCK_OP_FLUSH){
+                    segments = MapVirtioBlockBuffer(request, request->op == BLOCK_OP_READ, buffers + 1, blk->max_segments);
+                    if(segments == 0){
+                        requests = requests->next;
+                        request->next = failed;
+                        request->driver_tag = BLOCK_STATUS_ERROR;
+                        failed = request;
+                        continue;
+                    }
+                }
+                if(segments + 2 > queue->vq.free_count){
+                    queue_full = true;
+                    break;
+                }
+
+                u16 head = queue->vq.free_head;
+                VirtioBlockHeader* header = &queue->headers[head];
+                header->type = request->op == BLOCK_OP_READ ? VIRTIO_BLK_T_IN :
+                               request->op == BLOCK_OP_WRITE ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_FLUSH;
+                header->reserved = 0;
+                header->sector = request->op == BLOCK_OP_FLUSH ? 0 : request->sector;
+                queue->status[head] = 0xff;
+
+                buffers[0].address = queue->headers_phys + head * sizeof(VirtioBlockHeader);
+                buffers[0].length = sizeof(VirtioBlockHeader);
+                buffers[0].device_writable = false;
+                buffers[segments + 1].address = queue->status_phys + head;
+                buffers[segments + 1].length = 1;
+                buffers[segments + 1].device_writable = true;
+
+                // remember where status is, then status we complete with
+                request->driver_tag = head;
+                requests = requests->next;
+                AddVirtqueueBuffers(&queue->vq, buffers, segments + 2, request);
+            }
+            KickVirtqueue(&queue->vq);
+        }
+
+        CompleteVirtioBlockRequests(failed);
+        if(queue_full){
+            // make room by completing whatever device is done with
+            if(VirtioBlockPoll(device, index) == 0) CPUPause();
+        }
+    }
+    return true;
+}
+
+static bool SetupVirtioBlockQueue(VirtioBlockDevice* blk, u32 index, u16 vector){
+    VirtioBlockQueue* queue = new (SlabAllocate(&virtio_block_queue_cache)) VirtioBlockQueue();
+    if(!SetupVirtqueue(&blk->virtio, &queue->vq, index, VIRTQUEUE_MAX_SIZE, vector)){
+        SlabFree(&virtio_block_queue_cache, queue);
+        return false;
+    }
+    // smallest request is a header, one segment and a status byte
+    if(queue->vq.size < 3){
+        FreeVirtqueue(&queue->vq);
+        SlabFree(&virtio_block_queue_cache, queue);
+        return false;
+    }
+
+    u64 headers = AllocatePage();
+    u64 status = AllocatePage();
+    memset(reinterpret_cast<void*>(headers), 0, PAGE_SIZE);
+    memset(reinterpret_cast<void*>(status), 0, PAGE_SIZE);
+    queue->device = blk;
+    queue->headers = reinterpret_cast<VirtioBlockHeader*>(headers);
+    queue->headers_phys = VirtualToPhysicalAddress(headers);
+    queue->status = reinterpret_cast<volatile u8*>(status);
+    queue->status_phys = VirtualToPhysicalAddress(status);
+    blk->queues[index] = queue;
+    return true;
+}
+
+// undo a probe that failed part way, nothing was ever submitted to device
+static bool FailVirtioBlock(VirtioBlockDevice* blk){
+    FailVirtioDevice(&blk->virtio);
+    DisablePCIInterrupts(&blk->virtio.irq);
+    for(u32 i = 0; i < VIRTIO_BLOCK_MAX_QUEUES; i++){
+        VirtioBlockQueue* queue = blk->queues[i];
+        if(queue == nullptr) continue;
+        FreeVirtqueue(&queue->vq);
+        FreePage(reinterpret_cast<u64>(queue->headers));
+        FreePage(reinterpret_cast<u64>(queue->status));
+        SlabFree(&virtio_block_queue_cache, queue);
+    }
+    blk->virtio.pci->driver_data = nullptr;
+    SlabFree(&virtio_block_cache, blk);
+    return false;
+}
+
+static bool ProbeVirtioBlock(PCIDevice* pci, const PCIDeviceID*){
+    VirtioBlockDevice* blk = new (SlabAllocate(&virtio_block_cache)) VirtioBlockDevice();
+    VirtioDevice* virtio = &blk->virtio;
+    if(!InitializeVirtioDevice(virtio, pci)) return FailVirtioBlock(blk);
+
+    u64 wanted = (u64(1) << VIRTIO_BLK_F_SEG_MAX) | (u64(1) << VIRTIO_BLK_F_RO) |
+                 (u64(1) << VIRTIO_BLK_F_BLK_SIZE) | (u64(1) << VIRTIO_BLK_F_FLUSH) |
+                 (u64(1) << VIRTIO_BLK_F_MQ) | (u64(1) << VIRTIO_F_RING_EVENT_IDX);
+    if(!NegotiateVirtioFeatures(virtio, wanted)) return FailVirtioBlock(blk);
+
+    u32 queues = 1;
+    if(HasVirtioFeature(virtio, VIRTIO_BLK_F_MQ)){
+        queues = ReadVirtioConfig16(virtio, VIRTIO_BLK_CONFIG_NUM_QUEUES);
+    }
+    if(queues > GetVirtioQueueCount(virtio)) queues = GetVirtioQueueCount(virtio);
+    if(queues > GetCPUCount()) queues = GetCPUCount();
+    if(queues > VIRTIO_BLOCK_MAX_QUEUES) queues = VIRTIO_BLOCK_MAX_QUEUES;
+    if(queues == 0) queues = 1;
+
+    blk->max_segments = VIRTIO_BLOCK_MAX_SEGMENTS;
+    if(HasVirtioFeature(virtio, VIRTIO_BLK_F_SEG_MAX)){
+        u32 seg_max = ReadVirtioConfig32(virtio, VIRTIO_BLK_CONFIG_SEG_MAX);
+        if(seg_max && seg_max < blk->max_segments) blk->max_segments = seg_max;
+    }
+
+    // virtio needs MSI-X to tell queues apart, anything else is polled
+    bool polling_only = false;
+    u32 vectors = EnablePCIInterrupts(&virtio->irq, pci, queues);
+    if(virtio->irq.type != PCI_INTERRUPT_MSIX || vectors == 0){
+        DisablePCIInterrupts(&virtio->irq);
+        polling_only = true;
+    }else if(vectors < queues){
+        queues = vectors;
+    }
+
+    for(u32 i = 0; i < queues; i++){
+        if(!SetupVirtioBlockQueue(blk, i, polling_only ? VIRTIO_NO_VECTOR : i)) return FailVirtioBlock(blk);
+        // a request must fit in an empty ring, or submit waits for room forever
+        if(blk->max_segments > blk->queues[i]->vq.size - 2u) blk->max_segments = blk->queues[i]->vq.size - 2u;
+    }
+
+    BlockDevice* block = &blk->block;
+    sprintf(block->name, "vd%c", char('a' + virtio_block_count));
+    block->sector_count = ReadVirtioConfig64(virtio, VIRTIO_BLK_CONFIG_CAPACITY);
+    block->block_size = BLOCK_SECTOR_SIZE;
+    if(HasVirtioFeature(virtio, VIRTIO_BLK_F_BLK_SIZE)){
+        block->block_size = ReadVirtioConfig32(virtio, VIRTIO_BLK_CONFIG_BLK_SIZE);
+    }
+    block->read_only = HasVirtioFeature(virtio, VIRTIO_BLK_F_RO);
+    // a buffer that doesn't start on a page boundary needs one more segment
+    block->max_transfer = blk->max_segments > 1 ? u64(blk->max_segments - 1) * PAGE_SIZE : BLOCK_SECTOR_SIZE;
+    // every merged buffer takes at least one segment
+    block->max_segments = blk->max_segments > 1 ? blk->max_segments - 1 : 1;
+    block->queue_count = queues;
+    block->polling = polling_only;
+    block->polling_only = polling_only;
+    block->ops.submit = VirtioBlockSubmit;
+    block->ops.poll = VirtioBlockPoll;
+    block->ops.set_polling = VirtioBlockSetPolling;
+    block->driver_data = blk;
+    pci->driver_data = blk;
+
+    StartVirtioDevice(virtio);
+    for(u32 i = 0; i < queues; i++){
+        if(polling_only){
+            DisableVirtqueueInterrupts(&blk->queues[i]->vq);
+        }else{
+            SetPCIInterruptHandler(&virtio->irq, i, VirtioBlockInterrupt, blk->queues[i], i);
+        }
+    }
+
+    if(!RegisterBlockDevice(block)) return FailVirtioBlock(blk);
+    virtio_block_count++;
+    return true;
+}
+
+static const PCIDeviceID virtio_block_ids[] = {
+    {VIRTIO_PCI_VENDOR_ID, VIRTIO_BLOCK_LEGACY_DEVICE_ID, 0, 0},
+    {VIRTIO_PCI_VENDOR_ID, VIRTIO_PCI_MODERN_DEVICE_BASE + VIRTIO_TYPE_BLOCK, 0, 0}
+};
+
+static PCIDriver virtio_block_driver = {
+    "virtio-blk",
+    virtio_block_ids,
+    sizeof(virtio_block_ids) / sizeof(virtio_block_ids[0]),
+    ProbeVirtioBlock,
+    nullptr
+};
+
+void InitializeVirtioBlock(){
+    RegisterPCIDriver(&virtio_block_driver);
+}
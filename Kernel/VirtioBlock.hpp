@@ -0,0 +1,43 @@
+/**
+ * @file VirtioBlock.hpp
+ * @author Siddharth Mishra (brightprogrammer)
+ * @date 10/18/26
+ * @brief virtio-blk driver, one virtqueue per cpu.
+ * @copyright MIT License 2022 Siddharth Mishra
+ * */
+
+#ifndef VIRTIO_BLOCK_HPP
+#define VIRTIO_BLOCK_HPP
+
+#include "Common.hpp"
+
+/* ------------------ VIRTIO BLOCK --------------------
+ *
+ * Every request is a chain of descriptors :
+ *
+ *   ;----------------;------------------------;-------------;
+ *   ; request header ; data, one descriptor   ; status byte ;
+ *   ; (read only)    ; per contiguous run     ; (written)   ;
+ *   ;----------------;------------------------;-------------;
+ *
+ * Header and status live in per queue pages, at index of head descriptor
+ * of chain, so nothing is allocated per request. Data descriptors point
+ * straight at caller's buffer.
+ *
+ * Each cpu submits to it's own queue, and each queue interrupts the cpu
+ * it belongs to through it's own MSI-X vector. Devices without MSI-X are
+ * driven by polling.
+ *
+ * */
+
+// max number of queues of a single device
+#define VIRTIO_BLOCK_MAX_QUEUES 16
+// max number of data descriptors in a single request
+#define VIRTIO_BLOCK_MAX_SEGMENTS 64
+
+/**
+ * @brief Register virtio-blk driver and probe every virtio-blk device on PCI bus.
+ * */
+void InitializeVirtioBlock();
+
+#endif // VIRTIO_BLOCK_HPP
@@ -0,0 +1,728 @@
+/**
+ * @file VirtioNet.cpp
+ * @author Siddharth Mishra (brightprogrammer)
+ * @date 10/18/26
+ * @brief virtio-net driver, zero copy receive and transmit.
+ * @copyright MIT License 2022 Siddharth Mishra
+ * */
+
+#include "VirtioNet.hpp"
+#include "Virtio.hpp"
+#include "PCI.hpp"
+#include "MSI.hpp"
+#include "SMP.hpp"
+#include "CPU.hpp"
+#include "Slab.hpp"
+#include "Spinlock.hpp"
+#include "MemoryManager.hpp"
+#include "Timer.hpp"
+#include "Printf.hpp"
+#include "String.hpp"
+
+#include <new>
+
+#define VIRTIO_NET_LEGACY_DEVICE_ID 0x1000
+
+// device features
+#define VIRTIO_NET_F_MAC 5
+#define VIRTIO_NET_F_MRG_RXBUF 15
+
+// device configuration
+#define VIRTIO_NET_CONFIG_MAC 0
+
+// queue indices, first receive and transmit queue pair
+#define VIRTIO_NET_RX_QUEUE 0
+#define VIRTIO_NET_TX_QUEUE 1
+
+// most physically contiguous runs a transmitted frame is split into
+#define VIRTIO_NET_MAX_TX_SEGMENTS 4
+
+// header in front of every frame, both directions
+struct VirtioNetHeader {
+    u8 flags;
+    u8 gso_type;
+    u16 header_length;
+    u16 gso_size;
+    u16 checksum_start;
+    u16 checksum_offset;
+    // buffers a received frame was merged from
+    u16 num_buffers;
+} __attribute__((packed));
+
+static_assert(sizeof(VirtioNetHeader) == 12, "virtio-net header is 12 bytes with VIRTIO_F_VERSION_1");
+static_assert(sizeof(VirtioNetHeader) * VIRTQUEUE_MAX_SIZE <= 4096, "transmit headers must fit in a page");
+static_assert(sizeof(VirtioNetHeader) + VIRTIO_NET_MAX_FRAME_SIZE <= VIRTIO_NET_BUFFER_SIZE * VIRTIO_NET_MAX_FRAGMENTS,
+              "largest frame must fit in a merged receive");
+
+struct VirtioNetQueue {
+    Virtqueue vq;
+};
+
+struct VirtioNetDevice {
+    VirtioDevice virtio;
+    char name[8];
+    u8 mac[6];
+    bool polling;
+    VirtioNetQueue* rx;
+    VirtioNetQueue* tx;
+    // one transmit header per descriptor, indexed by chain head
+    VirtioNetHeader* tx_headers;
+    u64 tx_headers_phys;
+    // changed and read under receive queue lock
+    NetReceiveHandler handler;
+    void* handler_arg;
+    // receive counters under receive queue lock, transmit counters under
+    // transmit queue lock
+    NetStatistics stats;
+};
+
+// buffers reaped from receive queue in one go, frames are runs of buffers
+struct VirtioNetReceiveBatch {
+    u8* buffers[VIRTIO_NET_RX_BUDGET + VIRTIO_NET_MAX_FRAGMENTS];
+    u32 lengths[VIRTIO_NET_RX_BUDGET + VIRTIO_NET_MAX_FRAGMENTS];
+    u32 buffer_count;
+    u16 frame_first[VIRTIO_NET_RX_BUDGET];
+    u16 frame_buffers[VIRTIO_NET_RX_BUDGET];
+    u32 frame_length[VIRTIO_NET_RX_BUDGET];
+    u32 frame_count;
+};
+
+static SlabCache virtio_net_cache("virtio.net", sizeof(VirtioNetDevice));
+static SlabCache virtio_net_queue_cache("virtio.net.queue", sizeof(VirtioNetQueue));
+static VirtioNetDevice* virtio_net_devices[VIRTIO_NET_MAX_DEVICES];
+static u32 virtio_net_count = 0;
+
+/******************** PACKET BUFFER POOL ********************/
+
+// free buffers are linked through their first bytes
+static TicketLock<> packet_buffer_lock("net.buffers");
+static u8* free_packet_buffers = nullptr;
+
+u8* AllocatePacketBuffer(){
+    while(true){
+        {
+            LockGuard guard(packet_buffer_lock);
+            if(free_packet_buffers){
+                u8* buffer = free_packet_buffers;
+                free_packet_buffers = *reinterpret_cast<u8**>(buffer);
+                return buffer;
+            }
+        }
+
+        // pool grows a page at a time and never shrinks
+        u64 page = AllocatePage();
+        if(!page) return nullptr;
+        LockGuard guard(packet_buffer_lock);
+        for(u64 offset = 0; offset < PAGE_SIZE; offset += VIRTIO_NET_BUFFER_SIZE){
+            u8* buffer = reinterpret_cast<u8*>(page + offset);
+            *reinterpret_cast<u8**>(buffer) = free_packet_buffers;
+            free_packet_buffers = buffer;
+        }
+    }
+}
+
+void FreePacketBuffer(u8* buffer){
+    LockGuard guard(packet_buffer_lock);
+    *reinterpret_cast<u8**>(buffer) = free_packet_buffers;
+    free_packet_buffers = buffer;
+}
+
+/******************** RECEIVE ********************/
+
+// keep receive queue full of pool buffers, caller holds receive queue lock
+static void RefillVirtioNetReceive(VirtioNetDevice* net){
+    Virtqueue* vq = &net->rx->vq;
+    while(vq->free_count){
+        u8* buffer = AllocatePacketBuffer();
+        if(!buffer) break;
+        VirtqueueBuffer run = {KernelVirtualToPhysical(reinterpret_cast<u64>(buffer)), VIRTIO_NET_BUFFER_SIZE, true};
+        AddVirtqueueBuffers(vq, &run, 1, buffer);
+    }
+    if(KickVirtqueue(vq)) net->stats.rx_kicks++;
+}
+
+// take whole frames device is done with, caller holds receive queue lock
+static void ReapVirtioNetReceive(VirtioNetDevice* net, VirtioNetReceiveBatch* batch){
+    Virtqueue* vq = &net->rx->vq;
+    batch->buffer_count = 0;
+    batch->frame_count = 0;
+
+    // a frame never takes more than VIRTIO_NET_MAX_FRAGMENTS buffers of batch,
+    // so a new one is only started while we are under budget
+    while(batch->buffer_count < VIRTIO_NET_RX_BUDGET){
+        u32 length;
+        u8* buffer = reinterpret_cast<u8*>(GetVirtqueueUsed(vq, &length));
+        if(!buffer) break;
+
+        u32 first = batch->buffer_count;
+        batch->buffers[first] = buffer;
+        batch->lengths[first] = length;
+        batch->buffer_count++;
+
+        bool valid = length >= sizeof(VirtioNetHeader);
+        u16 num_buffers = valid ? reinterpret_cast<VirtioNetHeader*>(buffer)->num_buffers : 1;
+        if(num_buffers == 0){
+            num_buffers = 1;
+            valid = false;
+        }
+        if(num_buffers > VIRTIO_NET_MAX_FRAGMENTS) valid = false;
+        u32 frame_length = valid ? length - sizeof(VirtioNetHeader) : 0;
+
+        // rest of frame, device publishes all buffers of a frame together
+        for(u16 i = 1; i < num_buffers; i++){
+            buffer = reinterpret_cast<u8*>(GetVirtqueueUsed(vq, &length));
+            if(!buffer){
+                valid = false;
+                break;
+            }
+            if(!valid){
+                FreePacketBuffer(buffer);
+                continue;
+            }
+            batch->buffers[batch->buffer_count] = buffer;
+            batch->lengths[batch->buffer_count] = length;
+            batch->buffer_count++;
+            frame_length += length;
+        }
+
+        if(!valid){
+            net->stats.rx_dropped++;
+            continue;
+        }
+        batch->frame_first[batch->frame_count] = u16(first);
+        batch->frame_buffers[batch->frame_count] = num_buffers;
+        batch->frame_length[batch->frame_count] = frame_length;
+        batch->frame_count++;
+        net->stats.rx_packets++;
+        net->stats.rx_bytes += frame_length;
+        if(num_buffers > 1) net->stats.rx_merged++;
+    }
+}
+
+// hand frames to receive handler and buffers back to pool, outside of lock
+static void DeliverVirtioNetReceive(VirtioNetReceiveBatch* batch, NetReceiveHandler handler, void* arg){
+    NetFragment fragments[VIRTIO_NET_MAX_FRAGMENTS];
+    if(handler){
+        for(u32 i = 0; i < batch->frame_count; i++){
+            u32 first = batch->frame_first[i];
+            for(u32 j = 0; j < batch->frame_buffers[i]; j++){
+                // header is only at front of first buffer
+                u32 skip = j == 0 ? sizeof(VirtioNetHeader) : 0;
+                fragments[j].data = batch->buffers[first + j] + skip;
+                fragments[j].length = batch->lengths[first + j] - skip;
+            }
+            handler(arg, fragments, batch->frame_buffers[i], batch->frame_length[i]);
+        }
+    }
+    for(u32 i = 0; i < batch->buffer_count; i++){
+        FreePacketBuffer(batch->buffers[i]);
+    }
+}
+
+// receive until device has nothing more, optionally asking for
+// next interrupt once done
+static u64 ProcessVirtioNetReceive(VirtioNetDevice* net, bool interrupts){
+    VirtioNetReceiveBatch batch;
+    u64 count = 0;
+    while(true){
+        NetReceiveHandler handler;
+        void* arg;
+        bool more;
+        {
+            LockGuard guard(net->rx->vq.lock);
+            ReapVirtioNetReceive(net, &batch);
+            RefillVirtioNetReceive(net);
+            handler = net->handler;
+            arg = net->handler_arg;
+            more = batch.buffer_count >= VIRTIO_NET_RX_BUDGET;
+            // go again if device was faster than us
+            if(!more && interrupts && !net->polling){
+                more = EnableVirtqueueInterrupts(&net->rx->vq);
+            }
+        }
+        DeliverVirtioNetReceive(&batch, handler, arg);
+        count += batch.frame_count;
+        if(!more) break;
+    }
+    return count;
+}
+
+static void VirtioNetReceiveInterrupt(void* arg){
+    VirtioNetDevice* net = reinterpret_cast<VirtioNetDevice*>(arg);
+    {
+        LockGuard guard(net->rx->vq.lock);
+        net->stats.rx_interrupts++;
+        // nothing more until this batch is through
+        DisableVirtqueueInterrupts(&net->rx->vq);
+    }
+    ProcessVirtioNetReceive(net, true);
+}
+
+/******************** TRANSMIT ********************/
+
+// collect packets device is done with, caller holds transmit queue lock
+static void ReapVirtioNetTransmit(VirtioNetDevice* net, NetPacket** done){
+    void* cookie;
+    while((cookie = GetVirtqueueUsed(&net->tx->vq, nullptr)) != nullptr){
+        NetPacket* packet = reinterpret_cast<NetPacket*>(cookie);
+        net->stats.tx_packets++;
+        net->stats.tx_bytes += packet->length;
+        packet->next = *done;
+        *done = packet;
+    }
+}
+
+// give buffers back to their owners outside of lock, callbacks may
+// transmit again
+static void CompleteVirtioNetPackets(NetPacket* done){
+    while(done){
+        NetPacket* packet = done;
+        done = done->next;
+        if(packet->done) packet->done(packet);
+    }
+}
+
+// ask device to interrupt once three quarters of what's in flight is done,
+// returns true if it already is, caller holds transmit queue lock
+static bool DelayVirtioNetTransmitInterrupt(VirtioNetDevice* net){
+    Virtqueue* vq = &net->tx->vq;
+    u16 in_flight = vq->size - vq->free_count;
+    if(net->polling || in_flight == 0) return false;
+    return DelayVirtqueueInterrupts(vq, in_flight - in_flight / 4);
+}
+
+static void VirtioNetTransmitInterrupt(void* arg){
+    VirtioNetDevice* net = reinterpret_cast<VirtioNetDevice*>(arg);
+    NetPacket* done = nullptr;
+    {
+        LockGuard guard(net->tx->vq.lock);
+        net->stats.tx_interrupts++;
+        do{
+            ReapVirtioNetTransmit(net, &done);
+        }while(DelayVirtioNetTransmitInterrupt(net));
+    }
+    CompleteVirtioNetPackets(done);
+}
+
+// split a frame into physically contiguous runs, returns number of runs
+// or 0 if too many
+static u32 MapVirtioNetBuffer(u64 buffer, u64 size, VirtqueueBuffer* runs, u32 max_runs){
+    u32 count = 0;
+    while(size){
+        u64 chunk = PAGE_SIZE - (buffer & (PAGE_SIZE - 1));
+        if(chunk > size) chunk = size;
+        u64 phys = KernelVirtualToPhysical(buffer);
+
+        if(count && runs[count - 1].address + runs[count - 1].length == phys){
+            runs[count - 1].length += chunk;
+        }else{
+            if(count == max_runs) return 0;
+            runs[count].address = phys;
+            runs[count].length = chunk;
+            runs[count].device_writable = false;
+            count++;
+        }
+        buffer += chunk;
+        size -= chunk;
+    }
+    return count;
+}
+
+NetPacket* TransmitVirtioNet(VirtioNetDevice* net, NetPacket* packets){
+    Virtqueue* vq = &net->tx->vq;
+    VirtqueueBuffer buffers[VIRTIO_NET_MAX_TX_SEGMENTS + 1];
+    NetPacket* done = nullptr;
+    NetPacket* failed = nullptr;
+    {
+        LockGuard guard(vq->lock);
+        // completions are picked up here instead of waiting for an interrupt
+        ReapVirtioNetTransmit(net, &done);
+
+        while(packets){
+            NetPacket* packet = packets;
+            u32 segments = 0;
+            if(packet->length && packet->length <= VIRTIO_NET_MAX_FRAME_SIZE){
+                segments = MapVirtioNetBuffer(packet->buffer, packet->length, buffers + 1, VIRTIO_NET_MAX_TX_SEGMENTS);
+            }
+            if(segments == 0){
+                packets = packets->next;
+                packet->next = failed;
+                failed = packet;
+                continue;
+            }
+            if(segments + 1 > vq->free_count) break;
+
+            u16 head = vq->free_head;
+            memset(&net->tx_headers[head], 0, sizeof(VirtioNetHeader));
+            buffers[0].address = net->tx_headers_phys + head * sizeof(VirtioNetHeader);
+            buffers[0].length = sizeof(VirtioNetHeader);
+            buffers[0].device_writable = false;
+
+            packets = packets->next;
+            AddVirtqueueBuffers(vq, buffers, segments + 1, packet);
+        }
+        if(KickVirtqueue(vq)) net->stats.tx_kicks++;
+
+        if(DelayVirtioNetTransmitInterrupt(net)){
+            ReapVirtioNetTransmit(net, &done);
+        }
+    }
+
+    CompleteVirtioNetPackets(failed);
+    CompleteVirtioNetPackets(done);
+    return packets;
+}
+
+/******************** DEVICE ********************/
+
+u64 PollVirtioNet(VirtioNetDevice* net){
+    NetPacket* done = nullptr;
+    {
+        LockGuard guard(net->tx->vq.lock);
+        ReapVirtioNetTransmit(net, &done);
+    }
+    u64 count = 0;
+    for(NetPacket* packet = done; packet; packet = packet->next){
+        count++;
+    }
+    CompleteVirtioNetPackets(done);
+    return count + ProcessVirtioNetReceive(net, false);
+}
+
+VirtioNetDevice* GetVirtioNetDevice(u32 index){
+    if(index >= virtio_net_count) return nullptr;
+    return virtio_net_devices[index];
+}
+
+const char* GetVirtioNetName(VirtioNetDevice* net){
+    return net->name;
+}
+
+void GetVirtioNetAddress(VirtioNetDevice* net, u8 mac[6]){
+    memcpy(mac, net->mac, 6);
+}
+
+void SetVirtioNetReceiveHandler(VirtioNetDevice* net, NetReceiveHandler handler, void* arg){
+    LockGuard guard(net->rx->vq.lock);
+    net->handler = handler;
+    net->handler_arg = arg;
+}
+
+void GetVirtioNetStatistics(VirtioNetDevice* net, NetStatistics* stats){
+    {
+        LockGuard guard(net->rx->vq.lock);
+        stats->rx_packets = net->stats.rx_packets;
+        stats->rx_bytes = net->stats.rx_bytes;
+        stats->rx_merged = net->stats.rx_merged;
+        stats->rx_dropped = net->stats.rx_dropped;
+        stats->rx_kicks = net->stats.rx_kicks;
+        stats->rx_interrupts = net->stats.rx_interrupts;
+    }
+    LockGuard guard(net->tx->vq.lock);
+    stats->tx_packets = net->stats.tx_packets;
+    stats->tx_bytes = net->stats.tx_bytes;
+    stats->tx_kicks = net->stats.tx_kicks;
+    stats->tx_interrupts = net->stats.tx_interrupts;
+}
+
+static VirtioNetQueue* SetupVirtioNetQueue(VirtioNetDevice* net, u16 index, u16 vector){
+    VirtioNetQueue* queue = new (SlabAllocate(&virtio_net_queue_cache)) VirtioNetQueue();
+    if(!SetupVirtqueue(&net->virtio, &queue->vq, index, VIRTQUEUE_MAX_SIZE, vector)){
+        SlabFree(&virtio_net_queue_cache, queue);
+        return nullptr;
+    }
+    return queue;
+}
+
+// undo a probe that failed part way, device has never been started
+static bool FailVirtioNet(VirtioNetDevice* net){
+    FailVirtioDevice(&net->virtio);
+    DisablePCIInterrupts(&net->virtio.irq);
+    VirtioNetQueue* queues[2] = {net->rx, net->tx};
+    for(u32 i = 0; i < 2; i++){
+        if(queues[i] == nullptr) continue;
+        FreeVirtqueue(&queues[i]->vq);
+        SlabFree(&virtio_net_queue_cache, queues[i]);
+    }
+    SlabFree(&virtio_net_cache, net);
+    return false;
+}
+
+static bool ProbeVirtioNet(PCIDevice* pci, const PCIDeviceID*){
+    if(virtio_net_count == VIRTIO_NET_MAX_DEVICES) return false;
+
+    VirtioNetDevice* net = new (SlabAllocate(&virtio_net_cache)) VirtioNetDevice();
+    VirtioDevice* virtio = &net->virtio;
+    if(!InitializeVirtioDevice(virtio, pci)) return FailVirtioNet(net);
+
+    u64 wanted = (u64(1) << VIRTIO_NET_F_MAC) | (u64(1) << VIRTIO_NET_F_MRG_RXBUF) |
+                 (u64(1) << VIRTIO_F_RING_EVENT_IDX);
+    // receive buffers are smaller than a frame, so they must be mergeable
+    if(!NegotiateVirtioFeatures(virtio, wanted) || !HasVirtioFeature(virtio, VIRTIO_NET_F_MRG_RXBUF) ||
+       GetVirtioQueueCount(virtio) < 2){
+        return FailVirtioNet(net);
+    }
+
+    // one vector for each queue, anything else is polled
+    bool polling_only = false;
+    u32 vectors = EnablePCIInterrupts(&virtio->irq, pci, 2);
+    if(virtio->irq.type != PCI_INTERRUPT_MSIX || vectors < 2){
+        DisablePCIInterrupts(&virtio->irq);
+        polling_only = true;
+    }
+
+    net->rx = SetupVirtioNetQueue(net, VIRTIO_NET_RX_QUEUE, polling_only ? VIRTIO_NO_VECTOR : 0);
+    net->tx = SetupVirtioNetQueue(net, VIRTIO_NET_TX_QUEUE, polling_only ? VIRTIO_NO_VECTOR : 1);
+    if(!net->rx || !net->tx) return FailVirtioNet(net);
+
+    u64 headers = AllocatePage();
+    memset(reinterpret_cast<void*>(headers), 0, PAGE_SIZE);
+    net->tx_headers = reinterpret_cast<VirtioNetHeader*>(headers);
+    net->tx_headers_phys = VirtualToPhysicalAddress(headers);
+
+    sprintf(net->name, "eth%u", virtio_net_count);
+    if(HasVirtioFeature(virtio, VIRTIO_NET_F_MAC)){
+        for(u32 i = 0; i < 6; i++){
+            net->mac[i] = ReadVirtioConfig8(virtio, VIRTIO_NET_CONFIG_MAC + i);
+        }
+    }else{
+        // locally administered address
+        static const u8 local_mac[6] = {0x02, 0x00, 0x00, 0x00, 0x00, 0x00};
+        memcpy(net->mac, local_mac, 6);
+        net->mac[5] = u8(virtio_net_count);
+    }
+    net->polling = polling_only;
+    pci->driver_data = net;
+
+    StartVirtioDevice(virtio);
+    if(polling_only){
+        DisableVirtqueueInterrupts(&net->rx->vq);
+        DisableVirtqueueInterrupts(&net->tx->vq);
+    }else{
+        SetPCIInterruptHandler(&virtio->irq, 0, VirtioNetReceiveInterrupt, net, 0);
+        SetPCIInterruptHandler(&virtio->irq, 1, VirtioNetTransmitInterrupt, net, 1 % GetCPUCount());
+        // nothing is in flight yet
+        DisableVirtqueueInterrupts(&net->tx->vq);
+    }
+
+    {
+        LockGuard guard(net->rx->vq.lock);
+        RefillVirtioNetReceive(net);
+    }
+
+    virtio_net_devices[virtio_net_count++] = net;
+    return true;
+}
+
+static const PCIDeviceID virtio_net_ids[] = {
+    {VIRTIO_PCI_VENDOR_ID, VIRTIO_NET_LEGACY_DEVICE_ID, 0, 0},
+    {VIRTIO_PCI_VENDOR_ID, VIRTIO_PCI_MODERN_DEVICE_BASE + VIRTIO_TYPE_NET, 0, 0}
+};
+
+static PCIDriver virtio_net_driver = {
+    "virtio-net",
+    virtio_net_ids,
+    sizeof(virtio_net_ids) / sizeof(virtio_net_ids[0]),
+    ProbeVirtioNet,
+    nullptr
+};
+
+void InitializeVirtioNet(){
+    RegisterPCIDriver(&virtio_net_driver);
+}
+
+/******************** TRAFFIC GENERATOR ********************/
+
+// frames kept in flight by generator
+#define BENCH_NET_PACKETS 256
+// bytes between frames in generator memory, no frame crosses a page
+#define BENCH_NET_FRAME_STRIDE 2048
+// frames handed to driver at once
+#define BENCH_NET_BATCH 32
+#define BENCH_NET_DURATION_NS 200000000
+// how long to wait for last frames to go out and come in
+#define BENCH_NET_DRAIN_NS 50000000
+// ethertype reserved for local experiments
+#define BENCH_NET_ETHERTYPE 0x88b5
+// smallest frame ethernet allows without FCS
+#define BENCH_NET_MIN_FRAME 60
+
+struct NetGenerator {
+    NetPacket packets[BENCH_NET_PACKETS];
+    // set while packet is with driver, cleared by completion
+    u8 in_flight[BENCH_NET_PACKETS];
+    u64 rx_packets;
+    u64 rx_bytes;
+};
+
+static void NetGeneratorTransmitDone(NetPacket* packet){
+    NetGenerator* generator = reinterpret_cast<NetGenerator*>(packet->arg);
+    __atomic_store_n(&generator->in_flight[packet - generator->packets], 0, __ATOMIC_RELEASE);
+}
+
+static void NetGeneratorReceive(void* arg, const NetFragment* fragments, u32, u32 length){
+    // only count our own frames, peer may have other traffic
+    if(fragments[0].length < 14) return;
+    const u8* frame = fragments[0].data;
+    if(frame[12] != (BENCH_NET_ETHERTYPE >> 8) || frame[13] != (BENCH_NET_ETHERTYPE & 0xff)) return;
+
+    NetGenerator* generator = reinterpret_cast<NetGenerator*>(arg);
+    __atomic_fetch_add(&generator->rx_packets, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&generator->rx_bytes, length, __ATOMIC_RELAXED);
+}
+
+static bool NetGeneratorIdle(NetGenerator* generator){
+    for(u32 i = 0; i < BENCH_NET_PACKETS; i++){
+        if(__atomic_load_n(&generator->in_flight[i], __ATOMIC_ACQUIRE)) return false;
+    }
+    return true;
+}
+
+static void PollNetGenerator(VirtioNetDevice* sender, VirtioNetDevice* receiver){
+    PollVirtioNet(sender);
+    if(receiver != sender) PollVirtioNet(receiver);
+}
+
+static void RunNetGenerator(NetGenerator* generator, u64 frames, VirtioNetDevice* sender,
+                            VirtioNetDevice* receiver, const u8 destination[6], u32 frame_size){
+    for(u32 i = 0; i < BENCH_NET_PACKETS; i++){
+        u8* frame = reinterpret_cast<u8*>(frames + u64(i) * BENCH_NET_FRAME_STRIDE);
+        memset(frame, 0, frame_size);
+        memcpy(frame, destination, 6);
+        GetVirtioNetAddress(sender, frame + 6);
+        frame[12] = BENCH_NET_ETHERTYPE >> 8;
+        frame[13] = BENCH_NET_ETHERTYPE & 0xff;
+
+        NetPacket* packet = &generator->packets[i];
+        packet->buffer = reinterpret_cast<u64>(frame);
+        packet->length = frame_size;
+        packet->done = NetGeneratorTransmitDone;
+        packet->arg = generator;
+        generator->in_flight[i] = 0;
+    }
+    generator->rx_packets = 0;
+    generator->rx_bytes = 0;
+
+    NetStatistics tx_before, rx_before, tx_after, rx_after;
+    GetVirtioNetStatistics(sender, &tx_before);
+    GetVirtioNetStatistics(receiver, &rx_before);
+    SetVirtioNetReceiveHandler(receiver, NetGeneratorReceive, generator);
+
+    u64 start = GetUptimeNanoseconds();
+    u32 next = 0;
+    while(GetUptimeNanoseconds() - start < BENCH_NET_DURATION_NS){
+        // next batch is whatever run of packets driver gave back
+        NetPacket* batch = nullptr;
+        NetPacket** tail = &batch;
+        u32 count = 0;
+        while(count < BENCH_NET_BATCH && !__atomic_load_n(&generator->in_flight[next], __ATOMIC_ACQUIRE)){
+            NetPacket* packet = &generator->packets[next];
+            generator->in_flight[next] = 1;
+            packet->next = nullptr;
+            *tail = packet;
+            tail = &packet->next;
+            next = (next + 1) % BENCH_NET_PACKETS;
+            count++;
+        }
+
+        NetPacket* left = batch ? TransmitVirtioNet(sender, batch) : nullptr;
+        if(left){
+            // queue was full, take them again next time
+            next = u32(left - generator->packets);
+            for(NetPacket* packet = left; packet; packet = packet->next){
+                generator->in_flight[packet - generator->packets] = 0;
+            }
+        }
+        if(left || count == 0){
+            PollNetGenerator(sender, receiver);
+            CPUPause();
+        }
+    }
+
+    // let last frames go out, then give them time to come in
+    u64 drain = GetUptimeNanoseconds();
+    while(!NetGeneratorIdle(generator) && GetUptimeNanoseconds() - drain < BENCH_NET_DRAIN_NS){
+        PollNetGenerator(sender, receiver);
+        CPUPause();
+    }
+    u64 elapsed = GetUptimeNanoseconds() - start;
+    drain = GetUptimeNanoseconds();
+    while(GetUptimeNanoseconds() - drain < BENCH_NET_DRAIN_NS / 5){
+        PollNetGenerator(sender, receiver);
+        CPUPause();
+    }
+
+    SetVirtioNetReceiveHandler(receiver, nullptr, nullptr);
+    // anything still in flight references generator memory
+    while(!NetGeneratorIdle(generator)){
+        PollNetGenerator(sender, receiver);
+        CPUPause();
+    }
+    GetVirtioNetStatistics(sender, &tx_after);
+    GetVirtioNetStatistics(receiver, &rx_after);
+
+    u64 tx_packets = tx_after.tx_packets - tx_before.tx_packets;
+    u64 tx_bytes = tx_after.tx_bytes - tx_before.tx_bytes;
+    u64 rx_packets = __atomic_load_n(&generator->rx_packets, __ATOMIC_RELAXED);
+    u64 rx_bytes = __atomic_load_n(&generator->rx_bytes, __ATOMIC_RELAXED);
+    Printf("\t%u byte frames : tx %lu pps %lu MB/s | rx %lu pps %lu MB/s\n", frame_size,
+           tx_packets * 1000000000 / elapsed, tx_bytes * 1000 / elapsed,
+           rx_packets * 1000000000 / elapsed, rx_bytes * 1000 / elapsed);
+    Printf("\t\t%lu sent, %lu received | %lu tx kicks, %lu tx irqs, %lu rx kicks, %lu rx irqs, %lu merged, %lu dropped\n",
+           tx_packets, rx_packets, tx_after.tx_kicks - tx_before.tx_kicks,
+           tx_after.tx_interrupts - tx_before.tx_interrupts, rx_after.rx_kicks - rx_before.rx_kicks,
+           rx_after.rx_interrupts - rx_before.rx_interrupts, rx_after.rx_merged - rx_before.rx_merged,
+           rx_after.rx_dropped - rx_before.rx_dropped);
+}
+
+void BenchmarkVirtioNet(){
+    ColorPrintf(COLOR_YELLOW, COLOR_BLACK, "[+] Benchmark : Virtio Net\n");
+
+    if(virtio_net_count == 0){
+        Printf("\tNo virtio-net devices\n");
+        return;
+    }
+    static const char* hex_digits = "0123456789abcdef";
+    for(u32 i = 0; i < virtio_net_count; i++){
+        VirtioNetDevice* net = virtio_net_devices[i];
+        // printf has no field width, so address is spelled out here
+        char mac[18];
+        for(u32 j = 0; j < 6; j++){
+            mac[j * 3] = hex_digits[net->mac[j] >> 4];
+            mac[j * 3 + 1] = hex_digits[net->mac[j] & 0xf];
+            mac[j * 3 + 2] = j == 5 ? '\0' : ':';
+        }
+        Printf("\t%s : %s | %s\n", net->name, mac, net->polling ? "polled" : "MSI-X");
+    }
+
+    // two NICs talk to each other, one talks to whoever is on other end
+    VirtioNetDevice* sender = virtio_net_devices[0];
+    VirtioNetDevice* receiver = sender;
+    u8 destination[6] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
+    if(virtio_net_count > 1){
+        receiver = virtio_net_devices[1];
+        GetVirtioNetAddress(receiver, destination);
+        Printf("\tSending from %s to %s\n", sender->name, receiver->name);
+    }else{
+        Printf("\tBroadcasting from %s, receiving from peer\n", sender->name);
+    }
+
+    u64 generator_pages = (sizeof(NetGenerator) + PAGE_SIZE - 1) / PAGE_SIZE;
+    u64 frame_pages = u64(BENCH_NET_PACKETS) * BENCH_NET_FRAME_STRIDE / PAGE_SIZE;
+    NetGenerator* generator = reinterpret_cast<NetGenerator*>(AllocateKernelMemory(generator_pages));
+    u64 frames = AllocateKernelMemory(frame_pages);
+    if(!generator || !frames){
+        Printf("\tOut of memory\n");
+        if(generator) FreeKernelMemory(reinterpret_cast<u64>(generator), generator_pages);
+        if(frames) FreeKernelMemory(frames, frame_pages);
+        return;
+    }
+
+    static const u32 frame_sizes[] = {BENCH_NET_MIN_FRAME, 512, VIRTIO_NET_MAX_FRAME_SIZE};
+    for(u32 i = 0; i < sizeof(frame_sizes) / sizeof(frame_sizes[0]); i++){
+        RunNetGenerator(generator, frames, sender, receiver, destination, frame_sizes[i]);
+    }
+
+    FreeKernelMemory(frames, frame_pages);
+    FreeKernelMemory(reinterpret_cast<u64>(generator), generator_pages);
+}
@@ -0,0 +1,181 @@
+/**
+ * @file VirtioNet.hpp
+ * @author Siddharth Mishra (brightprogrammer)
+ * @date 10/18/26
+ * @brief virtio-net driver, zero copy receive and transmit.
+ * @copyright MIT License 2022 Siddharth Mishra
+ * */
+
+#ifndef VIRTIO_NET_HPP
+#define VIRTIO_NET_HPP
+
+#include "Common.hpp"
+
+/* ------------------ VIRTIO NET --------------------
+ *
+ * One receive and one transmit queue per device.
+ *
+ * Receive queue is kept full of packet buffers, a quarter page each, taken
+ * from packet buffer pool. Device merges as many of them as a frame needs
+ * (VIRTIO_NET_F_MRG_RXBUF), small frames take one buffer and full sized
+ * frames two. Receive handler of device gets frame as list of fragments
+ * pointing into those buffers, nothing is copied, and buffers go back to
+ * pool and ring once handler returns.
+ *
+ * A transmitted frame is a chain of a header, from a per queue page indexed
+ * by head descriptor like virtio-blk, and caller's buffer. Caller gets it's
+ * buffer back through completion callback of packet. Completions are
+ * reaped lazily by next transmit, and device is asked, through event index,
+ * to interrupt only once three quarters of what's in flight is done.
+ * Receive interrupts are off while a batch is being processed. Kicks of
+ * both queues are sent only when device asks for them.
+ *
+ * Devices without MSI-X are driven by polling (see PollVirtioNet).
+ *
+ * Nothing outside kernel is needed to test it. Two NICs of one guest can be
+ * connected with
+ *
+ *   -netdev hubport,id=n0,hubid=0 -device virtio-net-pci,netdev=n0
+ *   -netdev hubport,id=n1,hubid=0 -device virtio-net-pci,netdev=n1
+ *
+ * or two guests, each with one NIC, with
+ *
+ *   -netdev socket,id=n0,listen=127.0.0.1:5555 -device virtio-net-pci,netdev=n0
+ *   -netdev socket,id=n0,connect=127.0.0.1:5555 -device virtio-net-pci,netdev=n0
+ *
+ * BenchmarkVirtioNet sends from first NIC to second when there are two,
+ * and broadcasts while counting what peer sends when there is one.
+ *
+ * */
+
+// size of a buffer in packet buffer pool
+#define VIRTIO_NET_BUFFER_SIZE 1024
+// most buffers a received frame may be merged from
+#define VIRTIO_NET_MAX_FRAGMENTS 8
+// ethernet frame without FCS, largest frame that can be sent
+#define VIRTIO_NET_MAX_FRAME_SIZE 1514
+// most receive buffers processed in one go
+#define VIRTIO_NET_RX_BUDGET 64
+// max number of devices driver takes
+#define VIRTIO_NET_MAX_DEVICES 8
+
+struct VirtioNetDevice;
+struct NetPacket;
+
+/**
+ * @brief Part of a received frame, in a packet buffer.
+ * */
+struct NetFragment {
+    const u8* data;
+    u32 length;
+};
+
+/**
+ * @brief Called for every received frame, outside of queue lock, maybe
+ * in interrupt context. Fragments are valid only until it returns.
+ *
+ * @param length Total length of frame.
+ * */
+typedef void (*NetReceiveHandler)(void* arg, const NetFragment* fragments, u32 count, u32 length);
+
+/**
+ * @brief Called once device is done with buffer of a packet.
+ * */
+typedef void (*NetTransmitDone)(NetPacket* packet);
+
+/**
+ * @brief A frame to transmit. Caller owns both packet and it's buffer
+ * until done is called.
+ * */
+struct NetPacket {
+    // kernel virtual address of frame, starting with ethernet header
+    u64 buffer;
+    u32 length;
+    NetTransmitDone done;
+    void* arg;
+    // next packet in a batch
+    NetPacket* next;
+};
+
+/**
+ * @brief Counters of a device.
+ * */
+struct NetStatistics {
+    u64 rx_packets;
+    u64 rx_bytes;
+    // frames device merged from more than one buffer
+    u64 rx_merged;
+    // frames thrown away for being malformed or too large
+    u64 rx_dropped;
+    u64 tx_packets;
+    u64 tx_bytes;
+    // notifications actually sent to device
+    u64 rx_kicks;
+    u64 tx_kicks;
+    u64 rx_interrupts;
+    u64 tx_interrupts;
+};
+
+/**
+ * @brief Register virtio-net driver and probe every virtio-net device on PCI bus.
+ * */
+void InitializeVirtioNet();
+
+/**
+ * @brief Take a VIRTIO_NET_BUFFER_SIZE buffer from packet buffer pool.
+ * Buffer never crosses a page boundary.
+ * */
+u8* AllocatePacketBuffer();
+
+/**
+ * @brief Give a buffer back to packet buffer pool.
+ * */
+void FreePacketBuffer(u8* buffer);
+
+/**
+ * @brief Get a probed device.
+ *
+ * @return nullptr if there aren't that many devices.
+ * */
+VirtioNetDevice* GetVirtioNetDevice(u32 index);
+
+/**
+ * @brief Get name (eth0, eth1...) and MAC address of a device.
+ * */
+const char* GetVirtioNetName(VirtioNetDevice* device);
+void GetVirtioNetAddress(VirtioNetDevice* device, u8 mac[6]);
+
+/**
+ * @brief Set function called for every received frame, nullptr drops frames.
+ * */
+void SetVirtioNetReceiveHandler(VirtioNetDevice* device, NetReceiveHandler handler, void* arg);
+
+/**
+ * @brief Queue a batch of packets for transmission, under one notification.
+ *
+ * @return Packets not queued because transmit queue was full, or nullptr.
+ * Packets that can never be sent (empty or too large) are completed with
+ * their done callback instead of being returned.
+ * */
+NetPacket* TransmitVirtioNet(VirtioNetDevice* device, NetPacket* packets);
+
+/**
+ * @brief Reap both queues of device, calling completion callbacks and
+ * receive handler.
+ *
+ * @return Number of transmitted and received frames reaped.
+ * */
+u64 PollVirtioNet(VirtioNetDevice* device);
+
+/**
+ * @brief Get counters of a device.
+ * */
+void GetVirtioNetStatistics(VirtioNetDevice* device, NetStatistics* stats);
+
+/**
+ * @brief Run in kernel traffic generator over virtio-net devices and report
+ * packets and bytes per second sent and received, for a few frame sizes.
+ * */
+void BenchmarkVirtioNet();
+
+#endif // VIRTIO_NET_HPP
@@ -0,0 +1,310 @@
+/**
+ * @file Writeback.cpp
+ * @author Siddharth Mishra (brightprogrammer)
+ * @date 10/18/26
+ * @brief Writeback threads of block devices, and throttling of writers.
+ * @copyright MIT License 2022 Siddharth Mishra
+ * */
+
+#include "Writeback.hpp"
+#include "Block.hpp"
+#include "BufferCache.hpp"
+#include "PageCache.hpp"
+#include "VFS.hpp"
+#include "FAT32.hpp"
+#include "Spinlock.hpp"
+#include "Thread.hpp"
+#include "Scheduler.hpp"
+#include "MemoryManager.hpp"
+#include "CPU.hpp"
+#include "Timer.hpp"
+#include "Printf.hpp"
+#include "String.hpp"
+
+// bandwidth assumed until a device has written anything
+#define WRITEBACK_INITIAL_BANDWIDTH (u64(100) * MB)
+// longest thread name, "wb-" and name of device
+#define WRITEBACK_NAME_SIZE (BLOCK_DEVICE_NAME_SIZE + 3)
+
+struct DeviceWriteback {
+    TicketLock<> lock;
+    BlockDevice* device;
+    Thread* thread;
+    // something got dirty since thread last looked
+    bool pending;
+    bool sleeping;
+    char name[WRITEBACK_NAME_SIZE];
+
+    volatile u64 written_bytes;
+    volatile u64 bandwidth;
+    volatile u64 throttled;
+    volatile u64 throttled_ns;
+
+    constexpr DeviceWriteback()
+        : lock("writeback"), device(nullptr), thread(nullptr), pending(false), sleeping(false),
+          name(), written_bytes(0), bandwidth(0), throttled(0), throttled_ns(0) {}
+};
+
+static DeviceWriteback writebacks[MAX_BLOCK_DEVICES];
+static u64 writeback_count = 0;
+// set with SetDirtyLimits, 0 for fractions of buffer cache
+static u64 background_override = 0;
+static u64 limit_override = 0;
+
+static DeviceWriteback* FindWriteback(BlockDevice* device){
+    u64 count = __atomic_load_n(&writeback_count, __ATOMIC_ACQUIRE);
+    for(u64 i = 0; i < count; i++){
+        if(writebacks[i].device == device) return &writebacks[i];
+    }
+    return nullptr;
+}
+
+static void GetDirtyLimits(u64* background, u64* limit){
+    u64 memory = GetBufferCacheCapacity() * BUFFER_SIZE;
+    *background = background_override ? background_override : memory / WRITEBACK_BACKGROUND_RATIO;
+    *limit = limit_override ? limit_override : memory / WRITEBACK_LIMIT_RATIO;
+    if(*limit <= *background) *limit = *background + BUFFER_SIZE;
+}
+
+u64 GetDirtyBytes(){
+    return GetDirtyBufferCount() * BUFFER_SIZE + GetPageCacheDirtyPages() * PAGE_SIZE;
+}
+
+void SetDirtyLimits(u64 background_bytes, u64 limit_bytes){
+    background_override = background_bytes;
+    limit_override = limit_bytes;
+}
+
+void WakeWriteback(BlockDevice* device){
+    DeviceWriteback* wb = FindWriteback(device);
+    if(wb == nullptr) return;
+
+    // waking under lock, thread woken by it's timer instead takes lock
+    // before doing anything else, so no stale wakeup reaches it later
+    LockGuard guard(wb->lock);
+    wb->pending = true;
+    if(wb->sleeping && wb->thread){
+        wb->sleeping = false;
+        WakeThread(wb->thread);
+    }
+}
+
+// smooth bandwidth over batches, a single slow batch doesn't throttle writers much
+static void UpdateBandwidth(DeviceWriteback* wb, u64 bytes, u64 ns){
+    if(ns == 0) ns = 1;
+    u64 sample = bytes * 1000000000 / ns;
+    u64 bandwidth = wb->bandwidth;
+    wb->bandwidth = bandwidth ? (bandwidth * 7 + sample) / 8 : sample;
+    wb->written_bytes += bytes;
+}
+
+// one pass over device, returns uptime at which thread should look again,
+// now if it wrote something and 0 once nothing on device is dirty
+static u64 WriteBackDevice(DeviceWriteback* wb){
+    BlockDevice* device = wb->device;
+    u64 background, limit;
+    GetDirtyLimits(&background, &limit);
+    bool pressure = GetDirtyBytes() > background;
+
+    // page caches first, what they write becomes dirty buffers of device
+    u64 now = GetUptimeNanoseconds();
+    u64 oldest_cache = 0;
+    u64 pages = 0;
+    if(HasDirtyPageCaches()) pages = WriteBackVFS(device, pressure ? now : now - BUFFER_WRITEBACK_AGE_NS, &oldest_cache);
+
+    u64 start = GetUptimeNanoseconds();
+    u64 buffers = WriteBackBufferCache(device, pressure);
+    if(buffers) UpdateBandwidth(wb, buffers * BUFFER_SIZE, GetUptimeNanoseconds() - start);
+    if(pages || buffers) return start;
+
+    // nothing old enough yet, look again when oldest of it is, and no
+    // sooner than next tick when what is old enough couldn't be written
+    u64 oldest = GetOldestDirtyBuffer(device);
+    if(oldest_cache && (oldest == 0 || oldest_cache < oldest)) oldest = oldest_cache;
+    if(oldest == 0) return 0;
+    u64 deadline = oldest + BUFFER_WRITEBACK_AGE_NS;
+    return deadline > start ? deadline : start + 1;
+}
+
+static void WritebackThread(void* arg){
+    DeviceWriteback* wb = reinterpret_cast<DeviceWriteback*>(arg);
+    {
+        LockGuard guard(wb->lock);
+        wb->thread = GetCurrentThread();
+    }
+
+    // when to look at device again without being woken, 0 for never
+    u64 deadline = 0;
+    while(true){
+        u64 flags = SaveFlagsAndDisableInterrupts();
+        wb->lock.Lock();
+        bool sleep = !wb->pending && (deadline == 0 || GetUptimeNanoseconds() < deadline);
+        wb->pending = false;
+        if(sleep){
+            wb->sleeping = true;
+            __atomic_store_n(&GetCurrentThread()->state, ThreadState::Blocked, __ATOMIC_RELEASE);
+        }
+        wb->lock.Unlock();
+
+        // WakeWriteback wakes us, or timer once deadline has passed
+        if(sleep){
+            if(deadline) BlockCurrentThreadUntil(deadline);
+            else Schedule();
+        }
+        RestoreFlags(flags);
+        if(sleep){
+            // woken by timer, WakeWriteback didn't clear it
+            LockGuard guard(wb->lock);
+            wb->sleeping = false;
+            continue;
+        }
+
+        do{
+            deadline = WriteBackDevice(wb);
+        }while(deadline && deadline <= GetUptimeNanoseconds());
+    }
+}
+
+void BalanceDirtyMemory(BlockDevice* device, u64 bytes){
+    u64 background, limit;
+    GetDirtyLimits(&background, &limit);
+    u64 dirty = GetDirtyBytes();
+    if(dirty <= background) return;
+
+    DeviceWriteback* wb = FindWriteback(device);
+    if(wb == nullptr) return;
+    WakeWriteback(device);
+
+    // time device takes to write what caller dirtied, scaled by how far
+    // dirty memory is between background threshold and limit, in 1/1024ths
+    u64 pause = WRITEBACK_MAX_PAUSE_NS;
+    if(dirty < limit){
+        u64 bandwidth = wb->bandwidth ? wb->bandwidth : WRITEBACK_INITIAL_BANDWIDTH;
+        u64 position = (dirty - background) * 1024 / (limit - background);
+        pause = bytes * 1000000000 / bandwidth * position / 1024;
+        if(pause > WRITEBACK_MAX_PAUSE_NS) pause = WRITEBACK_MAX_PAUSE_NS;
+    }
+    if(pause == 0) return;
+
+    u64 start = GetUptimeNanoseconds();
+    u64 flags = SaveFlagsAndDisableInterrupts();
+    __atomic_store_n(&GetCurrentThread()->state, ThreadState::Blocked, __ATOMIC_RELEASE);
+    BlockCurrentThreadUntil(start + pause);
+    RestoreFlags(flags);
+    u64 elapsed = GetUptimeNanoseconds() - start;
+    __atomic_fetch_add(&wb->throttled, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&wb->throttled_ns, elapsed, __ATOMIC_RELAXED);
+}
+
+bool GetWritebackStatistics(BlockDevice* device, WritebackStatistics* stats){
+    DeviceWriteback* wb = FindWriteback(device);
+    if(wb == nullptr) return false;
+
+    stats->dirty_bytes = GetDirtyBytes();
+    GetDirtyLimits(&stats->background_bytes, &stats->limit_bytes);
+    stats->written_bytes = wb->written_bytes;
+    stats->bandwidth = wb->bandwidth;
+    stats->throttled = wb->throttled;
+    stats->throttled_ns = wb->throttled_ns;
+    return true;
+}
+
+void ShowWritebackStatistics(){
+    ColorPrintf(COLOR_YELLOW, COLOR_BLACK, "[+] Writeback Stats : \n");
+    u64 background, limit;
+    GetDirtyLimits(&background, &limit);
+    Printf("\tDirty : %lu KB | background %lu KB | limit %lu KB\n",
+           GetDirtyBytes() / KB, background / KB, limit / KB);
+
+    for(u64 i = 0; i < writeback_count; i++){
+        DeviceWriteback* wb = &writebacks[i];
+        Printf("\t%s : %lu KB written | %lu MB/s | %lu pauses, %lu ms\n", wb->device->name,
+               wb->written_bytes / KB, wb->bandwidth / MB, wb->throttled, wb->throttled_ns / 1000000);
+    }
+}
+
+void InitializeWriteback(){
+    for(u64 i = 0; i < GetBlockDeviceCount(); i++){
+        BlockDevice* device = GetBlockDevice(i);
+        if(device->read_only) continue;
+
+        DeviceWriteback* wb = &writebacks[writeback_count];
+        wb->device = device;
+        // anything dirtied before thread existed is looked at right away
+        wb->pending = true;
+        sprintf(wb->name, "wb-%s", device->name);
+        __atomic_store_n(&writeback_count, writeback_count + 1, __ATOMIC_RELEASE);
+        SpawnThread(wb->name, WritebackThread, wb);
+    }
+}
+
+/******************** Writeback Benchmark ********************/
+
+#define BENCH_WRITEBACK_FILE_SIZE (u64(16) * MB)
+#define BENCH_WRITEBACK_CHUNK (u64(64) * KB)
+// low limits, so that writer goes past them
+#define BENCH_WRITEBACK_BACKGROUND (u64(1) * MB)
+#define BENCH_WRITEBACK_LIMIT (u64(2) * MB)
+
+// write a file and sync it, reporting what writer saw
+static void RunWritebackBenchmark(const char* name, BlockDevice* device, void* chunk){
+    WritebackStatistics before, after;
+    GetWritebackStatistics(device, &before);
+
+    File* file = VFSOpen("/scratch/writeback", VFS_OPEN_WRITE | VFS_OPEN_CREATE | VFS_OPEN_TRUNCATE);
+    if(file == nullptr){
+        Printf("\t%s : failed to create file\n", name);
+        return;
+    }
+    u64 written = 0;
+    u64 peak = 0;
+    u64 start = GetUptimeNanoseconds();
+    while(written < BENCH_WRITEBACK_FILE_SIZE){
+        u64 count = VFSWrite(file, chunk, BENCH_WRITEBACK_CHUNK);
+        if(count == 0 || count == VFS_ERROR) break;
+        written += count;
+        u64 dirty = GetDirtyBytes();
+        if(dirty > peak) peak = dirty;
+    }
+    u64 write_ns = GetUptimeNanoseconds() - start;
+    VFSClose(file);
+
+    start = GetUptimeNanoseconds();
+    bool synced = SyncVFS();
+    u64 sync_ns = GetUptimeNanoseconds() - start;
+    GetWritebackStatistics(device, &after);
+
+    if(write_ns == 0) write_ns = 1;
+    Printf("\t%s (%lu KB / %lu KB) : %lu MB/s writes | peak dirty %lu KB | sync %lu ms%s\n", name,
+           after.background_bytes / KB, after.limit_bytes / KB, written * 1000 / write_ns,
+           peak / KB, sync_ns / 1000000, synced ? "" : " | errors");
+    Printf("\t\t%lu pauses, %lu ms | %lu KB by writeback thread at %lu MB/s\n",
+           after.throttled - before.throttled, (after.throttled_ns - before.throttled_ns) / 1000000,
+           (after.written_bytes - before.written_bytes) / KB, after.bandwidth / MB);
+}
+
+void BenchmarkWriteback(){
+    ColorPrintf(COLOR_YELLOW, COLOR_BLACK, "[+] Benchmark : Writeback\n");
+
+    BlockDevice* device = FindBlockDevice("nvme0n1");
+    FAT32Volume* volume = device && FormatFAT32(device) ? MountFAT32(device) : nullptr;
+    // earlier benchmarks may have made mountpoint already
+    VFSMakeDirectory("/scratch");
+    if(volume == nullptr || !VFSMountFAT32("/scratch", volume)){
+        if(volume) UnmountFAT32(volume);
+        Printf("\tNo scratch disk\n");
+        return;
+    }
+    u64 chunk_pages = BENCH_WRITEBACK_CHUNK / PAGE_SIZE;
+    void* chunk = reinterpret_cast<void*>(AllocateKernelMemory(chunk_pages));
+    memset(chunk, 0x3c, BENCH_WRITEBACK_CHUNK);
+
+    RunWritebackBenchmark("Default limits", device, chunk);
+    SetDirtyLimits(BENCH_WRITEBACK_BACKGROUND, BENCH_WRITEBACK_LIMIT);
+    RunWritebackBenchmark("Low limits", device, chunk);
+    SetDirtyLimits(0, 0);
+
+    FreeKernelMemory(reinterpret_cast<u64>(chunk), chunk_pages);
+    if(!VFSUnmount("/scratch")) Printf("\tFailed to unmount scratch disk\n");
+    ShowWritebackStatistics();
+}
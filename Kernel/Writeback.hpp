@@ -0,0 +1,121 @@
+/**
+ * @file Writeback.hpp
+ * @author Siddharth Mishra (brightprogrammer)
+ * @date 10/18/26
+ * @brief Writeback threads of block devices, and throttling of writers.
+ * @copyright MIT License 2022 Siddharth Mishra
+ * */
+
+#ifndef WRITEBACK_HPP
+#define WRITEBACK_HPP
+
+#include "Common.hpp"
+
+struct BlockDevice;
+
+/* ------------------ WRITEBACK --------------------
+ *
+ * Every writable block device has a writeback thread. It sleeps until
+ * something on it's device gets dirty, then writes back, oldest first :
+ *
+ *  - page caches of files on device that have been dirty (through shared
+ *    mappings or splice) for BUFFER_WRITEBACK_AGE_NS. This only moves
+ *    pages into filesystem, which makes them dirty buffers of device.
+ *  - dirty buffers of device that are that old.
+ *
+ * Once dirty memory, buffers and tagged page cache pages of all devices,
+ * goes past background threshold, age doesn't matter anymore and threads
+ * write until it's back under it. When what is dirty isn't old enough yet,
+ * thread sleeps until the oldest of it is, at resolution of timer tick
+ * (see BlockCurrentThreadUntil), and once nothing on it's device is dirty
+ * it sleeps until something gets dirty again.
+ *
+ * Writers are throttled in VFSWrite, with no locks held. Past background
+ * threshold, a writer pauses for as long as it's device takes to write
+ * what it just dirtied, scaled by how far dirty memory has got from
+ * background threshold to dirty limit, so writers slow down gradually
+ * as dirty memory grows, to bandwidth of device at the limit. Past limit
+ * every write pauses for WRITEBACK_MAX_PAUSE_NS. Writer sleeps through
+ * it's pause instead of spinning. A pause never waits for
+ * writeback to finish, so no writer stalls behind one big flush.
+ *
+ * Bandwidth of a device is measured from batches it's thread writes.
+ *
+ * */
+
+// dirty memory, as a fraction of buffer cache, past which writeback
+// doesn't wait for age and writers start to be throttled
+#define WRITEBACK_BACKGROUND_RATIO 4
+// dirty memory, as a fraction of buffer cache, at which writers are
+// throttled to bandwidth of device
+#define WRITEBACK_LIMIT_RATIO 2
+// longest a single write is paused
+#define WRITEBACK_MAX_PAUSE_NS 10000000
+
+/**
+ * @brief Counters of writeback of a device.
+ * */
+struct WritebackStatistics {
+    // dirty buffers and page cache pages of all devices
+    u64 dirty_bytes;
+    u64 background_bytes;
+    u64 limit_bytes;
+    // written to device by it's writeback thread
+    u64 written_bytes;
+    // bytes per second writeback thread gets to device, smoothed
+    u64 bandwidth;
+    // writes that paused and total time spent in pauses
+    u64 throttled;
+    u64 throttled_ns;
+};
+
+/**
+ * @brief Start a writeback thread for every writable block device.
+ * Scheduler must be running.
+ * */
+void InitializeWriteback();
+
+/**
+ * @brief Tell writeback thread of a device that something on it got dirty.
+ * Cheap if thread is already awake.
+ * */
+void WakeWriteback(BlockDevice* device);
+
+/**
+ * @brief Called by writers after dirtying memory that belongs on a device,
+ * pauses caller if too much memory is dirty.
+ *
+ * @param bytes Bytes caller just dirtied.
+ * */
+void BalanceDirtyMemory(BlockDevice* device, u64 bytes);
+
+/**
+ * @brief Bytes of dirty buffers and page cache pages over all devices.
+ * */
+u64 GetDirtyBytes();
+
+/**
+ * @brief Override background threshold and dirty limit, in bytes.
+ * Passing zeros goes back to fractions of buffer cache.
+ * */
+void SetDirtyLimits(u64 background_bytes, u64 limit_bytes);
+
+/**
+ * @brief Get writeback counters of a device.
+ *
+ * @return false if device has no writeback thread.
+ * */
+bool GetWritebackStatistics(BlockDevice* device, WritebackStatistics* stats);
+
+/**
+ * @brief Print writeback counters of every device.
+ * */
+void ShowWritebackStatistics();
+
+/**
+ * @brief Write a large file on scratch disk with default and with low
+ * dirty limits, reporting write rate, peak dirty memory and throttling.
+ * */
+void BenchmarkWriteback();
+
+#endif // WRITEBACK_HPP
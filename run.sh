@@ -1,10 +1,21 @@
 #!/usr/bin/env bash
 
 ./build.sh
+# scratch disk for NVMe benchmark, it's written to
+[ -f nvme.img ] || truncate -s 256M nvme.img
+# two NICs on one hub, network benchmark sends from first to second
 qemu-system-x86_64           \
-    moss.hdd                 \
+    -drive file=moss.hdd,if=none,id=hdd,format=raw \
+    -device virtio-blk-pci,drive=hdd,num-queues=4,bootindex=0 \
+    -drive file=nvme.img,if=none,id=nvm,format=raw \
+    -device nvme,serial=moss,drive=nvm \
+    -netdev hubport,hubid=0,id=n0 \
+    -device virtio-net-pci,netdev=n0 \
+    -netdev hubport,hubid=0,id=n1 \
+    -device virtio-net-pci,netdev=n1 \
     -cpu core2duo            \
     -m 512M                  \
+    -smp 4                   \
     -no-reboot               \
     -no-shutdown             \
     -M smm=off               \